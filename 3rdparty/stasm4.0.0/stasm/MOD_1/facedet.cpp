@@ -202,6 +202,23 @@ void FaceDet::DetectFaces_(  // call once per image to find all the faces
     iface_ = 0; // next invocation of NextFace_ must get first face
 }
 
+// Make facerect the only face in the image, so NextFace_ returns it without
+// running the face detector.  Useful when the caller already detected the face.
+
+void FaceDet::SetFace_(
+    const cv::Rect& facerect) // in
+{
+    DetPar detpar; // detpar constructor sets all fields INVALID
+    detpar.x = facerect.x + facerect.width / 2.;
+    detpar.y = facerect.y + facerect.height / 2.;
+    detpar.width  = double(facerect.width);
+    detpar.height = double(facerect.height);
+    detpar.yaw = 0; // assume face has no yaw in this version of Stasm
+    detpar.eyaw = EYAW00;
+    detpars_.assign(1, detpar);
+    iface_ = 0;
+}
+
 // Get the (next) face from the image.
 // If no face available, return detpar.x INVALID.
 // Eyes, mouth, and rot in detpar always returned INVALID.
@@ -36,6 +36,9 @@ public:
 
     const DetPar NextFace_(void); // get next face from faces found by DetectFaces_
 
+    void SetFace_(                // use a face found elsewhere instead of DetectFaces_
+        const cv::Rect& facerect); // in: the face rectangle in image coords
+
     FaceDet() {}                  // constructor
 
 
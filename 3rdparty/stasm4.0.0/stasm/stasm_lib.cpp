@@ -53,6 +53,45 @@ static const Shape LandmarksAsShape( // return a Shape
     return shape;
 }
 
+static void SearchNextFace(  // ASM search of the next face in facedet
+    int*         foundface,  // out: 0=no more faces, 1=found face
+    float*       landmarks,  // out: x0, y0, x1, y1, ..., caller must allocate
+    float*       estyaw,     // out: NULL or pointer to estimated yaw
+    const Image& img,        // in
+    FaceDet&     facedet,    // io
+    StasmCascadeClassifier cascade)
+{
+    Shape shape;       // the shape with landmarks
+    Image face_roi;    // cropped to area around startshape and possibly rotated
+    DetPar detpar_roi; // detpar translated to ROI frame
+    DetPar detpar;     // params returned by face det, in img frame
+
+    // Get the start shape for the next face in the image, and the ROI around it.
+    // The shape will be wrt the ROI frame.
+    if (NextStartShapeAndRoi(shape, face_roi, detpar_roi, detpar,
+                             img, mods_g, facedet, cascade))
+    {
+        // now working with maybe flipped ROI and start shape in ROI frame
+        *foundface = 1;
+        if (trace_g)   // show start shape?
+            LogShape(RoiShapeToImgFrame(shape, face_roi, detpar_roi, detpar),
+                     "auto_start");
+
+        // select an ASM model based on the face's yaw
+        const int imod = ABS(EyawAsModIndex(detpar.eyaw, mods_g));
+
+        // do the actual ASM search
+        shape = mods_g[imod]->ModSearch_(shape, face_roi);
+
+        shape = RoiShapeToImgFrame(shape, face_roi, detpar_roi, detpar);
+        // now working with non flipped start shape in image frame
+        RoundMat(shape);
+        ShapeToLandmarks(landmarks, shape);
+        if (estyaw)
+            *estyaw = float(detpar.yaw);
+    }
+}
+
 } // namespace stasm
 
 //-----------------------------------------------------------------------------
@@ -168,11 +207,6 @@ int stasm_search_auto_ext( // extended version of stasm_search_auto
     {
         CheckStasmInit();
 
-        Shape shape;       // the shape with landmarks
-        Image face_roi;    // cropped to area around startshape and possibly rotated
-        DetPar detpar_roi; // detpar translated to ROI frame
-        DetPar detpar;     // params returned by face det, in img frame
-
         // Allocate image
         Image img = Image(height, width,(unsigned char*)data);
 
@@ -181,30 +215,40 @@ int stasm_search_auto_ext( // extended version of stasm_search_auto
         // call the face detector to detect the face rectangle(s)
         facedet.DetectFaces_(img, NULL, false, 10, NULL, cascade.faceCascade);
 
-        // Get the start shape for the next face in the image, and the ROI around it.
-        // The shape will be wrt the ROI frame.
-        if (NextStartShapeAndRoi(shape, face_roi, detpar_roi, detpar,
-                                 img, mods_g, facedet, cascade))
-        {
-            // now working with maybe flipped ROI and start shape in ROI frame
-            *foundface = 1;
-            if (trace_g)   // show start shape?
-                LogShape(RoiShapeToImgFrame(shape, face_roi, detpar_roi, detpar),
-                         "auto_start");
-
-            // select an ASM model based on the face's yaw
-            const int imod = ABS(EyawAsModIndex(detpar.eyaw, mods_g));
-
-            // do the actual ASM search
-            shape = mods_g[imod]->ModSearch_(shape, face_roi);
-
-            shape = RoiShapeToImgFrame(shape, face_roi, detpar_roi, detpar);
-            // now working with non flipped start shape in image frame
-            RoundMat(shape);
-            ShapeToLandmarks(landmarks, shape);
-            if (estyaw)
-                *estyaw = float(detpar.yaw);
-        }
+        SearchNextFace(foundface, landmarks, estyaw, img, facedet, cascade);
+    }
+    catch(...)
+    {
+        returnval = 0; // a call was made to Err or a CV_Assert failed
+    }
+    return returnval;
+}
+
+int stasm_search_rect(     // like stasm_search_auto, but no OpenCV face detect
+    int*   foundface,      // out: 0=no face, 1=found face
+    float* landmarks,      // out: x0, y0, x1, y1, ..., caller must allocate
+    const char* data,
+    const int width,
+    const int height,
+    const int facex,
+    const int facey,
+    const int facewidth,
+    const int faceheight,
+    StasmCascadeClassifier cascade)
+{
+    int returnval = 1;     // assume success
+    *foundface = 0;        // but assume no face found
+    try
+    {
+        CheckStasmInit();
+
+        Image img = Image(height, width,(unsigned char*)data);
+
+        // the caller's face rect stands in for the face detector
+        FaceDet facedet;
+        facedet.SetFace_(cv::Rect(facex, facey, facewidth, faceheight));
+
+        SearchNextFace(foundface, landmarks, NULL, img, facedet, cascade);
     }
     catch(...)
     {
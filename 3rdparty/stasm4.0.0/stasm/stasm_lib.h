@@ -91,6 +91,19 @@ int stasm_search_auto(       // call repeatedly to find all faces
     const int    height,
     StasmCascadeClassifier cascade);
 
+extern "C"                   // like stasm_search_auto, but no OpenCV face detect
+int stasm_search_rect(       // search the face in the given rect, e.g. from another detector
+    int*         foundface,  // out: 0=no face, 1=found face
+    float*       landmarks,  // out: x0, y0, x1, y1, ..., caller must allocate
+    const char*  data,       // in: gray image data, top left corner at 0,0
+    const int    width,      // in: image width
+    const int    height,     // in: image height
+    const int    facex,      // in: left of the face rect
+    const int    facey,      // in: top of the face rect
+    const int    facewidth,  // in: width of the face rect
+    const int    faceheight, // in: height of the face rect
+    StasmCascadeClassifier cascade);
+
 extern "C"
 int stasm_search_single(     // wrapper for stasm_search_auto and friends
     int*         foundface,  // out: 0=no face, 1=found face
@@ -0,0 +1,265 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+/*!
+ * \ingroup cli
+ * \page cli_br_bench Compare Benchmark
+ * \code
+ * $ br-bench [-dimensions 256] [-targets 16384] [-queries 64] [-threads 1,2,4] [-blockSizes 1024,16384] [-metrics ByteL1,L2]
+ * $ br-bench -algorithm FaceRecognition -enroll ../data/MEDS/img [-images 256]
+ * \endcode
+ * Times Distance::compare over synthetic galleries for each metric, thread count and block size,
+ * and prints comparisons per second and GB/s of target templates as JSON.
+ * Targets are compared one block at a time, as "br -compare" reads them from a gallery.
+ *
+ * With -enroll, instead times the enrollment of a sample of images by the algorithm after a warm-up pass,
+ * and prints images per second, percentiles of the latency of each image, the peak resident set size
+ * and the time spent in each top-level child of the algorithm's pipe as a JSON object.
+ */
+
+#include <QElapsedTimer>
+#include <QFutureSynchronizer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QStringList>
+#include <QThread>
+#include <QtConcurrentRun>
+#include <algorithm>
+#include <stdio.h>
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif // Q_OS_UNIX
+#include <openbr/openbr_plugin.h>
+
+using namespace br;
+
+struct Metric
+{
+    QString name, type, distance, transform; // Templates are random matrices of type, passed through transform if any
+    int depth, columns;
+};
+
+static int option(const QStringList &args, const QString &key, int defaultValue)
+{
+    const int i = args.indexOf("-" + key);
+    return ((i >= 0) && (i+1 < args.size())) ? args[i+1].toInt() : defaultValue;
+}
+
+static QStringList listOption(const QStringList &args, const QString &key, const QStringList &defaultValue)
+{
+    const int i = args.indexOf("-" + key);
+    return ((i >= 0) && (i+1 < args.size())) ? args[i+1].split(',', QString::SkipEmptyParts) : defaultValue;
+}
+
+static TemplateList randomTemplates(int count, int depth, int columns, const QString &prefix)
+{
+    cv::RNG rng(count);
+    TemplateList templates;
+    for (int i=0; i<count; i++) {
+        cv::Mat m(1, columns, CV_MAKETYPE(depth, 1));
+        if (depth == CV_32F) rng.fill(m, cv::RNG::NORMAL, 0, 1);
+        else                 rng.fill(m, cv::RNG::UNIFORM, 0, 256);
+        Template t(File(QString("%1%2").arg(prefix, QString::number(i))), m);
+        t.file.set("Label", i % 128);
+        templates.append(t);
+    }
+    return templates;
+}
+
+static double benchmark(const Distance *distance, const TemplateList &targets, const TemplateList &queries, int blockSize, qint64 *comparisons)
+{
+    QScopedPointer<MatrixOutput> output(MatrixOutput::make(TemplateList(targets.mid(0, blockSize)).files(), queries.files()));
+
+    QElapsedTimer timer;
+    timer.start();
+    *comparisons = 0;
+    do {
+        for (int i=0; i<targets.size(); i+=blockSize) {
+            distance->compare(targets.mid(i, blockSize), queries, output.data());
+            *comparisons += qint64(qMin(blockSize, targets.size()-i)) * queries.size();
+        }
+    } while (timer.elapsed() < 500);
+    return timer.nsecsElapsed() / 1e9;
+}
+
+static void enrollOne(const Transform *transform, const Template *src, double *seconds)
+{
+    QElapsedTimer timer;
+    timer.start();
+    TemplateList dst;
+    transform->project(TemplateList() << *src, dst);
+    *seconds = timer.nsecsElapsed() / 1e9;
+}
+
+static qint64 peakResidentBytes()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef Q_OS_MAC
+    return usage.ru_maxrss;
+#else
+    return qint64(usage.ru_maxrss) * 1024;
+#endif // Q_OS_MAC
+#else
+    return -1;
+#endif // Q_OS_UNIX
+}
+
+static QJsonObject benchmarkEnrollment(const QString &algorithm, const QString &input, int images)
+{
+    const TemplateList sample = TemplateList::fromGallery(input).mid(0, images);
+    if (sample.isEmpty())
+        qFatal("No images in %s.", qPrintable(input));
+    QSharedPointer<Transform> transform = Transform::fromAlgorithm(algorithm);
+
+    // Warm-up, loading models and filling caches
+    TemplateList warmup;
+    transform->project(sample, warmup);
+
+    // Each image is enrolled on its own, as many at once as there are threads, so its latency can be measured
+    QVector<double> latencies(sample.size());
+    QElapsedTimer timer;
+    timer.start();
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<sample.size(); i++)
+        futures.addFuture(QtConcurrent::run(enrollOne, transform.data(), &sample[i], &latencies[i]));
+    futures.waitForFinished();
+    const double seconds = timer.nsecsElapsed() / 1e9;
+
+    // Then the whole sample is passed through the top-level children one at a time
+    QList<Transform*> stages;
+    if (QString(transform->metaObject()->className()) == "br::PipeTransform")
+        stages = transform->property("transforms").value< QList<Transform*> >();
+    else
+        stages.append(transform.data());
+    QJsonArray stageTimes;
+    TemplateList data = sample;
+    foreach (const Transform *stage, stages) {
+        timer.restart();
+        TemplateList projected;
+        stage->project(data, projected);
+        data = projected;
+
+        QJsonObject stageTime;
+        stageTime["transform"] = stage->description();
+        stageTime["seconds"] = timer.nsecsElapsed() / 1e9;
+        stageTimes.append(stageTime);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    QJsonObject latency;
+    latency["p50"] = latencies[(latencies.size() - 1) * 50 / 100];
+    latency["p90"] = latencies[(latencies.size() - 1) * 90 / 100];
+    latency["p99"] = latencies[(latencies.size() - 1) * 99 / 100];
+    latency["max"] = latencies.last();
+
+    QJsonObject result;
+    result["algorithm"] = algorithm;
+    result["images"] = sample.size();
+    result["threads"] = Globals->parallelism;
+    result["seconds"] = seconds;
+    result["imagesPerSecond"] = sample.size() / seconds;
+    result["latencySeconds"] = latency;
+    result["peakResidentBytes"] = double(peakResidentBytes());
+    result["stages"] = stageTimes;
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    Context::initialize(argc, argv, "", false);
+    Globals->quiet = true;
+
+    QStringList args;
+    for (int i=1; i<argc; i++)
+        args.append(argv[i]);
+
+    const int enroll = args.indexOf("-enroll");
+    if ((enroll >= 0) && (enroll+1 < args.size())) {
+        const int algorithm = args.indexOf("-algorithm");
+        const QJsonObject result = benchmarkEnrollment(((algorithm >= 0) && (algorithm+1 < args.size())) ? args[algorithm+1] : Globals->algorithm,
+                                                       args[enroll+1], option(args, "images", 256));
+        printf("%s", QJsonDocument(result).toJson().constData());
+        Context::finalize();
+        return 0;
+    }
+
+    const int dimensions = option(args, "dimensions", 256);
+    const int targetCount = option(args, "targets", 16384);
+    const int queryCount = option(args, "queries", 64);
+
+    QStringList defaultThreads;
+    for (int threads=1; threads<QThread::idealThreadCount(); threads*=2)
+        defaultThreads.append(QString::number(threads));
+    defaultThreads.append(QString::number(QThread::idealThreadCount()));
+    const QStringList threadCounts = listOption(args, "threads", defaultThreads);
+    const QStringList blockSizes = listOption(args, "blockSizes", QStringList() << "1024" << QString::number(Globals->blockSize));
+
+    QList<Metric> metrics;
+    Metric metric;
+    metric.name = "ByteL1";             metric.type = "uchar";     metric.distance = "ByteL1";              metric.depth = CV_8U;  metric.columns = dimensions;     metrics.append(metric);
+    metric.name = "HalfByteL1";         metric.type = "half-byte"; metric.distance = "HalfByteL1";          metric.depth = CV_8U;  metric.columns = dimensions / 2; metrics.append(metric);
+    metric.name = "L1";                 metric.type = "float";     metric.distance = "L1";                  metric.depth = CV_32F; metric.columns = dimensions;     metrics.append(metric);
+    metric.name = "L2";                 metric.type = "float";     metric.distance = "L2";                  metric.depth = CV_32F; metric.columns = dimensions;     metrics.append(metric);
+    metric.name = "Dist";               metric.type = "float";     metric.distance = "Dist(L2)";            metric.depth = CV_32F; metric.columns = dimensions;     metrics.append(metric);
+    metric.name = "ProductQuantization"; metric.type = "pq";       metric.distance = "ProductQuantization"; metric.depth = CV_32F; metric.columns = dimensions;
+    metric.transform = "ProductQuantization(n=2,batchSize=1024,iterations=10)"; metrics.append(metric);
+    const QStringList selected = listOption(args, "metrics", QStringList());
+
+    QJsonArray results;
+    foreach (const Metric &metric, metrics) {
+        if (!selected.isEmpty() && !selected.contains(metric.name))
+            continue;
+
+        TemplateList targets = randomTemplates(targetCount, metric.depth, metric.columns, "target");
+        TemplateList queries = randomTemplates(queryCount, metric.depth, metric.columns, "query");
+        if (!metric.transform.isEmpty()) {
+            QScopedPointer<Transform> transform(Transform::make(metric.transform, NULL));
+            transform->train(targets.mid(0, 4096));
+            targets >> *transform;
+            queries >> *transform;
+        }
+        QScopedPointer<Distance> distance(Distance::make(metric.distance, NULL));
+        const qint64 templateBytes = qint64(targets.first().bytes());
+
+        foreach (const QString &threads, threadCounts)
+            foreach (const QString &blockSize, blockSizes) {
+                Globals->setProperty("parallelism", threads);
+                qint64 comparisons;
+                const double seconds = benchmark(distance.data(), targets, queries, qMax(1, blockSize.toInt()), &comparisons);
+
+                QJsonObject result;
+                result["metric"] = metric.name;
+                result["type"] = metric.type;
+                result["dimensions"] = dimensions;
+                result["templateBytes"] = double(templateBytes);
+                result["threads"] = threads.toInt();
+                result["blockSize"] = blockSize.toInt();
+                result["comparisons"] = double(comparisons);
+                result["seconds"] = seconds;
+                result["comparisonsPerSecond"] = comparisons / seconds;
+                result["GBPerSecond"] = comparisons * templateBytes / seconds / 1e9;
+                results.append(result);
+            }
+    }
+
+    printf("%s", QJsonDocument(results).toJson().constData());
+    Context::finalize();
+    return 0;
+}
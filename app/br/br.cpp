@@ -210,6 +210,16 @@ public:
             } else if (!strcmp(fun, "version")) {
                 check(parc == 0, "No parameters expected for 'version'.");
                 printf("%s\n", br_version());
+            } else if (!strcmp(fun, "startupProfile")) {
+                check(parc == 0, "No parameters expected for 'startupProfile'.");
+                int size = br_startup_profile(NULL, 0);
+                char *temp = new char[size];
+                br_startup_profile(temp, size);
+                printf("%s\n", temp);
+                delete [] temp;
+            } else if (!strcmp(fun, "memoryUsage")) {
+                check(parc == 0, "No parameters expected for 'memoryUsage'.");
+                printMemoryUsage();
             } else if (!strcmp(fun, "daemon")) {
                 check(parc == 1, "Incorrect parameter count for 'daemon'.");
                 daemon = true;
@@ -232,9 +242,13 @@ public:
                 printf("That's me!\n");
             } else if (parc <= 1) {
                 br_set_property(fun, parc >=1 ? parv[0] : "");
+                continue;
             } else {
                 printf("Unrecognized function '%s'\n", fun);
             }
+
+            if (br::Globals->reportMemory)
+                printMemoryUsage();
         }
 
         QCoreApplication::exit();
@@ -249,6 +263,15 @@ private:
         }
     }
 
+    static void printMemoryUsage()
+    {
+        int size = br_memory_usage(NULL, 0);
+        char *temp = new char[size];
+        br_memory_usage(temp, size);
+        printf("%s\n", temp);
+        delete [] temp;
+    }
+
     static void help()
     {
         printf("<arg> = Input; {arg} = Output; [arg] = Optional; (arg0|...|argN) = Choice\n"
@@ -291,6 +314,8 @@ private:
                "-objects [abstraction [implementation]]\n"
                "-about\n"
                "-version\n"
+               "-startupProfile\n"
+               "-memoryUsage\n"
                "-daemon\n"
                "-slave\n"
                "-exit\n");
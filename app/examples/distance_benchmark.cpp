@@ -0,0 +1,96 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*!
+ * \ingroup cli
+ * \page cli_distance_benchmark Distance Benchmark
+ * \code
+ * $ distance_benchmark [bytes] [comparisons]
+ * \endcode
+ * Measures the throughput of each L1 and Hamming kernel supported by this CPU and checks it against the scalar implementation.
+ */
+
+//! [distance_benchmark]
+#include <QElapsedTimer>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <openbr/core/distance_sse.h>
+
+typedef float (*Kernel)(const uchar *a, const uchar *b, int size);
+
+static double benchmark(Kernel kernel, const QByteArray &gallery, int bytes, int comparisons, float *checksum)
+{
+    const uchar *data = (const uchar*) gallery.data();
+    const int templates = gallery.size() / bytes;
+
+    QElapsedTimer timer;
+    timer.start();
+    float total = 0;
+    for (int i=0; i<comparisons; i++)
+        total += kernel(data, data + (i % templates) * bytes, bytes);
+    const qint64 elapsed = std::max(qint64(1), timer.nsecsElapsed());
+
+    *checksum = total;
+    return double(comparisons) * bytes / elapsed; // GB/s
+}
+
+int main(int argc, char *argv[])
+{
+    const int bytes = argc > 1 ? atoi(argv[1]) : 1024;
+    const int comparisons = argc > 2 ? atoi(argv[2]) : 100000;
+    if ((bytes < 1) || (comparisons < 1)) {
+        fprintf(stderr, "Usage: distance_benchmark [bytes] [comparisons]\n");
+        return EXIT_FAILURE;
+    }
+
+    // A gallery larger than the L2 cache, so the benchmark reflects compare() against real enrollments
+    const int templates = std::max(2, (8 << 20) / bytes);
+    QByteArray gallery(templates * bytes, 0);
+    srand(0);
+    for (int i=0; i<gallery.size(); i++)
+        gallery[i] = char(rand());
+
+    const QString defaultKernel = l1Kernel();
+    setL1Kernel("scalar");
+    float expectedL1, expectedPacked, expectedCrumb, expectedHamming;
+    benchmark(l1, gallery, bytes, comparisons, &expectedL1);
+    benchmark(packed_l1, gallery, bytes, comparisons, &expectedPacked);
+    benchmark(crumb_l1, gallery, bytes, comparisons, &expectedCrumb);
+    benchmark(hamming, gallery, bytes, comparisons, &expectedHamming);
+
+    printf("Kernel\tL1 (GB/s)\tPackedL1 (GB/s)\tCrumbL1 (GB/s)\tHamming (GB/s)\n");
+    bool ok = true;
+    foreach (const QString &kernel, l1Kernels()) {
+        setL1Kernel(kernel);
+        float checkL1, checkPacked, checkCrumb, checkHamming;
+        const double l1Throughput = benchmark(l1, gallery, bytes, comparisons, &checkL1);
+        const double packedThroughput = benchmark(packed_l1, gallery, bytes, comparisons, &checkPacked);
+        const double crumbThroughput = benchmark(crumb_l1, gallery, bytes, comparisons, &checkCrumb);
+        const double hammingThroughput = benchmark(hamming, gallery, bytes, comparisons, &checkHamming);
+        printf("%s%s\t%.2f\t\t%.2f\t\t%.2f\t\t%.2f\n", qPrintable(kernel), kernel == defaultKernel ? "*" : "",
+               l1Throughput, packedThroughput, crumbThroughput, hammingThroughput);
+
+        if ((checkL1 != expectedL1) || (checkPacked != expectedPacked) || (checkCrumb != expectedCrumb) || (checkHamming != expectedHamming)) {
+            fprintf(stderr, "%s kernel disagrees with the scalar implementation.\n", qPrintable(kernel));
+            ok = false;
+        }
+    }
+    setL1Kernel(defaultKernel);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+//! [distance_benchmark]
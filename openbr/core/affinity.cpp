@@ -0,0 +1,165 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QDir>
+#include <QFile>
+#include <QStringList>
+#include <QThread>
+#include <algorithm>
+#include <openbr/openbr_plugin.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif // __linux__
+
+#include "affinity.h"
+
+namespace
+{
+
+struct Topology
+{
+    QList<int> cpus;  // Node-major
+    QList<int> nodes; // Node of each entry in cpus
+    int numNodes;
+
+    Topology() : numNodes(1)
+    {
+#ifdef __linux__
+        // Only CPUs the process is allowed to run on, e.g. under taskset or a cgroup
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return;
+
+        QStringList entries = QDir("/sys/devices/system/node").entryList(QStringList() << "node*", QDir::Dirs);
+        QList<int> ids;
+        foreach (const QString &entry, entries) {
+            bool ok;
+            const int id = entry.mid(4).toInt(&ok);
+            if (ok) ids.append(id);
+        }
+        std::sort(ids.begin(), ids.end());
+
+        numNodes = 0;
+        foreach (int id, ids) {
+            QFile file(QString("/sys/devices/system/node/node%1/cpulist").arg(id));
+            if (!file.open(QFile::ReadOnly))
+                continue;
+
+            // Formatted like "0-3,8-11"
+            bool any = false;
+            foreach (const QString &range, QString(file.readAll()).trimmed().split(',', QString::SkipEmptyParts)) {
+                const QStringList bounds = range.split('-');
+                const int first = bounds.first().toInt();
+                const int last = bounds.last().toInt();
+                for (int cpu=first; cpu<=last; cpu++) {
+                    if ((cpu >= CPU_SETSIZE) || !CPU_ISSET(cpu, &allowed))
+                        continue;
+                    cpus.append(cpu);
+                    nodes.append(numNodes);
+                    any = true;
+                }
+            }
+
+            // Memory only nodes have no CPUs to pin to
+            if (any) numNodes++;
+        }
+
+        if (cpus.isEmpty()) {
+            numNodes = 1;
+            for (int cpu=0; cpu<CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &allowed)) {
+                    cpus.append(cpu);
+                    nodes.append(0);
+                }
+        }
+#endif // __linux__
+
+        if (cpus.isEmpty()) {
+            for (int cpu=0; cpu<std::max(1, QThread::idealThreadCount()); cpu++) {
+                cpus.append(cpu);
+                nodes.append(0);
+            }
+        }
+    }
+};
+
+const Topology &topology()
+{
+    static const Topology topology;
+    return topology;
+}
+
+} // namespace
+
+int Affinity::nodes()
+{
+    return topology().numNodes;
+}
+
+int Affinity::cpus()
+{
+    return topology().cpus.size();
+}
+
+int Affinity::nodeOfCpu(int index)
+{
+    const Topology &t = topology();
+    return t.nodes[index % t.cpus.size()];
+}
+
+Affinity::Pin::Pin(Target target, int index)
+    : pinned(false)
+{
+    if (!br::Globals->affinity || (index < 0))
+        return;
+
+#ifdef __linux__
+    const Topology &t = topology();
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (target == Cpu) {
+        CPU_SET(t.cpus[index % t.cpus.size()], &mask);
+    } else {
+        const int node = index % t.numNodes;
+        for (int i=0; i<t.cpus.size(); i++)
+            if (t.nodes[i] == node)
+                CPU_SET(t.cpus[i], &mask);
+    }
+
+    previous = QByteArray(sizeof(cpu_set_t), 0);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), (cpu_set_t*) previous.data()) != 0)
+        return;
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &mask) != 0) {
+        qWarning("Failed to set thread affinity.");
+        return;
+    }
+    pinned = true;
+#else // __linux__
+    (void) target;
+#endif // __linux__
+}
+
+Affinity::Pin::~Pin()
+{
+#ifdef __linux__
+    if (pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), (const cpu_set_t*) previous.constData());
+#endif // __linux__
+}
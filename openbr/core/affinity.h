@@ -0,0 +1,53 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#ifndef BR_AFFINITY_H
+#define BR_AFFINITY_H
+
+#include <QByteArray>
+#include <openbr/openbr_export.h>
+
+namespace Affinity
+{
+    // NUMA nodes of the machine, read once from sysfs. Platforms without NUMA information report a single node.
+    BR_EXPORT int nodes();
+
+    // CPUs in node-major order, so consecutive indices fill one socket before moving to the next.
+    BR_EXPORT int cpus();
+
+    // Node of the index-th CPU in node-major order, wrapping around when index >= cpus().
+    BR_EXPORT int nodeOfCpu(int index);
+
+    // First item of the node's share of count items, items [begin(count,n), begin(count,n+1)) belong to node n.
+    inline int begin(int count, int node) { return int((qint64(count) * node) / nodes()); }
+
+    // Pins the calling thread for the lifetime of the object, restoring its previous affinity on destruction.
+    // Does nothing unless Globals->affinity is set, or on platforms without thread affinity support.
+    class BR_EXPORT Pin
+    {
+    public:
+        enum Target { Cpu, Node };
+        Pin(Target target, int index); // index wraps around cpus() or nodes()
+        ~Pin();
+
+    private:
+        bool pinned;
+        QByteArray previous; // The thread's former affinity mask
+    };
+}
+
+#endif // BR_AFFINITY_H
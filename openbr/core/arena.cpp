@@ -0,0 +1,187 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QAtomicInt>
+#include <QList>
+#include <QThreadStorage>
+#include <algorithm>
+
+#include "arena.h"
+
+namespace
+{
+
+// Matrices reference the chunk they were allocated from, so a chunk outlives the arena reset, or the thread,
+// for as long as any of its matrices do.
+struct Chunk
+{
+    QAtomicInt refs; // One per live matrix, plus one while the chunk belongs to an arena
+    uchar *data;
+    size_t size, used;
+
+    Chunk(size_t size) : refs(1), data((uchar*) cv::fastMalloc(size)), size(size), used(0) {}
+    ~Chunk() { cv::fastFree(data); }
+
+    void release()
+    {
+        if (!refs.deref())
+            delete this;
+    }
+};
+
+// Precedes the data of every allocation
+struct Header
+{
+    Chunk *chunk;
+    int refcount;
+};
+
+static const size_t HeaderSize = (sizeof(Header) + 15) & ~size_t(15);
+static const size_t ChunkSize = 4 << 20;
+
+struct ThreadArena
+{
+    QList<Chunk*> chunks;
+    int current; // Chunk being bump allocated from
+    int depth;   // Nested scopes
+
+    ThreadArena() : current(0), depth(0) {}
+
+    ~ThreadArena()
+    {
+        foreach (Chunk *chunk, chunks)
+            chunk->release();
+    }
+
+    uchar *allocate(size_t bytes, Chunk *&owner)
+    {
+        while ((current < chunks.size()) && (chunks[current]->used + bytes > chunks[current]->size))
+            current++;
+        if (current == chunks.size())
+            chunks.append(new Chunk(std::max(bytes, ChunkSize)));
+
+        owner = chunks[current];
+        uchar *block = owner->data + owner->used;
+        owner->used += bytes;
+        owner->refs.ref();
+        return block;
+    }
+
+    // Reuse chunks without live matrices, hand the others over to their matrices
+    void reset()
+    {
+        QList<Chunk*> reusable;
+        foreach (Chunk *chunk, chunks) {
+            if (chunk->refs.load() == 1) {
+                chunk->used = 0;
+                reusable.append(chunk);
+            } else {
+                chunk->release();
+            }
+        }
+        chunks = reusable;
+        current = 0;
+    }
+};
+
+QThreadStorage<ThreadArena*> &threadArenas()
+{
+    static QThreadStorage<ThreadArena*> arenas;
+    return arenas;
+}
+
+// A single, never destroyed, instance so matrices can be released from any thread at any time
+class ArenaAllocator : public cv::MatAllocator
+{
+public:
+    void allocate(int dims, const int *sizes, int type, int *&refcount, uchar *&datastart, uchar *&data, size_t *step)
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i=dims-1; i>=0; i--) {
+            step[i] = total;
+            total *= sizes[i];
+        }
+        const size_t bytes = HeaderSize + ((total + 15) & ~size_t(15));
+
+        // Outside of a scope, e.g. when an escaped matrix is reallocated, fall back to a chunk of its own
+        Chunk *chunk;
+        uchar *block;
+        ThreadArena *arena = threadArenas().hasLocalData() ? threadArenas().localData() : NULL;
+        if (arena && (arena->depth > 0)) {
+            block = arena->allocate(bytes, chunk);
+        } else {
+            chunk = new Chunk(bytes);
+            chunk->used = bytes;
+            block = chunk->data;
+        }
+
+        Header *header = reinterpret_cast<Header*>(block);
+        header->chunk = chunk;
+        header->refcount = 1;
+        refcount = &header->refcount;
+        datastart = data = block + HeaderSize;
+    }
+
+    void deallocate(int *refcount, uchar *datastart, uchar *data)
+    {
+        (void) refcount; (void) data;
+        reinterpret_cast<Header*>(datastart - HeaderSize)->chunk->release();
+    }
+};
+
+ArenaAllocator *arenaAllocator()
+{
+    static ArenaAllocator *allocator = new ArenaAllocator();
+    return allocator;
+}
+
+} // namespace
+
+cv::MatAllocator *Arena::allocator()
+{
+    QThreadStorage<ThreadArena*> &arenas = threadArenas();
+    return (arenas.hasLocalData() && (arenas.localData()->depth > 0)) ? arenaAllocator() : NULL;
+}
+
+void Arena::promote(br::Template &t)
+{
+    for (int i=0; i<t.size(); i++)
+        if (t[i].allocator == arenaAllocator())
+            t[i] = t[i].clone();
+}
+
+Arena::Scope::Scope()
+    : bound(br::Globals->arena)
+{
+    if (!bound)
+        return;
+
+    QThreadStorage<ThreadArena*> &arenas = threadArenas();
+    if (!arenas.hasLocalData())
+        arenas.setLocalData(new ThreadArena());
+    arenas.localData()->depth++;
+}
+
+Arena::Scope::~Scope()
+{
+    if (!bound)
+        return;
+
+    ThreadArena *arena = threadArenas().localData();
+    if (--arena->depth == 0)
+        arena->reset();
+}
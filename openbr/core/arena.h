@@ -0,0 +1,50 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#ifndef BR_ARENA_H
+#define BR_ARENA_H
+
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_plugin.h>
+
+namespace Arena
+{
+    // Allocator of the arena bound to the calling thread, or NULL outside of a Scope.
+    BR_EXPORT cv::MatAllocator *allocator();
+
+    // An empty matrix that will allocate from the calling thread's arena, if there is one.
+    inline cv::Mat mat() { cv::Mat m; m.allocator = allocator(); return m; }
+    inline cv::Mat mat(int rows, int cols, int type) { cv::Mat m = mat(); m.create(rows, cols, type); return m; }
+
+    // Copies the matrices of t that were allocated from an arena to the regular heap.
+    BR_EXPORT void promote(br::Template &t);
+
+    // Binds an arena to the calling thread, matrices created with Arena::mat() in its lifetime are bump allocated from it.
+    // The arena is reset when the outermost scope on the thread ends, so results that outlive it must be promoted first.
+    // Does nothing unless Globals->arena is set.
+    class BR_EXPORT Scope
+    {
+    public:
+        Scope();
+        ~Scope();
+
+    private:
+        bool bound;
+    };
+}
+
+#endif // BR_ARENA_H
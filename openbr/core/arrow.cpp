@@ -0,0 +1,406 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QFile>
+#include <QVector>
+#include <QtGlobal>
+#include <algorithm>
+#include <limits>
+#include <string.h>
+
+#include "arrow.h"
+
+using namespace Arrow;
+
+// A minimal FlatBuffers builder. Like the reference implementation the buffer grows towards the front,
+// so offsets are measured from the end and children are finished before the objects that reference them.
+class FlatBuilder
+{
+    QByteArray data; // The tail of the finished buffer
+    int tableStart;
+    QList< QPair<int,int> > fields; // QPair<field id, offset of the field>
+
+    void prepend(const void *bytes, int size)
+    {
+        data.prepend(QByteArray((const char*) bytes, size));
+    }
+
+    // Pads so that an object of size bytes prepended next is aligned, the finished buffer is a multiple of 8 bytes
+    void align(int size, int alignment)
+    {
+        const int remainder = (data.size() + size) % alignment;
+        if (remainder)
+            data.prepend(QByteArray(alignment - remainder, '\0'));
+    }
+
+public:
+    FlatBuilder() : tableStart(0) {}
+
+    int offset() const
+    {
+        return data.size();
+    }
+
+    template <typename T>
+    int scalar(T value)
+    {
+        align(sizeof(T), sizeof(T));
+        prepend(&value, sizeof(T));
+        return offset();
+    }
+
+    int reference(int target)
+    {
+        align(4, 4);
+        const quint32 value = offset() + 4 - target;
+        prepend(&value, 4);
+        return offset();
+    }
+
+    int string(const QByteArray &value)
+    {
+        align(4 + value.size() + 1, 4);
+        data.prepend('\0');
+        data.prepend(value);
+        return scalar<quint32>(value.size());
+    }
+
+    // A vector of count structs with the given alignment, stored contiguously in bytes
+    int structs(const QByteArray &bytes, int count, int alignment)
+    {
+        align(bytes.size(), std::max(alignment, 4));
+        data.prepend(bytes);
+        return scalar<quint32>(count);
+    }
+
+    int tables(const QList<int> &tables)
+    {
+        for (int i=tables.size()-1; i>=0; i--)
+            reference(tables[i]);
+        return scalar<quint32>(tables.size());
+    }
+
+    void startTable()
+    {
+        fields.clear();
+        tableStart = offset();
+    }
+
+    template <typename T>
+    void addScalar(int id, T value)
+    {
+        fields.append(QPair<int,int>(id, scalar(value)));
+    }
+
+    void addReference(int id, int target)
+    {
+        fields.append(QPair<int,int>(id, reference(target)));
+    }
+
+    int endTable()
+    {
+        const int table = scalar<qint32>(0); // Replaced by the offset to the vtable below
+
+        int fieldCount = 0;
+        for (int i=0; i<fields.size(); i++)
+            fieldCount = std::max(fieldCount, fields[i].first + 1);
+        QVector<quint16> entries(fieldCount, 0);
+        for (int i=0; i<fields.size(); i++)
+            entries[fields[i].first] = table - fields[i].second;
+
+        for (int i=entries.size()-1; i>=0; i--)
+            scalar<quint16>(entries[i]);
+        scalar<quint16>(table - tableStart);
+        const int vtable = scalar<quint16>(4 + 2 * entries.size());
+
+        const qint32 vtableOffset = vtable - table;
+        memcpy(data.data() + data.size() - table, &vtableOffset, sizeof(vtableOffset));
+        return table;
+    }
+
+    QByteArray finish(int root)
+    {
+        align(4, 8);
+        reference(root);
+        return data;
+    }
+};
+
+// Identifiers from the Arrow flatbuffer schemas, Schema.fbs, Message.fbs and File.fbs
+static const qint16 MetadataV5 = 4;
+static const quint8 MessageSchema = 1;
+static const quint8 MessageRecordBatch = 3;
+static const quint8 TypeInt = 2;
+static const quint8 TypeFloatingPoint = 3;
+static const quint8 TypeBinary = 4;
+static const quint8 TypeUtf8 = 5;
+static const quint8 TypeBool = 6;
+static const quint8 TypeFixedSizeBinary = 15;
+static const qint16 PrecisionSingle = 1;
+static const qint16 PrecisionDouble = 2;
+static const int BufferAlignment = 64;
+
+struct FieldNode
+{
+    qint64 length;
+    qint64 nullCount;
+};
+
+struct Buffer
+{
+    qint64 offset;
+    qint64 length;
+};
+
+struct Block
+{
+    qint64 offset;
+    qint32 metaDataLength;
+    qint32 padding;
+    qint64 bodyLength;
+};
+
+static void setBit(QByteArray &bitmap, qint64 index, bool value)
+{
+    if (index / 8 >= bitmap.size())
+        bitmap.append('\0');
+    if (value)
+        bitmap.data()[index / 8] |= char(1 << (index % 8));
+}
+
+Column::Column(const QString &name, Type type, int byteWidth)
+    : name(name), type(type), byteWidth(byteWidth), length(0), nullCount(0)
+{
+    if ((type == Utf8) || (type == Binary)) {
+        const qint32 zero = 0;
+        offsets.append((const char*) &zero, sizeof(zero));
+    }
+    if ((type == FixedSizeBinary) && (byteWidth < 1))
+        qFatal("Fixed size binary column %s requires a positive byte width.", qPrintable(name));
+}
+
+void Column::appendValid(bool valid)
+{
+    setBit(validity, length, valid);
+    if (!valid)
+        nullCount++;
+    length++;
+}
+
+void Column::appendNull()
+{
+    switch (type) {
+      case Bool:            setBit(values, length, false); break;
+      case Int64:           values.append(QByteArray(sizeof(qint64), '\0')); break;
+      case Float32:         values.append(QByteArray(sizeof(float), '\0')); break;
+      case Float64:         values.append(QByteArray(sizeof(double), '\0')); break;
+      case Utf8:
+      case Binary:          { const qint32 end = values.size(); offsets.append((const char*) &end, sizeof(end)); } break;
+      case FixedSizeBinary: values.append(QByteArray(byteWidth, '\0')); break;
+    }
+    appendValid(false);
+}
+
+void Column::append(bool value)
+{
+    if (type != Bool)
+        qFatal("Column %s is not boolean.", qPrintable(name));
+    setBit(values, length, value);
+    appendValid(true);
+}
+
+void Column::append(qint64 value)
+{
+    if (type != Int64)
+        qFatal("Column %s is not an integer.", qPrintable(name));
+    values.append((const char*) &value, sizeof(value));
+    appendValid(true);
+}
+
+void Column::append(double value)
+{
+    if (type == Float32) {
+        const float single = value;
+        values.append((const char*) &single, sizeof(single));
+    } else if (type == Float64) {
+        values.append((const char*) &value, sizeof(value));
+    } else {
+        qFatal("Column %s is not floating point.", qPrintable(name));
+    }
+    appendValid(true);
+}
+
+void Column::append(const QByteArray &value)
+{
+    if ((type == Utf8) || (type == Binary)) {
+        if (qint64(values.size()) + value.size() > std::numeric_limits<qint32>::max())
+            qFatal("Column %s exceeds 2 GB.", qPrintable(name));
+        values.append(value);
+        const qint32 end = values.size();
+        offsets.append((const char*) &end, sizeof(end));
+    } else if (type == FixedSizeBinary) {
+        if (value.size() != byteWidth)
+            qFatal("Expected %d bytes for column %s, got %d.", byteWidth, qPrintable(name), value.size());
+        values.append(value);
+    } else {
+        qFatal("Column %s is not binary.", qPrintable(name));
+    }
+    appendValid(true);
+}
+
+static int buildSchema(FlatBuilder &builder, const QList<Column> &columns)
+{
+    QList<int> fields;
+    foreach (const Column &column, columns) {
+        quint8 typeType;
+        builder.startTable();
+        switch (column.type) {
+          case Column::Bool:            typeType = TypeBool; break;
+          case Column::Int64:           typeType = TypeInt; builder.addScalar<qint32>(0, 64); builder.addScalar<quint8>(1, 1); break;
+          case Column::Float32:         typeType = TypeFloatingPoint; builder.addScalar<qint16>(0, PrecisionSingle); break;
+          case Column::Float64:         typeType = TypeFloatingPoint; builder.addScalar<qint16>(0, PrecisionDouble); break;
+          case Column::Utf8:            typeType = TypeUtf8; break;
+          case Column::Binary:          typeType = TypeBinary; break;
+          default:                      typeType = TypeFixedSizeBinary; builder.addScalar<qint32>(0, column.byteWidth); break;
+        }
+        const int type = builder.endTable();
+
+        QList<int> keyValues;
+        for (int i=0; i<column.metadata.size(); i++) {
+            const int key = builder.string(column.metadata[i].first.toUtf8());
+            const int value = builder.string(column.metadata[i].second.toUtf8());
+            builder.startTable();
+            builder.addReference(0, key);
+            builder.addReference(1, value);
+            keyValues.append(builder.endTable());
+        }
+        const int customMetadata = builder.tables(keyValues);
+        const int children = builder.tables(QList<int>()); // Required by readers even when empty
+        const int name = builder.string(column.name.toUtf8());
+
+        builder.startTable();
+        builder.addReference(0, name);
+        builder.addScalar<quint8>(1, 1); // nullable
+        builder.addScalar<quint8>(2, typeType);
+        builder.addReference(3, type);
+        builder.addReference(5, children);
+        builder.addReference(6, customMetadata);
+        fields.append(builder.endTable());
+    }
+
+    const int vector = builder.tables(fields);
+    builder.startTable();
+    builder.addScalar<qint16>(0, 0); // Little endian
+    builder.addReference(1, vector);
+    return builder.endTable();
+}
+
+static QByteArray buildMessage(FlatBuilder &builder, quint8 headerType, int header, qint64 bodyLength)
+{
+    builder.startTable();
+    builder.addScalar<qint16>(0, MetadataV5);
+    builder.addScalar<quint8>(1, headerType);
+    builder.addReference(2, header);
+    builder.addScalar<qint64>(3, bodyLength);
+    return builder.finish(builder.endTable());
+}
+
+static void appendBuffer(QByteArray &body, QByteArray &buffers, const QByteArray &data)
+{
+    Buffer buffer;
+    buffer.offset = body.size();
+    buffer.length = data.size();
+    buffers.append((const char*) &buffer, sizeof(buffer));
+    body.append(data);
+    if (body.size() % BufferAlignment)
+        body.append(QByteArray(BufferAlignment - body.size() % BufferAlignment, '\0'));
+}
+
+// Encapsulated message: continuation marker, metadata length, metadata padded to 8 bytes, body
+static Block writeMessage(QFile &file, const QByteArray &metadata, const QByteArray &body)
+{
+    Block block;
+    block.offset = file.pos();
+    block.metaDataLength = 8 + metadata.size();
+    block.padding = 0;
+    block.bodyLength = body.size();
+
+    const qint32 continuation = -1, length = metadata.size();
+    file.write((const char*) &continuation, sizeof(continuation));
+    file.write((const char*) &length, sizeof(length));
+    file.write(metadata);
+    file.write(body);
+    return block;
+}
+
+void Arrow::write(const QString &fileName, const QList<Column> &columns)
+{
+    const qint64 length = columns.isEmpty() ? 0 : columns.first().length;
+    foreach (const Column &column, columns)
+        if (column.length != length)
+            qFatal("Column %s has %lld rows, expected %lld.", qPrintable(column.name), column.length, length);
+
+    QByteArray body, nodes, buffers;
+    foreach (const Column &column, columns) {
+        FieldNode node;
+        node.length = column.length;
+        node.nullCount = column.nullCount;
+        nodes.append((const char*) &node, sizeof(node));
+
+        appendBuffer(body, buffers, column.nullCount > 0 ? column.validity : QByteArray());
+        if ((column.type == Column::Utf8) || (column.type == Column::Binary))
+            appendBuffer(body, buffers, column.offsets);
+        appendBuffer(body, buffers, column.values);
+    }
+
+    QFile file(fileName);
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Failed to open %s for writing.", qPrintable(fileName));
+    file.write("ARROW1\0\0", 8);
+
+    FlatBuilder schemaBuilder;
+    writeMessage(file, buildMessage(schemaBuilder, MessageSchema, buildSchema(schemaBuilder, columns), 0), QByteArray());
+
+    FlatBuilder batchBuilder;
+    const int nodeVector = batchBuilder.structs(nodes, columns.size(), 8);
+    const int bufferVector = batchBuilder.structs(buffers, buffers.size() / sizeof(Buffer), 8);
+    batchBuilder.startTable();
+    batchBuilder.addScalar<qint64>(0, length);
+    batchBuilder.addReference(1, nodeVector);
+    batchBuilder.addReference(2, bufferVector);
+    const int recordBatch = batchBuilder.endTable();
+    const Block block = writeMessage(file, buildMessage(batchBuilder, MessageRecordBatch, recordBatch, body.size()), body);
+
+    const qint32 endOfStream[2] = { -1, 0 };
+    file.write((const char*) endOfStream, sizeof(endOfStream));
+
+    FlatBuilder footerBuilder;
+    const int schema = buildSchema(footerBuilder, columns);
+    const int dictionaries = footerBuilder.structs(QByteArray(), 0, 8);
+    const int recordBatches = footerBuilder.structs(QByteArray((const char*) &block, sizeof(block)), 1, 8);
+    footerBuilder.startTable();
+    footerBuilder.addScalar<qint16>(0, MetadataV5);
+    footerBuilder.addReference(1, schema);
+    footerBuilder.addReference(2, dictionaries);
+    footerBuilder.addReference(3, recordBatches);
+    const QByteArray footer = footerBuilder.finish(footerBuilder.endTable());
+
+    const qint32 footerLength = footer.size();
+    file.write(footer);
+    file.write((const char*) &footerLength, sizeof(footerLength));
+    file.write("ARROW1", 6);
+}
@@ -0,0 +1,62 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#ifndef BR_ARROW_H
+#define BR_ARROW_H
+
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <openbr/openbr_export.h>
+
+// Writer for the Arrow IPC file format, readable without copying by pyarrow, pandas and Spark.
+namespace Arrow
+{
+    // One nullable column, values are appended in row order.
+    class BR_EXPORT Column
+    {
+    public:
+        enum Type { Bool, Int64, Float32, Float64, Utf8, Binary, FixedSizeBinary };
+
+        Column(const QString &name, Type type, int byteWidth = 0);
+
+        void appendNull();
+        void append(bool value);
+        void append(qint64 value);
+        void append(double value); // Float32 or Float64
+        void append(const QByteArray &value); // Utf8, Binary, or byteWidth bytes of FixedSizeBinary
+
+        // Stored as custom metadata on the field
+        void setMetadata(const QString &key, const QString &value) { metadata.append(QPair<QString,QString>(key, value)); }
+
+        QString name;
+        Type type;
+        int byteWidth;
+        qint64 length, nullCount;
+        QByteArray validity, offsets, values; // Arrow buffers, offsets are only used by Utf8 and Binary
+        QList< QPair<QString,QString> > metadata;
+
+    private:
+        void appendValid(bool valid);
+    };
+
+    // Writes the columns, which must have equal lengths, as one record batch.
+    BR_EXPORT void write(const QString &fileName, const QList<Column> &columns);
+}
+
+#endif // BR_ARROW_H
@@ -15,11 +15,9 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QtCore>
-#ifndef BR_EMBEDDED
-#include <QtXml>
-#endif // BR_EMBEDDED
 
 #include "bee.h"
+#include "distance_sse.h"
 #include "opencvutils.h"
 #include "qtutils.h"
 
@@ -33,66 +31,52 @@ FileList readSigset(const File &sigset, bool ignoreMetadata)
 {
     FileList fileList;
 
-#ifndef BR_EMBEDDED
-    QDomDocument doc(sigset.fileName());
-    {
-        QFile file(sigset.resolved());
-        if (!file.open(QIODevice::ReadOnly))
-            qFatal("Unable to open %s for reading.", qPrintable(sigset));
-        if (!doc.setContent(&file))
-            qFatal("Unable to parse %s.", qPrintable(sigset));
-    }
+    QFile file(sigset.resolved());
+    if (!file.open(QIODevice::ReadOnly))
+        qFatal("Unable to open %s for reading.", qPrintable(sigset));
 
-    QDomElement docElem = doc.documentElement();
-    if (docElem.nodeName() != "biometric-signature-set")
+    // Streamed instead of parsed into a DOM, so memory use is proportional to the output rather than the document
+    QXmlStreamReader reader(&file);
+    if (!reader.readNextStartElement() || (reader.name() != "biometric-signature-set")) {
+        if (reader.hasError()) qFatal("Unable to parse %s.", qPrintable(sigset));
         return fileList;
+    }
 
-    QDomNode subject = docElem.firstChild();
-    while (!subject.isNull()) {
+    while (reader.readNextStartElement()) {
         // Looping through subjects
-        QDomNode fileNode = subject.firstChild();
-        QDomElement d = subject.toElement();
-        QString name = d.attribute("name");
-        while (!fileNode.isNull()) {
+        const QString name = reader.attributes().value("name").toString();
+        while (reader.readNextStartElement()) {
             // Looping through files
             File file("", name);
-
-            QDomElement e = fileNode.toElement();
-            QDomNamedNodeMap attributes = e.attributes();
-            for (int i=0; i<attributes.length(); i++) {
-                const QString key = attributes.item(i).nodeName();
-                const QString value = attributes.item(i).nodeValue();
-                if      (key == "file-name") file.name = value;
-                else if (!ignoreMetadata)    file.set(key, value);
+            foreach (const QXmlStreamAttribute &attribute, reader.attributes()) {
+                const QString key = attribute.name().toString();
+                if      (key == "file-name") file.name = attribute.value().toString();
+                else if (!ignoreMetadata)    file.set(key, attribute.value().toString());
             }
 
             // add bounding boxes, if they exist (will be child elements of <presentation>)
-            if (fileNode.hasChildNodes()) {
-                QList<QRectF> rects;
-                QDomNodeList bboxes = fileNode.childNodes();
-                for (int i=0; i<bboxes.length(); i++) {
-                    QDomElement bbox = bboxes.at(i).toElement();
-                    qreal x = bbox.attribute("x").toDouble();
-                    qreal y = bbox.attribute("y").toDouble();
-                    qreal width = bbox.attribute("width").toDouble();
-                    qreal height = bbox.attribute("height").toDouble();
-                    rects += QRectF(x, y, width, height);
-                }
-                file.setRects(rects);
+            QList<QRectF> rects;
+            bool hasBoxes = false;
+            while (reader.readNextStartElement()) {
+                const QXmlStreamAttributes bbox = reader.attributes();
+                qreal x = bbox.value("x").toString().toDouble();
+                qreal y = bbox.value("y").toString().toDouble();
+                qreal width = bbox.value("width").toString().toDouble();
+                qreal height = bbox.value("height").toString().toDouble();
+                rects += QRectF(x, y, width, height);
+                hasBoxes = true;
+                reader.skipCurrentElement();
             }
+            if (hasBoxes)
+                file.setRects(rects);
 
             if (file.name.isEmpty()) qFatal("Missing file-name in %s.", qPrintable(sigset));
             fileList.append(file);
-
-            fileNode = fileNode.nextSibling();
         }
-        subject = subject.nextSibling();
     }
-#else // BR_EMBEDDED
-    (void) sigset;
-    (void) ignoreMetadata;
-#endif // BR_EMBEDDED
 
+    if (reader.hasError())
+        qFatal("Unable to parse %s: %s", qPrintable(sigset), qPrintable(reader.errorString()));
     return fileList;
 }
 
@@ -128,6 +112,136 @@ void writeSigset(const QString &sigset, const FileList &files, bool ignoreMetada
     QtUtils::writeFile(sigset, lines);
 }
 
+SimmatEncoding::SimmatEncoding(Type type_, float scale_, float offset_)
+    : type(type_), scale(scale_), offset(offset_)
+{}
+
+SimmatEncoding SimmatEncoding::fromRange(Type type, float lower, float upper)
+{
+    if (!(upper > lower)) qFatal("Invalid score range [%g, %g].", lower, upper);
+    if ((type == Float32) || (type == Float16)) return SimmatEncoding(type);
+    const int levels = (type == UInt8) ? 255 : 65535;
+    const float scale = (upper - lower) / (levels - 1);
+    return SimmatEncoding(type, scale, lower - scale);
+}
+
+SimmatEncoding SimmatEncoding::parse(const QStringList &words)
+{
+    SimmatEncoding encoding;
+    switch (words[0][1].toLatin1()) {
+      case 'F': case 'B': return encoding;
+      case 'H': encoding.type = Float16; break;
+      case 'S': encoding.type = UInt16; break;
+      case 'C': encoding.type = UInt8; break;
+      default:  qFatal("Unknown matrix type %s.", qPrintable(words[0]));
+    }
+    if (words.size() < 6) qFatal("Expected a scale and offset in the matrix header.");
+    encoding.scale = words[4].trimmed().toFloat();
+    encoding.offset = words[5].trimmed().toFloat();
+    return encoding;
+}
+
+char SimmatEncoding::code() const
+{
+    switch (type) {
+      case Float16: return 'H';
+      case UInt16:  return 'S';
+      case UInt8:   return 'C';
+      default:      return 'F';
+    }
+}
+
+int SimmatEncoding::elemSize() const
+{
+    switch (type) {
+      case Float16: case UInt16: return 2;
+      case UInt8:                return 1;
+      default:                   return sizeof(SimmatValue);
+    }
+}
+
+QByteArray SimmatEncoding::header() const
+{
+    if (type == Float32) return QByteArray();
+    return " " + QByteArray::number(scale, 'g', 9) + " " + QByteArray::number(offset, 'g', 9);
+}
+
+Mat SimmatEncoding::encode(const Mat &scores, qint64 *clipped) const
+{
+    if (type == Float32) return scores;
+
+    const Mat src = scores.isContinuous() ? scores : scores.clone();
+    const float *values = src.ptr<float>();
+    const int n = int(src.total());
+    Mat stored(src.rows, src.cols, (type == UInt8) ? CV_8UC1 : CV_16UC1);
+    qint64 saturated = 0;
+
+    if (type == Float16) {
+        static const float MaxHalf = 65504;
+        QVector<float> normalized(n);
+        for (int i=0; i<n; i++) {
+            if (values[i] == -std::numeric_limits<float>::max()) {
+                normalized[i] = -std::numeric_limits<float>::infinity();
+                continue;
+            }
+            const float value = (values[i] - offset) / scale;
+            if (fabs(value) > MaxHalf) saturated++;
+            normalized[i] = std::max(-MaxHalf, std::min(MaxHalf, value));
+        }
+        floatToHalf(normalized.data(), stored.ptr<quint16>(), n);
+    } else {
+        const float levels = (type == UInt8) ? 255 : 65535;
+        for (int i=0; i<n; i++) {
+            float code = 0;
+            if (values[i] != -std::numeric_limits<float>::max()) {
+                code = floor((values[i] - offset) / scale + 0.5f);
+                if (!(code >= 1) || (code > levels)) saturated++;
+                code = (code > levels) ? levels : ((code >= 1) ? code : 1);
+            }
+            if (type == UInt8) stored.ptr<uchar>()[i] = uchar(code);
+            else               stored.ptr<quint16>()[i] = quint16(code);
+        }
+    }
+
+    if (clipped) *clipped += saturated;
+    return stored;
+}
+
+void SimmatEncoding::decode(const void *stored, float *scores, int n) const
+{
+    switch (type) {
+      case Float32:
+        memcpy(scores, stored, n * sizeof(float));
+        return;
+      case Float16:
+        halfToFloat((const quint16*) stored, scores, n);
+        for (int i=0; i<n; i++)
+            scores[i] = (scores[i] == -std::numeric_limits<float>::infinity()) ? -std::numeric_limits<float>::max() : offset + scale * scores[i];
+        return;
+      case UInt16:
+        for (int i=0; i<n; i++) {
+            const quint16 code = ((const quint16*) stored)[i];
+            scores[i] = code ? offset + scale * code : -std::numeric_limits<float>::max();
+        }
+        return;
+      case UInt8:
+        for (int i=0; i<n; i++) {
+            const uchar code = ((const uchar*) stored)[i];
+            scores[i] = code ? offset + scale * code : -std::numeric_limits<float>::max();
+        }
+        return;
+    }
+}
+
+Mat SimmatEncoding::decode(const Mat &stored) const
+{
+    if (type == Float32) return stored;
+    const Mat src = stored.isContinuous() ? stored : stored.clone();
+    Mat scores(src.rows, src.cols, OpenCVType<SimmatValue,1>::make());
+    decode(src.data, scores.ptr<float>(), int(src.total()));
+    return scores;
+}
+
 Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
 {
     QFile file(matrix);
@@ -150,14 +264,17 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
     const int rows = words[1].toInt();
     const int cols = words[2].toInt();
     const bool isMask = words[0][1] == 'B';
-    const int typeSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
+    const SimmatEncoding encoding = SimmatEncoding::parse(words);
+    const int typeSize = isMask ? sizeof(BEE::MaskValue) : encoding.elemSize();
 
     // Get matrix data
     Mat m;
     if (isMask)
         m.create(rows, cols, OpenCVType<BEE::MaskValue,1>::make());
-    else
+    else if (encoding.type == SimmatEncoding::Float32)
         m.create(rows, cols, OpenCVType<BEE::SimmatValue,1>::make());
+    else
+        m.create(rows, cols, (encoding.type == SimmatEncoding::UInt8) ? CV_8UC1 : CV_16UC1);
 
     const qint64 bytesPerRow = m.cols * typeSize;
     for (int i=0; i<m.rows; i++) {
@@ -170,13 +287,16 @@ Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
         qFatal("Expected matrix end of file.");
     file.close();
 
+    if (!isMask)
+        m = encoding.decode(m);
+
     Mat result = m;
     if (isDistance ^ matrix.get<bool>("negate", false))
         m.convertTo(result, -1, -1);
     return result;
 }
 
-void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
+void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset, const SimmatEncoding &encoding)
 {
     bool isMask = false;
     if (m.type() == OpenCVType<BEE::MaskValue,1>::make())
@@ -184,32 +304,95 @@ void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSig
     else if (m.type() != OpenCVType<BEE::SimmatValue,1>::make())
         qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
 
-    const int elemSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
-    const QString matrixType = isMask ? "B" : "F";
+    const SimmatEncoding stored = isMask ? SimmatEncoding() : encoding;
+    qint64 clipped = 0;
+    const Mat data = isMask ? m : stored.encode(m, &clipped);
+    if (clipped > 0)
+        qWarning("%lld scores saturated writing %s.", clipped, qPrintable(fileName));
+    const int elemSize = isMask ? sizeof(BEE::MaskValue) : stored.elemSize();
 
-    char buff[4];
     QFile file(fileName);
     QtUtils::touchDir(file);
     if (!file.open(QFile::WriteOnly))
         qFatal("Unable to open %s for writing.", qPrintable(fileName));
-    file.write("S2\n");
-    file.write(qPrintable(targetSigset));
-    file.write("\n");
-    file.write(qPrintable(querySigset));
-    file.write("\n");
-    file.write("M");
-    file.write(qPrintable(matrixType));
-    file.write(" ");
-    file.write(qPrintable(QString::number(m.rows)));
-    file.write(" ");
-    file.write(qPrintable(QString::number(m.cols)));
-    file.write(" ");
+    file.write(matrixHeader(m.rows, m.cols, isMask, targetSigset, querySigset, stored));
+    file.write((const char*)data.data, qint64(m.rows)*m.cols*elemSize);
+    file.close();
+}
+
+QByteArray matrixHeader(int rows, int cols, bool isMask, const QString &targetSigset, const QString &querySigset, const SimmatEncoding &encoding)
+{
+    char buff[4];
+    QByteArray header;
+    header.append("S2\n");
+    header.append(qPrintable(targetSigset));
+    header.append("\n");
+    header.append(qPrintable(querySigset));
+    header.append("\n");
+    header.append("M");
+    header.append(isMask ? 'B' : encoding.code());
+    header.append(" ");
+    header.append(qPrintable(QString::number(rows)));
+    header.append(" ");
+    header.append(qPrintable(QString::number(cols)));
+    header.append(" ");
     const int endian = 0x12345678;
     memcpy(&buff, &endian, 4);
-    file.write(buff, 4);
-    file.write("\n");
-    file.write((const char*)m.data, m.rows*m.cols*elemSize);
-    file.close();
+    header.append(buff, 4);
+    if (!isMask) header.append(encoding.header());
+    header.append("\n");
+    return header;
+}
+
+MatrixStream::MatrixStream(const File &matrix)
+{
+    file.setFileName(matrix.name);
+    if (!file.open(QFile::ReadOnly)) qFatal("Unable to open %s for reading.", qPrintable(matrix.name));
+
+    // Check format
+    const QByteArray format = file.readLine();
+    if (format[1] != '2') qFatal("Invalid matrix header.");
+
+    // Read sigsets
+    target = file.readLine().simplified();
+    query = file.readLine().simplified();
+
+    // Get matrix size
+    const QStringList words = QString(file.readLine()).split(" ");
+    rows = words[1].toInt();
+    cols = words[2].toInt();
+    isMask = words[0][1] == 'B';
+    encoding = SimmatEncoding::parse(words);
+    negate = !isMask && ((format[0] == 'D') ^ matrix.get<bool>("negate", false));
+
+    dataOffset = file.pos();
+    if (file.size() - dataOffset != qint64(rows) * cols * (isMask ? sizeof(BEE::MaskValue) : encoding.elemSize()))
+        qFatal("Expected %s to contain a %d by %d matrix.", qPrintable(matrix.name), rows, cols);
+}
+
+qint64 MatrixStream::rowSize() const
+{
+    return qint64(cols) * (isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue));
+}
+
+Mat MatrixStream::read(int n)
+{
+    // Only the stored bytes are read, narrower encodings are decoded here
+    const int type = isMask ? OpenCVType<BEE::MaskValue,1>::make()
+                            : ((encoding.type == SimmatEncoding::Float32) ? OpenCVType<BEE::SimmatValue,1>::make()
+                                                                         : ((encoding.type == SimmatEncoding::UInt8) ? CV_8UC1 : CV_16UC1));
+    Mat m(n, cols, type);
+    const qint64 bytes = qint64(n) * cols * m.elemSize();
+    if (file.read((char*)m.data, bytes) != bytes)
+        qFatal("Didn't read complete row!");
+    if (!isMask) m = encoding.decode(m);
+    if (negate) m.convertTo(m, -1, -1);
+    return m;
+}
+
+void MatrixStream::rewind()
+{
+    file.seek(dataOffset);
 }
 
 void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset)
@@ -221,7 +404,29 @@ void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *que
 void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset)
 {
     qDebug("Writing %s header to %s %s.", qPrintable(matrix), qPrintable(targetSigset), qPrintable(querySigset));
-    writeMatrix(readMatrix(matrix), matrix, targetSigset, querySigset);
+
+    // Only the sigsets change, the scores are kept as stored rather than decoded and re-encoded
+    QFile file(matrix);
+    if (!file.open(QFile::ReadOnly))
+        qFatal("Unable to open %s for reading.", qPrintable(matrix));
+    const QByteArray format = file.readLine();
+    if (format[1] != '2') qFatal("Invalid matrix header.");
+    file.readLine();
+    file.readLine();
+    const QStringList words = QString(file.readLine()).split(" ");
+    const int rows = words[1].toInt();
+    const int cols = words[2].toInt();
+    const bool isMask = words[0][1] == 'B';
+    const QByteArray data = file.readAll();
+    file.close();
+
+    QByteArray header = matrixHeader(rows, cols, isMask, targetSigset, querySigset, SimmatEncoding::parse(words));
+    header[0] = format[0]; // Distance matrices stay distances
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Unable to open %s for writing.", qPrintable(matrix));
+    file.write(header);
+    file.write(data);
+    file.close();
 }
 
 void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask)
@@ -256,96 +461,79 @@ void makePairwiseMask(const QString &targetInput, const QString &queryInput, con
     }
 }
 
-Mat makePairwiseMask(const FileList &targets, const FileList &queries, int partition)
+static int id(QHash<QString,int> &ids, const QString &key)
 {
-    // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    const QStringList targetLabels = File::get<QString>(targets, "Label", "-1");
-    const QStringList queryLabels = File::get<QString>(queries, "Label", "-1");
-    const QList<int> targetPartitions = targets.crossValidationPartitions();
-    const QList<int> queryPartitions = queries.crossValidationPartitions();
-
-    Mat mask(queries.size(), 1, CV_8UC1);
-    for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
-
-        const QString &fileB = targets[i];
-        const QString labelB = targetLabels[i];
-        const int partitionB = targetPartitions[i];
-
-        MaskValue val;
-        if      (fileA == fileB)           val = DontCare;
-        else if (labelA == "-1")           val = DontCare;
-        else if (labelB == "-1")           val = DontCare;
-        else if (partitionA != partition)  val = DontCare;
-        else if (partitionB == -1)         val = NonMatch;
-        else if (partitionB != partition)  val = DontCare;
-        else if (labelA == labelB)         val = Match;
-        else                               val = NonMatch;
-        mask.at<MaskValue>(i,0) = val;
-    }
-
-    return mask;
+    QHash<QString,int>::iterator it = ids.find(key);
+    if (it == ids.end()) it = ids.insert(key, ids.size());
+    return it.value();
 }
 
-Mat makeMask(const FileList &targets, const FileList &queries, int partition)
+ImplicitMask::ImplicitMask(const FileList &targets, const FileList &queries, int partition, bool _pairwise)
+    : pairwise(_pairwise)
 {
-    // TODO: Direct use of "Label" isn't general, also would prefer to use indexProperty, rather than
-    // doing string comparisons (but that isn't implemented yet for FileList) -cao
-    const QStringList targetLabels = File::get<QString>(targets, "Label", "-1");
-    const QStringList queryLabels = File::get<QString>(queries, "Label", "-1");
-    const QList<int> targetPartitions = targets.crossValidationPartitions();
-    const QList<int> queryPartitions = queries.crossValidationPartitions();
-
-    Mat mask(queries.size(), targets.size(), CV_8UC1);
-    for (int i=0; i<queries.size(); i++) {
-        const QString &fileA = queries[i];
-        const QString labelA = queryLabels[i];
-        const int partitionA = queryPartitions[i];
+    if (pairwise && (targets.size() != queries.size()))
+        qFatal("Pairwise mask requires equal length target and query sets.");
+
+    // TODO: Direct use of "Label" isn't general -cao
+    const QStringList targetLabelNames = File::get<QString>(targets, "Label", "-1");
+    const QStringList queryLabelNames = File::get<QString>(queries, "Label", "-1");
+    const QList<int> targetPartitionList = targets.crossValidationPartitions();
+    const QList<int> queryPartitionList = queries.crossValidationPartitions();
+
+    // Labels and file names are resolved to integers once, rather than compared as strings per pair
+    QHash<QString,int> names, labels;
+    targetLabels.reserve(targets.size());
+    targetNames.reserve(targets.size());
+    for (int j=0; j<targets.size(); j++) {
+        const int partitionB = targetPartitionList[j];
+        targetNames.append(id(names, targets[j].name));
+        if      (targetLabelNames[j] == "-1")                    targetLabels.append(-1);
+        else if (partitionB == -1)                               targetLabels.append(-2);
+        else if ((partition >= 0) && (partitionB != partition))  targetLabels.append(-1);
+        else                                                     targetLabels.append(id(labels, targetLabelNames[j]));
+    }
 
-        for (int j=0; j<targets.size(); j++) {
-            const QString &fileB = targets[j];
-            const QString labelB = targetLabels[j];
-            const int partitionB = targetPartitions[j];
+    queryLabels.reserve(queries.size());
+    queryNames.reserve(queries.size());
+    for (int i=0; i<queries.size(); i++) {
+        queryNames.append(id(names, queries[i].name));
+        if      (queryLabelNames[i] == "-1")                                     queryLabels.append(-1);
+        else if ((partition >= 0) && (queryPartitionList[i] != partition))       queryLabels.append(-1);
+        else                                                                     queryLabels.append(id(labels, queryLabelNames[i]));
+    }
 
-            MaskValue val;
-            if      (fileA == fileB)           val = DontCare;
-            else if (labelA == "-1")           val = DontCare;
-            else if (labelB == "-1")           val = DontCare;
-            else if (partitionA != partition)  val = DontCare;
-            else if (partitionB == -1)         val = NonMatch;
-            else if (partitionB != partition)  val = DontCare;
-            else if (labelA == labelB)         val = Match;
-            else                               val = NonMatch;
-            mask.at<MaskValue>(i,j) = val;
-        }
+    if (partition < 0) {
+        targetPartitions = targetPartitionList.toVector();
+        queryPartitions = queryPartitionList.toVector();
     }
+}
 
+Mat ImplicitMask::toMat(int row, int rows) const
+{
+    if (rows < 0) rows = this->rows() - row;
+    Mat mask(rows, cols(), CV_8UC1);
+    for (int i=0; i<rows; i++) {
+        MaskValue *values = mask.ptr<MaskValue>(i);
+        for (int j=0; j<mask.cols; j++)
+            values[j] = at(row+i, j);
+    }
     return mask;
 }
 
-void combineMasks(const QStringList &inputMasks, const QString &outputMask, const QString &method)
+Mat makePairwiseMask(const FileList &targets, const FileList &queries, int partition)
 {
-    qDebug("Combining %d masks to %s with method %s", inputMasks.size(), qPrintable(outputMask), qPrintable(method));
-
-    bool AND = true;
-    if      (method == "And") AND = true;
-    else if (method == "Or")  AND = false;
-    else                      qFatal("Invalid method.");
+    return ImplicitMask(targets, queries, partition, true).toMat();
+}
 
-    QList<Mat> masks;
-    foreach (const QString &inputMask, inputMasks)
-        masks.append(readMatrix(inputMask));
-    if (masks.size() < 2)
-        qFatal("Expected at least two masks.");
+Mat makeMask(const FileList &targets, const FileList &queries, int partition)
+{
+    return ImplicitMask(targets, queries, partition).toMat();
+}
 
-    const int rows = masks.first().rows;
-    const int columns = masks.first().cols;
-    Mat combinedMask(rows, columns, CV_8UC1);
-    for (int i=0; i<rows; i++) {
-        for (int j=0; j<columns; j++) {
+static void combineMaskBlock(const QList<Mat> &masks, bool AND, Mat &dst)
+{
+    for (int i=0; i<dst.rows; i++) {
+        for (int j=0; j<dst.cols; j++) {
             int genuineCount = 0;
             int imposterCount = 0;
             int dontcareCount = 0;
@@ -369,11 +557,55 @@ void combineMasks(const QStringList &inputMasks, const QString &outputMask, cons
             else if (imposterCount > 0) val = NonMatch;
             else                        val = DontCare;
             if (AND && (dontcareCount > 0)) val = DontCare;
-            combinedMask.at<MaskValue>(i,j) = val;
+            dst.at<MaskValue>(i,j) = val;
         }
     }
+}
 
-    writeMatrix(combinedMask, outputMask, "Combined_Targets", "Combined_Queries");
+void combineMasks(const QStringList &inputMasks, const QString &outputMask, const QString &method)
+{
+    qDebug("Combining %d masks to %s with method %s", inputMasks.size(), qPrintable(outputMask), qPrintable(method));
+
+    bool AND = true;
+    if      (method == "And") AND = true;
+    else if (method == "Or")  AND = false;
+    else                      qFatal("Invalid method.");
+
+    if (inputMasks.size() < 2)
+        qFatal("Expected at least two masks.");
+    if (inputMasks.contains(outputMask))
+        qFatal("Combined mask %s can't overwrite one of its inputs.", qPrintable(outputMask));
+
+    // Masks are read a block of rows at a time, so memory is bounded regardless of their size
+    QList< QSharedPointer<MatrixStream> > streams;
+    foreach (const QString &inputMask, inputMasks) {
+        streams.append(QSharedPointer<MatrixStream>(new MatrixStream(inputMask)));
+        const MatrixStream &first = *streams.first(), &current = *streams.last();
+        if (!current.isMask || (first.rows != current.rows) || (first.cols != current.cols))
+            qFatal("Combined matrices must be masks of the same size.");
+    }
+
+    const int rows = streams.first()->rows;
+    const int columns = streams.first()->cols;
+
+    QFile file(outputMask);
+    QtUtils::touchDir(file);
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Unable to open %s for writing.", qPrintable(outputMask));
+    file.write(matrixHeader(rows, columns, true, "Combined_Targets", "Combined_Queries"));
+
+    // Roughly 64 MB of mask values per block across all masks
+    const int blockRows = std::max(1, int((64 << 20) / std::max(streams.size() * streams.first()->rowSize(), qint64(1))));
+    for (int row=0; row<rows; row+=blockRows) {
+        const int n = std::min(blockRows, rows - row);
+        QList<Mat> blocks;
+        for (int k=0; k<streams.size(); k++)
+            blocks.append(streams[k]->read(n));
+        Mat combinedBlock(n, columns, CV_8UC1);
+        combineMaskBlock(blocks, AND, combinedBlock);
+        file.write((const char*)combinedBlock.data, qint64(n) * columns * sizeof(MaskValue));
+    }
+    file.close();
 }
 
 } // namespace BEE
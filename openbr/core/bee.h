@@ -17,6 +17,7 @@
 #ifndef BEE_BEE_H
 #define BEE_BEE_H
 
+#include <QFile>
 #include <QString>
 #include <QStringList>
 #include <opencv2/core/core.hpp>
@@ -33,17 +34,90 @@ namespace BEE
     const MaskValue NonMatch(0x7f);
     const MaskValue DontCare(0x00);
 
+    // How similarity matrix scores are stored, a score is offset + scale * the stored value.
+    // Integer encodings reserve zero for scores that were never set, half precision stores them as negative infinity.
+    struct SimmatEncoding
+    {
+        enum Type { Float32, Float16, UInt16, UInt8 };
+        Type type;
+        float scale, offset;
+
+        SimmatEncoding(Type type = Float32, float scale = 1, float offset = 0);
+        static SimmatEncoding fromRange(Type type, float lower, float upper); // Integer levels spanning [lower, upper]
+        static SimmatEncoding parse(const QStringList &words); // From the size line of a matrix header
+
+        char code() const;
+        int elemSize() const;
+        QByteArray header() const; // Appended to the size line, empty for Float32
+
+        cv::Mat encode(const cv::Mat &scores, qint64 *clipped = NULL) const; // Scores outside the representable range saturate
+        cv::Mat decode(const cv::Mat &stored) const;
+        void decode(const void *stored, float *scores, int n) const;
+    };
+
     // Sigset
     br::FileList readSigset(const br::File &sigset, bool ignoreMetadata = false);
     void writeSigset(const QString &sigset, const br::FileList &files, bool ignoreMetadata = false);
 
     // Matrix
     cv::Mat readMatrix(const br::File &mat, QString *targetSigset = NULL, QString *querySigset = NULL);
-    void writeMatrix(const cv::Mat &m, const QString &fileName, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+    void writeMatrix(const cv::Mat &m, const QString &fileName, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query", const SimmatEncoding &encoding = SimmatEncoding());
     void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset);
     void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset);
+    QByteArray matrixHeader(int rows, int cols, bool isMask, const QString &targetSigset, const QString &querySigset, const SimmatEncoding &encoding = SimmatEncoding());
+
+    // Reads a matrix a block of rows at a time
+    class MatrixStream
+    {
+    public:
+        QString target, query;
+        int rows, cols;
+        bool isMask;
+        SimmatEncoding encoding;
+
+        MatrixStream(const br::File &matrix);
+        qint64 rowSize() const; // In memory once read, scores are always decoded to SimmatValue
+        cv::Mat read(int n); // The next n rows
+        void rewind();
+
+    private:
+        QFile file;
+        bool negate;
+        qint64 dataOffset;
+    };
 
     // Mask
+    // Mask values computed on demand from label, partition and file name IDs, without a dense matrix.
+    // Non-negative partitions follow makeMask, a negative partition compares each query to targets in its own partition.
+    class ImplicitMask
+    {
+    public:
+        ImplicitMask() : pairwise(false) {}
+        ImplicitMask(const br::FileList &targets, const br::FileList &queries, int partition = 0, bool pairwise = false);
+
+        int rows() const { return queryLabels.size(); }
+        int cols() const { return pairwise ? 1 : targetLabels.size(); }
+        int subject(int query) const { return queryLabels[query]; } // Label ID of the query
+
+        inline MaskValue at(int query, int target) const
+        {
+            if (pairwise) target = query;
+            const int queryLabel = queryLabels[query];
+            const int targetLabel = targetLabels[target];
+            if ((queryLabel == -1) || (targetLabel == -1) || (queryNames[query] == targetNames[target])) return DontCare;
+            if (!queryPartitions.isEmpty() && (targetLabel != -2) && (targetPartitions[target] != queryPartitions[query])) return DontCare;
+            return (queryLabel == targetLabel) ? Match : NonMatch;
+        }
+
+        cv::Mat toMat(int row = 0, int rows = -1) const; // Materializes rows [row, row+rows)
+
+    private:
+        bool pairwise;
+        QVector<int> targetLabels, queryLabels; // -1 is ignored, -2 only forms impostor pairs
+        QVector<int> targetNames, queryNames;
+        QVector<int> targetPartitions, queryPartitions; // Only used for negative partitions
+    };
+
     void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask);
     cv::Mat makeMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
     void makePairwiseMask(const QString &targetInput, const QString &queryInput, const QString &mask);
@@ -1,3 +1,6 @@
+#include <QFutureSynchronizer>
+#include <QThread>
+#include <QtConcurrent>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include "boost.h"
@@ -791,17 +794,42 @@ struct FeatureValOnlyPrecalc : ParallelLoopBody
     int sample_count;
 };
 
+// Features are divided into a few chunks per thread
+static int featureChunks(int features)
+{
+    return std::max(1, std::min(features, 4 * std::max(1, QThread::idealThreadCount())));
+}
+
+static void runFeatureRange(const ParallelLoopBody *body, Range range)
+{
+    (*body)(range);
+}
+
+// cv::parallel_for_ runs serially in OpenCV builds without a threading backend
+static void parallelFeatures(const Range &range, const ParallelLoopBody &body)
+{
+    const int features = range.end - range.start;
+    if (features <= 0)
+        return;
+
+    const int chunks = featureChunks(features);
+    QFutureSynchronizer<void> futures;
+    for (int i = 0; i < chunks; i++)
+        futures.addFuture(QtConcurrent::run(runFeatureRange, &body, Range(range.start + features*i/chunks, range.start + features*(i+1)/chunks)));
+    futures.waitForFinished();
+}
+
 void CascadeBoostTrainData::precalculate()
 {
     int minNum = MIN( numPrecalcVal, numPrecalcIdx);
 
     double proctime = -TIME( 0 );
-    parallel_for_( Range(numPrecalcVal, numPrecalcIdx),
-                   FeatureIdxOnlyPrecalc(featureEvaluator, buf, sample_count, is_buf_16u!=0) );
-    parallel_for_( Range(0, minNum),
-                   FeatureValAndIdxPrecalc(featureEvaluator, buf, &valCache, sample_count, is_buf_16u!=0) );
-    parallel_for_( Range(minNum, numPrecalcVal),
-                   FeatureValOnlyPrecalc(featureEvaluator, &valCache, sample_count) );        
+    parallelFeatures( Range(numPrecalcVal, numPrecalcIdx),
+                      FeatureIdxOnlyPrecalc(featureEvaluator, buf, sample_count, is_buf_16u!=0) );
+    parallelFeatures( Range(0, minNum),
+                      FeatureValAndIdxPrecalc(featureEvaluator, buf, &valCache, sample_count, is_buf_16u!=0) );
+    parallelFeatures( Range(minNum, numPrecalcVal),
+                      FeatureValOnlyPrecalc(featureEvaluator, &valCache, sample_count) );
     cout << "Precalculation time: " << (proctime + TIME( 0 )) << endl;
 }
 
@@ -834,45 +862,91 @@ CvDTreeNode* CascadeBoostTree::predict( int sampleIdx ) const
     return node;
 }
 
-void CascadeBoostTree::split_node_data( CvDTreeNode* node )
+CvDTreeSplit* CascadeBoostTree::find_best_split( CvDTreeNode* node )
 {
-    int n = node->sample_count, nl, nr, scount = data->sample_count;
-    char* dir = (char*)data->direction->data.ptr;
-    CvDTreeNode *left = 0, *right = 0;
-    int* newIdx = data->split_buf->data.i;
-    int newBufIdx = data->get_child_buf_idx( node );
-    int workVarCount = data->get_work_var_count();
-    CvMat* buf = data->buf;
-    size_t length_buf_row = data->get_length_subbuf();
-    cv::AutoBuffer<uchar> inn_buf(n*(3*sizeof(int)+sizeof(float)));
-    int* tempBuf = (int*)(uchar*)inn_buf;
-    bool splitInputData;
+    const int splitSize = data->split_heap->elem_size;
+    const int chunks = featureChunks(data->var_count);
 
-    complete_node_dir(node);
+    // The best split of each chunk of features
+    cv::AutoBuffer<uchar> splitsBuf(chunks*splitSize);
+    QFutureSynchronizer<void> futures;
+    for (int i = 0; i < chunks; i++)
+    {
+        CvDTreeSplit* split = (CvDTreeSplit*)((uchar*)splitsBuf + i*splitSize);
+        memset(split, 0, splitSize);
+        split->quality = -1;
+        split->condensed_idx = INT_MIN;
+        futures.addFuture(QtConcurrent::run(this, &CascadeBoostTree::findBestSplit, node,
+                                            data->var_count*i/chunks, data->var_count*(i+1)/chunks, split));
+    }
+    futures.waitForFinished();
 
-    for( int i = nl = nr = 0; i < n; i++ )
+    // Reduced in feature order, so ties go to the lowest feature index as in the serial search
+    CvDTreeSplit* best = (CvDTreeSplit*)(uchar*)splitsBuf;
+    for (int i = 1; i < chunks; i++)
     {
-        int d = dir[i];
-        // initialize new indices for splitting ordered variables
-        newIdx[i] = (nl & (d-1)) | (nr & -d); // d ? ri : li
-        nr += d;
-        nl += d^1;
+        CvDTreeSplit* split = (CvDTreeSplit*)((uchar*)splitsBuf + i*splitSize);
+        if (best->quality < split->quality)
+            best = split;
     }
 
-    node->left = left = data->new_node( node, nl, newBufIdx, node->offset );
-    node->right = right = data->new_node( node, nr, newBufIdx, node->offset + nl );
+    CvDTreeSplit* bestSplit = 0;
+    if (best->quality > 0)
+    {
+        bestSplit = data->new_split_cat( 0, -1.0f );
+        memcpy( bestSplit, best, splitSize );
+    }
+    return bestSplit;
+}
 
-    splitInputData = node->depth + 1 < data->params.max_depth &&
-        (node->left->sample_count > data->params.min_sample_count ||
-        node->right->sample_count > data->params.min_sample_count);
+// Mirrors cv::DTreeBestSplitFinder over [begin, end)
+void CascadeBoostTree::findBestSplit( CvDTreeNode* node, int begin, int end, CvDTreeSplit* bestSplit )
+{
+    const int splitSize = data->split_heap->elem_size;
+    cv::AutoBuffer<uchar> splitBuf(splitSize);
+    CvDTreeSplit* split = (CvDTreeSplit*)(uchar*)splitBuf;
+    memset(split, 0, splitSize);
 
-    // split ordered variables, keep both halves sorted.
-    for( int vi = 0; vi < ((CascadeBoostTrainData*)data)->numPrecalcIdx; vi++ )
+    const int n = node->sample_count;
+    cv::AutoBuffer<uchar> inn_buf(2*n*(sizeof(int) + sizeof(float)));
+
+    for( int vi = begin; vi < end; vi++ )
     {
+        CvDTreeSplit *res;
         int ci = data->get_var_type(vi);
-        if( ci >= 0 || !splitInputData )
+        if( node->get_num_valid(vi) <= 1 )
             continue;
 
+        if( data->is_classifier )
+            res = ci >= 0 ? find_split_cat_class( node, vi, bestSplit->quality, split, (uchar*)inn_buf ) :
+                find_split_ord_class( node, vi, bestSplit->quality, split, (uchar*)inn_buf );
+        else
+            res = ci >= 0 ? find_split_cat_reg( node, vi, bestSplit->quality, split, (uchar*)inn_buf ) :
+                find_split_ord_reg( node, vi, bestSplit->quality, split, (uchar*)inn_buf );
+
+        if( res && bestSplit->quality < split->quality )
+            memcpy( bestSplit, split, splitSize );
+    }
+}
+
+void CascadeBoostTree::splitSortedIndices( const SortedSplit* sortedSplit, int begin, int end )
+{
+    CvDTreeNode* node = sortedSplit->node;
+    CvDTreeNode* left = sortedSplit->left;
+    CvDTreeNode* right = sortedSplit->right;
+    const char* dir = sortedSplit->dir;
+    const int* newIdx = sortedSplit->newIdx;
+    int n = node->sample_count, nl = left->sample_count, scount = data->sample_count;
+    CvMat* buf = data->buf;
+    size_t length_buf_row = data->get_length_subbuf();
+    cv::AutoBuffer<uchar> inn_buf(n*(3*sizeof(int)+sizeof(float)));
+    int* tempBuf = (int*)(uchar*)inn_buf;
+
+    for( int vi = begin; vi < end; vi++ )
+    {
+        int ci = data->get_var_type(vi);
+        if( ci >= 0 )
+            continue;
         int n1 = node->get_num_valid(vi);
         float *src_val_buf = (float*)(tempBuf + n);
         int *src_sorted_idx_buf = (int*)(src_val_buf + n);
@@ -938,6 +1012,58 @@ void CascadeBoostTree::split_node_data( CvDTreeNode* node )
             CV_Assert( n1 == n );
         }
     }
+}
+
+void CascadeBoostTree::split_node_data( CvDTreeNode* node )
+{
+    int n = node->sample_count, nl, nr, scount = data->sample_count;
+    char* dir = (char*)data->direction->data.ptr;
+    CvDTreeNode *left = 0, *right = 0;
+    int* newIdx = data->split_buf->data.i;
+    int newBufIdx = data->get_child_buf_idx( node );
+    int workVarCount = data->get_work_var_count();
+    CvMat* buf = data->buf;
+    size_t length_buf_row = data->get_length_subbuf();
+    cv::AutoBuffer<uchar> inn_buf(n*(3*sizeof(int)+sizeof(float)));
+    int* tempBuf = (int*)(uchar*)inn_buf;
+    bool splitInputData;
+
+    complete_node_dir(node);
+
+    for( int i = nl = nr = 0; i < n; i++ )
+    {
+        int d = dir[i];
+        // initialize new indices for splitting ordered variables
+        newIdx[i] = (nl & (d-1)) | (nr & -d); // d ? ri : li
+        nr += d;
+        nl += d^1;
+    }
+
+    node->left = left = data->new_node( node, nl, newBufIdx, node->offset );
+    node->right = right = data->new_node( node, nr, newBufIdx, node->offset + nl );
+
+    splitInputData = node->depth + 1 < data->params.max_depth &&
+        (node->left->sample_count > data->params.min_sample_count ||
+        node->right->sample_count > data->params.min_sample_count);
+
+    // split ordered variables, keep both halves sorted.
+    if (splitInputData)
+    {
+        SortedSplit sortedSplit;
+        sortedSplit.node = node;
+        sortedSplit.left = left;
+        sortedSplit.right = right;
+        sortedSplit.dir = dir;
+        sortedSplit.newIdx = newIdx;
+
+        const int numPrecalcIdx = ((CascadeBoostTrainData*)data)->numPrecalcIdx;
+        const int chunks = featureChunks(numPrecalcIdx);
+        QFutureSynchronizer<void> futures;
+        for (int i = 0; i < chunks; i++)
+            futures.addFuture(QtConcurrent::run(this, &CascadeBoostTree::splitSortedIndices, &sortedSplit,
+                                                numPrecalcIdx*i/chunks, numPrecalcIdx*(i+1)/chunks));
+        futures.waitForFinished();
+    }
 
     // split cv_labels using newIdx relocation table
     int *src_lbls_buf = tempBuf + n;
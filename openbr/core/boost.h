@@ -48,7 +48,19 @@ public:
     virtual CvDTreeNode* predict(int sampleIdx) const;
 
 protected:
+    virtual CvDTreeSplit* find_best_split(CvDTreeNode* n);
     virtual void split_node_data(CvDTreeNode* n);
+
+private:
+    struct SortedSplit
+    {
+        CvDTreeNode *node, *left, *right;
+        const char *dir;
+        const int *newIdx;
+    };
+
+    void findBestSplit(CvDTreeNode* n, int begin, int end, CvDTreeSplit* bestSplit);
+    void splitSortedIndices(const SortedSplit* sortedSplit, int begin, int end);
 };
 
 class CascadeBoost : public CvBoost
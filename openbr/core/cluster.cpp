@@ -1,519 +1,1089 @@
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Copyright 2012 The MITRE Corporation                                      *
- *                                                                           *
- * Licensed under the Apache License, Version 2.0 (the "License");           *
- * you may not use this file except in compliance with the License.          *
- * You may obtain a copy of the License at                                   *
- *                                                                           *
- *     http://www.apache.org/licenses/LICENSE-2.0                            *
- *                                                                           *
- * Unless required by applicable law or agreed to in writing, software       *
- * distributed under the License is distributed on an "AS IS" BASIS,         *
- * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
- * See the License for the specific language governing permissions and       *
- * limitations under the License.                                            *
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-
-#include <QDebug>
-#include <QFile>
-#include <QHash>
-#include <QPair>
-#include <QSet>
-#include <limits>
-#include <openbr/openbr_plugin.h>
-#include <assert.h>
-
-#include "openbr/core/bee.h"
-#include "openbr/core/cluster.h"
-#include "openbr/plugins/openbr_internal.h"
-
-using namespace br;
-
-// Compare function used to order neighbors from highest to lowest similarity
-bool br::compareNeighbors(const Neighbor &a, const Neighbor &b)
-{
-    if (a.second == b.second)
-        return a.first < b.first;
-    return a.second > b.second;
-}
-
-// Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
-// Ob(x) in eq. 1, modified to consider 0/1 as ground truth imposter/genuine.
-static int indexOf(const Neighbors &neighbors, int i)
-{
-    for (int j=0; j<neighbors.size(); j++) {
-        const Neighbor &neighbor = neighbors[j];
-        if (neighbor.first == i) {
-            if      (neighbor.second == 0) return neighbors.size()-1;
-            else if (neighbor.second == 1) return 0;
-            else                           return j;
-        }
-    }
-    return -1;
-}
-
-// Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
-// Corresponds to eq. 1, or D(a,b)
-static int asymmetricalROD(const Neighborhood &neighborhood, int a, int b)
-{
-    int distance = 0;
-    foreach (const Neighbor &neighbor, neighborhood[a]) {
-        if (neighbor.first == b) break;
-        int index = indexOf(neighborhood[b], neighbor.first);
-        distance += (index == -1) ? neighborhood[b].size() : index;
-    }
-    return distance;
-}
-
-// Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
-// Corresponds to eq. 2/4, or D-R(a,b)
-float normalizedROD(const Neighborhood &neighborhood, int a, int b)
-{
-    int indexA = indexOf(neighborhood[b], a);
-    int indexB = indexOf(neighborhood[a], b);
-
-    // Default behaviors
-    if ((indexA == -1) || (indexB == -1)) return std::numeric_limits<float>::max();
-    if ((neighborhood[b][indexA].second == 1) || (neighborhood[a][indexB].second == 1)) return 0;
-    if ((neighborhood[b][indexA].second == 0) || (neighborhood[a][indexB].second == 0)) return std::numeric_limits<float>::max();
-
-    int distanceA = asymmetricalROD(neighborhood, a, b);
-    int distanceB = asymmetricalROD(neighborhood, b, a);
-    return 1.f * (distanceA + distanceB) / std::min(indexA+1, indexB+1);
-}
-
-Neighborhood br::knnFromSimmat(const QList<cv::Mat> &simmats, int k)
-{
-    Neighborhood neighborhood;
-
-    float globalMax = -std::numeric_limits<float>::max();
-    float globalMin = std::numeric_limits<float>::max();
-    int numGalleries = (int)sqrt((float)simmats.size());
-    if (numGalleries*numGalleries != simmats.size())
-        qFatal("Incorrect number of similarity matrices.");
-
-    // Process each simmat
-    for (int i=0; i<numGalleries; i++) {
-        QVector<Neighbors> allNeighbors;
-
-        int currentRows = -1;
-        int columnOffset = 0;
-        for (int j=0; j<numGalleries; j++) {
-            cv::Mat m = simmats[i * numGalleries + j];
-            if (j==0) {
-                currentRows = m.rows;
-                allNeighbors.resize(currentRows);
-            }
-            if (currentRows != m.rows) qFatal("Row count mismatch.");
-
-            // Get data row by row
-            for (int k=0; k<m.rows; k++) {
-                Neighbors &neighbors = allNeighbors[k];
-                neighbors.reserve(neighbors.size() + m.cols);
-                for (int l=0; l<m.cols; l++) {
-                    float val = m.at<float>(k,l);
-                    if ((i==j) && (k==l)) continue; // Skips self-similarity scores
-
-                    if (val != -std::numeric_limits<float>::max()
-                        && val != -std::numeric_limits<float>::infinity()
-                        && val != std::numeric_limits<float>::infinity()) {
-                        globalMax = std::max(globalMax, val);
-                        globalMin = std::min(globalMin, val);
-                    }
-                    neighbors.append(Neighbor(l+columnOffset, val));
-                }
-            }
-
-            columnOffset += m.cols;
-        }
-
-        // Keep the top matches
-        for (int j=0; j<allNeighbors.size(); j++) {
-            Neighbors &val = allNeighbors[j];
-            const int cutoff = k; // Number of neighbors to keep
-            int keep = std::min(cutoff, val.size());
-            std::partial_sort(val.begin(), val.begin()+keep, val.end(), compareNeighbors);
-            neighborhood.append((Neighbors)val.mid(0, keep));
-        }
-    }
-
-    return neighborhood;
-}
-
-// generate k-NN graph from pre-computed similarity matrices 
-Neighborhood br::knnFromSimmat(const QStringList &simmats, int k)
-{
-    QList<cv::Mat> mats;
-    foreach (const QString &simmat, simmats) {
-        QScopedPointer<br::Format> format(br::Factory<br::Format>::make(simmat));
-        br::Template t = format->read();
-        mats.append(t);
-    }
-    return knnFromSimmat(mats, k);
-}
-
-TemplateList knnFromGallery(const QString & galleryName, bool inMemory, const QString & outFile, int k)
-{
-    QSharedPointer<Transform> comparison = Transform::fromComparison(Globals->algorithm);
-
-    Gallery *tempG = Gallery::make(galleryName);
-    qint64 total = tempG->totalSize();
-    delete tempG;
-    comparison->setPropertyRecursive("galleryName", galleryName+"[dropMetadata=true]");
-
-    bool multiProcess = Globals->file.getBool("multiProcess", false);
-    if (multiProcess)
-        comparison = QSharedPointer<Transform> (br::wrapTransform(comparison.data(), "ProcessWrapper"));
-
-    QScopedPointer<Transform> collect(Transform::make("CollectNN+ProgressCounter+Discard", NULL));
-    collect->setPropertyRecursive("totalProgress", total);
-    collect->setPropertyRecursive("keep", k);
-
-    QList<Transform *> tforms;
-    tforms.append(comparison.data());
-    tforms.append(collect.data());
-
-    QScopedPointer<Transform> compareCollect(br::pipeTransforms(tforms));
-
-    QSharedPointer <Transform> projector;
-    if (inMemory)
-        projector = QSharedPointer<Transform> (br::wrapTransform(compareCollect.data(), "Stream(readMode=StreamGallery, endPoint=Discard"));
-    else
-        projector = QSharedPointer<Transform> (br::wrapTransform(compareCollect.data(), "Stream(readMode=StreamGallery, endPoint=LogNN("+outFile+")+DiscardTemplates)"));
-
-    TemplateList input;
-    input.append(Template(galleryName));
-    TemplateList output;
-
-    projector->init();
-    projector->projectUpdate(input, output);
-
-    return output;
-}
- 
-// Generate k-NN graph from a gallery, using the current algorithm for comparison.
-// Direct serialization to file system, k-NN graph is not retained in memory
-void br::knnFromGallery(const QString &galleryName, const QString &outFile, int k)
-{
-    knnFromGallery(galleryName, false, outFile, k);
-}
-
-// In-memory graph construction
-Neighborhood br::knnFromGallery(const QString &gallery, int k)
-{
-    // Nearest neighbor data current stored as template metadata, so retrieve it
-    TemplateList res = knnFromGallery(gallery, true, "", k);
-
-    Neighborhood neighborhood;
-    foreach (const Template &t, res) {
-        Neighbors neighbors = t.file.get<Neighbors>("neighbors");
-        neighbors.append(neighbors);
-    }
-
-    return neighborhood;
-}
-
-Neighborhood br::loadkNN(const QString &infile)
-{
-    Neighborhood neighborhood;
-    QFile file(infile);
-    bool success = file.open(QFile::ReadOnly);
-    if (!success) qFatal("Failed to open %s for reading.", qPrintable(infile));
-    QStringList lines = QString(file.readAll()).split("\n");
-    file.close();
-    int min_idx = INT_MAX;
-    int max_idx = -1;
-    int count = 0;
-
-    foreach (const QString &line, lines) {
-        Neighbors neighbors;
-        count++;
-        if (line.trimmed().isEmpty()) {
-            neighborhood.append(neighbors);
-            continue;
-        }
-        bool off = false;
-        QStringList list = line.trimmed().split(",", QString::SkipEmptyParts);
-        foreach (const QString &item, list) {
-            QStringList parts = item.trimmed().split(":", QString::SkipEmptyParts);
-            bool intOK = true;
-            bool floatOK = true;
-            int idx = parts[0].toInt(&intOK);
-            float score = parts[1].toFloat(&floatOK);
-
-            if (idx > max_idx)
-                max_idx = idx;
-            if (idx  <min_idx)
-                min_idx = idx;
-
-            if (idx >= lines.size()) {
-                off = true;
-                continue;
-            }
-            neighbors.append(qMakePair(idx, score));
-
-
-            if (!intOK && floatOK)
-                qFatal("Failed to parse word: %s", qPrintable(item));
-        }
-        neighborhood.append(neighbors);
-    }
-    return neighborhood;
-}
-
-bool br::savekNN(const Neighborhood &neighborhood, const QString &outfile)
-{
-    QFile file(outfile);
-    bool success = file.open(QFile::WriteOnly);
-    if (!success) qFatal("Failed to open %s for writing.", qPrintable(outfile));
-
-    foreach (Neighbors neighbors, neighborhood) {
-        QString aLine;
-        if (!neighbors.empty())
-        {
-            aLine.append(QString::number(neighbors[0].first)+":"+QString::number(neighbors[0].second));
-            for (int i=1; i < neighbors.size();i++) {
-                aLine.append(","+QString::number(neighbors[i].first)+":"+QString::number(neighbors[i].second));
-            }
-        }
-        aLine += "\n";
-        file.write(qPrintable(aLine));
-    }
-    file.close();
-    return true;
-}
-
-
-// Rank-order clustering on a pre-computed k-NN graph
-Clusters br::ClusterGraph(Neighborhood neighborhood, float aggressiveness, const QString &csv)
-{
-
-    const int cutoff = neighborhood.first().size();
-    const float threshold = 3*cutoff/4 * aggressiveness/5;
-
-    // Initialize clusters
-    Clusters clusters(neighborhood.size());
-    for (int i=0; i<neighborhood.size(); i++)
-        clusters[i].append(i);
-
-    bool done = false;
-    while (!done) {
-        // nextClusterIds[i] = j means that cluster i is set to merge into cluster j
-        QVector<int> nextClusterIDs(neighborhood.size());
-        for (int i=0; i<neighborhood.size(); i++) nextClusterIDs[i] = i;
-
-        // For each cluster
-        for (int clusterID=0; clusterID<neighborhood.size(); clusterID++) {
-            const Neighbors &neighbors = neighborhood[clusterID];
-            int nextClusterID = nextClusterIDs[clusterID];
-
-            // Check its neighbors
-            foreach (const Neighbor &neighbor, neighbors) {
-                int neighborID = neighbor.first;
-                int nextNeighborID = nextClusterIDs[neighborID];
-
-                // Don't bother if they have already merged
-                if (nextNeighborID == nextClusterID) continue;
-
-                // Flag for merge if similar enough
-                if (normalizedROD(neighborhood, clusterID, neighborID) < threshold) {
-                    if (nextClusterID < nextNeighborID) nextClusterIDs[neighborID] = nextClusterID;
-                    else                                nextClusterIDs[clusterID] = nextNeighborID;
-                }
-            }
-        }
-
-        // Transitive merge
-        for (int i=0; i<neighborhood.size(); i++) {
-            int nextClusterID = i;
-            while (nextClusterID != nextClusterIDs[nextClusterID]) {
-                assert(nextClusterIDs[nextClusterID] < nextClusterID);
-                nextClusterID = nextClusterIDs[nextClusterID];
-            }
-            nextClusterIDs[i] = nextClusterID;
-        }
-
-        // Construct new clusters
-        QHash<int, int> clusterIDLUT;
-        QList<int> allClusterIDs = QSet<int>::fromList(nextClusterIDs.toList()).values();
-        for (int i=0; i<neighborhood.size(); i++)
-            clusterIDLUT[i] = allClusterIDs.indexOf(nextClusterIDs[i]);
-
-        Clusters newClusters(allClusterIDs.size());
-        Neighborhood newNeighborhood(allClusterIDs.size());
-
-        for (int i=0; i<neighborhood.size(); i++) {
-            int newID = clusterIDLUT[i];
-            newClusters[newID].append(clusters[i]);
-            newNeighborhood[newID].append(neighborhood[i]);
-        }
-
-        // Update indices and trim
-        for (int i=0; i<newNeighborhood.size(); i++) {
-            Neighbors &neighbors = newNeighborhood[i];
-            int size = qMin(neighbors.size(),cutoff);
-            std::partial_sort(neighbors.begin(), neighbors.begin()+size, neighbors.end(), compareNeighbors);
-            for (int j=0; j<size; j++)
-                neighbors[j].first = clusterIDLUT[j];
-            neighbors = neighbors.mid(0, cutoff);
-        }
-
-        // Update results
-        done = true; //(newClusters.size() >= clusters.size());
-        clusters = newClusters;
-        neighborhood = newNeighborhood;
-    }
-
-    if (!csv.isEmpty())
-        WriteClusters(clusters, csv);
-
-    return clusters;
-}
-
-Clusters br::ClusterGraph(const QString & knnName, float aggressiveness, const QString &csv)
-{
-    Neighborhood neighbors = loadkNN(knnName);
-    return ClusterGraph(neighbors, aggressiveness, csv);
-}
-
-// Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
-br::Clusters br::ClusterSimmat(const QList<cv::Mat> &simmats, float aggressiveness, const QString &csv)
-{
-    qDebug("Clustering %d simmat(s), aggressiveness %f", simmats.size(), aggressiveness);
-
-    // Read in gallery parts, keeping top neighbors of each template
-    Neighborhood neighborhood = knnFromSimmat(simmats);
-
-    return ClusterGraph(neighborhood, aggressiveness, csv);
-}
-
-br::Clusters br::ClusterSimmat(const QStringList &simmats, float aggressiveness, const QString &csv)
-{
-    QList<cv::Mat> mats;
-    foreach (const QString &simmat, simmats) {
-        QScopedPointer<br::Format> format(br::Factory<br::Format>::make(simmat));
-        br::Template t = format->read();
-        mats.append(t);
-    }
-
-    Clusters clusters = ClusterSimmat(mats, aggressiveness, csv);
-    return clusters;
-}
-
-// Santo Fortunato "Community detection in graphs", Physics Reports 486 (2010)
-// wI or wII metric (page 148)
-float wallaceMetric(const br::Clusters &clusters, const QVector<int> &indices)
-{
-    int matches = 0;
-    int total = 0;
-    foreach (const QList<int> &cluster, clusters) {
-        for (int i=0; i<cluster.size(); i++) {
-            for (int j=i+1; j<cluster.size(); j++) {
-                total++;
-                if (indices[cluster[i]] == indices[cluster[j]])
-                    matches++;
-            }
-        }
-    }
-    return (float)matches/(float)total;
-}
-
-// Santo Fortunato "Community detection in graphs", Physics Reports 486 (2010)
-// Jaccard index (page 149)
-float jaccardIndex(const QVector<int> &indicesA, const QVector<int> &indicesB)
-{
-    int a[2][2] = {{0,0},{0,0}};
-    for (int i=0; i<indicesA.size()-1; i++)
-        for (int j=i+1; j<indicesA.size(); j++)
-            a[indicesA[i] == indicesA[j] ? 1 : 0][indicesB[i] == indicesB[j] ? 1 : 0]++;
-
-    return float(a[1][1]) / (a[0][1] + a[1][0] + a[1][1]);
-}
-
-// Evaluates clustering algorithms based on metrics described in
-// Santo Fortunato "Community detection in graphs", Physics Reports 486 (2010)
-void br::EvalClustering(const QString &csv, const QString &input, QString truth_property)
-{
-    if (truth_property.isEmpty())
-        truth_property = "Label";
-    qDebug("Evaluating %s against %s", qPrintable(csv), qPrintable(input));
-
-    TemplateList tList = TemplateList::fromGallery(input);
-    QList<int> labels = tList.indexProperty(truth_property);
-
-    QHash<int, int> labelToIndex;
-    int nClusters = 0;
-    for (int i=0; i<labels.size(); i++) {
-        const float &label = labels[i];
-        if (!labelToIndex.contains(label))
-            labelToIndex[label] = nClusters++;
-    }
-
-    Clusters truthClusters; truthClusters.reserve(nClusters);
-    for (int i=0; i<nClusters; i++)
-        truthClusters.append(QList<int>());
-
-    QVector<int> truthIndices(labels.size());
-    for (int i=0; i<labels.size(); i++) {
-        truthIndices[i] = labelToIndex[labels[i]];
-        truthClusters[labelToIndex[labels[i]]].append(i);
-    }
-
-    Clusters testClusters = ReadClusters(csv);
-
-    QVector<int> testIndices(labels.size());
-    for (int i=0; i<testClusters.size(); i++)
-        for (int j=0; j<testClusters[i].size(); j++)
-            testIndices[testClusters[i][j]] = i;
-
-    // At this point the following 4 things are defined:
-    // truthClusters - list of clusters of template_ids based on subject_ids
-    // truthIndices - template_id to cluster_id based on sigset subject_ids
-    // testClusters - list of clusters of template_ids based on csv input
-    // testIndices - template_id to cluster_id based on testClusters
-
-    float wI = wallaceMetric(truthClusters, testIndices);
-    float wII = wallaceMetric(testClusters, truthIndices);
-    float jaccard = jaccardIndex(testIndices, truthIndices);
-    qDebug("Recall: %f  Precision: %f  F-score: %f  Jaccard index: %f", wI, wII, sqrt(wI*wII), jaccard);
-}
-
-br::Clusters br::ReadClusters(const QString &csv)
-{
-    Clusters clusters;
-    QFile file(csv);
-    bool success = file.open(QFile::ReadOnly);
-    if (!success) qFatal("Failed to open %s for reading.", qPrintable(csv));
-    QStringList lines = QString(file.readAll()).split("\n");
-    file.close();
-
-    foreach (const QString &line, lines) {
-        Cluster cluster;
-        QStringList ids = line.trimmed().split(",", QString::SkipEmptyParts);
-        foreach (const QString &id, ids) {
-            bool ok;
-            cluster.append(id.toInt(&ok));
-            if (!ok) qFatal("Non-interger id.");
-        }
-        clusters.append(cluster);
-    }
-    return clusters;
-}
-
-void br::WriteClusters(const Clusters &clusters, const QString &csv)
-{
-    QFile file(csv);
-    bool success = file.open(QFile::WriteOnly);
-    if (!success) qFatal("Failed to open %s for writing.", qPrintable(csv));
-
-    foreach (Cluster cluster, clusters) {
-        if (cluster.empty()) continue;
-
-        qSort(cluster);
-        QStringList ids;
-        foreach (int id, cluster)
-            ids.append(QString::number(id));
-        file.write(qPrintable(ids.join(",")+"\n"));
-    }
-    file.close();
-}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QPair>
+#include <QSet>
+#include <QThread>
+#include <QtConcurrent>
+#include <algorithm>
+#include <limits>
+#include <openbr/openbr_plugin.h>
+#include <assert.h>
+
+#include "openbr/core/bee.h"
+#include "openbr/core/cluster.h"
+#include "openbr/core/distance_sse.h"
+#include "openbr/core/opencvutils.h"
+#include "openbr/plugins/openbr_internal.h"
+
+using namespace br;
+
+// Compare function used to order neighbors from highest to lowest similarity
+bool br::compareNeighbors(const Neighbor &a, const Neighbor &b)
+{
+    if (a.second == b.second)
+        return a.first < b.first;
+    return a.second > b.second;
+}
+
+// Binary k-NN graph in compressed sparse row form, written by savekNN to files ending in .knn or .knnz:
+// header, qint64 offsets[nodes+1], then for .knn qint32 indices[edges] and half precision scores[edges],
+// or for .knnz the scores followed by each row's indices as zigzag varint deltas from the row's node.
+// Uncompressed files are read straight out of a memory mapping.
+struct KNNHeader
+{
+    enum Flags { DeltaIndices = 1 };
+    char magic[4];
+    quint32 flags;
+    qint64 nodes, edges;
+};
+
+static const char knnMagic[4] = { 'B', 'K', 'N', 'N' };
+
+struct KNNFile
+{
+    qint64 nodes, edges;
+    const qint64 *offsets;
+    const qint32 *indices;
+    const quint16 *scores;
+    QVector<qint32> decoded; // Indices of a delta compressed file
+
+    // Returns false if fileName isn't a binary k-NN graph
+    bool open(const QString &fileName)
+    {
+        qint64 size = 0;
+        const uchar *data = mapFile(fileName, &size);
+        if (!data)
+            return false;
+        if ((size < qint64(sizeof(KNNHeader))) || memcmp(data, knnMagic, sizeof(knnMagic))) {
+            unmapFile(fileName);
+            return false;
+        }
+
+        const KNNHeader *header = reinterpret_cast<const KNNHeader*>(data);
+        nodes = header->nodes;
+        edges = header->edges;
+        const bool delta = header->flags & KNNHeader::DeltaIndices;
+        const qint64 offsetsEnd = sizeof(KNNHeader) + (nodes+1) * sizeof(qint64);
+        if ((nodes < 0) || (edges < 0) || (offsetsEnd > size))
+            qFatal("Corrupt k-NN graph %s.", qPrintable(fileName));
+        offsets = reinterpret_cast<const qint64*>(data + sizeof(KNNHeader));
+        if (offsets[nodes] != edges)
+            qFatal("Corrupt k-NN graph %s.", qPrintable(fileName));
+
+        if (!delta) {
+            if (offsetsEnd + edges * qint64(sizeof(qint32) + sizeof(quint16)) > size)
+                qFatal("Truncated k-NN graph %s.", qPrintable(fileName));
+            indices = reinterpret_cast<const qint32*>(data + offsetsEnd);
+            scores = reinterpret_cast<const quint16*>(data + offsetsEnd + edges * sizeof(qint32));
+            return true;
+        }
+
+        const qint64 scoresEnd = offsetsEnd + edges * sizeof(quint16);
+        if (scoresEnd > size)
+            qFatal("Truncated k-NN graph %s.", qPrintable(fileName));
+        scores = reinterpret_cast<const quint16*>(data + offsetsEnd);
+
+        decoded.resize(edges);
+        const uchar *in = data + scoresEnd, *end = data + size;
+        for (qint64 i=0; i<nodes; i++) {
+            qint64 previous = i;
+            for (qint64 j=offsets[i]; j<offsets[i+1]; j++) {
+                quint64 zigzag = 0;
+                for (int shift=0; ; shift+=7) {
+                    if (in == end)
+                        qFatal("Truncated k-NN graph %s.", qPrintable(fileName));
+                    zigzag |= quint64(*in & 0x7f) << shift;
+                    if (!(*in++ & 0x80))
+                        break;
+                }
+                previous += qint64(zigzag >> 1) ^ -qint64(zigzag & 1);
+                decoded[j] = qint32(previous);
+            }
+        }
+        indices = decoded.data();
+        return true;
+    }
+};
+
+// Neighborhood in compressed sparse row form, with each node's neighbors also sorted by index for logarithmic lookup
+struct CompactNeighborhood
+{
+    struct Entry
+    {
+        int index, position;
+        inline bool operator<(const Entry &other) const
+        {
+            return (index != other.index) ? (index < other.index) : (position < other.position);
+        }
+    };
+
+    QVector<int> offsets; // Neighbors of node i are in [offsets[i], offsets[i+1])
+    QVector<int> indices;
+    QVector<float> scores;
+    QVector<Entry> entries; // Same ranges as indices, sorted by index
+
+    CompactNeighborhood(const Neighborhood &neighborhood)
+        : offsets(neighborhood.size()+1, 0)
+    {
+        for (int i=0; i<neighborhood.size(); i++)
+            offsets[i+1] = offsets[i] + neighborhood[i].size();
+        indices.resize(offsets.last());
+        scores.resize(offsets.last());
+
+        for (int i=0; i<neighborhood.size(); i++)
+            for (int j=0; j<neighborhood[i].size(); j++) {
+                indices[offsets[i]+j] = neighborhood[i][j].first;
+                scores[offsets[i]+j] = neighborhood[i][j].second;
+            }
+        sortEntries();
+    }
+
+    CompactNeighborhood(const KNNFile &file)
+        : offsets(file.nodes+1, 0)
+    {
+        if (file.edges > std::numeric_limits<int>::max())
+            qFatal("k-NN graph of %lld edges is too large to cluster.", file.edges);
+        for (int i=0; i<=file.nodes; i++)
+            offsets[i] = int(file.offsets[i]);
+        indices.resize(file.edges);
+        memcpy(indices.data(), file.indices, file.edges * sizeof(qint32));
+        scores.resize(file.edges);
+        halfToFloat(file.scores, scores.data(), int(file.edges));
+        sortEntries();
+    }
+
+    void sortEntries()
+    {
+        entries.resize(offsets.last());
+        for (int i=0; i<nodes(); i++) {
+            for (int j=offsets[i]; j<offsets[i+1]; j++) {
+                entries[j].index = indices[j];
+                entries[j].position = j - offsets[i];
+            }
+            std::sort(entries.begin()+offsets[i], entries.begin()+offsets[i+1]);
+        }
+    }
+
+    inline int nodes() const { return offsets.size()-1; }
+    inline int size(int node) const { return offsets[node+1] - offsets[node]; }
+
+    // Position of i among the neighbors of node, or -1
+    inline int find(int node, int i) const
+    {
+        Entry key;
+        key.index = i;
+        key.position = -1;
+        const Entry *end = entries.data() + offsets[node+1];
+        const Entry *entry = std::lower_bound(entries.data() + offsets[node], end, key);
+        return ((entry == end) || (entry->index != i)) ? -1 : entry->position;
+    }
+
+    inline float score(int node, int position) const { return scores[offsets[node]+position]; }
+
+    // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
+    // Ob(x) in eq. 1, modified to consider 0/1 as ground truth imposter/genuine.
+    int indexOf(int node, int i) const
+    {
+        const int position = find(node, i);
+        if (position == -1) return -1;
+        const float s = score(node, position);
+        if      (s == 0) return size(node)-1;
+        else if (s == 1) return 0;
+        else             return position;
+    }
+
+    // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
+    // Corresponds to eq. 1, or D(a,b)
+    int asymmetricalROD(int a, int b) const
+    {
+        int distance = 0;
+        for (int j=offsets[a]; j<offsets[a+1]; j++) {
+            if (indices[j] == b) break;
+            const int index = indexOf(b, indices[j]);
+            distance += (index == -1) ? size(b) : index;
+        }
+        return distance;
+    }
+
+    // Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
+    // Corresponds to eq. 2/4, or D-R(a,b)
+    float normalizedROD(int a, int b) const
+    {
+        const int positionA = find(b, a);
+        const int positionB = find(a, b);
+
+        // Default behaviors
+        if ((positionA == -1) || (positionB == -1)) return std::numeric_limits<float>::max();
+        if ((score(b, positionA) == 1) || (score(a, positionB) == 1)) return 0;
+        if ((score(b, positionA) == 0) || (score(a, positionB) == 0)) return std::numeric_limits<float>::max();
+
+        const int distanceA = asymmetricalROD(a, b);
+        const int distanceB = asymmetricalROD(b, a);
+        return 1.f * (distanceA + distanceB) / std::min(positionA+1, positionB+1);
+    }
+};
+
+Neighborhood br::knnFromSimmat(const QList<cv::Mat> &simmats, int k)
+{
+    Neighborhood neighborhood;
+
+    float globalMax = -std::numeric_limits<float>::max();
+    float globalMin = std::numeric_limits<float>::max();
+    int numGalleries = (int)sqrt((float)simmats.size());
+    if (numGalleries*numGalleries != simmats.size())
+        qFatal("Incorrect number of similarity matrices.");
+
+    // Process each simmat
+    for (int i=0; i<numGalleries; i++) {
+        QVector<Neighbors> allNeighbors;
+
+        int currentRows = -1;
+        int columnOffset = 0;
+        for (int j=0; j<numGalleries; j++) {
+            cv::Mat m = simmats[i * numGalleries + j];
+            if (j==0) {
+                currentRows = m.rows;
+                allNeighbors.resize(currentRows);
+            }
+            if (currentRows != m.rows) qFatal("Row count mismatch.");
+
+            // Get data row by row
+            for (int k=0; k<m.rows; k++) {
+                Neighbors &neighbors = allNeighbors[k];
+                neighbors.reserve(neighbors.size() + m.cols);
+                for (int l=0; l<m.cols; l++) {
+                    float val = m.at<float>(k,l);
+                    if ((i==j) && (k==l)) continue; // Skips self-similarity scores
+
+                    if (val != -std::numeric_limits<float>::max()
+                        && val != -std::numeric_limits<float>::infinity()
+                        && val != std::numeric_limits<float>::infinity()) {
+                        globalMax = std::max(globalMax, val);
+                        globalMin = std::min(globalMin, val);
+                    }
+                    neighbors.append(Neighbor(l+columnOffset, val));
+                }
+            }
+
+            columnOffset += m.cols;
+        }
+
+        // Keep the top matches
+        for (int j=0; j<allNeighbors.size(); j++) {
+            Neighbors &val = allNeighbors[j];
+            const int cutoff = k; // Number of neighbors to keep
+            int keep = std::min(cutoff, val.size());
+            std::partial_sort(val.begin(), val.begin()+keep, val.end(), compareNeighbors);
+            neighborhood.append((Neighbors)val.mid(0, keep));
+        }
+    }
+
+    return neighborhood;
+}
+
+// generate k-NN graph from pre-computed similarity matrices 
+Neighborhood br::knnFromSimmat(const QStringList &simmats, int k)
+{
+    QList<cv::Mat> mats;
+    foreach (const QString &simmat, simmats) {
+        QScopedPointer<br::Format> format(br::Factory<br::Format>::make(simmat));
+        br::Template t = format->read();
+        mats.append(t);
+    }
+    return knnFromSimmat(mats, k);
+}
+
+TemplateList knnFromGallery(const QString & galleryName, bool inMemory, const QString & outFile, int k)
+{
+    QSharedPointer<Transform> comparison = Transform::fromComparison(Globals->algorithm);
+
+    Gallery *tempG = Gallery::make(galleryName);
+    qint64 total = tempG->totalSize();
+    delete tempG;
+    comparison->setPropertyRecursive("galleryName", galleryName+"[dropMetadata=true]");
+
+    bool multiProcess = Globals->file.getBool("multiProcess", false);
+    if (multiProcess)
+        comparison = QSharedPointer<Transform> (br::wrapTransform(comparison.data(), "ProcessWrapper"));
+
+    QScopedPointer<Transform> collect(Transform::make("CollectNN+ProgressCounter+Discard", NULL));
+    collect->setPropertyRecursive("totalProgress", total);
+    collect->setPropertyRecursive("keep", k);
+
+    QList<Transform *> tforms;
+    tforms.append(comparison.data());
+    tforms.append(collect.data());
+
+    QScopedPointer<Transform> compareCollect(br::pipeTransforms(tforms));
+
+    QSharedPointer <Transform> projector;
+    if (inMemory)
+        projector = QSharedPointer<Transform> (br::wrapTransform(compareCollect.data(), "Stream(readMode=StreamGallery, endPoint=Discard"));
+    else
+        projector = QSharedPointer<Transform> (br::wrapTransform(compareCollect.data(), "Stream(readMode=StreamGallery, endPoint=LogNN("+outFile+")+DiscardTemplates)"));
+
+    TemplateList input;
+    input.append(Template(galleryName));
+    TemplateList output;
+
+    projector->init();
+    projector->projectUpdate(input, output);
+
+    return output;
+}
+ 
+// Generate k-NN graph from a gallery, using the current algorithm for comparison.
+// Direct serialization to file system, k-NN graph is not retained in memory
+void br::knnFromGallery(const QString &galleryName, const QString &outFile, int k)
+{
+    knnFromGallery(galleryName, false, outFile, k);
+}
+
+// In-memory graph construction
+Neighborhood br::knnFromGallery(const QString &gallery, int k)
+{
+    // Nearest neighbor data current stored as template metadata, so retrieve it
+    TemplateList res = knnFromGallery(gallery, true, "", k);
+
+    Neighborhood neighborhood;
+    foreach (const Template &t, res) {
+        Neighbors neighbors = t.file.get<Neighbors>("neighbors");
+        neighborhood.append(neighbors);
+    }
+
+    return neighborhood;
+}
+
+// Dong et al. "Efficient K-Nearest Neighbor Graph Construction for Generic Similarity Measures", WWW 2011
+// Starting from random neighbors, each iteration compares the neighbors of neighbors of every template.
+// Only a sample of the candidates that changed since the previous iteration are joined, bounding the comparisons per iteration.
+struct NNDescent
+{
+    struct Candidate
+    {
+        int index;
+        float score;
+        bool isNew; // Not yet joined with the other neighbors
+
+        Candidate() {}
+        Candidate(int _index, float _score) : index(_index), score(_score), isNew(true) {}
+    };
+
+    // Min-heap on score, the weakest retained neighbor is at the front
+    static bool heapCompare(const Candidate &a, const Candidate &b)
+    {
+        return a.score > b.score;
+    }
+
+    static const int NumLocks = 1024;
+
+    const TemplateList &templates;
+    const Distance *distance;
+    const int k, sampleSize;
+    const float sample;
+    int seed;
+
+    QVector< QVector<Candidate> > heaps;
+    QVector< QVector<int> > newCandidates, oldCandidates, reverseNew, reverseOld;
+    QMutex locks[NumLocks];
+    QAtomicInt updates;
+
+    NNDescent(const TemplateList &_templates, const Distance *_distance, int _k, float _sample)
+        : templates(_templates), distance(_distance), k(_k), sampleSize(std::max(1, int(_sample * _k))), sample(_sample), seed(0),
+          heaps(_templates.size()), newCandidates(_templates.size()), oldCandidates(_templates.size()),
+          reverseNew(_templates.size()), reverseOld(_templates.size()) {}
+
+    bool insert(int i, int j, float score)
+    {
+        QMutexLocker locker(&locks[i % NumLocks]);
+        QVector<Candidate> &heap = heaps[i];
+        if ((heap.size() == k) && (score <= heap.front().score)) return false;
+        for (int l=0; l<heap.size(); l++)
+            if (heap[l].index == j) return false;
+
+        if (heap.size() < k) {
+            heap.append(Candidate(j, score));
+        } else {
+            std::pop_heap(heap.begin(), heap.end(), heapCompare);
+            heap.last() = Candidate(j, score);
+        }
+        std::push_heap(heap.begin(), heap.end(), heapCompare);
+        return true;
+    }
+
+    void update(int a, int b)
+    {
+        if (a == b) return;
+        const float score = distance->compare(templates[a], templates[b]);
+        const int changed = int(insert(a, b, score)) + int(insert(b, a, score));
+        if (changed > 0) updates.fetchAndAddRelaxed(changed);
+    }
+
+    void initialize(int begin, int end)
+    {
+        cv::RNG rng(begin + 1);
+        for (int i=begin; i<end; i++)
+            while (heaps[i].size() < k) {
+                const int j = rng.uniform(0, templates.size());
+                if (j != i) insert(i, j, distance->compare(templates[i], templates[j]));
+            }
+    }
+
+    // Splits each neighborhood into sampled new candidates, which are marked old, and old candidates
+    void split(int begin, int end)
+    {
+        cv::RNG rng(seed * templates.size() + begin + 1);
+        for (int i=begin; i<end; i++) {
+            QMutexLocker locker(&locks[i % NumLocks]);
+            newCandidates[i].clear();
+            oldCandidates[i].clear();
+            for (int l=0; l<heaps[i].size(); l++) {
+                Candidate &candidate = heaps[i][l];
+                if (!candidate.isNew) {
+                    oldCandidates[i].append(candidate.index);
+                } else if (rng.uniform(0.f, 1.f) < sample) {
+                    newCandidates[i].append(candidate.index);
+                    candidate.isNew = false;
+                }
+            }
+        }
+    }
+
+    void reverse()
+    {
+        for (int i=0; i<templates.size(); i++) {
+            reverseNew[i].clear();
+            reverseOld[i].clear();
+        }
+        for (int i=0; i<templates.size(); i++) {
+            foreach (int j, newCandidates[i]) reverseNew[j].append(i);
+            foreach (int j, oldCandidates[i]) reverseOld[j].append(i);
+        }
+    }
+
+    static void mergeSample(QVector<int> &candidates, QVector<int> &reverseCandidates, int sampleSize, cv::RNG &rng)
+    {
+        for (int l=0; l<std::min(sampleSize, reverseCandidates.size()); l++) {
+            std::swap(reverseCandidates[l], reverseCandidates[rng.uniform(l, reverseCandidates.size())]);
+            candidates.append(reverseCandidates[l]);
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    }
+
+    // Adds a sample of the reverse neighbors to the candidates
+    void merge(int begin, int end)
+    {
+        cv::RNG rng(seed * templates.size() + begin + 2);
+        for (int i=begin; i<end; i++) {
+            mergeSample(newCandidates[i], reverseNew[i], sampleSize, rng);
+            mergeSample(oldCandidates[i], reverseOld[i], sampleSize, rng);
+        }
+    }
+
+    // Compares new candidates with each other and with old candidates, old pairs were compared in a previous iteration
+    void join(int begin, int end)
+    {
+        for (int i=begin; i<end; i++) {
+            const QVector<int> &news = newCandidates[i];
+            const QVector<int> &olds = oldCandidates[i];
+            for (int a=0; a<news.size(); a++) {
+                for (int b=a+1; b<news.size(); b++)
+                    update(news[a], news[b]);
+                for (int b=0; b<olds.size(); b++)
+                    update(news[a], olds[b]);
+            }
+        }
+    }
+
+    void parallel(void (NNDescent::*step)(int, int))
+    {
+        const int chunk = std::max(1, templates.size() / (4 * std::max(1, QThread::idealThreadCount())));
+        QFutureSynchronizer<void> futures;
+        for (int begin=0; begin<templates.size(); begin+=chunk)
+            futures.addFuture(QtConcurrent::run(this, step, begin, std::min(begin + chunk, templates.size())));
+        futures.waitForFinished();
+    }
+};
+
+Neighborhood br::knnApproximate(const TemplateList &templates, int k, float sample, int iterations, float delta)
+{
+    if (templates.size() < 2) return Neighborhood(templates.size());
+    if ((sample <= 0) || (sample > 1)) qFatal("Sample rate must be in (0,1].");
+
+    QSharedPointer<Distance> distance = Distance::fromAlgorithm(Globals->algorithm);
+    NNDescent descent(templates, distance.data(), std::min(k, templates.size()-1), sample);
+    descent.parallel(&NNDescent::initialize);
+
+    for (int i=0; i<iterations; i++) {
+        descent.seed = i;
+        descent.updates = 0;
+        descent.parallel(&NNDescent::split);
+        descent.reverse();
+        descent.parallel(&NNDescent::merge);
+        descent.parallel(&NNDescent::join);
+
+        const int updates = descent.updates.load();
+        qDebug("NN-descent iteration %d: %d updates", i+1, updates);
+        if (updates <= delta * templates.size() * descent.k) break;
+    }
+
+    Neighborhood neighborhood(templates.size());
+    for (int i=0; i<templates.size(); i++) {
+        Neighbors &neighbors = neighborhood[i];
+        foreach (const NNDescent::Candidate &candidate, descent.heaps[i])
+            neighbors.append(Neighbor(candidate.index, candidate.score));
+        std::sort(neighbors.begin(), neighbors.end(), compareNeighbors);
+    }
+    return neighborhood;
+}
+
+Neighborhood br::knnApproximate(const QString &gallery, int k, float sample, int iterations, float delta)
+{
+    return knnApproximate(TemplateList::fromGallery(gallery), k, sample, iterations, delta);
+}
+
+Neighborhood br::loadkNN(const QString &infile)
+{
+    Neighborhood neighborhood;
+
+    KNNFile knn;
+    if (knn.open(infile)) {
+        neighborhood.resize(knn.nodes);
+        QVector<float> scores(knn.edges);
+        halfToFloat(knn.scores, scores.data(), knn.edges);
+        for (qint64 i=0; i<knn.nodes; i++) {
+            Neighbors &neighbors = neighborhood[i];
+            neighbors.reserve(knn.offsets[i+1] - knn.offsets[i]);
+            for (qint64 j=knn.offsets[i]; j<knn.offsets[i+1]; j++)
+                neighbors.append(Neighbor(knn.indices[j], scores[j]));
+        }
+        unmapFile(infile);
+        return neighborhood;
+    }
+
+    QFile file(infile);
+    bool success = file.open(QFile::ReadOnly);
+    if (!success) qFatal("Failed to open %s for reading.", qPrintable(infile));
+    QStringList lines = QString(file.readAll()).split("\n");
+    file.close();
+    int min_idx = INT_MAX;
+    int max_idx = -1;
+    int count = 0;
+
+    foreach (const QString &line, lines) {
+        Neighbors neighbors;
+        count++;
+        if (line.trimmed().isEmpty()) {
+            neighborhood.append(neighbors);
+            continue;
+        }
+        bool off = false;
+        QStringList list = line.trimmed().split(",", QString::SkipEmptyParts);
+        foreach (const QString &item, list) {
+            QStringList parts = item.trimmed().split(":", QString::SkipEmptyParts);
+            bool intOK = true;
+            bool floatOK = true;
+            int idx = parts[0].toInt(&intOK);
+            float score = parts[1].toFloat(&floatOK);
+
+            if (idx > max_idx)
+                max_idx = idx;
+            if (idx  <min_idx)
+                min_idx = idx;
+
+            if (idx >= lines.size()) {
+                off = true;
+                continue;
+            }
+            neighbors.append(qMakePair(idx, score));
+
+
+            if (!intOK && floatOK)
+                qFatal("Failed to parse word: %s", qPrintable(item));
+        }
+        neighborhood.append(neighbors);
+    }
+    return neighborhood;
+}
+
+static void writeBinarykNN(const Neighborhood &neighborhood, QFile &file, bool delta)
+{
+    KNNHeader header;
+    memcpy(header.magic, knnMagic, sizeof(knnMagic));
+    header.flags = delta ? KNNHeader::DeltaIndices : 0;
+    header.nodes = neighborhood.size();
+
+    QVector<qint64> offsets(neighborhood.size()+1, 0);
+    for (int i=0; i<neighborhood.size(); i++)
+        offsets[i+1] = offsets[i] + neighborhood[i].size();
+    header.edges = offsets.last();
+
+    QVector<float> scores;
+    QVector<qint32> indices;
+    scores.reserve(header.edges);
+    indices.reserve(header.edges);
+    foreach (const Neighbors &neighbors, neighborhood)
+        foreach (const Neighbor &neighbor, neighbors) {
+            indices.append(neighbor.first);
+            scores.append(neighbor.second);
+        }
+    QVector<quint16> halves(scores.size());
+    floatToHalf(scores.data(), halves.data(), scores.size());
+
+    file.write((const char*) &header, sizeof(header));
+    file.write((const char*) offsets.data(), offsets.size() * sizeof(qint64));
+    if (!delta) {
+        file.write((const char*) indices.data(), indices.size() * sizeof(qint32));
+        file.write((const char*) halves.data(), halves.size() * sizeof(quint16));
+        return;
+    }
+
+    file.write((const char*) halves.data(), halves.size() * sizeof(quint16));
+    QByteArray varints;
+    varints.reserve(indices.size() * 2);
+    for (int i=0; i<neighborhood.size(); i++) {
+        qint64 previous = i;
+        for (qint64 j=offsets[i]; j<offsets[i+1]; j++) {
+            const qint64 difference = indices[j] - previous;
+            quint64 zigzag = (quint64(difference) << 1) ^ quint64(difference >> 63);
+            for (; zigzag >= 0x80; zigzag >>= 7)
+                varints.append(char(zigzag | 0x80));
+            varints.append(char(zigzag));
+            previous = indices[j];
+        }
+    }
+    file.write(varints);
+}
+
+bool br::savekNN(const Neighborhood &neighborhood, const QString &outfile)
+{
+    QFile file(outfile);
+    bool success = file.open(QFile::WriteOnly);
+    if (!success) qFatal("Failed to open %s for writing.", qPrintable(outfile));
+
+    const QString suffix = QFileInfo(outfile).suffix();
+    if ((suffix == "knn") || (suffix == "knnz")) {
+        writeBinarykNN(neighborhood, file, suffix == "knnz");
+        file.close();
+        return true;
+    }
+
+    foreach (Neighbors neighbors, neighborhood) {
+        QString aLine;
+        if (!neighbors.empty())
+        {
+            aLine.append(QString::number(neighbors[0].first)+":"+QString::number(neighbors[0].second));
+            for (int i=1; i < neighbors.size();i++) {
+                aLine.append(","+QString::number(neighbors[i].first)+":"+QString::number(neighbors[i].second));
+            }
+        }
+        aLine += "\n";
+        file.write(qPrintable(aLine));
+    }
+    file.close();
+    return true;
+}
+
+
+// Collects the edges in [begin,end) whose rank-order distance is below the threshold
+static void findMerges(const CompactNeighborhood *neighborhood, float threshold, int begin, int end, QVector< QPair<int,int> > *merges)
+{
+    for (int i=begin; i<end; i++)
+        for (int j=neighborhood->offsets[i]; j<neighborhood->offsets[i+1]; j++) {
+            const int neighbor = neighborhood->indices[j];
+            if ((neighbor != i) && (neighborhood->normalizedROD(i, neighbor) < threshold))
+                merges->append(QPair<int,int>(i, neighbor));
+        }
+}
+
+static int findRoot(QVector<int> &parents, int i)
+{
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]]; // Path halving
+        i = parents[i];
+    }
+    return i;
+}
+
+// Rank-order clustering on a pre-computed k-NN graph
+static Clusters clusterCompact(const CompactNeighborhood &compact, float aggressiveness, const QString &csv)
+{
+    const int cutoff = compact.nodes() ? compact.size(0) : 0;
+    const float threshold = 3*cutoff/4 * aggressiveness/5;
+
+    // Evaluate every candidate edge in parallel
+    const int chunk = std::max(1, compact.nodes() / (4 * std::max(1, QThread::idealThreadCount())));
+    QVector< QVector< QPair<int,int> > > merges((compact.nodes() + chunk - 1) / chunk);
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<merges.size(); i++)
+        futures.addFuture(QtConcurrent::run(findMerges, &compact, threshold, i*chunk, std::min((i+1)*chunk, compact.nodes()), &merges[i]));
+    futures.waitForFinished();
+
+    // Transitive merge, each root is the smallest index in its cluster
+    QVector<int> parents(compact.nodes());
+    for (int i=0; i<parents.size(); i++)
+        parents[i] = i;
+    foreach (const QVector< QPair<int,int> > &chunkMerges, merges)
+        for (int i=0; i<chunkMerges.size(); i++) {
+            const int a = findRoot(parents, chunkMerges[i].first);
+            const int b = findRoot(parents, chunkMerges[i].second);
+            if (a < b) parents[b] = a;
+            else       parents[a] = b;
+        }
+
+    // Construct clusters, ordered by their smallest index
+    QVector<int> clusterIDs(compact.nodes(), -1);
+    Clusters clusters;
+    for (int i=0; i<compact.nodes(); i++) {
+        const int root = findRoot(parents, i);
+        if (clusterIDs[root] == -1) {
+            clusterIDs[root] = clusters.size();
+            clusters.append(Cluster());
+        }
+        clusters[clusterIDs[root]].append(i);
+    }
+
+    if (!csv.isEmpty())
+        WriteClusters(clusters, csv);
+
+    return clusters;
+}
+
+Clusters br::ClusterGraph(Neighborhood neighborhood, float aggressiveness, const QString &csv)
+{
+    const CompactNeighborhood compact(neighborhood);
+    neighborhood.clear();
+    return clusterCompact(compact, aggressiveness, csv);
+}
+
+Clusters br::ClusterGraph(const QString & knnName, float aggressiveness, const QString &csv)
+{
+    // Binary graphs are read straight into compressed sparse row form
+    KNNFile knn;
+    if (knn.open(knnName)) {
+        const CompactNeighborhood compact(knn);
+        unmapFile(knnName);
+        return clusterCompact(compact, aggressiveness, csv);
+    }
+
+    Neighborhood neighbors = loadkNN(knnName);
+    return ClusterGraph(neighbors, aggressiveness, csv);
+}
+
+// Zhu et al. "A Rank-Order Distance based Clustering Algorithm for Face Tagging", CVPR 2011
+br::Clusters br::ClusterSimmat(const QList<cv::Mat> &simmats, float aggressiveness, const QString &csv)
+{
+    qDebug("Clustering %d simmat(s), aggressiveness %f", simmats.size(), aggressiveness);
+
+    // Read in gallery parts, keeping top neighbors of each template
+    Neighborhood neighborhood = knnFromSimmat(simmats);
+
+    return ClusterGraph(neighborhood, aggressiveness, csv);
+}
+
+// Approximate k-NN graph construction avoids the self-similarity matrix of large galleries
+br::Clusters br::ClusterGallery(const File &gallery, float aggressiveness, const QString &csv)
+{
+    qDebug("Clustering %s, aggressiveness %f", qPrintable(gallery.name), aggressiveness);
+
+    const Neighborhood neighborhood = knnApproximate(gallery.name, gallery.get<int>("k", 20), gallery.get<float>("sample", 0.5),
+                                                     gallery.get<int>("iterations", 10), gallery.get<float>("delta", 0.001));
+
+    return ClusterGraph(neighborhood, aggressiveness, csv);
+}
+
+br::Clusters br::ClusterSimmat(const QStringList &simmats, float aggressiveness, const QString &csv)
+{
+    QList<cv::Mat> mats;
+    foreach (const QString &simmat, simmats) {
+        QScopedPointer<br::Format> format(br::Factory<br::Format>::make(simmat));
+        br::Template t = format->read();
+        mats.append(t);
+    }
+
+    Clusters clusters = ClusterSimmat(mats, aggressiveness, csv);
+    return clusters;
+}
+
+// Santo Fortunato "Community detection in graphs", Physics Reports 486 (2010)
+// wI or wII metric (page 148)
+float wallaceMetric(const br::Clusters &clusters, const QVector<int> &indices)
+{
+    int matches = 0;
+    int total = 0;
+    foreach (const QList<int> &cluster, clusters) {
+        for (int i=0; i<cluster.size(); i++) {
+            for (int j=i+1; j<cluster.size(); j++) {
+                total++;
+                if (indices[cluster[i]] == indices[cluster[j]])
+                    matches++;
+            }
+        }
+    }
+    return (float)matches/(float)total;
+}
+
+// Santo Fortunato "Community detection in graphs", Physics Reports 486 (2010)
+// Jaccard index (page 149)
+float jaccardIndex(const QVector<int> &indicesA, const QVector<int> &indicesB)
+{
+    int a[2][2] = {{0,0},{0,0}};
+    for (int i=0; i<indicesA.size()-1; i++)
+        for (int j=i+1; j<indicesA.size(); j++)
+            a[indicesA[i] == indicesA[j] ? 1 : 0][indicesB[i] == indicesB[j] ? 1 : 0]++;
+
+    return float(a[1][1]) / (a[0][1] + a[1][0] + a[1][1]);
+}
+
+// Evaluates clustering algorithms based on metrics described in
+// Santo Fortunato "Community detection in graphs", Physics Reports 486 (2010)
+void br::EvalClustering(const QString &csv, const QString &input, QString truth_property)
+{
+    if (truth_property.isEmpty())
+        truth_property = "Label";
+    qDebug("Evaluating %s against %s", qPrintable(csv), qPrintable(input));
+
+    TemplateList tList = TemplateList::fromGallery(input);
+    QList<int> labels = tList.indexProperty(truth_property);
+
+    QHash<int, int> labelToIndex;
+    int nClusters = 0;
+    for (int i=0; i<labels.size(); i++) {
+        const float &label = labels[i];
+        if (!labelToIndex.contains(label))
+            labelToIndex[label] = nClusters++;
+    }
+
+    Clusters truthClusters; truthClusters.reserve(nClusters);
+    for (int i=0; i<nClusters; i++)
+        truthClusters.append(QList<int>());
+
+    QVector<int> truthIndices(labels.size());
+    for (int i=0; i<labels.size(); i++) {
+        truthIndices[i] = labelToIndex[labels[i]];
+        truthClusters[labelToIndex[labels[i]]].append(i);
+    }
+
+    Clusters testClusters = ReadClusters(csv);
+
+    QVector<int> testIndices(labels.size());
+    for (int i=0; i<testClusters.size(); i++)
+        for (int j=0; j<testClusters[i].size(); j++)
+            testIndices[testClusters[i][j]] = i;
+
+    // At this point the following 4 things are defined:
+    // truthClusters - list of clusters of template_ids based on subject_ids
+    // truthIndices - template_id to cluster_id based on sigset subject_ids
+    // testClusters - list of clusters of template_ids based on csv input
+    // testIndices - template_id to cluster_id based on testClusters
+
+    float wI = wallaceMetric(truthClusters, testIndices);
+    float wII = wallaceMetric(testClusters, truthIndices);
+    float jaccard = jaccardIndex(testIndices, truthIndices);
+    qDebug("Recall: %f  Precision: %f  F-score: %f  Jaccard index: %f", wI, wII, sqrt(wI*wII), jaccard);
+}
+
+br::Clusters br::ReadClusters(const QString &csv)
+{
+    Clusters clusters;
+    QFile file(csv);
+    bool success = file.open(QFile::ReadOnly);
+    if (!success) qFatal("Failed to open %s for reading.", qPrintable(csv));
+    QStringList lines = QString(file.readAll()).split("\n");
+    file.close();
+
+    foreach (const QString &line, lines) {
+        Cluster cluster;
+        QStringList ids = line.trimmed().split(",", QString::SkipEmptyParts);
+        foreach (const QString &id, ids) {
+            bool ok;
+            cluster.append(id.toInt(&ok));
+            if (!ok) qFatal("Non-interger id.");
+        }
+        clusters.append(cluster);
+    }
+    return clusters;
+}
+
+void br::WriteClusters(const Clusters &clusters, const QString &csv)
+{
+    QFile file(csv);
+    bool success = file.open(QFile::WriteOnly);
+    if (!success) qFatal("Failed to open %s for writing.", qPrintable(csv));
+
+    foreach (Cluster cluster, clusters) {
+        if (cluster.empty()) continue;
+
+        qSort(cluster);
+        QStringList ids;
+        foreach (int id, cluster)
+            ids.append(QString::number(id));
+        file.write(qPrintable(ids.join(",")+"\n"));
+    }
+    file.close();
+}
+
+br::Centroids::Centroids(const cv::Mat &centers)
+{
+    centers.convertTo(c, CV_32F);
+    norms.create(1, c.rows, CV_32FC1);
+    for (int i=0; i<c.rows; i++)
+        norms.at<float>(0, i) = c.row(i).dot(c.row(i));
+}
+
+cv::Mat br::Centroids::nearest(const cv::Mat &queries, int k, cv::Mat *distances) const
+{
+    cv::Mat q;
+    queries.convertTo(q, CV_32F);
+    q = q.reshape(1, q.rows);
+    if (q.cols != c.cols)
+        qFatal("Expected %d dimensional queries, got %d.", c.cols, q.cols);
+
+    k = std::min(k, c.rows);
+    cv::Mat indices(q.rows, k, CV_32SC1);
+    if (distances)
+        distances->create(q.rows, k, CV_32FC1);
+
+    const int threads = Globals->parallelism > 1 ? std::max(1, std::min(QThread::idealThreadCount(), q.rows / Strip)) : 1;
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<threads; i++) {
+        const cv::Range range(q.rows * i / threads, q.rows * (i+1) / threads);
+        if (i == threads - 1) nearestRange(&q, k, &indices, distances, range);
+        else                  futures.addFuture(QtConcurrent::run(this, &Centroids::nearestRange, &q, k, &indices, distances, range));
+    }
+    futures.waitForFinished();
+    return indices;
+}
+
+void br::Centroids::nearest(const TemplateList &src, int k, TemplateList &dst) const
+{
+    const cv::Mat indices = nearest(OpenCVUtils::toMatByRow(src.data()), k);
+    int row = 0;
+    foreach (const Template &t, src) {
+        dst.append(Template(t.file, indices.rowRange(row, row + t.m().rows).clone().reshape(1, 1)));
+        row += t.m().rows;
+    }
+}
+
+void br::Centroids::nearestRange(const cv::Mat *queries, int k, cv::Mat *indices, cv::Mat *distances, cv::Range range) const
+{
+    const float *n = norms.ptr<float>();
+    QVector< QPair<float,int> > candidates(c.rows);
+    cv::Mat scores;
+    for (int begin=range.start; begin<range.end; begin+=Strip) {
+        const cv::Mat strip = queries->rowRange(begin, std::min(begin + Strip, range.end));
+        cv::gemm(strip, c, -2, cv::Mat(), 0, scores, cv::GEMM_2_T);
+
+        for (int i=0; i<strip.rows; i++) {
+            float *score = scores.ptr<float>(i);
+            for (int j=0; j<c.rows; j++)
+                score[j] += n[j];
+
+            int *index = indices->ptr<int>(begin + i);
+            if (k == 1) {
+                index[0] = int(std::min_element(score, score + c.rows) - score);
+            } else {
+                for (int j=0; j<c.rows; j++)
+                    candidates[j] = QPair<float,int>(score[j], j);
+                std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end());
+                for (int j=0; j<k; j++)
+                    index[j] = candidates[j].second;
+            }
+
+            if (distances) {
+                const float queryNorm = strip.row(i).dot(strip.row(i));
+                float *distance = distances->ptr<float>(begin + i);
+                for (int j=0; j<k; j++)
+                    distance[j] = std::max(score[index[j]] + queryNorm, 0.f);
+            }
+        }
+    }
+}
+
+double br::KMeans(const cv::Mat &data, int k, cv::Mat &centers, cv::Mat *labels, int batchSize, int iterations)
+{
+    cv::Mat samples;
+    data.convertTo(samples, CV_32F);
+    if (samples.rows < k)
+        qFatal("Need at least %d samples to train %d centers, got %d.", k, k, samples.rows);
+
+    if (batchSize <= 0) {
+        cv::Mat bestLabels;
+        const double compactness = cv::kmeans(samples, k, bestLabels, cv::TermCriteria(cv::TermCriteria::MAX_ITER, 10, 0), 3, cv::KMEANS_PP_CENTERS, centers);
+        if (labels) *labels = bestLabels;
+        return compactness;
+    }
+
+    cv::RNG &rng = cv::theRNG();
+
+    // k-means++ seeding on a sample large enough to represent every cluster
+    const int sampleSize = std::min(samples.rows, std::max(16 * k, batchSize));
+    cv::Mat sample;
+    if (sampleSize == samples.rows) {
+        sample = samples;
+    } else {
+        sample.create(sampleSize, samples.cols, CV_32FC1);
+        for (int i=0; i<sampleSize; i++)
+            samples.row(rng.uniform(0, samples.rows)).copyTo(sample.row(i));
+    }
+
+    centers.create(k, samples.cols, CV_32FC1);
+    sample.row(rng.uniform(0, sampleSize)).copyTo(centers.row(0));
+    cv::Mat closest;
+    Centroids(centers.row(0)).nearest(sample, 1, &closest);
+    for (int i=1; i<k; i++) {
+        const double total = cv::sum(closest)[0];
+        double target = rng.uniform(0., total);
+        int next = 0;
+        while ((next < sampleSize - 1) && ((target -= closest.at<float>(next, 0)) > 0))
+            next++;
+        sample.row(next).copyTo(centers.row(i));
+
+        cv::Mat distances;
+        Centroids(centers.row(i)).nearest(sample, 1, &distances);
+        closest = cv::min(closest, distances);
+    }
+
+    // Mini-batch updates with a per-center learning rate of 1/count
+    QVector<int> counts(k, 0);
+    cv::Mat batch(batchSize, samples.cols, CV_32FC1);
+    for (int iteration=0; iteration<iterations; iteration++) {
+        for (int i=0; i<batchSize; i++)
+            samples.row(rng.uniform(0, samples.rows)).copyTo(batch.row(i));
+
+        const cv::Mat assignments = Centroids(centers).nearest(batch);
+        for (int i=0; i<batchSize; i++) {
+            const int center = assignments.at<int>(i, 0);
+            const float eta = 1.f / ++counts[center];
+            float *c = centers.ptr<float>(center);
+            const float *x = batch.ptr<float>(i);
+            for (int j=0; j<samples.cols; j++)
+                c[j] += eta * (x[j] - c[j]);
+        }
+    }
+
+    if (!labels)
+        return -1;
+    cv::Mat distances;
+    *labels = Centroids(centers).nearest(samples, 1, &distances);
+    return cv::sum(distances)[0];
+}
@@ -1,68 +1,110 @@
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Copyright 2012 The MITRE Corporation                                      *
- *                                                                           *
- * Licensed under the Apache License, Version 2.0 (the "License");           *
- * you may not use this file except in compliance with the License.          *
- * You may obtain a copy of the License at                                   *
- *                                                                           *
- *     http://www.apache.org/licenses/LICENSE-2.0                            *
- *                                                                           *
- * Unless required by applicable law or agreed to in writing, software       *
- * distributed under the License is distributed on an "AS IS" BASIS,         *
- * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
- * See the License for the specific language governing permissions and       *
- * limitations under the License.                                            *
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-
-#ifndef BR_CLUSTER_H
-#define BR_CLUSTER_H
-
-#include <QList>
-#include <QString>
-#include <QStringList>
-#include <QVector>
-#include <openbr/openbr_plugin.h>
-#include <openbr/plugins/openbr_internal.h>
-
-namespace br
-{
-    typedef QList<int> Cluster; // List of indices into galleries
-    typedef QVector<Cluster> Clusters;
-
-    // generate k-NN graph from pre-computed similarity matrices 
-    Neighborhood knnFromSimmat(const QStringList &simmats, int k = 20);
-    Neighborhood knnFromSimmat(const QList<cv::Mat> &simmats, int k = 20);
- 
-    // Generate k-NN graph from a gallery, using the current algorithm for comparison.
-    // direct serialization to file system.
-    void  knnFromGallery(const QString &galleryName, const QString & outFile, int k = 20);
-    // in memory graph computation
-    Neighborhood knnFromGallery(const QString &gallery, int k = 20);
-
-    // Load k-NN graph from a file with the following ascii format:
-    // One line per sample, each line lists the top k neighbors for the sample as follows:
-    // index1:score1,index2:score2,...,indexk:scorek
-    Neighborhood loadkNN(const QString &fname);
-
-    // Save k-NN graph to file
-    bool savekNN(const Neighborhood &neighborhood, const QString &outfile);
-
-    // Rank-order clustering on a pre-computed k-NN graph
-    Clusters ClusterGraph(Neighborhood neighbors, float aggresssiveness, const QString &csv = "");
-    Clusters ClusterGraph(const QString & knnName, float aggressiveness, const QString &csv = "");
-
-    // Given a similarity matrix, compute the k-NN graph, then perform rank-order clustering.
-    Clusters ClusterSimmat(const QList<cv::Mat> &simmats, float aggressiveness, const QString &csv = "");
-    Clusters ClusterSimmat(const QStringList &simmats, float aggressiveness, const QString &csv = "");
-
-    // evaluate clustering results in csv, reading ground truth data from gallery input, using truth_property
-    // as the key for ground truth labels.
-    void EvalClustering(const QString &csv, const QString &input, QString truth_property);
-
-    // Read/write clusters from a text format, 1 line = 1 cluster, each line contains comma separated list
-    // of assigned indices.
-    Clusters ReadClusters(const QString &csv);
-    void WriteClusters(const Clusters &clusters, const QString &csv);
-}
-
-#endif // BR_CLUSTER_H
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_CLUSTER_H
+#define BR_CLUSTER_H
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+    typedef QList<int> Cluster; // List of indices into galleries
+    typedef QVector<Cluster> Clusters;
+
+    // generate k-NN graph from pre-computed similarity matrices 
+    Neighborhood knnFromSimmat(const QStringList &simmats, int k = 20);
+    Neighborhood knnFromSimmat(const QList<cv::Mat> &simmats, int k = 20);
+ 
+    // Generate k-NN graph from a gallery, using the current algorithm for comparison.
+    // direct serialization to file system.
+    void  knnFromGallery(const QString &galleryName, const QString & outFile, int k = 20);
+    // in memory graph computation
+    Neighborhood knnFromGallery(const QString &gallery, int k = 20);
+
+    // Approximate k-NN graph by NN-descent, using the current algorithm for comparison.
+    // Each iteration joins a fraction "sample" of the changed neighbors, stopping after "iterations" or once
+    // fewer than delta*k neighbors per template were updated.
+    Neighborhood knnApproximate(const TemplateList &templates, int k = 20, float sample = 0.5, int iterations = 10, float delta = 0.001);
+    Neighborhood knnApproximate(const QString &gallery, int k = 20, float sample = 0.5, int iterations = 10, float delta = 0.001);
+
+    // Load k-NN graph from a file with the following ascii format:
+    // One line per sample, each line lists the top k neighbors for the sample as follows:
+    // index1:score1,index2:score2,...,indexk:scorek
+    // Binary graphs written by savekNN are recognized by their header regardless of extension.
+    Neighborhood loadkNN(const QString &fname);
+
+    // Save k-NN graph to file, in the ascii format above unless the extension is:
+    // .knn  - memory-mappable compressed sparse rows of int32 indices and half precision scores
+    // .knnz - as .knn, with the indices delta and varint encoded
+    bool savekNN(const Neighborhood &neighborhood, const QString &outfile);
+
+    // Rank-order clustering on a pre-computed k-NN graph
+    Clusters ClusterGraph(Neighborhood neighbors, float aggresssiveness, const QString &csv = "");
+    Clusters ClusterGraph(const QString & knnName, float aggressiveness, const QString &csv = "");
+
+    // Given a similarity matrix, compute the k-NN graph, then perform rank-order clustering.
+    Clusters ClusterSimmat(const QList<cv::Mat> &simmats, float aggressiveness, const QString &csv = "");
+    Clusters ClusterSimmat(const QStringList &simmats, float aggressiveness, const QString &csv = "");
+
+    // Compute an approximate k-NN graph of the gallery, then perform rank-order clustering.
+    // k, sample, iterations and delta are read from the gallery file arguments.
+    Clusters ClusterGallery(const File &gallery, float aggressiveness, const QString &csv = "");
+
+    // evaluate clustering results in csv, reading ground truth data from gallery input, using truth_property
+    // as the key for ground truth labels.
+    void EvalClustering(const QString &csv, const QString &input, QString truth_property);
+
+    // Nearest centroid search by L2 distance.
+    // Candidates are ranked by ||c||^2 - 2x.c, taken from one matrix product per strip of queries.
+    class Centroids
+    {
+    public:
+        Centroids() {}
+        explicit Centroids(const cv::Mat &centers);
+        const cv::Mat &centers() const { return c; }
+
+        // Indices of the k nearest centroids to each row of queries, nearest first, as a queries.rows x k CV_32SC1.
+        // distances optionally receives the matching squared L2 distances.
+        cv::Mat nearest(const cv::Mat &queries, int k = 1, cv::Mat *distances = NULL) const;
+
+        // Batched equivalent of assigning each template's rows and flattening the indices to one row,
+        // appending a template per source template to dst.
+        void nearest(const TemplateList &src, int k, TemplateList &dst) const;
+
+    private:
+        static const int Strip = 256; // Queries per matrix product
+        cv::Mat c, norms;
+        void nearestRange(const cv::Mat *queries, int k, cv::Mat *indices, cv::Mat *distances, cv::Range range) const;
+    };
+
+    // Cluster the rows of data into k centers.
+    // batchSize <= 0 runs OpenCV's full batch kmeans, otherwise mini-batch k-means seeded by k-means++ on a sample of data.
+    // labels optionally receives the nearest center of each row.
+    // Returns the compactness, which mini-batch training only computes when labels are requested (otherwise -1).
+    double KMeans(const cv::Mat &data, int k, cv::Mat &centers, cv::Mat *labels = NULL, int batchSize = 0, int iterations = 100);
+
+    // Read/write clusters from a text format, 1 line = 1 cluster, each line contains comma separated list
+    // of assigned indices.
+    Clusters ReadClusters(const QString &csv);
+    void WriteClusters(const Clusters &clusters, const QString &csv);
+}
+
+#endif // BR_CLUSTER_H
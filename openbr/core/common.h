@@ -156,6 +156,47 @@ void MeanStdDev(const V<T> &vals, double *mean, double *stddev)
     *stddev = sqrt(variance/vals.size());
 }
 
+/*!
+ * \brief Streaming count, minimum, maximum, mean and standard deviation, using Welford's algorithm.
+ *
+ * Accumulators filled independently, e.g. by separate threads, can be combined with merge().
+ */
+struct Moments
+{
+    qint64 count;
+    double mean, m2, min, max;
+
+    Moments() : count(0), mean(0), m2(0), min(std::numeric_limits<double>::max()), max(-std::numeric_limits<double>::max()) {}
+
+    void add(double x)
+    {
+        count++;
+        const double delta = x - mean;
+        mean += delta / count;
+        m2 += delta * (x - mean);
+        min = std::min(min, x);
+        max = std::max(max, x);
+    }
+
+    void merge(const Moments &other)
+    {
+        if (other.count == 0) return;
+        const qint64 total = count + other.count;
+        const double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * (double(count) * other.count / total);
+        count = total;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+
+    // Population standard deviation, as computed by MeanStdDev()
+    double stddev() const
+    {
+        return count > 0 ? sqrt(m2 / count) : 0;
+    }
+};
+
 /*!
  * \brief Computes the median of a list.
  */
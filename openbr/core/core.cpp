@@ -14,6 +14,15 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QElapsedTimer>
+#include <QFutureInterface>
+#include <QFutureSynchronizer>
+#include <QProcess>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QUuid>
+#include <QWaitCondition>
+#include <QtConcurrentRun>
 #include <openbr/openbr_plugin.h>
 
 #include "bee.h"
@@ -37,6 +46,7 @@ struct AlgorithmCore
         TransformCompare,
     };
 
+    QSharedPointer<QtUtils::MappedModel> mappedModel; // Declared first so it outlives the views held by the transforms
     QSharedPointer<Transform> transform;
     QSharedPointer<Transform> simplifiedTransform;
     QSharedPointer<Transform> comparison;
@@ -117,16 +127,72 @@ struct AlgorithmCore
             simplifiedTransform = QSharedPointer<Transform>(temp, noDelete);
     }
 
+    static bool isLoadStore(const Transform *transform)
+    {
+        return !strcmp(transform->metaObject()->className(), "br::LoadStoreTransform");
+    }
+
+    static bool containsLoadStore(const Transform *transform)
+    {
+        if (isLoadStore(transform))
+            return true;
+        foreach (const Transform *child, transform->getChildren<Transform>())
+            if (containsLoadStore(child))
+                return true;
+        return false;
+    }
+
+    // A plan is the expanded description, in which LoadStore wrappers are replaced by their children,
+    // with the children's state stored inline. It loads without expanding abbreviations or reading submodels.
+    static bool plannable(const Transform *transform)
+    {
+        while (isLoadStore(transform))
+            transform = transform->getChildren<Transform>().first();
+        if (!containsLoadStore(transform))
+            return true;
+
+        // Pipe and Fork store nothing but their children
+        const QString className = transform->metaObject()->className();
+        if ((className != "br::PipeTransform") && (className != "br::ForkTransform"))
+            return false;
+        foreach (const Transform *child, transform->getChildren<Transform>())
+            if (!plannable(child))
+                return false;
+        return true;
+    }
+
+    static void storePlan(const Transform *transform, QDataStream &stream)
+    {
+        while (isLoadStore(transform))
+            transform = transform->getChildren<Transform>().first();
+        if (!containsLoadStore(transform)) {
+            transform->store(stream);
+            return;
+        }
+        foreach (const Transform *child, transform->getChildren<Transform>())
+            storePlan(child, stream);
+    }
+
+    static QString planMarker() { return "br::Plan"; }
+
     void store(const QString &model) const
     {
         QtUtils::BlockCompression compressedWrite;
         QFile outFile(model);
         compressedWrite.setBasis(&outFile);
-        QDataStream out(&compressedWrite);
-        compressedWrite.open(QFile::WriteOnly);
-
-        // Serialize algorithm to stream
-        transform->serialize(out);
+        QtUtils::MappedModel mappedWrite(model);
+        QIODevice *device = Globals->mappedModels ? (QIODevice*) &mappedWrite : (QIODevice*) &compressedWrite;
+        QDataStream out(device);
+        if (!device->open(QFile::WriteOnly))
+            qFatal("Failed to open %s for writing.", qPrintable(model));
+
+        // Serialize algorithm to stream, as a plan when its state can be laid out for one
+        if (plannable(transform.data())) {
+            out << planMarker() << transform->description(true);
+            storePlan(transform.data(), out);
+        } else {
+            transform->serialize(out);
+        }
 
         qint32 mode = None;
         if (!distance.isNull())
@@ -142,7 +208,7 @@ struct AlgorithmCore
         if (mode == TransformCompare)
             comparison->serialize(out);
 
-        compressedWrite.close();
+        device->close();
     }
 
     void load(const QString &model)
@@ -154,14 +220,26 @@ struct AlgorithmCore
         if (!Globals->modelSearch.contains(path))
             Globals->modelSearch.append(path);
 
+        // Matrices in a mapped model are views onto the file, shared with every process that loads it
         QtUtils::BlockCompression compressedRead;
         QFile inFile(model);
         compressedRead.setBasis(&inFile);
-        QDataStream in(&compressedRead);
-        compressedRead.open(QFile::ReadOnly);
+        QSharedPointer<QtUtils::MappedModel> mappedRead;
+        QIODevice *device = &compressedRead;
+        if (QtUtils::MappedModel::isMappedModel(model)) {
+            mappedRead = QSharedPointer<QtUtils::MappedModel>(new QtUtils::MappedModel(model));
+            device = mappedRead.data();
+        }
+        QDataStream in(device);
+        device->open(QFile::ReadOnly);
 
         // Load algorithm
-        transform = QSharedPointer<Transform>(Transform::deserialize(in));
+        QString description;
+        in >> description;
+        if (description == planMarker())
+            in >> description;
+        transform = QSharedPointer<Transform>(Transform::make(description, NULL));
+        transform->load(in);
 
         qint32 mode;
         in >> mode;
@@ -176,6 +254,8 @@ struct AlgorithmCore
         }
         if (mode == TransformCompare)
             comparison = QSharedPointer<Transform>(Transform::deserialize(in));
+
+        mappedModel = mappedRead;
     }
 
     File getMemoryGallery(const File &file) const
@@ -183,6 +263,49 @@ struct AlgorithmCore
         return name + file.baseName() + file.hash() + ".mem";
     }
 
+    static QString journalName(const File &gallery)
+    {
+        return gallery.name + ".journal";
+    }
+
+    // Each line of the journal is "<input> <position> <gallery size>", recording that the first <position> templates
+    // of input <input> are committed to the gallery, which was <gallery size> bytes long at the time.
+    static bool readJournal(const File &gallery, int &input, qint64 &position)
+    {
+        QFile journal(journalName(gallery));
+        if (!gallery.exists() || !journal.open(QFile::ReadOnly))
+            return false;
+
+        qint64 size = -1;
+        while (!journal.atEnd()) {
+            const QByteArray line = journal.readLine();
+            if (!line.endsWith('\n'))
+                break; // Interrupted while writing this line
+            const QList<QByteArray> words = line.trimmed().split(' ');
+            if (words.size() != 3)
+                qFatal("Corrupt enrollment journal: %s", qPrintable(journal.fileName()));
+            input = words[0].toInt();
+            position = words[1].toLongLong();
+            size = words[2].toLongLong();
+        }
+        if (size == -1)
+            return false;
+
+        // Discard anything written after the last commit
+        QFile output(gallery.name);
+        if ((output.size() < size) || !output.resize(size))
+            qFatal("Gallery %s is shorter than its enrollment journal records.", qPrintable(gallery.name));
+        return true;
+    }
+
+    static void writeJournal(const File &gallery, int input, qint64 position)
+    {
+        QFile journal(journalName(gallery));
+        if (!journal.open(QFile::WriteOnly | QFile::Append))
+            qFatal("Can't write enrollment journal: %s", qPrintable(journal.fileName()));
+        journal.write(QString("%1 %2 %3\n").arg(QString::number(input), QString::number(position), QString::number(QFileInfo(gallery.name).size())).toLatin1());
+    }
+
     void enroll(File input, File gallery = File())
     {
         bool noOutput = false;
@@ -194,19 +317,65 @@ struct AlgorithmCore
         bool multiProcess = Globals->file.getBool("multiProcess", false);
         bool fileExclusion = false;
 
+        // With a journal the input is enrolled in blocks, each committed to the gallery before the next is started,
+        // and a restarted enrollment appends to the gallery from the first uncommitted input.
+        const bool journal = !noOutput && gallery.getBool("journal");
+        bool resumed = false;
+        int journalInput = 0;
+        qint64 journalPosition = 0;
+        if (journal) {
+            // Only binary galleries commit on flush(), the others write on destruction and would be truncated on resume
+            QScopedPointer<Gallery> output(Gallery::make(gallery));
+            if (!output->inherits("br::BinaryGallery"))
+                qFatal("Gallery %s can't be journaled, use a binary gallery format such as .gal.", qPrintable(gallery.name));
+            resumed = readJournal(gallery, journalInput, journalPosition);
+            if (resumed) {
+                qDebug("Resuming enrollment to %s from its journal", qPrintable(gallery.name));
+                gallery.set("append", true);
+            } else {
+                QFile::remove(journalName(gallery));
+                if (!gallery.contains("append"))
+                    QFile::remove(gallery.name); // So the journal never records the size of a stale gallery
+            }
+        }
+
+        // With deduplicate, inputs whose contents were already enrolled to the gallery by this algorithm are skipped
+        // before they are decoded, through a table of content hashes kept beside the gallery
+        QScopedPointer<Transform> hashExclusion, hashRecord;
+        if (!noOutput && gallery.getBool("deduplicate")) {
+            const QString table = gallery.name + ".hashes";
+            if (!resumed && !gallery.contains("append"))
+                QFile::remove(table);
+            hashExclusion.reset(Transform::make("HashExclusion(table=" + table + ")", NULL));
+            hashExclusion->setPropertyRecursive("algorithm", name);
+            hashRecord.reset(Transform::make("HashRecord(table=" + table + ")", NULL));
+        }
+
         // In append mode, we will exclude any templates with filenames already present in the output gallery
-        if (gallery.contains("append") && gallery.exists() ) {
+        if (!resumed && gallery.contains("append") && gallery.exists()) {
             FileList::fromGallery(gallery,true);
             fileExclusion = true;
         }
 
         Transform *enroll = simplifiedTransform.data();
 
-        if (multiProcess)
+        // Worker processes are pooled by algorithm, so later calls reuse them
+        if (multiProcess) {
             enroll = wrapTransform(enroll, "ProcessWrapper");
+            enroll->setProperty(QString("pool"), name);
+        }
+
+        // Per-template cost, -enrollDeadline <ms> fails inputs that take too long
+        QScopedPointer<Transform> cost(wrapTransform(enroll, "Cost"));
+        cost->setPropertyRecursive("deadline", Globals->file.get<int>("enrollDeadline", 0));
+        cost->setPropertyRecursive("slowest", Globals->file.get<int>("slowestInputs", 10));
 
         QList<Transform *> stages;
-        stages.append(enroll);
+        if (hashExclusion)
+            stages.append(hashExclusion.data());
+        stages.append(cost.data());
+        if (hashRecord)
+            stages.append(hashRecord.data()); // Only inputs that enrolled are recorded
 
         QString outputDesc;
         if (fileExclusion)
@@ -220,20 +389,43 @@ struct AlgorithmCore
         QScopedPointer<Transform> pipeline(pipeTransforms(stages));
         QScopedPointer<Transform> stream(wrapTransform(pipeline.data(), "Stream(readMode=StreamGallery, endPoint="+outputDesc+")"));
 
-        foreach (const br::File &file, input.split()) {
+        const QList<File> inputs = input.split();
+        for (int i=journalInput; i<inputs.size(); i++) {
+            const File &file = inputs[i];
             qDebug("Enrolling %s%s", qPrintable(file.name),
                     gallery.isNull() ? "" : qPrintable(" to " + gallery.flat()));
 
             Gallery *temp = Gallery::make(file);
             qint64 total = temp->totalSize();
-            delete temp;
 
             progressCounter->setPropertyRecursive("totalProgress", QString::number(total));
 
-            TemplateList data, output;
-            data.append(file);
+            if (!journal) {
+                delete temp;
+                TemplateList data, output;
+                data.append(file);
+                stream->projectUpdate(data, output);
+                continue;
+            }
+
+            delete temp;
 
-            stream->projectUpdate(data, output);
+            // GalleryOutput flushes the gallery at the end of every stream, committing the block.
+            // The input ends at the first block with no templates, so it is never counted in a separate pass.
+            for (qint64 position = (i == journalInput) ? journalPosition : 0; ; position += Globals->blockSize) {
+                QScopedPointer<Gallery> probe(Gallery::make(file));
+                if (probe->readRange(position, position + 1).isEmpty())
+                    break;
+
+                File block = file;
+                block.set("pos", position);
+                block.set("length", Globals->blockSize);
+                TemplateList data, output;
+                data.append(block);
+                stream->projectUpdate(data, output);
+                writeJournal(gallery, i, position + Globals->blockSize);
+            }
+            writeJournal(gallery, i+1, 0);
         }
 
         if (multiProcess)
@@ -253,8 +445,11 @@ struct AlgorithmCore
             TemplateList templates = inputGallery->readBlock(&done);
             if (!templates.empty())
                 templates >> *transform;
-            if (!templates.empty())
+            if (!templates.empty()) {
+                // Inputs are often just file names, so later blocks are sized by what the first one enrolled to
+                inputGallery->tuneBlockSize(templates);
                 outputGallery->writeBlock(templates);
+            }
         } while (!done);
     }
 
@@ -266,7 +461,7 @@ struct AlgorithmCore
 
     void retrieveOrEnroll(const File &file, QScopedPointer<Gallery> &gallery, FileList &galleryFiles)
     {
-        if (!file.getBool("enroll") && (QStringList() << "gal" << "mem" << "template" << "ut").contains(file.suffix())) {
+        if (!file.getBool("enroll") && (QStringList() << "gal" << "mem" << "template" << "ut" << "mmap" << "fgal" << "zgal" << "ivf").contains(file.suffix())) {
             // Retrieve it
             gallery.reset(Gallery::make(file));
             galleryFiles = gallery->files();
@@ -298,27 +493,118 @@ struct AlgorithmCore
         retrieveOrEnroll(targetGallery, t, targetFiles);
         retrieveOrEnroll(queryGallery, q, queryFiles);
 
-        if (t->files().length() != q->files().length() )
+        if (targetFiles.length() != queryFiles.length())
             qFatal("Dimension mismatch in pairwise compare");
 
-        TemplateList queries = q->read();
-        TemplateList targets = t->read();
-
         output.set("targetGallery", targetGallery.name );
         output.set("queryGallery", queryGallery.name );
 
         // Use a single file for one of the dimensions so that the output makes the right size file
         FileList dummyTarget;
-        dummyTarget.append(targets[0]);
+        dummyTarget.append(targetFiles.first());
         QScopedPointer<Output> realOutput(Output::make(output, dummyTarget, queryFiles));
 
         realOutput->set_blockRows(INT_MAX);
         realOutput->set_blockCols(INT_MAX);
         realOutput->setBlock(0,0);
-        for (int i=0; i < queries.length(); i++) {
-            float res = distance->compare(queries[i], targets[i]);
-            realOutput->setRelative(res, 0,i);
+
+        // The galleries are read in lockstep a block at a time, each block's pairs are scored in parallel
+        // and written before the next block is read, so memory is bounded by the block size
+        const int threads = std::max(1, threadParallelism());
+        TemplateList queries, targets;
+        bool queriesDone = false, targetsDone = false;
+        int offset = 0;
+        PairwiseBlock block;
+        block.distance = distance.data();
+        block.queries = &queries;
+        block.targets = &targets;
+        while (true) {
+            while (!queriesDone && (queries.size() < Globals->blockSize))
+                queries.append(q->readBlock(&queriesDone));
+            while (!targetsDone && (targets.size() < Globals->blockSize))
+                targets.append(t->readBlock(&targetsDone));
+
+            const int pairs = std::min(queries.size(), targets.size());
+            if (pairs == 0) break;
+
+            block.scores.resize(pairs);
+            const int chunk = std::max(1, (pairs + threads - 1) / threads);
+            QFutureSynchronizer<void> futures;
+            for (int i=0; i<pairs; i+=chunk)
+                futures.addFuture(QtConcurrent::run(comparePairs, &block, i, std::min(i+chunk, pairs)));
+            futures.waitForFinished();
+
+            for (int i=0; i<pairs; i++)
+                realOutput->setRelative(block.scores[i], 0, offset+i);
+            offset += pairs;
+
+            queries = queries.mid(pairs);
+            targets = targets.mid(pairs);
         }
+
+        if (!queries.isEmpty() || !targets.isEmpty())
+            qFatal("Dimension mismatch in pairwise compare");
+    }
+
+    struct PairwiseBlock
+    {
+        const Distance *distance;
+        const TemplateList *queries, *targets;
+        QVector<float> scores;
+    };
+
+    // Scores queries[i] against targets[i] for i in [begin, end)
+    static void comparePairs(PairwiseBlock *block, int begin, int end)
+    {
+        for (int i=begin; i<end; i++)
+            block->scores[i] = block->distance->compare(block->queries->at(i), block->targets->at(i));
+    }
+
+    // Locality sensitive hashing for L1 distance over 8-bit features. Each bit compares one randomly chosen
+    // byte against a random threshold, so nearby templates share a bucket in at least one table with high probability.
+    // Returns, for each template in templates, the indices of earlier templates it collides with.
+    static QVector< QSet<int> > lshCandidates(const TemplateList &templates, int tables, int bits)
+    {
+        const int bytes = templates.first().bytes();
+        bits = std::min(bits, 64);
+
+        Common::seedRNG();
+        QVector< QSet<int> > candidates(templates.size());
+        for (int i=0; i<tables; i++) {
+            const QList<int> dims = Common::RandSample(bits, bytes);
+            const QList<int> thresholds = Common::RandSample(bits, 256);
+
+            QHash<quint64, QList<int> > buckets;
+            for (int j=0; j<templates.size(); j++) {
+                const uchar *data = templates[j].m().data;
+                quint64 key = 0;
+                for (int k=0; k<bits; k++)
+                    key |= quint64(data[dims[k]] > thresholds[k]) << k;
+
+                QList<int> &bucket = buckets[key];
+                foreach (int other, bucket)
+                    candidates[j].insert(other);
+                bucket.append(j);
+            }
+        }
+        return candidates;
+    }
+
+    // Indices of the earlier candidates scoring at least threshold against templates[index],
+    // every earlier template is a candidate if candidates is empty
+    QList<int> duplicatesOf(const TemplateList &templates, int index, const QSet<int> &candidates, float threshold) const
+    {
+        QList<int> duplicates;
+        if (candidates.isEmpty()) {
+            for (int i=0; i<index; i++)
+                if (distance->compare(templates[i], templates[index]) >= threshold)
+                    duplicates.append(i);
+        } else {
+            foreach (int candidate, candidates)
+                if (distance->compare(templates[candidate], templates[index]) >= threshold)
+                    duplicates.append(candidate);
+        }
+        return duplicates;
     }
 
     void deduplicate(const File &inputGallery, const File &outputGallery, const float threshold)
@@ -331,44 +617,59 @@ struct AlgorithmCore
         FileList inputFiles;
         retrieveOrEnroll(inputGallery, i, inputFiles);
 
-        TemplateList t = i->read();
-
-        Output *o = Output::make(QString("buffer.tail[selfSimilar,threshold=%1,atLeast=0]").arg(QString::number(threshold)),inputFiles,inputFiles);
-
-        // Compare to global tail output
-        distance->compare(t,t,o);
-
-        delete o;
-
-        QString buffer(Globals->buffer);
-
-        QStringList tail = buffer.split("\n");
-
-        // Remove header
-        tail.removeFirst();
-
-        QStringList toRemove;
-        foreach (const QString &s, tail)
-            toRemove.append(s.split(',').at(1));
-
-        QSet<QString> duplicates = QSet<QString>::fromList(toRemove);
-
-        QStringList fileNames = inputFiles.names();
-
-        QList<int> indices;
-        foreach (const QString &d, duplicates)
-            indices.append(fileNames.indexOf(d));
+        // When appending to an existing deduplicated gallery, new templates are also checked against its contents
+        TemplateList existing;
+        if (outputGallery.get<bool>("append", false) && QFileInfo(outputGallery.name).exists()) {
+            File existingGallery = outputGallery;
+            existingGallery.remove("append");
+            existing = TemplateList::fromGallery(existingGallery);
+        }
 
-        std::sort(indices.begin(),indices.end(),std::greater<float>());
+        TemplateList t = existing;
+        t.append(i->read());
+
+        // Candidate pairs come from LSH when lshTables > 0 and templates are single 8-bit matrices of equal size,
+        // otherwise every earlier template is a candidate
+        const int tables = outputGallery.get<int>("lshTables", 0);
+        bool hashable = (tables > 0) && !t.isEmpty();
+        foreach (const Template &temp, t)
+            hashable = hashable && (temp.size() == 1) && (temp.m().depth() == CV_8U) && temp.m().isContinuous() && (temp.bytes() == t.first().bytes());
+
+        QVector< QSet<int> > candidates;
+        if (hashable) candidates = lshCandidates(t, tables, outputGallery.get<int>("lshBits", 16));
+        else if (tables > 0) qWarning("Templates are not uniform 8-bit matrices, comparing all pairs.");
+
+        // Only candidate pairs are scored exactly
+        QHash< int, QFuture< QList<int> > > futures;
+        for (int j=existing.size(); j<t.size(); j++)
+            if (!hashable || !candidates[j].isEmpty())
+                futures.insert(j, QtConcurrent::run(this, &AlgorithmCore::duplicatesOf, t, j, hashable ? candidates[j] : QSet<int>(), threshold));
+
+        // A template is a duplicate if it matches an existing template or a later template that was kept,
+        // so of the new templates that match each other the last one is kept
+        QVector<bool> kept(t.size(), true);
+        QVector< QList<int> > later(t.size());
+        foreach (int j, futures.keys())
+            foreach (int duplicate, futures[j].result()) {
+                if (duplicate < existing.size()) kept[j] = false;
+                else                             later[duplicate].append(j);
+            }
+        for (int j=t.size()-1; j>=existing.size(); j--)
+            foreach (int duplicate, later[j])
+                if (kept[duplicate]) {
+                    kept[j] = false;
+                    break;
+                }
 
-        qDebug("\n%d duplicates removed.", indices.size());
+        TemplateList unique;
+        for (int j=existing.size(); j<t.size(); j++)
+            if (kept[j])
+                unique.append(t[j]);
 
-        for (int i=0; i<indices.size(); i++)
-            inputFiles.removeAt(indices[i]);
+        qDebug("\n%d duplicates removed.", t.size() - existing.size() - unique.size());
 
         QScopedPointer<Gallery> og(Gallery::make(outputGallery));
-
-        og->writeBlock(inputFiles);
+        og->writeBlock(unique);
     }
 
     void compare(File targetGallery, File queryGallery, File output)
@@ -435,7 +736,8 @@ struct AlgorithmCore
         // simple make sure the enrolled data is stored in a memGallery, but in multi-process mode we save the enrolled
         // data to disk (as a .gal file) so that each worker process can read it without re-doing enrollment.
         File colEnrolledGallery = colGallery;
-        QString targetExtension = "mem";
+        // Under a memory limit the column gallery is enrolled to disk, and only loaded if it fits
+        QString targetExtension = (Globals->memoryLimit > 0) ? "gal" : "mem";
 
         // If the column gallery is not already of the appropriate type, we need to do something
         if (colGallery.suffix() != targetExtension) {
@@ -443,7 +745,7 @@ struct AlgorithmCore
             colEnrolledGallery = colGallery.baseName() + colGallery.hash() + '.' + targetExtension;
 
             // Check if we have to do real enrollment, and not just convert the gallery's type.
-            if (!(QStringList() << "gal" << "template" << "mem" << "ut").contains(colGallery.suffix()))
+            if (!(QStringList() << "gal" << "template" << "mem" << "ut" << "mmap" << "fgal" << "zgal" << "ivf").contains(colGallery.suffix()))
                 enroll(colGallery, colEnrolledGallery);
 
             // If the gallery does have enrolled templates, but is not the right type, we do a simple
@@ -465,7 +767,7 @@ struct AlgorithmCore
         // which compares incoming templates against a gallery, we will handle enrollment of the row set by simply
         // building a transform that does enrollment (using the current algorithm), then does the comparison in one
         // step. This way, we don't have to retain the complete enrolled row gallery in memory, or on disk.
-        else if (!(QStringList() << "gal" << "mem" << "template" << "ut").contains(rowGallery.suffix()))
+        else if (!(QStringList() << "gal" << "mem" << "template" << "ut" << "mmap" << "fgal" << "zgal" << "ivf").contains(rowGallery.suffix()))
             needEnrollRows = true;
 
         // At this point, we have decided how we will structure the comparison (either in transpose mode, or not), 
@@ -478,12 +780,48 @@ struct AlgorithmCore
         // progress counting step.
         // After the base algorithm is built, the whole thing will be run in a stream, so that I/O can be handled sequentially.
 
+        // -scoreCache <file> reuses the scores of template pairs compared in earlier runs.
+        // Declared before the stream so its new scores are written once comparison finishes.
+        QScopedPointer<Distance> scoreCache;
+        const QString scoreCacheFile = Globals->file.get<QString>("scoreCache", "");
+        if (distance && !scoreCacheFile.isEmpty()) {
+            scoreCache.reset(Distance::make("ScoreCache", NULL));
+            scoreCache->setPropertyRecursive("distance", QVariant::fromValue(distance.data()));
+            scoreCache->setPropertyRecursive("cache", scoreCacheFile);
+            comparison->setPropertyRecursive("distance", QVariant::fromValue(scoreCache.data()));
+        }
+
         // The actual comparison step is done by a GalleryCompare transform, which has a Distance, and a gallery as data.
         // Incoming templates are compared against the templates in the gallery, and the output is the resulting score
         // vector.
-        TemplateList tlist = TemplateList::fromGallery(colEnrolledGallery);
-        comparison->train(tlist);
-        comparison->setPropertyRecursive("galleryName","");
+        //
+        // In multi-process mode, the column gallery is written to a read-only mapped gallery instead.
+        // The comparison then references it by name, so each worker process maps the same file rather
+        // than deserializing its own private copy of the enrolled templates.
+        //
+        // Under a memory limit, an enrolled gallery that wouldn't fit in memory (twice, since GalleryCompare
+        // packs it) is compared through the same mapped gallery, which the kernel can page out.
+        const qint64 colBytes = (colEnrolledGallery.suffix() == "mem") ? 0 : QFileInfo(colEnrolledGallery.name).size();
+        const bool spill = (Globals->memoryLimit > 0) && (2 * colBytes > Context::memoryAvailable());
+        if (spill)
+            qDebug("Comparing against %s through a mapped gallery to stay within the memory limit.", qPrintable(colGallery.flat()));
+
+        if (multiProcess || spill) {
+            const File colMappedGallery = colGallery.baseName() + colGallery.hash() + ".mmap";
+            QScopedPointer<Gallery> readColGallery(Gallery::make(colEnrolledGallery));
+            QScopedPointer<Gallery> mappedColOutput(Gallery::make(colMappedGallery));
+            bool done = false;
+            while (!done)
+                mappedColOutput->writeBlock(readColGallery->readBlock(&done));
+            mappedColOutput.reset();
+
+            comparison->train(TemplateList());
+            comparison->setPropertyRecursive("galleryName", QFileInfo(colMappedGallery).absoluteFilePath());
+        } else {
+            TemplateList tlist = TemplateList::fromGallery(colEnrolledGallery);
+            comparison->train(tlist);
+            comparison->setPropertyRecursive("galleryName","");
+        }
 
         QString compareRegionDesc;
         QList<Transform *> enrollCompare;
@@ -495,8 +833,10 @@ struct AlgorithmCore
 
         Transform *compareRegionBase = pipeTransforms(enrollCompare);
         // If in multi-process mode, wrap the enroll+compare structure in a ProcessWrapper.
-        if (multiProcess)
+        if (multiProcess) {
             compareRegionBase = wrapTransform(compareRegionBase, "ProcessWrapper");
+            compareRegionBase->setProperty(QString("pool"), name);
+        }
 
         QScopedPointer<Transform> compareRegion(compareRegionBase);
 
@@ -535,6 +875,9 @@ struct AlgorithmCore
 
         // Do the actual comparisons
         streamWrapper->projectUpdate(rowGalleryTemplate, outputGallery);
+
+        if (scoreCache)
+            comparison->setPropertyRecursive("distance", QVariant::fromValue(distance.data()));
     }
 
 private:
@@ -667,16 +1010,425 @@ void br::Enroll(TemplateList &tl)
     AlgorithmManager::getAlgorithm(alg)->enroll(tl);
 }
 
+/*!
+ * Batches templates submitted through br::EnrollAsync.
+ * Submissions arriving within a short window of one another are concatenated and enrolled together,
+ * so small requests share the parallelism of a single projection through the algorithm.
+ * Two workers run in turn, letting the next batch start while the tail of the previous one finishes.
+ * Each template is tagged with its submission so the enrolled templates can be handed back to their owners.
+ */
+class AsyncEnroller : public Initializer
+{
+    Q_OBJECT
+
+    struct Submission
+    {
+        TemplateList data;
+        QString algorithm;
+        EnrollCallback callback;
+        void *context;
+        QFutureInterface<TemplateList> result;
+    };
+
+    class Worker : public QThread
+    {
+        void run()
+        {
+            while (AsyncEnroller::process());
+        }
+    };
+
+    static const int Workers = 2;
+    static const int BatchWindow = 5; // ms
+
+    static QMutex lock;
+    static QWaitCondition submitted;
+    static QList<Submission*> pending;
+    static QList<Worker*> workers;
+    static bool stopping;
+
+    static int pendingTemplates(const QString &algorithm)
+    {
+        int count = 0;
+        foreach (const Submission *submission, pending)
+            if (submission->algorithm == algorithm)
+                count += submission->data.size();
+        return count;
+    }
+
+    static bool process()
+    {
+        QList<Submission*> batch;
+        {
+            QMutexLocker locker(&lock);
+            while (pending.isEmpty() && !stopping)
+                submitted.wait(&lock);
+            if (pending.isEmpty())
+                return false;
+
+            // Give concurrent submitters a moment to join the batch
+            const QString algorithm = pending.first()->algorithm;
+            QElapsedTimer timer;
+            timer.start();
+            while (!stopping && (pendingTemplates(algorithm) < Globals->blockSize) && (timer.elapsed() < BatchWindow))
+                submitted.wait(&lock, qMax(qint64(1), BatchWindow - timer.elapsed()));
+
+            int size = 0;
+            for (int i=0; i<pending.size(); i++) {
+                Submission *submission = pending[i];
+                if (submission->algorithm != algorithm)
+                    continue;
+                if (!batch.isEmpty() && (size + submission->data.size() > Globals->blockSize))
+                    break;
+                size += submission->data.size();
+                batch.append(pending.takeAt(i--));
+            }
+        }
+
+        TemplateList data;
+        for (int i=0; i<batch.size(); i++)
+            foreach (Template t, batch[i]->data) {
+                t.file.set("AsyncSubmission", i);
+                data.append(t);
+            }
+
+        AlgorithmManager::getAlgorithm(batch.first()->algorithm)->enroll(data);
+
+        QVector<TemplateList> enrolled(batch.size());
+        foreach (Template t, data) {
+            // Templates made by the algorithm without their source's metadata can only be returned if the batch has one owner
+            const int i = t.file.contains("AsyncSubmission") ? t.file.get<int>("AsyncSubmission", -1) : ((batch.size() == 1) ? 0 : -1);
+            t.file.remove("AsyncSubmission");
+            if ((i < 0) || (i >= batch.size())) {
+                qWarning("Enrolled template %s lost its submission and is dropped.", qPrintable(t.file.name));
+                continue;
+            }
+            enrolled[i].append(t);
+        }
+
+        for (int i=0; i<batch.size(); i++)
+            complete(batch[i], enrolled[i]);
+        return true;
+    }
+
+    static void complete(Submission *submission, const TemplateList &enrolled)
+    {
+        if (submission->callback)
+            submission->callback(enrolled, submission->context);
+        submission->result.reportResult(enrolled);
+        submission->result.reportFinished();
+        delete submission;
+    }
+
+public:
+    void initialize() const {}
+
+    void finalize() const
+    {
+        // Outstanding submissions are enrolled before the workers exit
+        lock.lock();
+        stopping = true;
+        submitted.wakeAll();
+        lock.unlock();
+
+        foreach (Worker *worker, workers) {
+            worker->wait();
+            delete worker;
+        }
+        workers.clear();
+        stopping = false;
+    }
+
+    static QFuture<TemplateList> submit(const TemplateList &data, EnrollCallback callback, void *context)
+    {
+        Submission *submission = new Submission();
+        submission->data = data;
+        submission->callback = callback;
+        submission->context = context;
+        submission->result.reportStarted();
+        QFuture<TemplateList> future = submission->result.future();
+
+        if (data.isEmpty()) {
+            complete(submission, TemplateList());
+            return future;
+        }
+        submission->algorithm = data.first().file.get<QString>("algorithm");
+
+        QMutexLocker locker(&lock);
+        if (stopping) qFatal("Enrollment submitted during shutdown.");
+        while (workers.size() < Workers) {
+            workers.append(new Worker());
+            workers.last()->start();
+        }
+        pending.append(submission);
+        submitted.wakeAll();
+        return future;
+    }
+};
+
+QMutex AsyncEnroller::lock;
+QWaitCondition AsyncEnroller::submitted;
+QList<AsyncEnroller::Submission*> AsyncEnroller::pending;
+QList<AsyncEnroller::Worker*> AsyncEnroller::workers;
+bool AsyncEnroller::stopping = false;
+
+BR_REGISTER(Initializer, AsyncEnroller)
+
+QFuture<TemplateList> br::EnrollAsync(const TemplateList &tl, EnrollCallback callback, void *context)
+{
+    return AsyncEnroller::submit(tl, callback, context);
+}
+
+namespace {
+
+// Enrolls one contiguous chunk of an AlgorithmHandle::enroll call on a thread of the handle
+class EnrollChunk : public QRunnable
+{
+    const Transform *transform;
+    TemplateList *chunk;
+    QSemaphore *done;
+
+public:
+    EnrollChunk(const Transform *transform, TemplateList *chunk, QSemaphore *done)
+        : transform(transform), chunk(chunk), done(done) {}
+
+    void run()
+    {
+        // The handle's threads are its budget, so each chunk is projected serially
+        setThreadParallelism(1);
+        *chunk >> *transform;
+        done->release();
+    }
+};
+
+} // namespace
+
+br::AlgorithmHandle::AlgorithmHandle(const QString &description, int parallelism, int blockSize)
+    : m_description(description.isEmpty() ? Globals->algorithm : description)
+    , m_parallelism(parallelism > 0 ? parallelism : qMax(1, Globals->parallelism))
+    , m_blockSize(blockSize > 0 ? blockSize : Globals->blockSize)
+    , core(AlgorithmManager::getAlgorithm(m_description))
+    , threads(new QThreadPool())
+{
+    threads->setMaxThreadCount(m_parallelism);
+}
+
+void br::AlgorithmHandle::enroll(TemplateList &templates) const
+{
+    if (core->transform.isNull()) qFatal("Null transform.");
+    if (templates.isEmpty())
+        return;
+
+    // Contiguous chunks, at least one per thread, so the enrolled templates keep their order
+    const int chunkSize = qMax(1, qMin(m_blockSize, (templates.size() + m_parallelism - 1) / m_parallelism));
+    QList<TemplateList> chunks;
+    for (int i=0; i<templates.size(); i+=chunkSize)
+        chunks.append(templates.mid(i, chunkSize));
+
+    QSemaphore done;
+    for (int i=0; i<chunks.size(); i++)
+        threads->start(new EnrollChunk(core->transform.data(), &chunks[i], &done));
+    done.acquire(chunks.size());
+
+    templates.clear();
+    foreach (const TemplateList &chunk, chunks)
+        templates.append(chunk);
+}
+
+void br::AlgorithmHandle::compare(const TemplateList &target, const TemplateList &query, Output *output) const
+{
+    if (core->distance.isNull()) qFatal("Null distance.");
+
+    // The comparison runs on the calling thread and its tiles are split according to the handle's budget
+    // The caller may have a budget of its own, e.g. a worker of another handle, which is restored afterwards
+    const int previous = setThreadParallelism(m_parallelism);
+    comparePartitions(core->distance.data(), target, query, output);
+    setThreadParallelism(previous);
+}
+
+/*!
+ * Coordinates a comparison sharded across the br processes named in the "workers" global.
+ * Each worker is a command prefix like "ssh node1", or "local" for a process on this machine.
+ * The query and target galleries are cut into a grid of shards, more shards than workers so that
+ * faster nodes take on more of them, and every shard is compared by a "br -compare" on a free worker.
+ * Shard galleries and partial matrices are exchanged through the scratch path, which must be on a
+ * filesystem shared by every worker. A worker whose process fails is retired and its shard reassigned.
+ */
+class DistributedCompare
+{
+    struct Shard
+    {
+        int row, column; // Indices into the row and column shard galleries
+        QString matrix;
+        int attempts;
+    };
+
+    QStringList workers;
+    QString algorithm, directory;
+    QList<QPair<int,int> > rowRanges, columnRanges; // QList<QPair<begin,end> >
+    QStringList rowGalleries, columnGalleries;
+
+    static QList<QPair<int,int> > ranges(int size, int count)
+    {
+        QList<QPair<int,int> > result;
+        for (int i=0; i<count; i++)
+            result.append(QPair<int,int>(qint64(size)*i/count, qint64(size)*(i+1)/count));
+        return result;
+    }
+
+    // Writes templates [begin, end) of gallery, enrolled shards as .gal and the rest as .csv so workers still enroll them
+    static QString writeShard(const File &gallery, const QString &baseName, int begin, int end)
+    {
+        const bool enrolled = (QStringList() << "gal" << "mem" << "template" << "ut" << "mmap" << "fgal" << "zgal" << "ivf").contains(gallery.suffix());
+        const QString shard = baseName + (enrolled ? ".gal" : ".csv");
+        QScopedPointer<Gallery> input(Gallery::make(gallery));
+        QScopedPointer<Gallery> output(Gallery::make(shard));
+        output->writeBlock(input->readRange(begin, end));
+        return shard;
+    }
+
+    // The remote shell re-parses the command line, so arguments are quoted unless the worker is local
+    static QString quote(QString argument)
+    {
+        return "'" + argument.replace("'", "'\\''") + "'";
+    }
+
+    QProcess *start(int worker, const Shard &shard) const
+    {
+        QStringList arguments;
+        arguments << "-algorithm" << algorithm << "-path" << Globals->path << "-quiet" << "true"
+                  << "-compare" << columnGalleries[shard.column] << rowGalleries[shard.row] << shard.matrix;
+
+        QString program = "br";
+        if (workers[worker] != "local") {
+            QStringList command = workers[worker].split(' ', QString::SkipEmptyParts);
+            for (int i=0; i<arguments.size(); i++)
+                arguments[i] = quote(arguments[i]);
+            arguments.prepend(program);
+            program = command.takeFirst();
+            arguments = command + arguments;
+        }
+
+        QProcess *process = new QProcess();
+        process->setStandardOutputFile(QProcess::nullDevice());
+        process->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        process->start(program, arguments);
+        return process;
+    }
+
+public:
+    DistributedCompare(const QString &workers, const QString &algorithm)
+        : workers(workers.split(';', QString::SkipEmptyParts)), algorithm(algorithm) {}
+
+    void compare(const File &targetGallery, File queryGallery, const File &output)
+    {
+        if (output.exists() && output.get<bool>("cache", false)) return;
+        if (queryGallery == ".") queryGallery = targetGallery;
+
+        // Rows of the output are queries and columns are targets
+        const FileList targetFiles = FileList::fromGallery(targetGallery, true);
+        const FileList queryFiles = FileList::fromGallery(queryGallery, true);
+        if (targetFiles.isEmpty() || queryFiles.isEmpty()) qFatal("Can't distribute an empty comparison.");
+
+        // Aim for twice as many roughly square shards as there are workers
+        const int shards = 2 * workers.size();
+        const int rowShards = qBound(1, qRound(sqrt(double(shards) * queryFiles.size() / targetFiles.size())), queryFiles.size());
+        const int columnShards = qBound(1, (shards + rowShards - 1) / rowShards, targetFiles.size());
+        rowRanges = ranges(queryFiles.size(), rowShards);
+        columnRanges = ranges(targetFiles.size(), columnShards);
+
+        directory = Globals->scratchPath() + "/distributed/" + QUuid::createUuid().toString().mid(1, 36);
+        QtUtils::touchDir(QDir(directory));
+        for (int i=0; i<rowShards; i++)
+            rowGalleries.append(writeShard(queryGallery, directory + "/row" + QString::number(i), rowRanges[i].first, rowRanges[i].second));
+        for (int j=0; j<columnShards; j++)
+            columnGalleries.append(writeShard(targetGallery, directory + "/column" + QString::number(j), columnRanges[j].first, columnRanges[j].second));
+
+        QList<Shard> pending;
+        for (int i=0; i<rowShards; i++)
+            for (int j=0; j<columnShards; j++) {
+                Shard shard;
+                shard.row = i;
+                shard.column = j;
+                shard.matrix = directory + "/" + QString::number(i) + "_" + QString::number(j) + ".mtx";
+                shard.attempts = 0;
+                pending.append(shard);
+            }
+
+        qDebug("Comparing %s and %s%s in %d shards across %d workers", qPrintable(targetGallery.flat()), qPrintable(queryGallery.flat()),
+               output.isNull() ? "" : qPrintable(" to " + output.flat()), pending.size(), workers.size());
+
+        QScopedPointer<Output> o(Output::make(output, targetFiles, queryFiles));
+        o->setBlock(-1, -1);
+        Globals->currentStep = 0;
+        Globals->totalSteps = pending.size();
+
+        QVector<bool> retired(workers.size(), false);
+        QHash<int, QPair<QProcess*,Shard> > running; // QHash<worker,QPair<process,shard> >
+        while (!pending.isEmpty() || !running.isEmpty()) {
+            for (int w=0; (w<workers.size()) && !pending.isEmpty(); w++)
+                if (!retired[w] && !running.contains(w)) {
+                    const Shard shard = pending.takeFirst();
+                    running.insert(w, QPair<QProcess*,Shard>(start(w, shard), shard));
+                }
+
+            if (running.isEmpty())
+                qFatal("Every distributed compare worker failed.");
+
+            foreach (int w, running.keys()) {
+                QProcess *process = running[w].first;
+                Shard shard = running[w].second;
+                if ((process->state() != QProcess::NotRunning) && !process->waitForFinished(100 / running.size() + 1))
+                    continue;
+
+                const bool succeeded = (process->error() != QProcess::FailedToStart) && (process->exitStatus() == QProcess::NormalExit) &&
+                                       (process->exitCode() == 0) && QFileInfo(shard.matrix).exists();
+                delete process;
+                running.remove(w);
+
+                if (!succeeded) {
+                    retired[w] = true;
+                    if (++shard.attempts >= workers.size())
+                        qFatal("Shard %s failed on %d workers.", qPrintable(shard.matrix), shard.attempts);
+                    qWarning("Worker '%s' failed, reassigning shard %s.", qPrintable(workers[w]), qPrintable(shard.matrix));
+                    pending.prepend(shard);
+                    continue;
+                }
+
+                // Scores are merged into the output as each shard arrives, so the full matrix need not fit in memory unless the output keeps one
+                const cv::Mat scores = BEE::readMatrix(shard.matrix);
+                const QPair<int,int> &rows = rowRanges[shard.row], &columns = columnRanges[shard.column];
+                if ((scores.rows != rows.second - rows.first) || (scores.cols != columns.second - columns.first))
+                    qFatal("Shard %s has unexpected dimensions.", qPrintable(shard.matrix));
+                for (int i=0; i<scores.rows; i++)
+                    for (int j=0; j<scores.cols; j++)
+                        o->setRelative(scores.at<float>(i, j), rows.first + i, columns.first + j);
+                QFile::remove(shard.matrix);
+
+                Globals->currentStep++;
+                Globals->currentProgress = Globals->currentStep;
+                Globals->printStatus();
+            }
+        }
+
+        o.reset();
+        QDir(directory).removeRecursively();
+    }
+};
+
 void br::Compare(const File &targetGallery, const File &queryGallery, const File &output)
 {
-    AlgorithmManager::getAlgorithm(output.get<QString>("algorithm"))->compare(targetGallery, queryGallery, output);
+    const QString workers = Globals->file.get<QString>("workers", "");
+    if      (targetGallery.get<QString>("plugin", targetGallery.suffix()) == "shards") compareShards(targetGallery, queryGallery, output);
+    else if (!workers.isEmpty()) DistributedCompare(workers, output.get<QString>("algorithm")).compare(targetGallery, queryGallery, output);
+    else                         AlgorithmManager::getAlgorithm(output.get<QString>("algorithm"))->compare(targetGallery, queryGallery, output);
 }
 
 void br::CompareTemplateLists(const TemplateList &target, const TemplateList &query, Output *output)
 {
     QString alg = output->file.get<QString>("algorithm");
     QSharedPointer<Distance> dist = Distance::fromAlgorithm(alg);
-    dist->compare(target, query, output);
+    comparePartitions(dist.data(), target, query, output);
 }
 
 void br::PairwiseCompare(const File &targetGallery, const File &queryGallery, const File &output)
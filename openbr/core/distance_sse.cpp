@@ -0,0 +1,877 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <QByteArray>
+
+#include "distance_sse.h"
+
+#if ((defined(__GNUC__) && (__GNUC__ >= 6)) || defined(__clang__)) && defined(__x86_64__)
+#  define BR_X86_DISPATCH
+#  include <cpuid.h>
+#  include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#endif
+
+typedef float (*L1Function)(const uchar *a, const uchar *b, int size);
+typedef void (*ToHalfFunction)(const float *src, quint16 *dst, int n);
+typedef void (*ToFloatFunction)(const quint16 *src, float *dst, int n);
+
+/**** SCALAR ****/
+static float l1_scalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += abs(a[i]-b[i]);
+    return distance;
+}
+
+static float packed_l1_scalar(const uchar *a, const uchar *b, int size)
+{
+    static const uchar low_mask = 0x0F;
+    static const uchar hi_mask = 0xF0;
+
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += (abs((a[i] & low_mask) - (b[i] & low_mask)) >> 0) +
+                    (abs((a[i] & hi_mask)  - (b[i] & hi_mask))  >> 4);
+    return distance;
+}
+
+static float crumb_l1_scalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        for (int shift=0; shift<8; shift+=2)
+            distance += abs(((a[i] >> shift) & 0x03) - ((b[i] >> shift) & 0x03));
+    return distance;
+}
+
+static float hamming_scalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        for (uchar x = a[i] ^ b[i]; x; x &= x-1)
+            distance++;
+    return distance;
+}
+
+static float mismatches_scalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += (a[i] != b[i]);
+    return distance;
+}
+
+// Signed 8-bit dot product, exact while the result fits a float's 24-bit mantissa
+static float dot_s8_scalar(const uchar *a, const uchar *b, int size)
+{
+    const qint8 *x = (const qint8*) a, *y = (const qint8*) b;
+    int dot = 0;
+    for (int i=0; i<size; i++)
+        dot += int(x[i]) * int(y[i]);
+    return dot;
+}
+
+static inline float toFloat(quint16 h)
+{
+    const quint32 sign = quint32(h & 0x8000) << 16;
+    quint32 exponent = (h >> 10) & 0x1F, mantissa = h & 0x3FF, bits;
+    if (exponent == 0x1F) {
+        bits = sign | 0x7F800000 | (mantissa << 13); // Infinity or NaN
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        // Subnormal, normalize it
+        exponent = 113;
+        while (!(mantissa & 0x400)) { mantissa <<= 1; exponent--; }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Rounds to nearest even, as F16C does, see Fabian Giesen's float_to_half_fast3_rtne
+static inline quint16 toHalf(float value)
+{
+    quint32 f;
+    memcpy(&f, &value, sizeof(f));
+    const quint32 sign = f & 0x80000000;
+    f ^= sign;
+
+    quint16 h;
+    if (f >= (quint32(127 + 16) << 23)) {
+        h = (f > (quint32(255) << 23)) ? 0x7E00 : 0x7C00; // NaN or infinity
+    } else if (f < (quint32(113) << 23)) {
+        // Subnormal or zero, let the FPU round by adding 0.5
+        const quint32 magicBits = quint32(126) << 23;
+        float magic, x;
+        memcpy(&magic, &magicBits, sizeof(magic));
+        memcpy(&x, &f, sizeof(x));
+        x += magic;
+        memcpy(&f, &x, sizeof(f));
+        h = quint16(f - magicBits);
+    } else {
+        const quint32 mantissaOdd = (f >> 13) & 1;
+        f -= quint32(127 - 15) << 23;
+        f += 0xFFF + mantissaOdd;
+        h = quint16(f >> 13);
+    }
+    return h | quint16(sign >> 16);
+}
+
+static void to_half_scalar(const float *src, quint16 *dst, int n)
+{
+    for (int i=0; i<n; i++)
+        dst[i] = toHalf(src[i]);
+}
+
+static void to_float_scalar(const quint16 *src, float *dst, int n)
+{
+    for (int i=0; i<n; i++)
+        dst[i] = toFloat(src[i]);
+}
+
+// Half precision distances take their size in bytes, like the others, and accumulate in single precision
+static float half_l1_scalar(const uchar *a, const uchar *b, int size)
+{
+    const quint16 *x = (const quint16*) a, *y = (const quint16*) b;
+    float distance = 0;
+    for (int i=0; i<size/2; i++)
+        distance += fabsf(toFloat(x[i]) - toFloat(y[i]));
+    return distance;
+}
+
+static float half_l2_scalar(const uchar *a, const uchar *b, int size)
+{
+    const quint16 *x = (const quint16*) a, *y = (const quint16*) b;
+    float distance = 0;
+    for (int i=0; i<size/2; i++) {
+        const float d = toFloat(x[i]) - toFloat(y[i]);
+        distance += d * d;
+    }
+    return distance;
+}
+
+/**** SSE2 ****/
+#ifdef __SSE2__
+
+static inline qint64 sum(__m128i v)
+{
+    qint64 buff[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), v);
+    return buff[0] + buff[1];
+}
+
+static float l1_sse2(const uchar *a, const uchar *b, int size)
+{
+    __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128(),
+            acc2 = _mm_setzero_si128(), acc3 = _mm_setzero_si128();
+
+    // Independent accumulators hide the latency of the adds
+    int i = 0;
+    for (; i+64<=size; i+=64) {
+        acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a+i)),    _mm_loadu_si128((const __m128i*)(b+i))));
+        acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a+i+16)), _mm_loadu_si128((const __m128i*)(b+i+16))));
+        acc2 = _mm_add_epi64(acc2, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a+i+32)), _mm_loadu_si128((const __m128i*)(b+i+32))));
+        acc3 = _mm_add_epi64(acc3, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a+i+48)), _mm_loadu_si128((const __m128i*)(b+i+48))));
+    }
+    for (; i+16<=size; i+=16)
+        acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a+i)), _mm_loadu_si128((const __m128i*)(b+i))));
+
+    const __m128i acc = _mm_add_epi64(_mm_add_epi64(acc0, acc1), _mm_add_epi64(acc2, acc3));
+    return sum(acc) + l1_scalar(a+i, b+i, size-i);
+}
+
+static float packed_l1_sse2(const uchar *a, const uchar *b, int size)
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    __m128i acc = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m128i A = _mm_loadu_si128((const __m128i*)(a+i));
+        const __m128i B = _mm_loadu_si128((const __m128i*)(b+i));
+        // Unpack the nibbles into bytes, then use the unsigned byte SAD on each half
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_and_si128(A, mask), _mm_and_si128(B, mask)));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_and_si128(_mm_srli_epi16(A, 4), mask),
+                                              _mm_and_si128(_mm_srli_epi16(B, 4), mask)));
+    }
+    return sum(acc) + packed_l1_scalar(a+i, b+i, size-i);
+}
+
+static float crumb_l1_sse2(const uchar *a, const uchar *b, int size)
+{
+    const __m128i mask = _mm_set1_epi8(0x03);
+    __m128i acc = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m128i A = _mm_loadu_si128((const __m128i*)(a+i));
+        const __m128i B = _mm_loadu_si128((const __m128i*)(b+i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_and_si128(A, mask), _mm_and_si128(B, mask)));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_and_si128(_mm_srli_epi16(A, 2), mask), _mm_and_si128(_mm_srli_epi16(B, 2), mask)));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_and_si128(_mm_srli_epi16(A, 4), mask), _mm_and_si128(_mm_srli_epi16(B, 4), mask)));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_and_si128(_mm_srli_epi16(A, 6), mask), _mm_and_si128(_mm_srli_epi16(B, 6), mask)));
+    }
+    return sum(acc) + crumb_l1_scalar(a+i, b+i, size-i);
+}
+
+static float hamming_sse2(const uchar *a, const uchar *b, int size)
+{
+    const __m128i m1 = _mm_set1_epi8(0x55), m2 = _mm_set1_epi8(0x33), m4 = _mm_set1_epi8(0x0F);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        // Bit-parallel popcount of each byte, then the byte SAD against zero sums them
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a+i)), _mm_loadu_si128((const __m128i*)(b+i)));
+        x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi16(x, 1), m1));
+        x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi16(x, 2), m2));
+        x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi16(x, 4)), m4);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(x, zero));
+    }
+    return sum(acc) + hamming_scalar(a+i, b+i, size-i);
+}
+
+static float mismatches_sse2(const uchar *a, const uchar *b, int size)
+{
+    const __m128i one = _mm_set1_epi8(1), zero = _mm_setzero_si128();
+    __m128i acc = zero;
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        // Equal bytes become 1, then the byte SAD against zero counts them
+        const __m128i equal = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a+i)), _mm_loadu_si128((const __m128i*)(b+i))), one);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(equal, zero));
+    }
+    return (i - sum(acc)) + mismatches_scalar(a+i, b+i, size-i);
+}
+
+static inline int sum32(__m128i v)
+{
+    int buff[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buff), v);
+    return buff[0] + buff[1] + buff[2] + buff[3];
+}
+
+static float dot_s8_sse2(const uchar *a, const uchar *b, int size)
+{
+    __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m128i A = _mm_loadu_si128((const __m128i*)(a+i));
+        const __m128i B = _mm_loadu_si128((const __m128i*)(b+i));
+        // Sign extend to 16 bits by unpacking each byte into the high half of a lane
+        acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_srai_epi16(_mm_unpacklo_epi8(A, A), 8), _mm_srai_epi16(_mm_unpacklo_epi8(B, B), 8)));
+        acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_srai_epi16(_mm_unpackhi_epi8(A, A), 8), _mm_srai_epi16(_mm_unpackhi_epi8(B, B), 8)));
+    }
+    return sum32(_mm_add_epi32(acc0, acc1)) + dot_s8_scalar(a+i, b+i, size-i);
+}
+
+#endif // __SSE2__
+
+/**** AVX2 / AVX-512 ****/
+#ifdef BR_X86_DISPATCH
+
+__attribute__((target("avx2")))
+static float l1_avx2(const uchar *a, const uchar *b, int size)
+{
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256(),
+            acc2 = _mm256_setzero_si256(), acc3 = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i+128<=size; i+=128) {
+        acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a+i)),    _mm256_loadu_si256((const __m256i*)(b+i))));
+        acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a+i+32)), _mm256_loadu_si256((const __m256i*)(b+i+32))));
+        acc2 = _mm256_add_epi64(acc2, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a+i+64)), _mm256_loadu_si256((const __m256i*)(b+i+64))));
+        acc3 = _mm256_add_epi64(acc3, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a+i+96)), _mm256_loadu_si256((const __m256i*)(b+i+96))));
+    }
+    for (; i+32<=size; i+=32)
+        acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a+i)), _mm256_loadu_si256((const __m256i*)(b+i))));
+
+    const __m256i acc = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1), _mm256_add_epi64(acc2, acc3));
+    const __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si64(half) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half)) + l1_scalar(a+i, b+i, size-i);
+}
+
+__attribute__((target("avx2")))
+static float packed_l1_avx2(const uchar *a, const uchar *b, int size)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    __m256i acc = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m256i A = _mm256_loadu_si256((const __m256i*)(a+i));
+        const __m256i B = _mm256_loadu_si256((const __m256i*)(b+i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_and_si256(A, mask), _mm256_and_si256(B, mask)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi16(A, 4), mask),
+                                                    _mm256_and_si256(_mm256_srli_epi16(B, 4), mask)));
+    }
+
+    const __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si64(half) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half)) + packed_l1_scalar(a+i, b+i, size-i);
+}
+
+__attribute__((target("avx2")))
+static float crumb_l1_avx2(const uchar *a, const uchar *b, int size)
+{
+    const __m256i mask = _mm256_set1_epi8(0x03);
+    __m256i acc = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m256i A = _mm256_loadu_si256((const __m256i*)(a+i));
+        const __m256i B = _mm256_loadu_si256((const __m256i*)(b+i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_and_si256(A, mask), _mm256_and_si256(B, mask)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi16(A, 2), mask), _mm256_and_si256(_mm256_srli_epi16(B, 2), mask)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi16(A, 4), mask), _mm256_and_si256(_mm256_srli_epi16(B, 4), mask)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi16(A, 6), mask), _mm256_and_si256(_mm256_srli_epi16(B, 6), mask)));
+    }
+
+    const __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si64(half) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half)) + crumb_l1_scalar(a+i, b+i, size-i);
+}
+
+__attribute__((target("avx2")))
+static float hamming_avx2(const uchar *a, const uchar *b, int size)
+{
+    // Popcount of each nibble by table lookup
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a+i)), _mm256_loadu_si256((const __m256i*)(b+i)));
+        const __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, mask)),
+                                               _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(counts, zero));
+    }
+
+    const __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si64(half) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half)) + hamming_scalar(a+i, b+i, size-i);
+}
+
+__attribute__((target("avx2")))
+static inline int sum32(__m256i v)
+{
+    const __m128i half = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    const __m128i quarter = _mm_add_epi32(half, _mm_unpackhi_epi64(half, half));
+    return _mm_cvtsi128_si32(_mm_add_epi32(quarter, _mm_shuffle_epi32(quarter, 1)));
+}
+
+__attribute__((target("avx2")))
+static float dot_s8_avx2(const uchar *a, const uchar *b, int size)
+{
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a+i))),
+                                                        _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b+i)))));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a+i+16))),
+                                                        _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b+i+16)))));
+    }
+    return sum32(_mm256_add_epi32(acc0, acc1)) + dot_s8_scalar(a+i, b+i, size-i);
+}
+
+__attribute__((target("avx2,f16c")))
+static inline float sum(__m256 v)
+{
+    const __m128 half = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    const __m128 quarter = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    return _mm_cvtss_f32(_mm_add_ss(quarter, _mm_shuffle_ps(quarter, quarter, 1)));
+}
+
+__attribute__((target("avx2,f16c")))
+static float half_l1_f16c(const uchar *a, const uchar *b, int size)
+{
+    const quint16 *x = (const quint16*) a, *y = (const quint16*) b;
+    const int n = size / 2;
+    const __m256 magnitude = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i+16<=n; i+=16) {
+        const __m256 d0 = _mm256_sub_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x+i))),   _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(y+i))));
+        const __m256 d1 = _mm256_sub_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x+i+8))), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(y+i+8))));
+        acc0 = _mm256_add_ps(acc0, _mm256_and_ps(d0, magnitude));
+        acc1 = _mm256_add_ps(acc1, _mm256_and_ps(d1, magnitude));
+    }
+    return sum(_mm256_add_ps(acc0, acc1)) + half_l1_scalar(a+2*i, b+2*i, size-2*i);
+}
+
+__attribute__((target("avx2,f16c,fma")))
+static float half_l2_f16c(const uchar *a, const uchar *b, int size)
+{
+    const quint16 *x = (const quint16*) a, *y = (const quint16*) b;
+    const int n = size / 2;
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+
+    int i = 0;
+    for (; i+16<=n; i+=16) {
+        const __m256 d0 = _mm256_sub_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x+i))),   _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(y+i))));
+        const __m256 d1 = _mm256_sub_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x+i+8))), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(y+i+8))));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    return sum(_mm256_add_ps(acc0, acc1)) + half_l2_scalar(a+2*i, b+2*i, size-2*i);
+}
+
+__attribute__((target("avx2,f16c")))
+static void to_half_f16c(const float *src, quint16 *dst, int n)
+{
+    int i = 0;
+    for (; i+8<=n; i+=8)
+        _mm_storeu_si128((__m128i*)(dst+i), _mm256_cvtps_ph(_mm256_loadu_ps(src+i), _MM_FROUND_TO_NEAREST_INT));
+    to_half_scalar(src+i, dst+i, n-i);
+}
+
+__attribute__((target("avx2,f16c")))
+static void to_float_f16c(const quint16 *src, float *dst, int n)
+{
+    int i = 0;
+    for (; i+8<=n; i+=8)
+        _mm256_storeu_ps(dst+i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src+i))));
+    to_float_scalar(src+i, dst+i, n-i);
+}
+
+__attribute__((target("avx512f")))
+static inline qint64 sum(__m512i v)
+{
+    qint64 buff[8];
+    _mm512_storeu_si512((void*)buff, v);
+    return buff[0] + buff[1] + buff[2] + buff[3] + buff[4] + buff[5] + buff[6] + buff[7];
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static float l1_avx512(const uchar *a, const uchar *b, int size)
+{
+    __m512i acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+
+    int i = 0;
+    for (; i+128<=size; i+=128) {
+        acc0 = _mm512_add_epi64(acc0, _mm512_sad_epu8(_mm512_loadu_si512((const void*)(a+i)),    _mm512_loadu_si512((const void*)(b+i))));
+        acc1 = _mm512_add_epi64(acc1, _mm512_sad_epu8(_mm512_loadu_si512((const void*)(a+i+64)), _mm512_loadu_si512((const void*)(b+i+64))));
+    }
+    for (; i+64<=size; i+=64)
+        acc0 = _mm512_add_epi64(acc0, _mm512_sad_epu8(_mm512_loadu_si512((const void*)(a+i)), _mm512_loadu_si512((const void*)(b+i))));
+
+    return sum(_mm512_add_epi64(acc0, acc1)) + l1_scalar(a+i, b+i, size-i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static float packed_l1_avx512(const uchar *a, const uchar *b, int size)
+{
+    const __m512i mask = _mm512_set1_epi8(0x0F);
+    __m512i acc = _mm512_setzero_si512();
+
+    int i = 0;
+    for (; i+64<=size; i+=64) {
+        const __m512i A = _mm512_loadu_si512((const void*)(a+i));
+        const __m512i B = _mm512_loadu_si512((const void*)(b+i));
+        acc = _mm512_add_epi64(acc, _mm512_sad_epu8(_mm512_and_si512(A, mask), _mm512_and_si512(B, mask)));
+        acc = _mm512_add_epi64(acc, _mm512_sad_epu8(_mm512_and_si512(_mm512_srli_epi16(A, 4), mask),
+                                                    _mm512_and_si512(_mm512_srli_epi16(B, 4), mask)));
+    }
+    return sum(acc) + packed_l1_scalar(a+i, b+i, size-i);
+}
+
+// VPDPBUSD multiplies unsigned by signed bytes, so the sign extended words go through VPDPWSSD instead
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static float dot_s8_vnni(const uchar *a, const uchar *b, int size)
+{
+    __m512i acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+
+    int i = 0;
+    for (; i+64<=size; i+=64) {
+        acc0 = _mm512_dpwssd_epi32(acc0, _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(a+i))),
+                                         _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(b+i))));
+        acc1 = _mm512_dpwssd_epi32(acc1, _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(a+i+32))),
+                                         _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(b+i+32))));
+    }
+    return _mm512_reduce_add_epi32(_mm512_add_epi32(acc0, acc1)) + dot_s8_avx2(a+i, b+i, size-i);
+}
+
+#endif // BR_X86_DISPATCH
+
+/**** NEON ****/
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+static inline quint32 sum(uint32x4_t v)
+{
+    return vgetq_lane_u32(v, 0) + vgetq_lane_u32(v, 1) + vgetq_lane_u32(v, 2) + vgetq_lane_u32(v, 3);
+}
+
+static float l1_neon(const uchar *a, const uchar *b, int size)
+{
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    int i = 0;
+    while (i+16 <= size) {
+        // Each 16-bit lane gains at most 2*255 per iteration, so flush every 128 iterations
+        uint16x8_t partial = vdupq_n_u16(0);
+        const int end = i + 16*std::min(128, (size-i)/16);
+        for (; i<end; i+=16)
+            partial = vpadalq_u8(partial, vabdq_u8(vld1q_u8(a+i), vld1q_u8(b+i)));
+        acc = vpadalq_u16(acc, partial);
+    }
+    return sum(acc) + l1_scalar(a+i, b+i, size-i);
+}
+
+static float packed_l1_neon(const uchar *a, const uchar *b, int size)
+{
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    int i = 0;
+    while (i+16 <= size) {
+        // Each 16-bit lane gains at most 4*15 per iteration
+        uint16x8_t partial = vdupq_n_u16(0);
+        const int end = i + 16*std::min(1024, (size-i)/16);
+        for (; i<end; i+=16) {
+            const uint8x16_t A = vld1q_u8(a+i);
+            const uint8x16_t B = vld1q_u8(b+i);
+            partial = vpadalq_u8(partial, vabdq_u8(vandq_u8(A, mask), vandq_u8(B, mask)));
+            partial = vpadalq_u8(partial, vabdq_u8(vshrq_n_u8(A, 4), vshrq_n_u8(B, 4)));
+        }
+        acc = vpadalq_u16(acc, partial);
+    }
+    return sum(acc) + packed_l1_scalar(a+i, b+i, size-i);
+}
+
+static float crumb_l1_neon(const uchar *a, const uchar *b, int size)
+{
+    const uint8x16_t mask = vdupq_n_u8(0x03);
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    int i = 0;
+    while (i+16 <= size) {
+        // Each 16-bit lane gains at most 8*3 per iteration
+        uint16x8_t partial = vdupq_n_u16(0);
+        const int end = i + 16*std::min(1024, (size-i)/16);
+        for (; i<end; i+=16) {
+            const uint8x16_t A = vld1q_u8(a+i);
+            const uint8x16_t B = vld1q_u8(b+i);
+            partial = vpadalq_u8(partial, vabdq_u8(vandq_u8(A, mask), vandq_u8(B, mask)));
+            partial = vpadalq_u8(partial, vabdq_u8(vandq_u8(vshrq_n_u8(A, 2), mask), vandq_u8(vshrq_n_u8(B, 2), mask)));
+            partial = vpadalq_u8(partial, vabdq_u8(vandq_u8(vshrq_n_u8(A, 4), mask), vandq_u8(vshrq_n_u8(B, 4), mask)));
+            partial = vpadalq_u8(partial, vabdq_u8(vshrq_n_u8(A, 6), vshrq_n_u8(B, 6)));
+        }
+        acc = vpadalq_u16(acc, partial);
+    }
+    return sum(acc) + crumb_l1_scalar(a+i, b+i, size-i);
+}
+
+static float hamming_neon(const uchar *a, const uchar *b, int size)
+{
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    int i = 0;
+    while (i+16 <= size) {
+        // Each 16-bit lane gains at most 2*8 per iteration
+        uint16x8_t partial = vdupq_n_u16(0);
+        const int end = i + 16*std::min(1024, (size-i)/16);
+        for (; i<end; i+=16)
+            partial = vpadalq_u8(partial, vcntq_u8(veorq_u8(vld1q_u8(a+i), vld1q_u8(b+i))));
+        acc = vpadalq_u16(acc, partial);
+    }
+    return sum(acc) + hamming_scalar(a+i, b+i, size-i);
+}
+
+static float mismatches_neon(const uchar *a, const uchar *b, int size)
+{
+    uint32x4_t acc = vdupq_n_u32(0);
+
+    int i = 0;
+    while (i+16 <= size) {
+        // Each 16-bit lane gains at most 2 per iteration
+        uint16x8_t partial = vdupq_n_u16(0);
+        const int end = i + 16*std::min(1024, (size-i)/16);
+        for (; i<end; i+=16)
+            partial = vpadalq_u8(partial, vshrq_n_u8(vmvnq_u8(vceqq_u8(vld1q_u8(a+i), vld1q_u8(b+i))), 7));
+        acc = vpadalq_u16(acc, partial);
+    }
+    return sum(acc) + mismatches_scalar(a+i, b+i, size-i);
+}
+
+static float dot_s8_neon(const uchar *a, const uchar *b, int size)
+{
+    int32x4_t acc0 = vdupq_n_s32(0), acc1 = vdupq_n_s32(0);
+
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const int8x16_t A = vld1q_s8((const int8_t*)(a+i));
+        const int8x16_t B = vld1q_s8((const int8_t*)(b+i));
+#ifdef __ARM_FEATURE_DOTPROD
+        acc0 = vdotq_s32(acc0, A, B);
+#else
+        acc0 = vpadalq_s16(acc0, vmull_s8(vget_low_s8(A), vget_low_s8(B)));
+        acc1 = vpadalq_s16(acc1, vmull_s8(vget_high_s8(A), vget_high_s8(B)));
+#endif // __ARM_FEATURE_DOTPROD
+    }
+    const int32x4_t acc = vaddq_s32(acc0, acc1);
+    return vgetq_lane_s32(acc, 0) + vgetq_lane_s32(acc, 1) + vgetq_lane_s32(acc, 2) + vgetq_lane_s32(acc, 3) + dot_s8_scalar(a+i, b+i, size-i);
+}
+
+#ifdef __aarch64__
+
+static float half_l1_neon(const uchar *a, const uchar *b, int size)
+{
+    const quint16 *x = (const quint16*) a, *y = (const quint16*) b;
+    const int n = size / 2;
+    float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+
+    int i = 0;
+    for (; i+8<=n; i+=8) {
+        acc0 = vaddq_f32(acc0, vabdq_f32(vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(x+i))),   vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(y+i)))));
+        acc1 = vaddq_f32(acc1, vabdq_f32(vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(x+i+4))), vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(y+i+4)))));
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1)) + half_l1_scalar(a+2*i, b+2*i, size-2*i);
+}
+
+static float half_l2_neon(const uchar *a, const uchar *b, int size)
+{
+    const quint16 *x = (const quint16*) a, *y = (const quint16*) b;
+    const int n = size / 2;
+    float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+
+    int i = 0;
+    for (; i+8<=n; i+=8) {
+        const float32x4_t d0 = vsubq_f32(vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(x+i))),   vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(y+i))));
+        const float32x4_t d1 = vsubq_f32(vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(x+i+4))), vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(y+i+4))));
+        acc0 = vfmaq_f32(acc0, d0, d0);
+        acc1 = vfmaq_f32(acc1, d1, d1);
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1)) + half_l2_scalar(a+2*i, b+2*i, size-2*i);
+}
+
+static void to_half_neon(const float *src, quint16 *dst, int n)
+{
+    int i = 0;
+    for (; i+4<=n; i+=4)
+        vst1_u16(dst+i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src+i))));
+    to_half_scalar(src+i, dst+i, n-i);
+}
+
+static void to_float_neon(const quint16 *src, float *dst, int n)
+{
+    int i = 0;
+    for (; i+4<=n; i+=4)
+        vst1q_f32(dst+i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src+i))));
+    to_float_scalar(src+i, dst+i, n-i);
+}
+
+#else // 32-bit ARM doesn't always have half precision conversions
+
+#define half_l1_neon  half_l1_scalar
+#define half_l2_neon  half_l2_scalar
+#define to_half_neon  to_half_scalar
+#define to_float_neon to_float_scalar
+
+#endif // __aarch64__
+
+#endif // __ARM_NEON
+
+/**** DISPATCH ****/
+struct L1Kernel
+{
+    const char *name;
+    L1Function l1, packed_l1, crumb_l1, hamming, mismatches, half_l1, half_l2, dot_s8;
+    ToHalfFunction to_half;
+    ToFloatFunction to_float;
+    bool (*supported)();
+};
+
+static bool always() { return true; }
+
+#ifdef BR_X86_DISPATCH
+// Every CPU with AVX2 also has F16C and FMA, they are checked for the half precision kernels
+static bool hasF16C()   { unsigned int a, b, c, d; return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_F16C) && (c & bit_FMA); }
+static bool hasAVX2()   { __builtin_cpu_init(); return __builtin_cpu_supports("avx2") && hasF16C(); }
+static bool hasAVX512() { __builtin_cpu_init(); return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && hasF16C(); }
+static bool hasVNNI()   { __builtin_cpu_init(); return hasAVX512() && __builtin_cpu_supports("avx512vnni"); }
+#endif // BR_X86_DISPATCH
+
+// In order of preference, AVX-512 CPUs use the AVX2 kernels for 2-bit L1, Hamming and half precision distances, and x86 CPUs count mismatches with SSE2.
+// SSE2 alone has no half precision conversions. AVX-512 only gets its own dot product kernel with VNNI.
+static const L1Kernel kernels[] = {
+#ifdef BR_X86_DISPATCH
+    { "avx512vnni", l1_avx512, packed_l1_avx512, crumb_l1_avx2,   hamming_avx2,   mismatches_sse2,   half_l1_f16c,   half_l2_f16c,   dot_s8_vnni,   to_half_f16c,   to_float_f16c,   hasVNNI   },
+    { "avx512",     l1_avx512, packed_l1_avx512, crumb_l1_avx2,   hamming_avx2,   mismatches_sse2,   half_l1_f16c,   half_l2_f16c,   dot_s8_avx2,   to_half_f16c,   to_float_f16c,   hasAVX512 },
+    { "avx2",       l1_avx2,   packed_l1_avx2,   crumb_l1_avx2,   hamming_avx2,   mismatches_sse2,   half_l1_f16c,   half_l2_f16c,   dot_s8_avx2,   to_half_f16c,   to_float_f16c,   hasAVX2   },
+#endif // BR_X86_DISPATCH
+#ifdef __SSE2__
+    { "sse2",       l1_sse2,   packed_l1_sse2,   crumb_l1_sse2,   hamming_sse2,   mismatches_sse2,   half_l1_scalar, half_l2_scalar, dot_s8_sse2,   to_half_scalar, to_float_scalar, always    },
+#endif // __SSE2__
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    { "neon",       l1_neon,   packed_l1_neon,   crumb_l1_neon,   hamming_neon,   mismatches_neon,   half_l1_neon,   half_l2_neon,   dot_s8_neon,   to_half_neon,   to_float_neon,   always    },
+#endif // __ARM_NEON
+    { "scalar",     l1_scalar, packed_l1_scalar, crumb_l1_scalar, hamming_scalar, mismatches_scalar, half_l1_scalar, half_l2_scalar, dot_s8_scalar, to_half_scalar, to_float_scalar, always    }
+};
+
+static const int numKernels = sizeof(kernels) / sizeof(L1Kernel);
+
+static const L1Kernel *selectKernel()
+{
+    const QByteArray requested = qgetenv("BR_L1_KERNEL");
+    for (int i=0; i<numKernels; i++)
+        if (kernels[i].supported() && (requested.isEmpty() || (requested == kernels[i].name)))
+            return &kernels[i];
+    qWarning("BR_L1_KERNEL=%s is not supported on this CPU.", requested.data());
+    return &kernels[numKernels-1];
+}
+
+static const L1Kernel *currentKernel = selectKernel();
+
+float l1(const uchar *a, const uchar *b, int size)
+{
+    return currentKernel->l1(a, b, size);
+}
+
+float packed_l1(const uchar *a, const uchar *b, int size)
+{
+    return currentKernel->packed_l1(a, b, size);
+}
+
+float crumb_l1(const uchar *a, const uchar *b, int size)
+{
+    return currentKernel->crumb_l1(a, b, size);
+}
+
+float hamming(const uchar *a, const uchar *b, int size)
+{
+    return currentKernel->hamming(a, b, size);
+}
+
+float mismatches(const uchar *a, const uchar *b, int size)
+{
+    return currentKernel->mismatches(a, b, size);
+}
+
+float half_l1(const uchar *a, const uchar *b, int size)
+{
+    return currentKernel->half_l1(a, b, size);
+}
+
+float half_l2(const uchar *a, const uchar *b, int size)
+{
+    return currentKernel->half_l2(a, b, size);
+}
+
+float dot_s8(const uchar *a, const uchar *b, int size)
+{
+    return currentKernel->dot_s8(a, b, size);
+}
+
+void floatToHalf(const float *src, quint16 *dst, int n)
+{
+    currentKernel->to_half(src, dst, n);
+}
+
+void halfToFloat(const quint16 *src, float *dst, int n)
+{
+    currentKernel->to_float(src, dst, n);
+}
+
+// Large enough that the per-block check is negligible next to the kernel, small enough to stop early on long templates
+static const int BoundedBlockSize = 512;
+
+static float bounded(L1Function kernel, const uchar *a, const uchar *b, int size, float limit)
+{
+    float distance = 0;
+    for (int i=0; i<size; i+=BoundedBlockSize) {
+        distance += kernel(a+i, b+i, std::min(BoundedBlockSize, size-i));
+        if (distance > limit)
+            break;
+    }
+    return distance;
+}
+
+float l1(const uchar *a, const uchar *b, int size, float limit)
+{
+    return bounded(currentKernel->l1, a, b, size, limit);
+}
+
+float packed_l1(const uchar *a, const uchar *b, int size, float limit)
+{
+    return bounded(currentKernel->packed_l1, a, b, size, limit);
+}
+
+float crumb_l1(const uchar *a, const uchar *b, int size, float limit)
+{
+    return bounded(currentKernel->crumb_l1, a, b, size, limit);
+}
+
+float hamming(const uchar *a, const uchar *b, int size, float limit)
+{
+    return bounded(currentKernel->hamming, a, b, size, limit);
+}
+
+float mismatches(const uchar *a, const uchar *b, int size, float limit)
+{
+    return bounded(currentKernel->mismatches, a, b, size, limit);
+}
+
+float half_l1(const uchar *a, const uchar *b, int size, float limit)
+{
+    return bounded(currentKernel->half_l1, a, b, size, limit);
+}
+
+float half_l2(const uchar *a, const uchar *b, int size, float limit)
+{
+    return bounded(currentKernel->half_l2, a, b, size, limit);
+}
+
+QString l1Kernel()
+{
+    return currentKernel->name;
+}
+
+QStringList l1Kernels()
+{
+    QStringList names;
+    for (int i=0; i<numKernels; i++)
+        if (kernels[i].supported())
+            names.append(kernels[i].name);
+    return names;
+}
+
+bool setL1Kernel(const QString &name)
+{
+    for (int i=0; i<numKernels; i++)
+        if ((name == kernels[i].name) && kernels[i].supported()) {
+            currentKernel = &kernels[i];
+            return true;
+        }
+    return false;
+}
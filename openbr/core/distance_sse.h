@@ -18,10 +18,12 @@
 #define DISTANCE_SSE_H
 
 #include <QDebug>
+#include <QStringList>
+#include <openbr/openbr_export.h>
 
-#ifdef __SSE__
+#ifdef __SSE2__
 
-#include <xmmintrin.h>
+#include <emmintrin.h>
 
 inline QDebug operator<<(QDebug dbg, const __m128i &p)
 {
@@ -31,45 +33,53 @@ inline QDebug operator<<(QDebug dbg, const __m128i &p)
     return dbg.space();
 }
 
-inline float l1(const uchar *a, const uchar *b, int size)
-{
-    size = size / sizeof(__m128i);
-    __m128i accumulate = _mm_setzero_si128();
-
-    for (int i=0; i<size; i++) {
-        __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a)+i);
-        __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b)+i);
-        __m128i sad = _mm_sad_epu8(A, B);
-        accumulate = _mm_add_epi64(sad, accumulate);
-    }
-
-    int64_t buff[2];
-    _mm_storeu_si128(reinterpret_cast<__m128i*>(&buff), accumulate);
-    return buff[0] + buff[1];
-}
+#endif // __SSE2__
 
-#else
+// L1 distance between two byte vectors.
+// The implementation is chosen at startup from the best instruction set supported by the CPU,
+// and can be overridden with the BR_L1_KERNEL environment variable (see l1Kernels()).
+BR_EXPORT float l1(const uchar *a, const uchar *b, int size);
 
-inline float l1(const uchar *a, const uchar *b, int size)
-{
-    int distance = 0;
-    for (int i=0; i<size; i++)
-        distance += abs(a[i]-b[i]);
-    return distance;
-}
+// L1 distance between two vectors of packed 4-bit values, size is in bytes.
+BR_EXPORT float packed_l1(const uchar *a, const uchar *b, int size);
 
-#endif
+// L1 distance between two vectors of packed 2-bit values, size is in bytes.
+BR_EXPORT float crumb_l1(const uchar *a, const uchar *b, int size);
 
-inline float packed_l1(const uchar *a, const uchar *b, int size)
-{
-    static const uchar low_mask = 0x0F;
-    static const uchar hi_mask = 0xF0;
-
-    int distance = 0;
-    for (int i=0; i<size; i++)
-        distance += (abs((a[i] & low_mask) - (b[i] & low_mask)) >> 0) +
-                    (abs((a[i] & hi_mask)  - (b[i] & hi_mask))  >> 4);
-    return distance;
-}
+// Hamming distance between two bit vectors, size is in bytes.
+BR_EXPORT float hamming(const uchar *a, const uchar *b, int size);
+
+// L1 and squared L2 distances between two vectors of IEEE half precision values, size is in bytes. Accumulated in single precision.
+BR_EXPORT float half_l1(const uchar *a, const uchar *b, int size);
+BR_EXPORT float half_l2(const uchar *a, const uchar *b, int size);
+
+// Dot product of two vectors of signed bytes, exact while the magnitude is less than 2^24.
+BR_EXPORT float dot_s8(const uchar *a, const uchar *b, int size);
+
+// Convert n values between single and IEEE half precision, rounding to nearest even.
+BR_EXPORT void floatToHalf(const float *src, quint16 *dst, int n);
+BR_EXPORT void halfToFloat(const quint16 *src, float *dst, int n);
+
+// Number of differing bytes, the Hamming distance between strings of byte symbols such as KernelHash codes.
+BR_EXPORT float mismatches(const uchar *a, const uchar *b, int size);
+
+// As above, but stop between blocks once the distance exceeds limit, returning the partial distance.
+// Used by distances that can discard a comparison as soon as it is known to miss a threshold.
+BR_EXPORT float l1(const uchar *a, const uchar *b, int size, float limit);
+BR_EXPORT float packed_l1(const uchar *a, const uchar *b, int size, float limit);
+BR_EXPORT float crumb_l1(const uchar *a, const uchar *b, int size, float limit);
+BR_EXPORT float hamming(const uchar *a, const uchar *b, int size, float limit);
+BR_EXPORT float mismatches(const uchar *a, const uchar *b, int size, float limit);
+BR_EXPORT float half_l1(const uchar *a, const uchar *b, int size, float limit);
+BR_EXPORT float half_l2(const uchar *a, const uchar *b, int size, float limit);
+
+// Name of the kernel currently used by the functions above.
+BR_EXPORT QString l1Kernel();
+
+// Kernels supported by this CPU, in order of preference.
+BR_EXPORT QStringList l1Kernels();
+
+// Select a kernel by name, returns false if it is not supported. Not thread safe, intended for benchmarking.
+BR_EXPORT bool setL1Kernel(const QString &name);
 
 #endif // DISTANCE_SSE_H
@@ -1,3 +1,5 @@
+#include <QFutureSynchronizer>
+#include <QtConcurrent>
 #include "eigenutils.h"
 #include <openbr/openbr_plugin.h>
 
@@ -8,6 +10,66 @@ void EigenUtils::printSize(Eigen::MatrixXf X) {
     qDebug() << "Rows=" << X.rows() << "\tCols=" << X.cols();
 }
 
+static void checkView(const Mat &m)
+{
+    if ((m.type() != CV_32FC1) || !m.isContinuous())
+        qFatal("Expected a continuous CV_32FC1 matrix.");
+}
+
+Map<const VectorXf> EigenUtils::vectorView(const Mat &m)
+{
+    checkView(m);
+    return Map<const VectorXf>(m.ptr<float>(), m.rows * m.cols);
+}
+
+Map<VectorXf> EigenUtils::vectorView(Mat &m)
+{
+    checkView(m);
+    return Map<VectorXf>(m.ptr<float>(), m.rows * m.cols);
+}
+
+template <typename MatrixType>
+static void copyColumns(const br::TemplateList *templates, MatrixType *matrix, int begin, int end)
+{
+    for (int i=begin; i<end; i++)
+        matrix->col(i) = EigenUtils::vectorView((*templates)[i].m()).template cast<typename MatrixType::Scalar>();
+}
+
+template <typename MatrixType>
+static void toMatrix(const br::TemplateList &templates, MatrixType &matrix)
+{
+    const int instances = templates.size();
+    if (instances == 0) {
+        matrix.resize(0, 0);
+        return;
+    }
+    const int dims = templates.first().m().rows * templates.first().m().cols;
+    matrix.resize(dims, instances);
+    foreach (const br::Template &t, templates)
+        if (t.m().rows * t.m().cols != dims)
+            qFatal("Templates have inconsistent dimensionality.");
+
+    // Memory bound, so a few large ranges are enough
+    const int chunks = std::max(1, std::min(br::Globals->parallelism, instances / 256));
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<chunks; i++) {
+        const int begin = instances * i / chunks, end = instances * (i + 1) / chunks;
+        if (i == chunks - 1) copyColumns(&templates, &matrix, begin, end);
+        else                 futures.addFuture(QtConcurrent::run(copyColumns<MatrixType>, &templates, &matrix, begin, end));
+    }
+    futures.waitForFinished();
+}
+
+void EigenUtils::templatesToMatrix(const br::TemplateList &templates, MatrixXf &matrix)
+{
+    toMatrix(templates, matrix);
+}
+
+void EigenUtils::templatesToMatrix(const br::TemplateList &templates, MatrixXd &matrix)
+{
+    toMatrix(templates, matrix);
+}
+
 float EigenUtils::stddev(const Eigen::MatrixXf& x) {
     return sqrt((x.array() - x.mean()).pow(2).sum() / (x.cols() * x.rows()));
 }
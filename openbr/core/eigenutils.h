@@ -27,6 +27,11 @@
 
 #include "openbr/core/qtutils.h"
 
+namespace br
+{
+    struct TemplateList;
+}
+
 namespace EigenUtils
 {
     template<typename _Scalar, int _Rows, int _Cols, int _Options, int _MaxRows, int _MaxCols>
@@ -78,6 +83,14 @@ namespace EigenUtils
 
     // Compute the element-wise standard deviation
     float stddev(const Eigen::MatrixXf& x);
+
+    // Zero-copy column vector views of a continuous CV_32FC1 matrix
+    Eigen::Map<const Eigen::VectorXf> vectorView(const cv::Mat &m);
+    Eigen::Map<Eigen::VectorXf> vectorView(cv::Mat &m);
+
+    // One column per template's first CV_32FC1 matrix, copied in parallel into a single allocation
+    void templatesToMatrix(const br::TemplateList &templates, Eigen::MatrixXf &matrix);
+    void templatesToMatrix(const br::TemplateList &templates, Eigen::MatrixXd &matrix);
 }
 
 template<typename _Scalar, int _Rows, int _Cols, int _Options, int _MaxRows, int _MaxCols>
@@ -20,6 +20,7 @@
 #include "openbr/core/qtutils.h"
 #include "openbr/core/opencvutils.h"
 #include <QMapIterator>
+#include <QtConcurrent>
 #include <cmath>
 
 using namespace cv;
@@ -115,81 +116,351 @@ static float getCMC(const QVector<int> &firstGenuineReturns, int rank)
     return retrievalRate;
 }
 
-// Decide whether to construct a normal mask matrix, or a pairwise mask by comparing the dimensions of
+// Decide whether to construct a normal mask, or a pairwise mask by comparing the dimensions of
 // scores with the size of the target and query lists
-static cv::Mat constructMatchingMask(const cv::Mat &scores, const FileList &target, const FileList &query, int partition=0)
+static BEE::ImplicitMask constructMatchingMask(const cv::Mat &scores, const FileList &target, const FileList &query, int partition=0)
 {
-    // If the dimensions of the score matrix match the sizes of the target and query lists, construct a normal mask matrix
+    // If the dimensions of the score matrix match the sizes of the target and query lists, construct a normal mask
     if (target.size() == scores.cols && query.size() == scores.rows)
-        return BEE::makeMask(target, query, partition);
+        return BEE::ImplicitMask(target, query, partition);
     // If this looks like a pairwise comparison (1 column score matrix, equal length target and query sets), construct a
     // mask for that
     else if (scores.cols == 1 && target.size() == query.size()) {
-        return BEE::makePairwiseMask(target, query, partition);
+        return BEE::ImplicitMask(target, query, partition, true);
     }
     // otherwise, we fail
     else
         qFatal("Unable to construct mask for %d by %d score matrix from %d element query set, and %d element target set ", scores.rows, scores.cols, query.length(), target.length());
 
-    return cv::Mat();
+    return BEE::ImplicitMask();
 }
 
-float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &query, const File &csv, int partition)
+// Adapts a dense mask matrix to the BEE::ImplicitMask interface
+struct DenseMask
+{
+    const Mat &mask;
+    DenseMask(const Mat &_mask) : mask(_mask) {}
+    inline BEE::MaskValue at(int i, int j) const { return mask.at<BEE::MaskValue>(i,j); }
+    int subject(int i) const { return i; } // Without labels each query is its own subject
+};
+
+// Pairs each block of scores with its mask rows, read from the mask matrix or computed from the galleries
+struct MaskedMatrixStream
+{
+    BEE::MatrixStream scores;
+    QScopedPointer<BEE::MatrixStream> mask;
+    BEE::ImplicitMask implicitMask;
+    int blockRows, row;
+
+    MaskedMatrixStream(const QString &simmat, const QString &maskFile)
+        : scores(simmat), row(0)
+    {
+        if (!maskFile.isEmpty()) {
+            mask.reset(new BEE::MatrixStream(maskFile));
+            if ((mask->rows != scores.rows) || (mask->cols != scores.cols))
+                qFatal("Similarity matrix (%ix%i) differs in size from mask matrix (%ix%i).",
+                       scores.rows, scores.cols, mask->rows, mask->cols);
+        } else {
+            // Use the galleries specified in the similarity matrix
+            if (scores.target.isEmpty()) qFatal("Unspecified target gallery.");
+            if (scores.query.isEmpty()) qFatal("Unspecified query gallery.");
+            const FileList targetFiles = FileList::fromGallery(scores.target);
+            const FileList queryFiles = FileList::fromGallery(scores.query);
+            const bool pairwise = (targetFiles.size() != scores.cols) || (queryFiles.size() != scores.rows);
+            if (pairwise && ((scores.cols != 1) || (targetFiles.size() != queryFiles.size()) || (queryFiles.size() != scores.rows)))
+                qFatal("Unable to construct mask for %d by %d score matrix from %d element query set, and %d element target set ", scores.rows, scores.cols, queryFiles.size(), targetFiles.size());
+            implicitMask = BEE::ImplicitMask(targetFiles, queryFiles, 0, pairwise);
+        }
+
+        // Roughly 64 MB of scores per block
+        blockRows = std::max(1, int((64 << 20) / std::max(scores.rowSize(), qint64(1))));
+    }
+
+    bool next(Mat &scoreBlock, Mat &maskBlock)
+    {
+        if (row == scores.rows) return false;
+        const int n = std::min(blockRows, scores.rows - row);
+        scoreBlock = scores.read(n);
+        if (mask) maskBlock = mask->read(n);
+        else      maskBlock = implicitMask.toMat(row, n);
+        row += n;
+        return true;
+    }
+
+    void rewind()
+    {
+        scores.rewind();
+        if (mask) mask->rewind();
+        row = 0;
+    }
+};
+
+static int histogramBin(float score, float minScore, double binWidth, int bins)
 {
-    return Evaluate(scores, constructMatchingMask(scores, target, query, partition), csv, QString(), QString(), 0);
+    const double position = (double(score) - minScore) / binWidth;
+    if (position <= 0)    return 0;
+    if (position >= bins) return bins - 1;
+    return int(position);
 }
 
-float Evaluate(const QString &simmat, const QString &mask, const File &csv, unsigned int matches)
+// Lower edge of the bin containing the rank-th highest score
+static float histogramScore(const QVector<qint64> &histogram, qint64 rank, float minScore, double binWidth)
 {
-    qDebug("Evaluating %s%s%s",
-           qPrintable(simmat),
-           mask.isEmpty() ? "" : qPrintable(" with " + mask),
-           csv.name.isEmpty() ? "" : qPrintable(" to " + csv));
+    for (int i=histogram.size()-1; i>=0; i--) {
+        rank -= histogram[i];
+        if (rank < 0) return minScore + i*binWidth;
+    }
+    return minScore;
+}
 
-    // Read similarity matrix
-    QString target, query;
-    Mat scores;
-    if (simmat.endsWith(".mtx")) {
-        scores = BEE::readMatrix(simmat, &target, &query);
-    } else {
-        QScopedPointer<Format> format(Factory<Format>::make(simmat));
-        scores = format->read();
+// Writes the plots and tables that follow the metadata table, shared by Evaluate and EvaluateStreaming
+static float writeResults(QStringList &lines, const File &csv, const QString &target,
+                          const QList<OperatingPoint> &operatingPoints, const QList<OperatingPoint> &searchOperatingPoints,
+                          const QVector<int> &firstGenuineReturns, qint64 genuineCount, qint64 impostorCount, qint64 totalImpostorSearches,
+                          const QList<float> &sampledGenuineScores, const QList<float> &sampledImpostorScores)
+{
+    float result = -1;
+
+    // Write Detection Error Tradeoff (DET), PRE, REC, Identification Error Tradeoff (IET)
+    float expFAR = csv.get<float>("FAR", std::max(ceil(log10(double(impostorCount))), 1.0));
+    float expFRR = csv.get<float>("FRR", std::max(ceil(log10(double(genuineCount))), 1.0));
+    float expFPIR = csv.get<float>("FPIR", std::max(ceil(log10(double(totalImpostorSearches))), 1.0));
+
+    float FARstep = expFAR / (float)(Max_Points - 1);
+    float FRRstep = expFRR / (float)(Max_Points - 1);
+    float FPIRstep = expFPIR / (float)(Max_Points - 1);
+
+    for (int i=0; i<Max_Points; i++) {
+        float FAR = pow(10, -expFAR + i*FARstep);
+        float FRR = pow(10, -expFRR + i*FRRstep);
+        float FPIR = pow(10, -expFPIR + i*FPIRstep);
+
+        OperatingPoint operatingPointFAR = getOperatingPointGivenFAR(operatingPoints, FAR);
+        OperatingPoint operatingPointTAR = getOperatingPointGivenTAR(operatingPoints, 1-FRR);
+        OperatingPoint searchOperatingPoint = getOperatingPointGivenFAR(searchOperatingPoints, FPIR);
+        lines.append(QString("DET,%1,%2").arg(QString::number(FAR),
+                                              QString::number(1-operatingPointFAR.TAR)));
+        lines.append(QString("FAR,%1,%2").arg(QString::number(operatingPointFAR.score),
+                                              QString::number(FAR)));
+        lines.append(QString("FRR,%1,%2").arg(QString::number(operatingPointTAR.score),
+                                              QString::number(FRR)));
+        lines.append(QString("IET,%1,%2").arg(QString::number(searchOperatingPoint.FAR),
+                                              QString::number(1-searchOperatingPoint.TAR)));
     }
 
-    // Read mask matrix
-    Mat truth;
-    if (mask.isEmpty()) {
-        // Use the galleries specified in the similarity matrix
-        if (target.isEmpty()) qFatal("Unspecified target gallery.");
-        if (query.isEmpty()) qFatal("Unspecified query gallery.");
+    // Write TAR@FAR Table (TF)
+    foreach (float far, QList<float>() << 1e-6 << 1e-5 << 1e-4 << 1e-3 << 1e-2 << 1e-1)
+      lines.append(qPrintable(QString("TF,%1,%2").arg(
+						      QString::number(far, 'f'),
+						      QString::number(getOperatingPointGivenFAR(operatingPoints, far).TAR, 'f', 3))));
 
-        truth = constructMatchingMask(scores, TemplateList::fromGallery(target).files(),
-                                              TemplateList::fromGallery(query).files());
-    } else {
-        File maskFile(mask);
-        maskFile.set("rows", scores.rows);
-        maskFile.set("columns", scores.cols);
-        QScopedPointer<Format> format(Factory<Format>::make(maskFile));
-        truth = format->read();
+    // Write FAR@TAR Table (FT)
+    foreach (float tar, QList<float>() << 0.95 << 0.85 << 0.75 << 0.65 << 0.5 << 0.4)
+      lines.append(qPrintable(QString("FT,%1,%2").arg(
+                         QString::number(tar, 'f', 2),
+                         QString::number(getOperatingPointGivenTAR(operatingPoints, tar).FAR, 'f', 3))));
+
+    //Write CMC Table (CT)
+    lines.append(qPrintable(QString("CT,1,%1").arg(QString::number(getCMC(firstGenuineReturns, 1), 'f', 3))));
+    lines.append(qPrintable(QString("CT,5,%1").arg(QString::number(getCMC(firstGenuineReturns, 5), 'f', 3))));
+    lines.append(qPrintable(QString("CT,10,%1").arg(QString::number(getCMC(firstGenuineReturns, 10), 'f', 3))));
+    lines.append(qPrintable(QString("CT,20,%1").arg(QString::number(getCMC(firstGenuineReturns, 20), 'f', 3))));
+    lines.append(qPrintable(QString("CT,50,%1").arg(QString::number(getCMC(firstGenuineReturns, 50), 'f', 3))));
+    lines.append(qPrintable(QString("CT,100,%1").arg(QString::number(getCMC(firstGenuineReturns, 100), 'f', 3))));
+
+    // Write FAR/TAR Bar Chart (BC)
+    lines.append(qPrintable(QString("BC,0.001,%1").arg(QString::number(getOperatingPointGivenFAR(operatingPoints, 0.001).TAR, 'f', 3))));
+    lines.append(qPrintable(QString("BC,0.01,%1").arg(QString::number(result = getOperatingPointGivenFAR(operatingPoints, 0.01).TAR, 'f', 3))));
+
+    // Attempt to read template size from enrolled gallery and write to output CSV
+    size_t maxSize(0);
+    if (target.endsWith(".gal") && QFileInfo(target).exists()) {
+        QScopedPointer<Gallery> gallery(Gallery::make(target));
+        bool done = false;
+        while (!done)
+            foreach (const Template &t, gallery->readBlock(&done)) maxSize = max(maxSize, t.bytes());
+        lines.append(QString("TS,,%1").arg(QString::number(maxSize)));
     }
 
-    return Evaluate(scores, truth, csv, target, query, matches);
+    // Write SD
+    for (int i=0; i<sampledGenuineScores.size(); i++) {
+        lines.append(QString("SD,%1,Genuine").arg(QString::number(sampledGenuineScores[i])));
+        lines.append(QString("SD,%1,Impostor").arg(QString::number(sampledImpostorScores[i])));
+    }
+
+    // Write Cumulative Match Characteristic (CMC) curve
+    const int Max_Retrieval = 200;
+    const int Report_Retrieval = 5;
+    for (int i=1; i<=Max_Retrieval; i++) {
+        const float retrievalRate = getCMC(firstGenuineReturns, i);
+        lines.append(qPrintable(QString("CMC,%1,%2").arg(QString::number(i), QString::number(retrievalRate))));
+    }
+
+    QtUtils::writeFile(csv, lines);
+    if (maxSize > 0) qDebug("Template Size: %i bytes", (int)maxSize);
+    qDebug("TAR @ FAR = 0.01:    %.3f",getOperatingPointGivenFAR(operatingPoints, 0.01).TAR);
+    qDebug("TAR @ FAR = 0.001:   %.3f",getOperatingPointGivenFAR(operatingPoints, 0.001).TAR);
+    qDebug("TAR @ FAR = 0.0001:  %.3f",getOperatingPointGivenFAR(operatingPoints, 0.0001).TAR);
+    qDebug("TAR @ FAR = 0.00001: %.3f",getOperatingPointGivenFAR(operatingPoints, 0.00001).TAR);
+
+    qDebug("FNIR @ FPIR = 0.1:   %.3f", 1-getOperatingPointGivenFAR(searchOperatingPoints, 0.1).TAR);
+    qDebug("FNIR @ FPIR = 0.01:  %.3f", 1-getOperatingPointGivenFAR(searchOperatingPoints, 0.01).TAR);
+
+    qDebug("\nRetrieval Rate @ Rank = %d: %.3f", Report_Retrieval, getCMC(firstGenuineReturns, Report_Retrieval));
+
+    return result;
 }
 
-float Evaluate(const Mat &simmat, const Mat &mask, const File &csv, const QString &target, const QString &query, unsigned int matches)
+
+static QList<float> bootstrapFARs() { return QList<float>() << 1e-6 << 1e-5 << 1e-4 << 1e-3 << 1e-2 << 1e-1; }
+static QList<int> bootstrapRanks() { return QList<int>() << 1 << 5 << 10 << 20 << 50 << 100; }
+
+// Read-only inputs shared by the bootstrap replicates
+struct Bootstrap
 {
-    if (target.isEmpty() || query.isEmpty()) matches = 0;
-    if (simmat.size() != mask.size())
-        qFatal("Similarity matrix (%ix%i) differs in size from mask matrix (%ix%i).",
-               simmat.rows, simmat.cols, mask.rows, mask.cols);
+    const QList<Comparison> *comparisons; // Sorted
+    const QVector<int> *firstGenuineReturns;
+    QVector<int> subjects; // Per query, index of its subject or -1 if the query has no comparisons
+    int numSubjects;
+};
 
-    if (simmat.type() != CV_32FC1)
-        qFatal("Invalid simmat format");
+// TAR at each bootstrapFARs() and retrieval rate at each bootstrapRanks(), empty if the replicate is degenerate
+struct BootstrapReplicate
+{
+    QList<float> TARs, retrievalRates;
+};
 
-    if (mask.type() != CV_8UC1)
-        qFatal("Invalid mask format");
+// Resamples subjects with replacement and weights each query by how often its subject was drawn.
+// Walks the already sorted comparisons, so a replicate costs O(comparisons) rather than a sort.
+static void bootstrapReplicate(const Bootstrap *bootstrap, int seed, BootstrapReplicate *replicate)
+{
+    RNG rng(seed);
+    QVector<int> draws(bootstrap->numSubjects, 0);
+    for (int i=0; i<bootstrap->numSubjects; i++)
+        draws[rng.uniform(0, bootstrap->numSubjects)]++;
+
+    QVector<int> weights(bootstrap->subjects.size(), 0);
+    for (int i=0; i<weights.size(); i++)
+        if (bootstrap->subjects[i] >= 0) weights[i] = draws[bootstrap->subjects[i]];
+
+    const QList<Comparison> &comparisons = *bootstrap->comparisons;
+    double genuineCount = 0, impostorCount = 0;
+    foreach (const Comparison &comparison, comparisons)
+        (comparison.genuine ? genuineCount : impostorCount) += weights[comparison.query];
+    if ((genuineCount == 0) || (impostorCount == 0)) return;
+
+    // Same operating points as evaluate(), with weighted counts
+    QList<OperatingPoint> operatingPoints;
+    double falsePositives = 0, previousFalsePositives = 0;
+    double truePositives = 0, previousTruePositives = 0;
+    int index = 0;
+    while (index < comparisons.size()) {
+        const float thresh = comparisons[index].score;
+        while ((index < comparisons.size()) && (comparisons[index].score == thresh)) {
+            const Comparison &comparison = comparisons[index];
+            (comparison.genuine ? truePositives : falsePositives) += weights[comparison.query];
+            index++;
+        }
 
-    float result = -1;
+        if ((falsePositives > previousFalsePositives) && (truePositives > previousTruePositives)) {
+            operatingPoints.append(OperatingPoint(thresh, falsePositives/impostorCount, truePositives/genuineCount));
+            previousFalsePositives = falsePositives;
+            previousTruePositives = truePositives;
+        }
+    }
+
+    if (operatingPoints.size() == 0) operatingPoints.append(OperatingPoint(1, 1, 1));
+    if (operatingPoints.size() == 1) operatingPoints.prepend(OperatingPoint(0, 0, 0));
+    if (operatingPoints.size() > 2)  operatingPoints.takeLast();
+
+    foreach (float far, bootstrapFARs())
+        replicate->TARs.append(getOperatingPointGivenFAR(operatingPoints, far).TAR);
+
+    const QVector<int> &firstGenuineReturns = *bootstrap->firstGenuineReturns;
+    foreach (int rank, bootstrapRanks()) {
+        double realizedReturns = 0, possibleReturns = 0;
+        for (int i=0; i<firstGenuineReturns.size(); i++) {
+            if (firstGenuineReturns[i] > 0) {
+                possibleReturns += weights[i];
+                if (firstGenuineReturns[i] <= rank) realizedReturns += weights[i];
+            }
+        }
+        replicate->retrievalRates.append(possibleReturns > 0 ? realizedReturns/possibleReturns : 0);
+    }
+}
+
+static float percentile(QList<float> values, float p)
+{
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size()-1, std::max(0, int(floor(p * (values.size()-1) + 0.5))))];
+}
+
+// Appends the lower (TFL, CTL) and upper (TFU, CTU) confidence bounds of the TF and CT tables
+template <typename Mask>
+static void writeBootstrap(QStringList &lines, const File &csv, const Mask &mask, const QList<Comparison> &comparisons,
+                           const QVector<int> &genuineSearches, const QVector<int> &firstGenuineReturns)
+{
+    const int replicates = csv.get<int>("bootstrap", 0);
+    if (replicates <= 0) return;
+    const float confidence = csv.get<float>("confidence", 0.95);
+
+    Bootstrap bootstrap;
+    bootstrap.comparisons = &comparisons;
+    bootstrap.firstGenuineReturns = &firstGenuineReturns;
+    bootstrap.subjects = QVector<int>(genuineSearches.size(), -1);
+    QHash<int,int> subjectIndices;
+    for (int i=0; i<genuineSearches.size(); i++) {
+        if (genuineSearches[i] == 0) continue;
+        const int subject = mask.subject(i);
+        if (!subjectIndices.contains(subject)) subjectIndices.insert(subject, subjectIndices.size());
+        bootstrap.subjects[i] = subjectIndices[subject];
+    }
+    bootstrap.numSubjects = subjectIndices.size();
+
+    QVector<BootstrapReplicate> results(replicates);
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<replicates; i++)
+        futures.addFuture(QtConcurrent::run(bootstrapReplicate, (const Bootstrap*)&bootstrap, i+1, &results[i]));
+    futures.waitForFinished();
+
+    QList< QList<float> > TARs, retrievalRates;
+    for (int i=0; i<bootstrapFARs().size(); i++) TARs.append(QList<float>());
+    for (int i=0; i<bootstrapRanks().size(); i++) retrievalRates.append(QList<float>());
+    foreach (const BootstrapReplicate &result, results) {
+        if (result.TARs.isEmpty()) continue;
+        for (int i=0; i<TARs.size(); i++) TARs[i].append(result.TARs[i]);
+        for (int i=0; i<retrievalRates.size(); i++) retrievalRates[i].append(result.retrievalRates[i]);
+    }
+    if (TARs.first().isEmpty()) {
+        qWarning("Every bootstrap replicate lacked genuine or impostor scores.");
+        return;
+    }
+
+    const float lower = (1 - confidence) / 2, upper = 1 - lower;
+    for (int i=0; i<TARs.size(); i++) {
+        const QString far = QString::number(bootstrapFARs()[i], 'f');
+        lines.append(QString("TFL,%1,%2").arg(far, QString::number(percentile(TARs[i], lower), 'f', 3)));
+        lines.append(QString("TFU,%1,%2").arg(far, QString::number(percentile(TARs[i], upper), 'f', 3)));
+    }
+    for (int i=0; i<retrievalRates.size(); i++) {
+        const QString rank = QString::number(bootstrapRanks()[i]);
+        lines.append(QString("CTL,%1,%2").arg(rank, QString::number(percentile(retrievalRates[i], lower), 'f', 3)));
+        lines.append(QString("CTU,%1,%2").arg(rank, QString::number(percentile(retrievalRates[i], upper), 'f', 3)));
+    }
+
+    qDebug("%d%% confidence intervals from %d bootstrap replicates of %d subjects:", int(confidence*100+0.5), TARs.first().size(), bootstrap.numSubjects);
+    qDebug("TAR @ FAR = 0.01:    [%.3f, %.3f]", percentile(TARs[4], lower), percentile(TARs[4], upper));
+    qDebug("TAR @ FAR = 0.001:   [%.3f, %.3f]", percentile(TARs[3], lower), percentile(TARs[3], upper));
+    qDebug("Retrieval Rate @ Rank = 1: [%.3f, %.3f]", percentile(retrievalRates[0], lower), percentile(retrievalRates[0], upper));
+}
+
+// Mask is a BEE::ImplicitMask or a DenseMask
+template <typename Mask>
+static float evaluate(const Mat &simmat, const Mask &mask, const File &csv, const QString &target, const QString &query, unsigned int matches)
+{
+    if (target.isEmpty() || query.isEmpty()) matches = 0;
+    if (simmat.type() != CV_32FC1)
+        qFatal("Invalid simmat format");
 
     // Make comparisons
     QList<Comparison> comparisons; comparisons.reserve(simmat.rows*simmat.cols);
@@ -203,7 +474,7 @@ float Evaluate(const Mat &simmat, const Mat &mask, const File &csv, const QStrin
     int genuineCount = 0, impostorCount = 0, numNaNs = 0;
     for (int i=0; i<simmat.rows; i++) {
         for (int j=0; j<simmat.cols; j++) {
-            const BEE::MaskValue mask_val = mask.at<BEE::MaskValue>(i,j);
+            const BEE::MaskValue mask_val = mask.at(i,j);
             const BEE::SimmatValue simmat_val = simmat.at<BEE::SimmatValue>(i,j);
             if (mask_val == BEE::DontCare) continue;
             if (simmat_val != simmat_val) { numNaNs++; continue; }
@@ -345,103 +616,271 @@ float Evaluate(const Mat &simmat, const Mat &mask, const File &csv, const QStrin
         }
     }
 
-    // Write Detection Error Tradeoff (DET), PRE, REC, Identification Error Tradeoff (IET)
-    float expFAR = csv.get<float>("FAR", std::max(ceil(log10(impostorCount)), 1.0));
-    float expFRR = csv.get<float>("FRR", std::max(ceil(log10(genuineCount)), 1.0));
-    float expFPIR = csv.get<float>("FPIR", std::max(ceil(log10(totalImpostorSearches)), 1.0));
+    // Sample the score distributions (SD)
+    int points = qMin(qMin(Max_Points, genuines.size()), impostors.size());
+    QList<float> sampledGenuineScores; sampledGenuineScores.reserve(points);
+    QList<float> sampledImpostorScores; sampledImpostorScores.reserve(points);
 
-    float FARstep = expFAR / (float)(Max_Points - 1);
-    float FRRstep = expFRR / (float)(Max_Points - 1);
-    float FPIRstep = expFPIR / (float)(Max_Points - 1);
+    if (points > 1) {
+        for (int i=0; i<points; i++) {
+            float genuineScore = genuines[double(i) / double(points-1) * double(genuines.size()-1)];
+            float impostorScore = impostors[double(i) / double(points-1) * double(impostors.size()-1)];
+            if (genuineScore == -std::numeric_limits<float>::max()) genuineScore = minGenuineScore;
+            if (impostorScore == -std::numeric_limits<float>::max()) impostorScore = minImpostorScore;
+            sampledGenuineScores.append(genuineScore);
+            sampledImpostorScores.append(impostorScore);
+        }
+    }
 
-    for (int i=0; i<Max_Points; i++) {
-        float FAR = pow(10, -expFAR + i*FARstep);
-        float FRR = pow(10, -expFRR + i*FRRstep);
-        float FPIR = pow(10, -expFPIR + i*FPIRstep);
+    writeBootstrap(lines, csv, mask, comparisons, genuineSearches, firstGenuineReturns);
 
-        OperatingPoint operatingPointFAR = getOperatingPointGivenFAR(operatingPoints, FAR);
-        OperatingPoint operatingPointTAR = getOperatingPointGivenTAR(operatingPoints, 1-FRR);
-        OperatingPoint searchOperatingPoint = getOperatingPointGivenFAR(searchOperatingPoints, FPIR);
-        lines.append(QString("DET,%1,%2").arg(QString::number(FAR),
-                                              QString::number(1-operatingPointFAR.TAR)));
-        lines.append(QString("FAR,%1,%2").arg(QString::number(operatingPointFAR.score),
-                                              QString::number(FAR)));
-        lines.append(QString("FRR,%1,%2").arg(QString::number(operatingPointTAR.score),
-                                              QString::number(FRR)));
-        lines.append(QString("IET,%1,%2").arg(QString::number(searchOperatingPoint.FAR),
-                                              QString::number(1-searchOperatingPoint.TAR)));
+    return writeResults(lines, csv, target, operatingPoints, searchOperatingPoints, firstGenuineReturns,
+                        genuineCount, impostorCount, totalImpostorSearches, sampledGenuineScores, sampledImpostorScores);
+}
+
+float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &query, const File &csv, int partition)
+{
+    return evaluate(scores, constructMatchingMask(scores, target, query, partition), csv, QString(), QString(), 0);
+}
+
+float Evaluate(const QString &simmat, const QString &mask, const File &csv, unsigned int matches)
+{
+    // Matrices too large to hold in memory are evaluated a block of rows at a time
+    if (simmat.endsWith(".mtx") && (mask.isEmpty() || mask.endsWith(".mask"))) {
+        const BEE::MatrixStream stream(simmat);
+        if (csv.get<bool>("stream", qint64(stream.rows) * stream.cols > (1 << 28)))
+            return EvaluateStreaming(simmat, mask, csv, matches);
     }
 
-    // Write TAR@FAR Table (TF)
-    foreach (float far, QList<float>() << 1e-6 << 1e-5 << 1e-4 << 1e-3 << 1e-2 << 1e-1)
-      lines.append(qPrintable(QString("TF,%1,%2").arg(
-						      QString::number(far, 'f'),
-						      QString::number(getOperatingPointGivenFAR(operatingPoints, far).TAR, 'f', 3))));
+    qDebug("Evaluating %s%s%s",
+           qPrintable(simmat),
+           mask.isEmpty() ? "" : qPrintable(" with " + mask),
+           csv.name.isEmpty() ? "" : qPrintable(" to " + csv));
 
-    // Write FAR@TAR Table (FT)
-    foreach (float tar, QList<float>() << 0.95 << 0.85 << 0.75 << 0.65 << 0.5 << 0.4)
-      lines.append(qPrintable(QString("FT,%1,%2").arg(
-                         QString::number(tar, 'f', 2),
-                         QString::number(getOperatingPointGivenTAR(operatingPoints, tar).FAR, 'f', 3))));
+    // Read similarity matrix
+    QString target, query;
+    Mat scores;
+    if (simmat.endsWith(".mtx")) {
+        scores = BEE::readMatrix(simmat, &target, &query);
+    } else {
+        QScopedPointer<Format> format(Factory<Format>::make(simmat));
+        scores = format->read();
+    }
 
-    //Write CMC Table (CT)
-    lines.append(qPrintable(QString("CT,1,%1").arg(QString::number(getCMC(firstGenuineReturns, 1), 'f', 3))));
-    lines.append(qPrintable(QString("CT,5,%1").arg(QString::number(getCMC(firstGenuineReturns, 5), 'f', 3))));
-    lines.append(qPrintable(QString("CT,10,%1").arg(QString::number(getCMC(firstGenuineReturns, 10), 'f', 3))));
-    lines.append(qPrintable(QString("CT,20,%1").arg(QString::number(getCMC(firstGenuineReturns, 20), 'f', 3))));
-    lines.append(qPrintable(QString("CT,50,%1").arg(QString::number(getCMC(firstGenuineReturns, 50), 'f', 3))));
-    lines.append(qPrintable(QString("CT,100,%1").arg(QString::number(getCMC(firstGenuineReturns, 100), 'f', 3))));
+    // Read mask matrix
+    if (mask.isEmpty()) {
+        // Use the galleries specified in the similarity matrix
+        if (target.isEmpty()) qFatal("Unspecified target gallery.");
+        if (query.isEmpty()) qFatal("Unspecified query gallery.");
 
-    // Write FAR/TAR Bar Chart (BC)
-    lines.append(qPrintable(QString("BC,0.001,%1").arg(QString::number(getOperatingPointGivenFAR(operatingPoints, 0.001).TAR, 'f', 3))));
-    lines.append(qPrintable(QString("BC,0.01,%1").arg(QString::number(result = getOperatingPointGivenFAR(operatingPoints, 0.01).TAR, 'f', 3))));
+        return evaluate(scores, constructMatchingMask(scores, FileList::fromGallery(target), FileList::fromGallery(query)),
+                        csv, target, query, matches);
+    }
 
-    // Attempt to read template size from enrolled gallery and write to output CSV
-    size_t maxSize(0);
-    if (target.endsWith(".gal") && QFileInfo(target).exists()) {
-        foreach (const Template &t, TemplateList::fromGallery(target)) maxSize = max(maxSize, t.bytes());
-        lines.append(QString("TS,,%1").arg(QString::number(maxSize)));
+    File maskFile(mask);
+    maskFile.set("rows", scores.rows);
+    maskFile.set("columns", scores.cols);
+    QScopedPointer<Format> format(Factory<Format>::make(maskFile));
+    const Mat truth = format->read();
+    return Evaluate(scores, truth, csv, target, query, matches);
+}
+
+float Evaluate(const Mat &simmat, const Mat &mask, const File &csv, const QString &target, const QString &query, unsigned int matches)
+{
+    if (simmat.size() != mask.size())
+        qFatal("Similarity matrix (%ix%i) differs in size from mask matrix (%ix%i).",
+               simmat.rows, simmat.cols, mask.rows, mask.cols);
+
+    if (mask.type() != CV_8UC1)
+        qFatal("Invalid mask format");
+
+    return evaluate(simmat, DenseMask(mask), csv, target, query, matches);
+}
+
+float EvaluateHistograms(const QVector<qint64> &genuineHistogram, const QVector<qint64> &impostorHistogram, float minScore, double binWidth,
+                         const QList<float> &genuineSearches, const QList<float> &impostorSearches, const QVector<int> &firstGenuineReturns,
+                         int gallerySize, int probeSize, const File &csv, const QString &target)
+{
+    if (genuineHistogram.size() != impostorHistogram.size())
+        qFatal("Genuine and impostor histograms differ in size.");
+    const int bins = genuineHistogram.size();
+
+    qint64 genuineCount = 0, impostorCount = 0;
+    for (int i=0; i<bins; i++) {
+        genuineCount += genuineHistogram[i];
+        impostorCount += impostorHistogram[i];
     }
+    if (genuineCount == 0) qFatal("No genuine scores!");
+    if (impostorCount == 0) qFatal("No impostor scores!");
 
-    // Write SD & KDE
-    int points = qMin(qMin(Max_Points, genuines.size()), impostors.size());
-    QList<double> sampledGenuineScores; sampledGenuineScores.reserve(points);
-    QList<double> sampledImpostorScores; sampledImpostorScores.reserve(points);
+    QList<OperatingPoint> operatingPoints;
+    qint64 falsePositives = 0, previousFalsePositives = 0;
+    qint64 truePositives = 0, previousTruePositives = 0;
+    for (int i=bins-1; i>=0; i--) {
+        truePositives += genuineHistogram[i];
+        falsePositives += impostorHistogram[i];
+        if ((falsePositives > previousFalsePositives) &&
+             (truePositives > previousTruePositives)) {
+            operatingPoints.append(OperatingPoint(minScore + i*binWidth, float(falsePositives)/impostorCount, float(truePositives)/genuineCount));
+            previousFalsePositives = falsePositives;
+            previousTruePositives = truePositives;
+        }
+    }
+
+    // Search statistics are exact, computed from the best score of each search
+    QList<Comparison> searches; searches.reserve(genuineSearches.size() + impostorSearches.size());
+    foreach (float score, genuineSearches)
+        searches.append(Comparison(score, -1, -1, true));
+    foreach (float score, impostorSearches)
+        searches.append(Comparison(score, -1, -1, false));
+    std::stable_sort(searches.begin(), searches.end());
+    const int totalGenuineSearches = genuineSearches.size();
+    const int totalImpostorSearches = impostorSearches.size();
+
+    QList<OperatingPoint> searchOperatingPoints;
+    int falseSearches = 0, previousFalseSearches = 0;
+    int trueSearches = 0, previousTrueSearches = 0;
+    int index = 0;
+    while (index < searches.size()) {
+        const float thresh = searches[index].score;
+        while ((index < searches.size()) &&
+               (searches[index].score == thresh)) {
+            if (searches[index].genuine) trueSearches++;
+            else                         falseSearches++;
+            index++;
+        }
+
+        if ((falseSearches > previousFalseSearches) &&
+             (trueSearches > previousTrueSearches)) {
+            searchOperatingPoints.append(OperatingPoint(thresh, float(falseSearches)/totalImpostorSearches, float(trueSearches)/totalGenuineSearches));
+            previousFalseSearches = falseSearches;
+            previousTrueSearches = trueSearches;
+        }
+    }
+
+    if (operatingPoints.size() == 0) operatingPoints.append(OperatingPoint(1, 1, 1));
+    if (operatingPoints.size() == 1) operatingPoints.prepend(OperatingPoint(0, 0, 0));
+    if (operatingPoints.size() > 2)  operatingPoints.takeLast(); // Remove point (1,1)
+
+    if (searchOperatingPoints.size() == 0) searchOperatingPoints.append(OperatingPoint(1, 1, 1));
+    if (searchOperatingPoints.size() == 1) searchOperatingPoints.prepend(OperatingPoint(0, 0, 0));
+    if (searchOperatingPoints.size() > 2)  searchOperatingPoints.takeLast();
+
+    // Write Metadata table
+    QStringList lines;
+    lines.append("Plot,X,Y");
+    lines.append("Metadata,"+QString::number(gallerySize)+",Gallery");
+    lines.append("Metadata,"+QString::number(probeSize)+",Probe");
+    lines.append("Metadata,"+QString::number(genuineCount)+",Genuine");
+    lines.append("Metadata,"+QString::number(impostorCount)+",Impostor");
+    lines.append("Metadata,"+QString::number(qint64(gallerySize)*probeSize-(genuineCount+impostorCount))+",Ignored");
+
+    // Sample the score distributions (SD)
+    const int points = int(qMin(qMin(qint64(Max_Points), genuineCount), impostorCount));
+    QList<float> sampledGenuineScores; sampledGenuineScores.reserve(points);
+    QList<float> sampledImpostorScores; sampledImpostorScores.reserve(points);
 
     if (points > 1) {
         for (int i=0; i<points; i++) {
-            float genuineScore = genuines[double(i) / double(points-1) * double(genuines.size()-1)];
-            float impostorScore = impostors[double(i) / double(points-1) * double(impostors.size()-1)];
-            if (genuineScore == -std::numeric_limits<float>::max()) genuineScore = minGenuineScore;
-            if (impostorScore == -std::numeric_limits<float>::max()) impostorScore = minImpostorScore;
-            lines.append(QString("SD,%1,Genuine").arg(QString::number(genuineScore)));
-            lines.append(QString("SD,%1,Impostor").arg(QString::number(impostorScore)));
-            sampledGenuineScores.append(genuineScore);
-            sampledImpostorScores.append(impostorScore);
+            sampledGenuineScores.append(histogramScore(genuineHistogram, qint64(double(i) / double(points-1) * double(genuineCount-1)), minScore, binWidth));
+            sampledImpostorScores.append(histogramScore(impostorHistogram, qint64(double(i) / double(points-1) * double(impostorCount-1)), minScore, binWidth));
         }
     }
 
-    // Write Cumulative Match Characteristic (CMC) curve
-    const int Max_Retrieval = 200;
-    const int Report_Retrieval = 5;
-    for (int i=1; i<=Max_Retrieval; i++) {
-        const float retrievalRate = getCMC(firstGenuineReturns, i);
-        lines.append(qPrintable(QString("CMC,%1,%2").arg(QString::number(i), QString::number(retrievalRate))));
-    }
+    return writeResults(lines, csv, target, operatingPoints, searchOperatingPoints, firstGenuineReturns,
+                        genuineCount, impostorCount, totalImpostorSearches, sampledGenuineScores, sampledImpostorScores);
+}
 
-    QtUtils::writeFile(csv, lines);
-    if (maxSize > 0) qDebug("Template Size: %i bytes", (int)maxSize);
-    qDebug("TAR @ FAR = 0.01:    %.3f",getOperatingPointGivenFAR(operatingPoints, 0.01).TAR);
-    qDebug("TAR @ FAR = 0.001:   %.3f",getOperatingPointGivenFAR(operatingPoints, 0.001).TAR);
-    qDebug("TAR @ FAR = 0.0001:  %.3f",getOperatingPointGivenFAR(operatingPoints, 0.0001).TAR);
-    qDebug("TAR @ FAR = 0.00001: %.3f",getOperatingPointGivenFAR(operatingPoints, 0.00001).TAR);
+float EvaluateStreaming(const QString &simmat, const QString &mask, const File &csv, unsigned int matches)
+{
+    qDebug("Streaming evaluation of %s%s%s",
+           qPrintable(simmat),
+           mask.isEmpty() ? "" : qPrintable(" with " + mask),
+           csv.name.isEmpty() ? "" : qPrintable(" to " + csv));
+    if (matches != 0) qWarning("Impostor and genuine matches are not reported by streaming evaluation.");
+
+    MaskedMatrixStream stream(simmat, mask);
+    const int rows = stream.scores.rows;
+    const int cols = stream.scores.cols;
+    Mat scores, truth;
+
+    // First pass counts the comparisons, finds the score range,
+    // and ranks the best genuine and impostor score of each search.
+    QList<float> genuineSearches, impostorSearches; // Best score of each mated and non-mated search
+    QVector<int> firstGenuineReturns(rows, 0);
+    qint64 genuineCount = 0, impostorCount = 0, numNaNs = 0;
+    float minScore = std::numeric_limits<float>::max();
+    float maxScore = -std::numeric_limits<float>::max();
+
+    int row = 0;
+    while (stream.next(scores, truth)) {
+        for (int i=0; i<scores.rows; i++, row++) {
+            const BEE::SimmatValue *simmat_row = scores.ptr<BEE::SimmatValue>(i);
+            const BEE::MaskValue *mask_row = truth.ptr<BEE::MaskValue>(i);
+            bool genuine = false, impostor = false;
+            float bestGenuine = -std::numeric_limits<float>::max();
+            float bestImpostor = -std::numeric_limits<float>::max();
+
+            for (int j=0; j<cols; j++) {
+                const BEE::SimmatValue simmat_val = simmat_row[j];
+                if (mask_row[j] == BEE::DontCare) continue;
+                if (simmat_val != simmat_val) { numNaNs++; continue; }
+                if (simmat_val != -std::numeric_limits<float>::max()) {
+                    minScore = std::min(minScore, simmat_val);
+                    maxScore = std::max(maxScore, simmat_val);
+                }
+                if (mask_row[j] == BEE::Match) {
+                    genuineCount++;
+                    bestGenuine = std::max(bestGenuine, simmat_val);
+                    genuine = true;
+                } else {
+                    impostorCount++;
+                    bestImpostor = std::max(bestImpostor, simmat_val);
+                    impostor = true;
+                }
+            }
 
-    qDebug("FNIR @ FPIR = 0.1:   %.3f", 1-getOperatingPointGivenFAR(searchOperatingPoints, 0.1).TAR);
-    qDebug("FNIR @ FPIR = 0.01:  %.3f", 1-getOperatingPointGivenFAR(searchOperatingPoints, 0.01).TAR);
+            if (genuine) {
+                // Ties are ranked pessimistically, impostors ahead of genuines
+                int rank = 1;
+                for (int j=0; j<cols; j++)
+                    if ((mask_row[j] != BEE::DontCare) && (mask_row[j] != BEE::Match) && (simmat_row[j] >= bestGenuine))
+                        rank++;
+                firstGenuineReturns[row] = rank;
+                genuineSearches.append(bestGenuine);
+            } else if (impostor) {
+                impostorSearches.append(bestImpostor);
+            }
+        }
+    }
 
-    qDebug("\nRetrieval Rate @ Rank = %d: %.3f", Report_Retrieval, getCMC(firstGenuineReturns, Report_Retrieval));
+    if (numNaNs > 0) qWarning("Encountered %lld NaN scores!", numNaNs);
+    if (genuineCount == 0) qFatal("No genuine scores!");
+    if (impostorCount == 0) qFatal("No impostor scores!");
+    if (minScore > maxScore) minScore = maxScore = 0;
+
+    // Second pass bins the scores, thresholds are quantized to the bin width
+    const int bins = std::max(csv.get<int>("bins", 1 << 20), 1);
+    const double binWidth = (maxScore > minScore) ? (double(maxScore) - minScore) / bins : 1;
+    QVector<qint64> genuineHistogram(bins, 0), impostorHistogram(bins, 0);
+
+    stream.rewind();
+    while (stream.next(scores, truth)) {
+        for (int i=0; i<scores.rows; i++) {
+            const BEE::SimmatValue *simmat_row = scores.ptr<BEE::SimmatValue>(i);
+            const BEE::MaskValue *mask_row = truth.ptr<BEE::MaskValue>(i);
+            for (int j=0; j<cols; j++) {
+                const BEE::SimmatValue simmat_val = simmat_row[j];
+                if ((mask_row[j] == BEE::DontCare) || (simmat_val != simmat_val)) continue;
+                const int bin = histogramBin(simmat_val, minScore, binWidth, bins);
+                if (mask_row[j] == BEE::Match) genuineHistogram[bin]++;
+                else                           impostorHistogram[bin]++;
+            }
+        }
+    }
 
-    return result;
+    return EvaluateHistograms(genuineHistogram, impostorHistogram, minScore, binWidth, genuineSearches, impostorSearches,
+                              firstGenuineReturns, cols, rows, csv, stream.scores.target);
 }
 
 void assertEval(const QString &simmat, const QString &mask, float accuracy)
@@ -494,7 +933,8 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
     qint64 cols = words[2].toLongLong();
 
     bool isMask = words[0][1] == 'B';
-    qint64 typeSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
+    const BEE::SimmatEncoding encoding = BEE::SimmatEncoding::parse(words);
+    qint64 typeSize = isMask ? sizeof(BEE::MaskValue) : encoding.elemSize();
 
     // Get matrix data
     qint64 rowSize = cols * typeSize;
@@ -545,9 +985,10 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
 
             QList<qint64> colMask = galleryIndices[probeLabels[i]];
             foreach (qint64 colID, colMask) {
-                float score;
+                float stored, score;
                 file.seek(data_pos + i * rowSize + colID * typeSize);
-                file.read((char *) &score, sizeof(float));
+                file.read((char *) &stored, typeSize);
+                encoding.decode(&stored, &score, 1);
                 if (genScoresToCounts.contains(score))
                     genScoresToCounts[score].genCount++;
                 else
@@ -574,6 +1015,7 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
 
     //sequence, mapfunciton, reducefunction
     Mat blockMat(bSize, cols, CV_32FC1);
+    QByteArray storedRows(int(bSize * rowSize), 0);
 
     qint64 bCount = 0;
     do {
@@ -582,7 +1024,8 @@ float InplaceEval(const QString &simmat, const QString &target, const QString &q
         QStringList probeLabels = File::get<QString>(temp, "Label");
         temp.clear();
 
-        file.read((char *) blockMat.data, rowSize * probeLabels.length());
+        file.read(storedRows.data(), rowSize * probeLabels.length());
+        encoding.decode(storedRows.constData(), (float *) blockMat.data, int(cols * probeLabels.length()));
         for (int i=0; i < probeLabels.size();i++) {
             row_count++;
             aRow = blockMat.row(i);
@@ -782,6 +1225,12 @@ struct SortedDetection
     inline bool operator<(const SortedDetection &other) const { return overlap > other.overlap; }
 };
 
+static bool truthMajor(const SortedDetection &a, const SortedDetection &b)
+{
+    if (a.truth_idx != b.truth_idx) return a.truth_idx < b.truth_idx;
+    return a.predicted_idx < b.predicted_idx;
+}
+
 struct Detections
 {
     QList<Detection> predicted, truth;
@@ -950,66 +1399,165 @@ static inline int getNumberOfImages(const QMap<QString, Detections> detections)
     return detections.keys().size();
 }
 
-static int associateGroundTruthDetections(QList<ResolvedDetection> &resolved, QList<ResolvedDetection> &falseNegative, QMap<QString, Detections> &all, QRectF &offsets)
+// Uniform grid over the truth detections of an image, for finding the ones a predicted detection may overlap
+struct DetectionGrid
 {
-    float dLeftTotal = 0.0, dRightTotal = 0.0, dTopTotal = 0.0, dBottomTotal = 0.0;
-    int count = 0, totalTrueDetections = 0;
+    QRectF bounds;
+    double cellWidth, cellHeight;
+    int columns, rows;
+    QVector< QVector<int> > cells;
 
-    foreach (Detections detections, all.values()) {
-        totalTrueDetections += detections.truth.size();
-        // Try to associate ground truth detections with predicted detections
-
-        QList<SortedDetection> sortedDetections; sortedDetections.reserve(detections.truth.size() * detections.predicted.size());
-        for (int t = 0; t < detections.truth.size(); t++) {
-            const Detection truth = detections.truth[t];
-            for (int p = 0; p < detections.predicted.size(); p++) {
-                Detection predicted = detections.predicted[p];
-
-                float predictedWidth = predicted.boundingBox.width();
-                float x, y, width, height;
-                x = predicted.boundingBox.x() + offsets.x()*predictedWidth;
-                y = predicted.boundingBox.y() + offsets.y()*predictedWidth;
-                width = predicted.boundingBox.width() - offsets.width()*predictedWidth;
-                height = predicted.boundingBox.height() - offsets.height()*predictedWidth;
-                Detection newPredicted(QRectF(x, y, width, height), 0.0);
-
-                const float overlap = truth.overlap(newPredicted);
-                if (overlap > 0)
-                    sortedDetections.append(SortedDetection(t, p, overlap));
-            }
+    DetectionGrid(const QList<Detection> &truth)
+        : cellWidth(1), cellHeight(1), columns(1), rows(1)
+    {
+        double totalWidth = 0, totalHeight = 0;
+        foreach (const Detection &detection, truth) {
+            bounds = bounds.united(detection.boundingBox.normalized());
+            totalWidth += fabs(detection.boundingBox.width());
+            totalHeight += fabs(detection.boundingBox.height());
+        }
+        if (truth.isEmpty() || bounds.isEmpty()) return;
+
+        // Cells about the size of an average detection, with at most a few per detection
+        const int maxCells = 4 * truth.size();
+        columns = qBound(1, int(bounds.width() / std::max(totalWidth / truth.size(), 1e-6)), maxCells);
+        rows = qBound(1, int(bounds.height() / std::max(totalHeight / truth.size(), 1e-6)), std::max(1, maxCells / columns));
+        cellWidth = bounds.width() / columns;
+        cellHeight = bounds.height() / rows;
+        cells.resize(columns * rows);
+
+        for (int t=0; t<truth.size(); t++) {
+            int left, top, right, bottom;
+            if (!cover(truth[t].boundingBox.normalized(), &left, &top, &right, &bottom)) continue;
+            for (int y=top; y<=bottom; y++)
+                for (int x=left; x<=right; x++)
+                    cells[y*columns + x].append(t);
         }
+    }
 
-        std::sort(sortedDetections.begin(), sortedDetections.end());
+    // The range of cells a box touches, false if it misses the grid
+    bool cover(const QRectF &box, int *left, int *top, int *right, int *bottom) const
+    {
+        if (!box.intersects(bounds)) return false;
+        *left   = qBound(0, int((box.left()   - bounds.left()) / cellWidth),  columns-1);
+        *right  = qBound(0, int((box.right()  - bounds.left()) / cellWidth),  columns-1);
+        *top    = qBound(0, int((box.top()    - bounds.top())  / cellHeight), rows-1);
+        *bottom = qBound(0, int((box.bottom() - bounds.top())  / cellHeight), rows-1);
+        return true;
+    }
 
-        QList<int> removedTruth;
-        QList<int> removedPredicted;
+    // Sorted indices of the truth detections that may overlap box
+    QVector<int> candidates(const QRectF &box) const
+    {
+        QVector<int> result;
+        int left, top, right, bottom;
+        if (cells.isEmpty() || !cover(box, &left, &top, &right, &bottom)) return result;
+        for (int y=top; y<=bottom; y++)
+            for (int x=left; x<=right; x++)
+                result += cells[y*columns + x];
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+        return result;
+    }
+};
 
-        foreach (const SortedDetection &detection, sortedDetections) {
-            if (removedTruth.contains(detection.truth_idx) || removedPredicted.contains(detection.predicted_idx))
-                continue;
+struct ImageAssociation
+{
+    QList<ResolvedDetection> resolved, falseNegative;
+    QList<QRectF> differences; // Left, top, right and bottom, relative to the predicted width
+};
 
-            const Detection truth = detections.truth[detection.truth_idx];
-            const Detection predicted = detections.predicted[detection.predicted_idx];
+static void associateImage(const Detections *detections, const QRectF offsets, ImageAssociation *association)
+{
+    // Try to associate ground truth detections with predicted detections
+    const DetectionGrid grid(detections->truth);
+
+    QList<SortedDetection> sortedDetections;
+    for (int p = 0; p < detections->predicted.size(); p++) {
+        Detection predicted = detections->predicted[p];
+
+        float predictedWidth = predicted.boundingBox.width();
+        float x, y, width, height;
+        x = predicted.boundingBox.x() + offsets.x()*predictedWidth;
+        y = predicted.boundingBox.y() + offsets.y()*predictedWidth;
+        width = predicted.boundingBox.width() - offsets.width()*predictedWidth;
+        height = predicted.boundingBox.height() - offsets.height()*predictedWidth;
+        Detection newPredicted(QRectF(x, y, width, height), 0.0);
+
+        // Degenerate boxes are checked against every truth detection
+        QVector<int> candidates;
+        if ((width > 0) && (height > 0)) {
+            candidates = grid.candidates(newPredicted.boundingBox);
+        } else {
+            for (int t = 0; t < detections->truth.size(); t++)
+                candidates.append(t);
+        }
 
-            if (!truth.ignore) resolved.append(ResolvedDetection(predicted.confidence, detection.overlap));
+        foreach (int t, candidates) {
+            const float overlap = detections->truth[t].overlap(newPredicted);
+            if (overlap > 0)
+                sortedDetections.append(SortedDetection(t, p, overlap));
+        }
+    }
 
-            removedTruth.append(detection.truth_idx);
-            removedPredicted.append(detection.predicted_idx);
+    // Restore truth-major order before sorting by overlap, so ties resolve as they did without the grid
+    std::sort(sortedDetections.begin(), sortedDetections.end(), truthMajor);
+    std::sort(sortedDetections.begin(), sortedDetections.end());
 
-            if (offsets.x() == 0 && detection.overlap > 0.3) {
-                count++;
-                float width = predicted.boundingBox.width();
-                dLeftTotal += (truth.boundingBox.left() - predicted.boundingBox.left()) / width;
-                dRightTotal += (truth.boundingBox.right() - predicted.boundingBox.right()) / width;
-                dTopTotal += (truth.boundingBox.top() - predicted.boundingBox.top()) / width;
-                dBottomTotal += (truth.boundingBox.bottom() - predicted.boundingBox.bottom()) / width;
-            }
+    QVector<bool> removedTruth(detections->truth.size(), false);
+    QVector<bool> removedPredicted(detections->predicted.size(), false);
+
+    foreach (const SortedDetection &detection, sortedDetections) {
+        if (removedTruth[detection.truth_idx] || removedPredicted[detection.predicted_idx])
+            continue;
+
+        const Detection truth = detections->truth[detection.truth_idx];
+        const Detection predicted = detections->predicted[detection.predicted_idx];
+
+        if (!truth.ignore) association->resolved.append(ResolvedDetection(predicted.confidence, detection.overlap));
+
+        removedTruth[detection.truth_idx] = true;
+        removedPredicted[detection.predicted_idx] = true;
+
+        if (offsets.x() == 0 && detection.overlap > 0.3) {
+            float width = predicted.boundingBox.width();
+            association->differences.append(QRectF((truth.boundingBox.left() - predicted.boundingBox.left()) / width,
+                                                   (truth.boundingBox.top() - predicted.boundingBox.top()) / width,
+                                                   (truth.boundingBox.right() - predicted.boundingBox.right()) / width,
+                                                   (truth.boundingBox.bottom() - predicted.boundingBox.bottom()) / width));
         }
+    }
+
+    for (int i = 0; i < detections->predicted.size(); i++)
+        if (!removedPredicted[i]) association->resolved.append(ResolvedDetection(detections->predicted[i].confidence, 0));
+    for (int i = 0; i < detections->truth.size(); i++)
+        if (!removedTruth[i] && !detections->truth[i].ignore) association->falseNegative.append(ResolvedDetection(-std::numeric_limits<float>::max(), 0));
+}
 
-        for (int i = 0; i < detections.predicted.size(); i++)
-            if (!removedPredicted.contains(i)) resolved.append(ResolvedDetection(detections.predicted[i].confidence, 0));
-        for (int i = 0; i < detections.truth.size(); i++)
-            if (!removedTruth.contains(i) && !detections.truth[i].ignore) falseNegative.append(ResolvedDetection(-std::numeric_limits<float>::max(), 0));
+static int associateGroundTruthDetections(QList<ResolvedDetection> &resolved, QList<ResolvedDetection> &falseNegative, QMap<QString, Detections> &all, QRectF &offsets)
+{
+    float dLeftTotal = 0.0, dRightTotal = 0.0, dTopTotal = 0.0, dBottomTotal = 0.0;
+    int count = 0, totalTrueDetections = 0;
+
+    // Images are associated in parallel, then merged in order
+    const QList<Detections> images = all.values();
+    QVector<ImageAssociation> associations(images.size());
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<images.size(); i++)
+        futures.addFuture(QtConcurrent::run(associateImage, &images[i], offsets, &associations[i]));
+    futures.waitForFinished();
+
+    for (int i=0; i<images.size(); i++) {
+        totalTrueDetections += images[i].truth.size();
+        resolved.append(associations[i].resolved);
+        falseNegative.append(associations[i].falseNegative);
+        foreach (const QRectF &difference, associations[i].differences) {
+            count++;
+            dLeftTotal += difference.x();
+            dRightTotal += difference.width();
+            dTopTotal += difference.y();
+            dBottomTotal += difference.height();
+        }
     }
 
     if (offsets.x() == 0) {
@@ -1128,60 +1676,126 @@ float EvalDetection(const QString &predictedGallery, const QString &truthGallery
     return averageOverlap;
 }
 
-static void projectAndWrite(Transform *t, const Template &src, const QString &filePath)
+// Points of the matched images, packed contiguously so errors are computed without per point container lookups
+struct LandmarkErrors
+{
+    QVector<int> offsets; // Index of the first point of each image, plus the total
+    QVector<float> predictedX, predictedY, truthX, truthY;
+    QVector<float> errors; // Normalized error of each point
+    QVector<float> imageErrors, normalizedLengths;
+    int normalizationIndexA, normalizationIndexB;
+};
+
+static void computeLandmarkErrors(LandmarkErrors *landmarks, int begin, int end)
+{
+    for (int i=begin; i<end; i++) {
+        const int offset = landmarks->offsets[i];
+        const int size = landmarks->offsets[i+1] - offset;
+        const float *predictedX = landmarks->predictedX.constData() + offset;
+        const float *predictedY = landmarks->predictedY.constData() + offset;
+        const float *truthX = landmarks->truthX.constData() + offset;
+        const float *truthY = landmarks->truthY.constData() + offset;
+        float *errors = landmarks->errors.data() + offset;
+
+        const float dx = truthX[landmarks->normalizationIndexB] - truthX[landmarks->normalizationIndexA];
+        const float dy = truthY[landmarks->normalizationIndexB] - truthY[landmarks->normalizationIndexA];
+        const float normalizedLength = sqrt(dx*dx + dy*dy);
+
+        float totalError = 0;
+        for (int j=0; j<size; j++) {
+            const float ex = predictedX[j] - truthX[j];
+            const float ey = predictedY[j] - truthY[j];
+            errors[j] = sqrt(ex*ex + ey*ey) / normalizedLength;
+            totalError += errors[j];
+        }
+        landmarks->imageErrors[i] = totalError / size;
+        landmarks->normalizedLengths[i] = normalizedLength;
+    }
+}
+
+struct LandmarkExample
+{
+    const Transform *transform;
+    Template src;
+    QString filePath;
+
+    LandmarkExample() : transform(NULL) {}
+    LandmarkExample(const Transform *transform_, const Template &src_, const QString &filePath_)
+        : transform(transform_), src(src_), filePath(filePath_) {}
+};
+
+static void projectAndWrite(LandmarkExample &example)
 {
     Template dst;
-    t->project(src,dst);
-    OpenCVUtils::saveImage(dst.m(),filePath);
+    example.transform->project(example.src, dst);
+    OpenCVUtils::saveImage(dst.m(), example.filePath);
 }
 
 float EvalLandmarking(const QString &predictedGallery, const QString &truthGallery, const QString &csv, int normalizationIndexA, int normalizationIndexB, int sampleIndex, int totalExamples)
 {
     qDebug("Evaluating landmarking of %s against %s", qPrintable(predictedGallery), qPrintable(truthGallery));
-    TemplateList predicted(TemplateList::fromGallery(predictedGallery));
-    TemplateList truth(TemplateList::fromGallery(truthGallery));
-    QStringList predictedNames = File::get<QString>(predicted, "name");
-    QStringList truthNames = File::get<QString>(truth, "name");
+    const TemplateList predicted(TemplateList::fromGallery(predictedGallery));
+    const TemplateList truth(TemplateList::fromGallery(truthGallery));
 
-    int skipped = 0;
-    QList< QList<float> > pointErrors;
-    QList<float> imageErrors;
-    QList<float> normalizedLengths;
+    // Ground truth is indexed by name, the first occurrence of a name wins
+    QHash<QString,int> truthIndices;
+    truthIndices.reserve(truth.size());
+    for (int i=0; i<truth.size(); i++)
+        if (!truthIndices.contains(truth[i].file.name))
+            truthIndices.insert(truth[i].file.name, i);
+
+    LandmarkErrors landmarks;
+    landmarks.normalizationIndexA = normalizationIndexA;
+    landmarks.normalizationIndexB = normalizationIndexB;
+    landmarks.offsets.append(0);
+    QVector<int> matchedPredicted, matchedTruth;
+    int skipped = 0, maxPoints = 0;
     for (int i=0; i<predicted.size(); i++) {
-        const QString &predictedName = predictedNames[i];
-        const int truthIndex = truthNames.indexOf(predictedName);
-        if (truthIndex == -1) qFatal("Could not identify ground truth for file: %s", qPrintable(predictedName));
+        const QString &predictedName = predicted[i].file.name;
+        const QHash<QString,int>::const_iterator truthIndex = truthIndices.constFind(predictedName);
+        if (truthIndex == truthIndices.constEnd()) qFatal("Could not identify ground truth for file: %s", qPrintable(predictedName));
         const QList<QPointF> predictedPoints = predicted[i].file.points();
-        const QList<QPointF> truthPoints = truth[truthIndex].file.points();
+        const QList<QPointF> truthPoints = truth[truthIndex.value()].file.points();
         if (predictedPoints.size() != truthPoints.size() || truthPoints.contains(QPointF(-1,-1))) {
-            predicted.removeAt(i);
-            predictedNames.removeAt(i);
-            truth.removeAt(i);
-            truthNames.removeAt(i);
-            i--; skipped++;
+            skipped++;
             continue;
         }
 
-        while (pointErrors.size() < predictedPoints.size())
-            pointErrors.append(QList<float>());
-
-        // Want to know error for every image.
-
         if (normalizationIndexA >= truthPoints.size()) qFatal("Normalization index A is out of range.");
         if (normalizationIndexB >= truthPoints.size()) qFatal("Normalization index B is out of range.");
-        const float normalizedLength = QtUtils::euclideanLength(truthPoints[normalizationIndexB] - truthPoints[normalizationIndexA]);
-        normalizedLengths.append(normalizedLength);
-        float totalError = 0;
+
         for (int j=0; j<predictedPoints.size(); j++) {
-            float error = QtUtils::euclideanLength(predictedPoints[j] - truthPoints[j])/normalizedLength;
-            totalError += error;
-            pointErrors[j].append(error);
+            landmarks.predictedX.append(predictedPoints[j].x());
+            landmarks.predictedY.append(predictedPoints[j].y());
+            landmarks.truthX.append(truthPoints[j].x());
+            landmarks.truthY.append(truthPoints[j].y());
         }
-        imageErrors.append(totalError/predictedPoints.size());
+        landmarks.offsets.append(landmarks.predictedX.size());
+        matchedPredicted.append(i);
+        matchedTruth.append(truthIndex.value());
+        maxPoints = std::max(maxPoints, predictedPoints.size());
     }
 
     qDebug() << "Skipped" << skipped << "files due to point size mismatch.";
 
+    // Want to know error for every image, computed in parallel over blocks of images
+    const int images = matchedPredicted.size();
+    landmarks.errors.resize(landmarks.predictedX.size());
+    landmarks.imageErrors.resize(images);
+    landmarks.normalizedLengths.resize(images);
+    const int chunk = std::max(1, images / (4 * std::max(1, QThread::idealThreadCount())));
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<images; i+=chunk)
+        futures.addFuture(QtConcurrent::run(computeLandmarkErrors, &landmarks, i, std::min(i+chunk, images)));
+    futures.waitForFinished();
+
+    QList< QList<float> > pointErrors;
+    for (int j=0; j<maxPoints; j++)
+        pointErrors.append(QList<float>());
+    for (int i=0; i<images; i++)
+        for (int j=landmarks.offsets[i]; j<landmarks.offsets[i+1]; j++)
+            pointErrors[j-landmarks.offsets[i]].append(landmarks.errors[j]);
+
     QList<float> averagePointErrors; averagePointErrors.reserve(pointErrors.size());
 
     QStringList lines;
@@ -1190,40 +1804,47 @@ float EvalLandmarking(const QString &predictedGallery, const QString &truthGalle
     QtUtils::touchDir(QDir("landmarking_examples_truth"));
     QtUtils::touchDir(QDir("landmarking_examples_predicted"));
 
+    // Examples are rendered in the background while the error distributions are summarized
+    QScopedPointer<Transform> sample(Transform::make("Open+Draw(verbose,rects=false,location=false)",NULL));
+    QScopedPointer<Transform> t(Transform::make("Open+Draw(rects=false)",NULL));
+    QList<LandmarkExample> examples;
+
     // Example
     {
-        QScopedPointer<Transform> t(Transform::make("Open+Draw(verbose,rects=false,location=false)",NULL));
-
-        QString filePath = "landmarking_examples_truth/"+truth[sampleIndex].file.fileName();
-        projectAndWrite(t.data(), truth[sampleIndex],filePath);
-        lines.append("Sample,"+filePath+","+QString::number(truth[sampleIndex].file.points().size()));
+        const Template &src = truth[matchedTruth[sampleIndex]];
+        QString filePath = "landmarking_examples_truth/"+src.file.fileName();
+        examples.append(LandmarkExample(sample.data(), src, filePath));
+        lines.append("Sample,"+filePath+","+QString::number(src.file.points().size()));
     }
 
     // Get best and worst performing examples
-    QList< QPair<float,int> > exampleIndices = Common::Sort(imageErrors,true);
-
-    QScopedPointer<Transform> t(Transform::make("Open+Draw(rects=false)",NULL));
+    QList< QPair<float,int> > exampleIndices = Common::Sort(landmarks.imageErrors.toList(),true);
+    totalExamples = std::min(totalExamples, exampleIndices.size());
 
     for (int i=0; i<totalExamples; i++) {
-        QString filePath = "landmarking_examples_truth/"+truth[exampleIndices[i].second].file.fileName();
-        projectAndWrite(t.data(), truth[exampleIndices[i].second],filePath);
+        const int image = exampleIndices[i].second;
+        QString filePath = "landmarking_examples_truth/"+truth[matchedTruth[image]].file.fileName();
+        examples.append(LandmarkExample(t.data(), truth[matchedTruth[image]], filePath));
         lines.append("EXT,"+filePath+","+QString::number(exampleIndices[i].first));
 
-        filePath = "landmarking_examples_predicted/"+predicted[exampleIndices[i].second].file.fileName();
-        projectAndWrite(t.data(), predicted[exampleIndices[i].second],filePath);
+        filePath = "landmarking_examples_predicted/"+predicted[matchedPredicted[image]].file.fileName();
+        examples.append(LandmarkExample(t.data(), predicted[matchedPredicted[image]], filePath));
         lines.append("EXP,"+filePath+","+QString::number(exampleIndices[i].first));
     }
 
     for (int i=exampleIndices.size()-1; i>exampleIndices.size()-totalExamples-1; i--) {
-        QString filePath = "landmarking_examples_truth/"+truth[exampleIndices[i].second].file.fileName();
-        projectAndWrite(t.data(), truth[exampleIndices[i].second],filePath);
+        const int image = exampleIndices[i].second;
+        QString filePath = "landmarking_examples_truth/"+truth[matchedTruth[image]].file.fileName();
+        examples.append(LandmarkExample(t.data(), truth[matchedTruth[image]], filePath));
         lines.append("EXT,"+filePath+","+QString::number(exampleIndices[i].first));
 
-        filePath = "landmarking_examples_predicted/"+predicted[exampleIndices[i].second].file.fileName();
-        projectAndWrite(t.data(), predicted[exampleIndices[i].second],filePath);
+        filePath = "landmarking_examples_predicted/"+predicted[matchedPredicted[image]].file.fileName();
+        examples.append(LandmarkExample(t.data(), predicted[matchedPredicted[image]], filePath));
         lines.append("EXP,"+filePath+","+QString::number(exampleIndices[i].first));
     }
 
+    QFuture<void> rendering = QtConcurrent::map(examples, projectAndWrite);
+
     for (int i=0; i<pointErrors.size(); i++) {
         std::sort(pointErrors[i].begin(), pointErrors[i].end());
         averagePointErrors.append(Common::Mean(pointErrors[i]));
@@ -1236,9 +1857,10 @@ float EvalLandmarking(const QString &predictedGallery, const QString &truthGalle
     const float averagePointError = Common::Mean(averagePointErrors);
 
     lines.append(QString("AvgError,0,%1").arg(averagePointError));
-    lines.append(QString("NormLength,0,%1").arg(Common::Mean(normalizedLengths)));
+    lines.append(QString("NormLength,0,%1").arg(Common::Mean(landmarks.normalizedLengths.toList())));
 
     QtUtils::writeFile(csv, lines);
+    rendering.waitForFinished();
 
     qDebug("Average Error for all Points: %.3f", averagePointError);
 
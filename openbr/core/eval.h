@@ -19,6 +19,7 @@
 
 #include <QList>
 #include <QString>
+#include <QVector>
 #include "openbr/openbr_plugin.h"
 
 namespace br
@@ -26,6 +27,10 @@ namespace br
     float Evaluate(const QString &simmat, const QString &mask = "", const File &csv = "", unsigned int matches = 0); // Returns TAR @ FAR = 0.001
     float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &query, const File &csv = "", int parition = 0);
     float Evaluate(const cv::Mat &scores, const cv::Mat &masks, const File &csv = "", const QString &target = "", const QString &query = "", unsigned int matches = 0);
+    float EvaluateStreaming(const QString &simmat, const QString &mask = "", const File &csv = "", unsigned int matches = 0); // Bounded memory evaluation of .mtx matrices
+    float EvaluateHistograms(const QVector<qint64> &genuineHistogram, const QVector<qint64> &impostorHistogram, float minScore, double binWidth,
+                             const QList<float> &genuineSearches, const QList<float> &impostorSearches, const QVector<int> &firstGenuineReturns,
+                             int gallerySize, int probeSize, const File &csv = "", const QString &target = ""); // Bin i holds scores from minScore + i*binWidth
     void assertEval(const QString &simmat, const QString &mask, float accuracy); // Check to see if -eval achieves a given TAR @ FAR = 0.001
     float InplaceEval(const QString & simmat, const QString & target, const QString & query, const QString & csv = "");
 
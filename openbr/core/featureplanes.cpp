@@ -0,0 +1,109 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QCache>
+#include <QHash>
+#include <QMutex>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "featureplanes.h"
+
+namespace
+{
+
+struct Level
+{
+    cv::Mat source, level; // Holding the source keeps its address from being reused while the level is cached
+    QHash<QString, cv::Mat> planes;
+};
+
+static const int CacheCost = 256 << 20; // Bytes of pyramid levels
+static const int PlaneCost = 8; // Cost of a level's planes relative to the level itself
+
+QMutex mutex;
+QCache<QByteArray, Level> levels(CacheCost);
+QHash<const uchar*, QByteArray> levelKeys; // Address of each cached level
+
+QByteArray key(const cv::Mat &image, const cv::Size &size)
+{
+    QByteArray key;
+    const quintptr address = quintptr(image.data);
+    const int values[] = { image.rows, image.cols, image.type(), int(image.step), size.width, size.height };
+    key.append((const char*)&address, sizeof(address));
+    key.append((const char*)values, sizeof(values));
+    return key;
+}
+
+// Caller holds the mutex
+Level *find(const cv::Mat &level)
+{
+    if (!levelKeys.contains(level.data)) return NULL;
+    Level *cached = levels.object(levelKeys[level.data]);
+    if (!cached || (cached->level.data != level.data) || (cached->level.size() != level.size())) return NULL;
+    return cached;
+}
+
+} // namespace
+
+cv::Mat FeaturePlanes::level(const cv::Mat &image, const cv::Size &size)
+{
+    const QByteArray levelKey = key(image, size);
+    {
+        QMutexLocker locker(&mutex);
+        if (Level *cached = levels.object(levelKey))
+            return cached->level;
+    }
+
+    // Concurrent misses compute the level twice rather than serializing all resizes
+    cv::Mat resized;
+    if (size == image.size()) resized = image;
+    else                      cv::resize(image, resized, size, 0, 0, CV_INTER_LINEAR);
+
+    const qint64 cost = qint64(resized.total()) * resized.elemSize() * (1 + PlaneCost);
+    if (cost < CacheCost) {
+        Level *cached = new Level();
+        cached->source = image;
+        cached->level = resized;
+        QMutexLocker locker(&mutex);
+        levels.insert(levelKey, cached, int(cost));
+        levelKeys.insert(resized.data, levelKey);
+
+        // Forget the addresses of evicted levels
+        if (levelKeys.size() > 4*levels.count() + 64) {
+            QHash<const uchar*, QByteArray>::iterator i = levelKeys.begin();
+            while (i != levelKeys.end()) {
+                if (levels.contains(i.value())) ++i;
+                else                            i = levelKeys.erase(i);
+            }
+        }
+    }
+    return resized;
+}
+
+cv::Mat FeaturePlanes::plane(const cv::Mat &level, const QString &name)
+{
+    QMutexLocker locker(&mutex);
+    Level *cached = find(level);
+    return cached ? cached->planes.value(name) : cv::Mat();
+}
+
+void FeaturePlanes::setPlane(const cv::Mat &level, const QString &name, const cv::Mat &plane)
+{
+    QMutexLocker locker(&mutex);
+    if (Level *cached = find(level))
+        cached->planes.insert(name, plane);
+}
@@ -0,0 +1,37 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#ifndef BR_FEATUREPLANES_H
+#define BR_FEATUREPLANES_H
+
+#include <QString>
+#include <opencv2/core/core.hpp>
+#include <openbr/openbr_plugin.h>
+
+namespace FeaturePlanes
+{
+    // Image resized to size, shared by every detector that scans the same image at the same pyramid level.
+    // The result must not be modified.
+    BR_EXPORT cv::Mat level(const cv::Mat &image, const cv::Size &size);
+
+    // Feature plane of a pyramid level by name, e.g. "Integral", or an empty matrix if it has not been computed.
+    // Planes are only retained for images returned by level(), and must not be modified.
+    BR_EXPORT cv::Mat plane(const cv::Mat &level, const QString &name);
+    BR_EXPORT void setPlane(const cv::Mat &level, const QString &name, const cv::Mat &plane);
+}
+
+#endif // BR_FEATUREPLANES_H
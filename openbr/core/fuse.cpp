@@ -14,7 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFile>
 #include <QList>
+#include <QSharedPointer>
 #include <QStringList>
 #include "openbr/core/opencvutils.h"
 #include <limits>
@@ -25,143 +27,209 @@
 #include "openbr/core/bee.h"
 #include "openbr/core/common.h"
 #include "openbr/core/fuse.h"
+#include "openbr/core/qtutils.h"
 
 using namespace cv;
 
-static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
+enum NormalizationMethod { NoNormalization, MinMaxNormalization, ZScoreNormalization };
+enum FusionMethod { MaxFusion, MinFusion, SumFusion, ReplaceFusion, DifferenceFusion, NoFusion };
+
+// Score statistics over the cared-for comparisons of one matrix and partition
+struct Normalization
 {
-    if (matrix.rows != mask.rows && matrix.cols != mask.cols)
-        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", matrix.rows, matrix.cols, mask.rows, mask.cols);
-
-    if (method == "None") return;
-
-    QList<float> vals; vals.reserve(matrix.rows*matrix.cols);
-    for (int i=0; i<matrix.rows; i++) {
-        for (int j=0; j<matrix.cols; j++) {
-            float val = matrix.at<float>(i,j);
-            if ((mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) ||
-                (val == -std::numeric_limits<float>::max()) ||
-                (val ==  std::numeric_limits<float>::max()))
-                continue;
-            vals.append(val);
-        }
+    float min, max;
+    double mean, squaredDeviations, stddev; // Welford's running mean and sum of squared deviations from it
+    qint64 count;
+
+    Normalization() : min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()), mean(0), squaredDeviations(0), stddev(0), count(0) {}
+
+    void accumulate(float val)
+    {
+        if ((val == -std::numeric_limits<float>::max()) ||
+            (val ==  std::numeric_limits<float>::max()))
+            return;
+        min = std::min(min, val);
+        max = std::max(max, val);
+        count++;
+        const double delta = val - mean;
+        mean += delta / count;
+        squaredDeviations += delta * (val - mean);
     }
 
-    float min, max;
-    double mean, stddev;
-    Common::MinMax(vals, &min, &max);
-    Common::MeanStdDev(vals, &mean, &stddev);
-
-    if (method == "MinMax") {
-        for (int i=0; i<matrix.rows; i++) {
-            for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) continue;
-                float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::max()) val = 0;
-                else if (val ==  std::numeric_limits<float>::max()) val = 1;
-                else                                                     val = (val - min) / (max - min);
-            }
-        }
-    } else if (method == "ZScore") {
-        if (stddev == 0) qFatal("Stddev is 0.");
-        for (int i=0; i<matrix.rows; i++) {
-            for (int j=0; j<matrix.cols; j++) {
-                if (mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) continue;
-                float &val = matrix.at<float>(i,j);
-                if      (val == -std::numeric_limits<float>::max()) val = (min - mean) / stddev;
-                else if (val ==  std::numeric_limits<float>::max()) val = (max - mean) / stddev;
-                else                                                val = (val - mean) / stddev;
-            }
+    void finalize(NormalizationMethod method)
+    {
+        if (count > 0)
+            stddev = sqrt(squaredDeviations / count);
+        if ((method == ZScoreNormalization) && (stddev == 0)) qFatal("Stddev is 0.");
+    }
+
+    inline float apply(float val, NormalizationMethod method) const
+    {
+        if (method == MinMaxNormalization) {
+            if      (val == -std::numeric_limits<float>::max()) return 0;
+            else if (val ==  std::numeric_limits<float>::max()) return 1;
+            else                                                return (val - min) / (max - min);
+        } else if (method == ZScoreNormalization) {
+            if      (val == -std::numeric_limits<float>::max()) return (min - mean) / stddev;
+            else if (val ==  std::numeric_limits<float>::max()) return (max - mean) / stddev;
+            else                                                return (val - mean) / stddev;
         }
-    } else {
-        qFatal("Invalid normalization method %s.", qPrintable(method));
+        return val;
+    }
+};
+
+// Combines the normalized scores of one comparison
+static inline float fuseScores(const QVector<float> &scores, FusionMethod fusion, const QList<float> &weights)
+{
+    float fused = scores[0];
+    switch (fusion) {
+      case MaxFusion:
+        for (int i=1; i<scores.size(); i++)
+            fused = std::max(fused, scores[i]);
+        break;
+      case MinFusion:
+        for (int i=1; i<scores.size(); i++)
+            fused = std::min(fused, scores[i]);
+        break;
+      case SumFusion:
+        fused = 0;
+        for (int i=0; i<scores.size(); i++)
+            fused += weights[i] * scores[i];
+        break;
+      case ReplaceFusion:
+        fused = scores[1];
+        break;
+      case DifferenceFusion:
+        fused = scores[0] - scores[1];
+        break;
+      case NoFusion:
+        break;
     }
+    return fused;
 }
 
 void br::Fuse(const QStringList &inputSimmats, const QString &normalization, const QString &fusion, const QString &outputSimmat)
 {
     qDebug("Fusing %d to %s", inputSimmats.size(), qPrintable(outputSimmat));
 
-    QString target, query, previousTarget, previousQuery;
-    QList<Mat> originalMatrices;
+    // Matrices are read a block of rows at a time, so memory is bounded regardless of their size
+    QList< QSharedPointer<BEE::MatrixStream> > streams;
     foreach (const QString &simmat, inputSimmats) {
-        originalMatrices.append(BEE::readMatrix(simmat,&target,&query));
+        streams.append(QSharedPointer<BEE::MatrixStream>(new BEE::MatrixStream(simmat)));
         // Make we're fusing score matrices for the same set of targets and querys
-        if (!previousTarget.isEmpty() && !previousQuery.isEmpty() && (previousTarget != target || previousQuery != query))
+        const BEE::MatrixStream &first = *streams.first(), &current = *streams.last();
+        if ((first.target != current.target) || (first.query != current.query))
             qFatal("Target or query files are not the same across fused matrices.");
-        previousTarget = target; previousQuery = query;
+        if (current.isMask || (first.rows != current.rows) || (first.cols != current.cols))
+            qFatal("Fused matrices must be similarity matrices of the same size.");
     }
 
-    if ((originalMatrices.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
-    if ((originalMatrices.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
+    if ((streams.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
+    if ((streams.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
+
+    FusionMethod fusionMethod = NoFusion;
+    if      (fusion == "Max")          fusionMethod = MaxFusion;
+    else if (fusion == "Min")          fusionMethod = MinFusion;
+    else if (fusion.startsWith("Sum")) fusionMethod = SumFusion;
+    else if (fusion == "Replace")      fusionMethod = ReplaceFusion;
+    else if (fusion == "Difference")   fusionMethod = DifferenceFusion;
+    else if (fusion == "None")         fusionMethod = NoFusion;
+    else                               qFatal("Invalid fusion method %s.", qPrintable(fusion));
+    if ((fusionMethod == ReplaceFusion) && (streams.size() != 2)) qFatal("Replace fusion requires exactly two matrices.");
+    if ((fusionMethod == DifferenceFusion) && (streams.size() != 2)) qFatal("Difference fusion requires exactly two matrices.");
+
+    NormalizationMethod normalizationMethod = NoNormalization;
+    if      (normalization == "None")   normalizationMethod = NoNormalization;
+    else if (normalization == "MinMax") normalizationMethod = MinMaxNormalization;
+    else if (normalization == "ZScore") normalizationMethod = ZScoreNormalization;
+    else                                qFatal("Invalid normalization method %s.", qPrintable(normalization));
+
+    QList<float> weights;
+    if (fusionMethod == SumFusion) {
+        QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
+        if (words.size() == 0) {
+            for (int k=0; k<streams.size(); k++)
+                weights.append(1);
+        } else if (words.size() == streams.size()) {
+            bool ok;
+            for (int k=0; k<streams.size(); k++) {
+                float weight = words[k].toFloat(&ok);
+                if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
+                weights.append(weight);
+            }
+        } else {
+            qFatal("Number of weights does not match number of similarity matrices.");
+        }
+    }
 
+    const QString target = streams.first()->target, query = streams.first()->query;
+    const int rows = streams.first()->rows, cols = streams.first()->cols;
     const FileList targetFiles = TemplateList::fromGallery(target).files();
     const FileList queryFiles = TemplateList::fromGallery(query).files();
 
+    QList<BEE::ImplicitMask> masks;
     int partition = 0;
-    int crossValidate = Globals->crossValidate;
-    Mat buffer = Mat::zeros(originalMatrices.last().size(),originalMatrices.last().type());
-
     do {
-        QList<Mat> matrices;
-        foreach (const Mat& matrix, originalMatrices)
-            matrices.append(matrix.clone());
-
-        Mat matrix_mask = BEE::makeMask(targetFiles,queryFiles,partition);
-        for (int i=0; i<matrices.size(); i++)
-            normalizeMatrix(matrices[i], matrix_mask, normalization);
-
-        Mat fused;
-        if (fusion == "Max") {
-            max(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                max(fused, matrices[i], fused);
-        } else if (fusion == "Min") {
-            min(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                min(fused, matrices[i], fused);
-        } else if (fusion.startsWith("Sum")) {
-            QList<float> weights;
-            QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
-            if (words.size() == 0) {
-                for (int k=0; k<matrices.size(); k++)
-                    weights.append(1);
-            } else if (words.size() == matrices.size()) {
-                bool ok;
-                for (int k=0; k<matrices.size(); k++) {
-                    float weight = words[k].toFloat(&ok);
-                    if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
-                    weights.append(weight);
-                }
-            } else {
-                qFatal("Number of weights does not match number of similarity matrices.");
+        masks.append(BEE::ImplicitMask(targetFiles, queryFiles, partition));
+        if ((rows != masks.last().rows()) || (cols != masks.last().cols()))
+            qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", rows, cols, masks.last().rows(), masks.last().cols());
+        partition++;
+    } while (partition < Globals->crossValidate);
+
+    // Roughly 64 MB of scores per block across all matrices
+    const int blockRows = std::max(1, int((64 << 20) / std::max(streams.size() * streams.first()->rowSize(), qint64(1))));
+
+    // First pass computes the normalization parameters of each matrix and partition
+    QVector< QVector<Normalization> > normalizations(masks.size(), QVector<Normalization>(streams.size()));
+    if (normalizationMethod != NoNormalization) {
+        for (int row=0; row<rows; row+=blockRows) {
+            const int n = std::min(blockRows, rows - row);
+            for (int k=0; k<streams.size(); k++) {
+                const Mat block = streams[k]->read(n);
+                for (int p=0; p<masks.size(); p++)
+                    for (int i=0; i<n; i++) {
+                        const float *scores = block.ptr<float>(i);
+                        for (int j=0; j<cols; j++)
+                            if (masks[p].at(row+i, j) != BEE::DontCare)
+                                normalizations[p][k].accumulate(scores[j]);
+                    }
             }
-
-            addWeighted(matrices[0], weights[0], matrices[1], weights[1], 0, fused);
-            for (int i=2; i<matrices.size(); i++)
-                addWeighted(fused, 1, matrices[i], weights[i], 0, fused);
-        } else if (fusion == "Replace") {
-            if (matrices.size() != 2) qFatal("Replace fusion requires exactly two matrices.");
-            fused = matrices.first().clone();
-            matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
-        } else if (fusion == "Difference") {
-            if (matrices.size() != 2) qFatal("Difference fusion requires exactly two matrices.");
-            subtract(matrices[0], matrices[1], fused);
-        } else if (fusion == "None") {
-            fused = matrices[0];
-        } else {
-            qFatal("Invalid fusion method %s.", qPrintable(fusion));
         }
+        for (int p=0; p<masks.size(); p++)
+            for (int k=0; k<streams.size(); k++)
+                normalizations[p][k].finalize(normalizationMethod);
+        for (int k=0; k<streams.size(); k++)
+            streams[k]->rewind();
+    }
 
-        // We don't want to add scores where the mask says we shouldn't care
-        Mat buffer_mask = Mat::ones(matrix_mask.size(),CV_8UC1);
-        buffer_mask.setTo(0,matrix_mask==BEE::DontCare);
-
-        add(buffer,fused,buffer,buffer_mask);
-
-        partition++;
-
-    } while (partition < crossValidate);
+    QFile file(outputSimmat);
+    QtUtils::touchDir(file);
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Unable to open %s for writing.", qPrintable(outputSimmat));
+    // The header names the inputs' sigsets, where fused matrices used to be written with Unknown_Target and Unknown_Query
+    file.write(BEE::matrixHeader(rows, cols, false, target, query));
+
+    // Second pass normalizes, fuses and writes each block, scores are only added where the mask says we care
+    QVector<float> scores(streams.size());
+    for (int row=0; row<rows; row+=blockRows) {
+        const int n = std::min(blockRows, rows - row);
+        QList<Mat> blocks;
+        for (int k=0; k<streams.size(); k++)
+            blocks.append(streams[k]->read(n));
+
+        Mat buffer = Mat::zeros(n, cols, CV_32FC1);
+        for (int p=0; p<masks.size(); p++)
+            for (int i=0; i<n; i++) {
+                float *fused = buffer.ptr<float>(i);
+                for (int j=0; j<cols; j++) {
+                    if (masks[p].at(row+i, j) == BEE::DontCare) continue;
+                    for (int k=0; k<blocks.size(); k++)
+                        scores[k] = normalizations[p][k].apply(blocks[k].at<float>(i,j), normalizationMethod);
+                    fused[j] += fuseScores(scores, fusionMethod, weights);
+                }
+            }
 
-    BEE::writeMatrix(buffer, outputSimmat);
+        file.write((const char*)buffer.data, qint64(n) * cols * sizeof(float));
+    }
+    file.close();
 }
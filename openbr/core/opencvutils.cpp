@@ -18,6 +18,7 @@
 #include <opencv2/highgui/highgui_c.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/imgproc/imgproc_c.h>
+#include <opencv2/objdetect/objdetect.hpp>
 #include <openbr/openbr_plugin.h>
 
 #include "opencvutils.h"
@@ -383,7 +384,6 @@ bool OpenCVUtils::overlaps(const QList<Rect> &posRects, const Rect &negRect, dou
 }
 
 // class for grouping object candidates, detected by Cascade Classifier, HOG etc.
-// instance of the class is to be passed to cv::partition (see cxoperations.hpp)
 class SimilarRects
 {
 public:
@@ -399,6 +399,139 @@ public:
     double eps;
 };
 
+// Uniform spatial hash over rectangles.
+// Each rectangle is filed under every cell it covers, so the rectangles touching a region are found
+// by visiting the cells under it rather than by comparing against every rectangle.
+class RectGrid
+{
+public:
+    RectGrid(int n, int cellSize) : cellSize(std::max(cellSize, 1)), stamps(n, -1), query(0) {}
+
+    void insert(int id, const Rect &region)
+    {
+        int x0, y0, x1, y1;
+        span(region, x0, y0, x1, y1);
+        for (int y=y0; y<=y1; y++)
+            for (int x=x0; x<=x1; x++)
+                cells[key(x, y)].push_back(id);
+    }
+
+    // Ids of the rectangles sharing at least one cell with region, each reported once
+    void candidates(const Rect &region, vector<int> &ids)
+    {
+        ids.clear();
+        query++;
+        int x0, y0, x1, y1;
+        span(region, x0, y0, x1, y1);
+        if (qint64(x1 - x0 + 1) * (y1 - y0 + 1) <= cells.size()) {
+            for (int y=y0; y<=y1; y++)
+                for (int x=x0; x<=x1; x++) {
+                    QHash<quint64, vector<int> >::const_iterator it = cells.find(key(x, y));
+                    if (it != cells.end())
+                        collect(*it, ids);
+                }
+        } else {
+            // A region wider than the occupied part of the grid, visit the occupied cells instead
+            for (QHash<quint64, vector<int> >::const_iterator it = cells.begin(); it != cells.end(); ++it) {
+                const int x = int(qint32(it.key() >> 32)), y = int(qint32(it.key()));
+                if ((x >= x0) && (x <= x1) && (y >= y0) && (y <= y1))
+                    collect(*it, ids);
+            }
+        }
+    }
+
+private:
+    const int cellSize;
+    QHash<quint64, vector<int> > cells;
+    vector<int> stamps; // Query that last reported each id
+    int query;
+
+    static quint64 key(int x, int y)
+    {
+        return (quint64(quint32(x)) << 32) | quint64(quint32(y));
+    }
+
+    void span(const Rect &region, int &x0, int &y0, int &x1, int &y1) const
+    {
+        x0 = cvFloor(float(region.x) / cellSize);
+        y0 = cvFloor(float(region.y) / cellSize);
+        x1 = cvFloor(float(region.x + std::max(region.width, 1) - 1) / cellSize);
+        y1 = cvFloor(float(region.y + std::max(region.height, 1) - 1) / cellSize);
+    }
+
+    void collect(const vector<int> &cell, vector<int> &ids)
+    {
+        for (size_t i=0; i<cell.size(); i++)
+            if (stamps[cell[i]] != query) {
+                stamps[cell[i]] = query;
+                ids.push_back(cell[i]);
+            }
+    }
+};
+
+static int averageSize(const vector<Rect> &rects)
+{
+    double total = 0;
+    for (size_t i=0; i<rects.size(); i++)
+        total += (rects[i].width + rects[i].height) / 2.0;
+    return rects.empty() ? 1 : cvRound(total / rects.size());
+}
+
+static int findRoot(vector<int> &parents, int i)
+{
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+// Number the sets in order of their first member, as cv::partition does
+static int labelSets(vector<int> &parents, vector<int> &labels)
+{
+    const int n = parents.size();
+    vector<int> setLabels(n, -1);
+    labels.resize(n);
+    int sets = 0;
+    for (int i=0; i<n; i++) {
+        const int root = findRoot(parents, i);
+        if (setLabels[root] < 0)
+            setLabels[root] = sets++;
+        labels[i] = setLabels[root];
+    }
+    return sets;
+}
+
+// Equivalent to cv::partition(rects, labels, SimilarRects(epsilon)).
+// Similar rectangles have top-left corners closer than delta, which is bounded by each rectangle's own size,
+// so only the rectangles with a corner in the cells around it are candidates.
+static int partitionSimilar(const vector<Rect> &rects, float epsilon, vector<int> &labels)
+{
+    const int n = rects.size();
+    const SimilarRects similar(epsilon);
+    RectGrid grid(n, cvRound(epsilon * 2 * averageSize(rects)));
+    for (int i=0; i<n; i++)
+        grid.insert(i, Rect(rects[i].x, rects[i].y, 1, 1));
+
+    vector<int> parents(n), ids;
+    for (int i=0; i<n; i++)
+        parents[i] = i;
+
+    for (int i=0; i<n; i++) {
+        const int radius = cvCeil(epsilon * (rects[i].width + rects[i].height) * 0.5);
+        grid.candidates(Rect(rects[i].x - radius, rects[i].y - radius, 2*radius + 1, 2*radius + 1), ids);
+        for (size_t k=0; k<ids.size(); k++) {
+            const int j = ids[k];
+            if ((j > i) && similar(rects[i], rects[j])) {
+                const int a = findRoot(parents, i), b = findRoot(parents, j);
+                if (a != b) parents[std::max(a, b)] = std::min(a, b);
+            }
+        }
+    }
+
+    return labelSets(parents, labels);
+}
+
 // TODO: Make sure case where no confidences are inputted works.
 void OpenCVUtils::group(vector<Rect> &rects, vector<float> &confidences, float confidenceThreshold, float epsilon)
 {
@@ -408,7 +541,7 @@ void OpenCVUtils::group(vector<Rect> &rects, vector<float> &confidences, float c
     const bool useConfidences = !confidences.empty();
 
     vector<int> labels;
-    int nClasses = cv::partition(rects, labels, SimilarRects(epsilon));
+    int nClasses = partitionSimilar(rects, epsilon, labels);
 
     // Rect for each class (class meaning identity assigned by partition)
     vector<Rect> rrects(nClasses);
@@ -452,7 +585,20 @@ void OpenCVUtils::group(vector<Rect> &rects, vector<float> &confidences, float c
     rects.clear();
     confidences.clear();
 
+    // Index the classes that could eliminate another by the region, grown by epsilon, that they eliminate within
+    RectGrid grid(nClasses, averageSize(rrects));
+    for (int j = 0; j < nClasses; j++)
+    {
+        if (rejectWeights[j] <= confidenceThreshold)
+            continue;
+        const Rect r2 = rrects[j];
+        const int dx = saturate_cast<int>(r2.width * epsilon);
+        const int dy = saturate_cast<int>(r2.height * epsilon);
+        grid.insert(j, Rect(r2.x - dx, r2.y - dy, r2.width + 2*dx, r2.height + 2*dy));
+    }
+
     // Aggregate by comparing average rectangles against other average rectangels
+    vector<int> ids;
     for (int i = 0; i < nClasses; i++)
     {
         // Average rectangle
@@ -466,10 +612,13 @@ void OpenCVUtils::group(vector<Rect> &rects, vector<float> &confidences, float c
         if (w1 <= confidenceThreshold)
             continue;
 
-        // filter out small face rectangles inside large rectangles
-        int j;
-        for (j = 0; j < nClasses; j++)
+        // filter out small face rectangles inside large rectangles,
+        // any rectangle containing r1 also contains its top-left corner
+        grid.candidates(Rect(r1.x, r1.y, 1, 1), ids);
+        size_t k;
+        for (k = 0; k < ids.size(); k++)
         {
+            const int j = ids[k];
             float w2 = rejectWeights[j];
 
             if (j == i)
@@ -496,7 +645,7 @@ void OpenCVUtils::group(vector<Rect> &rects, vector<float> &confidences, float c
         }
 
         // Need to return rects and confidences
-        if( j == nClasses )
+        if( k == ids.size() )
         {
             rects.push_back(r1);
             if (useConfidences)
@@ -505,6 +654,124 @@ void OpenCVUtils::group(vector<Rect> &rects, vector<float> &confidences, float c
     }
 }
 
+int OpenCVUtils::partitionOverlapping(const vector<Rect> &rects, float overlap, vector<int> &labels)
+{
+    const int n = rects.size();
+    RectGrid grid(n, averageSize(rects));
+    for (int i=0; i<n; i++)
+        grid.insert(i, rects[i]);
+
+    vector<int> parents(n), ids;
+    for (int i=0; i<n; i++)
+        parents[i] = i;
+
+    for (int i=0; i<n; i++) {
+        grid.candidates(rects[i], ids);
+        for (size_t k=0; k<ids.size(); k++) {
+            const int j = ids[k];
+            if ((j <= i) || (float((rects[i] & rects[j]).area()) / max(rects[i].area(), rects[j].area()) <= overlap))
+                continue;
+            const int a = findRoot(parents, i), b = findRoot(parents, j);
+            if (a != b) parents[std::max(a, b)] = std::min(a, b);
+        }
+    }
+
+    return labelSets(parents, labels);
+}
+
+static bool higherConfidence(const pair<float,int> &a, const pair<float,int> &b)
+{
+    return (a.first > b.first) || ((a.first == b.first) && (a.second < b.second));
+}
+
+void OpenCVUtils::suppress(vector<Rect> &rects, vector<float> &confidences, float overlap)
+{
+    const int n = rects.size();
+    if (n == 0)
+        return;
+
+    vector< pair<float,int> > order(n);
+    for (int i=0; i<n; i++)
+        order[i] = pair<float,int>(confidences.empty() ? 0 : confidences[i], i);
+    std::sort(order.begin(), order.end(), higherConfidence);
+
+    RectGrid grid(n, averageSize(rects));
+    for (int i=0; i<n; i++)
+        grid.insert(i, rects[i]);
+
+    // Visit detections from the most confident, each kept detection suppresses every remaining one it overlaps
+    vector<bool> suppressed(n, false);
+    vector<Rect> keptRects;
+    vector<float> keptConfidences;
+    vector<int> ids;
+    for (int k=0; k<n; k++) {
+        const int i = order[k].second;
+        if (suppressed[i])
+            continue;
+        suppressed[i] = true;
+        keptRects.push_back(rects[i]);
+        if (!confidences.empty())
+            keptConfidences.push_back(confidences[i]);
+
+        grid.candidates(rects[i], ids);
+        for (size_t c=0; c<ids.size(); c++) {
+            const int j = ids[c];
+            if (suppressed[j])
+                continue;
+            const float intersection = (rects[i] & rects[j]).area();
+            if (intersection / (rects[i].area() + rects[j].area() - intersection) > overlap)
+                suppressed[j] = true;
+        }
+    }
+
+    rects = keptRects;
+    confidences = keptConfidences;
+}
+
+// Detection writes to the feature evaluator, or to the whole cascade in the old format,
+// the stages it reads are copied by value.
+class DetachedCascadeClassifier : public CascadeClassifier
+{
+public:
+    explicit DetachedCascadeClassifier(const CascadeClassifier &cascade)
+        : CascadeClassifier(cascade)
+    {
+        if (isOldFormatCascade())
+            oldCascade = Ptr<CvHaarClassifierCascade>((CvHaarClassifierCascade*) cvClone(oldCascade));
+        else if (!featureEvaluator.empty())
+            featureEvaluator = featureEvaluator->clone();
+    }
+};
+
+void OpenCVUtils::copyCascade(const CascadeClassifier &src, CascadeClassifier &dst)
+{
+    dst = DetachedCascadeClassifier(src);
+}
+
+OpenCVUtils::RegionHistograms::RegionHistograms(const Size &image, const Size &region, const Size &step, int bins)
+    : region(region), step(step), bins(bins)
+{
+    columns = image.width >= region.width ? (image.width - region.width) / step.width + 1 : 0;
+    rows = image.height >= region.height ? (image.height - region.height) / step.height + 1 : 0;
+    for (int i=0; i<columns*rows; i++)
+        hists.append(Mat::zeros(1, bins, CV_32FC1));
+}
+
+void OpenCVUtils::RegionHistograms::accumulate(int row, const int *codes)
+{
+    // Only the regions spanning this row, which are ordered by column and then by row
+    const int first = row < region.height ? 0 : (row - region.height) / step.height + 1;
+    const int last = std::min(rows - 1, row / step.height);
+    for (int y=first; y<=last; y++)
+        for (int x=0; x<columns; x++) {
+            float *hist = hists[x*rows + y].ptr<float>();
+            const int *code = codes + x*step.width;
+            for (int i=0; i<region.width; i++)
+                if (unsigned(code[i]) < unsigned(bins))
+                    hist[code[i]]++;
+        }
+}
+
 QDataStream &operator<<(QDataStream &stream, const Mat &m)
 {
     // Write header
@@ -515,6 +782,14 @@ QDataStream &operator<<(QDataStream &stream, const Mat &m)
 
     // Write data
     int len = rows * cols * m.elemSize();
+    QtUtils::MappedModel *mapped = dynamic_cast<QtUtils::MappedModel*>(stream.device());
+    if (mapped && (len > 0)) {
+        // The data goes to the mapped section, a length of -1 marks the offset that follows
+        if (!m.isContinuous()) qFatal("Can't serialize non-continuous matrices.");
+        stream << int(-1) << mapped->append((const char*)m.data, len);
+        return stream;
+    }
+
     stream << len;
     if (len > 0) {
         if (!m.isContinuous()) qFatal("Can't serialize non-continuous matrices.");
@@ -529,10 +804,20 @@ QDataStream &operator>>(QDataStream &stream, Mat &m)
     // Read header
     int rows, cols, type;
     stream >> rows >> cols >> type;
-    m.create(rows, cols, type);
 
     int len;
     stream >> len;
+    if (len == -1) {
+        // A view onto the mapped section
+        QtUtils::MappedModel *mapped = dynamic_cast<QtUtils::MappedModel*>(stream.device());
+        if (!mapped) qFatal("Mat deserialization failure, mapped matrix outside of a mapped model.");
+        qint64 offset;
+        stream >> offset;
+        m = Mat(rows, cols, type, mapped->section(offset));
+        return stream;
+    }
+
+    m.create(rows, cols, type);
     char *data = (char*) m.data;
 
     // In certain circumstances, like reading from stdin or sockets, we may not
@@ -25,6 +25,8 @@
 #include <opencv2/ml/ml.hpp>
 #include <assert.h>
 
+namespace cv { class CascadeClassifier; }
+
 namespace OpenCVUtils
 {
     // Test/write/display image
@@ -100,8 +102,25 @@ namespace OpenCVUtils
 
     // Misc
     void group(std::vector<cv::Rect> &rects, std::vector<float> &confidences, float confidenceThreshold, float epsilon);
+    int partitionOverlapping(const std::vector<cv::Rect> &rects, float overlap, std::vector<int> &labels); // Connected components of rects whose intersection exceeds overlap of the larger area
+    void suppress(std::vector<cv::Rect> &rects, std::vector<float> &confidences, float overlap); // Non-maximum suppression by intersection over union
+    void copyCascade(const cv::CascadeClassifier &src, cv::CascadeClassifier &dst); // Without reparsing src, dst can detect concurrently with it
 
     int getFourcc();
+
+    // Histograms of integer codes over the regions RectRegions would extract, accumulated one image row at a time.
+    class RegionHistograms
+    {
+    public:
+        RegionHistograms(const cv::Size &image, const cv::Size &region, const cv::Size &step, int bins);
+        void accumulate(int row, const int *codes); // Codes outside [0, bins) are ignored, as Hist ignores them
+        const QList<cv::Mat> &histograms() const { return hists; } // In RectRegions order, each 1 x bins CV_32FC1
+
+    private:
+        cv::Size region, step;
+        int bins, columns, rows;
+        QList<cv::Mat> hists;
+    };
 }
 
 QDebug operator<<(QDebug dbg, const cv::Mat &m);
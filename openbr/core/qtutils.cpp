@@ -618,6 +618,94 @@ bool BlockCompression::isSequential() const
     return true;
 }
 
+static const char mappedModelMagic[8] = { 'B', 'R', 'M', 'O', 'D', 'E', 'L', '1' };
+
+MappedModel::MappedModel(const QString &fileName)
+    : file(fileName), streamData(NULL), mappedData(NULL), streamSize(0), streamPos(0) {}
+
+bool MappedModel::isMappedModel(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly))
+        return false;
+    return file.read(sizeof(mappedModelMagic)) == QByteArray(mappedModelMagic, sizeof(mappedModelMagic));
+}
+
+bool MappedModel::open(QIODevice::OpenMode mode)
+{
+    setOpenMode(mode);
+    if (mode & QIODevice::WriteOnly) {
+        stream.clear();
+        mapped.clear();
+        return file.open(QFile::WriteOnly);
+    }
+
+    if (!file.open(QFile::ReadOnly))
+        return false;
+
+    // Copy-on-write, so a transform that modifies its matrices doesn't touch the file or other processes
+    uchar *base = file.map(0, file.size(), QFile::MapPrivateOption);
+    if (!base || (file.size() < qint64(sizeof(mappedModelMagic) + sizeof(qint64))) || memcmp(base, mappedModelMagic, sizeof(mappedModelMagic)))
+        qFatal("%s is not a mapped model.", qPrintable(file.fileName()));
+
+    memcpy(&streamSize, base + sizeof(mappedModelMagic), sizeof(qint64));
+    streamData = base + sizeof(mappedModelMagic) + sizeof(qint64);
+    streamPos = 0;
+    const qint64 mappedOffset = (sizeof(mappedModelMagic) + sizeof(qint64) + streamSize + Alignment - 1) / Alignment * Alignment;
+    mappedData = base + mappedOffset;
+    return true;
+}
+
+void MappedModel::close()
+{
+    // Header, stream, then the mapped section aligned to Alignment from the start of the file
+    if ((openMode() & QIODevice::WriteOnly) && file.isOpen()) {
+        const qint64 size = stream.size();
+        file.write(mappedModelMagic, sizeof(mappedModelMagic));
+        file.write((const char*) &size, sizeof(qint64));
+        file.write(stream);
+        file.write(QByteArray(int(file.pos() % Alignment ? Alignment - file.pos() % Alignment : 0), 0));
+        file.write(mapped);
+        file.close();
+    }
+    // In read mode the file stays open until destruction, closing it would unmap the matrices
+    QIODevice::close();
+}
+
+bool MappedModel::isSequential() const
+{
+    return true;
+}
+
+qint64 MappedModel::append(const char *data, qint64 size)
+{
+    const qint64 offset = (mapped.size() + Alignment - 1) / Alignment * Alignment;
+    mapped.resize(int(offset + size));
+    memcpy(mapped.data() + offset, data, size);
+    return offset;
+}
+
+uchar *MappedModel::section(qint64 offset) const
+{
+    return mappedData + offset;
+}
+
+qint64 MappedModel::readData(char *data, qint64 size)
+{
+    size = qMin(size, streamSize - streamPos);
+    if (size <= 0)
+        return -1;
+    memcpy(data, streamData + streamPos, size);
+    streamPos += size;
+    return size;
+}
+
+qint64 MappedModel::writeData(const char *data, qint64 size)
+{
+    stream.append(data, int(size));
+    return size;
+}
+
 qint64 BlockCompression::writeData(const char *data, qint64 remaining)
 {
     const char * endPoint = data + remaining;
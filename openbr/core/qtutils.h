@@ -126,6 +126,37 @@ namespace QtUtils
         QDataStream blockWriter;
         qint64 writeData(const char *data, qint64 remaining);
     };
+
+    // An uncompressed model container whose matrices live 64-byte aligned in a section the reader maps,
+    // so processes loading the same model share its pages.
+    class MappedModel : public QIODevice
+    {
+    public:
+        static const int Alignment = 64;
+
+        MappedModel(const QString &fileName);
+        static bool isMappedModel(const QString &fileName);
+
+        bool open(QIODevice::OpenMode mode);
+        void close();
+        bool isSequential() const;
+
+        // Write mode, copies data into the mapped section and returns its offset
+        qint64 append(const char *data, qint64 size);
+
+        // Read mode, the mapped data at offset, valid until the device is destroyed
+        uchar *section(qint64 offset) const;
+
+        qint64 readData(char *data, qint64 size);
+        qint64 writeData(const char *data, qint64 size);
+
+    private:
+        QFile file;
+        QByteArray stream, mapped; // Write mode
+        const uchar *streamData; // Read mode
+        uchar *mappedData;
+        qint64 streamSize, streamPos;
+    };
 }
 
 #endif // QTUTILS_QTUTILS_H
@@ -17,6 +17,7 @@
 #ifndef BR_RESOURCE_H
 #define BR_RESOURCE_H
 
+#include <QElapsedTimer>
 #include <QHash>
 #include <QList>
 #include <QMutex>
@@ -24,6 +25,11 @@
 #include <QSharedPointer>
 #include <QString>
 #include <QThread>
+#include <typeinfo>
+#ifdef __GNUC__
+#include <cxxabi.h>
+#include <stdlib.h>
+#endif
 #include <openbr/openbr_plugin.h>
 
 namespace br
@@ -43,16 +49,113 @@ class DefaultResourceMaker : public ResourceMaker<T>
     T *make() const { return new T(); }
 };
 
+// Load an immutable model once per process and derive each resource from it.
+// Only the per-thread state is made for each resource, the model is shared by
+// every maker constructed with the same key and freed with the last of them.
+template <typename T, typename Model = T>
+class SharedResourceMaker : public ResourceMaker<T>
+{
+    const QString key;
+    mutable QSharedPointer<const Model> model;
+
+    static QMutex cacheLock;
+    static QHash< QString, QWeakPointer<const Model> > cache;
+
+public:
+    SharedResourceMaker(const QString &key) : key(key) {}
+
+    T *make() const
+    {
+        // Resource::acquire serializes calls to make
+        if (model.isNull()) {
+            QMutexLocker locker(&cacheLock);
+            model = cache.value(key).toStrongRef();
+            if (model.isNull()) {
+                model = QSharedPointer<const Model>(load());
+                cache.insert(key, model);
+            }
+        }
+        return instantiate(*model);
+    }
+
+protected:
+    virtual Model *load() const = 0;
+    virtual T *instantiate(const Model &model) const = 0;
+};
+
+template <typename T, typename Model>
+QMutex SharedResourceMaker<T, Model>::cacheLock;
+
+template <typename T, typename Model>
+QHash< QString, QWeakPointer<const Model> > SharedResourceMaker<T, Model>::cache;
+
+// How long threads wait for and hold the copies of a resource, published to Context::metrics()
+// labelled by resource type. Pools only grow when every copy is in use, so the copies made are
+// also the high-water mark of threads using the resource at once.
+struct ResourceStatistics
+{
+    static const int PublishInterval = 256; // Releases
+
+    QString name;
+    QElapsedTimer clock;
+    QHash<const void*, qint64> acquired; // Clock time each copy in use was acquired, in ns
+    qint64 made, acquires, waited, held; // Since last published, waited and held in ns
+    qint64 totalWaited, totalHeld;
+    bool warned;
+
+    ResourceStatistics(const QString &name)
+        : name(name), made(0), acquires(0), waited(0), held(0), totalWaited(0), totalHeld(0), warned(false)
+    {
+        clock.start();
+    }
+
+    // Called with the resource's lock held
+    void publish()
+    {
+        const QString label = "{resource=\"" + name + "\"}";
+        Context::addMetric("br_resource_made_total" + label, made);
+        Context::addMetric("br_resource_acquires_total" + label, acquires);
+        Context::addMetric("br_resource_wait_seconds_total" + label, waited / 1e9);
+        Context::addMetric("br_resource_hold_seconds_total" + label, held / 1e9);
+        totalWaited += waited;
+        totalHeld += held;
+        made = acquires = waited = held = 0;
+
+        if (!warned && (totalWaited > totalHeld) && (totalWaited > 1000000000)) {
+            qWarning("Threads waited %.3gs for %s resources while holding them for %.3gs, consider allowing more of them.",
+                     totalWaited / 1e9, qPrintable(name), totalHeld / 1e9);
+            warned = true;
+        }
+    }
+
+    static QString typeName(const char *mangled)
+    {
+#ifdef __GNUC__
+        int status = 0;
+        char *demangled = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+        if (demangled) {
+            const QString name = demangled;
+            free(demangled);
+            return name;
+        }
+#endif
+        return mangled;
+    }
+};
+
 // Manage multiple copies of a limited resource in a thread-safe manner.
 // TimeVaryingTransform makes a strong assumption that ResourceMaker::Make
 // is only called in acquire, not in the constructor.
+// Copies are made on demand, at most Globals->parallelism of them unless
+// setMaxResources says otherwise.
 template <typename T>
 class Resource
 {
     QSharedPointer< ResourceMaker<T> > resourceMaker;
     QSharedPointer< QList<T*> > availableResources;
     QSharedPointer<QMutex> lock;
-    QSharedPointer<QSemaphore> totalResources;
+    QSharedPointer<QSemaphore> totalResources; // NULL when unbounded
+    QSharedPointer<ResourceStatistics> statistics;
 
 public:
     Resource(ResourceMaker<T> *rm = new DefaultResourceMaker<T>())
@@ -60,22 +163,36 @@ public:
         , availableResources(new QList<T*>())
         , lock(new QMutex())
         , totalResources(new QSemaphore(br::Globals->parallelism))
+        , statistics(new ResourceStatistics(ResourceStatistics::typeName(typeid(T).name())))
     {}
 
     ~Resource()
     {
+        // Contexts publish to a registry that doesn't outlive them
+        if (br::Globals) {
+            lock->lock();
+            statistics->publish();
+            lock->unlock();
+        }
         qDeleteAll(*availableResources);
     }
 
     T *acquire() const
     {
-        totalResources->acquire();
+        const qint64 start = statistics->clock.nsecsElapsed();
+        if (totalResources) totalResources->acquire();
         lock->lock();
+        const qint64 acquired = statistics->clock.nsecsElapsed();
 
-        if (availableResources->isEmpty())
+        if (availableResources->isEmpty()) {
             availableResources->append(resourceMaker->make());
+            statistics->made++;
+        }
         T* resource = availableResources->takeFirst();
 
+        statistics->acquires++;
+        statistics->waited += acquired - start;
+        statistics->acquired.insert(resource, acquired);
         lock->unlock();
 
         return resource;
@@ -85,8 +202,11 @@ public:
     {
         lock->lock();
         availableResources->append(resource);
+        statistics->held += statistics->clock.nsecsElapsed() - statistics->acquired.take(resource);
+        if (statistics->acquires >= ResourceStatistics::PublishInterval)
+            statistics->publish();
         lock->unlock();
-        totalResources->release();
+        if (totalResources) totalResources->release();
     }
 
     void setResourceMaker(ResourceMaker<T> *maker)
@@ -94,9 +214,18 @@ public:
         resourceMaker = QSharedPointer< ResourceMaker<T> >(maker);
     }
 
+    // A non-positive max grows the pool to however many threads use it at once
     void setMaxResources(int max)
     {
-        totalResources = QSharedPointer<QSemaphore>(new QSemaphore(max));
+        totalResources = max > 0 ? QSharedPointer<QSemaphore>(new QSemaphore(max)) : QSharedPointer<QSemaphore>();
+    }
+
+    // Statistics are labelled with the resource type unless named otherwise
+    void setName(const QString &name)
+    {
+        QMutexLocker locker(lock.data());
+        statistics->publish();
+        statistics->name = name;
     }
 };
 
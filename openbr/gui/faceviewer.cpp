@@ -101,7 +101,7 @@ void FaceViewer::refreshImage()
 
 QRect FaceViewer::getImageRect(const QPointF &ip, const QSize &size) const
 {
-    if (!pixmap() || isNull()) return QRect();
+    if (isNull()) return QRect();
 
     QRect ir = QRect(ip.x() - size.width()/2.0,
                          ip.y() - size.height()/2.0, size.width(), size.height());
@@ -113,7 +113,7 @@ QRect FaceViewer::getImageRect(const QPointF &ip, const QSize &size) const
 
 QRectF FaceViewer::getScreenRect(const QPointF &sp, int width_, int height_) const
 {
-    if (!pixmap() || isNull()) return QRectF();
+    if (isNull()) return QRectF();
 
     QRectF sr = QRectF(sp.x() - width_/2.0, sp.y() - height_/2.0, width_, height_);
 
@@ -207,7 +207,7 @@ void FaceViewer::paintEvent(QPaintEvent *event)
         setCursor(QCursor(Qt::BlankCursor));
 
         QSize reticleSize = src.size() *.1;
-        QSize displaySize = pixmap()->size() *.3;
+        QSize displaySize = imageRect().size().toSize() *.3;
 
         QRect reticle = getImageRect(mousePoint, reticleSize);
         QImage reticleImage = src.copy(reticle).scaled(src.size()*2.0, Qt::KeepAspectRatio);
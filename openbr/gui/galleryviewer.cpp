@@ -8,12 +8,20 @@ GalleryViewer::GalleryViewer(QWidget *parent)
     : QMainWindow(parent)
 {
     addToolBar(Qt::TopToolBarArea, &gGallery);
-    setCentralWidget(&tvgTemplateViewerGrid);
+    vbCentral.addWidget(&tvgTemplateViewerGrid, 1);
+    vbCentral.addWidget(&pfPageFlip, 0, Qt::AlignHCenter);
+    vbCentral.setContentsMargins(0, 0, 0, 0);
+    wCentral.setLayout(&vbCentral);
+    setCentralWidget(&wCentral);
     setWindowFlags(Qt::Widget);
 
     connect(&tvgTemplateViewerGrid, SIGNAL(newInput(br::File)), &gGallery, SLOT(enroll(br::File)));
     connect(&tvgTemplateViewerGrid, SIGNAL(newInput(QImage)), &gGallery, SLOT(enroll(QImage)));
     connect(&tvgTemplateViewerGrid, SIGNAL(selectedInput(br::File)), &gGallery, SLOT(select(br::File)));
+    connect(&pfPageFlip, SIGNAL(first()), &tvgTemplateViewerGrid, SLOT(firstPage()));
+    connect(&pfPageFlip, SIGNAL(previous()), &tvgTemplateViewerGrid, SLOT(previousPage()));
+    connect(&pfPageFlip, SIGNAL(next()), &tvgTemplateViewerGrid, SLOT(nextPage()));
+    connect(&pfPageFlip, SIGNAL(last()), &tvgTemplateViewerGrid, SLOT(lastPage()));
 
     tmTemplateMetadata.addClassifier("GenderClassification", "MM0");
     tmTemplateMetadata.addClassifier("AgeRegression", "MM0");
@@ -39,6 +47,7 @@ void GalleryViewer::setFiles(FileList files)
     if (same) files = files.mid(0, 1);
 
     tvgTemplateViewerGrid.setFiles(files);
+    pfPageFlip.setVisible(tvgTemplateViewerGrid.pageCount() > 1);
     tmTemplateMetadata.setVisible(files.size() == 1);
     if (files.size() == 1)
         tmTemplateMetadata.setFile(files.first());
@@ -2,10 +2,12 @@
 #define BR_GALLERYVIEWER_H
 
 #include <QMainWindow>
+#include <QVBoxLayout>
 #include <QWidget>
 #include <openbr/openbr_plugin.h>
 
 #include "gallerytoolbar.h"
+#include "pageflipwidget.h"
 #include "templateviewergrid.h"
 #include "templatemetadata.h"
 
@@ -18,7 +20,10 @@ class BR_EXPORT GalleryViewer : public QMainWindow
 
 public:
     GalleryToolBar gGallery;
+    QWidget wCentral;
+    QVBoxLayout vbCentral;
     TemplateViewerGrid tvgTemplateViewerGrid;
+    PageFlipWidget pfPageFlip;
     TemplateMetadata tmTemplateMetadata;
 
     explicit GalleryViewer(QWidget *parent = 0);
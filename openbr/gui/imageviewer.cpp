@@ -16,16 +16,20 @@
 
 #include <QFileDialog>
 #include <QMutexLocker>
+#include <QPainter>
 #include <QSizePolicy>
 #include <QTimer>
 #include <QDebug>
+#include <math.h>
 
 #include "imageviewer.h"
 
 /*** PUBLIC ***/
 br::ImageViewer::ImageViewer(QWidget *parent)
     : QLabel(parent),
-    mutex(QMutex::Recursive)
+    mutex(QMutex::Recursive),
+    tiles(TileCacheSize),
+    zoom(1)
 {
     setAlignment(Qt::AlignCenter);
     setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
@@ -34,48 +38,97 @@ br::ImageViewer::ImageViewer(QWidget *parent)
 void br::ImageViewer::setDefaultText(const QString &text)
 {
     defaultText = text;
-    updatePixmap(QImage());
+    updatePixmap();
 }
 
 void br::ImageViewer::setImage(const QString &file, bool async)
 {
-    QMutexLocker locker(&mutex);
-    src = file.isNull() ? QImage() : QImage(file);
-    updatePixmap(src, async);
+    setSource(file.isNull() ? QImage() : QImage(file), async);
 }
 
 void br::ImageViewer::setImage(const QImage &image, bool async)
 {
-    QMutexLocker locker(&mutex);
-	src = image.copy();
-    updatePixmap(src, async);
+    setSource(image.copy(), async);
 }
 
 void br::ImageViewer::setImage(const QPixmap &pixmap, bool async)
+{
+    setSource(pixmap.toImage(), async);
+}
+
+void br::ImageViewer::setOverlays(const QList<QRectF> &rects)
 {
     QMutexLocker locker(&mutex);
-    src = pixmap.toImage();
-    updatePixmap(src, async);
+    overlays = rects;
+    QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection);
+}
+
+double br::ImageViewer::scale() const
+{
+    if (src.isNull()) return 1;
+    return zoom * std::min(double(width()) / src.width(), double(height()) / src.height());
+}
+
+QPointF br::ImageViewer::toImage(const QPointF &sp) const
+{
+    return (sp - QPointF(width(), height())/2) / scale() + center;
+}
+
+QPointF br::ImageViewer::toScreen(const QPointF &ip) const
+{
+    return (ip - center) * scale() + QPointF(width(), height())/2;
+}
+
+QRectF br::ImageViewer::imageRect() const
+{
+    if (src.isNull()) return QRectF();
+    return QRectF(toScreen(QPointF(0, 0)), toScreen(QPointF(src.width(), src.height())));
 }
 
 /*** PRIVATE ***/
-void br::ImageViewer::updatePixmap(QImage image, bool async)
+void br::ImageViewer::setSource(const QImage &image, bool async)
 {
-    if (async) {
-        QMetaObject::invokeMethod(this, "updatePixmap", Qt::QueuedConnection, Q_ARG(QImage, image), Q_ARG(bool, false));
-        return;
+    // Built before locking so painting isn't held up by a large image
+    QVector<QImage> levels;
+    if (!image.isNull()) {
+        levels.append(image);
+        while (std::max(levels.last().width(), levels.last().height()) > TileSize)
+            levels.append(levels.last().scaled(std::max(1, levels.last().width()/2), std::max(1, levels.last().height()/2),
+                                               Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
     }
 
     QMutexLocker locker(&mutex);
-    if (image.isNull() || size().isNull()) {
-        setPixmap(QPixmap());
+    src = image;
+    pyramid = levels;
+    if (async) QMetaObject::invokeMethod(this, "updatePixmap", Qt::QueuedConnection);
+    else       updatePixmap();
+}
+
+void br::ImageViewer::clampView()
+{
+    if (zoom <= 1) {
+        zoom = 1;
+        center = QPointF(src.width(), src.height())/2;
+    } else {
+        center = QPointF(std::min(std::max(center.x(), 0.0), double(src.width())),
+                         std::min(std::max(center.y(), 0.0), double(src.height())));
+    }
+}
+
+void br::ImageViewer::updatePixmap()
+{
+    QMutexLocker locker(&mutex);
+    tiles.clear();
+    zoom = 1;
+    clampView();
+    if (src.isNull() || size().isNull()) {
         setText(defaultText);
         setFrameShape(QLabel::StyledPanel);
     } else {
         clear();
-        setPixmap(QPixmap::fromImage(image.scaled(size(), Qt::KeepAspectRatio)));
         setFrameShape(QLabel::NoFrame);
     }
+    update();
 }
 
 QSize br::ImageViewer::sizeHint() const
@@ -92,6 +145,12 @@ void br::ImageViewer::keyPressEvent(QKeyEvent *event)
         event->accept();
         const QString fileName = QFileDialog::getSaveFileName(this, "Save Image");
         if (!fileName.isEmpty()) src.save(fileName);
+    } else if ((event->key() == Qt::Key_0) && (event->modifiers() == Qt::ControlModifier)) {
+        event->accept();
+        QMutexLocker locker(&mutex);
+        zoom = 1;
+        clampView();
+        update();
     }
 }
 
@@ -100,11 +159,93 @@ void br::ImageViewer::mouseMoveEvent(QMouseEvent *event)
     QLabel::mouseMoveEvent(event);
     event->accept();
     setFocus();
+
+    if (event->buttons() & Qt::MiddleButton) {
+        QMutexLocker locker(&mutex);
+        center -= QPointF(event->pos() - panPosition) / scale();
+        panPosition = event->pos();
+        clampView();
+        update();
+    }
+}
+
+void br::ImageViewer::mousePressEvent(QMouseEvent *event)
+{
+    QLabel::mousePressEvent(event);
+    if (event->button() == Qt::MiddleButton)
+        panPosition = event->pos();
+}
+
+void br::ImageViewer::paintEvent(QPaintEvent *event)
+{
+    QLabel::paintEvent(event);
+
+    QMutexLocker locker(&mutex);
+    if (src.isNull() || size().isNull()) return;
+
+    QPainter painter(this);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform, true);
+
+    // The coarsest level with at least one pixel per screen pixel
+    const double s = scale();
+    const int level = std::min(pyramid.size()-1, std::max(0, int(floor(-log(s)/log(2.0)))));
+    const QImage &image = pyramid[level];
+    const double levelScale = double(src.width()) / image.width(); // Image pixels per level pixel
+
+    // Tiles intersecting the exposed region
+    const QRectF exposed = QRectF(toImage(event->rect().topLeft()), toImage(event->rect().bottomRight() + QPoint(1, 1)));
+    const int x0 = std::max(0, int(exposed.left() / levelScale) / TileSize);
+    const int y0 = std::max(0, int(exposed.top() / levelScale) / TileSize);
+    const int x1 = std::min((image.width()-1) / TileSize, int(exposed.right() / levelScale) / TileSize);
+    const int y1 = std::min((image.height()-1) / TileSize, int(exposed.bottom() / levelScale) / TileSize);
+
+    for (int y=y0; y<=y1; y++) {
+        for (int x=x0; x<=x1; x++) {
+            const QRect tileRect = QRect(x*TileSize, y*TileSize, TileSize, TileSize).intersected(image.rect());
+            const quint64 key = (quint64(level) << 48) | (quint64(y) << 24) | quint64(x);
+            QPixmap *tile = tiles.object(key);
+            if (!tile) {
+                tile = new QPixmap(QPixmap::fromImage(image.copy(tileRect)));
+                tiles.insert(key, tile, std::max(1, tile->width() * tile->height() * 4 >> 10));
+            }
+            const QRectF target(toScreen(QPointF(tileRect.topLeft()) * levelScale),
+                                toScreen(QPointF(tileRect.topLeft() + QPoint(tileRect.width(), tileRect.height())) * levelScale));
+            painter.drawPixmap(target, *tile, QRectF(tile->rect()));
+        }
+    }
+
+    // Overlays stay sharp at any zoom because they are drawn as vectors
+    if (!overlays.isEmpty()) {
+        painter.setRenderHint(QPainter::Antialiasing, true);
+        painter.setPen(QPen(QColor(0, 255, 0, 192), 2));
+        painter.setBrush(Qt::NoBrush);
+        foreach (const QRectF &rect, overlays)
+            painter.drawRect(QRectF(toScreen(rect.topLeft()), toScreen(rect.bottomRight())));
+    }
 }
 
 void br::ImageViewer::resizeEvent(QResizeEvent *event)
 {
     QLabel::resizeEvent(event);
     event->accept();
-    updatePixmap(src);
+    QMutexLocker locker(&mutex);
+    clampView();
+}
+
+void br::ImageViewer::wheelEvent(QWheelEvent *event)
+{
+    QMutexLocker locker(&mutex);
+    if (src.isNull()) {
+        QLabel::wheelEvent(event);
+        return;
+    }
+    event->accept();
+
+    // Zoom about the cursor, up to eight screen pixels per image pixel
+    const QPointF ip = toImage(event->pos());
+    const double fit = scale() / zoom;
+    zoom = std::min(zoom * pow(1.25, event->angleDelta().y() / 120.0), std::max(1.0, 8 / fit));
+    center = ip - (QPointF(event->pos()) - QPointF(width(), height())/2) / scale();
+    clampView();
+    update();
 }
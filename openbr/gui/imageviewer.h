@@ -17,46 +17,81 @@
 #ifndef BR_IMAGEVIEWER_H
 #define BR_IMAGEVIEWER_H
 
+#include <QCache>
 #include <QImage>
 #include <QKeyEvent>
 #include <QLabel>
+#include <QList>
 #include <QMouseEvent>
 #include <QMutex>
+#include <QPaintEvent>
 #include <QPixmap>
+#include <QRectF>
 #include <QResizeEvent>
 #include <QString>
+#include <QVector>
+#include <QWheelEvent>
 #include <QWidget>
 #include <openbr/openbr_export.h>
 
 namespace br
 {
 
+/*!
+ * \brief Displays an image through a pyramid of tiles.
+ *
+ * Each pyramid level halves the one before it. Painting uses the coarsest level that still covers the screen resolution,
+ * and only the tiles in view are uploaded as pixmaps, so very large images pan and zoom at the cost of the visible area.
+ * The wheel zooms about the cursor, dragging with the middle button pans and Ctrl+0 fits the image again.
+ */
 class BR_EXPORT ImageViewer : public QLabel
 {
     Q_OBJECT
     QMutex mutex;
     QString defaultText;
+    QVector<QImage> pyramid; // Level i is src downsampled by 2^i
+    QCache<quint64, QPixmap> tiles; // Uploaded tiles keyed by level and position, cost in kilobytes
+    QList<QRectF> overlays;
+    double zoom; // Relative to fitting the image in the widget
+    QPointF center; // Image point at the center of the widget
+    QPoint panPosition;
 
 public:
+    static const int TileSize = 512;
+    static const int TileCacheSize = 128 << 10; // Kilobytes
+
     explicit ImageViewer(QWidget *parent = 0);
     void setDefaultText(const QString &text);
     void setImage(const QString &file, bool async = false);
     void setImage(const QImage &image, bool async = false);
     void setImage(const QPixmap &pixmap, bool async = false);
+    void setOverlays(const QList<QRectF> &rects); // Outlined over the image in image coordinates
     bool isNull() const { return src.isNull(); }
     int imageWidth() const { return src.width(); }
     int imageHeight() const { return src.height(); }
 
+    double scale() const; // Screen pixels per image pixel
+    QPointF toImage(const QPointF &sp) const;
+    QPointF toScreen(const QPointF &ip) const;
+    QRectF imageRect() const; // Screen rectangle the image is drawn in
+
 protected:
     QImage src;
 
 protected slots:
     void keyPressEvent(QKeyEvent *event);
     void mouseMoveEvent(QMouseEvent *event);
+    void mousePressEvent(QMouseEvent *event);
+    void paintEvent(QPaintEvent *event);
     void resizeEvent(QResizeEvent *event);
+    void wheelEvent(QWheelEvent *event);
+
+private:
+    void setSource(const QImage &image, bool async);
+    void clampView();
 
 private slots:
-    void updatePixmap(QImage image, bool async = false);
+    void updatePixmap();
     QSize sizeHint() const;
 };
 
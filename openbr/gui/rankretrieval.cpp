@@ -1,9 +1,12 @@
 #include "rankretrieval.h"
 
 #include <QtConcurrent>
+#include <algorithm>
+#include <functional>
 
 #include <openbr/openbr.h>
 #include <openbr/gui/faceviewer.h>
+#include <openbr/plugins/openbr_internal.h>
 
 using namespace br;
 
@@ -13,8 +16,13 @@ RankRetrieval::RankRetrieval(QWidget *parent) :
     gridSize(9)
 {
     targetPath = Context::scratchPath();
+}
 
-    connect(&compareWatcher, SIGNAL(finished()), this, SLOT(compareDone()));
+RankRetrieval::~RankRetrieval()
+{
+    searchGeneration.ref();
+    compareWatcher.waitForFinished();
+    enrollWatcher.waitForFinished();
 }
 
 void RankRetrieval::clear()
@@ -25,6 +33,9 @@ void RankRetrieval::clear()
 void RankRetrieval::setAlgorithm(const QString &algorithm)
 {
     br_set_property("algorithm",qPrintable(algorithm));
+
+    QMutexLocker locker(&lock);
+    distance.clear();
 }
 
 void RankRetrieval::setTargetGallery(const File &file)
@@ -45,6 +56,7 @@ void RankRetrieval::setQueryGallery(const File &file)
     queryTemplate >> *transform;
 
     query = queryTemplate;
+    this->queryTemplate = queryTemplate;
 
     emit newQueryFile(query);
 }
@@ -54,14 +66,73 @@ void RankRetrieval::enroll()
     File targetGallery(targetPath + ".gal");
     targetGallery.set("append", true);
 
-    enrollWatcher.setFuture(QtConcurrent::run(Enroll, target.flat(), targetGallery.flat()));
+    enrollWatcher.waitForFinished();
+    enrollWatcher.setFuture(QtConcurrent::run(this, &RankRetrieval::enrollTargets, target, targetGallery));
+}
+
+void RankRetrieval::enrollTargets(File target, File targetGallery)
+{
+    Enroll(target.flat(), targetGallery.flat());
+
+    // Read back once so searches don't reload the gallery
+    const TemplateList enrolled = TemplateList::fromGallery(targetGallery.name);
+    QMutexLocker locker(&lock);
+    targets = enrolled;
 }
 
 void RankRetrieval::compare()
 {
-    File targetGallery(targetPath + ".gal");
+    // A new query supersedes the running search, which stops at its next block
+    const int generation = searchGeneration.fetchAndAddOrdered(1) + 1;
+    gridPage = 0;
+
+    QMutexLocker locker(&lock);
+    if (distance.isNull()) {
+        distance = Distance::fromAlgorithm(Globals->algorithm);
+        if (distance.isNull()) {
+            qWarning("%s does not compare templates.", qPrintable(Globals->algorithm));
+            return;
+        }
+    }
+    searchMatches.clear();
+    searchScores.clear();
+    compareWatcher.setFuture(QtConcurrent::run(this, &RankRetrieval::search, generation, targets, queryTemplate, distance));
+}
+
+void RankRetrieval::search(int generation, TemplateList targets, Template query, QSharedPointer<Distance> distance)
+{
+    typedef QPair<float,int> Match; // QPair<score,target index>
+    const TemplateList queries = TemplateList() << query;
+    QVector<int> indices(Limit);
+    QVector<float> blockScores(Limit);
+    QList<Match> best;
+
+    // Search the gallery a block at a time, publishing the best so far after each one
+    for (int offset=0; offset<targets.size(); offset+=BlockSize) {
+        if (searchGeneration.loadAcquire() != generation) return;
+
+        searchTopK(distance.data(), targets.mid(offset, BlockSize), queries, Limit, indices.data(), blockScores.data());
+        for (int i=0; i<Limit; i++)
+            if (indices[i] != -1)
+                best.append(Match(blockScores[i], offset + indices[i]));
+        std::sort(best.begin(), best.end(), std::greater<Match>());
+        best = best.mid(0, Limit);
+
+        FileList files;
+        QList<float> scores;
+        foreach (const Match &match, best) {
+            files.append(targets[match.second].file);
+            scores.append(match.first);
+        }
+
+        QMutexLocker locker(&lock);
+        if (searchGeneration.loadAcquire() != generation) return;
+        searchMatches = files;
+        searchScores = scores;
+        QMetaObject::invokeMethod(this, "searchProgress", Qt::QueuedConnection, Q_ARG(int, generation));
+    }
 
-    compareWatcher.setFuture(QtConcurrent::run(Compare, targetGallery.flat(), query.flat(), QString("buffer.rr[byLine,limit=200]")));
+    if (best.isEmpty()) qWarning("Error: No successful matches.");
 }
 
 void RankRetrieval::first()
@@ -113,20 +184,13 @@ void RankRetrieval::setIndex(int index)
     (void) index;
 }
 
-void RankRetrieval::compareDone()
-{    
-    matches.clear();
-
-    QStringList results = QString(Globals->buffer).split("\n");
-
-    if (results.empty()) {
-        qWarning("Error: No successful matches.");
-        return;
-    }
-
-    foreach (const QString &line, results) {
-        File match(line);
-        matches.append(match);
+void RankRetrieval::searchProgress(int generation)
+{
+    {
+        QMutexLocker locker(&lock);
+        if (generation != searchGeneration.loadAcquire()) return;
+        matches = searchMatches;
+        scores = searchScores;
     }
 
     display();
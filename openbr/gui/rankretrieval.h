@@ -1,8 +1,10 @@
 #ifndef BR_RANKRETRIEVAL_H
 #define BR_RANKRETRIEVAL_H
 
+#include <QAtomicInt>
 #include <QFutureWatcher>
 #include <QFileDialog>
+#include <QMutex>
 #include <openbr/openbr_plugin.h>
 #include <openbr/gui/faceviewer.h>
 
@@ -14,6 +16,7 @@ class BR_EXPORT RankRetrieval : public QWidget
 
     int gridPage, gridSize;
     File target, query;
+    Template queryTemplate;
     FileList matches;
     QList<float> scores;
     QFutureWatcher<void> enrollWatcher;
@@ -21,8 +24,20 @@ class BR_EXPORT RankRetrieval : public QWidget
 
     QString targetPath;
 
+    // Shared with the background enrollment and search
+    QMutex lock;
+    TemplateList targets; // The enrolled target gallery, kept resident between searches
+    QSharedPointer<Distance> distance;
+    FileList searchMatches;
+    QList<float> searchScores;
+    QAtomicInt searchGeneration; // Incremented to cancel the running search
+
 public:
+    static const int Limit = 200; // Matches retained
+    static const int BlockSize = 4096; // Targets searched between progress updates and cancellation checks
+
     explicit RankRetrieval(QWidget *parent = 0);
+    ~RankRetrieval();
 
 public slots:
     void setAlgorithm(const QString &algorithm);
@@ -43,7 +58,7 @@ public slots:
     void compare();
 
 private slots:
-    void compareDone();
+    void searchProgress(int generation);
 
 signals:
     void newTargetFileList(FileList);
@@ -52,6 +67,8 @@ signals:
 
 private:
     void enroll();
+    void enrollTargets(File target, File targetGallery);
+    void search(int generation, TemplateList targets, Template query, QSharedPointer<Distance> distance);
     void display();
 
 };
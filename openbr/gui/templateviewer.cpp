@@ -28,6 +28,7 @@ TemplateViewer::TemplateViewer(QWidget *parent)
     setDefaultText("<b>Drag Photo or Folder Here</b>\n");
     format = "Photo";
     editable = false;
+    useThumbnail = false;
     setFile(File());
     update();
 }
@@ -36,15 +37,18 @@ TemplateViewer::TemplateViewer(QWidget *parent)
 void TemplateViewer::setFile(const File &file_)
 {
     this->file = file_;
+    thumbnail = QImage();
+    useThumbnail = false;
+    refreshLandmarks();
+    TemplateViewer::refreshImage();
+}
 
-    // Update landmarks
-    landmarks.clear();
-    if (file.contains("Affine_0")) landmarks.append(file.get<QPointF>("Affine_0"));
-    if (file.contains("Affine_1")) landmarks.append(file.get<QPointF>("Affine_1"));
-    while (landmarks.size() < NumLandmarks)
-        landmarks.append(QPointF());
-    nearestLandmark = -1;
-
+void TemplateViewer::setThumbnail(const File &file_, const QImage &thumbnail_)
+{
+    this->file = file_;
+    thumbnail = thumbnail_;
+    useThumbnail = true;
+    refreshLandmarks();
     TemplateViewer::refreshImage();
 }
 
@@ -67,10 +71,24 @@ void TemplateViewer::setFormat(const QString &format)
 }
 
 /*** PRIVATE ***/
+void TemplateViewer::refreshLandmarks()
+{
+    landmarks.clear();
+    if (file.contains("Affine_0")) landmarks.append(file.get<QPointF>("Affine_0"));
+    if (file.contains("Affine_1")) landmarks.append(file.get<QPointF>("Affine_1"));
+    while (landmarks.size() < NumLandmarks)
+        landmarks.append(QPointF());
+    nearestLandmark = -1;
+}
+
 void TemplateViewer::refreshImage()
 {
+    // Detections are outlined by the viewer rather than drawn into the image, thumbnails are drawn as is
+    setOverlays(((format == "Photo") && !useThumbnail) ? file.rects() : QList<QRectF>());
+
     if (file.isNull() || (format == "Photo")) {
-        setImage(file, true);
+        if (useThumbnail) setImage(thumbnail, true);
+        else              setImage(file, true);
     } else {
         const QString path = QString(br::Globals->scratchPath()) + "/thumbnails";
         const QString hash = file.hash()+format;
@@ -89,18 +107,16 @@ void TemplateViewer::refreshImage()
 
 QPointF TemplateViewer::getImagePoint(const QPointF &sp) const
 {
-    if (!pixmap() || isNull()) return QPointF();
-    QPointF ip = QPointF(imageWidth()*(sp.x() - (width() - pixmap()->width())/2)/pixmap()->width(),
-                        imageHeight()*(sp.y() - (height() - pixmap()->height())/2)/pixmap()->height());
+    if (isNull()) return QPointF();
+    QPointF ip = toImage(sp);
     if ((ip.x() < 0) || (ip.x() > imageWidth()) || (ip.y() < 0) || (ip.y() > imageHeight())) return QPointF();
     return ip;
 }
 
 QPointF TemplateViewer::getScreenPoint(const QPointF &ip) const
 {
-    if (!pixmap() || isNull()) return QPointF();
-    return QPointF(ip.x()*pixmap()->width()/imageWidth() + (width()-pixmap()->width())/2,
-                   ip.y()*pixmap()->height()/imageHeight() + (height()-pixmap()->height())/2);
+    if (isNull()) return QPointF();
+    return toScreen(ip);
 }
 
 /*** PROTECTED SLOTS ***/
@@ -25,12 +25,15 @@ public:
 
 public slots:
     void setFile(const br::File &file);
+    void setThumbnail(const br::File &file, const QImage &thumbnail); // Show a preloaded thumbnail instead of reading the file
     void setEditable(bool enabled);
     void setMousePoint(const QPointF &mousePoint);
     void setFormat(const QString &format);
 
 protected:
     File file;
+    QImage thumbnail;
+    bool useThumbnail;
     QPointF mousePoint;
     QString format;
 
@@ -41,6 +44,7 @@ protected:
     QPointF getScreenPoint(const QPointF &ip) const;
 
 private:
+    void refreshLandmarks();
     void refreshImage();
 
 protected slots:
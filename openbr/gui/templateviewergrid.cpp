@@ -7,16 +7,28 @@ using namespace br;
 TemplateViewerGrid::TemplateViewerGrid(QWidget *parent)
     : QWidget(parent)
 {
+    cells = 1;
+    page = 0;
     setLayout(&gridLayout);
+    connect(&thumbnails, SIGNAL(loaded(QString,QImage)), this, SLOT(thumbnailLoaded(QString,QImage)));
     setFiles(FileList(16));
     setFiles(FileList(1));
 }
 
+int TemplateViewerGrid::pageCount() const
+{
+    return std::max(1, (files.size() + cells - 1) / cells);
+}
+
 /*** PUBLIC SLOTS ***/
 void TemplateViewerGrid::setFiles(const FileList &files)
 {
-    const int size = std::max(1, (int)ceil(sqrt((float)files.size())));
-    while (templateViewers.size() < size*size) {
+    this->files = files;
+
+    // Viewers are only created for one page of cells, however long the file list is
+    const int size = std::max(1, std::min(MaxGridSize, (int)ceil(sqrt((float)files.size()))));
+    cells = size*size;
+    while (templateViewers.size() < cells) {
         templateViewers.append(QSharedPointer<TemplateViewer>(new TemplateViewer()));
         connect(templateViewers.last().data(), SIGNAL(newInput(br::File)), this, SIGNAL(newInput(br::File)));
         connect(templateViewers.last().data(), SIGNAL(newInput(QImage)), this, SIGNAL(newInput(QImage)));
@@ -31,20 +43,17 @@ void TemplateViewerGrid::setFiles(const FileList &files)
     }
 
     for (int i=0; i<templateViewers.size(); i++) {
-        if (i < size*size) {
+        if (i < cells) {
             gridLayout.addWidget(templateViewers[i].data(), i/size, i%size, 1, 1);
             templateViewers[i]->setVisible(true);
-        }
-
-        if (i < files.size()) {
-            templateViewers[i]->setFile(files[i]);
         } else {
-            templateViewers[i]->setDefaultText("<b>"+ (size > 1 ? QString() : QString("Drag Photo or Folder Here")) +"</b>");
-            templateViewers[i]->setFile(QString());
+            templateViewers[i]->setFile(QString()); // Release hidden images
         }
-
+        templateViewers[i]->setDefaultText("<b>"+ (size > 1 ? QString() : QString("Drag Photo or Folder Here")) +"</b>");
         templateViewers[i]->setEditable(files.size() == 1);
     }
+
+    setPage(0);
 }
 
 void TemplateViewerGrid::setFormat(const QString &format)
@@ -59,4 +68,64 @@ void TemplateViewerGrid::setMousePoint(const QPointF &mousePoint)
         templateViewer->setMousePoint(mousePoint);
 }
 
+void TemplateViewerGrid::firstPage()
+{
+    setPage(0);
+}
+
+void TemplateViewerGrid::previousPage()
+{
+    setPage(page-1);
+}
+
+void TemplateViewerGrid::nextPage()
+{
+    setPage(page+1);
+}
+
+void TemplateViewerGrid::lastPage()
+{
+    setPage(pageCount()-1);
+}
+
+/*** PRIVATE ***/
+void TemplateViewerGrid::setPage(int page)
+{
+    this->page = qBound(0, page, pageCount()-1);
+    const int offset = this->page*cells;
+
+    // Requests for pages flipped past are stale
+    thumbnails.cancel();
+
+    for (int i=0; i<cells; i++) {
+        const int index = offset + i;
+        if (index >= files.size()) {
+            templateViewers[i]->setFile(QString());
+        } else if (files.size() == 1) {
+            // A lone template is shown at full resolution so its landmarks can be edited
+            templateViewers[i]->setFile(files[index]);
+        } else {
+            thumbnails.request(files[index].name);
+            templateViewers[i]->setThumbnail(files[index], thumbnails.thumbnail(files[index].name));
+        }
+    }
+
+    // Prefetch the next page behind the visible one
+    if (files.size() > 1)
+        for (int index=offset+cells; index<std::min(offset+2*cells, files.size()); index++)
+            thumbnails.request(files[index].name);
+
+    emit pageChanged(this->page, pageCount());
+}
+
+/*** PRIVATE SLOTS ***/
+void TemplateViewerGrid::thumbnailLoaded(QString file, QImage thumbnail)
+{
+    if (files.size() <= 1) return;
+    const int offset = page*cells;
+    for (int i=0; i<cells && offset+i<files.size(); i++)
+        if (files[offset+i].name == file)
+            templateViewers[i]->setThumbnail(files[offset+i], thumbnail);
+}
+
 #include "moc_templateviewergrid.cpp"
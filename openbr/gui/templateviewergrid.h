@@ -9,30 +9,53 @@
 #include <openbr/openbr_plugin.h>
 
 #include "templateviewer.h"
+#include "thumbnailcache.h"
 
 namespace br
 {
 
+/*!
+ * \brief Shows a page of templates at a time.
+ *
+ * Only the visible cells have viewers, and for multiple files they display thumbnails decoded in the background.
+ */
 class BR_EXPORT TemplateViewerGrid : public QWidget
 {
     Q_OBJECT
 
     QGridLayout gridLayout;
     QList< QSharedPointer<TemplateViewer> > templateViewers;
+    ThumbnailCache thumbnails;
+    FileList files;
+    int cells, page;
 
 public:
+    static const int MaxGridSize = 6; // Cells per row and column
+
     explicit TemplateViewerGrid(QWidget *parent = 0);
+    int pageCount() const;
 
 public slots:
     void setFiles(const br::FileList &file);
     void setFormat(const QString &format);
     void setMousePoint(const QPointF &mousePoint);
+    void firstPage();
+    void previousPage();
+    void nextPage();
+    void lastPage();
+
+private:
+    void setPage(int page);
+
+private slots:
+    void thumbnailLoaded(QString file, QImage thumbnail);
 
 signals:
     void newInput(br::File);
     void newInput(QImage);
     void newMousePoint(QPointF);
     void selectedInput(br::File);
+    void pageChanged(int page, int pages);
 };
 
 } // namespace br
@@ -0,0 +1,82 @@
+#include <QImageReader>
+#include <QRunnable>
+#include <QThread>
+#include <algorithm>
+
+#include "thumbnailcache.h"
+
+using namespace br;
+
+/**** THUMBNAIL_LOADER ****/
+class ThumbnailLoader : public QRunnable
+{
+    ThumbnailCache *cache;
+    QString file;
+    int generation;
+
+public:
+    ThumbnailLoader(ThumbnailCache *cache_, const QString &file_, int generation_)
+        : cache(cache_), file(file_), generation(generation_) {}
+
+    void run()
+    {
+        QImageReader reader(file);
+        const QSize size = reader.size();
+        if (size.isValid())
+            reader.setScaledSize(size.scaled(ThumbnailCache::ThumbnailSize, ThumbnailCache::ThumbnailSize, Qt::KeepAspectRatio).boundedTo(size));
+        const QImage thumbnail = reader.read();
+        QMetaObject::invokeMethod(cache, "finished", Qt::QueuedConnection, Q_ARG(QString, file), Q_ARG(QImage, thumbnail), Q_ARG(int, generation));
+    }
+};
+
+/**** THUMBNAIL_CACHE ****/
+/*** PUBLIC ***/
+ThumbnailCache::ThumbnailCache(QObject *parent)
+    : QObject(parent), cache(CacheSize), generation(0)
+{
+    // Leave cores for enrollment and the UI, decoding is mostly disk bound anyway
+    pool.setMaxThreadCount(qBound(1, QThread::idealThreadCount()/2, 4));
+}
+
+ThumbnailCache::~ThumbnailCache()
+{
+    pool.clear();
+    pool.waitForDone();
+}
+
+bool ThumbnailCache::contains(const QString &file) const
+{
+    return cache.contains(file);
+}
+
+QImage ThumbnailCache::thumbnail(const QString &file) const
+{
+    const QImage *thumbnail = cache.object(file);
+    return thumbnail ? *thumbnail : QImage();
+}
+
+void ThumbnailCache::request(const QString &file)
+{
+    if (file.isEmpty() || cache.contains(file) || pending.contains(file)) return;
+    pending.insert(file);
+    pool.start(new ThumbnailLoader(this, file, generation));
+}
+
+void ThumbnailCache::cancel()
+{
+    // Loaders already running still report back, but under the old generation they are only cached
+    pool.clear();
+    pending.clear();
+    generation++;
+}
+
+/*** PRIVATE SLOTS ***/
+void ThumbnailCache::finished(QString file, QImage thumbnail, int generation_)
+{
+    if (generation_ == generation) pending.remove(file);
+    // Failed decodes are cached too so unreadable files are not retried on every page flip
+    cache.insert(file, new QImage(thumbnail), std::max(1, thumbnail.byteCount() >> 10));
+    emit loaded(file, thumbnail);
+}
+
+#include "moc_thumbnailcache.cpp"
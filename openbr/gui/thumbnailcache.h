@@ -0,0 +1,52 @@
+#ifndef BR_THUMBNAILCACHE_H
+#define BR_THUMBNAILCACHE_H
+
+#include <QCache>
+#include <QImage>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QThreadPool>
+
+#include <openbr/openbr_export.h>
+
+namespace br
+{
+
+/*!
+ * \brief Decodes downscaled images on a background pool and keeps the most recently used ones.
+ *
+ * Thumbnails are decoded with QImageReader::setScaledSize so large photos are never held at full resolution.
+ * All methods must be called from the thread that owns the cache, results are delivered through loaded().
+ */
+class BR_EXPORT ThumbnailCache : public QObject
+{
+    Q_OBJECT
+
+    QCache<QString, QImage> cache; // Cost in kilobytes
+    QSet<QString> pending;
+    QThreadPool pool;
+    int generation;
+
+public:
+    static const int ThumbnailSize = 256; // Bounding box in pixels
+    static const int CacheSize = 64 << 10; // Kilobytes
+
+    explicit ThumbnailCache(QObject *parent = 0);
+    ~ThumbnailCache();
+
+    bool contains(const QString &file) const;
+    QImage thumbnail(const QString &file) const; // Null until loaded() has been emitted
+    void request(const QString &file);
+    void cancel(); // Drop queued requests that have not started decoding
+
+signals:
+    void loaded(QString file, QImage thumbnail);
+
+private slots:
+    void finished(QString file, QImage thumbnail, int generation);
+};
+
+} // namespace br
+
+#endif // BR_THUMBNAILCACHE_H
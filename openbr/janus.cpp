@@ -1,3 +1,7 @@
+#include <QAtomicInt>
+#include <QDateTime>
+#include <QMutex>
+#include <QtConcurrentRun>
 #include "iarpa_janus.h"
 #include "iarpa_janus_io.h"
 #include "openbr_plugin.h"
@@ -9,9 +13,25 @@ static QSharedPointer<Transform> detect;
 static QSharedPointer<Transform> augment;
 static QSharedPointer<Distance> distance;
 
+// Templates keep at most MaxTemplateMatrixBytes of matrices, counted as they are stored in a flat gallery: each matrix with
+// its offset and size, padded to a 16-byte boundary. The rest of janus_max_template_size() covers the template's entries in
+// the gallery tables and its share of the gallery and segment headers, so a gallery of n templates fits in n times it.
+static const size_t MaxTemplateMatrixBytes = 102400; // 100 KB
+static const size_t FlatGalleryOverhead = 256;
+
+static size_t align16(size_t bytes)
+{
+    return (bytes + 15) & ~size_t(15);
+}
+
+static size_t storedMatrixBytes(size_t bytes)
+{
+    return 2 * sizeof(quint64) + align16(bytes);
+}
+
 size_t janus_max_template_size()
 {
-    return 102400;// 100 KB
+    return MaxTemplateMatrixBytes + FlatGalleryOverhead;
 }
 
 janus_error janus_initialize(const char *sdk_path, const char *temp_path, const char *model_file)
@@ -137,6 +157,7 @@ janus_error janus_augment(const janus_image image, janus_attributes *attributes,
 janus_error janus_flatten_template(janus_template template_, janus_flat_template flat_template, size_t *bytes)
 {    
     *bytes = 0;
+    size_t stored = 0; // The same matrices take more room in a flat gallery, whose limit applies to both
     foreach (const cv::Mat &m, *template_) {
         if (!m.data)
             continue;
@@ -145,8 +166,9 @@ janus_error janus_flatten_template(janus_template template_, janus_flat_template
             return JANUS_UNKNOWN_ERROR;
 
         const size_t templateBytes = m.rows * m.cols * m.elemSize();
-        if (*bytes + sizeof(size_t) + templateBytes > janus_max_template_size())
+        if (stored + storedMatrixBytes(templateBytes) > MaxTemplateMatrixBytes)
             break;
+        stored += storedMatrixBytes(templateBytes);
 
         memcpy(flat_template, &templateBytes, sizeof(templateBytes));
         flat_template += sizeof(templateBytes);
@@ -165,8 +187,198 @@ janus_error janus_free_template(janus_template template_)
     return JANUS_SUCCESS;
 }
 
+// Flat galleries are laid out to be searched in place: a header, the index of each template's first matrix,
+// the offset and size of each matrix, the template ids, and finally the matrices packed contiguously.
+struct FlatGalleryHeader
+{
+    quint32 magic, version;
+    quint64 templates, matrices;
+};
+
+static const quint32 FlatGalleryMagic = 0x47464252; // "BRFG"
+static const quint32 FlatGalleryVersion = 1;
+
+// janus_flatten_gallery writes a segmented flat gallery: a header, each segment laid out as a version 1 flat gallery
+// starting on a 16-byte boundary, and a directory of the offset and size of each segment.
+struct SegmentedGalleryHeader
+{
+    quint32 magic, version;
+    quint64 stamp; // Identifies the janus_gallery the buffer was flattened from
+    quint64 segments, directory;
+};
+
+static const quint32 SegmentedGalleryVersion = 2;
+
+struct FlatGallery
+{
+    quint64 templates;
+    const quint64 *templateMatrices; // templates+1 entries
+    const quint64 *matrixOffsets, *matrixBytes;
+    const janus_template_id *ids;
+    const janus_data *features;
+
+    bool parse(const janus_data *gallery, size_t bytes)
+    {
+        if (bytes < sizeof(FlatGalleryHeader))
+            return false;
+        const FlatGalleryHeader *header = reinterpret_cast<const FlatGalleryHeader*>(gallery);
+        if ((header->magic != FlatGalleryMagic) || (header->version != FlatGalleryVersion))
+            return false;
+
+        templates = header->templates;
+        templateMatrices = reinterpret_cast<const quint64*>(gallery + sizeof(FlatGalleryHeader));
+        matrixOffsets = templateMatrices + templates + 1;
+        matrixBytes = matrixOffsets + header->matrices;
+        ids = reinterpret_cast<const janus_template_id*>(matrixBytes + header->matrices);
+        features = gallery + align16(reinterpret_cast<const janus_data*>(ids + templates) - gallery);
+        return size_t(features - gallery) <= bytes;
+    }
+
+    // The segments of a flat gallery in either layout
+    static bool parseSegments(const janus_data *gallery, size_t bytes, QList<FlatGallery> &segments)
+    {
+        if (bytes < sizeof(FlatGalleryHeader))
+            return false;
+
+        const FlatGalleryHeader *header = reinterpret_cast<const FlatGalleryHeader*>(gallery);
+        if ((header->magic == FlatGalleryMagic) && (header->version == FlatGalleryVersion)) {
+            segments.append(FlatGallery());
+            return segments.last().parse(gallery, bytes);
+        }
+
+        if ((bytes < sizeof(SegmentedGalleryHeader)) || (header->magic != FlatGalleryMagic) || (header->version != SegmentedGalleryVersion))
+            return false;
+        const SegmentedGalleryHeader *segmented = reinterpret_cast<const SegmentedGalleryHeader*>(gallery);
+        if (segmented->directory + segmented->segments * 2 * sizeof(quint64) > bytes)
+            return false;
+
+        const quint64 *directory = reinterpret_cast<const quint64*>(gallery + segmented->directory);
+        for (quint64 i=0; i<segmented->segments; i++) {
+            if (directory[2*i] + directory[2*i+1] > bytes)
+                return false;
+            segments.append(FlatGallery());
+            if (!segments.last().parse(gallery + directory[2*i], directory[2*i+1]))
+                return false;
+        }
+        return true;
+    }
+};
+
+// Collects templates and writes them out as a version 1 flat gallery
+struct FlatGalleryWriter
+{
+    QVector<janus_template_id> ids;
+    QVector<quint64> templateMatrices, matrixBytes;
+    QVector<const janus_data*> matrices;
+    qint64 bytes;
+
+    FlatGalleryWriter() : bytes(0) { templateMatrices.append(0); }
+
+    void addMatrix(const janus_data *data, quint64 size)
+    {
+        matrices.append(data);
+        matrixBytes.append(size);
+        bytes += storedMatrixBytes(size);
+    }
+
+    void endTemplate(janus_template_id id)
+    {
+        ids.append(id);
+        templateMatrices.append(matrices.size());
+    }
+
+    QByteArray write() const
+    {
+        // Each matrix starts on a 16-byte boundary so SIMD distances can read it directly
+        QVector<quint64> matrixOffsets;
+        quint64 offset = 0;
+        for (int i=0; i<matrices.size(); i++) {
+            matrixOffsets.append(offset);
+            offset = align16(offset + matrixBytes[i]);
+        }
+
+        const size_t tables = sizeof(FlatGalleryHeader) + (templateMatrices.size() + 2 * matrices.size()) * sizeof(quint64) + ids.size() * sizeof(janus_template_id);
+        QByteArray segment(align16(tables) + offset, 0);
+        janus_data *dst = reinterpret_cast<janus_data*>(segment.data());
+
+        FlatGalleryHeader header;
+        header.magic = FlatGalleryMagic;
+        header.version = FlatGalleryVersion;
+        header.templates = ids.size();
+        header.matrices = matrices.size();
+        memcpy(dst, &header, sizeof(header));
+        dst += sizeof(header);
+        memcpy(dst, templateMatrices.data(), templateMatrices.size() * sizeof(quint64));
+        dst += templateMatrices.size() * sizeof(quint64);
+        memcpy(dst, matrixOffsets.data(), matrixOffsets.size() * sizeof(quint64));
+        dst += matrixOffsets.size() * sizeof(quint64);
+        memcpy(dst, matrixBytes.data(), matrixBytes.size() * sizeof(quint64));
+        dst += matrixBytes.size() * sizeof(quint64);
+        memcpy(dst, ids.data(), ids.size() * sizeof(janus_template_id));
+
+        janus_data *features = reinterpret_cast<janus_data*>(segment.data()) + align16(tables);
+        for (int i=0; i<matrices.size(); i++)
+            memcpy(features + matrixOffsets[i], matrices[i], matrixBytes[i]);
+        return segment;
+    }
+};
+
+// Enrollments are flattened into append-only segments. A segment is serialized once, the first time its templates are flattened,
+// so flattening again after more enrollments only serializes the new templates, the segments are then copied into the caller's
+// buffer. Small segments are merged in the background so the number of segments stays logarithmic in the size of the gallery.
 struct janus_gallery_type : public QList<janus_template>
-{};
+{
+    static const int MaxSegments = 8;
+    static const int MaxSegmentBytes = 1 << 30;
+
+    QMutex lock;
+    QList<QByteArray> segments; // Oldest first
+    int flattened; // Templates already serialized into segments
+    quint64 stamp;
+    QFuture<void> compaction;
+
+    janus_gallery_type()
+        : flattened(0)
+    {
+        static QAtomicInt galleries;
+        stamp = (quint64(QDateTime::currentMSecsSinceEpoch()) << 16) ^ quint64(galleries.fetchAndAddRelaxed(1));
+    }
+
+    // Merges the newest segments back to the first one at least twice their combined size
+    static void compact(janus_gallery_type *gallery)
+    {
+        int first;
+        QList<QByteArray> run;
+        {
+            QMutexLocker locker(&gallery->lock);
+            first = gallery->segments.size() - 1;
+            qint64 total = gallery->segments.last().size();
+            while ((first > 0) && (gallery->segments[first-1].size() < 2 * total) && (total + gallery->segments[first-1].size() <= MaxSegmentBytes))
+                total += gallery->segments[--first].size();
+            run = gallery->segments.mid(first);
+        }
+        if (run.size() < 2)
+            return;
+
+        FlatGalleryWriter writer;
+        foreach (const QByteArray &segment, run) {
+            FlatGallery flat;
+            flat.parse(reinterpret_cast<const janus_data*>(segment.data()), segment.size());
+            for (quint64 i=0; i<flat.templates; i++) {
+                for (quint64 j=flat.templateMatrices[i]; j<flat.templateMatrices[i+1]; j++)
+                    writer.addMatrix(flat.features + flat.matrixOffsets[j], flat.matrixBytes[j]);
+                writer.endTemplate(flat.ids[i]);
+            }
+        }
+        const QByteArray merged = writer.write();
+
+        // Segments are only ever appended while a compaction runs, so the run is still in place
+        QMutexLocker locker(&gallery->lock);
+        for (int i=0; i<run.size(); i++)
+            gallery->segments.removeAt(first);
+        gallery->segments.insert(first, merged);
+    }
+};
 
 janus_error janus_allocate_gallery(janus_gallery *gallery_)
 {
@@ -182,57 +394,95 @@ janus_error janus_enroll(const janus_template template_, const janus_template_id
 }
 
 janus_error janus_free_gallery(janus_gallery gallery_) {
+    gallery_->compaction.waitForFinished();
     delete gallery_;
     return JANUS_SUCCESS;
 }
 
 janus_error janus_flatten_gallery(janus_gallery gallery, janus_flat_gallery flat_gallery, size_t *bytes)
 {
-    *bytes = 0;
-    foreach (const janus_template &t, *gallery) {
-        janus_template_id template_id = t->file.get<janus_template_id>("TEMPLATE_ID");
-
-        janus_flat_template u = new janus_data[janus_max_template_size()];
-        size_t t_bytes = 0;
-        JANUS_ASSERT(janus_flatten_template(t, u, &t_bytes))
-        memcpy(flat_gallery, &template_id, sizeof(template_id));
-        flat_gallery += sizeof(template_id);
-        *bytes += sizeof(template_id);
-
-        memcpy(flat_gallery, &t_bytes, sizeof(t_bytes));
-        flat_gallery += sizeof(t_bytes);
-        *bytes += sizeof(t_bytes);
-
-        memcpy(flat_gallery, u, t_bytes);
-        flat_gallery += t_bytes;
-        *bytes += t_bytes;
-        delete[] u;
+    QMutexLocker locker(&gallery->lock);
+
+    if (gallery->flattened < gallery->size()) {
+        FlatGalleryWriter writer;
+        for (int i=gallery->flattened; i<gallery->size(); i++) {
+            const janus_template &t = (*gallery)[i];
+
+            // Same limit as janus_flatten_template
+            size_t templateBytes = 0;
+            foreach (const cv::Mat &m, *t) {
+                if (!m.data)
+                    continue;
+
+                if (!m.isContinuous())
+                    return JANUS_UNKNOWN_ERROR;
+
+                const size_t mBytes = m.rows * m.cols * m.elemSize();
+                if (templateBytes + storedMatrixBytes(mBytes) > MaxTemplateMatrixBytes)
+                    break;
+                templateBytes += storedMatrixBytes(mBytes);
+
+                writer.addMatrix(m.data, mBytes);
+            }
+            writer.endTemplate(t->file.get<janus_template_id>("TEMPLATE_ID"));
+
+            if ((writer.bytes >= janus_gallery_type::MaxSegmentBytes) || (i == gallery->size() - 1)) {
+                gallery->segments.append(writer.write());
+                gallery->flattened = i + 1;
+                writer = FlatGalleryWriter();
+            }
+        }
+    }
+
+    // The caller's buffer may have been reused or modified since it was last flattened into, so every segment is written
+    QVector<quint64> directory;
+    quint64 end = align16(sizeof(SegmentedGalleryHeader));
+    for (int i=0; i<gallery->segments.size(); i++) {
+        memcpy(flat_gallery + end, gallery->segments[i].data(), gallery->segments[i].size());
+        directory << end << quint64(gallery->segments[i].size());
+        end = align16(end + gallery->segments[i].size());
     }
+    memcpy(flat_gallery + end, directory.data(), directory.size() * sizeof(quint64));
+
+    SegmentedGalleryHeader header;
+    header.magic = FlatGalleryMagic;
+    header.version = SegmentedGalleryVersion;
+    header.stamp = gallery->stamp;
+    header.segments = gallery->segments.size();
+    header.directory = end;
+    memcpy(flat_gallery, &header, sizeof(header));
+
+    *bytes = end + directory.size() * sizeof(quint64);
+
+    if ((gallery->segments.size() > janus_gallery_type::MaxSegments) && !gallery->compaction.isRunning())
+        gallery->compaction = QtConcurrent::run(janus_gallery_type::compact, gallery);
     return JANUS_SUCCESS;
 }
 
+// Wraps the matrices of a flat template in place
+static QList<cv::Mat> unflatten(const janus_flat_template flat_template, const size_t bytes)
+{
+    QList<cv::Mat> matrices;
+    janus_flat_template t = flat_template;
+    while (t < flat_template + bytes) {
+        const size_t matrixBytes = *reinterpret_cast<size_t*>(t);
+        t += sizeof(matrixBytes);
+        matrices.append(cv::Mat(1, matrixBytes, CV_8UC1, t));
+        t += matrixBytes;
+    }
+    return matrices;
+}
+
 janus_error janus_verify(const janus_flat_template a, const size_t a_bytes, const janus_flat_template b, const size_t b_bytes, float *similarity)
 {
     *similarity = 0;
 
-    int comparisons = 0;
-    janus_flat_template a_template = a;
-    while (a_template < a + a_bytes) {
-        const size_t a_template_bytes = *reinterpret_cast<size_t*>(a_template);
-        a_template += sizeof(a_template_bytes);
-        janus_flat_template b_template = b;
-        while (b_template < b + b_bytes) {
-                const size_t b_template_bytes = *reinterpret_cast<size_t*>(b_template);
-                b_template += sizeof(b_template_bytes);
-                *similarity += distance->compare(cv::Mat(1, a_template_bytes, CV_8UC1, a_template),
-                                                 cv::Mat(1, b_template_bytes, CV_8UC1, b_template));
-                comparisons++;
-
-                b_template += b_template_bytes;
-        }
-
-        a_template += a_template_bytes;
-    }
+    const QList<cv::Mat> aMatrices = unflatten(a, a_bytes);
+    const QList<cv::Mat> bMatrices = unflatten(b, b_bytes);
+    foreach (const cv::Mat &aMatrix, aMatrices)
+        foreach (const cv::Mat &bMatrix, bMatrices)
+            *similarity += distance->compare(aMatrix, bMatrix);
+    const int comparisons = aMatrices.size() * bMatrices.size();
 
     if (*similarity != *similarity) // True for NaN
         return JANUS_UNKNOWN_ERROR;
@@ -242,43 +492,56 @@ janus_error janus_verify(const janus_flat_template a, const size_t a_bytes, cons
     return JANUS_SUCCESS;
 }
 
+static bool compareCandidates(const QPair<float, janus_template_id> &a, const QPair<float, janus_template_id> &b)
+{
+    return a.first > b.first;
+}
+
 janus_error janus_search(const janus_flat_template probe, const size_t probe_bytes, const janus_flat_gallery gallery, const size_t gallery_bytes, const size_t requested_returns, janus_template_id *template_ids, float *similarities, size_t *actual_returns)
 {
-    typedef QPair<float, int> Pair;
-    QList<Pair> comparisons; comparisons.reserve(requested_returns);
-    janus_flat_gallery target_gallery = gallery;
-    while (target_gallery < gallery + gallery_bytes) {
-        janus_template_id target_id = *reinterpret_cast<janus_template_id*>(target_gallery);
-        target_gallery += sizeof(target_id);
-
-        const size_t target_template_bytes = *reinterpret_cast<size_t*>(target_gallery);
-        target_gallery += sizeof(target_template_bytes);
-        janus_flat_template target_template_flat = new janus_data[target_template_bytes];
-        memcpy(target_template_flat, target_gallery, target_template_bytes);
-        target_gallery += target_template_bytes;
-
-        float similarity;
-        JANUS_ASSERT(janus_verify(probe, probe_bytes, target_template_flat, target_template_bytes, &similarity))
-        if ((size_t)comparisons.size() < requested_returns) {
-            comparisons.append(Pair(similarity, target_id));
-            std::sort(comparisons.begin(), comparisons.end());
-        } else {
-            Pair temp = comparisons.first();
-            if (temp.first < similarity) {
-                comparisons.removeFirst();
-                comparisons.append(Pair(similarity, target_id));
-                std::sort(comparisons.begin(), comparisons.end());
+    QList<FlatGallery> segments;
+    if (!FlatGallery::parseSegments(gallery, gallery_bytes, segments))
+        return JANUS_UNKNOWN_ERROR;
+
+    // Wrap the probe matrices once, the gallery matrices are compared in place
+    const QList<cv::Mat> probeMatrices = unflatten(probe, probe_bytes);
+
+    // Min-heap of the best candidates, the weakest is at the front
+    typedef QPair<float, janus_template_id> Pair;
+    QVector<Pair> candidates; candidates.reserve(requested_returns);
+    foreach (const FlatGallery &flat, segments) {
+        for (quint64 i=0; i<flat.templates; i++) {
+            float similarity = 0;
+            int comparisons = 0;
+            foreach (const cv::Mat &a, probeMatrices)
+                for (quint64 j=flat.templateMatrices[i]; j<flat.templateMatrices[i+1]; j++) {
+                    similarity += distance->compare(a, cv::Mat(1, flat.matrixBytes[j], CV_8UC1, const_cast<janus_data*>(flat.features + flat.matrixOffsets[j])));
+                    comparisons++;
+                }
+
+            if (similarity != similarity) // True for NaN
+                return JANUS_UNKNOWN_ERROR;
+
+            if (comparisons > 0) similarity /= comparisons;
+            else                 similarity = -std::numeric_limits<float>::max();
+
+            if ((size_t)candidates.size() < requested_returns) {
+                candidates.append(Pair(similarity, flat.ids[i]));
+                std::push_heap(candidates.begin(), candidates.end(), compareCandidates);
+            } else if (!candidates.isEmpty() && (candidates.front().first < similarity)) {
+                std::pop_heap(candidates.begin(), candidates.end(), compareCandidates);
+                candidates.last() = Pair(similarity, flat.ids[i]);
+                std::push_heap(candidates.begin(), candidates.end(), compareCandidates);
             }
         }
-        delete[] target_template_flat;
     }
-    *actual_returns = comparisons.size();
-    QList<Pair> temp; temp.reserve(comparisons.size());
-    std::reverse_copy(comparisons.begin(), comparisons.end(), std::back_inserter(temp));
-    comparisons = temp;
-    foreach(const Pair &comparison, comparisons) {
-        *similarities = comparison.first; similarities++;
-        *template_ids = comparison.second; template_ids++;
+
+    // Descending similarity
+    std::sort_heap(candidates.begin(), candidates.end(), compareCandidates);
+    *actual_returns = candidates.size();
+    foreach (const Pair &candidate, candidates) {
+        *similarities = candidate.first; similarities++;
+        *template_ids = candidate.second; template_ids++;
     }
     return JANUS_SUCCESS;
 }
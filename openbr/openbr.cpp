@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QWaitCondition>
 #include <openbr/openbr_plugin.h>
 
 #include "core/bee.h"
@@ -59,7 +60,11 @@ void br_cat(int num_input_galleries, const char *input_galleries[], const char *
 
 void br_cluster(int num_simmats, const char *simmats[], float aggressiveness, const char *csv)
 {
-    ClusterSimmat(QtUtils::toStringList(num_simmats, simmats), aggressiveness, csv);
+    const File input(num_simmats == 1 ? simmats[0] : "");
+    if ((QStringList() << "gal" << "mem" << "template" << "ut" << "mmap" << "fgal" << "zgal" << "ivf").contains(input.suffix()))
+        ClusterGallery(input, aggressiveness, csv);
+    else
+        ClusterSimmat(QtUtils::toStringList(num_simmats, simmats), aggressiveness, csv);
 }
 
 void br_combine_masks(int num_input_masks, const char *input_masks[], const char *output_mask, const char *method)
@@ -74,8 +79,21 @@ void br_compare(const char *target_gallery, const char *query_gallery, const cha
 
 void br_compare_n(int num_targets, const char *target_galleries[], const char *query_gallery, const char *output)
 {
-    if (num_targets > 1) Compare(QtUtils::toStringList(num_targets, target_galleries).join(";")+"(separator=;)", File(query_gallery), File(output));
-    else                 Compare(File(target_galleries[0]), File(query_gallery), File(output));
+    File outputFile(output);
+    const QStringList targets = QtUtils::toStringList(num_targets, target_galleries);
+    if (num_targets == 1) {
+        if (outputFile.name.contains("%1")) outputFile.name = outputFile.name.arg(0);
+        Compare(File(targets.first()), File(query_gallery), outputFile);
+        return;
+    }
+
+    // The targets are compared as one concatenated gallery in a single pass,
+    // a %1 place marker in the output splits the scores back into one output per target
+    if (outputFile.name.contains("%1")) {
+        outputFile.set("plugin", "split");
+        outputFile.set("galleries", "[" + targets.join(",") + "]");
+    }
+    Compare(targets.join(";")+"(separator=;)", File(query_gallery), outputFile);
 }
 
 void br_pairwise_compare(const char *target_gallery, const char *query_gallery, const char *output)
@@ -279,6 +297,26 @@ void br_set_property(const char *key, const char *value)
     Globals->setProperty(key, value);
 }
 
+int br_startup_profile(char *buffer, int buffer_length)
+{
+    return partialCopy(Context::startupProfile(), buffer, buffer_length);
+}
+
+int br_stream_stats(char *buffer, int buffer_length)
+{
+    return partialCopy(streamStatistics(), buffer, buffer_length);
+}
+
+int br_memory_usage(char *buffer, int buffer_length)
+{
+    return partialCopy(Context::memoryUsage(), buffer, buffer_length);
+}
+
+int br_metrics(char *buffer, int buffer_length)
+{
+    return partialCopy(Context::metrics(), buffer, buffer_length);
+}
+
 int br_time_remaining()
 {
     return Globals->timeRemaining();
@@ -320,6 +358,78 @@ br_template br_load_img(const char *data, int len)
     return (br_template)tmpl;
 }
 
+// The reference count of a wrapped caller buffer, a cv::Mat's refcount points at its first member
+struct WrappedBuffer
+{
+    int refcount;
+    br_release_callback release;
+    void *context;
+};
+
+static void freeBuffer(void *buffer)
+{
+    cv::fastFree(buffer);
+}
+
+// Calls the release callback when the last cv::Mat referencing a wrapped buffer is released.
+// Matrices later created through a wrapped header get an ordinary buffer freed by this allocator too.
+class WrappedBufferAllocator : public cv::MatAllocator
+{
+    void allocate(int dims, const int *sizes, int type, int *&refcount, uchar *&datastart, uchar *&data, size_t *step)
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i=dims-1; i>=0; i--) {
+            if (step)
+                step[i] = total;
+            total *= sizes[i];
+        }
+        datastart = data = (uchar*) cv::fastMalloc(total);
+        refcount = &wrap(freeBuffer, datastart)->refcount;
+    }
+
+    void deallocate(int *refcount, uchar *datastart, uchar *data)
+    {
+        (void) datastart;
+        (void) data;
+        WrappedBuffer *buffer = reinterpret_cast<WrappedBuffer*>(refcount);
+        if (buffer->release)
+            buffer->release(buffer->context);
+        delete buffer;
+    }
+
+public:
+    static WrappedBuffer *wrap(br_release_callback release, void *context)
+    {
+        WrappedBuffer *buffer = new WrappedBuffer();
+        buffer->refcount = 1;
+        buffer->release = release;
+        buffer->context = context;
+        return buffer;
+    }
+};
+
+static WrappedBufferAllocator wrappedBufferAllocator;
+
+br_template br_wrap_img(unsigned char *data, int rows, int cols, int channels, int stride, br_release_callback release, void *context)
+{
+    cv::Mat img(rows, cols, CV_8UC(channels), data, stride > 0 ? size_t(stride) : size_t(cv::Mat::AUTO_STEP));
+    img.refcount = &WrappedBufferAllocator::wrap(release, context)->refcount;
+    img.allocator = &wrappedBufferAllocator;
+    return (br_template) new Template(img);
+}
+
+br_template_list br_wrap_imgs(int num_images, unsigned char *data[], const int rows[], const int cols[], const int channels[], const int strides[], br_release_callback release, void *contexts[])
+{
+    TemplateList *tl = new TemplateList();
+    tl->reserve(num_images);
+    for (int i=0; i<num_images; i++) {
+        Template *t = reinterpret_cast<Template*>(br_wrap_img(data[i], rows[i], cols[i], channels[i], strides ? strides[i] : 0, release, contexts ? contexts[i] : NULL));
+        tl->append(*t);
+        delete t;
+    }
+    return (br_template_list)tl;
+}
+
 unsigned char *br_unload_img(br_template tmpl)
 {
     Template *t = reinterpret_cast<Template*>(tmpl);
@@ -376,6 +486,18 @@ bool br_img_is_empty(br_template tmpl)
     return t->m().empty();
 }
 
+int br_img_depth(br_template tmpl)
+{
+    Template *t = reinterpret_cast<Template*>(tmpl);
+    return t->m().depth();
+}
+
+int br_img_step(br_template tmpl)
+{
+    Template *t = reinterpret_cast<Template*>(tmpl);
+    return int(t->m().step[0]);
+}
+
 int br_get_filename(char *buffer, int buffer_length, br_template tmpl)
 {
     return partialCopy(reinterpret_cast<Template*>(tmpl)->file.name, buffer, buffer_length);
@@ -409,6 +531,77 @@ void br_enroll_template_list(br_template_list tl)
     Enroll(*realTL);
 }
 
+struct AsyncEnrollment
+{
+    br_enroll_callback callback;
+    void *context;
+};
+
+static QMutex asyncEnrollmentsLock;
+static QWaitCondition asyncEnrollmentsDone;
+static int asyncEnrollments = 0;
+
+static void asyncEnrolled(const TemplateList &enrolled, void *context)
+{
+    AsyncEnrollment *enrollment = reinterpret_cast<AsyncEnrollment*>(context);
+    enrollment->callback((br_template_list) new TemplateList(enrolled), enrollment->context);
+    delete enrollment;
+
+    QMutexLocker locker(&asyncEnrollmentsLock);
+    if (--asyncEnrollments == 0)
+        asyncEnrollmentsDone.wakeAll();
+}
+
+bool br_enroll_template_list_async(br_template_list tl, br_enroll_callback callback, void *context)
+{
+    if ((tl == NULL) || (callback == NULL)) {
+        qWarning("br_enroll_template_list_async requires a template list and a callback.");
+        return false;
+    }
+
+    AsyncEnrollment *enrollment = new AsyncEnrollment();
+    enrollment->callback = callback;
+    enrollment->context = context;
+
+    asyncEnrollmentsLock.lock();
+    asyncEnrollments++;
+    asyncEnrollmentsLock.unlock();
+
+    EnrollAsync(*reinterpret_cast<TemplateList*>(tl), asyncEnrolled, enrollment);
+    return true;
+}
+
+void br_wait_enrollments()
+{
+    QMutexLocker locker(&asyncEnrollmentsLock);
+    while (asyncEnrollments > 0)
+        asyncEnrollmentsDone.wait(&asyncEnrollmentsLock);
+}
+
+br_algorithm br_load_algorithm(const char *description, int parallelism, int block_size)
+{
+    return (br_algorithm) new br::AlgorithmHandle(description, parallelism, block_size);
+}
+
+void br_free_algorithm(br_algorithm algorithm)
+{
+    delete reinterpret_cast<br::AlgorithmHandle*>(algorithm);
+}
+
+void br_algorithm_enroll(br_algorithm algorithm, br_template_list tl)
+{
+    reinterpret_cast<br::AlgorithmHandle*>(algorithm)->enroll(*reinterpret_cast<TemplateList*>(tl));
+}
+
+br_matrix_output br_algorithm_compare(br_algorithm algorithm, br_template_list target, br_template_list query)
+{
+    TemplateList *targetTL = reinterpret_cast<TemplateList*>(target);
+    TemplateList *queryTL = reinterpret_cast<TemplateList*>(query);
+    MatrixOutput *output = MatrixOutput::make(targetTL->files(), queryTL->files());
+    reinterpret_cast<br::AlgorithmHandle*>(algorithm)->compare(*targetTL, *queryTL, output);
+    return (br_matrix_output)output;
+}
+
 br_matrix_output br_compare_template_lists(br_template_list target, br_template_list query)
 {
     TemplateList *targetTL = reinterpret_cast<TemplateList*>(target);
@@ -418,12 +611,39 @@ br_matrix_output br_compare_template_lists(br_template_list target, br_template_
     return (br_matrix_output)output;
 }
 
+void br_search(br_template_list gallery, br_template_list probes, int k, int *indices, float *scores)
+{
+    TemplateList *galleryTL = reinterpret_cast<TemplateList*>(gallery);
+    TemplateList *probesTL = reinterpret_cast<TemplateList*>(probes);
+    QSharedPointer<Distance> distance = Distance::fromAlgorithm(Globals->algorithm);
+    if (distance.isNull()) qFatal("%s does not compare templates.", qPrintable(Globals->algorithm));
+    searchTopK(distance.data(), *galleryTL, *probesTL, k, indices, scores);
+}
+
 float br_get_matrix_output_at(br_matrix_output output, int row, int col)
 {
     MatrixOutput *matOut = reinterpret_cast<MatrixOutput*>(output);
     return matOut->data.at<float>(row, col);
 }
 
+float *br_get_matrix_output_data(br_matrix_output output)
+{
+    MatrixOutput *matOut = reinterpret_cast<MatrixOutput*>(output);
+    return matOut->data.ptr<float>();
+}
+
+int br_matrix_output_rows(br_matrix_output output)
+{
+    MatrixOutput *matOut = reinterpret_cast<MatrixOutput*>(output);
+    return matOut->data.rows;
+}
+
+int br_matrix_output_cols(br_matrix_output output)
+{
+    MatrixOutput *matOut = reinterpret_cast<MatrixOutput*>(output);
+    return matOut->data.cols;
+}
+
 br_template br_get_template(br_template_list tl, int index)
 {
     TemplateList *realTL = reinterpret_cast<TemplateList*>(tl);
@@ -436,6 +656,42 @@ int br_num_templates(br_template_list tl)
     return realTL->size();
 }
 
+int br_template_list_feature_size(br_template_list tl)
+{
+    TemplateList *realTL = reinterpret_cast<TemplateList*>(tl);
+    int size = -1;
+    foreach (const Template &t, *realTL) {
+        // Templates that failed to enroll have no matrix, their rows are filled with NaN
+        if (t.isEmpty())
+            continue;
+        const int elements = int(t.m().total() * t.m().channels());
+        if ((size != -1) && (elements != size))
+            return -1;
+        size = elements;
+    }
+    return size;
+}
+
+bool br_template_list_features(br_template_list tl, float *features)
+{
+    TemplateList *realTL = reinterpret_cast<TemplateList*>(tl);
+    const int size = br_template_list_feature_size(tl);
+    if (size < 0)
+        return realTL->isEmpty();
+
+    // Each template is converted straight into its row of the caller's buffer
+    for (int i=0; i<realTL->size(); i++) {
+        if ((*realTL)[i].isEmpty()) {
+            std::fill(features + qint64(i) * size, features + qint64(i+1) * size, std::numeric_limits<float>::quiet_NaN());
+            continue;
+        }
+        const cv::Mat &m = (*realTL)[i].m();
+        cv::Mat row(m.rows, m.cols, CV_MAKETYPE(CV_32F, m.channels()), features + qint64(i) * size);
+        m.convertTo(row, CV_32F);
+    }
+    return true;
+}
+
 br_gallery br_make_gallery(const char *gallery)
 {
     Gallery *gal = Gallery::make(File(gallery));
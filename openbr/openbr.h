@@ -105,6 +105,14 @@ BR_EXPORT void br_set_header(const char *matrix, const char *target_gallery, con
 
 BR_EXPORT void br_set_property(const char *key, const char *value);
 
+BR_EXPORT int br_startup_profile(char * buffer, int buffer_length);
+
+BR_EXPORT int br_stream_stats(char * buffer, int buffer_length);
+
+BR_EXPORT int br_memory_usage(char * buffer, int buffer_length);
+
+BR_EXPORT int br_metrics(char * buffer, int buffer_length);
+
 BR_EXPORT int br_time_remaining();
 
 BR_EXPORT void br_train(const char *input, const char *model = "");
@@ -123,9 +131,16 @@ typedef void* br_template;
 typedef void* br_template_list;
 typedef void* br_gallery;
 typedef void* br_matrix_output;
+typedef void* br_algorithm;
+typedef void (*br_release_callback)(void *context);
+typedef void (*br_enroll_callback)(br_template_list enrolled, void *context);
 
 BR_EXPORT br_template br_load_img(const char *data, int len);
 
+BR_EXPORT br_template br_wrap_img(unsigned char *data, int rows, int cols, int channels, int stride = 0, br_release_callback release = 0, void *context = 0);
+
+BR_EXPORT br_template_list br_wrap_imgs(int num_images, unsigned char *data[], const int rows[], const int cols[], const int channels[], const int strides[] = 0, br_release_callback release = 0, void *contexts[] = 0);
+
 BR_EXPORT unsigned char* br_unload_img(br_template tmpl);
 
 BR_EXPORT br_template_list br_template_list_from_buffer(const char *buf, int len);
@@ -144,6 +159,10 @@ BR_EXPORT int br_img_channels(br_template tmpl);
 
 BR_EXPORT bool br_img_is_empty(br_template tmpl);
 
+BR_EXPORT int br_img_depth(br_template tmpl);
+
+BR_EXPORT int br_img_step(br_template tmpl);
+
 BR_EXPORT int br_get_filename(char * buffer, int buffer_length, br_template tmpl);
 
 BR_EXPORT void br_set_filename(br_template tmpl, const char *filename);
@@ -154,14 +173,38 @@ BR_EXPORT br_template_list br_enroll_template(br_template tmpl);
 
 BR_EXPORT void br_enroll_template_list(br_template_list tl);
 
+BR_EXPORT bool br_enroll_template_list_async(br_template_list tl, br_enroll_callback callback, void *context);
+
+BR_EXPORT void br_wait_enrollments();
+
+BR_EXPORT br_algorithm br_load_algorithm(const char *description, int parallelism, int block_size);
+
+BR_EXPORT void br_free_algorithm(br_algorithm algorithm);
+
+BR_EXPORT void br_algorithm_enroll(br_algorithm algorithm, br_template_list tl);
+
+BR_EXPORT br_matrix_output br_algorithm_compare(br_algorithm algorithm, br_template_list target, br_template_list query);
+
 BR_EXPORT br_matrix_output br_compare_template_lists(br_template_list target, br_template_list query);
 
 BR_EXPORT float br_get_matrix_output_at(br_matrix_output output, int row, int col);
 
+BR_EXPORT float *br_get_matrix_output_data(br_matrix_output output);
+
+BR_EXPORT int br_matrix_output_rows(br_matrix_output output);
+
+BR_EXPORT int br_matrix_output_cols(br_matrix_output output);
+
+BR_EXPORT void br_search(br_template_list gallery, br_template_list probes, int k, int *indices, float *scores);
+
 BR_EXPORT br_template br_get_template(br_template_list tl, int index);
 
 BR_EXPORT int br_num_templates(br_template_list tl);
 
+BR_EXPORT int br_template_list_feature_size(br_template_list tl);
+
+BR_EXPORT bool br_template_list_features(br_template_list tl, float *features);
+
 BR_EXPORT br_gallery br_make_gallery(const char *gallery);
 
 BR_EXPORT br_template_list br_load_from_gallery(br_gallery gallery);
@@ -16,6 +16,7 @@
 
 #include <QCoreApplication>
 #include <QCryptographicHash>
+#include <QElapsedTimer>
 #include <QFutureSynchronizer>
 #include <QJsonDocument>
 #include <QJsonObject>
@@ -24,9 +25,12 @@
 #include <qnumeric.h>
 #include <QPointF>
 #include <QProcess>
+#include <QReadWriteLock>
 #include <QRect>
 #include <QRegExp>
+#include <QScopedPointer>
 #include <QThreadPool>
+#include <QThreadStorage>
 #include <QtConcurrentRun>
 #include <algorithm>
 #include <iostream>
@@ -39,6 +43,7 @@
 #include "openbr_plugin.h"
 #include "version.h"
 #include "core/bee.h"
+#include "core/affinity.h"
 #include "core/common.h"
 #include "core/opencvutils.h"
 #include "core/qtutils.h"
@@ -59,7 +64,159 @@ static const QMetaObject *getInterface(const QObject *obj)
     return baseClass;
 }
 
+/* MetadataKey - public methods */
+namespace
+{
+
+struct MetadataKeys
+{
+    QReadWriteLock lock;
+    QHash<QString,int> ids;
+    QStringList names;
+};
+
+// Function statics so keys can be interned during static initialization of other translation units
+MetadataKeys &metadataKeys()
+{
+    static MetadataKeys keys;
+    return keys;
+}
+
+// Each thread caches the ids it has looked up, so interning a known key takes no lock
+QHash<QString,int> &localMetadataKeys()
+{
+    static QThreadStorage< QHash<QString,int> > cache;
+    return cache.localData();
+}
+
+} // namespace
+
+MetadataKey::MetadataKey(const QString &name)
+{
+    QHash<QString,int> &cache = localMetadataKeys();
+    QHash<QString,int>::const_iterator it = cache.constFind(name);
+    if (it != cache.constEnd()) {
+        id = it.value();
+        return;
+    }
+
+    MetadataKeys &keys = metadataKeys();
+    keys.lock.lockForRead();
+    id = keys.ids.value(name, -1);
+    keys.lock.unlock();
+
+    if (id == -1) {
+        QWriteLocker locker(&keys.lock);
+        id = keys.ids.value(name, -1);
+        if (id == -1) {
+            id = keys.names.size();
+            keys.names.append(name);
+            keys.ids.insert(name, id);
+        }
+    }
+    cache.insert(name, id);
+}
+
+QString MetadataKey::name() const
+{
+    MetadataKeys &keys = metadataKeys();
+    QReadLocker locker(&keys.lock);
+    return keys.names[id];
+}
+
+/* Metadata - public methods */
+Metadata::Metadata(const QVariantMap &map)
+{
+    entries.reserve(map.size());
+    for (QVariantMap::const_iterator it = map.constBegin(); it != map.constEnd(); ++it) {
+        Entry entry;
+        entry.key = MetadataKey(it.key()).id;
+        entry.value = it.value();
+        entries.append(entry);
+    }
+}
+
+void Metadata::remove(const MetadataKey &key)
+{
+    for (int i=0; i<entries.size(); i++)
+        if (entries[i].key == key.id) {
+            entries.remove(i);
+            return;
+        }
+}
+
+void Metadata::unite(const Metadata &other)
+{
+    if (isEmpty()) {
+        entries = other.entries;
+        return;
+    }
+
+    foreach (const Entry &entry, other.entries)
+        slot(entry.key) = entry.value;
+}
+
+QStringList Metadata::keys() const
+{
+    QStringList keys;
+    keys.reserve(entries.size());
+    MetadataKeys &interned = metadataKeys();
+    interned.lock.lockForRead();
+    foreach (const Entry &entry, entries)
+        keys.append(interned.names[entry.key]);
+    interned.lock.unlock();
+    qSort(keys);
+    return keys;
+}
+
+QVariantMap Metadata::toMap() const
+{
+    QVariantMap map;
+    MetadataKeys &interned = metadataKeys();
+    QReadLocker locker(&interned.lock);
+    foreach (const Entry &entry, entries)
+        map.insert(interned.names[entry.key], entry.value);
+    return map;
+}
+
+bool Metadata::operator==(const Metadata &other) const
+{
+    if (entries.size() != other.entries.size())
+        return false;
+
+    foreach (const Entry &entry, entries) {
+        bool found = false;
+        foreach (const Entry &otherEntry, other.entries)
+            if (otherEntry.key == entry.key) {
+                if (!(otherEntry.value == entry.value))
+                    return false;
+                found = true;
+                break;
+            }
+        if (!found)
+            return false;
+    }
+    return true;
+}
+
+/* Metadata - private methods */
+QVariant &Metadata::slot(int key)
+{
+    for (int i=0; i<entries.size(); i++)
+        if (entries[i].key == key)
+            return entries[i].value;
+
+    Entry entry;
+    entry.key = key;
+    entries.append(entry);
+    return entries.last().value;
+}
+
 /* File - public methods */
+static const MetadataKey &nameKey() { static const MetadataKey key("name"); return key; }
+static const MetadataKey &pointsKey() { static const MetadataKey key("Points"); return key; }
+static const MetadataKey &rectsKey() { static const MetadataKey key("Rects"); return key; }
+
 // Note that the convention for displaying metadata is as follows:
 // [] for lists in which argument order does not matter (e.g. [FTO=false, Index=0]),
 // () for lists in which argument order matters (e.g. First_Eye(100.0,100.0)).
@@ -99,7 +256,7 @@ void File::append(const File &other)
             name += value("separator").toString() + other.name;
         }
     }
-    append(other.m_metadata);
+    m_metadata.unite(other.m_metadata);
     fte = fte | other.fte;
 }
 
@@ -115,7 +272,7 @@ QList<File> File::split(const QString &separator) const
     QList<File> files;
     foreach (const QString &word, name.split(separator, QString::SkipEmptyParts)) {
         File file(word);
-        file.append(m_metadata);
+        file.m_metadata.unite(m_metadata);
         files.append(file);
     }
     return files;
@@ -136,9 +293,9 @@ QString File::resolved() const
     return name;
 }
 
-bool File::contains(const QString &key) const
+bool File::contains(const MetadataKey &key) const
 {
-    return m_metadata.contains(key) || Globals->contains(key) || key == "name";
+    return m_metadata.contains(key) || Globals->contains(key.name()) || (key.id == nameKey().id);
 }
 
 bool File::contains(const QStringList &keys) const
@@ -149,9 +306,10 @@ bool File::contains(const QStringList &keys) const
     return true;
 }
 
-QVariant File::value(const QString &key) const
+QVariant File::value(const MetadataKey &key) const
 {
-    return m_metadata.contains(key) ? m_metadata.value(key) : (key == "name" ? name : Globals->property(qPrintable(key)));
+    const QVariant *local = m_metadata.find(key);
+    return local ? *local : (key.id == nameKey().id ? name : Globals->property(qPrintable(key.name())));
 }
 
 QVariant File::parse(const QString &value)
@@ -180,7 +338,7 @@ void File::set(const QString &key, const QString &value)
     }
 }
 
-bool File::getBool(const QString &key, bool defaultValue) const
+bool File::getBool(const MetadataKey &key, bool defaultValue) const
 {
     if (!contains(key)) return defaultValue;
     QVariant variant = value(key);
@@ -191,8 +349,8 @@ bool File::getBool(const QString &key, bool defaultValue) const
 QList<QPointF> File::namedPoints() const
 {
     QList<QPointF> landmarks;
-    foreach (const QString &key, localMetadata().keys()) {
-        const QVariant &variant = m_metadata[key];
+    foreach (const QString &key, localKeys()) {
+        const QVariant variant = m_metadata.value(MetadataKey(key));
         if (variant.canConvert<QPointF>()) {
             const QPointF point = variant.value<QPointF>();
             if (!qIsNaN(point.x()) && !qIsNaN(point.y()))
@@ -205,31 +363,32 @@ QList<QPointF> File::namedPoints() const
 QList<QPointF> File::points() const
 {
     QList<QPointF> points;
-    foreach (const QVariant &point, m_metadata["Points"].toList())
+    foreach (const QVariant &point, m_metadata.value(pointsKey()).toList())
         points.append(point.toPointF());
     return points;
 }
 
 void File::appendPoint(const QPointF &point)
 {
-    QList<QVariant> newPoints = m_metadata["Points"].toList();
+    QVariant &points = m_metadata[pointsKey()];
+    QList<QVariant> newPoints = points.toList();
     newPoints.append(point);
-    m_metadata["Points"] = newPoints;
+    points = newPoints;
 }
 
 void File::appendPoints(const QList<QPointF> &points)
 {
-    QList<QVariant> newPoints = m_metadata["Points"].toList();
+    QList<QVariant> newPoints = m_metadata.value(pointsKey()).toList();
     foreach (const QPointF &point, points)
         newPoints.append(point);
-    m_metadata["Points"] = newPoints;
+    m_metadata.insert(pointsKey(), newPoints);
 }
 
 QList<QRectF> File::namedRects() const
 {
     QList<QRectF> rects;
-    foreach (const QString &key, localMetadata().keys()) {
-        const QVariant &variant = m_metadata[key];
+    foreach (const QString &key, localKeys()) {
+        const QVariant variant = m_metadata.value(MetadataKey(key));
         if (variant.canConvert<QRectF>())
             rects.append(variant.value<QRectF>());
         else if (variant.canConvert<QList<QRectF> >()) {
@@ -246,16 +405,17 @@ QList<QRectF> File::namedRects() const
 QList<QRectF> File::rects() const
 {
     QList<QRectF> rects;
-    foreach (const QVariant &rect, m_metadata["Rects"].toList())
+    foreach (const QVariant &rect, m_metadata.value(rectsKey()).toList())
         rects.append(rect.toRect());
     return rects;
 }
 
 void File::appendRect(const QRectF &rect)
 {
-    QList<QVariant> newRects = m_metadata["Rects"].toList();
+    QVariant &rects = m_metadata[rectsKey()];
+    QList<QVariant> newRects = rects.toList();
     newRects.append(rect);
-    m_metadata["Rects"] = newRects;
+    rects = newRects;
 }
 
 void File::appendRect(const cv::Rect &rect)
@@ -265,10 +425,10 @@ void File::appendRect(const cv::Rect &rect)
 
 void File::appendRects(const QList<QRectF> &rects)
 {
-    QList<QVariant> newRects = m_metadata["Rects"].toList();
+    QList<QVariant> newRects = m_metadata.value(rectsKey()).toList();
     foreach (const QRectF &rect, rects)
         newRects.append(rect);
-    m_metadata["Rects"] = newRects;
+    m_metadata.insert(rectsKey(), newRects);
 }
 
 void File::appendRects(const QList<cv::Rect> &rects)
@@ -323,12 +483,14 @@ QDataStream &br::operator<<(QDataStream &stream, const File &file)
 {
     File temp = file;
     temp.set("FTE",QVariant::fromValue(file.fte));
-    return stream << temp.name << temp.m_metadata;
+    return stream << temp.name << temp.m_metadata.toMap();
 }
 
 QDataStream &br::operator>>(QDataStream &stream, File &file)
 {
-    stream >> file.name >> file.m_metadata;
+    QVariantMap metadata;
+    stream >> file.name >> metadata;
+    file.m_metadata = metadata;
     file.fte = file.getBool("FTE", false);
     return stream;
 }
@@ -1083,6 +1245,17 @@ void br::Context::printStatus()
     }
 }
 
+int br::Context::tunedBlockSize(qint64 templateBytes) const
+{
+    if (templateBytes <= 0)
+        return blockSize;
+
+    // Enough templates to fill each thread's working set, as long as every block in flight fits the memory budget
+    const qint64 perThread = std::max(qint64(1), qint64(blockWorkingSet) * 1024 / templateBytes);
+    const qint64 budget = qint64(blockMemory) * 1024 * 1024 / templateBytes;
+    return int(std::max(qint64(1), std::min(std::min(perThread * std::max(parallelism, 1), budget), qint64(std::numeric_limits<int>::max()))));
+}
+
 float br::Context::progress() const
 {
     if (totalSteps == 0) return -1;
@@ -1123,8 +1296,29 @@ bool br::Context::checkSDKPath(const QString &sdkPath)
 // We create our own when the user hasn't
 static QCoreApplication *application = NULL;
 
+static QMutex initializersLock(QMutex::Recursive); // Deferred initializers may make plugins themselves
+static QList< QSharedPointer<Initializer> > initializers; // In the order they were initialized
+static QHash< QString, QSharedPointer<Initializer> > deferredInitializers; // QHash<plugin,initializer>
+static QAtomicInt deferredCount(0); // Lets Factory::make skip the lock once nothing is deferred
+static QList< QPair<QString, double> > startupTimes; // QList<QPair<stage,ms> >
+
+static void recordStartup(const QString &stage, QElapsedTimer &timer)
+{
+    startupTimes.append(QPair<QString, double>(stage, timer.nsecsElapsed() / 1e6));
+    timer.restart();
+}
+
+static QString initializerName(const Initializer *initializer)
+{
+    return QString(initializer->metaObject()->className()).remove("br::");
+}
+
 void br::Context::initialize(int &argc, char *argv[], QString sdkPath, bool useGui)
 {
+    QElapsedTimer timer;
+    timer.start();
+    startupTimes.clear();
+
     qInstallMessageHandler(messageHandler);
 
     QString sep;
@@ -1156,6 +1350,7 @@ void br::Context::initialize(int &argc, char *argv[], QString sdkPath, bool useG
     QCoreApplication::setOrganizationName(COMPANY_NAME);
     QCoreApplication::setApplicationName(PRODUCT_NAME);
     QCoreApplication::setApplicationVersion(PRODUCT_VERSION);
+    recordStartup("Application", timer);
 
     qRegisterMetaType<cv::Mat>();
     qRegisterMetaType<br::File>();
@@ -1206,19 +1401,219 @@ void br::Context::initialize(int &argc, char *argv[], QString sdkPath, bool useG
     Globals->sdkPath = sdkPath;
 
     QThreadPool::globalInstance()->setMaxThreadCount(Globals->parallelism);
+    recordStartup("Context", timer);
+
+    // Defer the initializers that only serve specific plugins, before any others run and might make those plugins
+    QMutexLocker locker(&initializersLock);
+    QList< QSharedPointer<Initializer> > immediate;
+    foreach (const QSharedPointer<Initializer> &initializer, Factory<Initializer>::makeAll()) {
+        initializer->registerAbbreviations();
+        const QStringList plugins = initializer->plugins();
+        if (plugins.isEmpty()) {
+            immediate.append(initializer);
+        } else {
+            foreach (const QString &plugin, plugins)
+                deferredInitializers.insert(plugin, initializer);
+            recordStartup("Initializer " + initializerName(initializer.data()) + " (deferred)", timer);
+        }
+    }
+    deferredCount = deferredInitializers.size();
 
-    // Trigger registered initializers
-    QList< QSharedPointer<Initializer> > initializers = Factory<Initializer>::makeAll();
-    foreach (const QSharedPointer<Initializer> &initializer, initializers)
+    // Trigger the remaining registered initializers
+    foreach (const QSharedPointer<Initializer> &initializer, immediate) {
         initializer->initialize();
+        initializers.append(initializer);
+        recordStartup("Initializer " + initializerName(initializer.data()), timer);
+    }
+}
+
+void br::Context::initializePlugin(const QString &name)
+{
+    if (deferredCount.load() == 0)
+        return;
+
+    QMutexLocker locker(&initializersLock);
+    const QSharedPointer<Initializer> initializer = deferredInitializers.value(name);
+    if (initializer.isNull())
+        return;
+
+    // Forgotten before initializing in case initialize() makes one of its own plugins,
+    // while deferredCount stays set so other threads wait on the lock until it finishes.
+    foreach (const QString &plugin, initializer->plugins())
+        deferredInitializers.remove(plugin);
+
+    QElapsedTimer timer;
+    timer.start();
+    initializer->initialize();
+    initializers.append(initializer);
+    recordStartup("Initializer " + initializerName(initializer.data()) + " (first " + name + ")", timer);
+    deferredCount = deferredInitializers.size();
+}
+
+QString br::Context::startupProfile()
+{
+    QMutexLocker locker(&initializersLock);
+    QStringList lines;
+    double total = 0;
+    for (int i=0; i<startupTimes.size(); i++) {
+        lines.append(startupTimes[i].first + "\t" + QString::number(startupTimes[i].second, 'f', 3));
+        total += startupTimes[i].second;
+    }
+    lines.append("Total\t" + QString::number(total, 'f', 3));
+    return "Stage\tms\n" + lines.join("\n");
+}
+
+// Bytes currently held and the most held by each subsystem, and their sum
+static QMutex memoryLock;
+static QMap<QString, QPair<qint64, qint64> > memoryHeld;
+static qint64 memoryTotal = 0;
+
+static qint64 memoryLimitBytes()
+{
+    return (Globals && (Globals->memoryLimit > 0)) ? qint64(Globals->memoryLimit) * 1024 * 1024 : std::numeric_limits<qint64>::max();
+}
+
+void br::Context::trackMemory(const QString &subsystem, qint64 bytes)
+{
+    QMutexLocker locker(&memoryLock);
+    QPair<qint64, qint64> &held = memoryHeld[subsystem];
+    held.first += bytes;
+    held.second = std::max(held.second, held.first);
+    memoryTotal += bytes;
+    const bool exceeded = (bytes > 0) && (memoryTotal > memoryLimitBytes());
+    locker.unlock();
+
+    // Fail with an explanation rather than be killed by the kernel later
+    if (exceeded)
+        qFatal("%s needs %lld more bytes, exceeding the memory limit of %d MB.\n%s", qPrintable(subsystem), bytes, Globals->memoryLimit, qPrintable(memoryUsage()));
+}
+
+bool br::Context::reserveMemory(const QString &subsystem, qint64 bytes)
+{
+    QMutexLocker locker(&memoryLock);
+    if ((bytes > 0) && (memoryTotal + bytes > memoryLimitBytes()))
+        return false;
+    QPair<qint64, qint64> &held = memoryHeld[subsystem];
+    held.first += bytes;
+    held.second = std::max(held.second, held.first);
+    memoryTotal += bytes;
+    return true;
+}
+
+qint64 br::Context::memoryAvailable()
+{
+    const qint64 limit = memoryLimitBytes();
+    if (limit == std::numeric_limits<qint64>::max())
+        return limit;
+    QMutexLocker locker(&memoryLock);
+    return std::max(limit - memoryTotal, qint64(0));
+}
+
+QString br::Context::memoryUsage()
+{
+    QMutexLocker locker(&memoryLock);
+    QStringList lines;
+    qint64 total = 0;
+    for (QMap<QString, QPair<qint64, qint64> >::const_iterator i = memoryHeld.constBegin(); i != memoryHeld.constEnd(); ++i) {
+        lines.append(i.key() + "\t" + QString::number(i.value().first) + "\t" + QString::number(i.value().second));
+        total += i.value().first;
+    }
+    lines.append("Total\t" + QString::number(total));
+    return "Subsystem\tBytes\tPeak bytes\n" + lines.join("\n");
+}
+
+// Metrics in the Prometheus text format, names ending in _total are counters and the rest gauges
+struct MetricHistogram
+{
+    QVector<qint64> counts; // Per bucket, not cumulative
+    double sum;
+    qint64 count;
+
+    MetricHistogram() : sum(0), count(0) {}
+};
+
+static QMutex metricsLock;
+static QMap<QString, double> metricValues;
+static QMap<QString, MetricHistogram> metricHistograms;
+static const double metricBuckets[] = { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+static const int numMetricBuckets = sizeof(metricBuckets) / sizeof(metricBuckets[0]);
+
+void br::Context::addMetric(const QString &name, double value)
+{
+    QMutexLocker locker(&metricsLock);
+    metricValues[name] += value;
+}
+
+void br::Context::setMetric(const QString &name, double value)
+{
+    QMutexLocker locker(&metricsLock);
+    metricValues[name] = value;
+}
+
+void br::Context::observeMetric(const QString &name, double value)
+{
+    const int bucket = std::lower_bound(metricBuckets, metricBuckets + numMetricBuckets, value) - metricBuckets;
+    QMutexLocker locker(&metricsLock);
+    MetricHistogram &histogram = metricHistograms[name];
+    if (histogram.counts.isEmpty())
+        histogram.counts = QVector<qint64>(numMetricBuckets + 1, 0);
+    histogram.counts[bucket]++;
+    histogram.sum += value;
+    histogram.count++;
+}
+
+QString br::Context::metrics()
+{
+    QMap<QString, double> values;
+    if (Globals) {
+        values["br_progress_current_step"] = Globals->currentStep;
+        values["br_progress_total_steps"] = Globals->totalSteps;
+    }
+    {
+        QMutexLocker locker(&memoryLock);
+        for (QMap<QString, QPair<qint64, qint64> >::const_iterator i = memoryHeld.constBegin(); i != memoryHeld.constEnd(); ++i)
+            values["br_memory_bytes{subsystem=\"" + i.key() + "\"}"] = i.value().first;
+    }
+
+    QMutexLocker locker(&metricsLock);
+    for (QMap<QString, double>::const_iterator i = metricValues.constBegin(); i != metricValues.constEnd(); ++i)
+        values[i.key()] = i.value();
+
+    QStringList lines;
+    QString family;
+    for (QMap<QString, double>::const_iterator i = values.constBegin(); i != values.constEnd(); ++i) {
+        const QString name = i.key().left(i.key().indexOf('{'));
+        if (name != family) {
+            family = name;
+            lines.append("# TYPE " + family + (family.endsWith("_total") ? " counter" : " gauge"));
+        }
+        lines.append(i.key() + " " + QString::number(i.value(), 'g', 15));
+    }
+
+    for (QMap<QString, MetricHistogram>::const_iterator i = metricHistograms.constBegin(); i != metricHistograms.constEnd(); ++i) {
+        lines.append("# TYPE " + i.key() + " histogram");
+        qint64 cumulative = 0;
+        for (int j=0; j<numMetricBuckets; j++) {
+            cumulative += i.value().counts[j];
+            lines.append(i.key() + "_bucket{le=\"" + QString::number(metricBuckets[j]) + "\"} " + QString::number(cumulative));
+        }
+        lines.append(i.key() + "_bucket{le=\"+Inf\"} " + QString::number(i.value().count));
+        lines.append(i.key() + "_sum " + QString::number(i.value().sum, 'g', 15));
+        lines.append(i.key() + "_count " + QString::number(i.value().count));
+    }
+    return lines.join("\n") + "\n";
 }
 
 void br::Context::finalize()
 {
-    // Trigger registered finalizers
-    QList< QSharedPointer<Initializer> > initializers = Factory<Initializer>::makeAll();
+    // Trigger registered finalizers, only for initializers that were initialized
+    QMutexLocker locker(&initializersLock);
     foreach (const QSharedPointer<Initializer> &initializer, initializers)
         initializer->finalize();
+    initializers.clear();
+    deferredInitializers.clear();
+    deferredCount = 0;
+    locker.unlock();
 
     delete Globals;
     Globals = NULL;
@@ -1358,6 +1753,13 @@ void Output::setRelative(float value, int i, int j)
     if (!next.isNull()) next->setRelative(value, i, j);
 }
 
+float Output::boundRelative(int i, int j) const
+{
+    // Only scores discarded by every chained output can be skipped
+    const float value = bound(i+offset.y(), j+offset.x());
+    return next.isNull() ? value : std::min(value, next->boundRelative(i, j));
+}
+
 Output *Output::make(const File &file, const FileList &targetFiles, const FileList &queryFiles)
 {
     Output *output = NULL;
@@ -1377,6 +1779,13 @@ void MatrixOutput::initialize(const FileList &targetFiles, const FileList &query
 {
     Output::initialize(targetFiles, queryFiles);
     data.create(queryFiles.size(), targetFiles.size(), CV_32FC1);
+    Context::trackMemory("MatrixOutput", qint64(data.total() * data.elemSize()) - heldBytes);
+    heldBytes = data.total() * data.elemSize();
+}
+
+MatrixOutput::~MatrixOutput()
+{
+    Context::trackMemory("MatrixOutput", -heldBytes);
 }
 
 MatrixOutput *MatrixOutput::make(const FileList &targetFiles, const FileList &queryFiles)
@@ -1414,10 +1823,31 @@ TemplateList Gallery::read()
 {
     TemplateList templates;
     bool done = false;
-    while (!done) templates.append(readBlock(&done));
+    while (!done) {
+        const TemplateList block = readBlock(&done);
+        tuneBlockSize(block);
+        templates.append(block);
+    }
     return templates;
 }
 
+void Gallery::tuneBlockSize(const TemplateList &block)
+{
+    if (!Globals->autoBlockSize || tuned || block.isEmpty())
+        return;
+    tuned = true;
+
+    qint64 bytes = 0;
+    foreach (const Template &t, block)
+        bytes += t.bytes();
+    // Galleries of file names alone, e.g. images not yet decoded, keep the default
+    if (bytes == 0)
+        return;
+
+    readBlockSize = Globals->tunedBlockSize(bytes / block.size());
+    qDebug("Reading %s in blocks of %d templates.", qPrintable(file.name), readBlockSize);
+}
+
 FileList Gallery::files()
 {
     FileList files;
@@ -1426,12 +1856,38 @@ FileList Gallery::files()
     return files;
 }
 
+TemplateList Gallery::readRange(qint64 begin, qint64 end)
+{
+    // Without random access the gallery is read from the start, keeping only the requested range
+    TemplateList templates;
+    qint64 index = 0;
+    bool done = false;
+    while (!done && (index < end)) {
+        const TemplateList block = readBlock(&done);
+        for (int i=0; (i<block.size()) && (index<end); i++, index++)
+            if (index >= begin)
+                templates.append(block[i]);
+    }
+    return templates;
+}
+
+void Gallery::seek(qint64 index)
+{
+    (void) index;
+    qFatal("Gallery %s does not support random access.", qPrintable(file.name));
+}
+
 void Gallery::writeBlock(const TemplateList &templates)
 {
     foreach (const Template &t, templates) write(t);
     if (!next.isNull()) next->writeBlock(templates);
 }
 
+void Gallery::flush()
+{
+    if (!next.isNull()) next->flush();
+}
+
 Gallery *Gallery::make(const File &file)
 {
     Gallery *gallery = NULL;
@@ -1518,7 +1974,11 @@ Transform *Transform::make(QString str, QObject *parent)
     Transform *transform = Factory<Transform>::make("." + str);
     //! [Construct the root transform]
 
-    if (transform->independent) {
+    const bool independent = transform->independent;
+    if (!Globals->profile.isEmpty())
+        transform = profiled(transform);
+
+    if (independent) {
         File independent(".Independent");
         independent.set("transform", qVariantFromValue<void*>(transform));
         transform = Factory<Transform>::make(independent);
@@ -1545,6 +2005,23 @@ static void _project(const Transform *transform, const Template *src, Template *
     }
 }
 
+// Threads without a budget of their own, the usual case, use Globals->parallelism
+static QThreadStorage<int> parallelismBudget;
+
+int br::threadParallelism()
+{
+    if (parallelismBudget.hasLocalData() && (parallelismBudget.localData() > 0))
+        return parallelismBudget.localData();
+    return Globals->parallelism;
+}
+
+int br::setThreadParallelism(int parallelism)
+{
+    const int previous = parallelismBudget.hasLocalData() ? parallelismBudget.localData() : 0;
+    parallelismBudget.setLocalData(parallelism);
+    return previous;
+}
+
 // Default project(TemplateList) calls project(Template) separately for each element
 void Transform::project(const TemplateList &src, TemplateList &dst) const
 {
@@ -1554,11 +2031,45 @@ void Transform::project(const TemplateList &src, TemplateList &dst) const
         dst.append(Template());
     QFutureSynchronizer<void> futures;
     for (int i=0; i<dst.size(); i++)
-        if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(_project, this, &src[i], &dst[i]));
+        if (threadParallelism() > 1) futures.addFuture(QtConcurrent::run(_project, this, &src[i], &dst[i]));
         else                          _project(this, &src[i], &dst[i]);
     futures.waitForFinished();
 }
 
+void Transform::projectInPlace(Template &srcdst) const
+{
+    srcdst >> *this;
+}
+
+void Transform::projectInPlace(TemplateList &srcdst) const
+{
+    TemplateList dst;
+    project(srcdst, dst);
+    srcdst = dst;
+}
+
+static void _projectInPlace(const Transform *transform, Template *srcdst)
+{
+    const File file = srcdst->file;
+    try {
+        transform->projectInPlace(*srcdst);
+    } catch (...) {
+        qWarning("Exception triggered when processing %s with transform %s", qPrintable(file.flat()), qPrintable(transform->objectName()));
+        *srcdst = Template(file);
+        srcdst->file.fte = true;
+    }
+}
+
+void Transform::projectEachInPlace(TemplateList &srcdst) const
+{
+    srcdst.detach(); // Before the templates are replaced concurrently
+    QFutureSynchronizer<void> futures;
+    for (int i=0; i<srcdst.size(); i++)
+        if (threadParallelism() > 1) futures.addFuture(QtConcurrent::run(_projectInPlace, this, &srcdst[i]));
+        else                          _projectInPlace(this, &srcdst[i]);
+    futures.waitForFinished();
+}
+
 TemplateEvent *Transform::getEvent(const QString &name)
 {
     foreach (Transform *child, getChildren<Transform>()) {
@@ -1610,23 +2121,182 @@ Distance *Distance::make(QString str, QObject *parent)
     return distance;
 }
 
-void Distance::compare(const TemplateList &target, const TemplateList &query, Output *output) const
+// Compares are divided into a grid of tiles along both the target and query axes. Workers repeatedly claim
+// the next unprocessed tile, so uneven tiles balance out, and tiles adjacent in claim order share a target block.
+// With Globals->affinity the target tiles are split between NUMA nodes in the same proportions as packTemplates
+// splits a gallery, and each worker claims tiles of its own node before stealing from the others.
+namespace br
 {
-    const bool stepTarget = target.size() > query.size();
-    const int totalSize = std::max(target.size(), query.size());
-    int stepSize = ceil(float(totalSize) / float(std::max(1, abs(Globals->parallelism))));
-    QFutureSynchronizer<void> futures;
-    for (int i=0; i<totalSize; i+=stepSize) {
-        const TemplateList &targets(stepTarget ? TemplateList(target.mid(i, stepSize)) : target);
-        const TemplateList &queries(stepTarget ? query : TemplateList(query.mid(i, stepSize)));
-        const int targetOffset = stepTarget ? i : 0;
-        const int queryOffset = stepTarget ? 0 : i;
-        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &Distance::compareBlock, targets, queries, output, targetOffset, queryOffset));
-        else                                                                           compareBlock (targets, queries, output, targetOffset, queryOffset);
+
+struct CompareTiles
+{
+    const Distance *distance;
+    Output *output;
+    QList<TemplateList> targetTiles, queryTiles;
+    QList<int> targetOffsets, queryOffsets;
+    QList<int> nodeBegin, nodeEnd; // Range of tile indices belonging to each node
+    QScopedArrayPointer<QAtomicInt> nodeNext;
+
+    CompareTiles(const Distance *distance_, Output *output_, const TemplateList &target, const TemplateList &query, int workers)
+        : distance(distance_), output(output_)
+    {
+        // Size target tiles to stay resident in a typical 256KB L2 cache while a tile of queries is compared against them
+        static const qint64 cacheSize = 256 * 1024;
+        const qint64 templateBytes = std::max(qint64(1), qint64(target.first().bytes()));
+        int targetTile = std::max(1, std::min(target.size(), int(cacheSize / templateBytes)));
+        int queryTile = std::min(query.size(), 64);
+
+        // Ensure there are enough tiles for every worker to steal from
+        while (numTiles(target.size(), targetTile, query.size(), queryTile) < 4*workers && (targetTile > 1 || queryTile > 1)) {
+            if (targetTile >= queryTile) targetTile = (targetTile+1)/2;
+            else                         queryTile = (queryTile+1)/2;
+        }
+
+        const int nodes = Globals->affinity ? Affinity::nodes() : 1;
+        for (int node=0; node<nodes; node++) {
+            // Tiles don't straddle nodes
+            const int begin = (nodes > 1) ? Affinity::begin(target.size(), node) : 0;
+            const int end = (nodes > 1) ? Affinity::begin(target.size(), node+1) : target.size();
+            nodeBegin.append(targetTiles.size());
+            for (int i=begin; i<end; i+=targetTile) {
+                targetTiles.append(target.mid(i, std::min(targetTile, end-i)));
+                targetOffsets.append(i);
+            }
+            nodeEnd.append(targetTiles.size());
+        }
+        for (int i=0; i<query.size(); i+=queryTile) {
+            queryTiles.append(query.mid(i, queryTile));
+            queryOffsets.append(i);
+        }
+
+        for (int node=0; node<nodes; node++) {
+            nodeBegin[node] *= queryTiles.size();
+            nodeEnd[node] *= queryTiles.size();
+        }
+        nodeNext.reset(new QAtomicInt[nodes]);
+        for (int node=0; node<nodes; node++)
+            nodeNext[node].store(nodeBegin[node]);
+    }
+
+    static int numTiles(int targets, int targetTile, int queries, int queryTile)
+    {
+        return ((targets + targetTile - 1) / targetTile) * ((queries + queryTile - 1) / queryTile);
+    }
+
+    void run(int worker)
+    {
+        const int nodes = nodeBegin.size();
+        const int home = worker % nodes;
+        Affinity::Pin pin(Affinity::Pin::Node, nodes > 1 ? home : -1);
+
+        for (int i=0; i<nodes; i++) {
+            const int node = (home + i) % nodes;
+            for (int tile = nodeNext[node].fetchAndAddRelaxed(1); tile < nodeEnd[node]; tile = nodeNext[node].fetchAndAddRelaxed(1)) {
+                const int t = tile / queryTiles.size();
+                const int q = tile % queryTiles.size();
+                distance->compareBlock(targetTiles[t], queryTiles[q], output, targetOffsets[t], queryOffsets[q]);
+            }
+        }
+    }
+};
+
+// Forwards the scores of a subset of targets and queries to their rows and columns of the full output
+struct PartitionOutput : public Output
+{
+    Output *output;
+    QVector<int> rows, columns;
+
+    void setRelative(float value, int i, int j)
+    {
+        output->setRelative(value, rows[i], columns[j]);
+    }
+
+    float boundRelative(int i, int j) const
+    {
+        return output->boundRelative(rows[i], columns[j]);
+    }
+
+private:
+    void set(float value, int i, int j)
+    {
+        (void) value; (void) i; (void) j;
+        qFatal("Logic error.");
     }
+};
+
+} // namespace br
+
+static void runCompareTiles(CompareTiles *tiles, int worker)
+{
+    tiles->run(worker);
+}
+
+static void compareTiles(const Distance *distance, const TemplateList &target, const TemplateList &query, Output *output)
+{
+    Context::addMetric("br_comparisons_total", double(target.size()) * query.size());
+
+    const int workers = std::max(1, threadParallelism());
+    CompareTiles tiles(distance, output, target, query, workers);
+
+    // The calling thread works on tiles too, rather than blocking while the pool does all the work
+    QFutureSynchronizer<void> futures;
+    for (int i=1; i<workers; i++)
+        futures.addFuture(QtConcurrent::run(runCompareTiles, &tiles, i));
+    tiles.run(0);
     futures.waitForFinished();
 }
 
+// Cross validation only evaluates pairs within a partition, so each partition's queries are compared against its targets and those in every partition (-1)
+void br::comparePartitions(const Distance *distance, const TemplateList &target, const TemplateList &query, Output *output)
+{
+    if ((Globals->crossValidate <= 0) || target.isEmpty() || query.isEmpty()) {
+        distance->compare(target, query, output);
+        return;
+    }
+
+    const QList<int> targetPartitions = target.files().crossValidationPartitions();
+    const QList<int> queryPartitions = query.files().crossValidationPartitions();
+
+    QMap<int, QVector<int> > queryGroups;
+    for (int i=0; i<query.size(); i++)
+        queryGroups[queryPartitions[i]].append(i);
+
+    qint64 skipped = qint64(target.size()) * query.size();
+    for (QMap<int, QVector<int> >::const_iterator group = queryGroups.constBegin(); group != queryGroups.constEnd(); ++group) {
+        PartitionOutput partitionOutput;
+        partitionOutput.output = output;
+        partitionOutput.rows = group.value();
+
+        TemplateList partitionTargets, partitionQueries;
+        for (int j=0; j<target.size(); j++)
+            if ((targetPartitions[j] == -1) || (targetPartitions[j] == group.key())) {
+                partitionOutput.columns.append(j);
+                partitionTargets.append(target[j]);
+            }
+        foreach (int i, group.value())
+            partitionQueries.append(query[i]);
+
+        if (!partitionTargets.isEmpty())
+            distance->compare(partitionTargets, partitionQueries, &partitionOutput);
+        skipped -= qint64(partitionTargets.size()) * partitionQueries.size();
+    }
+
+    // Not every output initializes its scores, so skipped pairs get the sentinel of a failed comparison
+    for (int i=0; i<query.size(); i++)
+        for (int j=0; j<target.size(); j++)
+            if ((targetPartitions[j] != -1) && (targetPartitions[j] != queryPartitions[i]))
+                output->setRelative(-std::numeric_limits<float>::max(), i, j);
+    Context::addMetric("br_comparisons_skipped_total", double(skipped));
+}
+
+void Distance::compare(const TemplateList &target, const TemplateList &query, Output *output) const
+{
+    if (target.isEmpty() || query.isEmpty())
+        return;
+
+    compareTiles(this, target, query, output);
+}
+
 QList<float> Distance::compare(const TemplateList &targets, const Template &query) const
 {
     QList<float> scores; scores.reserve(targets.size());
@@ -1654,6 +2324,12 @@ float Distance::compare(const Template &a, const Template &b) const
     return similarity;
 }
 
+float Distance::compare(const Template &a, const Template &b, float lower, float upper) const
+{
+    (void) lower; (void) upper;
+    return compare(a, b);
+}
+
 float Distance::compare(const cv::Mat &a, const cv::Mat &b) const
 {
     if (a.empty() || b.empty() || a.rows != b.rows || a.cols != b.cols || a.elemSize() != b.elemSize())
@@ -1674,7 +2350,7 @@ void Distance::compareBlock(const TemplateList &target, const TemplateList &quer
     for (int i=0; i<query.size(); i++)
         for (int j=0; j<target.size(); j++)
             if (target[j].isEmpty() || query[i].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(),i+queryOffset, j+targetOffset);
-            else output->setRelative(compare(target[j], query[i]), i+queryOffset, j+targetOffset);
+            else output->setRelative(compare(target[j], query[i], output->boundRelative(i+queryOffset, j+targetOffset), std::numeric_limits<float>::max()), i+queryOffset, j+targetOffset);
 }
 
 void br::applyAdditionalProperties(const File &temp, Transform *target)
@@ -1688,6 +2364,105 @@ void br::applyAdditionalProperties(const File &temp, Transform *target)
     }
 }
 
+namespace br
+{
+
+// Copies templates [begin, end) into consecutive rows of buffer starting at row
+struct PackRange
+{
+    TemplateList *templates;
+    cv::Mat buffer;
+    int begin, end, row, node;
+    size_t elements;
+    int channels, rows;
+
+    void run() const
+    {
+        Affinity::Pin pin(Affinity::Pin::Node, node);
+        int next = row;
+        for (int i=begin; i<end; i++) {
+            Template &t = (*templates)[i];
+            if (t.isNull()) continue;
+            cv::Mat view = buffer.row(next++).colRange(0, elements).reshape(channels, rows);
+            t.first().copyTo(view);
+            t.first() = view;
+        }
+    }
+};
+
+} // namespace br
+
+static void runPackRange(const PackRange &range)
+{
+    range.run();
+}
+
+bool br::packTemplates(TemplateList &templates)
+{
+    static const size_t alignment = 16;
+
+    const cv::Mat *first = NULL;
+    int count = 0;
+    foreach (const Template &t, templates) {
+        if (t.isNull()) continue;
+        if (t.size() != 1) return false;
+        if (!first) first = &t.first();
+        else if ((t.first().rows != first->rows) || (t.first().cols != first->cols) || (t.first().type() != first->type()))
+            return false;
+        count++;
+    }
+    if (count < 2) return false;
+
+    const int depth = first->depth();
+    const int channels = first->channels();
+    const int rows = first->rows;
+    const size_t elements = first->total() * channels;
+    const size_t elementSize = first->elemSize1();
+    const size_t stride = ((elements * elementSize + alignment - 1) / alignment) * alignment;
+
+    // Already packed, e.g. read from a mmapGallery, so don't copy it again
+    bool packed = first->isContinuous() && (size_t(first->data) % alignment == 0);
+    const uchar *expected = first->data;
+    for (int i=0; packed && (i<templates.size()); i++) {
+        if (templates[i].isNull()) continue;
+        packed = (templates[i].first().data == expected) && templates[i].first().isContinuous();
+        expected += stride;
+    }
+    if (packed) return true;
+
+    // One row per template, padded to the stride
+    PackRange range;
+    range.templates = &templates;
+    range.buffer = cv::Mat(count, stride / elementSize, CV_MAKETYPE(depth, 1));
+    range.elements = elements;
+    range.channels = channels;
+    range.rows = rows;
+
+    // With Globals->affinity each NUMA node's share of the gallery is first touched by a thread on that node,
+    // so its pages are allocated in the node's local memory. The shares match those compared by CompareTiles.
+    const int nodes = Globals->affinity ? Affinity::nodes() : 1;
+    if (nodes == 1) {
+        range.begin = 0; range.end = templates.size(); range.row = 0; range.node = -1;
+        range.run();
+        return true;
+    }
+
+    templates.detach(); // Before the ranges are written concurrently
+    QFutureSynchronizer<void> futures;
+    int row = 0;
+    for (int node=0; node<nodes; node++) {
+        range.begin = Affinity::begin(templates.size(), node);
+        range.end = Affinity::begin(templates.size(), node+1);
+        range.row = row;
+        range.node = node;
+        futures.addFuture(QtConcurrent::run(runPackRange, range));
+        for (int i=range.begin; i<range.end; i++)
+            if (!templates[i].isNull()) row++;
+    }
+    futures.waitForFinished();
+    return true;
+}
+
 Transform *br::wrapTransform(Transform *base, const QString &target)
 {
     Transform *res = Transform::make(target, NULL);
@@ -1715,6 +2490,20 @@ Representation *Representation::make(QString str, QObject *parent)
     return rep;
 }
 
+// Window at element offset of a continuous preprocessed image
+static cv::Mat windowAt(const cv::Mat &image, int offset, const cv::Size &size)
+{
+    return image(cv::Rect(cv::Point(offset % image.cols, offset / image.cols), size)).clone();
+}
+
+void Representation::evaluate(const cv::Mat &image, int idx, int origin, int step, int count, float *responses) const
+{
+    int dx, dy;
+    const cv::Size size = windowSize(&dx, &dy);
+    for (int i=0; i<count; i++)
+        responses[i] = evaluate(windowAt(image, origin + i*step, cv::Size(size.width + dx, size.height + dy)), idx);
+}
+
 Classifier *Classifier::make(QString str, QObject *parent)
 {
     // Check for custom transforms
@@ -1727,3 +2516,14 @@ Classifier *Classifier::make(QString str, QObject *parent)
     classifier->setParent(parent);
     return classifier;
 }
+
+void Classifier::classify(const cv::Mat &image, int origin, int step, int count, uchar *mask, float *confidences) const
+{
+    int dx, dy;
+    const cv::Size size = windowSize(&dx, &dy);
+    for (int i=0; i<count; i++) {
+        if (!mask[i]) continue;
+        confidences[i] = 0;
+        mask[i] = classify(windowAt(image, origin + i*step, cv::Size(size.width + dx, size.height + dy)), false, &confidences[i]) != 0;
+    }
+}
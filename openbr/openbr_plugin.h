@@ -36,6 +36,7 @@
 #include <QString>
 #include <QStringList>
 #include <QThread>
+#include <QThreadPool>
 #include <QTime>
 #include <QVariant>
 #include <QVector>
@@ -53,6 +54,64 @@ TYPE get_##NAME() const { return NAME; }                \
 void set_##NAME(TYPE the_##NAME) { NAME = the_##NAME; } \
 void reset_##NAME() { NAME = DEFAULT; }
 
+/*!
+ * \brief A globally interned metadata key.
+ *
+ * Interning a name costs one hash lookup, after which br::Metadata lookups compare integers.
+ * Keys used in tight loops should be constructed once, e.g. as function statics.
+ */
+struct BR_EXPORT MetadataKey
+{
+    int id;
+    explicit MetadataKey(const QString &name);
+    QString name() const;
+};
+
+/*!
+ * \brief Key-value metadata stored as a small flat array of interned keys.
+ *
+ * Scalar values such as int, float and bool live inline in their QVariant, so reading them back as their own type needs no conversion.
+ */
+class BR_EXPORT Metadata
+{
+public:
+    Metadata() {}
+    Metadata(const QVariantMap &map);
+
+    inline int size() const { return entries.size(); }
+    inline bool isEmpty() const { return entries.isEmpty(); }
+    inline bool contains(const MetadataKey &key) const { return find(key) != NULL; }
+
+    const QVariant *find(const MetadataKey &key) const
+    {
+        for (int i=0; i<entries.size(); i++)
+            if (entries[i].key == key.id)
+                return &entries[i].value;
+        return NULL;
+    }
+
+    inline QVariant value(const MetadataKey &key) const { const QVariant *value = find(key); return value ? *value : QVariant(); }
+    inline QVariant &operator[](const MetadataKey &key) { return slot(key.id); }
+    inline void insert(const MetadataKey &key, const QVariant &value) { (*this)[key] = value; }
+    void remove(const MetadataKey &key);
+    void unite(const Metadata &other); // Values in other replace existing ones
+
+    QStringList keys() const; // Sorted, like QVariantMap::keys()
+    QVariantMap toMap() const;
+    bool operator==(const Metadata &other) const;
+
+private:
+    struct Entry
+    {
+        int key;
+        QVariant value;
+    };
+
+    QVector<Entry> entries;
+
+    QVariant &slot(int key); // Inserts a null value if key is missing
+};
+
 struct BR_EXPORT File
 {
     QString name;
@@ -67,7 +126,7 @@ struct BR_EXPORT File
     QString hash() const;
 
     inline QStringList localKeys() const { return m_metadata.keys(); }
-    inline QVariantMap localMetadata() const { return m_metadata; }
+    inline QVariantMap localMetadata() const { return m_metadata.toMap(); }
 
     void append(const QVariantMap &localMetadata);
     void append(const File &other);
@@ -99,11 +158,14 @@ struct BR_EXPORT File
     inline QString path() const { return QFileInfo(name).path(); }
     QString resolved() const;
 
-    bool contains(const QString &key) const;
+    inline bool contains(const QString &key) const { return contains(MetadataKey(key)); }
+    bool contains(const MetadataKey &key) const;
     bool contains(const QStringList &keys) const;
-    QVariant value(const QString &key) const;
+    inline QVariant value(const QString &key) const { return value(MetadataKey(key)); }
+    QVariant value(const MetadataKey &key) const;
     static QVariant parse(const QString &value);
-    inline void set(const QString &key, const QVariant &value) { m_metadata.insert(key, value); }
+    inline void set(const QString &key, const QVariant &value) { m_metadata.insert(MetadataKey(key), value); }
+    inline void set(const MetadataKey &key, const QVariant &value) { m_metadata.insert(key, value); }
     void set(const QString &key, const QString &value);
 
 
@@ -117,30 +179,41 @@ struct BR_EXPORT File
         set(key, variantList);
     }
 
-    inline void remove(const QString &key) { m_metadata.remove(key); }
+    inline void remove(const QString &key) { m_metadata.remove(MetadataKey(key)); }
 
 
     template <typename T>
-    T get(const QString &key) const
+    T get(const MetadataKey &key) const
     {
-        if (!contains(key)) qFatal("Missing key: %s in: %s", qPrintable(key), qPrintable(flat()));
-        QVariant variant = value(key);
-        if (!variant.canConvert<T>()) qFatal("Can't convert: %s in: %s", qPrintable(key), qPrintable(flat()));
+        const QVariant *local = m_metadata.find(key);
+        if (local && (local->userType() == qMetaTypeId<T>())) return *reinterpret_cast<const T*>(local->constData());
+        if (!local && !contains(key)) qFatal("Missing key: %s in: %s", qPrintable(key.name()), qPrintable(flat()));
+        QVariant variant = local ? *local : value(key);
+        if (!variant.canConvert<T>()) qFatal("Can't convert: %s in: %s", qPrintable(key.name()), qPrintable(flat()));
         return variant.value<T>();
     }
 
+    template <typename T>
+    T get(const QString &key) const { return get<T>(MetadataKey(key)); }
+
 
     template <typename T>
-    T get(const QString &key, const T &defaultValue) const
+    T get(const MetadataKey &key, const T &defaultValue) const
     {
-        if (!contains(key)) return defaultValue;
-        QVariant variant = value(key);
+        const QVariant *local = m_metadata.find(key);
+        if (local && (local->userType() == qMetaTypeId<T>())) return *reinterpret_cast<const T*>(local->constData());
+        if (!local && !contains(key)) return defaultValue;
+        QVariant variant = local ? *local : value(key);
         if (!variant.canConvert<T>()) return defaultValue;
         return variant.value<T>();
     }
 
+    template <typename T>
+    T get(const QString &key, const T &defaultValue) const { return get<T>(MetadataKey(key), defaultValue); }
+
 
-    bool getBool(const QString &key, bool defaultValue = false) const;
+    inline bool getBool(const QString &key, bool defaultValue = false) const { return getBool(MetadataKey(key), defaultValue); }
+    bool getBool(const MetadataKey &key, bool defaultValue = false) const;
 
 
     template <typename T>
@@ -148,7 +221,7 @@ struct BR_EXPORT File
     {
         if (!contains(key)) qFatal("Missing key: %s in: %s", qPrintable(key), qPrintable(flat()));
         QList<T> list;
-        foreach (const QVariant &item, m_metadata[key].toList()) {
+        foreach (const QVariant &item, m_metadata.value(MetadataKey(key)).toList()) {
             if (item.canConvert<T>()) list.append(item.value<T>());
             else qFatal("Failed to convert value for key %s in: %s", qPrintable(key), qPrintable(flat()));
         }
@@ -161,7 +234,7 @@ struct BR_EXPORT File
     {
         if (!contains(key)) return defaultValue;
         QList<T> list;
-        foreach (const QVariant &item, m_metadata[key].toList()) {
+        foreach (const QVariant &item, m_metadata.value(MetadataKey(key)).toList()) {
             if (item.canConvert<T>()) list.append(item.value<T>());
             else return defaultValue;
         }
@@ -172,8 +245,9 @@ struct BR_EXPORT File
     template<class U>
     static QList<QVariant> values(const QList<U> &fileList, const QString &key)
     {
+        const MetadataKey metadataKey(key);
         QList<QVariant> values; values.reserve(fileList.size());
-        foreach (const U &f, fileList) values.append(((const File&)f).value(key));
+        foreach (const U &f, fileList) values.append(((const File&)f).value(metadataKey));
         return values;
     }
 
@@ -181,8 +255,9 @@ struct BR_EXPORT File
     template<class T, class U>
     static QList<T> get(const QList<U> &fileList, const QString &key)
     {
+        const MetadataKey metadataKey(key);
         QList<T> result; result.reserve(fileList.size());
-        foreach (const U &f, fileList) result.append(((const File&)f).get<T>(key));
+        foreach (const U &f, fileList) result.append(((const File&)f).get<T>(metadataKey));
         return result;
     }
 
@@ -190,8 +265,9 @@ struct BR_EXPORT File
     template<class T, class U>
     static QList<T> get(const QList<U> &fileList, const QString &key, const T &defaultValue)
     {
+        const MetadataKey metadataKey(key);
         QList<T> result; result.reserve(fileList.size());
-        foreach (const U &f, fileList) result.append(static_cast<const File&>(f).get<T>(key, defaultValue));
+        foreach (const U &f, fileList) result.append(static_cast<const File&>(f).get<T>(metadataKey, defaultValue));
         return result;
     }
 
@@ -199,7 +275,7 @@ struct BR_EXPORT File
     QList<QPointF> points() const;
     void appendPoint(const QPointF &point);
     void appendPoints(const QList<QPointF> &points);
-    inline void clearPoints() { m_metadata["Points"] = QList<QVariant>(); }
+    inline void clearPoints() { set("Points", QList<QVariant>()); }
     inline void setPoints(const QList<QPointF> &points) { clearPoints(); appendPoints(points); }
 
     QList<QRectF> namedRects() const;
@@ -208,13 +284,13 @@ struct BR_EXPORT File
     void appendRect(const cv::Rect &rect);
     void appendRects(const QList<QRectF> &rects);
     void appendRects(const QList<cv::Rect> &rects);
-    inline void clearRects() { m_metadata["Rects"] = QList<QVariant>(); }
+    inline void clearRects() { set("Rects", QList<QVariant>()); }
     inline void setRects(const QList<QRectF> &rects) { clearRects(); appendRects(rects); }
     inline void setRects(const QList<cv::Rect> &rects) { clearRects(); appendRects(rects); }
 
     bool fte;
 private:
-    QVariantMap m_metadata;
+    Metadata m_metadata;
     BR_EXPORT friend QDataStream &operator<<(QDataStream &stream, const File &file);
     BR_EXPORT friend QDataStream &operator>>(QDataStream &stream, File &file);
 
@@ -235,6 +311,20 @@ inline bool File::get<bool>(const QString &key) const
     return getBool(key);
 }
 
+
+template <>
+inline bool File::get<bool>(const MetadataKey &key, const bool &defaultValue) const
+{
+    return getBool(key, defaultValue);
+}
+
+
+template <>
+inline bool File::get<bool>(const MetadataKey &key) const
+{
+    return getBool(key);
+}
+
 BR_EXPORT QDebug operator<<(QDebug dbg, const File &file);
 BR_EXPORT QDataStream &operator<<(QDataStream &stream, const File &file);
 BR_EXPORT QDataStream &operator>>(QDataStream &stream, File &file);
@@ -527,6 +617,48 @@ public:
     Q_PROPERTY(QList<QString> modelSearch READ get_modelSearch WRITE set_modelSearch RESET reset_modelSearch)
     BR_PROPERTY(QList<QString>, modelSearch, QList<QString>() )
 
+    Q_PROPERTY(QString streamStats READ get_streamStats WRITE set_streamStats RESET reset_streamStats)
+    BR_PROPERTY(QString, streamStats, "")
+
+    Q_PROPERTY(int streamStatsInterval READ get_streamStatsInterval WRITE set_streamStatsInterval RESET reset_streamStatsInterval)
+    BR_PROPERTY(int, streamStatsInterval, 10)
+
+    Q_PROPERTY(QString streamTrace READ get_streamTrace WRITE set_streamTrace RESET reset_streamTrace)
+    BR_PROPERTY(QString, streamTrace, "")
+
+    Q_PROPERTY(bool affinity READ get_affinity WRITE set_affinity RESET reset_affinity)
+    BR_PROPERTY(bool, affinity, false)
+
+    Q_PROPERTY(bool arena READ get_arena WRITE set_arena RESET reset_arena)
+    BR_PROPERTY(bool, arena, false)
+
+    Q_PROPERTY(QString checkpoint READ get_checkpoint WRITE set_checkpoint RESET reset_checkpoint)
+    BR_PROPERTY(QString, checkpoint, "")
+
+    Q_PROPERTY(bool mappedModels READ get_mappedModels WRITE set_mappedModels RESET reset_mappedModels)
+    BR_PROPERTY(bool, mappedModels, false)
+
+    Q_PROPERTY(QString profile READ get_profile WRITE set_profile RESET reset_profile)
+    BR_PROPERTY(QString, profile, "")
+
+    Q_PROPERTY(bool reportMemory READ get_reportMemory WRITE set_reportMemory RESET reset_reportMemory)
+    BR_PROPERTY(bool, reportMemory, false)
+
+    Q_PROPERTY(bool jit READ get_jit WRITE set_jit RESET reset_jit)
+    BR_PROPERTY(bool, jit, false)
+
+    Q_PROPERTY(bool autoBlockSize READ get_autoBlockSize WRITE set_autoBlockSize RESET reset_autoBlockSize)
+    BR_PROPERTY(bool, autoBlockSize, false)
+
+    Q_PROPERTY(int blockWorkingSet READ get_blockWorkingSet WRITE set_blockWorkingSet RESET reset_blockWorkingSet)
+    BR_PROPERTY(int, blockWorkingSet, 4096)
+
+    Q_PROPERTY(int blockMemory READ get_blockMemory WRITE set_blockMemory RESET reset_blockMemory)
+    BR_PROPERTY(int, blockMemory, 2048)
+
+    Q_PROPERTY(int memoryLimit READ get_memoryLimit WRITE set_memoryLimit RESET reset_memoryLimit)
+    BR_PROPERTY(int, memoryLimit, 0)
+
     QHash<QString,QString> abbreviations;
     QTime startTime;
 
@@ -535,6 +667,7 @@ public:
     float progress() const;
     void setProperty(const QString &key, const QString &value);
     int timeRemaining() const;
+    int tunedBlockSize(qint64 templateBytes) const; // Templates per block for templates of this size, see autoBlockSize
 
     static bool checkSDKPath(const QString &sdkPath);
     static void initialize(int &argc, char *argv[], QString sdkPath = "", bool useGui = true);
@@ -543,6 +676,16 @@ public:
     static QString version();
     static QString scratchPath();
     static QStringList objects(const char *abstractions = ".*", const char *implementations = ".*", bool parameters = true);
+    static void initializePlugin(const QString &name);
+    static QString startupProfile();
+    static void trackMemory(const QString &subsystem, qint64 bytes);
+    static bool reserveMemory(const QString &subsystem, qint64 bytes);
+    static qint64 memoryAvailable();
+    static QString memoryUsage();
+    static void addMetric(const QString &name, double value = 1);
+    static void setMetric(const QString &name, double value);
+    static void observeMetric(const QString &name, double value);
+    static QString metrics();
 
 private:
     static void messageHandler(QtMsgType type, const QMessageLogContext &context, const QString &msg);
@@ -565,6 +708,7 @@ struct Factory
             else if (names().contains("Default"))                 name = "Default";
             else    qFatal("%s registry does not contain object named: %s", qPrintable(baseClassName()), qPrintable(name));
         }
+        Context::initializePlugin(name);
         T *object = registry->value(name)->_make();
         static_cast<Object*>(object)->init(file);
         return object;
@@ -633,6 +777,8 @@ public:
     virtual ~Initializer() {}
     virtual void initialize() const = 0;
     virtual void finalize() const {}
+    virtual QStringList plugins() const { return QStringList(); } /*!< If not empty, initialize() is deferred until one of these plugins is first made. */
+    virtual void registerAbbreviations() const {} /*!< Called at startup even when initialize() is deferred. */
 };
 
 
@@ -654,6 +800,7 @@ public:
     virtual void initialize(const FileList &targetFiles, const FileList &queryFiles);
     virtual void setBlock(int rowBlock, int columnBlock);
     virtual void setRelative(float value, int i, int j);
+    virtual float boundRelative(int i, int j) const;
 
     static Output *make(const File &file, const FileList &targetFiles, const FileList &queryFiles);
 
@@ -661,6 +808,7 @@ private:
     QSharedPointer<Output> next;
     QPoint offset;
     virtual void set(float value, int i, int j) = 0;
+    virtual float bound(int i, int j) const { (void) i; (void) j; return -std::numeric_limits<float>::max(); }
 };
 
 
@@ -671,12 +819,16 @@ class BR_EXPORT MatrixOutput : public Output
 public:
     cv::Mat data;
 
+    MatrixOutput() : heldBytes(0) {}
+    ~MatrixOutput();
     static MatrixOutput *make(const FileList &targetFiles, const FileList &queryFiles);
 
 protected:
     QString toString(int row, int column) const;
 
 private:
+    qint64 heldBytes; // Size of data when it was allocated, see Context::trackMemory()
+
     void initialize(const FileList &targetFiles, const FileList &queryFiles);
     void set(float value, int i, int j);
 };
@@ -700,20 +852,27 @@ public:
     Q_PROPERTY(int readBlockSize READ get_readBlockSize WRITE set_readBlockSize RESET reset_readBlockSize STORED false)
     BR_PROPERTY(int, readBlockSize, Globals->blockSize)
 
+    Gallery() : tuned(false) {}
     virtual ~Gallery() {}
     TemplateList read();
-    FileList files();
+    virtual FileList files(); // Metadata only, galleries may override it to skip reading matrices
     virtual TemplateList readBlock(bool *done) = 0;
+    virtual TemplateList readRange(qint64 begin, qint64 end); // Templates [begin, end) in gallery order
+    virtual void seek(qint64 index); // The next readBlock starts at this template
     void writeBlock(const TemplateList &templates);
     virtual void write(const Template &t) = 0;
+    virtual void flush(); // Commit everything written so far to storage
     static Gallery *make(const File &file);
     void init();
 
     virtual qint64 totalSize() { return std::numeric_limits<qint64>::max(); }
     virtual qint64 position() { return 0; }
 
+    void tuneBlockSize(const TemplateList &block); // Sizes readBlockSize from the first block read if Context::autoBlockSize is set
+
 private:
     QSharedPointer<Gallery> next;
+    bool tuned;
 };
 
 
@@ -754,6 +913,11 @@ public:
     virtual void project(const Template &src, Template &dst) const = 0;
     virtual void project(const TemplateList &src, TemplateList &dst) const;
 
+    // Replace srcdst with its projection. Transforms that can overwrite matrices and metadata no longer shared
+    // with anything else override these, the defaults project into a copy.
+    virtual void projectInPlace(Template &srcdst) const;
+    virtual void projectInPlace(TemplateList &srcdst) const;
+
     virtual void projectUpdate(const Template &src, Template &dst)
     {
         project(src, dst);
@@ -816,6 +980,10 @@ public:
 protected:
     Transform(bool independent = true, bool trainable = true);
     inline Transform *make(const QString &description) { return make(description, this); }
+
+    // projectInPlace(Template&) for each template in parallel, an implementation of projectInPlace(TemplateList&)
+    // for transforms that use the default project(TemplateList).
+    void projectEachInPlace(TemplateList &srcdst) const;
 };
 
 inline Template &operator>>(Template &srcdst, const Transform &f)
@@ -857,6 +1025,7 @@ public:
     virtual void compare(const TemplateList &target, const TemplateList &query, Output *output) const;
     virtual QList<float> compare(const TemplateList &targets, const Template &query) const;
     virtual float compare(const Template &a, const Template &b) const;
+    virtual float compare(const Template &a, const Template &b, float lower, float upper) const;
     virtual float compare(const cv::Mat &a, const cv::Mat &b) const;
     virtual float compare(const uchar *a, const uchar *b, size_t size) const;
 
@@ -867,6 +1036,7 @@ private:
     virtual void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const;
 
     friend struct AlgorithmCore;
+    friend struct CompareTiles;
     virtual bool compare(const File &targetGallery, const File &queryGallery, const File &output) const
         { (void) targetGallery; (void) queryGallery; (void) output; return false; }
 };
@@ -887,6 +1057,9 @@ public:
     // By convention, an empty indices list will result in all feature responses being calculated
     // and returned.
     virtual cv::Mat evaluate(const cv::Mat &image, const QList<int> &indices = QList<int>()) const = 0;
+    // Evaluates feature idx for count windows of a preprocessed image, whose top left corners are step elements apart
+    // starting at element origin of the continuous image. The default implementation evaluates each window separately.
+    virtual void evaluate(const cv::Mat &image, int idx, int origin, int step, int count, float *responses) const;
 
     virtual cv::Size windowSize(int *dx = NULL, int *dy = NULL) const = 0; // dx and dy should indicate the change to the original window size after preprocessing
     virtual int numChannels() const { return 1; }
@@ -905,6 +1078,9 @@ public:
 
     virtual void train(const QList<cv::Mat> &images, const QList<float> &labels) = 0;
     virtual float classify(const cv::Mat &image, bool process = true, float *confidence = NULL) const = 0;
+    // Classifies count preprocessed windows laid out as in Representation::evaluate. Windows with a zero mask are skipped,
+    // on return the mask is non-zero for positive windows. The default implementation classifies each window separately.
+    virtual void classify(const cv::Mat &image, int origin, int step, int count, uchar *mask, float *confidences) const;
 
     // Slots for representations
     virtual cv::Mat preprocess(const cv::Mat &image) const = 0;
@@ -914,6 +1090,36 @@ public:
 };
 
 
+struct AlgorithmCore;
+
+/*!
+ * \brief A handle to an algorithm with a thread budget of its own.
+ *
+ * Handles of the same algorithm share its trained model, while each one enrolls and compares with
+ * at most its own parallelism and block size rather than those of Globals,
+ * so several algorithms can be served side by side from one process and used concurrently from different threads.
+ * Copies of a handle share its threads.
+ */
+class BR_EXPORT AlgorithmHandle
+{
+public:
+    AlgorithmHandle(const QString &description = QString(), int parallelism = 0, int blockSize = 0); /*!< \brief Zero takes the value from Globals. */
+
+    QString description() const { return m_description; }
+    int parallelism() const { return m_parallelism; }
+    int blockSize() const { return m_blockSize; }
+
+    void enroll(TemplateList &templates) const; /*!< \brief Templates are modified in place as they are projected through the algorithm. */
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const;
+
+private:
+    QString m_description;
+    int m_parallelism, m_blockSize;
+    QSharedPointer<AlgorithmCore> core;
+    QSharedPointer<QThreadPool> threads;
+};
+
+
 BR_EXPORT bool IsClassifier(const QString &algorithm);
 
 BR_EXPORT void Train(const File &input, const File &model);
@@ -922,6 +1128,10 @@ BR_EXPORT void Enroll(const File &input, const File &gallery = File());
 
 BR_EXPORT void Enroll(TemplateList &tmpl);
 
+typedef void (*EnrollCallback)(const TemplateList &enrolled, void *context);
+
+BR_EXPORT QFuture<TemplateList> EnrollAsync(const TemplateList &tmpl, EnrollCallback callback = NULL, void *context = NULL);
+
 BR_EXPORT void Project(const File &input, const File &output);
 
 BR_EXPORT void Compare(const File &targetGallery, const File &queryGallery, const File &output);
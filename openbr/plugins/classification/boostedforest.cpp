@@ -94,6 +94,8 @@ static void storeRecursive(QDataStream &stream, const Node *node, int maxCatCoun
  * \br_property int maxDepth The maximum depth for each trained tree
  * \br_property int maxWeakCount The maximum number of trees in the forest
  * \br_property Type type. The type of boosting to perform. Options are [Discrete, Real, Logit, Gentle]. Gentle is the default.
+ * \br_property int precalcValBufSize The size in MB of the buffer of precomputed feature responses
+ * \br_property int precalcIdxBufSize The size in MB of the buffer of samples sorted by each feature's response, kept as 16-bit indices below 65536 samples
  */
 class BoostedForestClassifier : public Classifier
 {
@@ -107,6 +109,8 @@ class BoostedForestClassifier : public Classifier
     Q_PROPERTY(int maxDepth READ get_maxDepth WRITE set_maxDepth RESET reset_maxDepth STORED false)
     Q_PROPERTY(int maxWeakCount READ get_maxWeakCount WRITE set_maxWeakCount RESET reset_maxWeakCount STORED false)
     Q_PROPERTY(Type type READ get_type WRITE set_type RESET reset_type STORED false)
+    Q_PROPERTY(int precalcValBufSize READ get_precalcValBufSize WRITE set_precalcValBufSize RESET reset_precalcValBufSize STORED false)
+    Q_PROPERTY(int precalcIdxBufSize READ get_precalcIdxBufSize WRITE set_precalcIdxBufSize RESET reset_precalcIdxBufSize STORED false)
 
 public:
     enum Type { Discrete = CvBoost::DISCRETE,
@@ -121,10 +125,67 @@ private:
     BR_PROPERTY(int, maxDepth, 1)
     BR_PROPERTY(int, maxWeakCount, 100)
     BR_PROPERTY(Type, type, Gentle)
+    BR_PROPERTY(int, precalcValBufSize, 1024)
+    BR_PROPERTY(int, precalcIdxBufSize, 1024)
 
     QList<Node*> classifiers;
     float threshold;
 
+    // The trees flattened depth first into one array, each left child immediately follows its parent
+    struct FlatNode
+    {
+        int featureIdx; // Negative for leaves
+        float threshold; // Value for leaves
+        int right;
+        int subset; // Offset into subsets for categorical features
+    };
+    QVector<FlatNode> flatNodes;
+    QVector<int> roots, subsets;
+
+    static const int MaxBatch = 64;
+
+    void flatten(const Node *node)
+    {
+        const int index = flatNodes.size();
+        FlatNode flatNode;
+        flatNode.featureIdx = node->left ? node->featureIdx : -1;
+        flatNode.threshold = node->left ? node->threshold : node->value;
+        flatNode.right = -1;
+        flatNode.subset = subsets.size();
+        flatNodes.append(flatNode);
+        if (!node->left) return;
+
+        foreach (int s, node->subset)
+            subsets.append(s);
+        flatten(node->left);
+        flatNodes[index].right = flatNodes.size();
+        flatten(node->right);
+    }
+
+    void compile()
+    {
+        flatNodes.clear();
+        roots.clear();
+        subsets.clear();
+        foreach (const Node *classifier, classifiers) {
+            roots.append(flatNodes.size());
+            flatten(classifier);
+        }
+    }
+
+    inline int next(int index, float response) const
+    {
+        const FlatNode &node = flatNodes[index];
+        bool left;
+        if (representation->maxCatCount() > 0) {
+            const int c = (int)response;
+            left = (subsets[node.subset + (c >> 5)] & (1 << (c & 31))) != 0;
+        } else {
+            left = response <= node.threshold;
+        }
+        return left ? index + 1 : node.right;
+    }
+
     void train(const QList<Mat> &images, const QList<float> &labels)
     {
         representation->train(images, labels);
@@ -138,7 +199,7 @@ private:
             featureEvaluator.setImage(images[i], labels[i], i);
 
         CascadeBoost boost;
-        boost.train(&featureEvaluator, images.size(), 1024, 1024, representation->numChannels(), params);
+        boost.train(&featureEvaluator, images.size(), precalcValBufSize, precalcIdxBufSize, representation->numChannels(), params);
 
         threshold = boost.getThreshold();
 
@@ -147,6 +208,7 @@ private:
             buildTreeRecursive(root, classifier->get_root(), representation->maxCatCount());
             classifiers.append(root);
         }
+        compile();
     }
 
     float classify(const Mat &image, bool process, float *confidence) const
@@ -158,20 +220,11 @@ private:
             m = image;
 
         float sum = 0;
-        for (int i = 0; i < classifiers.size(); i++) {
-            Node *node = classifiers[i];
-
-            while (node->left) {
-                if (representation->maxCatCount() > 0) {
-                    int c = (int)representation->evaluate(m, node->featureIdx);
-                    node = (node->subset[c >> 5] & (1 << (c & 31))) ? node->left : node->right;
-                } else {
-                    double val = representation->evaluate(m, node->featureIdx);
-                    node = val <= node->threshold ? node->left : node->right;
-                }
-            }
-
-            sum += node->value;
+        foreach (int root, roots) {
+            int index = root;
+            while (flatNodes[index].featureIdx >= 0)
+                index = next(index, representation->evaluate(m, flatNodes[index].featureIdx));
+            sum += flatNodes[index].threshold;
         }
 
         if (confidence)
@@ -179,6 +232,55 @@ private:
         return sum < threshold - THRESHOLD_EPS ? 0.0f : 1.0f;
     }
 
+    // Each split is evaluated once for all the windows that reach it, only spanning the unmasked windows
+    void classify(const Mat &image, int origin, int step, int count, uchar *mask, float *confidences) const
+    {
+        if (count > MaxBatch) {
+            for (int i = 0; i < count; i += MaxBatch)
+                classify(image, origin + i*step, step, std::min(MaxBatch, count - i), mask + i, confidences + i);
+            return;
+        }
+
+        int begin = 0, end = count;
+        while ((begin < end) && !mask[begin]) begin++;
+        while ((end > begin) && !mask[end-1]) end--;
+        if (begin == end) return;
+
+        float sums[MaxBatch], responses[MaxBatch];
+        int indices[MaxBatch];
+        for (int i = begin; i < end; i++)
+            sums[i] = 0;
+
+        foreach (int root, roots) {
+            for (int i = begin; i < end; i++)
+                indices[i] = root;
+
+            while (true) {
+                int current = -1;
+                for (int i = begin; i < end; i++)
+                    if (mask[i] && (flatNodes[indices[i]].featureIdx >= 0)) {
+                        current = indices[i];
+                        break;
+                    }
+                if (current == -1) break;
+
+                representation->evaluate(image, flatNodes[current].featureIdx, origin + begin*step, step, end - begin, responses + begin);
+                for (int i = begin; i < end; i++)
+                    if (indices[i] == current)
+                        indices[i] = next(current, responses[i]);
+            }
+
+            for (int i = begin; i < end; i++)
+                sums[i] += flatNodes[indices[i]].threshold;
+        }
+
+        for (int i = begin; i < end; i++)
+            if (mask[i]) {
+                confidences[i] = sums[i];
+                mask[i] = sums[i] < threshold - THRESHOLD_EPS ? 0 : 1;
+            }
+    }
+
     int numFeatures() const
     {
         return representation->numFeatures();
@@ -212,6 +314,7 @@ private:
             loadRecursive(stream, classifier, representation->maxCatCount());
             classifiers.append(classifier);
         }
+        compile();
     }
 
     void store(QDataStream &stream) const
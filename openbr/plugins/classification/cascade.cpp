@@ -1,3 +1,5 @@
+#include <QVarLengthArray>
+#include <QtConcurrent>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -54,33 +56,48 @@ struct ImageHandler
                     ((float)winSize.height + point.y) / ((float)src.rows));
 
         Size sz((int)(scale*src.cols + 0.5F), (int)(scale*src.rows + 0.5F));
+        img.release(); // Earlier levels may still reference it
         resize(src, img, sz);
     }
 
-    bool getNeg(Mat &_img)
+    // Moves to the next window, returns false if it is at another scale or image
+    bool advance()
     {
-        if (img.empty())
-            nextNeg();
+        if ((int)(point.x + (1.0F + stepFactor) * winSize.width) < img.cols) {
+            point.x += (int)(stepFactor * winSize.width);
+            return true;
+        }
 
-        Mat m(winSize.height, winSize.width, CV_8UC1, (void*)(img.data + point.y * img.step + point.x * img.elemSize()), img.step);
-        m.copyTo(_img);
+        point.x = offset.x;
+        if ((int)( point.y + (1.0F + stepFactor ) * winSize.height ) < img.rows) {
+            point.y += (int)(stepFactor * winSize.height);
+            return true;
+        }
 
-        if ((int)(point.x + (1.0F + stepFactor) * winSize.width) < img.cols)
-            point.x += (int)(stepFactor * winSize.width);
-        else {
-            point.x = offset.x;
-            if ((int)( point.y + (1.0F + stepFactor ) * winSize.height ) < img.rows)
-                point.y += (int)(stepFactor * winSize.height);
-            else {
-                point.y = offset.y;
-                scale *= scaleFactor;
-                if (scale <= 1.0F)
-                    resize(src, img, Size((int)(scale*src.cols), (int)(scale*src.rows)));
-                else
-                    nextNeg();
-            }
+        point.y = offset.y;
+        scale *= scaleFactor;
+        if (scale <= 1.0F) {
+            img.release();
+            resize(src, img, Size((int)(scale*src.cols), (int)(scale*src.rows)));
+        } else {
+            nextNeg();
         }
-        return true;
+        return false;
+    }
+
+    // Returns the current scale of the current negative image and the positions of its remaining windows in scan order,
+    // moving past them. Windows in a row are (int)(stepFactor * winSize.width) apart.
+    Mat getNegLevel(std::vector<Point> &points)
+    {
+        if (img.empty())
+            nextNeg();
+
+        Mat level = img;
+        points.clear();
+        do {
+            points.push_back(point);
+        } while (advance());
+        return level;
     }
 
     bool getPos(Mat &_img)
@@ -115,6 +132,9 @@ struct ImageHandler
  * \br_property int numPos The number of positives to feed each stage during training
  * \br_property int numNegs The number of negatives to feed each stage during training. A negative sample must have been classified by the previous stages in the cascade as positive to be fed to the next stage during training.
  * \br_property float maxFAR A termination parameter. Calculated as (number of passed negatives) / (total number of checked negatives) for a given stage during training. If that number is below the given maxFAR cascade training is terminated early. This can help prevent overfitting.
+ *
+ * Negatives are mined in parallel, a whole scale of a background image at a time through the batched classify().
+ * Windows scanned after the last needed negative of a stage are skipped rather than revisited by the next stage.
  * \br_paper Paul Viola, Michael Jones
  *           Rapid Object Detection using a Boosted Cascade of Simple Features
  *           CVPR, 2001
@@ -186,6 +206,29 @@ class CascadeClassifier : public Classifier
         return 1.0f;
     }
 
+    // Windows rejected by a stage are masked out of the remaining stages, which stop once every window is rejected
+    void classify(const Mat &image, int origin, int step, int count, uchar *mask, float *confidences) const
+    {
+        QVarLengthArray<uchar, 64> active(count);
+        QVarLengthArray<float, 64> stageConfidences(count);
+        for (int i = 0; i < count; i++)
+            if (mask[i]) confidences[i] = 0;
+
+        foreach (const Classifier *stage, stages) {
+            memcpy(active.data(), mask, count);
+            stage->classify(image, origin, step, count, mask, stageConfidences.data());
+
+            bool remaining = false;
+            for (int i = 0; i < count; i++)
+                if (active[i]) {
+                    confidences[i] += stageConfidences[i];
+                    remaining = remaining || mask[i];
+                }
+            if (!remaining)
+                return;
+        }
+    }
+
     int numFeatures() const
     {
         return stages.first()->numFeatures();
@@ -224,6 +267,55 @@ class CascadeClassifier : public Classifier
     }
 
 private:
+    static const int BatchSize = 16; // Neighboring windows classified together
+    static const int MaxWaveLevels = 256;
+    static const int MinWaveWindows = 1 << 14;
+    static const int MaxWaveWindows = 1 << 22;
+
+    // The remaining windows at one scale of a negative image
+    struct NegLevel
+    {
+        Mat image;
+        int step;
+        std::vector<Point> points;
+        QList<int> positives; // Indices of the windows passing every stage
+    };
+
+    void mineLevel(NegLevel *level) const
+    {
+        const std::vector<Point> &points = level->points;
+        const Mat repImage = preprocess(level->image);
+        if (!repImage.isContinuous()) {
+            const Size size = windowSize();
+            for (size_t i = 0; i < points.size(); i++) {
+                float confidence = 0.0f;
+                if (classify(level->image(Rect(points[i], size)).clone(), true, &confidence) > 0.0f)
+                    level->positives.append(i);
+            }
+            return;
+        }
+
+        uchar mask[BatchSize];
+        float confidences[BatchSize];
+        size_t begin = 0;
+        while (begin < points.size()) {
+            // The windows of one row
+            size_t end = begin + 1;
+            while ((end < points.size()) && (points[end].y == points[begin].y))
+                end++;
+
+            for (size_t i = begin; i < end; i += BatchSize) {
+                const int count = std::min(BatchSize, int(end - i));
+                memset(mask, 1, count);
+                classify(repImage, points[i].y*repImage.cols + points[i].x, level->step, count, mask, confidences);
+                for (int j = 0; j < count; j++)
+                    if (mask[j])
+                        level->positives.append(i + j);
+            }
+            begin = end;
+        }
+    }
+
     float fillTrainingSet(ImageHandler &imgHandler, QList<Mat> &images, QList<float> &labels)
     {
         imgHandler.restart();
@@ -246,17 +338,46 @@ private:
         qDebug() << "POS count : consumed  " << posCount << ":" << imgHandler.posIdx;
 
         int passedNegs = 0;
+        int waveWindows = MinWaveWindows;
         while ((images.size() - posCount) < numNegs) {
-            Mat neg(imgHandler.winSize, CV_8UC1);
-            if (!imgHandler.getNeg(neg))
-                qFatal("Cannot get another negative sample!");
-
-            if (classify(neg, true, &confidence) > 0.0f) {
-                printf("NEG current samples: %d\r", images.size() - posCount);
-                images.append(neg);
-                labels.append(0.0f);
+            // Scan whole scales of negative images until the wave is expected to hold the remaining negatives
+            QList<NegLevel> levels;
+            int windows = 0;
+            while ((windows < waveWindows) && (levels.size() < MaxWaveLevels)) {
+                NegLevel level;
+                level.image = imgHandler.getNegLevel(level.points);
+                level.step = (int)(imgHandler.stepFactor * imgHandler.winSize.width);
+                windows += level.points.size();
+                levels.append(level);
+            }
+
+            QFutureSynchronizer<void> futures;
+            for (int j = 0; j < levels.size(); j++)
+                futures.addFuture(QtConcurrent::run(this, &CascadeClassifier::mineLevel, &levels[j]));
+            futures.waitForFinished();
+
+            // Accepted in scan order, so the first numNegs negatives are the ones a serial scan finds
+            foreach (const NegLevel &level, levels) {
+                int checked = level.points.size();
+                foreach (int j, level.positives) {
+                    images.append(level.image(Rect(level.points[j], imgHandler.winSize)).clone());
+                    labels.append(0.0f);
+                    if ((images.size() - posCount) >= numNegs) {
+                        checked = j + 1;
+                        break;
+                    }
+                }
+                passedNegs += checked;
+                if ((images.size() - posCount) >= numNegs)
+                    break; // The rest of the wave is skipped
             }
-            passedNegs++;
+
+            const int negCount = images.size() - posCount;
+            if (negCount > 0)
+                waveWindows = (int)std::min((qint64)MaxWaveWindows, std::max((qint64)MinWaveWindows, (qint64)(numNegs - negCount) * passedNegs / negCount));
+            else
+                waveWindows = std::min(MaxWaveWindows, 2 * waveWindows);
+            printf("NEG current samples: %d, checked: %d, acceptanceRatio: %g\r", negCount, passedNegs, negCount / (double)passedNegs);
         }
 
         double acceptanceRatio = (images.size() - posCount) / (double)passedNegs;
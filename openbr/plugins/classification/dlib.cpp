@@ -17,30 +17,54 @@ using namespace dlib;
 namespace br
 {
 
-/*!
- * \ingroup transforms
- * \brief Wrapper to dlib's landmarker.
- * \author Scott Klum \cite sklum
- */
-class DLibShapeResourceMaker : public ResourceMaker<shape_predictor>
+// Prediction only reads the model, so every thread uses the one copy loaded per process.
+struct DLibShapePredictor
 {
+    const shape_predictor &model;
+
+    DLibShapePredictor(const shape_predictor &model) : model(model) {}
+};
+
+class DLibShapeResourceMaker : public SharedResourceMaker<DLibShapePredictor, shape_predictor>
+{
+public:
+    DLibShapeResourceMaker()
+        : SharedResourceMaker<DLibShapePredictor, shape_predictor>(file())
+    {}
 
 private:
-    shape_predictor *make() const
+    static QString file()
+    {
+        return Globals->sdkPath + "/share/openbr/models/dlib/shape_predictor_68_face_landmarks.dat";
+    }
+
+    shape_predictor *load() const
     {
         shape_predictor *sp = new shape_predictor();
-        dlib::deserialize(qPrintable(Globals->sdkPath + "/share/openbr/models/dlib/shape_predictor_68_face_landmarks.dat")) >> *sp;
+        dlib::deserialize(qPrintable(file())) >> *sp;
         return sp;
     }
+
+    DLibShapePredictor *instantiate(const shape_predictor &model) const
+    {
+        return new DLibShapePredictor(model);
+    }
 };
 
+/*!
+ * \ingroup transforms
+ * \brief Wrapper to dlib's landmarker.
+ *
+ * The image is wrapped rather than copied, and every rect of a template is landmarked with it before the points are appended.
+ * \author Scott Klum \cite sklum
+ */
 class DLandmarkerTransform : public UntrainableTransform
 {
     Q_OBJECT
 
 private:
 
-    Resource<shape_predictor> shapeResource;
+    Resource<DLibShapePredictor> shapeResource;
 
     void init()
     {
@@ -49,26 +73,24 @@ private:
 
     void project(const Template &src, Template &dst) const
     {
-        dst = src;            
-
-        if (!src.file.rects().isEmpty()) {
-            shape_predictor *sp = shapeResource.acquire();
-
-            cv_image<unsigned char> cimg(src.m());
-            array2d<unsigned char> image;
-            assign_image(image,cimg);
-
-            for (int j=0; j<src.file.rects().size(); ++j)
-            {
-                QRectF rect = src.file.rects()[j];
-                rectangle r(rect.left(),rect.top(),rect.right(),rect.bottom());
-                full_object_detection shape = (*sp)(image, r);
-                for (size_t i=0; i<shape.num_parts(); i++)
-                    dst.file.appendPoint(QPointF(shape.part(i)(0),shape.part(i)(1)));
-            }
+        dst = src;
 
-            shapeResource.release(sp);
+        const QList<QRectF> rects = src.file.rects();
+        if (rects.isEmpty())
+            return;
+
+        const cv_image<unsigned char> image(src.m());
+        QList<QPointF> points;
+
+        DLibShapePredictor *sp = shapeResource.acquire();
+        foreach (const QRectF &rect, rects) {
+            const full_object_detection shape = sp->model(image, rectangle(rect.left(),rect.top(),rect.right(),rect.bottom()));
+            for (size_t i=0; i<shape.num_parts(); i++)
+                points.append(QPointF(shape.part(i)(0),shape.part(i)(1)));
         }
+        shapeResource.release(sp);
+
+        dst.file.appendPoints(points);
     }
 };
 
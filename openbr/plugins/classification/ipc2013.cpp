@@ -17,6 +17,11 @@ static PXCAccelerator *pxcAccelerator = NULL;
  */
 class IPC2013Initializer : public Initializer
 {
+	QStringList plugins() const
+	{
+		return QStringList() << "IPC2013FaceRecognitionTransfrom";
+	}
+
 	void initialize() const
 	{
 		PXCSession_Create(&pxcSession);
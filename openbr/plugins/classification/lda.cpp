@@ -14,12 +14,15 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrent>
 #include <Eigen/Dense>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
 
+#include <openbr/core/arena.h>
 #include <openbr/core/common.h>
 #include <openbr/core/eigenutils.h>
 #include <openbr/core/opencvutils.h>
@@ -45,6 +48,69 @@ class EigenInitializer : public Initializer
 
 BR_REGISTER(Initializer, EigenInitializer)
 
+/*!
+ * \brief Projects a batch of templates through weights * (x - mean) as a few blocked matrix products instead of one product per template.
+ *
+ * The batch is split into one contiguous chunk per thread, each stacked into a matrix and multiplied at once.
+ */
+class BatchProjection
+{
+    const Eigen::MatrixXf &weights;
+    const bool transposed; // Multiply by weights.transpose() instead
+    const Eigen::VectorXf &mean;
+
+    static const int MinChunkSize = 32;
+
+public:
+    BatchProjection(const Eigen::MatrixXf &weights, bool transposed, const Eigen::VectorXf &mean)
+        : weights(weights), transposed(transposed), mean(mean) {}
+
+    // Appends the projections to dst, or returns false leaving dst untouched for batches that should be projected one template at a time
+    bool project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (src.size() < 2)
+            return false;
+        foreach (const Template &t, src)
+            if ((t.size() != 1) || (t.m().type() != CV_32FC1) || !t.m().isContinuous() || (t.m().rows*t.m().cols != mean.rows()))
+                return false;
+
+        TemplateList projected;
+        projected.reserve(src.size());
+        for (int i=0; i<src.size(); i++)
+            projected.append(Template(src[i].file));
+
+        const int chunks = Globals->parallelism > 1 ? std::max(1, std::min(QThread::idealThreadCount(), src.size() / MinChunkSize)) : 1;
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<chunks; i++) {
+            const int begin = src.size() * i / chunks, end = src.size() * (i+1) / chunks;
+            if (i == chunks - 1) projectRange(&src, &projected, begin, end);
+            else                 futures.addFuture(QtConcurrent::run(this, &BatchProjection::projectRange, &src, &projected, begin, end));
+        }
+        futures.waitForFinished();
+        dst.append(projected);
+        return true;
+    }
+
+private:
+    void projectRange(const TemplateList *src, TemplateList *dst, int begin, int end) const
+    {
+        const int dimsIn = mean.rows();
+        Eigen::MatrixXf data(dimsIn, end - begin);
+        for (int i=begin; i<end; i++)
+            data.col(i - begin) = Eigen::Map<const Eigen::VectorXf>((*src)[i].m().ptr<float>(), dimsIn) - mean;
+
+        Eigen::MatrixXf out;
+        if (transposed) out.noalias() = weights.transpose() * data;
+        else            out.noalias() = weights * data;
+
+        for (int i=begin; i<end; i++) {
+            cv::Mat m = Arena::mat(1, out.rows(), CV_32FC1);
+            Eigen::Map<Eigen::VectorXf>(m.ptr<float>(), out.rows()) = out.col(i - begin);
+            (*dst)[i].append(m);
+        }
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Projects input into learned Principal Component Analysis subspace.
@@ -54,29 +120,48 @@ BR_REGISTER(Initializer, EigenInitializer)
  * \br_property float keep Options are: [keep < 0 - All eigenvalues are retained, keep == 0 - No PCA is performed and the eigenvectors form an identity matrix, 0 < keep < 1 - Keep is the fraction of the variance to retain, keep >= 1 - keep is the number of leading eigenvectors to retain] Default is 0.95.
  * \br_property int drop BRENDAN OR JOSH FILL ME IN. Default is 0.
  * \br_property bool whiten BRENDAN OR JOSH FILL ME IN. Default is false.
+ * \br_property Solver solver How the eigenvectors are found, the Covariance and Randomized solvers never hold the training set as a double precision matrix. Default is Dense.
+ * \br_property int rank Components estimated by the Randomized solver when keep is a fraction, otherwise keep + drop are estimated. Default is 0.
+ * \br_property int powerIterations Extra passes the Randomized solver makes over the training set, each one sharpening the estimated components. Default is 2.
  */
 class PCATransform : public Transform
 {
     Q_OBJECT
+    Q_ENUMS(Solver)
     friend class DFFSTransform;
     friend class LDATransform;
 
+public:
+    /*!< */
+    enum Solver { Dense, // Eigendecomposition of the covariance of the training set, held in memory
+                  Covariance, // Eigendecomposition of the covariance, accumulated from blocks of the training set
+                  Randomized }; // Randomized eigendecomposition of the leading components, multiplying blocks of the training set
+
 protected:
     Q_PROPERTY(float keep READ get_keep WRITE set_keep RESET reset_keep STORED false)
     Q_PROPERTY(int drop READ get_drop WRITE set_drop RESET reset_drop STORED false)
     Q_PROPERTY(bool whiten READ get_whiten WRITE set_whiten RESET reset_whiten STORED false)
+    Q_PROPERTY(Solver solver READ get_solver WRITE set_solver RESET reset_solver STORED false)
+    Q_PROPERTY(int rank READ get_rank WRITE set_rank RESET reset_rank STORED false)
+    Q_PROPERTY(int powerIterations READ get_powerIterations WRITE set_powerIterations RESET reset_powerIterations STORED false)
 
     BR_PROPERTY(float, keep, 0.95)
     BR_PROPERTY(int, drop, 0)
     BR_PROPERTY(bool, whiten, false)
+    BR_PROPERTY(Solver, solver, Dense)
+    BR_PROPERTY(int, rank, 0)
+    BR_PROPERTY(int, powerIterations, 2)
 
     Eigen::VectorXf mean, eVals;
     Eigen::MatrixXf eVecs;
 
     int originalRows;
 
+    static const int BlockSize = 1024; // Training templates per streamed block
+    static const int Oversampling = 10; // Extra components estimated by the Randomized solver
+
 public:
-    PCATransform() : keep(0.95), drop(0), whiten(false) {}
+    PCATransform() : keep(0.95), drop(0), whiten(false), solver(Dense), rank(0), powerIterations(2) {}
 
 private:
     double residualReconstructionError(const Template &src) const
@@ -96,27 +181,175 @@ private:
             qFatal("Requires single channel 32-bit floating point matrices.");
 
         originalRows = trainingSet.first().m().rows;
-        int dimsIn = trainingSet.first().m().rows * trainingSet.first().m().cols;
-        const int instances = trainingSet.size();
+
+        if ((solver != Dense) && (keep != 0)) {
+            trainStreaming(trainingSet);
+            return;
+        }
 
         // Map into 64-bit Eigen matrix
-        Eigen::MatrixXd data(dimsIn, instances);
-        for (int i=0; i<instances; i++)
-            data.col(i) = Eigen::Map<const Eigen::MatrixXf>(trainingSet[i].m().ptr<float>(), dimsIn, 1).cast<double>();
+        Eigen::MatrixXd data;
+        EigenUtils::templatesToMatrix(trainingSet, data);
 
         trainCore(data);
     }
 
+    // Contiguous ranges of the training set, one per thread
+    static QList<QPair<int,int> > threadRanges(int instances)
+    {
+        const int chunks = Globals->parallelism > 1 ? std::max(1, std::min(QThread::idealThreadCount(), instances / BlockSize)) : 1;
+        QList<QPair<int,int> > ranges;
+        for (int i=0; i<chunks; i++)
+            ranges.append(QPair<int,int>(instances * i / chunks, instances * (i+1) / chunks));
+        return ranges;
+    }
+
+    // Templates [begin, end) as mean centered columns
+    Eigen::MatrixXd centeredBlock(const TemplateList &data, int begin, int end) const
+    {
+        const Eigen::VectorXd center = mean.cast<double>();
+        Eigen::MatrixXd block(mean.rows(), end - begin);
+        for (int i=begin; i<end; i++)
+            block.col(i - begin) = Eigen::Map<const Eigen::VectorXf>(data[i].m().ptr<float>(), mean.rows()).cast<double>() - center;
+        return block;
+    }
+
+    void accumulateMoments(const TemplateList *data, int begin, int end, Eigen::VectorXd *sum, double *squares) const
+    {
+        const int dimsIn = sum->rows();
+        for (int i=begin; i<end; i++) {
+            const Eigen::Map<const Eigen::VectorXf> x((*data)[i].m().ptr<float>(), dimsIn);
+            *sum += x.cast<double>();
+            *squares += x.cast<double>().squaredNorm();
+        }
+    }
+
+    void accumulateCovariance(const Eigen::MatrixXd *block, Eigen::MatrixXd *cov, int begin, int end) const
+    {
+        // Each thread owns a strip of rows, so the blocks can be shared without copies of the covariance
+        cov->middleRows(begin, end - begin).noalias() += block->middleRows(begin, end - begin) * block->transpose();
+    }
+
+    // product = data * data^T * basis over templates [begin, end), streamed in blocks
+    void multiplyCovariance(const TemplateList *data, const Eigen::MatrixXd *basis, Eigen::MatrixXd *product, int begin, int end) const
+    {
+        for (int i=begin; i<end; i+=BlockSize) {
+            const Eigen::MatrixXd block = centeredBlock(*data, i, std::min(i + BlockSize, end));
+            product->noalias() += block * (block.transpose() * *basis);
+        }
+    }
+
+    // The covariance of the training set times basis, without forming the covariance
+    Eigen::MatrixXd covarianceProduct(const TemplateList &data, const Eigen::MatrixXd &basis) const
+    {
+        const QList<QPair<int,int> > ranges = threadRanges(data.size());
+        QList<Eigen::MatrixXd> products;
+        for (int i=0; i<ranges.size(); i++)
+            products.append(Eigen::MatrixXd::Zero(basis.rows(), basis.cols()));
+
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<ranges.size(); i++)
+            futures.addFuture(QtConcurrent::run(this, &PCATransform::multiplyCovariance, &data, &basis, &products[i], ranges[i].first, ranges[i].second));
+        futures.waitForFinished();
+
+        Eigen::MatrixXd product = products[0];
+        for (int i=1; i<products.size(); i++)
+            product += products[i];
+        return product / (data.size() - 1.0);
+    }
+
+    static Eigen::MatrixXd orthonormalize(const Eigen::MatrixXd &m)
+    {
+        Eigen::HouseholderQR<Eigen::MatrixXd> qr(m);
+        return qr.householderQ() * Eigen::MatrixXd::Identity(m.rows(), m.cols());
+    }
+
+    void trainStreaming(const TemplateList &trainingSet)
+    {
+        const int dimsIn = trainingSet.first().m().rows * trainingSet.first().m().cols;
+        const int instances = trainingSet.size();
+        foreach (const Template &t, trainingSet)
+            if ((t.m().type() != CV_32FC1) || !t.m().isContinuous() || (t.m().rows * t.m().cols != dimsIn))
+                qFatal("Requires continuous single channel 32-bit floating point matrices of equal size.");
+
+        // Mean and total energy in one pass
+        const QList<QPair<int,int> > ranges = threadRanges(instances);
+        QList<Eigen::VectorXd> sums;
+        QVector<double> squares(ranges.size(), 0);
+        for (int i=0; i<ranges.size(); i++)
+            sums.append(Eigen::VectorXd::Zero(dimsIn));
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<ranges.size(); i++)
+            futures.addFuture(QtConcurrent::run(this, &PCATransform::accumulateMoments, &trainingSet, ranges[i].first, ranges[i].second, &sums[i], &squares[i]));
+        futures.waitForFinished();
+
+        Eigen::VectorXd sum = Eigen::VectorXd::Zero(dimsIn);
+        double squaredNorms = 0;
+        for (int i=0; i<ranges.size(); i++) {
+            sum += sums[i];
+            squaredNorms += squares[i];
+        }
+        mean = (sum / instances).cast<float>();
+        const double totalEnergy = std::max(0.0, (squaredNorms - sum.squaredNorm() / instances) / (instances - 1.0));
+
+        Eigen::MatrixXd allEVals, allEVecs;
+        if (solver == Covariance) {
+            Eigen::MatrixXd cov = Eigen::MatrixXd::Zero(dimsIn, dimsIn);
+            const int strips = std::min(QThread::idealThreadCount(), dimsIn);
+            for (int i=0; i<instances; i+=BlockSize) {
+                const Eigen::MatrixXd block = centeredBlock(trainingSet, i, std::min(i + BlockSize, instances));
+                for (int j=0; j<strips; j++)
+                    futures.addFuture(QtConcurrent::run(this, &PCATransform::accumulateCovariance, &block, &cov, dimsIn * j / strips, dimsIn * (j+1) / strips));
+                futures.waitForFinished();
+                futures.clearFutures();
+            }
+            cov /= (instances - 1.0);
+
+            // Compute eigendecomposition. Returns eigenvectors/eigenvalues in increasing order by eigenvalue.
+            Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(cov);
+            allEVals = eSolver.eigenvalues();
+            allEVecs = eSolver.eigenvectors();
+        } else {
+            const int components = keep >= 1 ? (int)keep + drop : rank;
+            if ((components <= 0) || (keep < 0))
+                qFatal("Randomized PCA needs keep >= 1, or a fractional keep and rank > 0.");
+
+            // Range finder with power iterations, then the eigendecomposition of the covariance restricted to that range
+            cv::RNG rng;
+            Eigen::MatrixXd basis(dimsIn, std::min(components + Oversampling, std::min(dimsIn, instances)));
+            for (int i=0; i<basis.rows(); i++)
+                for (int j=0; j<basis.cols(); j++)
+                    basis(i, j) = rng.gaussian(1);
+
+            basis = orthonormalize(covarianceProduct(trainingSet, basis));
+            for (int i=0; i<powerIterations; i++)
+                basis = orthonormalize(covarianceProduct(trainingSet, basis));
+
+            Eigen::MatrixXd projected = basis.transpose() * covarianceProduct(trainingSet, basis);
+            projected = (projected + projected.transpose()) / 2;
+            Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(projected);
+
+            // Only the requested components, the oversampled ones are less accurate
+            const int estimated = std::min(components, (int)basis.cols());
+            allEVals = eSolver.eigenvalues().tail(estimated);
+            allEVecs = basis * eSolver.eigenvectors().rightCols(estimated);
+        }
+
+        selectComponents(allEVals, allEVecs, totalEnergy);
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        dst = cv::Mat(1, keep, CV_32FC1);
+        dst = Arena::mat(1, keep, CV_32FC1);
 
         // Map Eigen into OpenCV
-        Eigen::Map<const Eigen::MatrixXf> inMap(src.m().ptr<float>(), src.m().rows*src.m().cols, 1);
-        Eigen::Map<Eigen::MatrixXf> outMap(dst.m().ptr<float>(), keep, 1);
+        EigenUtils::vectorView(dst.m()) = eVecs.transpose() * (EigenUtils::vectorView(src.m()) - mean);
+    }
 
-        // Do projection
-        outMap = eVecs.transpose() * (inMap - mean);
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!BatchProjection(eVecs, true, mean).project(src, dst))
+            Transform::project(src, dst);
     }
 
     void store(QDataStream &stream) const
@@ -160,11 +393,17 @@ protected:
             allEVals = Eigen::VectorXd::Ones(dimsIn);
         }
 
+        selectComponents(allEVals, allEVecs, allEVals.sum());
+    }
+
+    // Eigenvalues are in increasing order, totalEnergy is their sum over every dimension even if only the leading ones are known
+    void selectComponents(const Eigen::MatrixXd &allEVals, const Eigen::MatrixXd &allEVecs, double totalEnergy)
+    {
+        const int dimsIn = allEVecs.rows();
         if (keep <= 0) {
             keep = dimsIn - drop;
         } else if (keep < 1) {
             // Keep eigenvectors that retain a certain energy percentage.
-            const double totalEnergy = allEVals.sum();
             if (totalEnergy == 0) {
                 keep = 0;
             } else {
@@ -282,12 +521,15 @@ BR_REGISTER(Transform, DFFSTransform)
  * \br_property QString inputVariable BRENDAN OR JOSH FILL ME IN. Default is "Label".
  * \br_property bool isBinary BRENDAN OR JOSH FILL ME IN. Default is false.
  * \br_property bool normalize BRENDAN OR JOSH FILL ME IN. Default is true.
+ * \br_property br::PCATransform::Solver pcaSolver Solver of the initial PCA. Default is Dense.
+ * \br_property int pcaRank Components the initial PCA estimates with the Randomized solver. Default is 0.
  */
 class LDATransform : public Transform
 {
     friend class SparseLDATransform;
 
     Q_OBJECT
+    Q_ENUMS(br::PCATransform::Solver)
     Q_PROPERTY(float pcaKeep READ get_pcaKeep WRITE set_pcaKeep RESET reset_pcaKeep STORED false)
     Q_PROPERTY(bool pcaWhiten READ get_pcaWhiten WRITE set_pcaWhiten RESET reset_pcaWhiten STORED false)
     Q_PROPERTY(int directLDA READ get_directLDA WRITE set_directLDA RESET reset_directLDA STORED false)
@@ -295,6 +537,8 @@ class LDATransform : public Transform
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
     Q_PROPERTY(bool isBinary READ get_isBinary WRITE set_isBinary RESET reset_isBinary STORED false)
     Q_PROPERTY(bool normalize READ get_normalize WRITE set_normalize RESET reset_normalize STORED false)
+    Q_PROPERTY(br::PCATransform::Solver pcaSolver READ get_pcaSolver WRITE set_pcaSolver RESET reset_pcaSolver STORED false)
+    Q_PROPERTY(int pcaRank READ get_pcaRank WRITE set_pcaRank RESET reset_pcaRank STORED false)
     BR_PROPERTY(float, pcaKeep, 0.98)
     BR_PROPERTY(bool, pcaWhiten, false)
     BR_PROPERTY(int, directLDA, 0)
@@ -302,6 +546,8 @@ class LDATransform : public Transform
     BR_PROPERTY(QString, inputVariable, "Label")
     BR_PROPERTY(bool, isBinary, false)
     BR_PROPERTY(bool, normalize, true)
+    BR_PROPERTY(PCATransform::Solver, pcaSolver, PCATransform::Dense)
+    BR_PROPERTY(int, pcaRank, 0)
 
     int dimsOut;
     Eigen::VectorXf mean;
@@ -318,6 +564,8 @@ class LDATransform : public Transform
         PCATransform pca;
         pca.keep = pcaKeep;
         pca.whiten = pcaWhiten;
+        pca.solver = pcaSolver;
+        pca.rank = pcaRank;
         pca.train(trainingSet);
         mean = pca.mean;
 
@@ -333,9 +581,8 @@ class LDATransform : public Transform
         const int numClasses = classCounts.size();
 
         // Map Eigen into OpenCV
-        Eigen::MatrixXd data = Eigen::MatrixXd(dimsIn, instances);
-        for (int i=0; i<instances; i++)
-            data.col(i) = Eigen::Map<const Eigen::MatrixXf>(ldaTrainingSet[i].m().ptr<float>(), dimsIn, 1).cast<double>();
+        Eigen::MatrixXd data;
+        EigenUtils::templatesToMatrix(ldaTrainingSet, data);
 
         // Removing class means
         Eigen::MatrixXd classMeans = Eigen::MatrixXd::Zero(dimsIn, numClasses);
@@ -487,15 +734,25 @@ class LDATransform : public Transform
         dst = cv::Mat(1, dimsOut, CV_32FC1);
 
         // Map Eigen into OpenCV
-        Eigen::Map<Eigen::MatrixXf> inMap((float*)src.m().ptr<float>(), src.m().rows*src.m().cols, 1);
-        Eigen::Map<Eigen::MatrixXf> outMap(dst.m().ptr<float>(), dimsOut, 1);
-
-        // Do projection
-        outMap = projection.transpose() * (inMap - mean);
+        EigenUtils::vectorView(dst.m()) = projection.transpose() * (EigenUtils::vectorView(src.m()) - mean);
         if (normalize && isBinary)
             dst.m().at<float>(0,0) = dst.m().at<float>(0,0) / stdDev;
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        TemplateList projected;
+        if (!BatchProjection(projection, true, mean).project(src, projected)) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        if (normalize && isBinary)
+            for (int i=0; i<projected.size(); i++)
+                projected[i].m().at<float>(0,0) = projected[i].m().at<float>(0,0) / stdDev;
+        dst.append(projected);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << pcaKeep;
@@ -603,6 +860,23 @@ class SparseLDATransform : public Transform
         ldaSparse.project(Template(src.file, inSelect), dst);
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        TemplateList selected;
+        selected.reserve(src.size());
+        foreach (const Template &t, src) {
+            if (t.isEmpty()) {
+                Transform::project(src, dst);
+                return;
+            }
+            cv::Mat inSelect(selections.size(), 1, CV_32F);
+            for (int i = 0; i < selections.size(); i++)
+                inSelect.at<float>(i) = t.m().at<float>(selections[i]);
+            selected.append(Template(t.file, inSelect));
+        }
+        ldaSparse.project(selected, dst);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << pcaKeep;
@@ -683,9 +957,8 @@ class WCDATransform : public Transform
         const int dimsIn = templates.first().m().rows * templates.first().m().cols;
 
         // Map data into Eigen
-        MatrixXf data(dimsIn, instances);
-        for (int i=0; i<instances; i++)
-            data.col(i) = Map<const VectorXf>(templates[i].m().ptr<float>(), dimsIn);
+        MatrixXf data;
+        EigenUtils::templatesToMatrix(templates, data);
 
         // Perform PCA dimensionality reduction
         VectorXf pcaEvals;
@@ -779,6 +1052,12 @@ class WCDATransform : public Transform
         outMap = projection * (inMap - mean);
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!BatchProjection(projection, false, mean).project(src, dst))
+            Transform::project(src, dst);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << mean << compressed << a << b;
@@ -1,4 +1,6 @@
 #include <QTemporaryFile>
+#include <QVarLengthArray>
+#include <QtConcurrent>
 #include <opencv2/core/core.hpp>
 #include <opencv2/ml/ml.hpp>
 
@@ -45,8 +47,29 @@ static void loadModel(model &m, QDataStream &stream)
     m = *load_model(qPrintable(tempFile.fileName()));
 }
 
+// Trains the binary classifier of one class against the rest, writing its weights to w
+static void trainOneVsRest(const problem *prob, const parameter *param, double label, double *w)
+{
+    problem sub = *prob;
+    sub.y = new double[prob->l];
+    for (int i=0; i<prob->l; i++)
+        sub.y[i] = (prob->y[i] == label) ? 1 : -1;
+
+    model *binary = train_svm(&sub, param);
+    // A binary model's weights favor its first label, which is whichever of +1/-1 was seen first
+    const double sign = (binary->label[0] == 1) ? 1 : -1;
+    for (int j=0; j<binary->nr_feature; j++)
+        w[j] = sign * binary->w[j];
+
+    free_and_destroy_model(&binary);
+    delete[] sub.y;
+}
+
 /*!
  * \brief Wraps LibLinear's Linear SVM framework.
+ *
+ * Samples are converted to sparse feature nodes, skipping zeros.
+ * Multi-class problems with a one-vs-rest solver train each class in parallel.
  * \author Scott Klum \cite sklum
  */
 class Linear : public Transform
@@ -99,18 +122,23 @@ private:
         for (int i=0; i<prob.l; i++)
             prob.y[i] = labels.at<float>(i,0);
 
-        // Allocate enough memory for l feature_nodes pointers
+        if (samples.type() != CV_32FC1)
+            qFatal("Expected single channel floating point training data.");
+
+        // One allocation holds the non-zero feature_nodes of every sample, each list terminated by index -1
         prob.x = new feature_node*[prob.l];
-        feature_node *x_space = new feature_node[(prob.n+1)*prob.l];
+        feature_node *x_space = new feature_node[countNonZero(samples)+prob.l];
 
         int k = 0;
         for (int i=0; i<prob.l; i++) {
             prob.x[i] = &x_space[k];
-            for (int j=0; j<prob.n; j++) {
-                x_space[k].index = j+1;
-                x_space[k].value = samples.at<float>(i,j);
-                k++;
-            }
+            const float *row = samples.ptr<float>(i);
+            for (int j=0; j<prob.n; j++)
+                if (row[j] != 0) {
+                    x_space[k].index = j+1;
+                    x_space[k].value = row[j];
+                    k++;
+                }
             x_space[k++].index = -1;
         }
 
@@ -138,7 +166,38 @@ private:
             param.weight = NULL;
         }
 
-        m = *train_svm(&prob, &param);
+        QList<double> classes;
+        for (int i=0; i<prob.l; i++)
+            if (!classes.contains(prob.y[i]))
+                classes.append(prob.y[i]);
+
+        const bool oneVsRest = (classes.size() > 2) && !weight && (Globals->parallelism > 1) &&
+                               (solver != MCSVM_CS) && (solver != L2R_L2LOSS_SVR) && (solver != L2R_L2LOSS_SVR_DUAL) && (solver != L2R_L1LOSS_SVR_DUAL);
+        if (oneVsRest) {
+            // Equivalent to liblinear's own one-vs-rest loop, with classes in order of first appearance
+            const int nr_class = classes.size();
+            QVector<double> weights(nr_class*prob.n);
+            QFutureSynchronizer<void> futures;
+            for (int c=0; c<nr_class; c++)
+                futures.addFuture(QtConcurrent::run(trainOneVsRest, &prob, &param, classes[c], weights.data() + c*prob.n));
+            futures.waitForFinished();
+
+            model *multi = (model*) malloc(sizeof(model));
+            multi->param = param;
+            multi->nr_class = nr_class;
+            multi->nr_feature = prob.n;
+            multi->bias = prob.bias;
+            multi->label = (int*) malloc(nr_class*sizeof(int));
+            multi->w = (double*) malloc(nr_class*prob.n*sizeof(double));
+            for (int c=0; c<nr_class; c++) {
+                multi->label[c] = int(classes[c]);
+                for (int j=0; j<prob.n; j++)
+                    multi->w[j*nr_class+c] = weights[c*prob.n+j];
+            }
+            m = *multi;
+        } else {
+            m = *train_svm(&prob, &param);
+        }
 
         delete[] param.weight;
         delete[] param.weight_label;
@@ -152,13 +211,18 @@ private:
         dst = src;
 
         Mat sample = src.m().reshape(1,1);
-        feature_node *x_space = new feature_node[sample.cols+1];
-
-        for (int j=0; j<sample.cols; j++) {
-            x_space[j].index = j+1;
-            x_space[j].value = sample.at<float>(0,j);
-        }
-        x_space[sample.cols].index = -1;
+        QVarLengthArray<feature_node, 1024> x_space;
+        const float *row = sample.ptr<float>();
+        for (int j=0; j<sample.cols; j++)
+            if (row[j] != 0) {
+                feature_node node;
+                node.index = j+1;
+                node.value = row[j];
+                x_space.append(node);
+            }
+        feature_node terminator;
+        terminator.index = -1;
+        x_space.append(terminator);
 
         float prediction;
         double prob_estimates[m.nr_class];
@@ -172,13 +236,13 @@ private:
             solver == MCSVM_CS              ||
             solver == L1R_L2LOSS_SVC)
         {
-            prediction = predict_values(&m,x_space,prob_estimates);
+            prediction = predict_values(&m,x_space.data(),prob_estimates);
             if (returnDFVal) prediction = prob_estimates[0];
         } else if (solver == L2R_LR         ||
                    solver == L2R_LR_DUAL    ||
                    solver == L1R_LR)
         {
-            prediction = predict_probability(&m,x_space,prob_estimates);
+            prediction = predict_probability(&m,x_space.data(),prob_estimates);
             if (returnDFVal) prediction = prob_estimates[0];
         }
 
@@ -188,8 +252,6 @@ private:
         } else {
             dst.file.set(outputVariable,prediction);
         }
-
-        delete[] x_space;
     }
 
     void store(QDataStream &stream) const
@@ -14,7 +14,10 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
+#include <Eigen/Dense>
 #include <opencv2/ml/ml.hpp>
+#include <algorithm>
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
@@ -35,6 +38,13 @@ namespace br
  * \br_property QStringList inputVariables Metadata keys for the labels associated with each template. There should be the same number of keys in the list as there are neurons in the final layer. Default is QStringList().
  * \br_property QStringList outputVariables Metadata keys to store the output of the neural network. There should be the same number of keys in the list as there are neurons in the final layer. Default is QStringList().
  * \br_property QList<int> neuronsPerLayer The number of neurons in each layer of the net. Default is QList<int>() << 1 << 1.
+ * \br_property int batchSize Samples per mini-batch gradient step, each batch split across threads. If 0 the net is trained by OpenCV's RPROP instead. Default is 0.
+ * \br_property int epochs Number of passes over the training data in mini-batch training. Default is 100.
+ * \br_property float learningRate Step size of mini-batch training. Default is 0.01.
+ * \br_property float momentum Momentum of mini-batch training. Default is 0.9.
+ *
+ * Mini-batch training starts from OpenCV's input and output scaling and initial weights, and minimizes the same squared error.
+ * Template lists are evaluated in one batched forward pass.
  */
 class MLPTransform : public MetaTransform
 {
@@ -47,6 +57,10 @@ class MLPTransform : public MetaTransform
     Q_PROPERTY(QStringList inputVariables READ get_inputVariables WRITE set_inputVariables RESET reset_inputVariables STORED false)
     Q_PROPERTY(QStringList outputVariables READ get_outputVariables WRITE set_outputVariables RESET reset_outputVariables STORED false)
     Q_PROPERTY(QList<int> neuronsPerLayer READ get_neuronsPerLayer WRITE set_neuronsPerLayer RESET reset_neuronsPerLayer STORED false)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
+    Q_PROPERTY(int epochs READ get_epochs WRITE set_epochs RESET reset_epochs STORED false)
+    Q_PROPERTY(float learningRate READ get_learningRate WRITE set_learningRate RESET reset_learningRate STORED false)
+    Q_PROPERTY(float momentum READ get_momentum WRITE set_momentum RESET reset_momentum STORED false)
 
 public:
 
@@ -61,9 +75,15 @@ private:
     BR_PROPERTY(QStringList, inputVariables, QStringList())
     BR_PROPERTY(QStringList, outputVariables, QStringList())
     BR_PROPERTY(QList<int>, neuronsPerLayer, QList<int>() << 1 << 1)
+    BR_PROPERTY(int, batchSize, 0)
+    BR_PROPERTY(int, epochs, 100)
+    BR_PROPERTY(float, learningRate, 0.01)
+    BR_PROPERTY(float, momentum, 0.9)
 
     CvANN_MLP mlp;
 
+    typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Matrix;
+
     void init()
     {
         if (kernel == Gaussian)
@@ -88,12 +108,155 @@ private:
         for (int i=0; i<inputVariables.size(); i++)
             labels.col(i) += OpenCVUtils::toMat(File::get<float>(data, inputVariables.at(i)));
 
-        mlp.train(_data,labels,Mat());
+        if (batchSize > 0) {
+            if (kernel == Gaussian)
+                qFatal("Mini-batch training does not support the Gaussian kernel.");
+            // A single RPROP iteration computes OpenCV's scaling and initial weights
+            CvANN_MLP_TrainParams params;
+            params.term_crit = cvTermCriteria(CV_TERMCRIT_ITER, 1, 0);
+            mlp.train(_data,labels,Mat(),Mat(),params);
+            trainMiniBatch(_data, labels);
+        } else {
+            mlp.train(_data,labels,Mat());
+        }
 
         if (Globals->verbose)
             for (int i=0; i<neuronsPerLayer.size(); i++) qDebug() << *mlp.get_weights(i);
     }
 
+    // In place, z = f(z) as computed by CvANN_MLP
+    void activate(Matrix &z) const
+    {
+        if (kernel == Sigmoid) {
+            const Matrix u = (z * -alpha).array().exp().matrix();
+            z = (beta * (1 - u.array()) / (1 + u.array())).matrix();
+        }
+    }
+
+    // df/dz in terms of the activation a = f(z)
+    Matrix derivative(const Matrix &a) const
+    {
+        if (kernel == Sigmoid)
+            return (alpha / (2*beta) * (beta*beta - a.array().square())).matrix();
+        return Matrix::Ones(a.rows(), a.cols());
+    }
+
+    // Squared error gradient of a chunk of a mini-batch, summed over its samples
+    void gradient(const QList<Matrix> *weights, const Matrix *x, const Matrix *t, QList<Matrix> *gradients) const
+    {
+        QList<Matrix> activations;
+        activations.append(*x);
+        for (int i=0; i<weights->size(); i++) {
+            const Matrix &w = (*weights)[i];
+            Matrix z = activations.last() * w.topRows(w.rows()-1);
+            z.rowwise() += w.row(w.rows()-1);
+            activate(z);
+            activations.append(z);
+        }
+
+        Matrix delta = (activations.last() - *t).cwiseProduct(derivative(activations.last()));
+        for (int i=weights->size()-1; i>=0; i--) {
+            const Matrix &w = (*weights)[i];
+            Matrix &g = (*gradients)[i];
+            g.resize(w.rows(), w.cols());
+            g.topRows(w.rows()-1) = activations[i].transpose() * delta;
+            g.row(w.rows()-1) = delta.colwise().sum();
+            if (i > 0)
+                delta = (delta * w.topRows(w.rows()-1).transpose()).cwiseProduct(derivative(activations[i]));
+        }
+    }
+
+    void trainMiniBatch(const Mat &data, const Mat &labels)
+    {
+        const int layers = neuronsPerLayer.size() - 1;
+        const int inputs = neuronsPerLayer.first(), outputs = neuronsPerLayer.last();
+
+        // Map the samples and labels into the net's scaled space
+        Matrix x(data.rows, inputs), t(labels.rows, outputs);
+        const double *inputScale = mlp.get_weights(0), *outputScale = mlp.get_weights(layers+1);
+        for (int i=0; i<data.rows; i++) {
+            for (int j=0; j<inputs; j++)
+                x(i,j) = data.at<float>(i,j) * inputScale[2*j] + inputScale[2*j+1];
+            for (int j=0; j<outputs; j++)
+                t(i,j) = (labels.at<float>(i,j) - outputScale[2*j+1]) / outputScale[2*j];
+        }
+
+        QList<Matrix> weights, velocities;
+        for (int l=0; l<layers; l++) {
+            Matrix w(neuronsPerLayer[l]+1, neuronsPerLayer[l+1]);
+            const double *src = mlp.get_weights(l+1);
+            for (int i=0; i<w.size(); i++)
+                w.data()[i] = src[i];
+            weights.append(w);
+            velocities.append(Matrix::Zero(w.rows(), w.cols()));
+        }
+
+        QList<int> order;
+        for (int i=0; i<data.rows; i++)
+            order.append(i);
+
+        const int threads = std::max(1, std::min(Globals->parallelism, batchSize / 16));
+        for (int epoch=0; epoch<epochs; epoch++) {
+            std::random_shuffle(order.begin(), order.end());
+            for (int begin=0; begin<order.size(); begin+=batchSize) {
+                const int size = std::min(batchSize, order.size()-begin);
+                const int chunks = std::min(threads, size);
+                QList<Matrix> xs, ts;
+                QVector< QList<Matrix> > gradients(chunks);
+                for (int c=0; c<chunks; c++) {
+                    const int first = begin + size*c/chunks, last = begin + size*(c+1)/chunks;
+                    Matrix xc(last-first, inputs), tc(last-first, outputs);
+                    for (int i=first; i<last; i++) {
+                        xc.row(i-first) = x.row(order[i]);
+                        tc.row(i-first) = t.row(order[i]);
+                    }
+                    xs.append(xc);
+                    ts.append(tc);
+                    gradients[c] = weights;
+                }
+
+                QFutureSynchronizer<void> futures;
+                for (int c=0; c<chunks; c++)
+                    futures.addFuture(QtConcurrent::run(this, &MLPTransform::gradient, &weights, &xs[c], &ts[c], &gradients[c]));
+                futures.waitForFinished();
+
+                for (int l=0; l<layers; l++) {
+                    Matrix g = gradients[0][l];
+                    for (int c=1; c<chunks; c++)
+                        g += gradients[c][l];
+                    velocities[l] = momentum*velocities[l] - (learningRate/size)*g;
+                    weights[l] += velocities[l];
+                }
+            }
+        }
+
+        for (int l=0; l<layers; l++) {
+            double *dst = mlp.get_weights(l+1);
+            for (int i=0; i<weights[l].size(); i++)
+                dst[i] = weights[l].data()[i];
+        }
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (src.isEmpty())
+            return;
+
+        // One forward pass for the whole list
+        QList<Mat> samples;
+        foreach (const Template &t, src)
+            samples.append(t.m().reshape(1,1));
+        Mat responses;
+        mlp.predict(OpenCVUtils::toMat(samples), responses);
+
+        for (int i=0; i<src.size(); i++) {
+            Template t = src[i];
+            for (int j=0; j<outputVariables.size(); j++)
+                t.file.set(outputVariables.at(j), responses.at<float>(i,j));
+            dst.append(t);
+        }
+    }
+
     void project(const Template &src, Template &dst) const
     {
         dst = src;
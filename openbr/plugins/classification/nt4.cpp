@@ -51,12 +51,21 @@ class NT4Initializer : public Initializer
         }
     }
 
+    QStringList plugins() const
+    {
+        return QStringList() << "NT4DetectFace" << "NT4EnrollFace" << "NT4EnrollIris" << "NT4Compare";
+    }
+
     void initialize() const
     {
         NCoreOnStart();
+        manageLicenses(true);
+    }
+
+    void registerAbbreviations() const
+    {
         Globals->abbreviations.insert("NT4Face", "Open+NT4DetectFace!NT4EnrollFace:NT4Compare");
         Globals->abbreviations.insert("NT4Iris", "Open+NT4EnrollIris:NT4Compare");
-        manageLicenses(true);
     }
 
     void finalize() const
@@ -407,6 +416,8 @@ BR_REGISTER(Transform, NT4EnrollIris)
 /*!
  * \ingroup distances
  * \brief Compare templates with Neurotech SDK 4
+ *
+ * Each block of comparisons holds one matcher, which is started once per target and then identifies every query against it.
  * \author Josh Klontz \cite jklontz
  * \author E. Taborsky \cite mmtaborsky
  */
@@ -445,6 +456,40 @@ class NT4Compare : public Distance
         contexts.release(context);
         return score;
     }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        NT4Context *context = contexts.acquire();
+
+        for (int j=0; j<target.size(); j++) {
+            const Mat &srcA = target[j];
+            if (!srcA.data) {
+                for (int i=0; i<query.size(); i++)
+                    output->setRelative(-std::numeric_limits<float>::max(), i+queryOffset, j+targetOffset);
+                continue;
+            }
+
+            NResult result = NMIdentifyStartEx(context->matcher, srcA.data, srcA.rows*srcA.cols, NULL);
+            if (NFailed(result)) qFatal("NT4Compare::compareBlock NMIdentifyStart() failed, result=%i.", result);
+
+            for (int i=0; i<query.size(); i++) {
+                const Mat &srcB = query[i];
+                float score = -std::numeric_limits<float>::max();
+                if (srcB.data) {
+                    NInt pScore;
+                    result = NMIdentifyNextEx(context->matcher, srcB.data, srcB.rows*srcB.cols, NULL, &pScore);
+                    if (NFailed(result)) qFatal("NT4Compare::compareBlock NMIdentifyNext() failed, result=%i.", result);
+                    score = float(pScore);
+                }
+                output->setRelative(score, i+queryOffset, j+targetOffset);
+            }
+
+            result = NMIdentifyEnd(context->matcher);
+            if (NFailed(result)) qFatal("NT4Compare::compareBlock NMIdentifyEnd() failed, result=%i.", result);
+        }
+
+        contexts.release(context);
+    }
 };
 
 BR_REGISTER(Distance, NT4Compare)
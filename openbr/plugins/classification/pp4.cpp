@@ -1,4 +1,3 @@
-#include <QThreadPool>
 #include <QMap>
 #include <QVariant>
 #include <pittpatt_errors.h>
@@ -36,7 +35,14 @@ class PP4Initializer : public Initializer
 {
     Q_OBJECT
 
-    void initialize() const
+    QStringList plugins() const
+    {
+        return QStringList() << "PP4Enroll" << "PP4Compare";
+    }
+
+    void initialize() const {}
+
+    void registerAbbreviations() const
     {
         Globals->abbreviations.insert("PP4", "Open+PP4Enroll:PP4Compare");
     }
@@ -58,13 +64,13 @@ struct PP4Context
 {
     ppr_context_type context;
 
-    PP4Context()
+    PP4Context(int recognitionThreads = 1)
     {
         context = ppr_get_context();
         TRY(ppr_enable_recognition(context))
         TRY(ppr_set_license(context, my_license_id, my_license_key))
         TRY(ppr_set_models_path(context, qPrintable(Globals->sdkPath + "/models/pp4")))
-        TRY(ppr_set_num_recognition_threads(context, QThreadPool::globalInstance()->maxThreadCount()))
+        TRY(ppr_set_num_recognition_threads(context, recognitionThreads))
         TRY(ppr_set_num_detection_threads(context, 1))
         TRY(ppr_set_detection_precision(context, PPR_FINE_PRECISION))
         TRY(ppr_set_landmark_detector_type(context, PPR_DUAL_MULTI_POSE_LANDMARK_DETECTOR, PPR_AUTOMATIC_LANDMARKS))
@@ -316,6 +322,10 @@ BR_REGISTER(Transform, PP4EnrollTransform)
 /*!
  * \ingroup distances
  * \brief Compare faces using PittPatt 4.
+ *
+ * Enrollment contexts each use one recognition thread and are pooled across the enrolling threads,
+ * while comparisons are made in one ppr_compare_galleries call using all the threads available to the algorithm.
+ * Galleries with the \c native flag set are compared whole instead of block by block.
  * \author Josh Klontz \cite jklontz
  * \warning Needs a maintainer.
  */
@@ -324,6 +334,11 @@ class PP4Compare : public Distance,
 {
     Q_OBJECT
 
+public:
+    PP4Compare()
+        : PP4Context(std::max(1, threadParallelism())) {}
+
+private:
     void compare(const TemplateList &target, const TemplateList &query, Output *output) const
     {
         ppr_gallery_type target_gallery, query_gallery;
@@ -332,7 +347,26 @@ class PP4Compare : public Distance,
         QList<int> target_template_ids, query_template_ids;
         enroll(target, &target_gallery, target_template_ids);
         enroll(query, &query_gallery, query_template_ids);
+        compareNative(target_gallery, target_template_ids, query_gallery, query_template_ids, output);
+        ppr_free_gallery(target_gallery);
+        ppr_free_gallery(query_gallery);
+    }
+
+    bool compare(const File &targetGallery, const File &queryGallery, const File &output) const
+    {
+        if (!targetGallery.get<bool>("native") || !queryGallery.get<bool>("native"))
+            return false;
+
+        const TemplateList target = TemplateList::fromGallery(targetGallery);
+        const TemplateList query = TemplateList::fromGallery(queryGallery);
+        QScopedPointer<Output> o(Output::make(output, target.files(), query.files()));
+        o->setBlock(0, 0);
+        compare(target, query, o.data());
+        return true;
+    }
 
+    void compareNative(ppr_gallery_type target_gallery, const QList<int> &target_template_ids, ppr_gallery_type query_gallery, const QList<int> &query_template_ids, Output *output) const
+    {
         ppr_similarity_matrix_type similarity_matrix;
         TRY(ppr_compare_galleries(context, query_gallery, target_gallery, &similarity_matrix))
 
@@ -349,8 +383,6 @@ class PP4Compare : public Distance,
         }
 
         ppr_free_similarity_matrix(similarity_matrix);
-        ppr_free_gallery(target_gallery);
-        ppr_free_gallery(query_gallery);
     }
 
     void enroll(const TemplateList &templates, ppr_gallery_type *gallery, QList<int> &template_ids) const
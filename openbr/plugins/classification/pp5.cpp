@@ -42,9 +42,18 @@ class PP5Initializer : public Initializer
 {
     Q_OBJECT
 
+    QStringList plugins() const
+    {
+        return QStringList() << "PP5Enroll" << "PP5Compare" << "PP5Gallery";
+    }
+
     void initialize() const
     {
         TRY(ppr_initialize_sdk(qPrintable(Globals->sdkPath + "/share/openbr/models/pp5/"), my_license_id, my_license_key))
+    }
+
+    void registerAbbreviations() const
+    {
         Globals->abbreviations.insert("PP5","Open+Expand+PP5Enroll!PP5Gallery");
         Globals->abbreviations.insert("PP5Register", "PP5Enroll(true,true,0.02,5,Extended)+RenameFirst([eyeL,PP5_Landmark0_Right_Eye],Affine_0)+RenameFirst([eyeR,PP5_Landmark1_Left_Eye],Affine_1)");
         Globals->abbreviations.insert("PP5CropFace", "Open+PP5Enroll(true)+RenameFirst([eyeL,PP5_Landmark0_Right_Eye],Affine_0)+RenameFirst([eyeR,PP5_Landmark1_Left_Eye],Affine_1)+Affine(128,128,0.25,0.35)+Cvt(Gray)");
@@ -67,7 +76,7 @@ struct PP5Context
 {
     ppr_context_type context;
 
-    PP5Context(bool detectOnly = false, float adaptiveMinSize = 0.01f, int minSize = 4, ppr_landmark_range_type landmarkRange = PPR_LANDMARK_RANGE_COMPREHENSIVE, int searchPruningAggressiveness = 0)
+    PP5Context(bool detectOnly = false, float adaptiveMinSize = 0.01f, int minSize = 4, ppr_landmark_range_type landmarkRange = PPR_LANDMARK_RANGE_COMPREHENSIVE, int searchPruningAggressiveness = 0, int comparisonThreads = 1)
     {
         ppr_settings_type default_settings = ppr_get_default_settings();
 
@@ -86,7 +95,7 @@ struct PP5Context
         default_settings.recognition.automatically_extract_templates = !detectOnly;
         default_settings.recognition.enable_comparison = !detectOnly;
         default_settings.recognition.enable_extraction = !detectOnly;
-        default_settings.recognition.num_comparison_threads = 1;
+        default_settings.recognition.num_comparison_threads = comparisonThreads;
         default_settings.recognition.recognizer = PPR_RECOGNIZER_MULTI_POSE;
         TRY(ppr_initialize_context(default_settings, &context))
     }
@@ -407,6 +416,8 @@ BR_REGISTER(Transform, PP5EnrollTransform)
 /*!
  * \ingroup distances
  * \brief Compare templates with PP5. PP5 distance is known to be asymmetric
+ *
+ * Gallery comparisons are made with one ppr_compare_galleries call, which spreads the work over the threads available to the calling algorithm.
  * \author Josh Klontz \cite jklontz
  * \author E. Taborsky \cite mmtaborsky
  */
@@ -415,6 +426,12 @@ class PP5CompareDistance : public UntrainableDistance
 {
     Q_OBJECT
 
+public:
+    PP5CompareDistance()
+        : PP5Context(false, 0.01f, 4, PPR_LANDMARK_RANGE_COMPREHENSIVE, 0, std::max(1, threadParallelism())) {}
+
+private:
+
     struct NativeGallery
     {
         FileList files;
@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QTemporaryFile>
+#include <QtConcurrent>
 #include <opencv2/core/core.hpp>
 #include <opencv2/ml/ml.hpp>
 
@@ -45,6 +46,10 @@ namespace br
  * \br_property int termCriteria The maximum number of training iterations. Default is 1000.
  * \br_property int folds Cross validation parameter used for autoselecting other parameters. Default is 5.
  * \br_property bool balanceFolds If true and the problem is 2-class classification then more balanced cross validation subsets are created. Default is false.
+ * \br_property int refinements Maximum number of finer grids searched around the best C and gamma of a C_SVC with a Linear or RBF kernel, stopping early when a grid brings no improvement. Default is 0.
+ *
+ * When C or gamma is -1 for a C_SVC with a Linear or RBF kernel, every (C, gamma, fold) of OpenCV's default grids is trained in parallel,
+ * on folds split once and shared by all grid points. Other SVMs are auto-trained by OpenCV.
  */
 class SVMTransform : public Transform
 {
@@ -61,6 +66,7 @@ class SVMTransform : public Transform
     Q_PROPERTY(int termCriteria READ get_termCriteria WRITE set_termCriteria RESET reset_termCriteria STORED false)
     Q_PROPERTY(int folds READ get_folds WRITE set_folds RESET reset_folds STORED false)
     Q_PROPERTY(bool balanceFolds READ get_balanceFolds WRITE set_balanceFolds RESET reset_balanceFolds STORED false)
+    Q_PROPERTY(int refinements READ get_refinements WRITE set_refinements RESET reset_refinements STORED false)
 
 public:
     enum Kernel { Linear = CvSVM::LINEAR,
@@ -85,6 +91,7 @@ private:
     BR_PROPERTY(int, termCriteria, 1000)
     BR_PROPERTY(int, folds, 5)
     BR_PROPERTY(bool, balanceFolds, false)
+    BR_PROPERTY(int, refinements, 0)
 
     SVM svm;
     QHash<QString, int> labelMap;
@@ -116,7 +123,10 @@ private:
         params.nu = 0.5;
         params.term_crit = cvTermCriteria(CV_TERMCRIT_ITER+CV_TERMCRIT_EPS, termCriteria, FLT_EPSILON);
 
-        if ((C == -1) || ((gamma == -1) && (kernel == CvSVM::RBF))) {
+        if (((C == -1) || ((gamma == -1) && (kernel == CvSVM::RBF))) && (type == C_SVC) && ((kernel == CvSVM::LINEAR) || (kernel == CvSVM::RBF)) && (folds > 1)) {
+            gridSearch(data, lab, params);
+            svm.train(data, lab, Mat(), Mat(), params);
+        } else if ((C == -1) || ((gamma == -1) && (kernel == CvSVM::RBF))) {
             try {
                 svm.train_auto(data, lab, Mat(), Mat(), params, folds,
                                CvSVM::get_default_grid(CvSVM::C),
@@ -140,6 +150,146 @@ private:
         qDebug("SVM C = %f  Gamma = %f  Support Vectors = %d", p.C, p.gamma, svm.get_support_vector_count());
     }
 
+    struct Fold
+    {
+        Mat trainData, trainLabels, testData, testLabels;
+    };
+
+    struct Job
+    {
+        CvSVMParams params;
+        const Fold *fold;
+        int errors;
+    };
+
+    static void evaluate(Job *job)
+    {
+        const Fold &fold = *job->fold;
+        try {
+            CvSVM svm;
+            svm.train(fold.trainData, fold.trainLabels, Mat(), Mat(), job->params);
+            job->errors = 0;
+            for (int i=0; i<fold.testData.rows; i++)
+                if (svm.predict(fold.testData.row(i)) != fold.testLabels.at<float>(i, 0))
+                    job->errors++;
+        } catch (...) {
+            job->errors = fold.testData.rows;
+        }
+    }
+
+    // Held out misclassifications of each (C, gamma), each parameter pair and fold trained in parallel
+    static QList<int> crossValidate(const QList<Fold> &folds, const QList< QPair<double,double> > &candidates, const CvSVMParams &params)
+    {
+        QList<Job> jobs;
+        for (int i=0; i<candidates.size(); i++)
+            for (int j=0; j<folds.size(); j++) {
+                Job job;
+                job.params = params;
+                job.params.C = candidates[i].first;
+                job.params.gamma = candidates[i].second;
+                job.fold = &folds[j];
+                jobs.append(job);
+            }
+
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<jobs.size(); i++)
+            futures.addFuture(QtConcurrent::run(evaluate, &jobs[i]));
+        futures.waitForFinished();
+
+        QList<int> errors;
+        for (int i=0; i<candidates.size(); i++) {
+            int total = 0;
+            for (int j=0; j<folds.size(); j++)
+                total += jobs[i*folds.size()+j].errors;
+            errors.append(total);
+        }
+        return errors;
+    }
+
+    static QList<double> gridValues(const CvParamGrid &grid)
+    {
+        QList<double> values;
+        for (double value=grid.min_val; value<grid.max_val; value*=grid.step)
+            values.append(value);
+        return values;
+    }
+
+    // Chooses C and gamma by cross validation, from OpenCV's default grids and then finer grids around the best pair
+    void gridSearch(const Mat &data, const Mat &labels, CvSVMParams &params) const
+    {
+        // Split the folds once, shuffled and optionally stratified by class
+        QList<int> order;
+        for (int i=0; i<data.rows; i++)
+            order.append(i);
+        std::random_shuffle(order.begin(), order.end());
+        if (balanceFolds) {
+            QMap<float, QList<int> > byClass;
+            foreach (int i, order)
+                byClass[labels.at<float>(i, 0)].append(i);
+            order.clear();
+            foreach (const QList<int> &members, byClass)
+                order.append(members);
+        }
+        QVector<int> assignment(data.rows);
+        for (int i=0; i<order.size(); i++)
+            assignment[order[i]] = i % folds;
+
+        QList<Fold> splits;
+        for (int f=0; f<folds; f++) {
+            Fold fold;
+            for (int i=0; i<data.rows; i++) {
+                if (assignment[i] == f) { fold.testData.push_back(data.row(i));  fold.testLabels.push_back(labels.row(i));  }
+                else                    { fold.trainData.push_back(data.row(i)); fold.trainLabels.push_back(labels.row(i)); }
+            }
+            splits.append(fold);
+        }
+
+        const bool searchC = (C == -1);
+        const bool searchGamma = (gamma == -1) && (kernel == CvSVM::RBF);
+        const QList<double> Cs = searchC ? gridValues(CvSVM::get_default_grid(CvSVM::C)) : QList<double>() << C;
+        const QList<double> gammas = searchGamma ? gridValues(CvSVM::get_default_grid(CvSVM::GAMMA)) : QList<double>() << (gamma == -1 ? 1 : gamma);
+
+        QList< QPair<double,double> > candidates;
+        foreach (double c, Cs)
+            foreach (double g, gammas)
+                candidates.append(QPair<double,double>(c, g));
+
+        QList<int> errors = crossValidate(splits, candidates, params);
+        int best = 0;
+        for (int i=1; i<errors.size(); i++)
+            if (errors[i] < errors[best])
+                best = i;
+        QPair<double,double> bestCandidate = candidates[best];
+        int bestErrors = errors[best];
+
+        double stepC = CvSVM::get_default_grid(CvSVM::C).step;
+        double stepGamma = CvSVM::get_default_grid(CvSVM::GAMMA).step;
+        for (int r=0; (r<refinements) && (bestErrors > 0); r++) {
+            stepC = sqrt(stepC);
+            stepGamma = sqrt(stepGamma);
+            QList< QPair<double,double> > neighbors;
+            for (int i=-1; i<=1; i++)
+                for (int j=-1; j<=1; j++)
+                    if (((i != 0) && searchC) || ((j != 0) && searchGamma))
+                        if ((i == 0 || searchC) && (j == 0 || searchGamma))
+                            neighbors.append(QPair<double,double>(bestCandidate.first * pow(stepC, i), bestCandidate.second * pow(stepGamma, j)));
+
+            errors = crossValidate(splits, neighbors, params);
+            int improved = -1;
+            for (int i=0; i<errors.size(); i++)
+                if (errors[i] < (improved == -1 ? bestErrors : errors[improved]))
+                    improved = i;
+            if (improved == -1)
+                break; // No improvement at this resolution
+            bestCandidate = neighbors[improved];
+            bestErrors = errors[improved];
+        }
+
+        params.C = bestCandidate.first;
+        params.gamma = bestCandidate.second;
+        qDebug("SVM cross validation error = %f", double(bestErrors) / data.rows);
+    }
+
     void project(const Template &src, Template &dst) const
     {
         if (returnDFVal && reverseLookup.size() > 2)
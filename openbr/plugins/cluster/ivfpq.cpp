@@ -0,0 +1,340 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QtConcurrent>
+#include <algorithm>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
+
+using namespace cv;
+
+namespace br
+{
+
+extern QVector< QList<Mat> > ProductQuantizationCenters;
+QVector<Mat> IVFPQCoarseCenters;
+
+// An IVFPQ code is a CV_8UC1 row vector holding the model index and coarse cell, followed by the
+// ProductQuantization code of the residual (its own model index and one codeword index per subspace).
+struct IVFPQCode
+{
+    static const int HeaderSize = sizeof(quint16) + sizeof(qint32);
+
+    quint16 index, pqIndex;
+    qint32 cell;
+    const uchar *codes;
+    int dims;
+
+    IVFPQCode(const Mat &m)
+    {
+        memcpy(&index, m.data, sizeof(quint16));
+        memcpy(&cell, m.data + sizeof(quint16), sizeof(qint32));
+        memcpy(&pqIndex, m.data + HeaderSize, sizeof(quint16));
+        codes = m.data + HeaderSize + sizeof(quint16);
+        dims = int(m.total()) - HeaderSize - sizeof(quint16);
+    }
+
+    // Templates without a code sort after every cell
+    static qint32 cellOf(const Template &t)
+    {
+        if (t.isEmpty()) return std::numeric_limits<qint32>::max();
+        qint32 cell;
+        memcpy(&cell, t.last().data + sizeof(quint16), sizeof(qint32));
+        return cell;
+    }
+};
+
+/*!
+ * \ingroup transforms
+ * \brief Inverted file with product quantized residuals.
+ *
+ * Assigns each template to a coarse cell and product quantizes its residual from the cell center.
+ * The output template retains the feature vector, for asymmetric comparison as a probe, followed by the code.
+ * The cell is also stored in the IVFCell metadata field, and an ivf gallery keeps only the codes, sorted by cell.
+ * \br_paper Jegou, Herve, Matthijs Douze, and Cordelia Schmid.
+ *           "Product quantization for nearest neighbor search."
+ *           Pattern Analysis and Machine Intelligence, IEEE Transactions on 33.1 (2011): 117-128
+ * \br_property br::Transform* quantizer Coarse quantizer, projecting a template to the index of its cell.
+ * \br_property br::Transform* pq Product quantizer of the residuals.
+ * \author Unknown \cite unknown
+ */
+class IVFPQTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform *quantizer READ get_quantizer WRITE set_quantizer RESET reset_quantizer)
+    Q_PROPERTY(br::Transform *pq READ get_pq WRITE set_pq RESET reset_pq)
+    BR_PROPERTY(br::Transform*, quantizer, Transform::make("KMeans(kTrain=1024)", this))
+    BR_PROPERTY(br::Transform*, pq, Transform::make("ProductQuantization(n=2)", this))
+
+    quint16 index;
+    Mat centers;
+
+public:
+    IVFPQTransform()
+    {
+        if (IVFPQCoarseCenters.size() > std::numeric_limits<quint16>::max())
+            qFatal("Out of IVFPQ space!"); // Unlikely
+
+        static QMutex mutex;
+        QMutexLocker locker(&mutex);
+        index = IVFPQCoarseCenters.size();
+        IVFPQCoarseCenters.append(Mat());
+    }
+
+private:
+    int cellOf(const Mat &m) const
+    {
+        Template cell;
+        quantizer->project(Template(m), cell);
+        return cell.m().at<int>(0,0);
+    }
+
+    void train(const TemplateList &src)
+    {
+        quantizer->train(src);
+
+        Mat data;
+        OpenCVUtils::toMatByRow(src.data()).convertTo(data, CV_32F);
+
+        // Every cell of the quantizer gets a center, cells no training sample falls in keep a zero one
+        QList<int> cells;
+        int numCells = quantizer->property("kTrain").toInt();
+        for (int i=0; i<data.rows; i++) {
+            cells.append(cellOf(data.row(i)));
+            numCells = std::max(numCells, cells.last()+1);
+        }
+
+        // Cell centers are the means of their assigned training samples
+        centers = Mat::zeros(numCells, data.cols, CV_32FC1);
+        QVector<int> counts(numCells, 0);
+        for (int i=0; i<data.rows; i++) {
+            Mat center = centers.row(cells[i]);
+            center += data.row(i);
+            counts[cells[i]]++;
+        }
+        for (int i=0; i<numCells; i++)
+            if (counts[i] > 0) {
+                Mat center = centers.row(i);
+                center /= counts[i];
+            }
+
+        TemplateList residuals;
+        for (int i=0; i<data.rows; i++)
+            residuals.append(Template(src[i].file, Mat(data.row(i) - centers.row(cells[i]))));
+        pq->train(residuals);
+
+        IVFPQCoarseCenters[index] = centers;
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        Mat m;
+        src.m().reshape(1, 1).convertTo(m, CV_32F);
+        const qint32 cell = cellOf(m);
+        if ((cell < 0) || (cell >= centers.rows))
+            qFatal("Coarse cell %d is outside the %d cells IVFPQ was trained with.", int(cell), centers.rows);
+
+        Template residual;
+        pq->project(Template(src.file, Mat(m - centers.row(cell))), residual);
+
+        Mat code(1, IVFPQCode::HeaderSize + residual.m().total(), CV_8UC1);
+        memcpy(code.data, &index, sizeof(quint16));
+        memcpy(code.data + sizeof(quint16), &cell, sizeof(qint32));
+        memcpy(code.data + IVFPQCode::HeaderSize, residual.m().data, residual.m().total());
+
+        dst = Template(src.file, m);
+        dst.append(code);
+        dst.file.set("IVFCell", cell);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        br::Object::store(stream);
+        stream << index << centers;
+    }
+
+    void load(QDataStream &stream)
+    {
+        br::Object::load(stream);
+        stream >> index >> centers;
+        while (IVFPQCoarseCenters.size() <= index)
+            IVFPQCoarseCenters.append(Mat());
+        IVFPQCoarseCenters[index] = centers;
+    }
+};
+
+BR_REGISTER(Transform, IVFPQTransform)
+
+/*!
+ * \ingroup distances
+ * \brief Asymmetric distance between a probe and IVFPQ coded targets.
+ *
+ * Only targets in the nprobe cells nearest the probe are scored, the rest receive -FLT_MAX.
+ * The distance tables for each probed cell are computed once per probe and shared by every target in it.
+ * When comparing against a single probe, the targets must be in cell order, as read from an ivf gallery.
+ * \br_property int nprobe The number of cells searched per probe, trading speed for recall.
+ * \author Unknown \cite unknown
+ */
+class IVFPQDistance : public UntrainableDistance
+{
+    Q_OBJECT
+    Q_PROPERTY(int nprobe READ get_nprobe WRITE set_nprobe RESET reset_nprobe STORED false)
+    BR_PROPERTY(int, nprobe, 8)
+
+    typedef QHash<int, QVector<int> > InvertedLists; // QHash<cell,target indices>
+
+    struct Probe
+    {
+        QList<int> cells;
+        QList<Mat> luts; // Squared distances from the probe residual to each codeword, one row per subspace
+    };
+
+    // Enrolled probes retain their feature vector, ones read from an ivf gallery are reconstructed from their code
+    static Mat probeVector(const Template &query)
+    {
+        if (query.size() > 1)
+            return query.first().reshape(1, 1);
+
+        const IVFPQCode code(query.last());
+        Mat vector = IVFPQCoarseCenters[code.index].row(code.cell).clone();
+        const QList<Mat> &codebooks = ProductQuantizationCenters[code.pqIndex];
+        int column = 0;
+        for (int i=0; i<code.dims; i++) {
+            const Mat codeword = codebooks[i].row(code.codes[i]);
+            Mat subvector = vector.colRange(column, column + codeword.cols);
+            subvector += codeword;
+            column += codeword.cols;
+        }
+        return vector;
+    }
+
+    Probe probe(const Template &query) const
+    {
+        const IVFPQCode code(query.last());
+        const Mat vector = probeVector(query);
+        const Mat &coarse = IVFPQCoarseCenters[code.index];
+        const QList<Mat> &codebooks = ProductQuantizationCenters[code.pqIndex];
+
+        QVector< QPair<double,int> > cells(coarse.rows);
+        for (int i=0; i<coarse.rows; i++)
+            cells[i] = QPair<double,int>(norm(vector, coarse.row(i), NORM_L2SQR), i);
+        const int probes = std::min(nprobe, coarse.rows);
+        std::partial_sort(cells.begin(), cells.begin() + probes, cells.end());
+
+        Probe probe;
+        for (int i=0; i<probes; i++) {
+            const Mat residual = vector - coarse.row(cells[i].second);
+            Mat lut(codebooks.size(), 256, CV_32FC1);
+            int column = 0;
+            for (int j=0; j<codebooks.size(); j++) {
+                const Mat subresidual = residual.colRange(column, column + codebooks[j].cols);
+                for (int k=0; k<codebooks[j].rows; k++)
+                    lut.at<float>(j,k) = norm(subresidual, codebooks[j].row(k), NORM_L2SQR);
+                column += codebooks[j].cols;
+            }
+            probe.cells.append(cells[i].second);
+            probe.luts.append(lut);
+        }
+        return probe;
+    }
+
+    static float score(const Mat &lut, const Template &target)
+    {
+        const IVFPQCode code(target.last());
+        const float *table = (const float*) lut.data;
+        float distance = 0;
+        for (int i=0; i<code.dims; i++)
+            distance += table[i*256 + code.codes[i]];
+        return -distance;
+    }
+
+    static bool cellLess(const Template &t, int cell)
+    {
+        return IVFPQCode::cellOf(t) < cell;
+    }
+
+    static bool cellGreater(int cell, const Template &t)
+    {
+        return cell < IVFPQCode::cellOf(t);
+    }
+
+    float compare(const Template &target, const Template &query) const
+    {
+        if (target.isEmpty() || query.isEmpty())
+            return -std::numeric_limits<float>::max();
+
+        const Probe p = probe(query);
+        const int i = p.cells.indexOf(IVFPQCode::cellOf(target));
+        return i == -1 ? -std::numeric_limits<float>::max() : score(p.luts[i], target);
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        QVector<float> scores(targets.size(), -std::numeric_limits<float>::max());
+        if (query.isEmpty())
+            return scores.toList();
+
+        const Probe p = probe(query);
+        for (int i=0; i<p.cells.size(); i++) {
+            TemplateList::const_iterator begin = std::lower_bound(targets.begin(), targets.end(), p.cells[i], cellLess);
+            TemplateList::const_iterator end = std::upper_bound(begin, targets.end(), p.cells[i], cellGreater);
+            for (TemplateList::const_iterator target = begin; target != end; ++target)
+                scores[target - targets.begin()] = score(p.luts[i], *target);
+        }
+        return scores.toList();
+    }
+
+    void search(const TemplateList &target, const InvertedLists &lists, const TemplateList &query, Output *output, int queryOffset) const
+    {
+        for (int i=0; i<query.size(); i++) {
+            QVector<float> scores(target.size(), -std::numeric_limits<float>::max());
+            if (!query[i].isEmpty()) {
+                const Probe p = probe(query[i]);
+                for (int j=0; j<p.cells.size(); j++)
+                    foreach (int k, lists.value(p.cells[j]))
+                        scores[k] = score(p.luts[j], target[k]);
+            }
+
+            for (int j=0; j<target.size(); j++)
+                output->setRelative(scores[j], i+queryOffset, j);
+        }
+    }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        // Targets need not be in cell order here, the inverted lists are built once for the whole block of probes
+        InvertedLists lists;
+        for (int i=0; i<target.size(); i++)
+            if (!target[i].isEmpty())
+                lists[IVFPQCode::cellOf(target[i])].append(i);
+
+        const int queryStep = std::max(1, (query.size() + Globals->parallelism - 1) / std::max(1, Globals->parallelism));
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<query.size(); i+=queryStep) {
+            if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &IVFPQDistance::search, target, lists, query.mid(i, queryStep), output, i));
+            else                                                                                    search (target, lists, query.mid(i, queryStep), output, i);
+        }
+        futures.waitForFinished();
+    }
+};
+
+BR_REGISTER(Distance, IVFPQDistance)
+
+} // namespace br
+
+#include "cluster/ivfpq.moc"
@@ -14,10 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <opencv2/flann/flann.hpp>
-
 #include <openbr/plugins/openbr_internal.h>
-#include <openbr/core/opencvutils.h>
+#include <openbr/core/cluster.h>
 
 using namespace cv;
 
@@ -26,11 +24,15 @@ namespace br
 
 /*!
  * \ingroup transforms
- * \brief Wraps OpenCV kmeans and flann.
+ * \brief Wraps OpenCV kmeans, or trains by parallel mini-batch k-means, and assigns the nearest centroids.
  * \author Josh Klontz \cite jklontz
  * \br_property int kTrain The number of random centroids to make at train time. Default is 256.
  * \br_property int kSearch The number of nearest neighbors to search for at runtime. Default is 1.
- * \br_link http://docs.opencv.org/modules/flann/doc/flann_fast_approximate_nearest_neighbor_search.html
+ * \br_property int batchSize Samples per mini-batch k-means iteration, <= 0 uses OpenCV's full batch kmeans. Default is 0.
+ * \br_property int iterations Number of mini-batch k-means iterations. Default is 100.
+ * \br_paper D. Sculley
+ *            Web-Scale K-Means Clustering
+ *            Proceedings of the 19th international conference on World Wide Web, 2010
  */
 class KMeansTransform : public Transform
 {
@@ -38,42 +40,43 @@ class KMeansTransform : public Transform
     Q_PROPERTY(int kTrain READ get_kTrain WRITE set_kTrain RESET reset_kTrain STORED false)
     Q_PROPERTY(int kSearch READ get_kSearch WRITE set_kSearch RESET reset_kSearch STORED false)
     BR_PROPERTY(int, kTrain, 256)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
     BR_PROPERTY(int, kSearch, 1)
+    BR_PROPERTY(int, batchSize, 0)
+    BR_PROPERTY(int, iterations, 100)
 
-    Mat centers;
-    mutable QScopedPointer<flann::Index> index;
-    mutable QMutex mutex;
+    Centroids centroids;
 
-    void reindex()
+    void train(const TemplateList &data)
     {
-        index.reset(new flann::Index(centers, flann::LinearIndexParams()));
+        Mat centers;
+        const double compactness = KMeans(OpenCVUtils::toMatByRow(data.data()), kTrain, centers, NULL, batchSize, iterations);
+        if (compactness >= 0)
+            qDebug("KMeans compactness = %f", compactness);
+        centroids = Centroids(centers);
     }
 
-    void train(const TemplateList &data)
+    void project(const Template &src, Template &dst) const
     {
-        Mat bestLabels;
-        const double compactness = kmeans(OpenCVUtils::toMatByRow(data.data()), kTrain, bestLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, centers);
-        qDebug("KMeans compactness = %f", compactness);
-        reindex();
+        dst = centroids.nearest(src, kSearch).reshape(1, 1);
     }
 
-    void project(const Template &src, Template &dst) const
+    void project(const TemplateList &src, TemplateList &dst) const
     {
-        QMutexLocker locker(&mutex);
-        Mat dists, indicies;
-        index->knnSearch(src, indicies, dists, kSearch);
-        dst = indicies.reshape(1, 1);
+        centroids.nearest(src, kSearch, dst);
     }
 
     void load(QDataStream &stream)
     {
+        Mat centers;
         stream >> centers;
-        reindex();
+        centroids = Centroids(centers);
     }
 
     void store(QDataStream &stream) const
     {
-        stream << centers;
+        stream << centroids.centers();
     }
 };
 
@@ -14,9 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <opencv2/flann/flann.hpp>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/cluster.h>
 #include <openbr/core/common.h>
 #include <openbr/core/opencvutils.h>
 
@@ -31,7 +30,6 @@ namespace br
  * \author Austin Blanton \cite imaus10
  * \br_property int kTrain The number of random centroids to make at train time. Default is 256.
  * \br_property int kSearch The number of nearest neighbors to search for at runtime. Default is 1.
- * \br_link http://docs.opencv.org/modules/flann/doc/flann_fast_approximate_nearest_neighbor_search.html
  */
 class RandomCentroidsTransform : public Transform
 {
@@ -41,41 +39,38 @@ class RandomCentroidsTransform : public Transform
     BR_PROPERTY(int, kTrain, 256)
     BR_PROPERTY(int, kSearch, 1)
 
-    Mat centers;
-    mutable QScopedPointer<flann::Index> index;
-    mutable QMutex mutex;
-
-    void reindex()
-    {
-        index.reset(new flann::Index(centers, flann::LinearIndexParams()));
-    }
+    Centroids centroids;
 
     void train(const TemplateList &data)
     {
         Mat flat = OpenCVUtils::toMatByRow(data.data());
         QList<int> sample = Common::RandSample(kTrain, flat.rows, 0, true);
+        Mat centers;
         foreach (const int &idx, sample)
             centers.push_back(flat.row(idx));
-        reindex();
+        centroids = Centroids(centers);
     }
 
     void project(const Template &src, Template &dst) const
     {
-        QMutexLocker locker(&mutex);
-        Mat dists, indicies;
-        index->knnSearch(src, indicies, dists, kSearch);
-        dst = indicies.reshape(1, 1);
+        dst = centroids.nearest(src, kSearch).reshape(1, 1);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        centroids.nearest(src, kSearch, dst);
     }
 
     void load(QDataStream &stream)
     {
+        Mat centers;
         stream >> centers;
-        reindex();
+        centroids = Centroids(centers);
     }
 
     void store(QDataStream &stream) const
     {
-        stream << centers;
+        stream << centroids.centers();
     }
 };
 
@@ -10,4 +10,5 @@ if(${BR_WITH_LIBAV})
   endforeach()
 else()
   set(BR_EXCLUDED_PLUGINS ${BR_EXCLUDED_PLUGINS} plugins/gallery/keyframes.cpp)
+  set(BR_EXCLUDED_PLUGINS ${BR_EXCLUDED_PLUGINS} plugins/gallery/libav.cpp)
 endif()
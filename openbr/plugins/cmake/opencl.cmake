@@ -0,0 +1,9 @@
+set(BR_WITH_OPENCL OFF CACHE BOOL "Build with OpenCL")
+
+if(${BR_WITH_OPENCL})
+  find_package(OpenCL REQUIRED)
+  include_directories(${OPENCL_INCLUDE_DIRS})
+  set(BR_THIRDPARTY_LIBS ${BR_THIRDPARTY_LIBS} ${OPENCL_LIBRARIES})
+else()
+  set(BR_EXCLUDED_PLUGINS ${BR_EXCLUDED_PLUGINS} plugins/distance/openclbyteL1.cpp)
+endif()
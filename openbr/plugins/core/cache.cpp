@@ -14,6 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QCryptographicHash>
+#include <QQueue>
+#include <QSaveFile>
 #include <openbr/plugins/openbr_internal.h>
 
 namespace br
@@ -22,6 +25,8 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Caches Transform::project() results.
+ *
+ * Under Context::memoryLimit the oldest results are evicted to make room for new ones.
  * \author Josh Klontz \cite jklontz
  */
 class CacheTransform : public MetaTransform
@@ -31,6 +36,7 @@ class CacheTransform : public MetaTransform
     BR_PROPERTY(br::Transform*, transform, NULL)
 
     static QHash<QString, Template> cache;
+    static QQueue<QString> order; // Keys of cache, oldest first
     static QMutex cacheLock;
 
 public:
@@ -61,11 +67,34 @@ private:
             if (!file.open(QFile::ReadOnly))
                 qFatal("Unable to open %s for reading.", qPrintable(file.fileName()));
             QDataStream stream(&file);
-            stream >> cache;
+            QHash<QString, Template> stored;
+            stream >> stored;
             file.close();
+            for (QHash<QString, Template>::const_iterator i = stored.constBegin(); i != stored.constEnd(); ++i)
+                insert(i.key(), i.value());
         }
     }
 
+    // Call with cacheLock held, or before the cache is shared
+    static void insert(const QString &file, const Template &t)
+    {
+        if (cache.contains(file)) {
+            Context::trackMemory("Cache", -qint64(cache.take(file).bytes()));
+            order.removeOne(file);
+        }
+
+        bool reserved;
+        while (!(reserved = Context::reserveMemory("Cache", t.bytes())) && !order.isEmpty())
+            Context::trackMemory("Cache", -qint64(cache.take(order.dequeue()).bytes()));
+
+        // Not even an empty cache has room for it
+        if (!reserved)
+            return;
+
+        cache.insert(file, t);
+        order.enqueue(file);
+    }
+
     void train(const QList<TemplateList> &data)
     {
         transform->train(data);
@@ -74,22 +103,133 @@ private:
     void project(const Template &src, Template &dst) const
     {
         const QString &file = src.file;
-        if (cache.contains(file)) {
+        // Entries may be evicted concurrently
+        cacheLock.lock();
+        const bool cached = cache.contains(file);
+        if (cached)
             dst = cache[file];
-        } else {
+        cacheLock.unlock();
+
+        if (!cached) {
             transform->project(src, dst);
             cacheLock.lock();
-            cache[file] = dst;
+            insert(file, dst);
             cacheLock.unlock();
         }
     }
 };
 
 QHash<QString, Template> CacheTransform::cache;
+QQueue<QString> CacheTransform::order;
 QMutex CacheTransform::cacheLock;
 
 BR_REGISTER(Transform, CacheTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Caches Transform::project() results on disk, so they are reused across processes.
+ *
+ * Results are keyed by the SHA-1 of the wrapped transform's description and model, the input's metadata,
+ * and the input's matrices, or the contents of its file when it has not been opened yet.
+ * Each result is written atomically to its own file, sharded into subdirectories by the first byte of its key,
+ * and concurrent writers are serialized per stripe of keys rather than globally.
+ * \author Unknown \cite unknown
+ * \br_property br::Transform* transform The transform whose results are cached.
+ * \br_property QString path Directory of the cache. Default is "Cache.d".
+ */
+class DiskCacheTransform : public MetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(QString path READ get_path WRITE set_path RESET reset_path STORED false)
+    BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(QString, path, "Cache.d")
+
+    static const int Stripes = 64;
+    mutable QMutex stripes[Stripes];
+    QByteArray modelHash;
+
+    void init()
+    {
+        if (!transform) return;
+
+        trainable = transform->trainable;
+        if (!trainable) hashModel(); // Otherwise the model is hashed once trained or loaded
+    }
+
+    void hashModel()
+    {
+        QByteArray model;
+        QDataStream stream(&model, QIODevice::WriteOnly);
+        transform->store(stream);
+
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(transform->description(true).toUtf8());
+        hash.addData(model);
+        modelHash = hash.result();
+    }
+
+    QByteArray key(const Template &src) const
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(modelHash);
+        hash.addData(src.file.flat().toUtf8());
+        if (src.isEmpty()) {
+            QFile file(src.file.resolved());
+            if (file.open(QFile::ReadOnly))
+                hash.addData(&file);
+        } else {
+            foreach (const cv::Mat &m, src) {
+                const cv::Mat c = m.isContinuous() ? m : m.clone();
+                const int header[3] = { c.rows, c.cols, c.type() };
+                hash.addData((const char*) header, sizeof(header));
+                hash.addData((const char*) c.data, int(c.total() * c.elemSize()));
+            }
+        }
+        return hash.result();
+    }
+
+    void train(const QList<TemplateList> &data)
+    {
+        transform->train(data);
+        hashModel();
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const QByteArray hash = key(src);
+        const QByteArray hex = hash.toHex();
+        const QString fileName = path + "/" + hex.left(2) + "/" + hex;
+
+        QFile cached(fileName);
+        if (cached.open(QFile::ReadOnly)) {
+            QDataStream stream(&cached);
+            stream >> dst;
+            return;
+        }
+
+        transform->project(src, dst);
+
+        QMutexLocker locker(&stripes[uchar(hash[0]) % Stripes]);
+        QDir().mkpath(QFileInfo(fileName).path());
+        QSaveFile file(fileName);
+        if (!file.open(QFile::WriteOnly))
+            qFatal("Unable to open %s for writing.", qPrintable(fileName));
+        QDataStream stream(&file);
+        stream << dst;
+        if (!file.commit())
+            qFatal("Unable to write %s.", qPrintable(fileName));
+    }
+
+    void load(QDataStream &stream)
+    {
+        MetaTransform::load(stream);
+        hashModel();
+    }
+};
+
+BR_REGISTER(Transform, DiskCacheTransform)
+
 } // namespace br
 
 #include "core/cache.moc"
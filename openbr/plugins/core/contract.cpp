@@ -23,7 +23,9 @@ namespace br
  * \ingroup transforms
  * \brief It's like the opposite of ExpandTransform, but not really
  *
- * Given a TemplateList as input, concatenate them into a single Template
+ * Given a TemplateList as input, concatenate them into a single Template.
+ * If the list was expanded by ExpandTransform, the children of each parent are instead
+ * concatenated back into one Template per parent, in a single pass over the list.
  *
  * \author Charles Otto \cite caotto
  */
@@ -31,9 +33,47 @@ class ContractTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
 
+    // The children of one parent, the last child's metadata wins as with Template::merge
+    static Template contracted(const TemplateList &src, int begin, int end)
+    {
+        Template out(src[end-1].file);
+        out.file.remove("ExpandParent");
+        QList<QPointF> points;
+        QList<QRectF> rects;
+        for (int i=begin; i<end; i++) {
+            out.append(src[i]);
+            points.append(src[i].file.points());
+            rects.append(src[i].file.rects());
+            out.file.fte = out.file.fte || src[i].file.fte;
+        }
+        out.file.setPoints(points);
+        out.file.setRects(rects);
+        return out;
+    }
+
     virtual void project(const TemplateList &src, TemplateList &dst) const
     {
         if (src.empty()) return;
+
+        static const MetadataKey parentKey("ExpandParent");
+        bool expanded = false;
+        foreach (const Template &t, src)
+            if (t.file.contains(parentKey)) {
+                expanded = true;
+                break;
+            }
+
+        // Each run of children of the same parent becomes one template, anything else passes through
+        if (expanded) {
+            dst.clear();
+            for (int begin=0, end; begin<src.size(); begin=end) {
+                const QVariant parent = src[begin].file.value(parentKey);
+                for (end=begin+1; parent.isValid() && (end<src.size()) && (src[end].file.value(parentKey) == parent); end++);
+                dst.append(parent.isValid() ? contracted(src, begin, end) : src[begin]);
+            }
+            return;
+        }
+
         Template out;
 
         foreach (const Template &t, src) {
@@ -22,9 +22,16 @@
 namespace br
 {
 
-static void _train(Transform *transform, TemplateList data) // think data has to be a copy -cao
+// Physical memory available to new allocations in bytes, or 0 if unknown
+static qint64 availableMemory()
 {
-    transform->train(data);
+    QFile meminfo("/proc/meminfo");
+    if (!meminfo.open(QFile::ReadOnly))
+        return 0;
+    foreach (const QByteArray &line, meminfo.readAll().split('\n'))
+        if (line.startsWith("MemAvailable:"))
+            return line.mid(13).trimmed().split(' ').first().toLongLong() * 1024;
+    return 0;
 }
 
 /*!
@@ -42,8 +49,14 @@ static void _train(Transform *transform, TemplateList data) // think data has to
  * To use an extended Gallery, add an allPartitions="true" flag to the gallery sigset for those images that should be compared
  * against for all testing partitions.
  *
+ * Folds are trained concurrently, at most maxFolds at a time. By default as many as the available
+ * physical memory allows, estimating each fold's peak usage as memoryFactor times the size of its training data.
+ * The folds share the global thread pool, so each one gets a budget of roughly parallelism / maxFolds threads.
+ *
  * \author Josh Klontz \cite jklontz
  * \author Scott Klum \cite sklum
+ * \br_property int maxFolds Maximum number of folds trained at once, 0 to derive it from the available memory. Default is 0.
+ * \br_property float memoryFactor Estimated peak memory of training a fold, as a multiple of the size of its training data. Default is 4.
  */
 class CrossValidateTransform : public MetaTransform
 {
@@ -53,7 +66,11 @@ class CrossValidateTransform : public MetaTransform
     Q_PROPERTY(unsigned int randomSeed READ get_randomSeed WRITE set_randomSeed RESET reset_randomSeed STORED false)
     BR_PROPERTY(QString, description, "Identity")
     BR_PROPERTY(QString, inputVariable, "Label")
+    Q_PROPERTY(int maxFolds READ get_maxFolds WRITE set_maxFolds RESET reset_maxFolds STORED false)
+    Q_PROPERTY(float memoryFactor READ get_memoryFactor WRITE set_memoryFactor RESET reset_memoryFactor STORED false)
     BR_PROPERTY(unsigned int, randomSeed, 0)
+    BR_PROPERTY(int, maxFolds, 0)
+    BR_PROPERTY(float, memoryFactor, 4)
 
     // numPartitions copies of transform specified by description.
     QList<br::Transform*> transforms;
@@ -75,19 +92,46 @@ class CrossValidateTransform : public MetaTransform
             return;
         }
 
+        const int concurrency = foldConcurrency(data, numPartitions);
+        qDebug("Training %d folds, %d at a time", numPartitions, concurrency);
+
+        // Each worker trains folds until none are left
+        QAtomicInt next(0);
         QFutureSynchronizer<void> futures;
-        for (int i=0; i<numPartitions; i++) {
-            TemplateList partitionedData = data;
-            for (int j=partitionedData.size()-1; j>=0; j--)
-                if (partitions[j] == i)
-                    // Remove data, it's designated for testing
-                    partitionedData.removeAt(j);
-            // Train on the remaining templates
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], partitionedData));
-        }
+        for (int i=0; i<concurrency; i++)
+            futures.addFuture(QtConcurrent::run(this, &CrossValidateTransform::trainFolds, &data, &partitions, numPartitions, &next));
         futures.waitForFinished();
     }
 
+    void trainFolds(const TemplateList *data, const QList<int> *partitions, int numPartitions, QAtomicInt *next)
+    {
+        for (int i = next->fetchAndAddOrdered(1); i < numPartitions; i = next->fetchAndAddOrdered(1)) {
+            // Train on the templates not designated for testing this fold
+            TemplateList partitionedData;
+            for (int j=0; j<data->size(); j++)
+                if ((*partitions)[j] != i)
+                    partitionedData.append((*data)[j]);
+            transforms[i]->train(partitionedData);
+        }
+    }
+
+    int foldConcurrency(const TemplateList &data, int numPartitions) const
+    {
+        if (maxFolds > 0)
+            return std::min(maxFolds, numPartitions);
+
+        qint64 bytes = 0;
+        foreach (const Template &t, data)
+            foreach (const cv::Mat &m, t)
+                bytes += m.total() * m.elemSize();
+
+        const qint64 available = availableMemory();
+        const qint64 perFold = qint64(memoryFactor * bytes * (numPartitions - 1) / numPartitions);
+        if ((available == 0) || (perFold == 0))
+            return numPartitions;
+        return int(std::max(qint64(1), std::min(qint64(numPartitions), available / perFold)));
+    }
+
     void project(const Template &src, Template &dst) const
     {
         Q_UNUSED(src);
@@ -26,15 +26,80 @@ static void _projectList(const Transform *transform, const TemplateList *src, Te
     transform->project(*src, *dst);
 }
 
+// Batches of templates handed out to whichever thread asks next. The calling thread works
+// through the queue too, so it finishes even if no helper ever gets a thread.
+struct DistributeQueue
+{
+    const Transform *transform;
+    const TemplateList *src;
+    QList<TemplateList> *output;
+    int batchSize, batches;
+    QAtomicInt next; // The next batch to hand out
+    QAtomicInt remaining; // Batches not yet finished
+    QMutex lock;
+    QWaitCondition finished;
+
+    // Returns once there are no more batches to hand out
+    void work()
+    {
+        forever {
+            const int batch = next.fetchAndAddOrdered(1);
+            if (batch >= batches)
+                return;
+
+            const int end = std::min(src->size(), (batch + 1) * batchSize);
+            for (int i=batch*batchSize; i<end; i++) {
+                TemplateList input;
+                input.append(src->at(i));
+                _projectList(transform, &input, &(*output)[i]);
+            }
+
+            if (remaining.fetchAndAddOrdered(-1) == 1) {
+                QMutexLocker locker(&lock);
+                finished.wakeAll();
+            }
+        }
+    }
+
+    void wait()
+    {
+        QMutexLocker locker(&lock);
+        while (remaining.loadAcquire() > 0)
+            finished.wait(&lock);
+    }
+};
+
+// Helpers may start after the queue is drained and the caller returned, so they share ownership of it
+class DistributeWorker : public QRunnable
+{
+    QSharedPointer<DistributeQueue> queue;
+
+public:
+    DistributeWorker(const QSharedPointer<DistributeQueue> &queue) : queue(queue) {}
+
+    void run()
+    {
+        queue->work();
+    }
+};
+
 /*!
- * \brief DOCUMENT ME CHARLES
+ * \brief Projects each template of a list through transform separately and in parallel.
+ *
+ * Templates are handed out in small batches to the threads as they become free, so a few
+ * expensive templates don't leave the other threads idle, and the outputs keep the input order.
+ * Unless transform is time varying, and so may wait on streams of its own, the threads are those
+ * of the executor shared with the streams of the same parent.
+ * \br_property int batchSize Templates handed out at once, 0 to choose from the number of templates and threads.
  * \author Unknown \cite unknown
  */
 class DistributeTemplateTransform : public MetaTransform
 {
     Q_OBJECT
     Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
     BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(int, batchSize, 0)
 
 public:
 
@@ -92,34 +157,28 @@ public:
         // Pre-allocate output for each template
         QList<TemplateList> output_buffer;
         output_buffer.reserve(src.size());
-
-        // Can't declare this local to the loop because it would go out of scope
-        QList<TemplateList> input_buffer;
-        input_buffer.reserve(src.size());
-
-        QFutureSynchronizer<void> futures;
-
-        for (int i =0; i < src.size();i++) {
-            input_buffer.append(TemplateList());
+        for (int i =0; i < src.size();i++)
             output_buffer.append(TemplateList());
-        }
-        QList<QFuture<void> > temp;
-        temp.reserve(src.size());
-        for (int i=0; i<src.size(); i++) {
-            input_buffer[i].append(src[i]);
 
-            if (Globals->parallelism > 1) temp.append(QtConcurrent::run(_projectList, transform, &input_buffer[i], &output_buffer[i]));
-            else _projectList(transform, &input_buffer[i], &output_buffer[i]);
-        }
-        // We add the futures in reverse order, since in Qt 5.1 at least the
-        // waiting thread will wait on them in the order added (which for uniform priority
-        // threads is the order of execution), and we want the waiting thread to go in the opposite order
-        // so that it can steal runnables and do something besides wait.
-        for (int i = temp.size() - 1; i >= 0; i--) {
-            futures.addFuture(temp[i]);
+        const int threads = std::max(1, Globals->parallelism);
+        QSharedPointer<DistributeQueue> queue(new DistributeQueue());
+        queue->transform = transform;
+        queue->src = &src;
+        queue->output = &output_buffer;
+        // Several batches per thread by default, so uneven templates even out
+        queue->batchSize = batchSize > 0 ? batchSize : std::max(1, src.size() / (8 * threads));
+        queue->batches = (src.size() + queue->batchSize - 1) / queue->batchSize;
+        queue->next.storeRelease(0);
+        queue->remaining.storeRelease(queue->batches);
+
+        // The calling thread is one of the workers
+        const int helpers = std::min(threads, queue->batches) - 1;
+        for (int i=0; i<helpers; i++) {
+            if (transform->timeVarying()) QThreadPool::globalInstance()->start(new DistributeWorker(queue));
+            else                          startStreamJob(parent(), new DistributeWorker(queue));
         }
-
-        futures.waitForFinished();
+        queue->work();
+        queue->wait();
 
         for (int i=0; i<src.size(); i++) dst.append(output_buffer[i]);
     }
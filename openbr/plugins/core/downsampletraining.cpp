@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
 #include <openbr/plugins/openbr_internal.h>
 
 namespace br
@@ -86,10 +87,21 @@ static TemplateList Downsample(const TemplateList &templates, int classes, int i
     return downsample;
 }
 
+static void _project(const Transform *transform, const TemplateList *src, TemplateList *dst)
+{
+    transform->project(*src, *dst);
+}
+
 /*!
  * \ingroup transforms
  * \brief DOCUMENT ME JOSH
+ *
+ * If projection is set, the training data is streamed through it in blocks of Context::blockSize templates,
+ * and each projected template is offered to a reservoir sample of instances templates of its class.
+ * Only the reservoirs are kept, and they are downsampled as usual before training transform.
+ * The projection is untrainable, and it is also applied ahead of transform when projecting.
  * \author Josh Klontz \cite jklontz
+ * \br_property br::Transform* projection Optional untrainable transform to stream the training data through while sampling it. Default is NULL.
  */
 class DownsampleTrainingTransform : public Transform
 {
@@ -101,6 +113,7 @@ class DownsampleTrainingTransform : public Transform
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
     Q_PROPERTY(QStringList gallery READ get_gallery WRITE set_gallery RESET reset_gallery STORED false)
     Q_PROPERTY(QStringList subjects READ get_subjects WRITE set_subjects RESET reset_subjects STORED false)
+    Q_PROPERTY(br::Transform* projection READ get_projection WRITE set_projection RESET reset_projection STORED false)
     BR_PROPERTY(br::Transform*, transform, NULL)
     BR_PROPERTY(int, classes, std::numeric_limits<int>::max())
     BR_PROPERTY(int, instances, std::numeric_limits<int>::max())
@@ -108,17 +121,27 @@ class DownsampleTrainingTransform : public Transform
     BR_PROPERTY(QString, inputVariable, "Label")
     BR_PROPERTY(QStringList, gallery, QStringList())
     BR_PROPERTY(QStringList, subjects, QStringList())
-
+    BR_PROPERTY(br::Transform*, projection, NULL)
 
     Transform *simplify(bool &newTForm)
     {
+        if (projection) {
+            newTForm = false;
+            return this;
+        }
         Transform *res = transform->simplify(newTForm);
         return res;
     }
 
     void project(const Template &src, Template &dst) const
     {
-       transform->project(src,dst);
+        if (projection) {
+            Template projected;
+            projection->project(src, projected);
+            transform->project(projected, dst);
+        } else {
+            transform->project(src,dst);
+        }
     }
 
 
@@ -127,10 +150,61 @@ class DownsampleTrainingTransform : public Transform
         if (!transform || !transform->trainable)
             return;
 
-        TemplateList downsampled = Downsample(data, classes, instances, fraction, inputVariable, gallery, subjects);
+        TemplateList downsampled = Downsample(projection ? reservoirSample(data) : data, classes, instances, fraction, inputVariable, gallery, subjects);
 
         transform->train(downsampled);
     }
+
+    TemplateList reservoirSample(const TemplateList &data) const
+    {
+        const int capacity = abs(instances);
+        if (instances == std::numeric_limits<int>::max())
+            qWarning("DownsampleTraining is streaming without an instance limit, every template will be kept.");
+
+        QHash<QString,TemplateList> reservoirs;
+        QHash<QString,qint64> seen;
+        QList<QString> order; // Classes in the order they were first seen
+        const int chunks = std::max(1, Globals->parallelism);
+        for (int begin=0; begin<data.size(); begin+=Globals->blockSize) {
+            const TemplateList block = data.mid(begin, Globals->blockSize);
+            QList<TemplateList> inputs, outputs;
+            for (int i=0; i<chunks; i++) {
+                inputs.append(block.mid(block.size() * i / chunks, block.size() * (i+1) / chunks - block.size() * i / chunks));
+                outputs.append(TemplateList());
+            }
+
+            QFutureSynchronizer<void> futures;
+            for (int i=0; i<chunks; i++)
+                futures.addFuture(QtConcurrent::run(_project, projection, &inputs[i], &outputs[i]));
+            futures.waitForFinished();
+
+            foreach (const TemplateList &projected, outputs)
+                foreach (const Template &t, projected) {
+                    if (t.file.fte || t.file.get<bool>("FTE", false) || t.file.get<bool>("PossibleFTE", false))
+                        continue;
+
+                    const QString label = t.file.get<QString>(inputVariable);
+                    if (!seen.contains(label))
+                        order.append(label);
+                    const qint64 n = ++seen[label];
+                    TemplateList &reservoir = reservoirs[label];
+                    if (reservoir.size() < capacity) {
+                        reservoir.append(t);
+                    } else {
+                        // Keep the new template with probability capacity/n
+                        const qint64 r = qint64(double(rand()) / (double(RAND_MAX) + 1) * n);
+                        if (r < capacity)
+                            reservoir[int(r)] = t;
+                    }
+                }
+        }
+
+        TemplateList sample;
+        foreach (const QString &label, order)
+            sample.append(reservoirs[label]);
+        qDebug("Reservoir sampled %d of %d training templates", sample.size(), data.size());
+        return sample;
+    }
 };
 
 BR_REGISTER(Transform, DownsampleTrainingTransform)
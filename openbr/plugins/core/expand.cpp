@@ -21,8 +21,15 @@ namespace br
 
 static TemplateList Expanded(const TemplateList &templates)
 {
+    int size = 0;
+    foreach (const Template &t, templates)
+        size += std::max(t.size(), 1);
+
+    static const MetadataKey parentKey("ExpandParent");
     TemplateList expanded;
-    foreach (const Template &t, templates) {
+    expanded.reserve(size);
+    for (int parent=0; parent<templates.size(); parent++) {
+        const Template &t = templates[parent];
         const bool enrollAll = t.file.get<bool>("enrollAll");
         if (t.isEmpty()) {
             if (!enrollAll)
@@ -30,6 +37,12 @@ static TemplateList Expanded(const TemplateList &templates)
             continue;
         }
 
+        // A single matrix keeps all of the parent's points and rects, so its metadata is shared with the parent
+        if (t.size() == 1) {
+            expanded.append(t);
+            continue;
+        }
+
         const QList<QPointF> points = t.file.points();
         const QList<QRectF> rects = t.file.rects();
         if (points.size() % t.size() != 0) qFatal("Uneven point count.");
@@ -37,10 +50,13 @@ static TemplateList Expanded(const TemplateList &templates)
         const int pointStep = points.size() / t.size();
         const int rectStep = rects.size() / t.size();
 
+        // Children of the same parent carry its index, see ContractTransform
         for (int i=0; i<t.size(); i++) {
             expanded.append(Template(t.file, t[i]));
-            expanded.last().file.setRects(rects.mid(i*rectStep, rectStep));
-            expanded.last().file.setPoints(points.mid(i*pointStep, pointStep));
+            File &file = expanded.last().file;
+            file.setRects(rects.mid(i*rectStep, rectStep));
+            file.setPoints(points.mid(i*pointStep, pointStep));
+            file.set(parentKey, parent);
         }
     }
     return expanded;
@@ -14,6 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QSaveFile>
 #include <QtConcurrent>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -21,9 +22,33 @@
 namespace br
 {
 
-static void _train(Transform *transform, const QList<TemplateList> *data)
+static void _train(Transform *transform, const QList<TemplateList> *data, QString checkpoint)
 {
     transform->train(*data);
+    if (checkpoint.isEmpty())
+        return;
+
+    QDir().mkpath(QFileInfo(checkpoint).path());
+    QSaveFile file(checkpoint);
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Unable to open %s for writing.", qPrintable(checkpoint));
+    QDataStream stream(&file);
+    transform->store(stream);
+    if (!file.commit())
+        qFatal("Unable to write %s.", qPrintable(checkpoint));
+}
+
+static void _projectBranch(const Transform *transform, const TemplateList *src, TemplateList *dst)
+{
+    transform->project(*src, *dst);
+}
+
+// Append branch to dst, taking over its matrices rather than copying them when dst has none yet
+static void mergeBranch(Template &dst, Template &branch)
+{
+    if (dst.isEmpty()) dst.QList<cv::Mat>::swap(branch);
+    else               dst.append(branch);
+    dst.file.append(branch.file);
 }
 
 /*!
@@ -31,6 +56,8 @@ static void _train(Transform *transform, const QList<TemplateList> *data)
  * \brief Transforms in parallel.
  *
  * The source Template is seperately given to each transform and the results are appended together.
+ * When projecting fewer templates than Context::parallelism, the branches run concurrently
+ * on the global thread pool, each still parallel across templates.
  *
  * \author Josh Klontz \cite jklontz
  * \br_related_plugin PipeTransform
@@ -43,8 +70,17 @@ class ForkTransform : public CompositeTransform
     {
         if (!trainable) return;
         QFutureSynchronizer<void> futures;
-        for (int i=0; i<transforms.size(); i++)
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], &data));
+        for (int i=0; i<transforms.size(); i++) {
+            // Children trained before training was restarted are restored from their checkpoints
+            const QString checkpoint = transforms[i]->trainable ? checkpointFile(this, i, data) : QString();
+            QFile file(checkpoint);
+            if (!checkpoint.isEmpty() && file.open(QFile::ReadOnly)) {
+                QDataStream stream(&file);
+                transforms[i]->load(stream);
+                continue;
+            }
+            futures.addFuture(QtConcurrent::run(_train, transforms[i], &data, checkpoint));
+        }
         futures.waitForFinished();
     }
 
@@ -73,8 +109,40 @@ class ForkTransform : public CompositeTransform
             TemplateList m;
             f->projectUpdate(src, m);
             if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
-            for (int i=0; i<src.size(); i++) dst[i].merge(m[i]);
+            for (int i=0; i<src.size(); i++) mergeBranch(dst[i], m[i]);
+        }
+    }
+
+    // The last branch is the only one that doesn't need the source afterwards, so it is projected in place
+    void projectInPlace(TemplateList &srcdst) const
+    {
+        if (timeVarying() || transforms.isEmpty()) {
+            Transform::projectInPlace(srcdst);
+            return;
+        }
+
+        // Branches running concurrently can't project the source in place
+        if (concurrent(srcdst)) {
+            TemplateList dst;
+            projectBranches(srcdst, dst);
+            srcdst = dst;
+            return;
+        }
+
+        TemplateList dst;
+        dst.reserve(srcdst.size());
+        for (int i=0; i<srcdst.size(); i++) dst.append(Template(srcdst[i].file));
+        for (int j=0; j<transforms.size()-1; j++) {
+            TemplateList m;
+            transforms[j]->project(srcdst, m);
+            if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
+            for (int i=0; i<dst.size(); i++) mergeBranch(dst[i], m[i]);
         }
+
+        transforms.last()->projectInPlace(srcdst);
+        if (srcdst.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
+        for (int i=0; i<dst.size(); i++) mergeBranch(dst[i], srcdst[i]);
+        srcdst = dst;
     }
 
     // this is probably going to go bad, fork transform probably won't work well in a variable
@@ -107,6 +175,30 @@ class ForkTransform : public CompositeTransform
 
 protected:
 
+    // With fewer templates than threads, running the branches concurrently keeps the rest busy
+    bool concurrent(const TemplateList &src) const
+    {
+        return (transforms.size() > 1) && (src.size() < threadParallelism());
+    }
+
+    // Project src through every branch concurrently, merging the results in branch order
+    void projectBranches(const TemplateList &src, TemplateList &dst) const
+    {
+        QVector<TemplateList> branches(transforms.size());
+        QFutureSynchronizer<void> futures;
+        for (int j=1; j<transforms.size(); j++)
+            futures.addFuture(QtConcurrent::run(_projectBranch, transforms[j], &src, &branches[j]));
+        transforms.first()->project(src, branches[0]);
+        futures.waitForFinished();
+
+        dst.reserve(src.size());
+        for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
+        for (int j=0; j<branches.size(); j++) {
+            if (branches[j].size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
+            for (int i=0; i<dst.size(); i++) mergeBranch(dst[i], branches[j][i]);
+        }
+    }
+
     // Apply each transform to src, concatenate the results
     void _project(const Template &src, Template &dst) const
     {
@@ -124,13 +216,18 @@ protected:
 
     void _project(const TemplateList &src, TemplateList &dst) const
     {
+        if (concurrent(src)) {
+            projectBranches(src, dst);
+            return;
+        }
+
         dst.reserve(src.size());
         for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
         foreach (const Transform *f, transforms) {
             TemplateList m;
             f->project(src, m);
             if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
-            for (int i=0; i<src.size(); i++) dst[i].merge(m[i]);
+            for (int i=0; i<src.size(); i++) mergeBranch(dst[i], m[i]);
         }
     }
 
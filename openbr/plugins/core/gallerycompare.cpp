@@ -24,6 +24,9 @@ namespace br
  * \ingroup transforms
  * \brief Compare each Template to a fixed Gallery (with name = galleryName), using the specified distance.
  * dst will contain a 1 by n vector of scores.
+ * Uniformly sized gallery templates are packed into one contiguous buffer so they are scanned with a fixed stride.
+ * When cross validating, templates are only compared against gallery templates in their partition or in every partition (-1),
+ * other scores are -FLT_MAX.
  * \author Charles Otto \cite caotto
  */
 class GalleryCompareTransform : public Transform
@@ -36,37 +39,105 @@ class GalleryCompareTransform : public Transform
 
     TemplateList gallery;
 
+    // The gallery templates each partition's queries are compared against
+    struct Partition
+    {
+        TemplateList targets;
+        QVector<int> indices;
+    };
+    QHash<int, Partition> partitions;
+    Partition shared; // For queries in a partition no gallery template is in
+
     void project(const Template &src, Template &dst) const
     {
         dst = src;
         if (gallery.isEmpty())
             return;
 
+        if (Globals->crossValidate > 0) {
+            const QHash<int, Partition>::const_iterator found = partitions.constFind(src.file.get<int>("Partition", 0));
+            const Partition &partition = (found == partitions.constEnd()) ? shared : found.value();
+            QList<float> line;
+            line.reserve(gallery.size());
+            for (int j=0; j<gallery.size(); j++)
+                line.append(-std::numeric_limits<float>::max());
+            if (!partition.targets.isEmpty()) {
+                const QList<float> scores = distance->compare(partition.targets, src);
+                for (int k=0; k<scores.size(); k++)
+                    line[partition.indices[k]] = scores[k];
+            }
+            dst.m() = OpenCVUtils::toMat(line, 1);
+            return;
+        }
+
         QList<float> line = distance->compare(gallery, src);
         dst.m() = OpenCVUtils::toMat(line, 1);
     }
 
+    void setGallery(const TemplateList &data)
+    {
+        gallery = data;
+        packTemplates(gallery);
+
+        // Partitions are split after packing, so their templates share the packed buffer
+        partitions.clear();
+        shared = Partition();
+        if (Globals->crossValidate <= 0)
+            return;
+        const QList<int> galleryPartitions = gallery.files().crossValidationPartitions();
+        foreach (int p, galleryPartitions)
+            if (p != -1)
+                partitions.insert(p, Partition());
+        for (int j=0; j<gallery.size(); j++) {
+            const int p = galleryPartitions[j];
+            if (p != -1) {
+                partitions[p].targets.append(gallery[j]);
+                partitions[p].indices.append(j);
+                continue;
+            }
+            for (QHash<int, Partition>::iterator partition = partitions.begin(); partition != partitions.end(); ++partition) {
+                partition.value().targets.append(gallery[j]);
+                partition.value().indices.append(j);
+            }
+            shared.targets.append(gallery[j]);
+            shared.indices.append(j);
+        }
+    }
+
     void init()
     {
         if (!galleryName.isEmpty())
-            gallery = TemplateList::fromGallery(galleryName);
+            setGallery(TemplateList::fromGallery(galleryName));
     }
 
     void train(const TemplateList &data)
     {
-        gallery = data;
+        setGallery(data);
     }
 
+    // If galleryName is set the gallery is re-read on load rather than serialized (e.g. a shared mmap gallery).
+    // galleryName is stored too, so the model loads the same way whatever the loading transform was made with.
     void store(QDataStream &stream) const
     {
         br::Object::store(stream);
-        stream << gallery;
+        stream << galleryName;
+        if (galleryName.isEmpty())
+            stream << gallery;
     }
 
     void load(QDataStream &stream)
     {
         br::Object::load(stream);
-        stream >> gallery;
+        QString storedName;
+        stream >> storedName;
+        if (storedName.isEmpty()) {
+            TemplateList data;
+            stream >> data;
+            setGallery(data);
+        } else if (storedName != galleryName) {
+            set_galleryName(storedName);
+            setGallery(TemplateList::fromGallery(galleryName));
+        }
     }
 
 public:
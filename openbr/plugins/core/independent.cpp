@@ -23,19 +23,42 @@ using namespace cv;
 namespace br
 {
 
+// Trains one subspace's clone, keeping it to its share of the thread budget
+class TrainSubspace : public QRunnable
+{
+    Transform *transform;
+    const TemplateList *data;
+    int parallelism;
+
+public:
+    TrainSubspace(Transform *transform, const TemplateList *data, int parallelism)
+        : transform(transform), data(data), parallelism(parallelism) {}
+
+    void run()
+    {
+        setThreadParallelism(parallelism);
+        transform->train(*data);
+        setThreadParallelism(0);
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Clones the Transform so that it can be applied independently.
  *
  * Independent Transforms expect single-matrix Templates.
+ * The clones of each subspace train concurrently, sharing the thread budget of the caller.
  *
+ * \br_property int threads Maximum number of clones trained at once, 0 for the calling thread's parallelism. Each gets an equal share of that parallelism for its own training.
  * \author Josh Klontz \cite jklontz
  */
 class IndependentTransform : public MetaTransform
 {
     Q_OBJECT
     Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform STORED false)
+    Q_PROPERTY(int threads READ get_threads WRITE set_threads RESET reset_threads STORED false)
     BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(int, threads, 0)
 
     QList<Transform*> transforms;
 
@@ -128,22 +151,20 @@ class IndependentTransform : public MetaTransform
 
     bool timeVarying() const { return transform->timeVarying(); }
 
-    static void _train(Transform *transform, const TemplateList *data)
-    {
-        transform->train(*data);
-    }
-
     void train(const TemplateList &data)
     {
         // Don't bother if the transform is untrainable
         if (!trainable) return;
 
+        // Each subspace's templates are headers sharing the matrices of data
         QList<TemplateList> templatesList;
         foreach (const Template &t, data) {
             if ((templatesList.size() != t.size()) && !templatesList.isEmpty())
                 qWarning("Independent::train (%s) template %s of size %d differs from expected size %d.", qPrintable(objectName()), qPrintable(t.file.name), t.size(), templatesList.size());
-            while (templatesList.size() < t.size())
+            while (templatesList.size() < t.size()) {
                 templatesList.append(TemplateList());
+                templatesList.last().reserve(data.size());
+            }
             for (int i=0; i<t.size(); i++)
                 templatesList[i].append(Template(t.file, t[i]));
         }
@@ -151,10 +172,14 @@ class IndependentTransform : public MetaTransform
         while (transforms.size() < templatesList.size())
             transforms.append(transform->clone());
 
-        QFutureSynchronizer<void> futures;
+        // Bound the clones training at once, so their own parallel training doesn't oversubscribe the caller's budget
+        const int budget = std::max(1, threadParallelism());
+        const int workers = std::max(1, std::min(threads > 0 ? threads : budget, templatesList.size()));
+        QThreadPool pool;
+        pool.setMaxThreadCount(workers);
         for (int i=0; i<templatesList.size(); i++)
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], &templatesList[i]));
-        futures.waitForFinished();
+            pool.start(new TrainSubspace(transforms[i], &templatesList[i], std::max(1, budget / workers)));
+        pool.waitForDone();
     }
 
     void project(const Template &src, Template &dst) const
@@ -169,6 +194,28 @@ class IndependentTransform : public MetaTransform
         dst.append(mats);
     }
 
+    void projectInPlace(Template &srcdst) const
+    {
+        if ((srcdst.size() != 1) || transforms.isEmpty()) {
+            Transform::projectInPlace(srcdst);
+            return;
+        }
+
+        // Hand the matrix over, so the wrapped transform holds the only reference and may reuse it
+        Template single(srcdst.file);
+        single.swap(srcdst);
+        transforms.first()->projectInPlace(single);
+
+        // Like project(), keep the last matrix the wrapped transform produced
+        srcdst.file = single.file;
+        srcdst.append(single.isEmpty() ? Mat() : single.last());
+    }
+
+    void projectInPlace(TemplateList &srcdst) const
+    {
+        projectEachInPlace(srcdst);
+    }
+
     void projectUpdate(const Template &src, Template &dst)
     {
         dst.file = src.file;
@@ -3,6 +3,7 @@
 #include <limits>
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/resource.h>
+#include <QThreadStorage>
 #include <jni.h>
 
 namespace br
@@ -19,6 +20,7 @@ class JNIInitializer : public Initializer
     public:
         static JavaVM* jvm;
         static JavaVMInitArgs vm_args;
+        static bool destroyed;
 
     void initialize() const
     {
@@ -36,25 +38,70 @@ class JNIInitializer : public Initializer
         vm_args.ignoreUnrecognized = JNI_FALSE;
 
         JNI_CreateJavaVM(&jvm, (void**)&env, &vm_args);
+        destroyed = false;
+    }
+
+    QStringList plugins() const
+    {
+        return QStringList() << "JNI";
+    }
 
+    void registerAbbreviations() const
+    {
         Globals->abbreviations.insert("JNIHelloWorld","Open+JNI(HelloWorld)");
     }
 
     void finalize() const
     {
         jvm->DestroyJavaVM();
+        destroyed = true;
     }
+
+    //The environment of the calling thread, which is attached to the JavaVM the first time and stays attached until it exits
+    static JNIEnv *env()
+    {
+        static QThreadStorage<AttachedThread*> threads;
+        if (!threads.hasLocalData())
+            threads.setLocalData(new AttachedThread());
+        return threads.localData()->env;
+    }
+
+    private:
+        struct AttachedThread
+        {
+            JNIEnv *env;
+
+            AttachedThread()
+            {
+                jvm->AttachCurrentThreadAsDaemon((void**)&env, NULL);
+                if (jvm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK)
+                    qFatal("Failed to initialize JNI environment");
+            }
+
+            ~AttachedThread()
+            {
+                if (!destroyed)
+                    jvm->DetachCurrentThread();
+            }
+        };
 };
 
 JavaVM *JNIInitializer::jvm;
 JavaVMInitArgs JNIInitializer::vm_args;
+bool JNIInitializer::destroyed = true;
 
 BR_REGISTER(Initializer, JNIInitializer)
 
 /*!
  * \ingroup transforms
  * \brief Execute Java code from OpenBR using the JNI
+ *
+ * Calls the static method project of the Java class.
+ * If the class declares project(String fileName, java.nio.ByteBuffer data, int rows, int cols, int type) the template's matrix
+ * is passed without copying as a direct ByteBuffer over its data in the OpenCV layout, and changes made to the buffer are seen in the output template.
+ * Otherwise project(String fileName) is called with only the template's file name.
  * \author Jordan Cheney \cite jcheney
+ * \br_property QString className Java class to call, looked up once when the transform is initialized.
  */
 class JNITransform : public UntrainableTransform
 {
@@ -62,38 +109,58 @@ class JNITransform : public UntrainableTransform
     Q_PROPERTY(QString className READ get_className WRITE set_className RESET reset_className STORED false)
     BR_PROPERTY(QString, className, "")
 
-    void project(const Template &src, Template &dst) const
-    {
-        (void)dst; //Eliminates a compiler warning.
+    jclass cls;
+    jmethodID bufferMethod, nameMethod;
 
-		JNIEnv *env;
-
-        //Attach current thread to the thread of the JavaVM and access env
-        JNIInitializer::jvm->AttachCurrentThreadAsDaemon((void**)&env, NULL);
-        if (JNIInitializer::jvm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
-            qFatal("Failed to initialize JNI environment");
+    void init()
+    {
+        cls = NULL;
+        bufferMethod = nameMethod = NULL;
+        if (className.isEmpty())
+            return;
+
+        JNIEnv *env = JNIInitializer::env();
+        jclass localClass = env->FindClass(qPrintable(className));
+        if (localClass == NULL) { qFatal("Class not found"); }
+        cls = reinterpret_cast<jclass>(env->NewGlobalRef(localClass));
+        env->DeleteLocalRef(localClass);
+
+        bufferMethod = env->GetStaticMethodID(cls, "project", "(Ljava/lang/String;Ljava/nio/ByteBuffer;III)V");
+        if (bufferMethod == NULL) {
+            env->ExceptionClear(); // NoSuchMethodError
+            nameMethod = env->GetStaticMethodID(cls, "project", "(Ljava/lang/String;)V");
+            if (nameMethod == NULL) { qFatal("MethodID not found"); }
         }
+    }
 
-        //Convert QString to const char*
-        QByteArray tmpClass = className.toLocal8Bit();
-        const char* charClassName = tmpClass.constData();
-
-        //Call java method
-        jclass cls = env->FindClass(charClassName);
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
         if (cls == NULL) { qFatal("Class not found"); }
-        jmethodID mid = env->GetStaticMethodID(cls, "project", "(Ljava/lang/String;)V");
-        if (mid == NULL) { qFatal("MethodID not found"); }
-
-        QByteArray tmp = src.file.name.toLocal8Bit();
-        const char* fileName = tmp.constData();
 
-        //Convert char* to java compatible string
-        jstring jfileName = env->NewStringUTF(fileName);
+        JNIEnv *env = JNIInitializer::env();
+        jstring jfileName = env->NewStringUTF(qPrintable(src.file.name));
+
+        if (bufferMethod != NULL) {
+            // The buffer is writable, so Java gets a copy rather than the data src shares with its caller
+            cv::Mat &m = dst.m();
+            m = m.clone();
+            jobject data = env->NewDirectByteBuffer(m.data, m.total() * m.elemSize());
+            env->CallStaticVoidMethod(cls, bufferMethod, jfileName, data, m.rows, m.cols, m.type());
+            env->DeleteLocalRef(data);
+        } else {
+            env->CallStaticVoidMethod(cls, nameMethod, jfileName);
+        }
 
-        env->CallStaticObjectMethod(cls, mid, jfileName);
+        //The thread stays attached, so local references have to be released explicitly
+        env->DeleteLocalRef(jfileName);
 
-        JNIInitializer::jvm->DetachCurrentThread();
-	}
+        if (env->ExceptionCheck()) {
+            env->ExceptionDescribe();
+            env->ExceptionClear();
+            qWarning("Java exception in %s.project for %s", qPrintable(className), qPrintable(src.file.flat()));
+        }
+    }
 };
 
 BR_REGISTER(Transform, JNITransform)
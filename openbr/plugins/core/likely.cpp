@@ -1,3 +1,4 @@
+#include <QCryptographicHash>
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
 
@@ -96,6 +97,201 @@ class LikelyTransform : public Transform
 
 BR_REGISTER(Transform, LikelyTransform)
 
+/*!
+ * \brief A run of PointwiseTransforms compiled into a single Likely kernel, see Context::jit.
+ *
+ * Likely matrix dimensions are runtime values, so one kernel serves every image with a given type.
+ * Kernels are compiled on first use of each type and their bitcode is cached under Context::scratchPath.
+ * Types the run can't be lowered for fall back to applying the steps in turn.
+ * \author Unknown \cite unknown
+ */
+class LikelyFusedTransform : public UntrainableTransform
+{
+    Q_OBJECT
+
+    typedef likely_mat (*Function)(likely_const_mat);
+
+    struct Kernel
+    {
+        likely_env env;
+        Function function; // NULL if the run can't be lowered for this type
+    };
+
+    QList<const PointwiseTransform*> steps;
+    mutable QMutex kernelsLock;
+    mutable QHash<int, Kernel> kernels; // Keyed by OpenCV type
+
+public:
+    LikelyFusedTransform(const QList<const PointwiseTransform*> &steps)
+        : UntrainableTransform(false), steps(steps)
+    {
+        QStringList names;
+        foreach (const PointwiseTransform *step, steps)
+            names.append(step->objectName());
+        setObjectName(names.join("+"));
+    }
+
+    QString description(bool expanded = false) const
+    {
+        return describeSteps(steps, expanded);
+    }
+
+    ~LikelyFusedTransform()
+    {
+        foreach (const Kernel &kernel, kernels)
+            if (kernel.env)
+                likely_release_env(kernel.env);
+    }
+
+    // Lowers the run for the given input type, returning an empty string if that isn't possible
+    static QString source(const QList<const PointwiseTransform*> &steps, int type)
+    {
+        QStringList channels;
+        for (int c=0; c<CV_MAT_CN(type); c++)
+            channels.append(QString("(src %1 x y)").arg(c));
+        int depth = CV_MAT_DEPTH(type);
+        foreach (const PointwiseTransform *step, steps)
+            if (!step->lower(channels, depth))
+                return QString();
+        if (channels.size() != 1)
+            return QString(); // Multi-channel output needs a store per channel, which isn't worth it for the runs we see
+
+        const QString inType = likelyType(type);
+        const QString outType = likelyType(CV_MAKETYPE(depth, 1));
+        return QString("fused := src :->\n"
+                       "{\n"
+                       "  dst := (new %1 1 src.columns src.rows src.frames null)\n"
+                       "  (dst src) :=> %2\n"
+                       "}\n"
+                       "(extern %1 \"fused\" %3 fused)\n").arg(outType, channels.first(), inType);
+    }
+
+private:
+    static QString likelyType(int type)
+    {
+        QString depth;
+        switch (CV_MAT_DEPTH(type)) {
+          case CV_8U:  depth = "u8";  break;
+          case CV_16U: depth = "u16"; break;
+          case CV_16S: depth = "i16"; break;
+          case CV_32S: depth = "i32"; break;
+          case CV_32F: depth = "f32"; break;
+          default:     depth = "f64"; break;
+        }
+        return depth + (CV_MAT_CN(type) > 1 ? "CXY" : "XY");
+    }
+
+    static QByteArray compile(const QString &src)
+    {
+        likely_settings settings = likely_default_settings(likely_file_bitcode, false);
+        settings.runtime_only = true;
+        settings.multicore = Globals->parallelism > 1;
+
+        likely_mat output = NULL;
+        const likely_const_env parent = likely_standard(settings, &output, likely_file_bitcode);
+        likely_release_env(likely_lex_parse_and_eval(qPrintable(src), likely_guess_file_type("fused.lisp"), parent));
+        likely_release_env(parent);
+        if (!output)
+            return QByteArray();
+
+        const QByteArray bitcode(output->data, likely_bytes(output));
+        likely_release_mat(output);
+        return bitcode;
+    }
+
+    Kernel kernel(int type) const
+    {
+        QMutexLocker locker(&kernelsLock);
+        if (kernels.contains(type))
+            return kernels[type];
+
+        Kernel kernel;
+        kernel.env = NULL;
+        kernel.function = NULL;
+
+        const QString src = source(steps, type);
+        if (!src.isEmpty()) {
+            const QString cache = QString("%1/likely/%2.bc").arg(Globals->scratchPath(), QString(QCryptographicHash::hash(src.toUtf8(), QCryptographicHash::Sha1).toHex()));
+            QByteArray bitcode;
+            QFile file(cache);
+            if (file.open(QFile::ReadOnly)) {
+                bitcode = file.readAll();
+                file.close();
+            } else {
+                bitcode = compile(src);
+                if (!bitcode.isEmpty()) {
+                    QtUtils::touchDir(file);
+                    QtUtils::writeFile(cache, bitcode);
+                }
+            }
+
+            if (!bitcode.isEmpty()) {
+                const likely_const_mat data = likely_new(likely_u8 | likely_multi_channel, bitcode.size(), 1, 1, 1, bitcode.constData());
+                kernel.env = likely_precompiled(data, "fused");
+                likely_release_mat(data);
+                kernel.function = (Function) likely_function(kernel.env->expr);
+            }
+            if (!kernel.function)
+                qWarning("Failed to compile %s for type %d, falling back to OpenCV.", qPrintable(file.fileName()), type);
+        }
+
+        kernels.insert(type, kernel);
+        return kernel;
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        for (int i=0; i<dst.size(); i++) {
+            const Kernel k = kernel(dst[i].type());
+            if (k.function && dst[i].isContinuous()) {
+                const likely_const_mat srcl = likelyFromOpenCVMat(dst[i]);
+                const likely_mat dstl = k.function(srcl);
+                dst[i] = likelyToOpenCVMat(dstl);
+                likely_release_mat(dstl);
+                likely_release_mat(srcl);
+            } else {
+                foreach (const PointwiseTransform *step, steps) {
+                    cv::Mat m;
+                    step->apply(dst[i], m);
+                    dst[i] = m;
+                }
+            }
+        }
+    }
+};
+
+/*!
+ * \brief Installs LikelyFusedTransform as the PointwiseCompiler for Context::jit.
+ * \author Unknown \cite unknown
+ */
+class LikelyInitializer : public Initializer, public PointwiseCompiler
+{
+    Q_OBJECT
+
+    void initialize() const
+    {
+        PointwiseCompiler::instance = const_cast<LikelyInitializer*>(this);
+    }
+
+    void finalize() const
+    {
+        if (PointwiseCompiler::instance == this)
+            PointwiseCompiler::instance = NULL;
+    }
+
+    Transform *compile(const QList<const PointwiseTransform*> &steps) const
+    {
+        // Worth compiling only if the common image types lower
+        if (LikelyFusedTransform::source(steps, CV_8UC3).isEmpty() &&
+            LikelyFusedTransform::source(steps, CV_8UC1).isEmpty())
+            return NULL;
+        return new LikelyFusedTransform(steps);
+    }
+};
+
+BR_REGISTER(Initializer, LikelyInitializer)
+
 } // namespace br
 
 #include "core/likely.moc"
@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QCryptographicHash>
+#include <QSaveFile>
 #include <QtConcurrent>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -21,6 +23,82 @@
 namespace br
 {
 
+PointwiseCompiler *PointwiseCompiler::instance = NULL;
+
+QString checkpointFile(const Transform *composite, int child, const QList<TemplateList> &data)
+{
+    if (Globals->checkpoint.isEmpty())
+        return QString();
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(composite->description(true).toUtf8());
+    hash.addData(QByteArray::number(child));
+    foreach (const TemplateList &templates, data) {
+        hash.addData(QByteArray::number(templates.size()));
+        foreach (const Template &t, templates)
+            hash.addData(t.file.name.toUtf8());
+    }
+    return Globals->checkpoint + "/" + hash.result().toHex();
+}
+
+/*!
+ * \brief Adjacent PointwiseTransforms of a PipeTransform fused by PipeTransform::simplify.
+ *
+ * Each matrix is passed through every step before the next one, writing into a single output buffer.
+ * When projecting a Template onto itself whose matrices are not shared with anything else, the steps run in place.
+ */
+class FusedTransform : public UntrainableTransform
+{
+    Q_OBJECT
+
+public:
+    QList<const PointwiseTransform*> steps;
+
+    FusedTransform(const QList<const PointwiseTransform*> &steps)
+        : UntrainableTransform(false), steps(steps)
+    {
+        QStringList names;
+        foreach (const PointwiseTransform *step, steps)
+            names.append(step->objectName());
+        setObjectName(names.join("+"));
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const bool inPlace = (&src == &dst) && isExclusive(src);
+
+        QList<cv::Mat> mats;
+        for (int i=0; i<src.size(); i++) {
+            cv::Mat buffer = inPlace ? src[i] : Arena::mat();
+            steps.first()->apply(src[i], buffer);
+            for (int j=1; j<steps.size(); j++)
+                steps[j]->apply(buffer, buffer);
+            mats.append(buffer);
+        }
+
+        if (&src != &dst)
+            dst.file = src.file;
+        dst.clear(); // Releases the input matrices before the results replace them
+        dst.append(mats);
+    }
+
+    QString description(bool expanded = false) const
+    {
+        return describeSteps(steps, expanded);
+    }
+
+    void projectInPlace(Template &srcdst) const { project(srcdst, srcdst); }
+    void projectInPlace(TemplateList &srcdst) const { projectEachInPlace(srcdst); }
+};
+
+// Transforms wrapped by an IndependentTransform are fused by the wrapped transform, which is applied to each matrix
+static const PointwiseTransform *pointwise(const Transform *transform)
+{
+    if (!strcmp(transform->metaObject()->className(), "br::IndependentTransform"))
+        transform = transform->property("transform").value<br::Transform*>();
+    return dynamic_cast<const PointwiseTransform*>(transform);
+}
+
 /*!
  * \ingroup Transforms
  * \brief Transforms in series.
@@ -34,15 +112,25 @@ class PipeTransform : public CompositeTransform
 {
     Q_OBJECT
 
+    // Projects srcdst through the given stages a block at a time, so only one block is ever held
+    // at an intermediate stage, however much wider than the output of the last stage it is
     void _projectPartial(TemplateList *srcdst, int startIndex, int stopIndex)
     {
-        TemplateList ftes;
-        for (int i=startIndex; i<stopIndex; i++) {
-            TemplateList res;
-            transforms[i]->project(*srcdst, res);
+        const int blockSize = std::max(1, Globals->blockSize);
+        QList<TemplateList> blocks;
+        for (int i=0; i<srcdst->size(); i+=blockSize)
+            blocks.append(srcdst->mid(i, blockSize));
+        // Only the blocks reference the input from here on, so the pipe releases it block by block
+        srcdst->clear();
 
-            splitFTEs(res, ftes);
-            *srcdst = res;
+        TemplateList ftes;
+        for (int b=0; b<blocks.size(); b++) {
+            for (int i=startIndex; i<stopIndex; i++) {
+                transforms[i]->projectInPlace(blocks[b]);
+                splitFTEs(blocks[b], ftes);
+            }
+            srcdst->append(blocks[b]);
+            blocks[b].clear();
         }
     }
 
@@ -52,7 +140,8 @@ class PipeTransform : public CompositeTransform
 
         QList<TemplateList> dataLines(data);
 
-        int i = 0;
+        const QString checkpoint = checkpointFile(this, -1, data);
+        int i = resume(checkpoint, dataLines);
         while (i < transforms.size()) {
             // Conditional statement covers likely case that first transform is untrainable
             if (transforms[i]->trainable) {
@@ -72,6 +161,7 @@ class PipeTransform : public CompositeTransform
 
                 // advance i since we already projected for this stage.
                 i++;
+                save(checkpoint, i, dataLines);
 
                 // the next stage might be trainable, so continue to evaluate it.
                 continue;
@@ -89,8 +179,10 @@ class PipeTransform : public CompositeTransform
                 nextTrainableTransform++;
 
             // No more trainable transforms? Don't need any more projects then
-            if (nextTrainableTransform == transforms.size())
+            if (nextTrainableTransform == transforms.size()) {
+                save(checkpoint, transforms.size(), QList<TemplateList>());
                 break;
+            }
 
             fprintf(stderr, "Projecting %s", qPrintable(transforms[i]->description()));
             for (int j=i+1; j < nextTrainableTransform; j++)
@@ -104,9 +196,46 @@ class PipeTransform : public CompositeTransform
             futures.waitForFinished();
 
             i = nextTrainableTransform;
+            save(checkpoint, i, dataLines);
         }
     }
 
+    // Restores the stages completed before training was restarted, returns the index of the next stage
+    int resume(const QString &checkpoint, QList<TemplateList> &dataLines)
+    {
+        QFile file(checkpoint);
+        if (checkpoint.isEmpty() || !file.open(QFile::ReadOnly))
+            return 0;
+
+        QDataStream stream(&file);
+        int stage;
+        stream >> stage;
+        for (int i=0; i<stage; i++)
+            transforms[i]->load(stream);
+        stream >> dataLines;
+        qDebug() << "Resuming training of" << description() << "at stage" << stage;
+        return stage;
+    }
+
+    // Stores the stages before the given one and the training data projected through them
+    void save(const QString &checkpoint, int stage, const QList<TemplateList> &dataLines) const
+    {
+        if (checkpoint.isEmpty())
+            return;
+
+        QDir().mkpath(QFileInfo(checkpoint).path());
+        QSaveFile file(checkpoint);
+        if (!file.open(QFile::WriteOnly))
+            qFatal("Unable to open %s for writing.", qPrintable(checkpoint));
+        QDataStream stream(&file);
+        stream << stage;
+        for (int i=0; i<stage; i++)
+            transforms[i]->store(stream);
+        stream << dataLines;
+        if (!file.commit())
+            qFatal("Unable to write %s.", qPrintable(checkpoint));
+    }
+
     void projectUpdate(const Template &src, Template &dst)
     {
         dst = src;
@@ -179,38 +308,107 @@ class PipeTransform : public CompositeTransform
         CompositeTransform::init();
     }
 
+    // Replaces runs of adjacent PointwiseTransforms with a FusedTransform, or a compiled kernel with Context::jit
+    Transform *simplify(bool &newTransform)
+    {
+        PipeTransform *pipe = dynamic_cast<PipeTransform*>(CompositeTransform::simplify(newTransform));
+        if (!pipe)
+            return NULL;
+
+        QList<Transform*> fused;
+        QList<Transform*> created;
+        for (int i=0; i<pipe->transforms.size();) {
+            QList<const PointwiseTransform*> run;
+            for (int j=i; j<pipe->transforms.size(); j++) {
+                const PointwiseTransform *step = pointwise(pipe->transforms[j]);
+                if (!step) break;
+                run.append(step);
+            }
+
+            if (run.size() > 1) {
+                Transform *compiled = (Globals->jit && PointwiseCompiler::instance) ? PointwiseCompiler::instance->compile(run) : NULL;
+                created.append(compiled ? compiled : new FusedTransform(run));
+                fused.append(created.last());
+                i += run.size();
+            } else {
+                fused.append(pipe->transforms[i]);
+                i++;
+            }
+        }
+
+        if (created.isEmpty())
+            return pipe;
+
+        if (!newTransform) {
+            // Make a copy of the current object, with empty transforms
+            QList<Transform *> children = transforms;
+            transforms = QList<Transform *>();
+            pipe = dynamic_cast<PipeTransform *>(Transform::make(description(false), NULL));
+            transforms = children;
+            newTransform = true;
+        }
+
+        pipe->transforms = fused;
+        foreach (Transform *transform, created)
+            transform->setParent(pipe);
+        pipe->init();
+        return pipe;
+    }
+
+    void projectInPlace(Template &srcdst) const
+    {
+        if (timeVarying()) Transform::projectInPlace(srcdst);
+        else               projectStages(srcdst, File(srcdst.file));
+    }
+
+    void projectInPlace(TemplateList &srcdst) const
+    {
+        if (timeVarying()) Transform::projectInPlace(srcdst);
+        else               projectStages(srcdst);
+    }
+
 protected:
     // Template list project -- process templates in parallel through Transform::project
     // or if parallelism is disabled, handle them sequentially
    void _project(const TemplateList &src, TemplateList &dst) const
     {
-        TemplateList ftes;
         dst = src;
-        foreach (const Transform *f, transforms) {
-            TemplateList res;
-            f->project(dst, res);
-            splitFTEs(res, ftes);
-            dst = res;
-        }
-        dst.append(ftes);
+        projectStages(dst);
     }
 
    // Single template const project, pass the template through each sub-transform, one after the other
    virtual void _project(const Template &src, Template &dst) const
    {
        dst = src;
-       foreach (const Transform *f, transforms) {
-           try {
-               dst >> *f;
-               if (dst.file.fte)
-                   break;
-           } catch (...) {
-               qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
-               dst = Template(src.file);
-               dst.file.fte = true;
-           }
-       }
+       projectStages(dst, src.file);
    }
+
+private:
+    // Each stage replaces the output of the previous one, so only the first copies data shared with the caller
+    void projectStages(TemplateList &srcdst) const
+    {
+        TemplateList ftes;
+        foreach (const Transform *f, transforms) {
+            f->projectInPlace(srcdst);
+            splitFTEs(srcdst, ftes);
+        }
+        srcdst.append(ftes);
+    }
+
+    void projectStages(Template &srcdst, const File &file) const
+    {
+        foreach (const Transform *f, transforms) {
+            try {
+                f->projectInPlace(srcdst);
+                if (srcdst.file.fte)
+                    break;
+            } catch (...) {
+                qWarning("Exception triggered when processing %s with transform %s", qPrintable(file.flat()), qPrintable(f->objectName()));
+                srcdst = Template(file);
+                srcdst.file.fte = true;
+            }
+        }
+    }
 };
 
 BR_REGISTER(Transform, PipeTransform)
@@ -16,10 +16,12 @@
 
 #include <QBuffer>
 #include <QCoreApplication>
+#include <QCryptographicHash>
 #include <QLocalServer>
 #include <QLocalSocket>
 #include <QMutex>
 #include <QProcess>
+#include <QSharedMemory>
 #include <QUuid>
 #include <QWaitCondition>
 
@@ -67,12 +69,16 @@ public:
         connect(&outbound, SIGNAL(stateChanged(QLocalSocket::LocalSocketState)), this, SLOT(outboundStateChanged(QLocalSocket::LocalSocketState) ) );
 
         inbound = NULL;
+        readFailed = false;
+        writeSegment = NULL;
+        readSegment = NULL;
         basis->start();
     }
 
     ~CommunicationManager()
     {
-
+        delete writeSegment;
+        delete readSegment;
     }
 
     void shutDownThread()
@@ -86,7 +92,8 @@ public:
     {
         INPUT_AVAILABLE,
         OUTPUT_AVAILABLE,
-        SHOULD_END
+        SHOULD_END,
+        NEW_TRANSFORM
     };
 
 
@@ -237,6 +244,7 @@ public slots:
 
     void readSerializedInternal()
     {
+        readFailed = true;
         qint64 bufferSize;
         while (inbound->bytesAvailable() < qint64(sizeof(bufferSize))) {
             bool size_ready = inbound->waitForReadyRead(timeout_ms);
@@ -274,6 +282,8 @@ public slots:
         }
         if (arrayPosition != bufferSize)
             qDebug() << key <<  "Read wrong size object!";
+        else
+            readFailed = false;
     }
 
     void shutdownInternal()
@@ -302,6 +312,7 @@ signals:
 public:
     QByteArray readArray;
     QByteArray writeArray;
+    bool readFailed; // The last read lost its connection, e.g. because the other process crashed
 
     SignalType readSignal;
     QMutex receivedLock;
@@ -318,6 +329,17 @@ public:
     QLocalSocket outbound;
     QLocalServer server;
 
+    // Matrices are sent through a shared memory segment owned by the writer,
+    // only the template metadata and matrix descriptors go through the socket.
+    QSharedMemory *writeSegment;
+    QSharedMemory *readSegment;
+    static const int SegmentAlignment = 64;
+
+    static qint64 aligned(qint64 bytes)
+    {
+        return (bytes + SegmentAlignment - 1) / SegmentAlignment * SegmentAlignment;
+    }
+
 
     void waitForInbound()
     {
@@ -356,6 +378,99 @@ public:
         return true;
     }
 
+    // Exchanges are synchronous, so a segment is only rewritten after the reader has answered
+    bool sendTemplates(const TemplateList &templates, bool shared)
+    {
+        qint64 bytes = 0;
+        foreach (const Template &t, templates)
+            foreach (const Mat &m, t)
+                bytes += aligned(m.total() * m.elemSize());
+
+        if (bytes > std::numeric_limits<int>::max() / 2)
+            shared = false; // QSharedMemory sizes are ints
+
+        if (shared && (bytes > 0) && (!writeSegment || (writeSegment->size() < bytes))) {
+            // Grown segments get a new key, the reader attaches to it when it sees the key change
+            delete writeSegment;
+            writeSegment = new QSharedMemory(QUuid::createUuid().toString());
+            if (!writeSegment->create(int(bytes * 3 / 2))) {
+                qWarning("%s failed to create shared memory, falling back to the socket: %s", qPrintable(key), qPrintable(writeSegment->errorString()));
+                delete writeSegment;
+                writeSegment = NULL;
+            }
+        }
+        shared = shared && ((bytes == 0) || writeSegment);
+
+        QBuffer buffer;
+        buffer.open(QBuffer::ReadWrite);
+        QDataStream serializer(&buffer);
+        serializer << shared;
+        if (!shared) {
+            serializer << templates;
+        } else {
+            serializer << (writeSegment ? writeSegment->key() : QString()) << qint32(templates.size());
+            char *base = writeSegment ? (char*) writeSegment->data() : NULL;
+            qint64 offset = 0;
+            foreach (const Template &t, templates) {
+                serializer << t.file << qint32(t.size());
+                foreach (const Mat &m, t) {
+                    const Mat continuous = m.isContinuous() ? m : m.clone();
+                    const qint64 size = continuous.total() * continuous.elemSize();
+                    serializer << continuous.rows << continuous.cols << continuous.type() << offset;
+                    if (size > 0)
+                        memcpy(base + offset, continuous.data, size);
+                    offset += aligned(size);
+                }
+            }
+        }
+
+        writeArray = buffer.data();
+        emit pulseSendSerialized();
+        return shared;
+    }
+
+    // If copy is false the matrices are views onto the segment, valid until the writer's next send
+    bool readTemplates(TemplateList &templates, bool copy)
+    {
+        emit pulseReadSerialized();
+        if (readFailed)
+            return false;
+        QDataStream deserializer(readArray);
+        bool shared;
+        deserializer >> shared;
+        if (!shared) {
+            deserializer >> templates;
+            return false;
+        }
+
+        QString segment;
+        qint32 count;
+        deserializer >> segment >> count;
+        templates.clear();
+        if (!segment.isEmpty() && (!readSegment || (readSegment->key() != segment))) {
+            delete readSegment;
+            readSegment = new QSharedMemory(segment);
+            if (!readSegment->attach())
+                qFatal("%s failed to attach to shared memory: %s", qPrintable(key), qPrintable(readSegment->errorString()));
+        }
+
+        char *base = readSegment ? (char*) readSegment->data() : NULL;
+        for (int i=0; i<count; i++) {
+            Template t;
+            qint32 mats;
+            deserializer >> t.file >> mats;
+            for (int j=0; j<mats; j++) {
+                int rows, cols, type;
+                qint64 offset;
+                deserializer >> rows >> cols >> type >> offset;
+                const Mat m(rows, cols, type, base + offset);
+                t.append(copy ? m.clone() : m);
+            }
+            templates.append(t);
+        }
+        return true;
+    }
+
     Transform *readTForm()
     {
         emit pulseReadSerialized();
@@ -444,12 +559,21 @@ public:
             if (signal == CommunicationManager::SHOULD_END) {
                 break;
             }
+
+            // A pooled worker is being reused for a different transform
+            if (signal == CommunicationManager::NEW_TRANSFORM) {
+                delete transform;
+                transform = comm->readTForm();
+                continue;
+            }
+
             TemplateList inList;
             TemplateList outList;
 
-            comm->readData(inList);
+            // The input is read in place, and the output answers in the same transport
+            const bool shared = comm->readTemplates(inList, false);
             transform->projectUpdate(inList,outList);
-            comm->sendData(outList);
+            comm->sendTemplates(outList, shared);
         }
         comm->shutdown();
     }
@@ -501,6 +625,11 @@ public:
         emit pulseStart(arguments);
     }
 
+    bool running() const
+    {
+        return workerProcess.state() == QProcess::Running;
+    }
+
 signals:
     void pulseEnd();
     void pulseStart(QStringList);
@@ -524,6 +653,7 @@ struct ProcessData
     CommunicationManager comm;
     ProcessInterface proc;
     bool initialized;
+    QByteArray transformHash; // Of the serialized transform the worker holds
     ProcessData()
     {
         initialized = false;
@@ -541,20 +671,77 @@ struct ProcessData
 };
 
 
+/*!
+ * \ingroup initializers
+ * \brief Idle worker processes kept for reuse by later ProcessWrapperTransforms with the same pool.
+ *
+ * A reused worker is kept if it holds the same transform, otherwise it is sent the new one,
+ * either way skipping process start, plugin initialization, and algorithm load.
+ * \author Unknown \cite unknown
+ */
+class ProcessPool : public Initializer
+{
+    Q_OBJECT
+
+    static QMutex lock;
+    static QHash< QString, QList<ProcessData*> > idle;
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        QMutexLocker locker(&lock);
+        foreach (const QList<ProcessData*> &workers, idle)
+            qDeleteAll(workers);
+        idle.clear();
+    }
+
+public:
+    // NULL if no worker is idle in the pool
+    static ProcessData *take(const QString &pool)
+    {
+        QMutexLocker locker(&lock);
+        QList<ProcessData*> &workers = idle[pool];
+        return workers.isEmpty() ? NULL : workers.takeLast();
+    }
+
+    static void give(const QString &pool, ProcessData *data)
+    {
+        QMutexLocker locker(&lock);
+        idle[pool].append(data);
+    }
+};
+
+QMutex ProcessPool::lock;
+QHash< QString, QList<ProcessData*> > ProcessPool::idle;
+
+BR_REGISTER(Initializer, ProcessPool)
+
 /*!
  * \ingroup transforms
  * \brief Interface to a separate process
+ *
+ * Matrices are exchanged through shared memory, with only template metadata sent over the local socket.
+ * Workers that exited are restarted, and a batch a worker crashed on is retried once on a new worker.
  * \author Charles Otto \cite caotto
+ * \br_property int concurrentCount Maximum number of processes receiving the transform at once. Default is 2.
+ * \br_property bool sharedMemory Exchange matrices through shared memory rather than serializing them over the socket. Default is true.
+ * \br_property QString pool If not empty, workers are taken from and returned to the ProcessPool of this name rather than ended with the transform. Default is "".
  */
 class ProcessWrapperTransform : public WrapperTransform
 {
     Q_OBJECT
     Q_PROPERTY(int concurrentCount READ get_concurrentCount WRITE set_concurrentCount RESET reset_concurrentCount STORED false)
+    Q_PROPERTY(bool sharedMemory READ get_sharedMemory WRITE set_sharedMemory RESET reset_sharedMemory STORED false)
     BR_PROPERTY(int, concurrentCount, 2)
+    Q_PROPERTY(QString pool READ get_pool WRITE set_pool RESET reset_pool STORED false)
+    BR_PROPERTY(bool, sharedMemory, true)
+    BR_PROPERTY(QString, pool, "")
 
     QString baseKey;
 
     Resource<ProcessData> processes;
+    mutable QSemaphore pooled; // Bounds the pooled workers in use at once, as processes does otherwise
 
     Transform *smartCopy(bool &newTransform)
     {
@@ -571,17 +758,56 @@ class ProcessWrapperTransform : public WrapperTransform
         if (src.empty())
             return;
         
-        ProcessData *data = processes.acquire();
+        ProcessData *data;
+        if (pool.isEmpty()) {
+            data = processes.acquire();
+        } else {
+            pooled.acquire();
+            data = ProcessPool::take(pool);
+            if (!data)
+                data = new ProcessData();
+        }
+
+        // Health check, a worker that exited since its last use is replaced
+        if (data->initialized && !data->proc.running()) {
+            qWarning("Restarting a worker process that exited.");
+            delete data;
+            data = new ProcessData();
+        }
+
         if (!data->initialized)
             activateProcess(data);
+        else if (data->transformHash != serializedHash)
+            retarget(data);
 
-        CommunicationManager *localComm = &(data->comm);
+        if (!exchange(data, src, dst)) {
+            qWarning("Restarting a worker process that failed, and retrying its templates.");
+            delete data;
+            data = new ProcessData();
+            activateProcess(data);
+            dst.clear();
+            if (!exchange(data, src, dst))
+                qFatal("Worker process failed twice on the same templates.");
+        }
 
+        if (pool.isEmpty()) {
+            processes.release(data);
+        } else {
+            ProcessPool::give(pool, data);
+            pooled.release();
+        }
+    }
+
+    bool exchange(ProcessData *data, const TemplateList &src, TemplateList &dst) const
+    {
+        CommunicationManager *localComm = &(data->comm);
         localComm->sendSignal(CommunicationManager::INPUT_AVAILABLE);
-        localComm->sendData(src);
+        localComm->sendTemplates(src, sharedMemory);
 
-        localComm->readData(dst);
-        processes.release(data);
+        // Copied out, the worker reuses its segment for the next reply
+        dst.clear();
+        localComm->readTemplates(dst, true);
+        return !localComm->readFailed;
     }
 
     void train(const TemplateList &data)
@@ -596,33 +822,35 @@ class ProcessWrapperTransform : public WrapperTransform
         if (transform) {
             QDataStream out(&serialized, QFile::WriteOnly);
             transform->serialize(out);
-            tcount = Globals->parallelism;
+            serializedHash = QCryptographicHash::hash(serialized, QCryptographicHash::Sha1);
             counter.acquire(counter.available());
             counter.release(this->concurrentCount);
         }
+        pooled.acquire(pooled.available());
+        pooled.release(Globals->parallelism);
     }
 
     static QSemaphore counter;
-    mutable int tcount;
-    mutable QByteArray serialized;
-    void transmitTForm(CommunicationManager *localComm) const
+    // Kept after the first transmission, restarted and reused workers are sent it again
+    QByteArray serialized, serializedHash;
+    void transmitTForm(ProcessData *data) const
     {
         if (serialized.isEmpty() )
             qFatal("Trying to transmit empty transform!");
 
+        CommunicationManager *localComm = &(data->comm);
         counter.acquire(1);
-        static QMutex transmission;
-        QMutexLocker lock(&transmission);
-        tcount--;
-
         localComm->writeArray = serialized;
-        if (tcount == 0)
-            serialized.clear();
-        lock.unlock();
-
         emit localComm->pulseSendSerialized();
         localComm->getSignal();
         counter.release(1);
+        data->transformHash = serializedHash;
+    }
+
+    void retarget(ProcessData *data) const
+    {
+        data->comm.sendSignal(CommunicationManager::NEW_TRANSFORM);
+        transmitTForm(data);
     }
 
     void activateProcess(ProcessData *data) const
@@ -654,7 +882,7 @@ class ProcessWrapperTransform : public WrapperTransform
         data->comm.waitForInbound();
         data->comm.connectToRemote(baseKey+"_worker");
 
-        transmitTForm(&(data->comm));
+        transmitTForm(data);
     }
 
     bool timeVarying() const
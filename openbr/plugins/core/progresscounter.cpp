@@ -15,6 +15,9 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QElapsedTimer>
+#include <QThread>
+#include <QWaitCondition>
+#include <algorithm>
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
@@ -24,24 +27,66 @@ namespace br
 
 /*!
  * \ingroup transforms
- * \brief DOCUMENT ME CHARLES
+ * \brief Reports the progress of a stream, along with its throughput and latency.
+ *
+ * Throughput is reported over the last second and over the last window seconds.
+ * Latency is the time from a template entering the stream to reaching this transform,
+ * reported as percentiles of the most recent templates.
+ * A warning is printed if no template arrives within stallTimeout seconds.
+ *
  * \author Unknown \cite unknown
+ * \br_property qint64 totalProgress The number of templates expected.
+ * \br_property int window Seconds of the windowed throughput.
+ * \br_property int stallTimeout Seconds without a template before a stall is reported, 0 to disable.
  */
 class ProgressCounterTransform : public TimeVaryingTransform
 {
     Q_OBJECT
 
     Q_PROPERTY(qint64 totalProgress READ get_totalProgress WRITE set_totalProgress RESET reset_totalProgress STORED false)
+    Q_PROPERTY(int window READ get_window WRITE set_window RESET reset_window STORED false)
+    Q_PROPERTY(int stallTimeout READ get_stallTimeout WRITE set_stallTimeout RESET reset_stallTimeout STORED false)
     BR_PROPERTY(qint64, totalProgress, 1)
+    BR_PROPERTY(int, window, 60)
+    BR_PROPERTY(int, stallTimeout, 300)
+
+    static const int LatencySamples = 4096;
+
+    // Checks for stalls while templates are expected, between the first template and finalize()
+    class Watchdog : public QThread
+    {
+        ProgressCounterTransform *counter;
+
+    public:
+        Watchdog(ProgressCounterTransform *counter) : counter(counter) {}
+
+    private:
+        void run()
+        {
+            counter->watch();
+        }
+    };
 
     void projectUpdate(const TemplateList &src, TemplateList &dst)
     {
         dst = src;
 
+        const qint64 now = streamTime();
         qint64 elapsed = timer.elapsed();
         int last_frame = -2;
+        int ftes = 0;
+        foreach (const Template &t, dst)
+            if (t.file.fte) ftes++;
+        Context::addMetric("br_templates_processed_total", dst.size());
+        if (ftes > 0)
+            Context::addMetric("br_failures_to_enroll_total", ftes);
         if (!dst.empty()) {
             for (int i=0;i < dst.size();i++) {
+                if (dst[i].file.contains("StreamEnter")) {
+                    recordLatency((now - dst[i].file.get<qint64>("StreamEnter")) / 1e6);
+                    dst[i].file.remove("StreamEnter");
+                }
+
                 int frame = dst[i].file.get<int>("FrameNumber", -1);
                 if (frame == last_frame && frame != -1)
                     continue;
@@ -53,11 +98,13 @@ class ProgressCounterTransform : public TimeVaryingTransform
 
                 Globals->currentStep++;
             }
+            completed();
         }
 
         // updated every second
         if (elapsed > 1000) {
-            Globals->printStatus();
+            rates.append(QPair<qint64, double>(uptime.elapsed(), Globals->currentStep));
+            printStatus();
             timer.start();
         }
 
@@ -72,9 +119,14 @@ class ProgressCounterTransform : public TimeVaryingTransform
     void finalize(TemplateList &data)
     {
         (void) data;
+        stopWatchdog();
+
         float p = br_progress();
         qDebug("\r%05.2f%%  ELAPSED=%s  REMAINING=%s  COUNT=%g", p*100, QtUtils::toTime(Globals->startTime.elapsed()/1000.0f).toStdString().c_str(), QtUtils::toTime(0).toStdString().c_str(), Globals->currentStep);
-        timer.start();
+        if (!latencies.isEmpty())
+            qDebug("Throughput %.3g/s  Latency P50=%.3gms  P90=%.3gms  P99=%.3gms",
+                   Globals->currentStep * 1000.0 / std::max(qint64(1), uptime.elapsed()), latency(0.5), latency(0.9), latency(0.99));
+        reset();
         Globals->startTime.start();
         Globals->currentStep = 0;
         Globals->currentProgress = 0;
@@ -83,16 +135,127 @@ class ProgressCounterTransform : public TimeVaryingTransform
 
     void init()
     {
-        timer.start();
+        reset();
         Globals->startTime.start();
         Globals->currentProgress = 0;
         Globals->currentStep = 0;
         Globals->totalSteps = totalProgress;
     }
 
+    void reset()
+    {
+        timer.start();
+        uptime.start();
+        rates.clear();
+        rates.append(QPair<qint64, double>(0, 0));
+        latencies.clear();
+        nextLatency = 0;
+    }
+
+    void recordLatency(double ms)
+    {
+        if (latencies.size() < LatencySamples) latencies.append(ms);
+        else                                   latencies[nextLatency] = ms;
+        nextLatency = (nextLatency + 1) % LatencySamples;
+    }
+
+    // Over the most recent templates, in ms
+    double latency(double fraction) const
+    {
+        QVector<double> sorted = latencies;
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[std::min(sorted.size() - 1, int(sorted.size() * fraction))];
+    }
+
+    // Templates per second since the sample taken seconds ago, rates holds samples taken about once a second
+    double rate(int seconds) const
+    {
+        const qint64 since = rates.last().first - seconds * 1000;
+        int i = rates.size() - 1;
+        while ((i > 0) && (rates[i-1].first >= since))
+            i--;
+        if (i == rates.size() - 1)
+            i = std::max(0, i - 1);
+        const qint64 elapsed = rates.last().first - rates[i].first;
+        return elapsed > 0 ? (rates.last().second - rates[i].second) * 1000.0 / elapsed : 0;
+    }
+
+    // Globals->printStatus() followed by throughput and latency
+    void printStatus()
+    {
+        while ((rates.size() > 2) && (rates[1].first < rates.last().first - window * 1000))
+            rates.removeFirst();
+
+        Globals->printStatus();
+        if (Globals->verbose || Globals->quiet || (Globals->totalSteps < 2) || (Globals->progress() >= 1))
+            return;
+        fprintf(stderr, "  RATE=%.3g/s  RATE%ds=%.3g/s", rate(1), window, rate(window));
+        if (!latencies.isEmpty())
+            fprintf(stderr, "  P50=%.3gms  P99=%.3gms", latency(0.5), latency(0.99));
+        fflush(stderr);
+    }
+
+    void completed()
+    {
+        QMutexLocker locker(&watchdogLock);
+        lastCompleted = uptime.elapsed();
+        if (stalled) {
+            stalled = false;
+            qDebug("\nProgress resumed after %s.", qPrintable(QtUtils::toTime(stalledFor / 1000.0f)));
+        }
+        if (!watchdog && (stallTimeout > 0)) {
+            stopping = false;
+            watchdog = new Watchdog(this);
+            watchdog->start();
+        }
+    }
+
+    void watch()
+    {
+        QMutexLocker locker(&watchdogLock);
+        while (!stopping) {
+            wakeWatchdog.wait(&watchdogLock, 1000);
+            const qint64 idle = uptime.elapsed() - lastCompleted;
+            if (!stopping && !stalled && (idle > stallTimeout * 1000)) {
+                stalled = true;
+                qWarning("No templates completed in the last %s, at %g of %g.", qPrintable(QtUtils::toTime(idle / 1000.0f)), Globals->currentStep, Globals->totalSteps);
+            }
+            if (stalled)
+                stalledFor = idle;
+        }
+    }
+
+    void stopWatchdog()
+    {
+        QMutexLocker locker(&watchdogLock);
+        if (!watchdog)
+            return;
+        stopping = true;
+        wakeWatchdog.wakeAll();
+        locker.unlock();
+
+        watchdog->wait();
+        delete watchdog;
+        watchdog = NULL;
+        stalled = false;
+    }
+
 public:
-    ProgressCounterTransform() : TimeVaryingTransform(false,false) {}
+    ProgressCounterTransform() : TimeVaryingTransform(false,false), nextLatency(0), watchdog(NULL), stopping(false), stalled(false), lastCompleted(0), stalledFor(0) {}
+    ~ProgressCounterTransform() { stopWatchdog(); }
     QElapsedTimer timer;
+
+private:
+    QElapsedTimer uptime;
+    QList< QPair<qint64, double> > rates; // QPair<uptime ms, Globals->currentStep>
+    QVector<double> latencies; // Ring buffer of the most recent latencies, in ms
+    int nextLatency;
+
+    QMutex watchdogLock;
+    QWaitCondition wakeWatchdog;
+    Watchdog *watchdog;
+    bool stopping, stalled;
+    qint64 lastCompleted, stalledFor; // uptime ms
 };
 
 BR_REGISTER(Transform, ProgressCounterTransform)
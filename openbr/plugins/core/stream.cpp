@@ -15,17 +15,22 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <fstream>
+#include <QElapsedTimer>
 #include <QReadWriteLock>
 #include <QWaitCondition>
-#include <QThreadPool>
+#include <QThread>
+#include <QThreadStorage>
 #include <QSemaphore>
 #include <QMap>
 #include <QQueue>
 #include <QtConcurrent>
 #include <opencv/highgui.h>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/affinity.h>
+#include <openbr/core/arena.h>
 #include <openbr/core/common.h>
 #include <openbr/core/opencvutils.h>
 #include <openbr/core/qtutils.h>
@@ -36,10 +41,117 @@ using namespace std;
 namespace br
 {
 
+// Monotonic time shared by every stream, in ns
+struct StreamClock
+{
+    QElapsedTimer timer;
+    StreamClock() { timer.start(); }
+    qint64 now() const { return timer.nsecsElapsed(); }
+};
+static StreamClock streamClock;
+
+// Timeline of the stages each thread runs and of the frames read and returned, only recorded while
+// Context::streamTrace is set. Each thread appends to a buffer of its own and publishes an event by
+// advancing the buffer's size, so recording takes no locks and buffers can be read while streams run.
+struct StreamTrace
+{
+    struct Event
+    {
+        qint64 begin, end; // streamClock, in ns
+        int frame; // FrameData::sequenceNumber
+        int name; // Index into names
+    };
+
+    struct Buffer
+    {
+        static const int Capacity = 1 << 16; // Later events are dropped
+        Event *events;
+        QAtomicInt size;
+        int thread;
+
+        Buffer(int thread) : events(new Event[Capacity]), size(0), thread(thread) {}
+    };
+
+    // Buffers stay allocated after their threads exit so they can still be written out
+    struct Slot
+    {
+        Buffer *buffer;
+        Slot() : buffer(NULL) {}
+    };
+
+    static QAtomicInt recording;
+
+    // Stage names are interned once, when streams are made
+    static int name(const QString &name)
+    {
+        QMutexLocker locker(&lock);
+        const int index = names.indexOf(name);
+        if (index >= 0)
+            return index;
+        names.append(name);
+        return names.size() - 1;
+    }
+
+    static void record(int name, int frame, qint64 begin, qint64 end)
+    {
+        Slot &slot = threadSlots.localData();
+        if (!slot.buffer) {
+            QMutexLocker locker(&lock);
+            slot.buffer = new Buffer(buffers.size() + 1);
+            buffers.append(slot.buffer);
+        }
+
+        Buffer *buffer = slot.buffer;
+        const int size = buffer->size.load();
+        if (size >= Buffer::Capacity)
+            return;
+        Event &event = buffer->events[size];
+        event.begin = begin;
+        event.end = end;
+        event.frame = frame;
+        event.name = name;
+        buffer->size.storeRelease(size + 1);
+    }
+
+    // Every event recorded so far in the Chrome trace event format, also read by Perfetto
+    static QString format()
+    {
+        QMutexLocker locker(&lock);
+        QStringList events;
+        foreach (const Buffer *buffer, buffers) {
+            events.append(QString("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%1,\"args\":{\"name\":\"Stream thread %1\"}}").arg(buffer->thread));
+            const int size = buffer->size.loadAcquire();
+            for (int i=0; i<size; i++) {
+                const Event &event = buffer->events[i];
+                events.append(QString("{\"name\":\"%1\",\"cat\":\"stream\",\"ph\":\"X\",\"pid\":1,\"tid\":%2,\"ts\":%3,\"dur\":%4,\"args\":{\"frame\":%5}}")
+                              .arg(names[event.name], QString::number(buffer->thread), QString::number(event.begin / 1000.0, 'f', 3),
+                                   QString::number((event.end - event.begin) / 1000.0, 'f', 3), QString::number(event.frame)));
+            }
+        }
+        return "{\"traceEvents\":[\n" + events.join(",\n") + "\n]}";
+    }
+
+private:
+    static QMutex lock;
+    static QStringList names;
+    static QList<Buffer*> buffers;
+    static QThreadStorage<Slot> threadSlots;
+};
+
+QAtomicInt StreamTrace::recording;
+QMutex StreamTrace::lock;
+QStringList StreamTrace::names;
+QList<StreamTrace::Buffer*> StreamTrace::buffers;
+QThreadStorage<StreamTrace::Slot> StreamTrace::threadSlots;
+
 class FrameData
 {
 public:
     int sequenceNumber;
+    int source; // Index of the DataSource input this frame was read from
+    qint64 issued; // DataSource clock time when the frame was read, in ns
+    qint64 enqueued; // streamClock time when the frame was added to a stage's input buffer, in ns
+    qint64 bytes; // Size of the matrices read into data, see Context::trackMemory()
     TemplateList data;
 };
 
@@ -59,119 +171,120 @@ public:
 
 // for n - 1 boundaries, multiple threads call addItem, the frames are
 // sequenced based on FrameData::sequence_number, and calls to getItem
-// receive them in that order
+// receive them in that order. Calls to tryGetItem are serialized by the
+// consuming stage.
+// Frames are issued in sequence and at most capacity are out at once, so
+// no frame can be more than capacity - 1 ahead of the one we are waiting
+// for. Each frame therefore has a slot of its own, and producers never
+// contend with each other or with the consumer.
 class SequencingBuffer : public SharedBuffer
 {
 public:
-    SequencingBuffer()
+    SequencingBuffer(int capacity)
     {
         next_target = 0;
+        this->capacity = std::max(capacity, 1);
+        slots = new QAtomicPointer<FrameData>[this->capacity];
     }
 
-    void addItem(FrameData *input)
+    ~SequencingBuffer()
     {
-        QMutexLocker bufferLock(&bufferGuard);
+        delete[] slots;
+    }
 
-        buffer.insert(input->sequenceNumber, input);
+    void addItem(FrameData *input)
+    {
+        if (!slots[input->sequenceNumber % capacity].testAndSetRelease(NULL, input))
+            qFatal("Sequencing buffer overflow, more than %d frames are out.", capacity);
+        count.ref();
     }
 
     FrameData *tryGetItem()
     {
-        QMutexLocker bufferLock(&bufferGuard);
-
-        if (buffer.empty() || buffer.begin().key() != this->next_target) {
+        QAtomicPointer<FrameData> *slot = &slots[next_target % capacity];
+        FrameData *output = slot->loadAcquire();
+        if (!output)
             return NULL;
-        }
 
-        QMap<int, FrameData *>::Iterator result = buffer.begin();
-
-        if (next_target != result.value()->sequenceNumber) {
+        if (next_target != output->sequenceNumber) {
             qFatal("mismatched targets!");
         }
 
         next_target = next_target + 1;
 
-        FrameData *output = result.value();
-        buffer.erase(result);
+        slot->storeRelease(NULL);
+        count.deref();
         return output;
     }
 
     virtual int size()
     {
-        QMutexLocker lock(&bufferGuard);
-        return buffer.size();
+        return count.load();
     }
     virtual void reset()
     {
         if (size() != 0)
             qDebug("Sequencing buffer has non-zero size during reset!");
 
-        QMutexLocker lock(&bufferGuard);
         next_target = 0;
     }
 
 
 private:
-    QMutex bufferGuard;
+    // Slot i holds the frame whose sequence number is i modulo capacity
+    QAtomicPointer<FrameData> *slots;
+    int capacity;
+    QAtomicInt count;
     int next_target;
-
-    QMap<int, FrameData *> buffer;
 };
 
-// For 1 - 1 boundaries, a double buffering scheme
-// Producer/consumer read/write from separate buffers, and switch if their
-// buffer runs out/overflows. Synchronization is handled by a read/write lock
-// threads are "reading" if they are adding to/removing from their individual
-// buffer, and writing if they access or swap with the other buffer.
-class DoubleBuffer : public SharedBuffer
+// For 1 - 1 boundaries, a single producer single consumer ring buffer.
+// The producer only writes tail, and the consumer only writes head, so
+// neither needs a lock. Calls to addItem and tryGetItem may come from
+// different threads over time, but each side is serialized by the stage
+// it belongs to.
+class RingBuffer : public SharedBuffer
 {
 public:
-    DoubleBuffer()
+    RingBuffer(int capacity)
     {
-        inputBuffer = &buffer1;
-        outputBuffer = &buffer2;
+        // A power of two size keeps slot indices consistent when the
+        // counters wrap
+        int ringSize = 1;
+        while (ringSize < capacity)
+            ringSize *= 2;
+        ring = QVector<FrameData *>(ringSize, NULL);
+        mask = ringSize - 1;
     }
 
     int size()
     {
-        QReadLocker readLock(&bufferGuard);
-        return inputBuffer->size() + outputBuffer->size();
+        return int(quint32(tail.loadAcquire()) - quint32(head.loadAcquire()));
     }
 
     // called from the producer thread
     void addItem(FrameData *input)
     {
-        QReadLocker readLock(&bufferGuard);
-        inputBuffer->append(input);
+        const quint32 current = tail.load();
+        if (current - quint32(head.loadAcquire()) >= quint32(ring.size()))
+            qFatal("Ring buffer overflow, more than %d frames are out.", ring.size());
+
+        ring[current & mask] = input;
+        // Publish the frame before advancing tail
+        tail.storeRelease(int(current + 1));
     }
 
     FrameData *tryGetItem()
     {
-        QReadLocker readLock(&bufferGuard);
-
-        // There is something for us to get
-        if (!outputBuffer->empty()) {
-            FrameData *output = outputBuffer->first();
-            outputBuffer->removeFirst();
-            return output;
-        }
+        const quint32 current = head.load();
 
-        // Outputbuffer is empty, try to swap with the input buffer, we need a
-        // write lock to do that.
-        readLock.unlock();
-        QWriteLocker writeLock(&bufferGuard);
-
-        // Nothing on the input buffer either?
-        if (inputBuffer->empty()) {
+        // Nothing for us to get
+        if (current == quint32(tail.loadAcquire()))
             return NULL;
-        }
 
-        // input buffer is non-empty, so swap the buffers
-        std::swap(inputBuffer, outputBuffer);
-
-        // Return a frame
-        FrameData *output = outputBuffer->first();
-        outputBuffer->removeFirst();
+        FrameData *output = ring[current & mask];
+        // Release the slot back to the producer
+        head.storeRelease(int(current + 1));
         return output;
     }
 
@@ -183,28 +296,19 @@ public:
 
 
 private:
-    // The read-write lock. The thread adding to this buffer can add
-    // to the current input buffer if it has a read lock. The thread
-    // removing from this buffer can remove things from the current
-    // output buffer if it has a read lock, or swap the buffers if it
-    // has a write lock.
-    QReadWriteLock bufferGuard;
-
-    // The buffer that is currently being added to
-    QList<FrameData *> * inputBuffer;
-    // The buffer that is currently being removed from
-    QList<FrameData *> * outputBuffer;
-
-    // The buffers pointed at by inputBuffer/outputBuffer
-    QList<FrameData *> buffer1;
-    QList<FrameData *> buffer2;
+    QVector<FrameData *> ring;
+    quint32 mask;
+
+    // Free running counters, the number of items ever removed/added
+    QAtomicInt head;
+    QAtomicInt tail;
 };
 
 // Given a template as input, open the file contained as a gallery, and return templates one at a time on
 // calls to getNextTemplate
 struct StreamGallery
 {
-    bool open(Template &input)
+    bool open(Template &input, int maxFrames)
     {
         // Create a gallery
         gallery = QSharedPointer<Gallery>(Gallery::make(input.file));
@@ -215,11 +319,35 @@ struct StreamGallery
             return false;
         }
 
+        // Galleries that recycle their frame buffers (e.g. videoGallery) need
+        // one for every frame we might have out at once
+        if ((gallery->metaObject()->indexOfProperty("buffers") != -1) && !input.file.contains("buffers"))
+            gallery->setProperty("buffers", maxFrames);
+
         // Set up state variables for future reads
         galleryOk = true;
         gallery->readBlockSize = 100;
+        currentData.clear();
         nextIdx = 0;
         lastBlock = false;
+
+        // Optionally read only part of the gallery, as in TemplateList::fromGallery
+        skip = input.file.get<qint64>("pos", 0);
+        remaining = input.file.get<qint64>("length", -1);
+
+        // Galleries that can seek, e.g. videoGallery, start at pos directly
+        if ((skip > 0) && (gallery->metaObject()->indexOfProperty("begin") != -1) && !input.file.contains("begin")) {
+            gallery->setProperty("begin", skip);
+            skip = 0;
+        }
+
+        // A bounded range is read in one step, so galleries with random access (e.g. galGallery) seek to pos
+        // rather than reading and discarding every template before it
+        if ((skip > 0) && (remaining > 0)) {
+            currentData = gallery->readRange(skip, skip + remaining);
+            lastBlock = true;
+            skip = 0;
+        }
         return galleryOk;
     }
 
@@ -235,19 +363,19 @@ struct StreamGallery
 
     bool getNextTemplate(Template &output)
     {
-        // If we still have data available, we return one of those
-        if ((nextIdx >= currentData.size()) && !lastBlock) {
-            currentData = gallery->readBlock(&lastBlock);
-            nextIdx = 0;
-        }
+        for (; skip > 0; skip--)
+            if (!readNextTemplate(output))
+                return false;
 
-        if (nextIdx >= currentData.size()) {
+        if (remaining == 0) {
             galleryOk = false;
             return false;
         }
 
-        // Return the indicated template, and advance the index
-        output = currentData[nextIdx++];
+        if (!readNextTemplate(output))
+            return false;
+        if (remaining > 0)
+            remaining--;
         return true;
     }
 
@@ -256,9 +384,28 @@ protected:
     QSharedPointer<Gallery> gallery;
     bool galleryOk;
     bool lastBlock;
+    qint64 skip, remaining; // Templates to skip, then to read (-1 for all)
 
     TemplateList currentData;
     int nextIdx;
+
+    bool readNextTemplate(Template &output)
+    {
+        // If we still have data available, we return one of those
+        if ((nextIdx >= currentData.size()) && !lastBlock) {
+            currentData = gallery->readBlock(&lastBlock);
+            nextIdx = 0;
+        }
+
+        if (nextIdx >= currentData.size()) {
+            galleryOk = false;
+            return false;
+        }
+
+        // Return the indicated template, and advance the index
+        output = currentData[nextIdx++];
+        return true;
+    }
 };
 
 // Interface for sequentially getting data from some data source.
@@ -267,10 +414,18 @@ protected:
 class DataSource
 {
 public:
-    DataSource(int maxFrames=500)
-    {
+    DataSource(int maxFrames=500) : allFrames(maxFrames), maxFrames(maxFrames)
+    {
+        latencyTarget = 0;
+        memoryBudget = 0;
+        deadline = 0;
+        downscale = false;
+        multiplex = false;
+        issueTimes = QVector<qint64>(std::max(maxFrames, 1), 0);
+        readName = StreamTrace::name("Read frame");
+        returnName = StreamTrace::name("Return frame");
         // The sequence number of the last frame
-        final_frame = -1;
+        final_frame.storeRelease(-1);
         for (int i=0; i < maxFrames;i++)
         {
             allFrames.addItem(new FrameData());
@@ -291,6 +446,8 @@ public:
     void close()
     {
         frameSource.close();
+        for (int i=0; i < sources.size(); i++)
+            sources[i].close();
     }
 
     int size()
@@ -298,6 +455,12 @@ public:
         return this->templates.size();
     }
 
+    // The number of inputs frames are tagged with, see FrameData::source
+    int sourceCount() const
+    {
+        return multiplex ? std::max(sources.size(), 1) : 1;
+    }
+
     bool open(const TemplateList &input)
     {
         // Set up variables specific to us
@@ -308,12 +471,24 @@ public:
         allReturned = false;
 
         // The last frame isn't initialized yet
-        final_frame = -1;
+        final_frame.storeRelease(-1);
         // Start our sequence numbers from the input index
         next_sequence_number = 0;
+        next_frame_number = 0;
+        oldestOutstanding.storeRelease(0);
+        dropped = downscaled = 0;
+
+        // Without a latency target every frame may be out at once, otherwise
+        // start from one frame per thread and let returnFrame adjust it
+        window.storeRelease(latencyTarget > 0 ? std::min(maxFrames, std::max(Globals->parallelism, 1)) : maxFrames);
+        averageLatency = averageInterval = -1;
+        lastReturnTime = -1;
+        returnedSinceAdjustment = 0;
+        frameBytes = 0;
+        clock.start();
 
         // Actually open the data source
-        bool open_res = openNextTemplate();
+        bool open_res = multiplex ? openAllTemplates() : openNextTemplate();
 
         // We couldn't open the data source
         if (!open_res) {
@@ -336,29 +511,75 @@ public:
             return NULL;
         }
 
+        // Are as many frames out as we currently allow?
+        int limit = window.loadAcquire();
+        if ((memoryBudget > 0) && (frameBytes > 0))
+            limit = int(std::min(qint64(limit), std::max(qint64(1), memoryBudget / frameBytes)));
+        if (maxFrames - allFrames.size() >= limit)
+            return NULL;
+
         // Try to get a FrameData from the pool, if we can't it means too many
         // frames are already out, and we will return NULL to indicate failure
         FrameData *aFrame = allFrames.tryGetItem();
         if (aFrame == NULL)
             return NULL;
+        const qint64 readBegin = streamClock.now();
 
         // Try to actually read a frame, if this returns false the data source is broken
         bool res = getNextFrame(*aFrame);
 
+        // If we have fallen behind, skip frames (or shrink this one) until
+        // the oldest frame still out is within the deadline again
+        while (res && (deadline > 0) && (lag() > deadline)) {
+            if (downscale) {
+                shrinkFrame(*aFrame);
+                break;
+            }
+            dropped++;
+            aFrame->data.clear();
+            next_sequence_number--; // Reuse the skipped frame's sequence number
+            res = getNextFrame(*aFrame);
+        }
+
+        if (res && (deadline > 0))
+            for (int i=0; i < aFrame->data.size(); i++) {
+                aFrame->data[i].file.set("DroppedFrames", dropped);
+                aFrame->data[i].file.set("DownscaledFrames", downscaled);
+            }
+
+        aFrame->issued = clock.nsecsElapsed();
+        issueTimes[aFrame->sequenceNumber % issueTimes.size()] = aFrame->issued;
+
+        // Like "progress", which marks the templates ProgressCounter gets and removes
+        const qint64 entered = streamClock.now();
+        for (int i=0; i < aFrame->data.size(); i++)
+            if (aFrame->data[i].file.contains("progress"))
+                aFrame->data[i].file.set("StreamEnter", entered);
+        aFrame->bytes = aFrame->data.bytes<qint64>();
+        Context::trackMemory("Stream frames", aFrame->bytes);
+        Context::addMetric("br_stream_frames_in_flight");
+        if (res && (memoryBudget > 0)) {
+            frameBytes = 0;
+            foreach (const Template &t, aFrame->data)
+                foreach (const cv::Mat &m, t)
+                    frameBytes += m.total() * m.elemSize();
+        }
+
         // The datasource broke, update final_frame
         if (!res)
         {
-            QMutexLocker lock(&last_frame_update);
-            final_frame = aFrame->sequenceNumber;
+            final_frame.storeRelease(aFrame->sequenceNumber);
             aFrame->data().clear();
         }
 
         // If this is the last frame, say so
-        if (aFrame->sequenceNumber == final_frame) {
+        if (aFrame->sequenceNumber == final_frame.load()) {
             last_frame = true;
             is_broken = true;
         }
 
+        if (StreamTrace::recording.load())
+            StreamTrace::record(readName, aFrame->sequenceNumber, readBegin, streamClock.now());
         return aFrame;
     }
 
@@ -366,23 +587,31 @@ public:
     // frame issued, false otherwise
     bool returnFrame(FrameData *inputFrame)
     {
+        const qint64 returnBegin = streamClock.now();
         int frameNumber = inputFrame->sequenceNumber;
-
+        if (latencyTarget > 0)
+            adjustWindow(inputFrame->issued);
+        // The end stage returns frames in sequence order
+        oldestOutstanding.storeRelease(frameNumber + 1);
+
+        Context::trackMemory("Stream frames", -inputFrame->bytes);
+        Context::addMetric("br_stream_frames_in_flight", -1);
+        Context::observeMetric("br_stream_frame_latency_seconds", (clock.nsecsElapsed() - inputFrame->issued) / 1e9);
         inputFrame->data.clear();
         inputFrame->sequenceNumber = -1;
         allFrames.addItem(inputFrame);
+        if (StreamTrace::recording.load())
+            StreamTrace::record(returnName, frameNumber, returnBegin, streamClock.now());
 
-        bool rval = false;
+        // final_frame is set before the last frame is issued, so only the
+        // last frame needs the lock
+        if (frameNumber != final_frame.loadAcquire())
+            return false;
 
+        // We just received the last frame, better pulse
         QMutexLocker lock(&last_frame_update);
-
-        if (frameNumber == final_frame) {
-            // We just received the last frame, better pulse
-            allReturned = true;
-            rval = true;
-        }
-
-        return rval;
+        allReturned = true;
+        return true;
     }
 
     void wake()
@@ -390,7 +619,8 @@ public:
         lastReturned.wakeAll();
     }
 
-    bool waitLast()
+    // Returns false if time ms passed before the last frame was returned
+    bool waitLast(unsigned long time = ULONG_MAX)
     {
         QMutexLocker lock(&last_frame_update);
 
@@ -398,7 +628,8 @@ public:
         {
             // This would be a safer wait if we used a timeout, but
             // theoretically that should never matter.
-            lastReturned.wait(&last_frame_update);
+            if (!lastReturned.wait(&last_frame_update, time))
+                return allReturned;
         }
         return true;
     }
@@ -417,7 +648,7 @@ protected:
 
             Template curr = this->templates[current_template_idx];
 
-            open_res = frameSource.open(curr);
+            open_res = frameSource.open(curr, maxFrames);
             if (!open_res)
             {
                 current_template_idx++;
@@ -428,8 +659,50 @@ protected:
         return true;
     }
 
+    // Open every input as a separate source
+    bool openAllTemplates()
+    {
+        sources = QVector<StreamGallery>(templates.size());
+        sourceFrameNumbers = QVector<int>(templates.size(), 0);
+        next_source = 0;
+
+        bool any_open = false;
+        for (int i=0; i < templates.size(); i++) {
+            Template curr = templates[i];
+            any_open = sources[i].open(curr, maxFrames) || any_open;
+        }
+        return any_open;
+    }
+
+    // Take turns reading from each source that is still open
+    bool getNextMultiplexedFrame(FrameData &output)
+    {
+        for (int i=0; i < sources.size(); i++) {
+            const int source = (next_source + i) % sources.size();
+            Template aTemplate;
+            if (!sources[source].isOpen() || !sources[source].getNextTemplate(aTemplate))
+                continue;
+
+            next_source = source + 1;
+            output.sequenceNumber = next_sequence_number++;
+            output.source = source;
+            output.data.append(aTemplate);
+            output.data.last().file.set("FrameNumber", sourceFrameNumbers[source]++);
+            output.data.last().file.set("SourceID", source);
+            return true;
+        }
+
+        // Every source is exhausted
+        output.sequenceNumber = next_sequence_number;
+        return false;
+    }
+
     bool getNextFrame(FrameData &output)
     {
+        if (multiplex)
+            return getNextMultiplexedFrame(output);
+
+        output.source = 0;
         bool got_frame = false;
 
         Template aTemplate;
@@ -443,8 +716,9 @@ protected:
                 // set the sequence number and tempalte of this frame
                 output.sequenceNumber = next_sequence_number;
                 output.data.append(aTemplate);
-                // set the frame number in the template's metadata
-                output.data.last().file.set("FrameNumber", output.sequenceNumber);
+                // set the frame number in the template's metadata, this
+                // differs from the sequence number if frames were dropped
+                output.data.last().file.set("FrameNumber", next_frame_number++);
                 next_sequence_number++;
                 return true;
             }
@@ -474,11 +748,92 @@ protected:
     StreamGallery frameSource;
 
     int next_sequence_number;
-    int final_frame;
+    int next_frame_number;
+
+    // Used instead of frameSource when multiplexing
+    QVector<StreamGallery> sources;
+    QVector<int> sourceFrameNumbers;
+    int next_source;
+    QAtomicInt final_frame;
     bool is_broken;
     bool allReturned;
 
-    DoubleBuffer allFrames;
+    RingBuffer allFrames;
+    int maxFrames;
+
+public:
+    int latencyTarget; // ms from reading a frame to returning it, 0 to disable
+    qint64 memoryBudget; // bytes of decoded frames out at once, 0 to disable
+    int deadline; // ms the oldest frame out may lag before frames are dropped, 0 to disable
+    bool downscale; // Halve the resolution of frames rather than skip them
+    bool multiplex; // Read every input at once, taking turns, instead of one after another
+    int dropped, downscaled; // Frames affected by the deadline since open()
+
+protected:
+    // The number of frames currently allowed out, at most maxFrames
+    QAtomicInt window;
+    QElapsedTimer clock;
+    qint64 frameBytes; // Size of the most recently read frame, updated by tryGetFrame
+    int readName, returnName; // See StreamTrace::name
+
+    // Updated by returnFrame, which the end stage calls one frame at a time
+    double averageLatency, averageInterval; // ms
+    qint64 lastReturnTime;
+    int returnedSinceAdjustment;
+
+    // Read side record of issue times, indexed by sequence number modulo maxFrames
+    QVector<qint64> issueTimes;
+    QAtomicInt oldestOutstanding; // Sequence number of the oldest frame not yet returned
+
+    // Age of the oldest frame still out, in ms
+    double lag()
+    {
+        const int oldest = oldestOutstanding.loadAcquire();
+        // The frame being read has already taken a sequence number
+        if (oldest >= next_sequence_number - 1)
+            return 0;
+        return (clock.nsecsElapsed() - issueTimes[oldest % issueTimes.size()]) / 1e6;
+    }
+
+    void shrinkFrame(FrameData &frame)
+    {
+        for (int i=0; i < frame.data.size(); i++) {
+            for (int j=0; j < frame.data[i].size(); j++) {
+                cv::Mat shrunk;
+                cv::resize(frame.data[i][j], shrunk, cv::Size(), 0.5, 0.5, cv::INTER_AREA);
+                frame.data[i][j] = shrunk;
+            }
+            frame.data[i].file.set("Scale", 0.5);
+        }
+        downscaled++;
+    }
+
+    // Additive increase, multiplicative decrease on the window, at most one
+    // change per window's worth of returned frames.
+    void adjustWindow(qint64 issued)
+    {
+        const qint64 now = clock.nsecsElapsed();
+        const double latency = (now - issued) / 1e6;
+        averageLatency = (averageLatency < 0) ? latency : 0.9 * averageLatency + 0.1 * latency;
+        if (lastReturnTime >= 0) {
+            const double interval = (now - lastReturnTime) / 1e6;
+            averageInterval = (averageInterval < 0) ? interval : 0.9 * averageInterval + 0.1 * interval;
+        }
+        lastReturnTime = now;
+
+        const int current = window.load();
+        if (++returnedSinceAdjustment < current)
+            return;
+        returnedSinceAdjustment = 0;
+
+        int next = current + 1;
+        if (averageLatency > latencyTarget) {
+            // By Little's law, this many frames out at the measured throughput meets the target
+            const int sustainable = (averageInterval > 0) ? int(latencyTarget / averageInterval) : current;
+            next = std::min(current * 3 / 4, sustainable);
+        }
+        window.storeRelease(std::max(1, std::min(next, maxFrames)));
+    }
 
     QWaitCondition lastReturned;
     QMutex last_frame_update;
@@ -501,6 +856,236 @@ public:
     FrameData *startItem;
 };
 
+// Runs stream jobs on a fixed set of worker threads, each with its own queue. A job started from a worker
+// is queued on that worker, so a stage's follow-up work stays on the thread that already holds its frame,
+// while idle workers steal from the other queues. As with QThreadPool::start, higher priority jobs run first.
+class StreamExecutor
+{
+public:
+    StreamExecutor(int threads) : stopping(false), queued(0), nextQueue(0)
+    {
+        // Successive executors start on different CPUs, so concurrent streams don't pin onto the same cores
+        const int firstCpu = nextCpu.fetchAndAddRelaxed(std::max(threads, 1));
+        for (int i=0; i<std::max(threads, 1); i++) {
+            queues.append(new Queue());
+            workers.append(new Worker(this, i, firstCpu + i));
+        }
+        foreach (Worker *worker, workers)
+            worker->start();
+    }
+
+    ~StreamExecutor()
+    {
+        idleLock.lock();
+        stopping = true;
+        idle.wakeAll();
+        idleLock.unlock();
+
+        foreach (Worker *worker, workers) {
+            worker->wait();
+            delete worker;
+        }
+        foreach (Queue *queue, queues) {
+            foreach (const Job &job, queue->jobs)
+                if (job.second->autoDelete())
+                    delete job.second;
+            delete queue;
+        }
+    }
+
+    void start(QRunnable *runnable, int priority)
+    {
+        Worker *worker = dynamic_cast<Worker *>(QThread::currentThread());
+        const int index = (worker && (worker->executor == this)) ? worker->index
+                                                                 : int(quint32(nextQueue.fetchAndAddRelaxed(1)) % quint32(queues.size()));
+
+        // Each queue is ordered by priority, and by age within a priority
+        Queue *queue = queues[index];
+        queue->lock.lock();
+        QList<Job>::iterator it = queue->jobs.end();
+        while ((it != queue->jobs.begin()) && ((it-1)->first > priority))
+            --it;
+        queue->jobs.insert(it, Job(priority, runnable));
+        queue->lock.unlock();
+
+        QMutexLocker locker(&idleLock);
+        queued++;
+        idle.wakeOne();
+    }
+
+private:
+    typedef QPair<int, QRunnable *> Job; // QPair<priority,runnable>
+
+    struct Queue
+    {
+        QMutex lock;
+        QList<Job> jobs;
+    };
+
+    class Worker : public QThread
+    {
+    public:
+        StreamExecutor *executor;
+        int index, cpu;
+
+        Worker(StreamExecutor *executor, int index, int cpu) : executor(executor), index(index), cpu(cpu) {}
+
+    private:
+        void run()
+        {
+            // Each worker on its own CPU, filling one NUMA node before the next
+            Affinity::Pin pin(Affinity::Pin::Cpu, cpu % Affinity::cpus());
+            executor->work(index);
+        }
+    };
+
+    QList<Queue *> queues;
+    QList<Worker *> workers;
+
+    QMutex idleLock;
+    QWaitCondition idle;
+    bool stopping;
+    int queued; // Jobs not yet taken, guarded by idleLock
+    QAtomicInt nextQueue; // Round robin over the queues for jobs started outside of a worker
+    static QAtomicInt nextCpu;
+
+    QRunnable *take(int index)
+    {
+        for (int i=0; i<queues.size(); i++) {
+            Queue *queue = queues[(index + i) % queues.size()];
+            QMutexLocker locker(&queue->lock);
+            if (queue->jobs.isEmpty())
+                continue;
+
+            // The owner takes its newest highest priority job, thieves take the oldest one
+            int j = queue->jobs.size() - 1;
+            if (i > 0)
+                while ((j > 0) && (queue->jobs[j-1].first == queue->jobs[j].first))
+                    j--;
+            return queue->jobs.takeAt(j).second;
+        }
+        return NULL;
+    }
+
+    void work(int index)
+    {
+        forever {
+            QRunnable *runnable = take(index);
+
+            QMutexLocker locker(&idleLock);
+            if (!runnable) {
+                if (stopping)
+                    return;
+                // queued can briefly be negative if a job was taken before start() counted it
+                if (queued <= 0)
+                    idle.wait(&idleLock);
+                continue;
+            }
+            queued--;
+            locker.unlock();
+
+            runnable->run();
+            if (runnable->autoDelete())
+                delete runnable;
+        }
+    }
+};
+
+QAtomicInt StreamExecutor::nextCpu;
+
+// Timing and queueing statistics for a processing stage, only recorded while
+// enabled, i.e. when Context::streamStats is set.
+struct StageStatistics
+{
+    static const int Buckets = 24; // Bucket i counts service times under 2^i us
+
+    bool enabled;
+
+    StageStatistics() : enabled(false)
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        QMutexLocker locker(&lock);
+        start = streamClock.now();
+        frames = busy = queued = waited = depth = 0;
+        maxDepth = 0;
+        histogram = QVector<qint64>(Buckets, 0);
+    }
+
+    void recordService(qint64 time)
+    {
+        int bucket = 0;
+        while ((bucket < Buckets - 1) && ((qint64(1000) << bucket) <= time))
+            bucket++;
+
+        QMutexLocker locker(&lock);
+        frames++;
+        busy += time;
+        histogram[bucket]++;
+    }
+
+    // Called when a frame is added to the stage's input buffer, size includes it
+    void recordQueued(int size)
+    {
+        QMutexLocker locker(&lock);
+        queued++;
+        depth += size;
+        maxDepth = std::max(maxDepth, size);
+    }
+
+    // Called when a frame is taken from the stage's input buffer
+    void recordWait(qint64 time)
+    {
+        QMutexLocker locker(&lock);
+        waited += time;
+    }
+
+    // Threads,Frames,MeanService,P50Service,P99Service,MeanQueueWait,MeanQueueDepth,MaxQueueDepth,Idle,Histogram
+    QString report(int threads)
+    {
+        QMutexLocker locker(&lock);
+        const double elapsed = std::max(qint64(1), streamClock.now() - start);
+        QStringList histogramCounts;
+        foreach (qint64 count, histogram)
+            histogramCounts.append(QString::number(count));
+
+        return QStringList() << QString::number(threads)
+                             << QString::number(frames)
+                             << QString::number(frames ? busy / 1e6 / frames : 0)
+                             << QString::number(percentile(0.5))
+                             << QString::number(percentile(0.99))
+                             << QString::number(queued ? waited / 1e6 / queued : 0)
+                             << QString::number(queued ? double(depth) / queued : 0)
+                             << QString::number(maxDepth)
+                             << QString::number(std::max(0.0, 1 - busy / (elapsed * threads)))
+                             << histogramCounts.join(" ")
+                             ;
+    }
+
+private:
+    QMutex lock;
+    qint64 start; // streamClock when recording began
+    qint64 frames, busy; // busy in ns
+    qint64 queued, waited, depth; // waited in ns, depth summed over queued frames
+    int maxDepth;
+    QVector<qint64> histogram;
+
+    // Upper bound of the bucket containing the given fraction of service times, in ms
+    double percentile(double fraction) const
+    {
+        qint64 count = 0;
+        for (int i=0; i<Buckets; i++) {
+            count += histogram[i];
+            if (count >= fraction * frames)
+                return (qint64(1000) << i) / 1e6;
+        }
+        return 0;
+    }
+};
+
 class ProcessingStage
 {
 public:
@@ -509,6 +1094,7 @@ public:
     ProcessingStage(int nThreads = 1)
     {
         thread_count = nThreads;
+        transform = NULL;
     }
     virtual ~ProcessingStage() {}
 
@@ -517,18 +1103,27 @@ public:
     virtual bool tryAcquireNextStage(FrameData *& input, bool &final)=0;
 
     int stage_id;
+    int traceName; // See StreamTrace::name
 
     virtual void reset()=0;
 
     virtual void status()=0;
 
+    StageStatistics statistics;
+
+    // A CSV line for this stage, see DirectStreamTransform::publishStatistics
+    QString statisticsReport()
+    {
+        return QString::number(stage_id) + "," + (transform ? transform->objectName() : QString("Read")) + "," + statistics.report(thread_count);
+    }
+
 protected:
     int thread_count;
 
     SharedBuffer *inputBuffer;
     ProcessingStage *nextStage;
     QList<ProcessingStage *> * stages;
-    QThreadPool *threads;
+    StreamExecutor *threads;
     Transform *transform;
 
 };
@@ -546,11 +1141,16 @@ public:
             qFatal("null input to multi-thread stage");
         }
 
+        // The frame owns its templates, so the transform may overwrite them
         TemplateList ftes;
         splitFTEs(input->data, ftes);
-        TemplateList res;
-        transform->project(input->data, res);
-        input->data = res;
+        {
+            // Intermediate matrices of the frame come from this thread's arena, only its results are copied to the heap
+            Arena::Scope arena;
+            transform->projectInPlace(input->data);
+            for (int i=0; i<input->data.size(); i++)
+                Arena::promote(input->data[i]);
+        }
         input->data.append(ftes);
 
         should_continue = nextStage->tryAcquireNextStage(input, final);
@@ -579,25 +1179,45 @@ public:
 class SingleThreadStage : public ProcessingStage
 {
 public:
-    SingleThreadStage(bool input_variance) : ProcessingStage(1)
+    SingleThreadStage(bool input_variance, int activeFrames) : ProcessingStage(1)
     {
         currentStatus = STOPPING;
         next_target = 0;
         // If the previous stage is single-threaded, queued inputs
-        // are stored in a double buffer
+        // are stored in a ring buffer
         if (input_variance) {
-            this->inputBuffer = new DoubleBuffer();
+            this->inputBuffer = new RingBuffer(activeFrames);
         }
         // If it's multi-threaded we need to put the inputs back in order
         // before we can use them, so we use a sequencing buffer.
         else {
-            this->inputBuffer = new SequencingBuffer();
+            this->inputBuffer = new SequencingBuffer(activeFrames);
         }
     }
 
     ~SingleThreadStage()
     {
         delete inputBuffer;
+        qDeleteAll(sourceCopies);
+    }
+
+    // Time varying transforms keep state between frames, so frames from
+    // different sources of a multiplexed stream go to separate copies.
+    // Source 0 uses transform itself.
+    virtual Transform *transformFor(int source)
+    {
+        if (source == 0)
+            return transform;
+
+        if (source >= sourceTransforms.size())
+            sourceTransforms.resize(source + 1);
+        if (!sourceTransforms[source]) {
+            bool newTransform = false;
+            sourceTransforms[source] = transform->smartCopy(newTransform);
+            if (newTransform)
+                sourceCopies.append(sourceTransforms[source]);
+        }
+        return sourceTransforms[source];
     }
 
     void reset()
@@ -618,6 +1238,12 @@ public:
     QReadWriteLock statusLock;
     Status currentStatus;
 
+protected:
+    QVector<Transform *> sourceTransforms; // Indexed by source, NULL until first used
+    QList<Transform *> sourceCopies; // The entries of sourceTransforms we own
+
+public:
+
     FrameData *run(FrameData *input, bool &should_continue, bool &final)
     {
         if (input == NULL)
@@ -631,7 +1257,7 @@ public:
         TemplateList ftes;
         splitFTEs(input->data, ftes);
         TemplateList res;
-        transform->projectUpdate(input->data, res);
+        transformFor(input->source)->projectUpdate(input->data, res);
         input->data = res;
         input->data.append(ftes);
 
@@ -643,6 +1269,8 @@ public:
         // Is there anything on our input buffer? If so we should start a thread with that.
         QWriteLocker lock(&statusLock);
         FrameData *newItem = inputBuffer->tryGetItem();
+        if (newItem && statistics.enabled)
+            statistics.recordWait(streamClock.now() - newItem->enqueued);
         if (!newItem)
         {
             this->currentStatus = STOPPING;
@@ -665,8 +1293,7 @@ public:
         // We start threads with priority equal to their stage id
         // This is intended to ensure progression, we do queued late stage
         // jobs before queued early stage jobs, and so tend to finish frames
-        // rather than go stage by stage. In Qt 5.1, priorities are priorities
-        // so we use the stage_id directly.
+        // rather than go stage by stage.
         this->threads->start(next, stage_id);
     }
 
@@ -675,7 +1302,13 @@ public:
     bool tryAcquireNextStage(FrameData *& input, bool &final)
     {
         final = false;
-        inputBuffer->addItem(input);
+        if (statistics.enabled) {
+            input->enqueued = streamClock.now();
+            inputBuffer->addItem(input);
+            statistics.recordQueued(inputBuffer->size());
+        } else {
+            inputBuffer->addItem(input);
+        }
 
         QReadLocker lock(&statusLock);
         // Thread is already running, we should just return
@@ -699,6 +1332,9 @@ public:
         if (!input)
             return false;
 
+        if (statistics.enabled)
+            statistics.recordWait(streamClock.now() - input->enqueued);
+
         currentStatus = STARTING;
 
         return true;
@@ -713,10 +1349,17 @@ public:
 class EndStage : public SingleThreadStage
 {
 public:
-    EndStage(bool input_variance) : SingleThreadStage(input_variance) {}
+    EndStage(bool input_variance, int activeFrames) : SingleThreadStage(input_variance, activeFrames) {}
 
     ~EndStage() {}
 
+    // Output from every source is collected together
+    Transform *transformFor(int source)
+    {
+        (void) source;
+        return transform;
+    }
+
     // Calledfrom a different thread than run.
     bool tryAcquireNextStage(FrameData *& input, bool &final)
     {
@@ -795,7 +1438,7 @@ BR_REGISTER(Transform, CollectOutputTransform)
 class ReadStage : public SingleThreadStage
 {
 public:
-    ReadStage(int activeFrames = 100) : SingleThreadStage(true), dataSource(activeFrames){ }
+    ReadStage(int activeFrames = 100) : SingleThreadStage(true, activeFrames), dataSource(activeFrames){ }
 
     DataSource dataSource;
 
@@ -891,7 +1534,20 @@ void BasicLoop::run()
     bool the_end = false;
     forever
     {
-        target_item = stages->at(current_idx)->run(target_item, should_continue, the_end);
+        ProcessingStage *stage = stages->at(current_idx);
+        const bool traced = StreamTrace::recording.load();
+        if (stage->statistics.enabled || traced) {
+            const int frame = target_item ? target_item->sequenceNumber : -1;
+            const qint64 start = streamClock.now();
+            target_item = stage->run(target_item, should_continue, the_end);
+            const qint64 end = streamClock.now();
+            if (stage->statistics.enabled)
+                stage->statistics.recordService(end - start);
+            if (traced)
+                StreamTrace::record(stage->traceName, frame, start, end);
+        } else {
+            target_item = stage->run(target_item, should_continue, the_end);
+        }
         if (!should_continue) {
             break;
         }
@@ -917,8 +1573,18 @@ class DirectStreamTransform : public CompositeTransform
 
 public:
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
+    Q_PROPERTY(int latencyTarget READ get_latencyTarget WRITE set_latencyTarget RESET reset_latencyTarget)
+    Q_PROPERTY(int memoryBudget READ get_memoryBudget WRITE set_memoryBudget RESET reset_memoryBudget)
+    Q_PROPERTY(int deadline READ get_deadline WRITE set_deadline RESET reset_deadline)
+    Q_PROPERTY(bool downscale READ get_downscale WRITE set_downscale RESET reset_downscale)
+    Q_PROPERTY(bool multiplex READ get_multiplex WRITE set_multiplex RESET reset_multiplex)
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
     BR_PROPERTY(int, activeFrames, 100)
+    BR_PROPERTY(int, latencyTarget, 0)
+    BR_PROPERTY(int, memoryBudget, 0)
+    BR_PROPERTY(int, deadline, 0)
+    BR_PROPERTY(bool, downscale, false)
+    BR_PROPERTY(bool, multiplex, false)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
 
     friend class StreamTransfrom;
@@ -1028,6 +1694,17 @@ public:
             return;
         }
 
+        const bool traced = !Globals->streamTrace.isEmpty();
+        if (traced)
+            StreamTrace::recording.storeRelease(1);
+
+        const bool timed = !Globals->streamStats.isEmpty();
+        foreach (ProcessingStage *stage, processingStages) {
+            stage->statistics.enabled = timed;
+            if (timed)
+                stage->statistics.reset();
+        }
+
         // Start the first thread in the stream.
         QWriteLocker lock(&readStage->statusLock);
         readStage->currentStatus = SingleThreadStage::STARTING;
@@ -1042,25 +1719,31 @@ public:
         lock.unlock();
 
         // Wait for the stream to process the last frame available from
-        // the data source.
-        readStage->dataSource.waitLast();
+        // the data source, publishing statistics periodically if requested.
+        if (timed && (Globals->streamStatsInterval > 0)) {
+            while (!readStage->dataSource.waitLast(Globals->streamStatsInterval * 1000))
+                publishStatistics();
+        } else {
+            readStage->dataSource.waitLast();
+        }
 
         // Now that there are no more incoming frames, call finalize
         // on each transform in turn to collect any last templates
         // they wish to issue.
         TemplateList final_output;
 
-        // Push finalize through the stages
+        // Push finalize through the stages, separately for each source
+        for (int source=0; source < readStage->dataSource.sourceCount(); source++)
         for (int i=0; i < this->transforms.size(); i++)
         {
             TemplateList output_set;
-            transforms[i]->finalize(output_set);
+            stageTransform(i, source)->finalize(output_set);
             if (output_set.empty())
                 continue;
 
             for (int j=i+1; j < transforms.size();j++)
             {
-                transforms[j]->projectUpdate(output_set);
+                stageTransform(j, source)->projectUpdate(output_set);
             }
             final_output.append(output_set);
         }
@@ -1075,6 +1758,15 @@ public:
         endPoint->finalize(output);
         dst.append(output);
 
+        if (timed)
+            publishStatistics();
+        if (traced)
+            QtUtils::writeFile(Globals->streamTrace, StreamTrace::format());
+
+        const DataSource &source = readStage->dataSource;
+        if (source.dropped || source.downscaled)
+            qDebug("Stream dropped %d and downscaled %d frames to stay within its %d ms deadline.", source.dropped, source.downscaled, deadline);
+
         foreach (ProcessingStage *stage, processingStages)
             stage->reset();
     }
@@ -1093,15 +1785,13 @@ public:
         // correctly.
         CompositeTransform::init();
 
-        // We share a thread pool across streams attached to the same
-        // parent tranform, retrieve or create a thread pool based
+        // We share an executor across streams attached to the same
+        // parent tranform, retrieve or create an executor based
         // on our parent transform.
         QMutexLocker poolLock(&poolsAccess);
-        QHash<QObject *, QThreadPool *>::Iterator it;
-        if (!pools.contains(this->parent())) {
-            it = pools.insert(this->parent(), new QThreadPool());
-            it.value()->setMaxThreadCount(Globals->parallelism);
-        }
+        QHash<QObject *, StreamExecutor *>::Iterator it;
+        if (!pools.contains(this->parent()))
+            it = pools.insert(this->parent(), new StreamExecutor(Globals->parallelism));
         else it = pools.find(this->parent());
         threads = it.value();
         poolLock.unlock();
@@ -1117,6 +1807,11 @@ public:
         // Additionally, we have a separate stage responsible for reading
         // frames from the data source
         readStage = new ReadStage(activeFrames);
+        readStage->dataSource.latencyTarget = latencyTarget;
+        readStage->dataSource.memoryBudget = qint64(memoryBudget) << 20;
+        readStage->dataSource.deadline = deadline;
+        readStage->dataSource.downscale = downscale;
+        readStage->dataSource.multiplex = multiplex;
 
         processingStages.push_back(readStage);
         readStage->stage_id = 0;
@@ -1132,7 +1827,7 @@ public:
             if (stage_variance[i])
                 // Whether or not the previous stage is multi-threaded controls
                 // the type of input buffer we need in a single threaded stage.
-                processingStages.append(new SingleThreadStage(prev_stage_variance));
+                processingStages.append(new SingleThreadStage(prev_stage_variance, activeFrames));
             else
                 processingStages.append(new MultiThreadStage(Globals->parallelism));
 
@@ -1151,7 +1846,7 @@ public:
 
         // We also have the last stage, which just puts the output of the
         // previous stages on a template list.
-        collectionStage = new EndStage(prev_stage_variance);
+        collectionStage = new EndStage(prev_stage_variance, activeFrames);
         collectionStage->transform = this->endPoint;
 
 
@@ -1160,6 +1855,9 @@ public:
         collectionStage->stages = &this->processingStages;
         collectionStage->threads = this->threads;
 
+        foreach (ProcessingStage *stage, processingStages)
+            stage->traceName = StreamTrace::name(QString::number(stage->stage_id) + " " + (stage->transform ? stage->transform->objectName() : QString("Read")));
+
         // the last transform stage points to collection stage
         processingStages[processingStages.size() - 2]->nextStage = collectionStage;
 
@@ -1176,6 +1874,9 @@ public:
             delete processingStages[i];
         }
         processingStages.clear();
+
+        QMutexLocker lock(&statisticsAccess);
+        statistics.remove(this);
     }
 
 protected:
@@ -1186,8 +1887,8 @@ protected:
 
     QList<ProcessingStage *> processingStages;
 
-    // This is a map from parent transforms (of Streams) to thread pools. Rather
-    // than starting threads on the global thread pool, Stream uses separate thread pools
+    // This is a map from parent transforms (of Streams) to executors. Rather
+    // than starting threads on the global thread pool, Stream uses separate executors
     // keyed on their parent transform. This is necessary because stream's project starts
     // threads, then enters an indefinite wait for them to finish. Since we are starting
     // threads using thread pools, threads themselves are a limited resource. Therefore,
@@ -1201,9 +1902,51 @@ protected:
     // will steal work from those jobs, so in that sense distribute isn't doing a hold and wait.
     // Waiting for a QFutureSynchronzier isn't really possible here since stream runs an indeteriminate
     // number of jobs.
-    static QHash<QObject *, QThreadPool *> pools;
+    // None of these executors share threads with QThreadPool::globalInstance, so stages calling
+    // QtConcurrent (e.g. Transform::project(TemplateList) or Distance::compare) neither compete with
+    // stream jobs for pool threads nor occupy one while they wait, since a thread waiting on a
+    // QFutureSynchronizer runs the jobs that haven't started yet itself.
+    static QHash<QObject *, StreamExecutor *> pools;
     static QMutex poolsAccess;
-    QThreadPool *threads;
+    StreamExecutor *threads;
+    friend void startStreamJob(QObject *owner, QRunnable *job);
+
+    // The instance of transforms[i] handling frames from the given source
+    Transform *stageTransform(int i, int source)
+    {
+        SingleThreadStage *stage = dynamic_cast<SingleThreadStage *>(processingStages[i+1]);
+        return stage ? stage->transformFor(source) : transforms[i];
+    }
+
+    // The most recent statistics of each stream, written together to Context::streamStats
+    static QMap<const DirectStreamTransform *, QStringList> statistics;
+    static QMutex statisticsAccess;
+    friend QString streamStatistics();
+
+    void publishStatistics()
+    {
+        QStringList lines;
+        foreach (ProcessingStage *stage, processingStages)
+            lines.append(stage->statisticsReport());
+
+        QMutexLocker lock(&statisticsAccess);
+        statistics.insert(this, lines);
+        QtUtils::writeFile(Globals->streamStats, formatStatistics());
+    }
+
+    // Called with statisticsAccess locked
+    static QString formatStatistics()
+    {
+        QStringList lines;
+        lines.append("Stream,Stage,Transform,Threads,Frames,MeanService,P50Service,P99Service,MeanQueueWait,MeanQueueDepth,MaxQueueDepth,Idle,Histogram");
+        int stream = 0;
+        foreach (const QStringList &stages, statistics.values()) {
+            foreach (const QString &stage, stages)
+                lines.append(QString::number(stream) + "," + stage);
+            stream++;
+        }
+        return lines.join("\n");
+    }
 
     void _project(const Template &src, Template &dst) const
     {
@@ -1217,14 +1960,47 @@ protected:
     }
 };
 
-QHash<QObject *, QThreadPool *> DirectStreamTransform::pools;
+QHash<QObject *, StreamExecutor *> DirectStreamTransform::pools;
 QMutex DirectStreamTransform::poolsAccess;
+QMap<const DirectStreamTransform *, QStringList> DirectStreamTransform::statistics;
+QMutex DirectStreamTransform::statisticsAccess;
+
+QString streamStatistics()
+{
+    QMutexLocker lock(&DirectStreamTransform::statisticsAccess);
+    return DirectStreamTransform::formatStatistics();
+}
+
+qint64 streamTime()
+{
+    return streamClock.now();
+}
+
+void startStreamJob(QObject *owner, QRunnable *job)
+{
+    QMutexLocker lock(&DirectStreamTransform::poolsAccess);
+    QHash<QObject *, StreamExecutor *>::Iterator it = DirectStreamTransform::pools.find(owner);
+    if (it == DirectStreamTransform::pools.end())
+        it = DirectStreamTransform::pools.insert(owner, new StreamExecutor(Globals->parallelism));
+    StreamExecutor *executor = it.value();
+    lock.unlock();
+
+    executor->start(job, 0);
+}
 
 BR_REGISTER(Transform, DirectStreamTransform)
 
 /*!
  * \ingroup transforms
  * \brief DOCUMENT ME CHARLES
+ * \br_property int activeFrames Maximum number of frames in the stream at once.
+ * \br_property int latencyTarget If positive, the number of frames in the stream is adapted to keep the time from reading a frame to finishing it near this many ms.
+ * \br_property int memoryBudget If positive, limits the decoded frames in the stream to this many MB.
+ * \br_property int deadline If positive, new frames are dropped while the oldest frame in the stream is older than this many ms, bounding the lag behind a live source. Frames carry DroppedFrames and DownscaledFrames counts.
+ * \br_property bool downscale Halve the resolution of frames read while behind the deadline instead of dropping them.
+ * \br_property bool multiplex Read every input template as a live source at once, taking turns, rather than one after another. Frames carry a SourceID, and time varying transforms keep separate state per source, while the workers and the models of the other stages are shared.
+ * \br_property int segments If greater than one, a single video is split into up to this many segments which are streamed concurrently, each by its own copy of the time varying transforms. Outputs are returned in order with the FrameNumber of the whole video. Requires a gallery that reports its frame count and seeks to a begin frame, e.g. videoGallery or libavGallery.
+ * \br_property int warmup Frames read before the start of each segment but the first, and whose outputs are discarded, to bring time varying transforms to the state they would have in a sequential stream.
  * \author Charles Otto \cite caotto
  */
 class StreamTransform : public WrapperTransform
@@ -1238,8 +2014,22 @@ public:
 
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
+    Q_PROPERTY(int latencyTarget READ get_latencyTarget WRITE set_latencyTarget RESET reset_latencyTarget)
+    Q_PROPERTY(int memoryBudget READ get_memoryBudget WRITE set_memoryBudget RESET reset_memoryBudget)
+    Q_PROPERTY(int deadline READ get_deadline WRITE set_deadline RESET reset_deadline)
+    Q_PROPERTY(bool downscale READ get_downscale WRITE set_downscale RESET reset_downscale)
+    Q_PROPERTY(bool multiplex READ get_multiplex WRITE set_multiplex RESET reset_multiplex)
+    Q_PROPERTY(int segments READ get_segments WRITE set_segments RESET reset_segments)
+    Q_PROPERTY(int warmup READ get_warmup WRITE set_warmup RESET reset_warmup)
 
     BR_PROPERTY(int, activeFrames, 100)
+    BR_PROPERTY(int, latencyTarget, 0)
+    BR_PROPERTY(int, memoryBudget, 0)
+    BR_PROPERTY(int, deadline, 0)
+    BR_PROPERTY(bool, downscale, false)
+    BR_PROPERTY(bool, multiplex, false)
+    BR_PROPERTY(int, segments, 0)
+    BR_PROPERTY(int, warmup, 30)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
 
     bool timeVarying() const { return true; }
@@ -1255,7 +2045,8 @@ public:
     }
     void projectUpdate(const TemplateList &src, TemplateList &dst)
     {
-        basis->projectUpdate(src,dst);
+        if (!projectSegments(src, dst))
+            basis->projectUpdate(src,dst);
     }
 
     void train(const QList<TemplateList> &data)
@@ -1281,6 +2072,11 @@ public:
         basis = QSharedPointer<DirectStreamTransform>((DirectStreamTransform *) Transform::make("DirectStream",this));
         basis->transforms.clear();
         basis->activeFrames = this->activeFrames;
+        basis->latencyTarget = this->latencyTarget;
+        basis->memoryBudget = this->memoryBudget;
+        basis->deadline = this->deadline;
+        basis->downscale = this->downscale;
+        basis->multiplex = this->multiplex;
         basis->endPoint = this->endPoint;
 
         // We need at least a CompositeTransform * to acess transform's children.
@@ -1354,6 +2150,11 @@ public:
         // We just want the DirectStream to begin with, so just return a copy of that.
         DirectStreamTransform *res = (DirectStreamTransform *) basis->smartCopy(newTransform);
         res->activeFrames = this->activeFrames;
+        res->latencyTarget = this->latencyTarget;
+        res->memoryBudget = this->memoryBudget;
+        res->deadline = this->deadline;
+        res->downscale = this->downscale;
+        res->multiplex = this->multiplex;
         return res;
     }
 
@@ -1386,6 +2187,84 @@ public:
 
 private:
     QSharedPointer<DirectStreamTransform> basis;
+
+    static void projectSegment(Transform *stream, const TemplateList *src, TemplateList *dst)
+    {
+        stream->projectUpdate(*src, *dst);
+    }
+
+    // Stream segments of a single video concurrently, returns false if src
+    // should be streamed sequentially instead
+    bool projectSegments(const TemplateList &src, TemplateList &dst)
+    {
+        if ((segments < 2) || (src.size() != 1) || multiplex || (deadline > 0))
+            return false;
+
+        // Other end points, e.g. ones writing a gallery, would see segments out of order
+        if (QString(endPoint->metaObject()->className()) != "br::CollectOutputTransform") {
+            qWarning("Streaming %s sequentially, segments require the default end point.", qPrintable(src.first().file.name));
+            return false;
+        }
+
+        QScopedPointer<Gallery> gallery(Gallery::make(src.first().file));
+        if (gallery->metaObject()->indexOfProperty("begin") == -1)
+            return false;
+        const qint64 frames = gallery->totalSize();
+        gallery.reset();
+        if (frames == std::numeric_limits<qint64>::max())
+            return false;
+
+        // Segments much shorter than the warm up would mostly repeat work
+        const qint64 minimumLength = std::max(qint64(4) * warmup, qint64(activeFrames));
+        const int count = int(std::min(qint64(segments), frames / std::max(minimumLength, qint64(1))));
+        if (count < 2)
+            return false;
+
+        QVector<qint64> begins(count), starts(count);
+        QVector<TemplateList> inputs(count), outputs(count);
+        QList<Transform *> streams;
+        for (int i=0; i < count; i++) {
+            begins[i] = frames * i / count;
+            starts[i] = std::max(begins[i] - warmup, qint64(0));
+
+            Template segment = src.first();
+            segment.file.set("pos", starts[i]);
+            // The last segment reads to the end, since frame counts may be estimates
+            if (i < count - 1)
+                segment.file.set("length", frames * (i+1) / count - starts[i]);
+            inputs[i].append(segment);
+
+            bool newTransform = false;
+            Transform *stream = basis->smartCopy(newTransform);
+            if (!newTransform)
+                qFatal("Expected a copy of the stream for each segment.");
+            // Share basis' executor, rather than that of streams without a parent
+            stream->setParent(this);
+            stream->init();
+            streams.append(stream);
+        }
+
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i < count; i++)
+            futures.addFuture(QtConcurrent::run(projectSegment, streams[i], &inputs[i], &outputs[i]));
+        futures.waitForFinished();
+        qDeleteAll(streams);
+
+        // Restore the frame numbers of the whole video, dropping outputs of the warm up frames
+        dst.clear();
+        for (int i=0; i < count; i++) {
+            foreach (Template t, outputs[i]) {
+                if (t.file.contains("FrameNumber")) {
+                    const qint64 frameNumber = starts[i] + t.file.get<qint64>("FrameNumber");
+                    if (frameNumber < begins[i])
+                        continue;
+                    t.file.set("FrameNumber", frameNumber);
+                }
+                dst.append(t);
+            }
+        }
+        return true;
+    }
 };
 
 BR_REGISTER(Transform, StreamTransform)
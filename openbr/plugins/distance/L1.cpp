@@ -17,6 +17,7 @@
 #include <Eigen/Dense>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
 
 namespace br
 {
@@ -24,18 +25,35 @@ namespace br
 /*!
  * \ingroup distances
  * \brief L1 distance computed using eigen.
+ *
+ * Half precision templates from br::HalfTransform are compared with vectorized kernels that accumulate in single precision.
  * \author Josh Klontz \cite jklontz
  */
-class L1Distance : public UntrainableDistance
+class L1Distance : public BoundedDistance
 {
     Q_OBJECT
 
-    float compare(const cv::Mat &a, const cv::Mat &b) const
+    float boundedCompare(const cv::Mat &a, const cv::Mat &b, float upper) const
     {
+        if (a.depth() == CV_16U) {
+            const int bytes = int(a.total() * a.elemSize());
+            return (upper < std::numeric_limits<float>::max()) ? half_l1(a.data, b.data, bytes, upper) : half_l1(a.data, b.data, bytes);
+        }
+
         const int size = a.rows * a.cols;
         Eigen::Map<Eigen::VectorXf> aMap((float*)a.data, size);
         Eigen::Map<Eigen::VectorXf> bMap((float*)b.data, size);
-        return (aMap-bMap).cwiseAbs().sum();
+
+        // Unbounded comparisons are summed in one pass so their results don't change
+        const int blockSize = (upper < std::numeric_limits<float>::max()) ? 256 : size;
+        float distance = 0;
+        for (int i=0; i<size; i+=blockSize) {
+            const int n = std::min(blockSize, size-i);
+            distance += (aMap.segment(i, n)-bMap.segment(i, n)).cwiseAbs().sum();
+            if (distance > upper)
+                break;
+        }
+        return distance;
     }
 };
 
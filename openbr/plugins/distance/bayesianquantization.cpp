@@ -27,16 +27,53 @@ namespace br
 /*!
  * \ingroup distances
  * \brief Bayesian quantization Distance
+ *
+ * Comparisons look up 16-bit fixed point copies of the log likelihood tables, which take half the cache of the float tables,
+ * unless the rounding could change a score by more than tolerance.
  * \author Josh Klontz \cite jklontz
+ * \br_property QString inputVariable Metadata key for the labels to train on.
+ * \br_property float tolerance The largest change to a score allowed from rounding the tables, 0 to always use the float tables.
  */
 class BayesianQuantizationDistance : public Distance
 {
     Q_OBJECT
 
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    Q_PROPERTY(float tolerance READ get_tolerance WRITE set_tolerance RESET reset_tolerance STORED false)
     BR_PROPERTY(QString, inputVariable, "Label")
+    BR_PROPERTY(float, tolerance, 0.05)
 
     QVector<float> loglikelihoods;
+    QVector<qint16> quantized; // loglikelihoods * scale, empty if the rounding error could exceed tolerance
+    float scale;
+
+    void init()
+    {
+        quantize();
+    }
+
+    void quantize()
+    {
+        quantized.clear();
+        const int dimensions = loglikelihoods.size() / 256;
+        if ((dimensions == 0) || (dimensions > 65536))
+            return;
+
+        float maxAbs = 0;
+        foreach (float loglikelihood, loglikelihoods)
+            maxAbs = std::max(maxAbs, std::abs(loglikelihood));
+        if (maxAbs == 0)
+            return;
+
+        // Each lookup is off by at most half a step, so a score by at most half a step per dimension
+        scale = 32767 / maxAbs;
+        if (dimensions * 0.5f / scale > tolerance)
+            return;
+
+        quantized.resize(loglikelihoods.size());
+        for (int i=0; i<loglikelihoods.size(); i++)
+            quantized[i] = qint16(qRound(loglikelihoods[i] * scale));
+    }
 
     static void computeLogLikelihood(const Mat &data, const QList<int> &labels, float *loglikelihood)
     {
@@ -73,6 +110,7 @@ class BayesianQuantizationDistance : public Distance
         for (int i=0; i<data.cols; i++)
             futures.addFuture(QtConcurrent::run(&BayesianQuantizationDistance::computeLogLikelihood, data.col(i), templateLabels, &loglikelihoods.data()[i*256]));
         futures.waitForFinished();
+        quantize();
     }
 
     float compare(const cv::Mat &a, const cv::Mat &b) const
@@ -80,6 +118,23 @@ class BayesianQuantizationDistance : public Distance
         const uchar *aData = a.data;
         const uchar *bData = b.data;
         const int size = a.rows * a.cols;
+
+        if (quantized.size() == size*256) {
+            // Independent sums so consecutive lookups don't wait on each other, at most 65536*32767 fits in an int
+            const qint16 *table = quantized.constData();
+            int s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+            int i = 0;
+            for (; i+4<=size; i+=4, table+=4*256) {
+                s0 += table[0*256 + abs(aData[i+0]-bData[i+0])];
+                s1 += table[1*256 + abs(aData[i+1]-bData[i+1])];
+                s2 += table[2*256 + abs(aData[i+2]-bData[i+2])];
+                s3 += table[3*256 + abs(aData[i+3]-bData[i+3])];
+            }
+            for (; i<size; i++, table+=256)
+                s0 += table[abs(aData[i]-bData[i])];
+            return (s0 + s1 + s2 + s3) / scale;
+        }
+
         float likelihood = 0;
         for (int i=0; i<size; i++)
             likelihood += loglikelihoods[i*256+abs(aData[i]-bData[i])];
@@ -94,6 +149,7 @@ class BayesianQuantizationDistance : public Distance
     void load(QDataStream &stream)
     {
         stream >> loglikelihoods;
+        quantize();
     }
 };
 
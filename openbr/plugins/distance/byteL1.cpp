@@ -25,13 +25,13 @@ namespace br
  * \brief Fast 8-bit L1 distance
  * \author Josh Klontz \cite jklontz
  */
-class ByteL1Distance : public UntrainableDistance
+class ByteL1Distance : public BoundedDistance
 {
     Q_OBJECT
 
-    float compare(const unsigned char *a, const unsigned char *b, size_t size) const
+    float boundedCompare(const cv::Mat &a, const cv::Mat &b, float upper) const
     {
-        return l1(a, b, size);
+        return l1(a.data, b.data, a.rows * a.cols * a.elemSize(), upper);
     }
 };
 
@@ -0,0 +1,162 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QtConcurrent>
+#include <algorithm>
+
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Scores every target with a cheap distance, and only the best with the expensive ones.
+ *
+ * The first distance is the coarse one, it ranks the targets for each query.
+ * Targets scoring at least threshold, and among the best keep of them, are re-scored by the mean of the remaining distances, the rest score -FLT_MAX.
+ * When templates have one matrix per distance, as for br::FuseDistance, each distance compares its own matrix, otherwise each compares whole templates.
+ * Targets are ranked within each block compared at once, so the survivors include the best keep targets of the whole gallery.
+ * Only the threshold applies to pairs compared one at a time.
+ * \author Unknown \cite unknown
+ * \br_property QList<br::Distance*> distances The coarse distance followed by the fine distances.
+ * \br_property int keep Targets per query re-scored by the fine distances, 0 for no limit.
+ * \br_property float threshold Targets scoring below this on the coarse distance are discarded.
+ */
+class CascadeDistance : public ListDistance
+{
+    Q_OBJECT
+    Q_PROPERTY(int keep READ get_keep WRITE set_keep RESET reset_keep STORED false)
+    Q_PROPERTY(float threshold READ get_threshold WRITE set_threshold RESET reset_threshold STORED false)
+    BR_PROPERTY(int, keep, 100)
+    BR_PROPERTY(float, threshold, -std::numeric_limits<float>::max())
+
+    typedef QPair<float,int> Candidate; // QPair<coarse score,target index>
+
+    static bool better(const Candidate &a, const Candidate &b)
+    {
+        return a.first > b.first;
+    }
+
+    void train(const TemplateList &src)
+    {
+        QList<TemplateList> partitionedSrc;
+        if (!src.isEmpty() && (src.first().size() == distances.size())) {
+            QList<int> splits;
+            for (int i=0; i<distances.size(); i++) splits.append(1);
+            partitionedSrc = src.split(splits);
+        } else {
+            for (int i=0; i<distances.size(); i++) partitionedSrc.append(src);
+        }
+
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<distances.size(); i++)
+            futures.addFuture(QtConcurrent::run(distances[i], &Distance::train, partitionedSrc[i]));
+        futures.waitForFinished();
+    }
+
+    Template part(const Template &t, int i) const
+    {
+        return (t.size() == distances.size()) ? Template(t.file, t[i]) : t;
+    }
+
+    float fine(const Template &target, const Template &query, float coarse, float lower) const
+    {
+        if (distances.size() == 1)
+            return coarse;
+        if (distances.size() == 2)
+            return distances[1]->compare(part(target, 1), part(query, 1), lower, std::numeric_limits<float>::max());
+
+        float score = 0;
+        for (int i=1; i<distances.size(); i++)
+            score += distances[i]->compare(part(target, i), part(query, i));
+        return score / (distances.size() - 1);
+    }
+
+    float compare(const Template &target, const Template &query) const
+    {
+        const float coarse = distances.first()->compare(part(target, 0), part(query, 0));
+        if ((coarse == -std::numeric_limits<float>::max()) || (coarse < threshold))
+            return -std::numeric_limits<float>::max();
+        return fine(target, query, coarse, -std::numeric_limits<float>::max());
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        return cascade(targets, query, NULL, 0);
+    }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        if (target.isEmpty() || query.isEmpty())
+            return;
+
+        Context::addMetric("br_comparisons_total", double(target.size()) * query.size());
+
+        // Each query ranks the whole target list, so queries rather than tiles are divided among the threads
+        QAtomicInt next(0);
+        const int workers = std::max(1, threadParallelism());
+        QFutureSynchronizer<void> futures;
+        for (int i=1; i<workers; i++)
+            futures.addFuture(QtConcurrent::run(runQueries, this, &target, &query, output, &next));
+        runQueries(this, &target, &query, output, &next);
+        futures.waitForFinished();
+    }
+
+    static void runQueries(const CascadeDistance *distance, const TemplateList *target, const TemplateList *query, Output *output, QAtomicInt *next)
+    {
+        int i;
+        while ((i = next->fetchAndAddRelaxed(1)) < query->size()) {
+            const QList<float> scores = distance->cascade(*target, (*query)[i], output, i);
+            for (int j=0; j<scores.size(); j++)
+                output->setRelative(scores[j], i, j);
+        }
+    }
+
+    // Scores targets against the query in row of output, which may be NULL
+    QList<float> cascade(const TemplateList &targets, const Template &query, Output *output, int row) const
+    {
+        TemplateList coarseTargets; coarseTargets.reserve(targets.size());
+        foreach (const Template &target, targets)
+            coarseTargets.append(part(target, 0));
+        QList<float> scores = distances.first()->compare(coarseTargets, part(query, 0));
+
+        QVector<Candidate> candidates; candidates.reserve(scores.size());
+        for (int j=0; j<scores.size(); j++) {
+            if ((scores[j] != -std::numeric_limits<float>::max()) && (scores[j] >= threshold))
+                candidates.append(Candidate(scores[j], j));
+            scores[j] = -std::numeric_limits<float>::max();
+        }
+        if ((keep > 0) && (candidates.size() > keep)) {
+            std::nth_element(candidates.begin(), candidates.begin() + keep, candidates.end(), better);
+            candidates.resize(keep);
+        }
+
+        foreach (const Candidate &candidate, candidates) {
+            const int j = candidate.second;
+            const float lower = output ? output->boundRelative(row, j) : -std::numeric_limits<float>::max();
+            scores[j] = fine(targets[j], query, candidate.first, lower);
+        }
+        return scores;
+    }
+};
+
+BR_REGISTER(Distance, CascadeDistance)
+
+} // namespace br
+
+#include "distance/cascade.moc"
@@ -16,6 +16,7 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
 
 using namespace cv;
 
@@ -25,6 +26,9 @@ namespace br
 /*!
  * \ingroup distances
  * \brief Standard Distance metrics
+ *
+ * Half precision templates from br::HalfTransform are compared in single precision.
+ * L1 and L2 use vectorized kernels, other metrics convert both matrices first.
  * \author Josh Klontz \cite jklontz
  */
 class DistDistance : public UntrainableDistance
@@ -56,6 +60,9 @@ private:
             (a.type() != b.type()))
                 return -std::numeric_limits<float>::max();
 
+        if (a.depth() == CV_16U)
+            return compareHalf(a, b);
+
 // TODO: this max value is never returned based on the switch / default
         float result = std::numeric_limits<float>::max();
         switch (metric) {
@@ -87,12 +94,35 @@ private:
             qFatal("Invalid metric");
         }
 
+        return finish(result);
+    }
+
+    float finish(float result) const
+    {
         if (result != result)
             qFatal("NaN result.");
 
         return negLogPlusOne ? -log(result+1) : result;
     }
 
+    float compareHalf(const Mat &a, const Mat &b) const
+    {
+        if (a.isContinuous() && b.isContinuous()) {
+            const int bytes = int(a.total() * a.elemSize());
+            if (metric == L1) return finish(half_l1(a.data, b.data, bytes));
+            if (metric == L2) return finish(sqrt(half_l2(a.data, b.data, bytes)));
+        }
+        return compare(toFloat(a), toFloat(b));
+    }
+
+    static Mat toFloat(const Mat &m)
+    {
+        const Mat c = m.isContinuous() ? m : m.clone();
+        Mat f(c.rows, c.cols, CV_MAKETYPE(CV_32F, c.channels()));
+        halfToFloat((const quint16*) c.data, (float*) f.data, int(c.total() * c.channels()));
+        return f;
+    }
+
     static float cosine(const Mat &a, const Mat &b)
     {
         float dot = 0;
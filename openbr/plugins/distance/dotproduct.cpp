@@ -0,0 +1,116 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Dot product similarity, fast for signed 8-bit templates from Quantize(symmetric=true).
+ *
+ * Signed 8-bit templates are compared with VNNI, AVX2, SSE2 or NEON dot product kernels, other depths with cv::Mat::dot.
+ * Blocks of signed 8-bit templates are scored all at once as a matrix product.
+ * \author Unknown \cite unknown
+ * \br_property bool normalize If true, divide by the product of the template magnitudes to get cosine similarity. Default is false.
+ * \br_property int minBlock Smallest number of queries in a block worth scoring as a matrix product. Default is 4.
+ */
+class DotProductDistance : public UntrainableDistance
+{
+    Q_OBJECT
+    Q_PROPERTY(bool normalize READ get_normalize WRITE set_normalize RESET reset_normalize STORED false)
+    Q_PROPERTY(int minBlock READ get_minBlock WRITE set_minBlock RESET reset_minBlock STORED false)
+    BR_PROPERTY(bool, normalize, false)
+    BR_PROPERTY(int, minBlock, 4)
+
+    float compare(const Mat &a, const Mat &b) const
+    {
+        if ((a.size != b.size) || (a.type() != b.type()))
+            return -std::numeric_limits<float>::max();
+
+        if (a.depth() != CV_8S) {
+            const double dot = a.dot(b);
+            return normalize ? dot / sqrt(a.dot(a) * b.dot(b)) : dot;
+        }
+
+        const Mat ac = a.isContinuous() ? a : a.clone();
+        const Mat bc = b.isContinuous() ? b : b.clone();
+        const int bytes = int(ac.total() * ac.elemSize());
+        const float dot = dot_s8(ac.data, bc.data, bytes);
+        return normalize ? dot / sqrt(dot_s8(ac.data, ac.data, bytes) * dot_s8(bc.data, bc.data, bytes)) : dot;
+    }
+
+    // Rows of signed 8-bit templates as single precision, which holds their products exactly, or an empty matrix if they can't be packed
+    static Mat pack(const TemplateList &templates, int type, size_t elements)
+    {
+        Mat packed(templates.size(), int(elements), CV_32F);
+        for (int i=0; i<templates.size(); i++) {
+            const Template &t = templates[i];
+            if ((t.size() != 1) || (t.m().type() != type) || (t.m().total() * t.m().channels() != elements))
+                return Mat();
+            t.m().reshape(1, 1).convertTo(packed.row(i), CV_32F);
+        }
+        return packed;
+    }
+
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        bool empty = target.isEmpty() || (query.size() < minBlock);
+        foreach (const Template &t, target + query)
+            empty = empty || t.isEmpty();
+        if (empty || (query.first().m().depth() != CV_8S)) {
+            Distance::compareBlock(target, query, output, targetOffset, queryOffset);
+            return;
+        }
+
+        const Mat &first = query.first().m();
+        const size_t elements = first.total() * first.channels();
+        const Mat targets = pack(target, first.type(), elements);
+        const Mat queries = pack(query, first.type(), elements);
+        if (targets.empty() || queries.empty()) {
+            Distance::compareBlock(target, query, output, targetOffset, queryOffset);
+            return;
+        }
+
+        Mat scores;
+        gemm(queries, targets, 1, Mat(), 0, scores, GEMM_2_T);
+
+        if (normalize) {
+            QVector<float> magnitudes(target.size());
+            for (int j=0; j<target.size(); j++)
+                magnitudes[j] = sqrt(targets.row(j).dot(targets.row(j)));
+            for (int i=0; i<query.size(); i++) {
+                const float magnitude = sqrt(queries.row(i).dot(queries.row(i)));
+                for (int j=0; j<target.size(); j++)
+                    scores.at<float>(i, j) /= magnitude * magnitudes[j];
+            }
+        }
+
+        for (int i=0; i<query.size(); i++)
+            for (int j=0; j<target.size(); j++)
+                output->setRelative(scores.at<float>(i, j), i+queryOffset, j+targetOffset);
+    }
+};
+
+BR_REGISTER(Distance, DotProductDistance)
+
+} // namespace br
+
+#include "distance/dotproduct.moc"
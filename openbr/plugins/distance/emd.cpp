@@ -1,3 +1,4 @@
+#include <QMutex>
 #include <openbr/plugins/openbr_internal.h>
 #include <opencv2/imgproc/imgproc.hpp>
 
@@ -9,49 +10,174 @@ namespace br
 /*!
  * \ingroup distances
  * \brief Computes Earth Mover's Distance
+ *
+ * In Approximate mode both histograms are normalized to unit mass.
+ * Single row histograms then have a closed form, the L1 distance between their cumulative sums.
+ * Others are solved with a fixed number of Sinkhorn iterations, reusing the kernel matrix of each histogram size.
+ * The distance between histogram centroids bounds the EMD from below, so comparisons stop there when it exceeds the caller's upper bound.
  * \author Scott Klum \cite sklum
  * \brief https://www.cs.duke.edu/~tomasi/papers/rubner/rubnerTr98.pdf
+ * \br_property enum Metric Ground distance between bins. Possible values are: [L1, L2, C].
+ * \br_property enum Mode Possible values are: [Exact, Approximate].
+ * \br_property float regularization Sinkhorn entropic regularization, relative to the largest ground distance.
+ * \br_property int iterations Sinkhorn iterations.
  */
 class EMDDistance : public UntrainableDistance
 {
     Q_OBJECT
 
     Q_ENUMS(Metric)
+    Q_ENUMS(Mode)
     Q_PROPERTY(Metric metric READ get_metric WRITE set_metric RESET reset_metric STORED false)
+    Q_PROPERTY(Mode mode READ get_mode WRITE set_mode RESET reset_mode STORED false)
+    Q_PROPERTY(float regularization READ get_regularization WRITE set_regularization RESET reset_regularization STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
 
 public:
     enum Metric { L1 = CV_DIST_L1,
                   L2 = CV_DIST_L2,
                   C = CV_DIST_C };
 
+    enum Mode { Exact,
+                Approximate };
+
 private:
     BR_PROPERTY(Metric, metric, L2)
+    BR_PROPERTY(Mode, mode, Exact)
+    BR_PROPERTY(float, regularization, 0.05)
+    BR_PROPERTY(int, iterations, 50)
+
+    struct Kernel
+    {
+        Mat cost, k; // Ground distances between bins, and exp(-cost/epsilon)
+    };
+
+    mutable QMutex kernelsLock;
+    mutable QHash<QPair<int,int>, Kernel> kernels; // Keyed by histogram QPair<rows,cols>
+
+    void init()
+    {
+        QMutexLocker locker(&kernelsLock);
+        kernels.clear();
+    }
+
+    float ground(float dx, float dy) const
+    {
+        dx = std::abs(dx); dy = std::abs(dy);
+        if      (metric == L1) return dx + dy;
+        else if (metric == C)  return std::max(dx, dy);
+        else                   return sqrt(dx*dx + dy*dy);
+    }
+
+    static Mat signature(const Mat &m)
+    {
+        const int dims = m.rows > 1 ? 3 : 2;
+        Mat sig(m.rows*m.cols, dims, CV_32FC1);
+        for (int i=0; i<m.rows; i++) {
+            for (int j=0; j<m.cols; j++) {
+                sig.at<float>(i*m.cols+j,0) = m.at<float>(i,j);
+                sig.at<float>(i*m.cols+j,1) = j;
+                if (dims == 3) sig.at<float>(i*m.cols+j,2) = i;
+            }
+        }
+        return sig;
+    }
 
     float compare(const Template &a, const Template &b) const
     {
-        const int dims_a = a.m().rows > 1 ? 3 : 2;
-        const int dims_b = b.m().rows > 1 ? 3 : 2;
+        return compare(a, b, -std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+    }
 
-        Mat sig_a(a.m().cols, dims_a, CV_32FC1);
-        Mat sig_b(b.m().cols, dims_b, CV_32FC1);
+    float compare(const Template &a, const Template &b, float lower, float upper) const
+    {
+        (void) lower;
+        const Mat &ma = a.m(), &mb = b.m();
+        const bool sameShape = (ma.rows == mb.rows) && (ma.cols == mb.cols) && (ma.type() == CV_32FC1) && (mb.type() == CV_32FC1);
+        const double massA = sameShape ? sum(ma)[0] : 0, massB = sameShape ? sum(mb)[0] : 0;
 
-        for (int i=0; i<a.m().rows; i++) {
-            for (int j=0; j<a.m().cols; j++) {
-                sig_a.at<float>(i*a.m().cols+j,0) = a.m().at<float>(i,j);
-                sig_a.at<float>(i*a.m().cols+j,1) = j;
-                if (dims_a == 3) sig_a.at<float>(i*a.m().cols+j,2) = i;
+        // Rubner's centroid bound holds when the masses are equal, as they are once normalized
+        if (sameShape && (massA > 0) && (massB > 0) && ((mode == Approximate) || (std::abs(massA - massB) <= 1e-5 * massA))) {
+            if (upper < std::numeric_limits<float>::max()) {
+                const float bound = centroidDistance(ma, mb, massA, massB);
+                if (bound > upper)
+                    return bound;
             }
+            if (mode == Approximate)
+                return (ma.rows == 1) ? ordered(ma, mb, massA, massB) : sinkhorn(ma, mb, massA, massB);
         }
 
-        for (int i=0; i<b.m().rows; i++) {
-            for (int j=0; j<b.m().cols; j++) {
-                sig_b.at<float>(i*b.m().cols+j,0) = b.m().at<float>(i,j);
-                sig_b.at<float>(i*b.m().cols+j,1) = j;
-                if (dims_b == 3) sig_a.at<float>(i*b.m().cols+j,2) = i;
+        return EMD(signature(ma), signature(mb), metric);
+    }
+
+    float centroidDistance(const Mat &a, const Mat &b, double massA, double massB) const
+    {
+        double dx = 0, dy = 0;
+        for (int i=0; i<a.rows; i++) {
+            const float *pa = a.ptr<float>(i), *pb = b.ptr<float>(i);
+            for (int j=0; j<a.cols; j++) {
+                const double difference = pa[j] / massA - pb[j] / massB;
+                dx += difference * j;
+                dy += difference * i;
             }
         }
+        return ground(dx, dy);
+    }
+
+    // With unit spaced ordered bins the EMD is the L1 distance between the cumulative distributions
+    static float ordered(const Mat &a, const Mat &b, double massA, double massB)
+    {
+        const float *pa = a.ptr<float>(), *pb = b.ptr<float>();
+        double cumulative = 0, emd = 0;
+        for (int j=0; j<a.cols-1; j++) {
+            cumulative += pa[j] / massA - pb[j] / massB;
+            emd += std::abs(cumulative);
+        }
+        return emd;
+    }
+
+    float sinkhorn(const Mat &a, const Mat &b, double massA, double massB) const
+    {
+        const Kernel kernel = getKernel(a.rows, a.cols);
+        const int n = a.rows * a.cols;
+
+        Mat p, q; // Unit mass distributions as column vectors
+        a.reshape(1, n).convertTo(p, CV_32F, 1/massA);
+        b.reshape(1, n).convertTo(q, CV_32F, 1/massB);
+
+        Mat u = Mat::ones(n, 1, CV_32F), v = Mat::ones(n, 1, CV_32F), kv, ktu;
+        for (int i=0; i<iterations; i++) {
+            kv = kernel.k * v;
+            divide(p, max(kv, std::numeric_limits<float>::min()), u);
+            ktu = kernel.k.t() * u; // The kernel is symmetric for histograms of the same shape
+            divide(q, max(ktu, std::numeric_limits<float>::min()), v);
+        }
+
+        // Transport cost of the plan diag(u) K diag(v)
+        const Mat plan = kernel.k.mul(u * v.t());
+        return plan.dot(kernel.cost);
+    }
+
+    Kernel getKernel(int rows, int cols) const
+    {
+        QMutexLocker locker(&kernelsLock);
+        const QPair<int,int> key(rows, cols);
+        if (kernels.contains(key))
+            return kernels[key];
+
+        const int n = rows * cols;
+        Kernel kernel;
+        kernel.cost.create(n, n, CV_32FC1);
+        for (int i=0; i<n; i++)
+            for (int j=0; j<n; j++)
+                kernel.cost.at<float>(i, j) = ground((i % cols) - (j % cols), (i / cols) - (j / cols));
+
+        double maxCost;
+        minMaxLoc(kernel.cost, NULL, &maxCost);
+        const double epsilon = regularization * std::max(maxCost, 1.0);
+        exp(-kernel.cost / epsilon, kernel.k);
 
-        return EMD(sig_a,sig_b,metric);
+        kernels.insert(key, kernel);
+        return kernel;
     }
 };
 
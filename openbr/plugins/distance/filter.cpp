@@ -31,25 +31,30 @@ class FilterDistance : public UntrainableDistance
     float compare(const Template &a, const Template &b) const
     {
         (void) b; // Query template isn't checked
-        foreach (const QString &key, Globals->filters.keys()) {
-            bool keep = false;
-            const QString metadata = a.file.get<QString>(key, "");
-            if (Globals->filters[key].isEmpty()) continue;
-            if (metadata.isEmpty()) return -std::numeric_limits<float>::max();
-            foreach (const QString &value, Globals->filters[key]) {
-                if (metadata == value) {
-                    keep = true;
-                    break;
-                }
-            }
-            if (!keep) return -std::numeric_limits<float>::max();
-        }
-        return 0;
+        return matchesFilters(a.file) ? 0 : -std::numeric_limits<float>::max();
     }
 };
 
 BR_REGISTER(Distance, FilterDistance)
 
+bool matchesFilters(const File &file)
+{
+    foreach (const QString &key, Globals->filters.keys()) {
+        bool keep = false;
+        const QString metadata = file.get<QString>(key, "");
+        if (Globals->filters[key].isEmpty()) continue;
+        if (metadata.isEmpty()) return false;
+        foreach (const QString &value, Globals->filters[key]) {
+            if (metadata == value) {
+                keep = true;
+                break;
+            }
+        }
+        if (!keep) return false;
+    }
+    return true;
+}
+
 } // namespace br
 
 #include "distance/filter.moc"
@@ -27,13 +27,13 @@ namespace br
  * \brief Fast 4-bit L1 distance
  * \author Josh Klontz \cite jklontz
  */
-class HalfByteL1Distance : public UntrainableDistance
+class HalfByteL1Distance : public BoundedDistance
 {
     Q_OBJECT
 
-    float compare(const Mat &a, const Mat &b) const
+    float boundedCompare(const Mat &a, const Mat &b, float upper) const
     {
-        return packed_l1(a.data, b.data, a.total());
+        return packed_l1(a.data, b.data, a.total(), upper);
     }
 };
 
@@ -0,0 +1,42 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Fast Hamming distance between bit vectors, for templates packed by QuantizePack with bits=1.
+ * \author Unknown \cite unknown
+ */
+class HammingDistance : public BoundedDistance
+{
+    Q_OBJECT
+
+    float boundedCompare(const cv::Mat &a, const cv::Mat &b, float upper) const
+    {
+        return hamming(a.data, b.data, a.rows * a.cols * a.elemSize(), upper);
+    }
+};
+
+BR_REGISTER(Distance, HammingDistance)
+
+} // namespace br
+
+#include "distance/hamming.moc"
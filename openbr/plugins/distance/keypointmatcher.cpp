@@ -14,9 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
 #include <opencv2/features2d/features2d.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
 
 using namespace cv;
 
@@ -26,16 +28,25 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Wraps OpenCV Key Point Matcher
+ *
+ * With the BruteForce-Hamming matcher, binary descriptors are matched with the popcount kernels of br::HammingDistance.
+ * When comparing galleries with index set, each target's descriptors are indexed once, with FLANN (LSH for binary descriptors),
+ * and searched by the descriptors of every query. Matches are then approximate, and always go from query to target descriptors.
  * \br_link http://docs.opencv.org/modules/features2d/doc/common_interfaces_of_feature_detectors.html
  * \author Josh Klontz \cite jklontz
+ * \br_property QString matcher The DescriptorMatcher to use.
+ * \br_property float maxRatio Matches whose nearest neighbor isn't at most this fraction of the second nearest are discarded.
+ * \br_property bool index Index target descriptors when comparing galleries.
  */
 class KeyPointMatcherDistance : public UntrainableDistance
 {
     Q_OBJECT
     Q_PROPERTY(QString matcher READ get_matcher WRITE set_matcher RESET reset_matcher STORED false)
     Q_PROPERTY(float maxRatio READ get_maxRatio WRITE set_maxRatio RESET reset_maxRatio STORED false)
+    Q_PROPERTY(bool index READ get_index WRITE set_index RESET reset_index STORED false)
     BR_PROPERTY(QString, matcher, "BruteForce")
     BR_PROPERTY(float, maxRatio, 0.8)
+    BR_PROPERTY(bool, index, false)
 
     Ptr<DescriptorMatcher> descriptorMatcher;
 
@@ -50,15 +61,47 @@ class KeyPointMatcherDistance : public UntrainableDistance
     {
         if ((a.rows < 2) || (b.rows < 2)) return 0;
 
+        if ((matcher == "BruteForce-Hamming") && (a.type() == CV_8UC1) && (b.type() == CV_8UC1) && (a.cols == b.cols)) {
+            if (a.rows < b.rows) return similarity(hammingMatches(a, b));
+            else                 return similarity(hammingMatches(b, a));
+        }
+
         std::vector< std::vector<DMatch> > matches;
         if (a.rows < b.rows) descriptorMatcher->knnMatch(a, b, matches, 2);
         else                 descriptorMatcher->knnMatch(b, a, matches, 2);
+        return similarity(ratioTest(matches));
+    }
 
+    // Distances of the nearest neighbors passing the ratio test
+    QList<float> ratioTest(const std::vector< std::vector<DMatch> > &matches) const
+    {
         QList<float> distances;
         foreach (const std::vector<DMatch> &match, matches) {
-            if (match[0].distance / match[1].distance > maxRatio) continue;
+            if ((match.size() < 2) || (match[0].distance / match[1].distance > maxRatio)) continue;
             distances.append(match[0].distance);
         }
+        return distances;
+    }
+
+    // Exhaustive 2-nearest neighbor search with popcount, as DescriptorMatcher::knnMatch followed by ratioTest()
+    QList<float> hammingMatches(const Mat &query, const Mat &train) const
+    {
+        QList<float> distances;
+        for (int i=0; i<query.rows; i++) {
+            float first = std::numeric_limits<float>::max(), second = std::numeric_limits<float>::max();
+            for (int j=0; j<train.rows; j++) {
+                const float distance = hamming(query.ptr(i), train.ptr(j), query.cols);
+                if (distance < first) { second = first; first = distance; }
+                else if (distance < second) second = distance;
+            }
+            if (first / second > maxRatio) continue;
+            distances.append(first);
+        }
+        return distances;
+    }
+
+    static float similarity(QList<float> distances)
+    {
         qSort(distances);
 
         float similarity = 0;
@@ -66,6 +109,64 @@ class KeyPointMatcherDistance : public UntrainableDistance
             similarity += 1.f/(1+distances[i])/(i+1);
         return similarity;
     }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        if (!index) {
+            Distance::compare(target, query, output);
+            return;
+        }
+        if (target.isEmpty() || query.isEmpty())
+            return;
+
+        Context::addMetric("br_comparisons_total", double(target.size()) * query.size());
+
+        // Targets are divided among the threads, so each index is built and searched by one thread
+        QAtomicInt next(0);
+        const int workers = std::max(1, threadParallelism());
+        QFutureSynchronizer<void> futures;
+        for (int i=1; i<workers; i++)
+            futures.addFuture(QtConcurrent::run(runTargets, this, &target, &query, output, &next));
+        runTargets(this, &target, &query, output, &next);
+        futures.waitForFinished();
+    }
+
+    static void runTargets(const KeyPointMatcherDistance *distance, const TemplateList *target, const TemplateList *query, Output *output, QAtomicInt *next)
+    {
+        int j;
+        while ((j = next->fetchAndAddRelaxed(1)) < target->size())
+            distance->searchTarget((*target)[j], *query, output, j);
+    }
+
+    void searchTarget(const Template &target, const TemplateList &queries, Output *output, int column) const
+    {
+        const Mat descriptors = (target.size() == 1) ? target.m() : Mat();
+        const bool indexed = descriptors.rows >= 2;
+
+        FlannBasedMatcher flannMatcher(descriptors.type() == CV_8UC1 ? Ptr<flann::IndexParams>(new flann::LshIndexParams(12, 20, 2))
+                                                                     : Ptr<flann::IndexParams>(new flann::KDTreeIndexParams()));
+        if (indexed) {
+            flannMatcher.add(std::vector<Mat>(1, descriptors));
+            flannMatcher.train();
+        }
+
+        for (int i=0; i<queries.size(); i++) {
+            const Template &query = queries[i];
+            float score;
+            if (target.isEmpty() || query.isEmpty()) {
+                score = -std::numeric_limits<float>::max();
+            } else if ((target.size() != 1) || (query.size() != 1) || (query.m().type() != descriptors.type())) {
+                score = Distance::compare(target, query);
+            } else if (!indexed || (query.m().rows < 2)) {
+                score = 0;
+            } else {
+                std::vector< std::vector<DMatch> > matches;
+                flannMatcher.knnMatch(query.m(), matches, 2);
+                score = similarity(ratioTest(matches));
+            }
+            output->setRelative(score, i, column);
+        }
+    }
 };
 
 BR_REGISTER(Distance, KeyPointMatcherDistance)
@@ -66,7 +66,7 @@ struct KDE
 
         if (score <= min) return bins.first();
         if (score >= max) return bins.last();
-        const float x = (score-min)/(max-min)*bins.size();
+        const float x = (score-min)/(max-min)*(bins.size()-1);
         const float y1 = bins[floor(x)];
         const float y2 = bins[ceil(x)];
         return y1 + (y2-y1)*(x-floor(x));
@@ -111,6 +111,8 @@ QDataStream &operator>>(QDataStream &stream, MP &nmp)
 /*!
  * \ingroup distances
  * \brief Match Probability
+ *
+ * The trained mapping is tabulated over the range of training scores and linearly interpolated, scores outside it are mapped exactly.
  * \author Josh Klontz \cite jklontz
  */
 class MatchProbabilityDistance : public Distance
@@ -122,6 +124,38 @@ class MatchProbabilityDistance : public Distance
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
 
     MP mp;
+    QVector<float> table; // mp sampled uniformly over [tableMin, tableMin + (table.size()-1)/tableScale]
+    float tableMin, tableScale;
+
+    void init()
+    {
+        tabulate();
+    }
+
+    void tabulate()
+    {
+        table.clear();
+        const float lo = std::min(mp.genuine.min, mp.impostor.min);
+        const float hi = std::max(mp.genuine.max, mp.impostor.max);
+        if (!(hi > lo))
+            return;
+
+        const int size = 4096;
+        table.resize(size);
+        for (int i=0; i<size; i++)
+            table[i] = mp(lo + (hi-lo)*i/(size-1), gaussian);
+        tableMin = lo;
+        tableScale = (size-1)/(hi-lo);
+    }
+
+    inline float probability(float score) const
+    {
+        const float x = (score - tableMin) * tableScale;
+        if (table.isEmpty() || !(x >= 0) || (x > table.size()-1))
+            return mp(score, gaussian);
+        const int i = std::min(int(x), table.size()-2);
+        return table[i] + (table[i+1]-table[i])*(x-i);
+    }
 
     void train(const TemplateList &src)
     {
@@ -145,6 +179,7 @@ class MatchProbabilityDistance : public Distance
         }
 
         mp = MP(genuineScores, impostorScores, !gaussian);
+        tabulate();
     }
 
     float compare(const Template &target, const Template &query) const
@@ -166,7 +201,31 @@ class MatchProbabilityDistance : public Distance
     {
         if (score == -std::numeric_limits<float>::max()) return score;
         if (!Globals->scoreNormalization) return -log(score+1);
-        return mp(score, gaussian);
+        return probability(score);
+    }
+
+    // Scores a row of targets at once, so the wrapped distance can batch them and the mapping is one pass over the row
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        bool emptyTarget = false;
+        foreach (const Template &t, target)
+            emptyTarget = emptyTarget || t.isEmpty();
+
+        for (int i=0; i<query.size(); i++) {
+            QList<float> scores;
+            if (query[i].isEmpty() || emptyTarget) {
+                // Empty templates are never passed to the wrapped distance
+                for (int j=0; j<target.size(); j++)
+                    scores.append((target[j].isEmpty() || query[i].isEmpty()) ? -std::numeric_limits<float>::max() : distance->compare(target[j], query[i]));
+            } else {
+                scores = distance->compare(target, query[i]);
+            }
+
+            for (int j=0; j<scores.size(); j++)
+                scores[j] = normalize(scores[j]);
+            for (int j=0; j<scores.size(); j++)
+                output->setRelative(scores[j], i+queryOffset, j+targetOffset);
+        }
     }
 
     void store(QDataStream &stream) const
@@ -179,6 +238,7 @@ class MatchProbabilityDistance : public Distance
     {
         distance->load(stream);
         stream >> mp;
+        tabulate();
     }
 
 protected:
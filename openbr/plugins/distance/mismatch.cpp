@@ -0,0 +1,44 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Fast Hamming distance between strings of byte symbols, for templates from KernelHash.
+ *
+ * Counts the bytes that differ, see br::HammingDistance for bit strings.
+ * \author Unknown \cite unknown
+ */
+class MismatchDistance : public BoundedDistance
+{
+    Q_OBJECT
+
+    float boundedCompare(const cv::Mat &a, const cv::Mat &b, float upper) const
+    {
+        return mismatches(a.data, b.data, a.rows * a.cols * a.elemSize(), upper);
+    }
+};
+
+BR_REGISTER(Distance, MismatchDistance)
+
+} // namespace br
+
+#include "distance/mismatch.moc"
@@ -0,0 +1,277 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QMutex>
+#include <QtConcurrent>
+#include <algorithm>
+#include <math.h>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Multi-index hashing search over binary codes, such as those from QuantizePack with bits=1.
+ *
+ * Scores are the negated Hamming distance, so nearer codes score higher.
+ * Each code is split into substrings with a hash table per substring.
+ * A code within Hamming distance r of the query has a substring within r/substrings of the query's,
+ * so radius and nearest neighbor searches only verify codes found by probing the tables near the query's substrings.
+ * Targets not found score -FLT_MAX, and are skipped altogether for outputs that discard such scores, like br::topKOutput.
+ * The indices of the last few target galleries compared are kept for later searches of the same galleries,
+ * such as the partitions of a cross validated gallery.
+ * Described in Norouzi et al. "Fast Exact Search in Hamming Space with Multi-Index Hashing", PAMI 2014.
+ * \author Unknown \cite unknown
+ * \br_property int radius Targets farther than this from the query aren't found, -1 for no limit.
+ * \br_property int k Find the k nearest targets to each query, 0 to find every target within radius.
+ * \br_property int substrings Number of substrings codes are split into, 0 for about bits/log2(targets).
+ */
+class MultiIndexHashDistance : public UntrainableDistance
+{
+    Q_OBJECT
+    Q_PROPERTY(int radius READ get_radius WRITE set_radius RESET reset_radius STORED false)
+    Q_PROPERTY(int k READ get_k WRITE set_k RESET reset_k STORED false)
+    Q_PROPERTY(int substrings READ get_substrings WRITE set_substrings RESET reset_substrings STORED false)
+    BR_PROPERTY(int, radius, -1)
+    BR_PROPERTY(int, k, 0)
+    BR_PROPERTY(int, substrings, 0)
+
+    typedef QPair<int,int> Neighbor; // QPair<Hamming distance,target index>
+
+    struct Index
+    {
+        TemplateList targets; // Keeps the codes alive, and identifies the gallery
+        QList<const uchar*> codes;
+        int bytes, valid, substrings, substringBits; // valid is the number of non-NULL codes
+        QVector< QHash<quint32, QVector<int> > > tables;
+
+        quint32 substring(const uchar *code, int s) const
+        {
+            const int begin = s * substringBits, end = std::min(begin + substringBits, bytes * 8);
+            quint32 value = 0;
+            for (int bit=begin; bit<end; bit++)
+                if ((code[bit >> 3] >> (bit & 7)) & 1)
+                    value |= quint32(1) << (bit - begin);
+            return value;
+        }
+
+        int length(int s) const
+        {
+            return std::min(substringBits, bytes * 8 - s * substringBits);
+        }
+    };
+
+    static const int MaxIndices = 16;
+
+    mutable QMutex indexLock;
+    mutable QList< QSharedPointer<Index> > indices; // Most recently used first
+
+    float compare(const cv::Mat &a, const cv::Mat &b) const
+    {
+        const float distance = hamming(a.data, b.data, a.rows * a.cols * a.elemSize());
+        if ((radius >= 0) && (distance > radius))
+            return -std::numeric_limits<float>::max();
+        return -distance;
+    }
+
+    static const uchar *data(const Template &t)
+    {
+        return t.isEmpty() ? NULL : t.first().data;
+    }
+
+    static int bytes(const Template &t)
+    {
+        return (t.size() == 1) ? int(t.first().total() * t.first().elemSize()) : 0;
+    }
+
+    static bool sameGallery(const TemplateList &a, const TemplateList &b)
+    {
+        if (a.size() != b.size())
+            return false;
+        // The index holds references to its codes, so matching buffers can't belong to another gallery
+        const int step = std::max(1, a.size() / 16);
+        for (int i=0; i<a.size(); i+=step)
+            if (data(a[i]) != data(b[i]))
+                return false;
+        return data(a.last()) == data(b.last());
+    }
+
+    QSharedPointer<Index> getIndex(const TemplateList &targets) const
+    {
+        QMutexLocker locker(&indexLock);
+        for (int i=0; i<indices.size(); i++)
+            if (sameGallery(indices[i]->targets, targets)) {
+                indices.move(i, 0);
+                return indices.first();
+            }
+
+        QSharedPointer<Index> built(new Index());
+        built->targets = targets;
+        built->bytes = 0;
+        foreach (const Template &target, targets)
+            built->bytes = std::max(built->bytes, bytes(target));
+        built->valid = 0;
+        foreach (const Template &target, targets) {
+            const bool valid = (built->bytes > 0) && (bytes(target) == built->bytes);
+            built->codes.append(valid ? data(target) : NULL);
+            built->valid += valid;
+        }
+        if (built->valid == 0)
+            qFatal("MultiIndexHash expected single matrix templates.");
+
+        const int bits = built->bytes * 8;
+        int m = substrings;
+        if (m <= 0)
+            m = qRound(bits / std::max(1.0, log(double(targets.size())) / log(2.0)));
+        m = std::min(bits, std::max(m, (bits + 31) / 32)); // Substrings fit in 32 bits
+        built->substrings = m;
+        built->substringBits = (bits + m - 1) / m;
+        built->substrings = (bits + built->substringBits - 1) / built->substringBits;
+
+        built->tables.resize(built->substrings);
+        for (int j=0; j<built->codes.size(); j++)
+            if (built->codes[j])
+                for (int s=0; s<built->substrings; s++)
+                    built->tables[s][built->substring(built->codes[j], s)].append(j);
+
+        indices.prepend(built);
+        while (indices.size() > MaxIndices)
+            indices.removeLast();
+        return built;
+    }
+
+    // Appends the targets whose substring s is exactly r bits from value, that haven't been seen
+    static void probe(const Index &index, int s, quint32 value, int r, const uchar *query, QSet<int> &seen, QList<Neighbor> &found)
+    {
+        const int length = index.length(s);
+        if (r > length)
+            return;
+
+        // Enumerate the masks of r bits out of length in increasing order
+        quint32 mask = (r == 0) ? 0 : (r == 32) ? ~quint32(0) : (quint32(1) << r) - 1;
+        while (true) {
+            QHash<quint32, QVector<int> >::const_iterator bucket = index.tables[s].constFind(value ^ mask);
+            if (bucket != index.tables[s].constEnd())
+                foreach (int j, bucket.value())
+                    if (!seen.contains(j)) {
+                        seen.insert(j);
+                        found.append(Neighbor(int(hamming(query, index.codes[j], index.bytes)), j));
+                    }
+
+            if (mask == 0)
+                break;
+            const quint32 lowest = mask & (~mask + 1), ripple = mask + lowest;
+            if (ripple < mask) // Past 32 bits
+                break;
+            mask = (((ripple ^ mask) >> 2) / lowest) | ripple;
+            if ((length < 32) && (mask >> length))
+                break;
+        }
+    }
+
+    QList<Neighbor> search(const Index &index, const uchar *query) const
+    {
+        QList<quint32> values;
+        for (int s=0; s<index.substrings; s++)
+            values.append(index.substring(query, s));
+
+        QSet<int> seen;
+        QList<Neighbor> found;
+        for (int r=0; r<=index.substringBits; r++) {
+            // Codes within radius must match a substring within radius/substrings
+            if ((radius >= 0) && (r > radius / index.substrings))
+                break;
+            for (int s=0; s<index.substrings; s++)
+                probe(index, s, values[s], r, query, seen, found);
+            if (seen.size() == index.valid)
+                break;
+
+            // Every code within substrings*(r+1)-1 has now been found
+            if (k > 0) {
+                const int complete = index.substrings * (r+1) - 1;
+                int within = 0;
+                foreach (const Neighbor &neighbor, found)
+                    if (neighbor.first <= complete)
+                        within++;
+                if (within >= k)
+                    break;
+            }
+        }
+
+        QList<Neighbor> neighbors;
+        foreach (const Neighbor &neighbor, found)
+            if ((radius < 0) || (neighbor.first <= radius))
+                neighbors.append(neighbor);
+        std::sort(neighbors.begin(), neighbors.end());
+        if ((k > 0) && (neighbors.size() > k))
+            neighbors = neighbors.mid(0, k);
+        return neighbors;
+    }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        if (target.isEmpty() || query.isEmpty())
+            return;
+        if ((radius < 0) && (k <= 0)) {
+            Distance::compare(target, query, output);
+            return;
+        }
+
+        Context::addMetric("br_comparisons_total", double(target.size()) * query.size());
+        const QSharedPointer<Index> targetIndex = getIndex(target);
+
+        QAtomicInt next(0);
+        const int workers = std::max(1, threadParallelism());
+        QFutureSynchronizer<void> futures;
+        for (int i=1; i<workers; i++)
+            futures.addFuture(QtConcurrent::run(runQueries, this, targetIndex.data(), &query, output, &next));
+        runQueries(this, targetIndex.data(), &query, output, &next);
+        futures.waitForFinished();
+    }
+
+    static void runQueries(const MultiIndexHashDistance *distance, const Index *index, const TemplateList *query, Output *output, QAtomicInt *next)
+    {
+        int i;
+        while ((i = next->fetchAndAddRelaxed(1)) < query->size())
+            distance->searchQuery(*index, (*query)[i], output, i);
+    }
+
+    void searchQuery(const Index &index, const Template &query, Output *output, int row) const
+    {
+        const QList<Neighbor> neighbors = (bytes(query) == index.bytes) ? search(index, data(query)) : QList<Neighbor>();
+
+        // Outputs that keep every score get -FLT_MAX for the targets that weren't found
+        if (output->boundRelative(row, 0) == -std::numeric_limits<float>::max()) {
+            QVector<float> scores(index.codes.size(), -std::numeric_limits<float>::max());
+            foreach (const Neighbor &neighbor, neighbors)
+                scores[neighbor.second] = -neighbor.first;
+            for (int j=0; j<scores.size(); j++)
+                output->setRelative(scores[j], row, j);
+        } else {
+            foreach (const Neighbor &neighbor, neighbors)
+                output->setRelative(-neighbor.first, row, neighbor.second);
+        }
+    }
+};
+
+BR_REGISTER(Distance, MultiIndexHashDistance)
+
+} // namespace br
+
+#include "distance/multiindexhash.moc"
@@ -45,6 +45,12 @@ class NegativeLogPlusOneDistance : public Distance
         return -log(distance->compare(a,b)+1);
     }
 
+    float compare(const Template &a, const Template &b, float lower, float upper) const
+    {
+        // Decreasing, so a score below lower is a distance above exp(-lower)-1
+        return -log(distance->compare(a, b, exp(-upper)-1, exp(-lower)-1)+1);
+    }
+
     void store(QDataStream &stream) const
     {
         distance->store(stream);
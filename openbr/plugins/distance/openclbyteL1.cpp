@@ -0,0 +1,253 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+
+namespace br
+{
+
+static const char *OpenCLByteL1Source =
+    "__kernel void byteL1(__global const uchar *targets, __global const uchar *queries, __global float *scores,\n"
+    "                     const int bytes, const int stride, const int numTargets)\n"
+    "{\n"
+    "    const int t = get_global_id(0);\n"
+    "    const int q = get_global_id(1);\n"
+    "    if (t >= numTargets) return;\n"
+    "    __global const uchar *a = targets + (size_t)t*stride;\n"
+    "    __global const uchar *b = queries + (size_t)q*stride;\n"
+    "    uint sum = 0;\n"
+    "    for (int i=0; i<bytes; i++)\n"
+    "        sum += abs_diff(a[i], b[i]);\n"
+    "    scores[(size_t)q*numTargets + t] = sum;\n"
+    "}\n";
+
+/*!
+ * \ingroup distances
+ * \brief ByteL1 distance computed on an OpenCL device.
+ *
+ * The targets are uploaded once and kept on the device, queries are streamed in blocks and their scores read back.
+ * Falls back to the CPU implementation when no device is available or templates are not uniformly sized 8-bit matrices.
+ * \br_property int queryBlock The number of queries compared per kernel launch.
+ * \author Unknown \cite unknown
+ */
+class OpenCLByteL1Distance : public UntrainableDistance
+{
+    Q_OBJECT
+    Q_PROPERTY(int queryBlock READ get_queryBlock WRITE set_queryBlock RESET reset_queryBlock STORED false)
+    BR_PROPERTY(int, queryBlock, 256)
+
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    bool available;
+
+    // Device copy of the most recently compared targets, identified by their first template's data
+    mutable QMutex mutex;
+    mutable cl_mem targetBuffer;
+    mutable const uchar *targetData;
+    mutable int targetCount;
+
+public:
+    OpenCLByteL1Distance() : context(NULL), queue(NULL), program(NULL), kernel(NULL), available(false), targetBuffer(NULL), targetData(NULL), targetCount(0) {}
+
+    ~OpenCLByteL1Distance()
+    {
+        release();
+    }
+
+private:
+    void init()
+    {
+        release();
+        available = false;
+
+        cl_platform_id platform;
+        cl_uint platforms = 0;
+        if ((clGetPlatformIDs(1, &platform, &platforms) != CL_SUCCESS) || (platforms == 0)) {
+            qWarning("OpenCLByteL1: no OpenCL platform, using the CPU.");
+            return;
+        }
+
+        cl_device_id device;
+        if ((clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL) != CL_SUCCESS) &&
+            (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL) != CL_SUCCESS)) {
+            qWarning("OpenCLByteL1: no OpenCL device, using the CPU.");
+            return;
+        }
+
+        cl_int error;
+        context = clCreateContext(NULL, 1, &device, NULL, NULL, &error);
+        if (error == CL_SUCCESS) queue = clCreateCommandQueue(context, device, 0, &error);
+        if (error == CL_SUCCESS) program = clCreateProgramWithSource(context, 1, &OpenCLByteL1Source, NULL, &error);
+        if (error == CL_SUCCESS) error = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+        if (error == CL_SUCCESS) kernel = clCreateKernel(program, "byteL1", &error);
+        if (error != CL_SUCCESS) {
+            qWarning("OpenCLByteL1: failed to initialize the device (error %d), using the CPU.", error);
+            release();
+            return;
+        }
+        available = true;
+    }
+
+    void release()
+    {
+        if (targetBuffer) clReleaseMemObject(targetBuffer);
+        if (kernel) clReleaseKernel(kernel);
+        if (program) clReleaseProgram(program);
+        if (queue) clReleaseCommandQueue(queue);
+        if (context) clReleaseContext(context);
+        targetBuffer = NULL; kernel = NULL; program = NULL; queue = NULL; context = NULL;
+        targetData = NULL; targetCount = 0;
+    }
+
+    // Row stride of templates whose matrices are evenly spaced in memory, as left by packTemplates, or 0
+    static size_t uniformStride(const TemplateList &templates, size_t bytes)
+    {
+        if (templates.isEmpty()) return 0;
+        const size_t stride = (templates.size() > 1) ? size_t(templates[1].m().data - templates[0].m().data) : bytes;
+        if (stride < bytes) return 0;
+        for (int i=0; i<templates.size(); i++) {
+            const Template &t = templates[i];
+            if ((t.size() != 1) || (t.m().depth() != CV_8U) || !t.m().isContinuous() || (t.bytes() != bytes) ||
+                (t.m().data != templates[0].m().data + i*stride))
+                return 0;
+        }
+        return stride;
+    }
+
+    // Called with the mutex held
+    bool uploadTargets(const TemplateList &targets, size_t stride) const
+    {
+        if ((targetData == targets.first().m().data) && (targetCount == targets.size()))
+            return true;
+
+        if (targetBuffer) clReleaseMemObject(targetBuffer);
+        cl_int error;
+        targetBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, stride * targets.size(), targets.first().m().data, &error);
+        if (error != CL_SUCCESS) {
+            targetBuffer = NULL;
+            targetData = NULL;
+            return false;
+        }
+        targetData = targets.first().m().data;
+        targetCount = targets.size();
+        return true;
+    }
+
+    // Scores queries against the resident targets, called with the mutex held
+    bool compareOnDevice(const uchar *queries, int numQueries, int bytes, int stride, float *scores) const
+    {
+        cl_int error;
+        cl_mem queryBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size_t(stride) * numQueries, const_cast<uchar*>(queries), &error);
+        if (error != CL_SUCCESS) return false;
+        cl_mem scoreBuffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * targetCount * numQueries, NULL, &error);
+        if (error != CL_SUCCESS) { clReleaseMemObject(queryBuffer); return false; }
+
+        clSetKernelArg(kernel, 0, sizeof(cl_mem), &targetBuffer);
+        clSetKernelArg(kernel, 1, sizeof(cl_mem), &queryBuffer);
+        clSetKernelArg(kernel, 2, sizeof(cl_mem), &scoreBuffer);
+        clSetKernelArg(kernel, 3, sizeof(int), &bytes);
+        clSetKernelArg(kernel, 4, sizeof(int), &stride);
+        clSetKernelArg(kernel, 5, sizeof(int), &targetCount);
+
+        const size_t global[2] = { size_t(targetCount), size_t(numQueries) };
+        error = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global, NULL, 0, NULL, NULL);
+        if (error == CL_SUCCESS)
+            error = clEnqueueReadBuffer(queue, scoreBuffer, CL_TRUE, 0, sizeof(float) * targetCount * numQueries, scores, 0, NULL, NULL);
+
+        clReleaseMemObject(scoreBuffer);
+        clReleaseMemObject(queryBuffer);
+        return error == CL_SUCCESS;
+    }
+
+    float compare(const unsigned char *a, const unsigned char *b, size_t size) const
+    {
+        return l1(a, b, size);
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        const size_t stride = available ? uniformStride(targets, query.bytes()) : 0;
+        if (!stride || (query.size() != 1) || !query.m().isContinuous())
+            return Distance::compare(targets, query);
+
+        // Queries are read with the target stride, so copy this one into a padded buffer
+        QByteArray padded(stride, 0);
+        memcpy(padded.data(), query.m().data, query.bytes());
+
+        QVector<float> scores(targets.size());
+        QMutexLocker locker(&mutex);
+        if (!uploadTargets(targets, stride) || !compareOnDevice((const uchar*) padded.data(), 1, query.bytes(), stride, scores.data()))
+            return Distance::compare(targets, query);
+        return scores.toList();
+    }
+
+    void compare(const TemplateList &target, const TemplateList &query, Output *output) const
+    {
+        if (!available || target.isEmpty() || query.isEmpty()) {
+            Distance::compare(target, query, output);
+            return;
+        }
+
+        const size_t bytes = target.first().bytes();
+        const size_t stride = uniformStride(target, bytes);
+        bool uniformQueries = true;
+        foreach (const Template &t, query)
+            uniformQueries = uniformQueries && (t.size() == 1) && (t.m().depth() == CV_8U) && t.m().isContinuous() && (t.bytes() == bytes);
+        if (!stride || !uniformQueries) {
+            Distance::compare(target, query, output);
+            return;
+        }
+
+        QMutexLocker locker(&mutex);
+        if (!uploadTargets(target, stride)) {
+            locker.unlock();
+            Distance::compare(target, query, output);
+            return;
+        }
+
+        // Query blocks are copied with the target stride and streamed to the device
+        QByteArray queries(stride * queryBlock, 0);
+        QVector<float> scores(target.size() * queryBlock);
+        for (int i=0; i<query.size(); i+=queryBlock) {
+            const int numQueries = std::min(queryBlock, query.size() - i);
+            for (int q=0; q<numQueries; q++)
+                memcpy(queries.data() + q*stride, query[i+q].m().data, bytes);
+
+            if (!compareOnDevice((const uchar*) queries.data(), numQueries, bytes, stride, scores.data()))
+                qFatal("OpenCLByteL1: kernel failed.");
+
+            for (int q=0; q<numQueries; q++)
+                for (int t=0; t<target.size(); t++)
+                    output->setRelative(scores[q*target.size() + t], i+q, t);
+        }
+    }
+};
+
+BR_REGISTER(Distance, OpenCLByteL1Distance)
+
+} // namespace br
+
+#include "distance/openclbyteL1.moc"
@@ -0,0 +1,42 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Fast 2-bit L1 distance, for templates packed by QuantizePack with bits=2.
+ * \author Unknown \cite unknown
+ */
+class QuarterByteL1Distance : public BoundedDistance
+{
+    Q_OBJECT
+
+    float boundedCompare(const cv::Mat &a, const cv::Mat &b, float upper) const
+    {
+        return crumb_l1(a.data, b.data, a.rows * a.cols * a.elemSize(), upper);
+    }
+};
+
+BR_REGISTER(Distance, QuarterByteL1Distance)
+
+} // namespace br
+
+#include "distance/quarterbyteL1.moc"
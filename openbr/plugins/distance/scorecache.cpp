@@ -0,0 +1,338 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QMutex>
+#include <string.h>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup distances
+ * \brief Reuses scores of template pairs compared in earlier runs, from a file shared across runs.
+ *
+ * Scores are keyed by a hash of both templates' matrices and the wrapped distance's description.
+ * Only the matrices are hashed, so distances that compare metadata or depend on trained state not in their description shouldn't be cached.
+ * A Bloom filter in front of the cached scores makes misses cheap.
+ * New scores are appended to the file in large writes, so concurrent runs can share it.
+ * The hashes of the last few target galleries compared are kept for later queries against the same galleries.
+ * Used by br_compare when -scoreCache <file> is set.
+ * \author Unknown \cite unknown
+ * \br_property br::Distance* distance The distance whose scores are cached.
+ * \br_property QString cache File the scores are read from and appended to.
+ * \br_property int bloomBits Bloom filter bits per cached score. Default is 10, about a 1% false positive rate.
+ */
+class ScoreCacheDistance : public Distance
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
+    Q_PROPERTY(QString cache READ get_cache WRITE set_cache RESET reset_cache STORED false)
+    Q_PROPERTY(int bloomBits READ get_bloomBits WRITE set_bloomBits RESET reset_bloomBits STORED false)
+    BR_PROPERTY(br::Distance*, distance, NULL)
+    BR_PROPERTY(QString, cache, "")
+    BR_PROPERTY(int, bloomBits, 10)
+
+    typedef QPair<quint64,float> Entry;
+
+    struct Hashes
+    {
+        TemplateList targets; // Keeps the matrices alive, and identifies the gallery
+        QVector<quint64> hashes;
+    };
+
+    static const int FlushSize = 1 << 20;
+    static const int MaxGalleries = 16;
+
+    mutable QMutex lock; // Guards everything below, the cached scores and Bloom filter are read-only once loaded
+    mutable bool loaded;
+    mutable quint64 salt;
+    mutable QHash<quint64,float> scores;
+    mutable QVector<quint64> bloom;
+    mutable int probes;
+    mutable QVector<Entry> pending;
+    mutable QList< QSharedPointer<Hashes> > galleries; // Most recently used first
+    mutable qint64 hits, misses;
+
+    ~ScoreCacheDistance()
+    {
+        flush();
+        if (hits + misses > 0)
+            qDebug("%lld of %lld scores read from %s.", hits, hits + misses, qPrintable(cache));
+    }
+
+    void init()
+    {
+        QMutexLocker locker(&lock);
+        flush();
+        loaded = false;
+        scores.clear();
+        bloom.clear();
+        galleries.clear();
+        hits = misses = 0;
+    }
+
+    bool trainable()
+    {
+        return distance->trainable();
+    }
+
+    void train(const TemplateList &src)
+    {
+        distance->train(src);
+    }
+
+    float compare(const Template &a, const Template &b) const
+    {
+        return distance->compare(a, b);
+    }
+
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        return compare(targets, targetHashes(targets)->hashes, query);
+    }
+
+    // Tiles of the target gallery differ from call to call, so their hashes aren't kept
+    void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
+    {
+        QVector<quint64> hashes(target.size());
+        for (int j=0; j<target.size(); j++)
+            hashes[j] = hash(target[j]);
+
+        for (int i=0; i<query.size(); i++) {
+            const QList<float> row = compare(target, hashes, query[i]);
+            for (int j=0; j<row.size(); j++)
+                output->setRelative(row[j], i+queryOffset, j+targetOffset);
+        }
+    }
+
+    QList<float> compare(const TemplateList &targets, const QVector<quint64> &hashes, const Template &query) const
+    {
+        ensureLoaded();
+        const quint64 queryHash = hash(query);
+
+        QList<float> result;
+        QList<int> missed;
+        for (int j=0; j<targets.size(); j++) {
+            float score = 0;
+            if (query.isEmpty() || targets[j].isEmpty() || !lookup(key(hashes[j], queryHash), &score))
+                missed.append(j);
+            result.append(score);
+        }
+        if (missed.isEmpty()) {
+            count(targets.size(), 0);
+            return result;
+        }
+
+        TemplateList missedTargets;
+        if (missed.size() < targets.size())
+            foreach (int j, missed)
+                missedTargets.append(targets[j]);
+        const QList<float> computed = distance->compare(missedTargets.isEmpty() ? targets : missedTargets, query);
+
+        QVector<Entry> added;
+        for (int k=0; k<missed.size(); k++) {
+            const int j = missed[k];
+            result[j] = computed[k];
+            if (!query.isEmpty() && !targets[j].isEmpty())
+                added.append(Entry(key(hashes[j], queryHash), computed[k]));
+        }
+        record(added);
+        count(targets.size() - missed.size(), missed.size());
+        return result;
+    }
+
+    // MurmurHash3's finalizer
+    static quint64 mix(quint64 h)
+    {
+        h ^= h >> 33;
+        h *= Q_UINT64_C(0xff51afd7ed558ccd);
+        h ^= h >> 33;
+        h *= Q_UINT64_C(0xc4ceb9fe1a85ec53);
+        h ^= h >> 33;
+        return h;
+    }
+
+    static quint64 hash(const uchar *data, size_t size, quint64 seed)
+    {
+        // Independent lanes so the multiplies overlap
+        quint64 lanes[4] = { seed, seed + 1, seed + 2, seed + 3 };
+        size_t i = 0;
+        for (; i+32<=size; i+=32)
+            for (int l=0; l<4; l++) {
+                quint64 word;
+                memcpy(&word, data+i+8*l, sizeof(word));
+                lanes[l] = mix(lanes[l] ^ word);
+            }
+        for (; i<size; i++)
+            lanes[0] = mix(lanes[0] ^ data[i]);
+        return mix(lanes[0] ^ mix(lanes[1] ^ mix(lanes[2] ^ mix(lanes[3] ^ size))));
+    }
+
+    static quint64 hash(const Template &t)
+    {
+        quint64 h = mix(t.size());
+        foreach (const cv::Mat &m, t) {
+            h = mix(h ^ ((quint64(quint32(m.rows)) << 32) | quint32(m.cols)));
+            h = mix(h ^ quint64(m.type()));
+            if (m.isContinuous()) {
+                h = hash(m.data, m.total() * m.elemSize(), h);
+            } else {
+                for (int i=0; i<m.rows; i++)
+                    h = hash(m.ptr(i), m.cols * m.elemSize(), h);
+            }
+        }
+        return h;
+    }
+
+    quint64 key(quint64 target, quint64 query) const
+    {
+        return mix(salt ^ mix(target ^ mix(query)));
+    }
+
+    static bool sameGallery(const TemplateList &a, const TemplateList &b)
+    {
+        if (a.size() != b.size())
+            return false;
+        // Matching buffers can't belong to another gallery while ours holds references to them
+        for (int i=0; i<a.size(); i++)
+            if ((a[i].isEmpty() ? NULL : a[i].first().data) != (b[i].isEmpty() ? NULL : b[i].first().data))
+                return false;
+        return true;
+    }
+
+    QSharedPointer<Hashes> targetHashes(const TemplateList &targets) const
+    {
+        QMutexLocker locker(&lock);
+        for (int i=0; i<galleries.size(); i++)
+            if (sameGallery(galleries[i]->targets, targets)) {
+                galleries.move(i, 0);
+                return galleries.first();
+            }
+
+        QSharedPointer<Hashes> hashes(new Hashes());
+        hashes->targets = targets;
+        hashes->hashes.resize(targets.size());
+        for (int j=0; j<targets.size(); j++)
+            hashes->hashes[j] = hash(targets[j]);
+        galleries.prepend(hashes);
+        while (galleries.size() > MaxGalleries)
+            galleries.removeLast();
+        return hashes;
+    }
+
+    void ensureLoaded() const
+    {
+        QMutexLocker locker(&lock);
+        if (loaded)
+            return;
+        loaded = true;
+
+        if (!distance)
+            qFatal("ScoreCache requires a distance.");
+        // Keyed by the trained model as well as the description, so retraining invalidates the cached scores
+        QByteArray model = distance->description().toUtf8();
+        QDataStream modelStream(&model, QIODevice::WriteOnly | QIODevice::Append);
+        distance->store(modelStream);
+        salt = hash((const uchar*) model.constData(), model.size(), 0);
+
+        QFile file(cache);
+        if (!cache.isEmpty() && file.exists()) {
+            if (!file.open(QFile::ReadOnly))
+                qFatal("Unable to open %s for reading.", qPrintable(cache));
+            QDataStream stream(&file);
+            while (!stream.atEnd()) {
+                quint64 k;
+                float score;
+                stream >> k >> score;
+                scores.insert(k, score);
+            }
+        }
+
+        // Double hashing, with the number of probes minimizing false positives
+        const qint64 bits = std::max(qint64(64), qint64(std::max(bloomBits, 1)) * scores.size());
+        bloom.fill(0, int((bits + 63) / 64));
+        probes = std::max(1, qRound(std::max(bloomBits, 1) * 0.693));
+        for (QHash<quint64,float>::const_iterator i = scores.constBegin(); i != scores.constEnd(); ++i) {
+            const quint64 h1 = i.key(), h2 = mix(i.key()) | 1;
+            for (int p=0; p<probes; p++) {
+                const quint64 bit = (h1 + p*h2) % (quint64(bloom.size()) * 64);
+                bloom[int(bit / 64)] |= quint64(1) << (bit % 64);
+            }
+        }
+    }
+
+    bool lookup(quint64 k, float *score) const
+    {
+        if (scores.isEmpty())
+            return false;
+        const quint64 h1 = k, h2 = mix(k) | 1;
+        for (int p=0; p<probes; p++) {
+            const quint64 bit = (h1 + p*h2) % (quint64(bloom.size()) * 64);
+            if (!(bloom[int(bit / 64)] & (quint64(1) << (bit % 64))))
+                return false;
+        }
+        QHash<quint64,float>::const_iterator i = scores.constFind(k);
+        if (i == scores.constEnd())
+            return false;
+        *score = i.value();
+        return true;
+    }
+
+    void record(const QVector<Entry> &added) const
+    {
+        if (cache.isEmpty() || added.isEmpty())
+            return;
+        QMutexLocker locker(&lock);
+        pending += added;
+        if (pending.size() >= FlushSize)
+            flush();
+    }
+
+    void count(qint64 hit, qint64 miss) const
+    {
+        QMutexLocker locker(&lock);
+        hits += hit;
+        misses += miss;
+    }
+
+    // Callers hold the lock, or are the destructor
+    void flush() const
+    {
+        if (pending.isEmpty())
+            return;
+
+        QByteArray data;
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        foreach (const Entry &entry, pending)
+            stream << entry.first << entry.second;
+        pending.clear();
+
+        // One unbuffered append, so writes from concurrent runs don't interleave within an entry
+        QFile file(cache);
+        QtUtils::touchDir(file);
+        if (!file.open(QFile::Append | QFile::Unbuffered) || (file.write(data) != data.size()))
+            qFatal("Failed to append to %s.", qPrintable(cache));
+    }
+};
+
+BR_REGISTER(Distance, ScoreCacheDistance)
+
+} // namespace br
+
+#include "distance/scorecache.moc"
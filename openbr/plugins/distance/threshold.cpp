@@ -47,7 +47,13 @@ class ThresholdDistance : public Distance
 
     float compare(const Template &a, const Template &b) const
     {
-        float value = distance->compare(a,b);
+        // Scores beyond the thresholds are clamped anyway, so the wrapped distance needn't finish computing them
+        return compare(a, b, -std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+    }
+
+    float compare(const Template &a, const Template &b, float lower, float upper) const
+    {
+        float value = distance->compare(a, b, std::max(lower, min), std::min(upper, max));
         if (value < min) value = min;
         else if (value > max) value = max;
         return value;
@@ -79,10 +79,36 @@ class UnitDistance : public Distance
         return a * (distance->compare(target, query) - b);
     }
 
+    float compare(const Template &target, const Template &query, float lower, float upper) const
+    {
+        // Map the bounds onto the wrapped distance, swapping them if the normalization is decreasing
+        if (a == 0)
+            return compare(target, query);
+        if (a > 0) return a * (distance->compare(target, query, unnormalize(lower), unnormalize(upper)) - b);
+        else       return a * (distance->compare(target, query, unnormalize(upper), unnormalize(lower)) - b);
+    }
+
+    // Inverse of the normalization, unbounded limits stay unbounded
+    float unnormalize(float score) const
+    {
+        if (std::abs(score) == std::numeric_limits<float>::max())
+            return ((score > 0) == (a > 0)) ? std::numeric_limits<float>::max() : -std::numeric_limits<float>::max();
+        return b + score / a;
+    }
+
     float compare(const cv::Mat &target, const cv::Mat &query) const
     {
         return a * (distance->compare(target, query) - b);
     }
+
+    // Forwarded so the wrapped distance can score a whole gallery at once
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        QList<float> scores = distance->compare(targets, query);
+        for (int i=0; i<scores.size(); i++)
+            scores[i] = a * (scores[i] - b);
+        return scores;
+    }
 };
 
 BR_REGISTER(Distance, UnitDistance)
@@ -14,59 +14,139 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QMutex>
+
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
 
 namespace br
 {
 
+/*!
+ * \brief Accumulates the moments of the distinct pairs of a self-similarity matrix as they are scored.
+ *
+ * Safe to call concurrently from multiple compareBlock threads, rows share one of NumStripes accumulators.
+ */
+class MomentsOutput : public Output
+{
+public:
+    QList<QString> modalities; // Pairs of the same modality are skipped, if set
+
+    Common::Moments moments() const
+    {
+        Common::Moments result;
+        for (int i=0; i<NumStripes; i++)
+            result.merge(stripes[i]);
+        return result;
+    }
+
+private:
+    static const int NumStripes = 64;
+    Common::Moments stripes[NumStripes];
+    QMutex locks[NumStripes];
+
+    void set(float value, int i, int j)
+    {
+        if ((j >= i) || (value == -std::numeric_limits<float>::max())) return;
+        if (!modalities.isEmpty() && (modalities[i] == modalities[j])) return;
+
+        QMutexLocker locker(&locks[i % NumStripes]);
+        stripes[i % NumStripes].add(value);
+    }
+};
+
 /*!
  * \brief Performs zscore normalization on distances at test time by learning mean
  *        and standard deviation parameters during training.
+ *
+ * The statistics are accumulated as pairs are scored, so training doesn't keep the scores or the similarity matrix.
  * \author Scott Klum \cite sklum
+ * \br_property br::Distance* distance The distance to normalize.
+ * \br_property bool crossModality Only learn from pairs of templates with different MODALITY.
+ * \br_property int pairs Approximate number of pairs to learn from, sampled by training on a random subset of the templates. 0 to use every pair.
  */
 class ZScoreDistance : public Distance
 {
     Q_OBJECT
     Q_PROPERTY(br::Distance* distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
     Q_PROPERTY(bool crossModality READ get_crossModality WRITE set_crossModality RESET reset_crossModality STORED false)
+    Q_PROPERTY(int pairs READ get_pairs WRITE set_pairs RESET reset_pairs STORED false)
     BR_PROPERTY(br::Distance*, distance, make("Dist(L2)"))
     BR_PROPERTY(bool, crossModality, false)
+    BR_PROPERTY(int, pairs, 0)
 
     float min, max;
     double mean, stddev;
+    float scale, offset, minScore, maxScore; // (score - mean) / stddev as score * scale + offset
 
     void train(const TemplateList &src)
     {
         distance->train(src);
 
-        QScopedPointer<MatrixOutput> matrixOutput(MatrixOutput::make(FileList(src.size()), FileList(src.size())));
-        distance->compare(src, src, matrixOutput.data());
-
-        QList<float> scores;
-        scores.reserve(src.size()*src.size());
-        for (int i=0; i<src.size(); i++) {
-            for (int j=0; j<i; j++) {
-                const float score = matrixOutput.data()->data.at<float>(i, j);
-                if (score == -std::numeric_limits<float>::max()) continue;
-                if (crossModality && src[i].file.get<QString>("MODALITY") == src[j].file.get<QString>("MODALITY")) continue;
-                scores.append(score);
-            }
+        TemplateList samples = src;
+        if ((pairs > 0) && ((qint64(src.size()) * (src.size() - 1) / 2) > pairs)) {
+            const int n = std::max(2, int(ceil((1 + sqrt(1 + 8.0 * pairs)) / 2)));
+            samples.clear();
+            foreach (int index, Common::RandSample(n, src.size(), 0, true))
+                samples.append(src[index]);
         }
 
-        Common::MinMax(scores, &min, &max);
-        Common::MeanStdDev(scores, &mean, &stddev);
+        MomentsOutput output;
+        output.initialize(samples.files(), samples.files());
+        if (crossModality)
+            foreach (const Template &sample, samples)
+                output.modalities.append(sample.file.get<QString>("MODALITY"));
+        distance->compare(samples, samples, &output);
+
+        const Common::Moments moments = output.moments();
+        min = moments.min;
+        max = moments.max;
+        mean = moments.mean;
+        stddev = moments.stddev();
 
         if (stddev == 0) qFatal("Stddev is 0.");
+        setNormalization();
+    }
+
+    void setNormalization()
+    {
+        scale = 1 / stddev;
+        offset = -mean / stddev;
+        minScore = (min - mean) / stddev;
+        maxScore = (max - mean) / stddev;
+    }
+
+    inline float normalize(float score) const
+    {
+        if      (score == -std::numeric_limits<float>::max()) return minScore;
+        else if (score ==  std::numeric_limits<float>::max()) return maxScore;
+        else                                                  return score * scale + offset;
     }
 
     float compare(const Template &target, const Template &query) const
     {
-        float score = distance->compare(target,query);
-        if      (score == -std::numeric_limits<float>::max()) score = (min - mean) / stddev;
-        else if (score ==  std::numeric_limits<float>::max()) score = (max - mean) / stddev;
-        else                                                  score = (score - mean) / stddev;
-        return score;
+        return normalize(distance->compare(target, query));
+    }
+
+    // Forwarded so the wrapped distance can score a whole gallery at once, the normalization is then one pass over the scores
+    QList<float> compare(const TemplateList &targets, const Template &query) const
+    {
+        QList<float> scores = distance->compare(targets, query);
+        for (int i=0; i<scores.size(); i++)
+            scores[i] = normalize(scores[i]);
+        return scores;
+    }
+
+    float compare(const Template &target, const Template &query, float lower, float upper) const
+    {
+        return normalize(distance->compare(target, query, unnormalize(lower), unnormalize(upper)));
+    }
+
+    // Inverse of the normalization, unbounded limits stay unbounded
+    float unnormalize(float score) const
+    {
+        if (std::abs(score) == std::numeric_limits<float>::max()) return score;
+        return score * stddev + mean;
     }
 
     void store(QDataStream &stream) const
@@ -79,6 +159,7 @@ class ZScoreDistance : public Distance
     {
         distance->load(stream);
         stream >> min >> max >> mean >> stddev;
+        setNormalization();
     }
 };
 
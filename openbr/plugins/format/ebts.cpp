@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrent>
 #include <QtEndian>
 #include <opencv2/highgui/highgui.hpp>
 
@@ -28,135 +30,129 @@ namespace br
 /*!
  * \ingroup formats
  * \brief Reads FBI EBTS transactions.
+ *
+ * The transaction is memory mapped and its logical records indexed by type,
+ * fields are parsed as views into the mapping and only the image records of the requested types are decoded.
+ * \br_property QList<int> types Record types whose images are read, in order of preference. Default is Type-10 (face).
+ * \br_property bool all Decode the image of every record of the requested types in parallel, one matrix each, rather than only the first.
  * \author Scott Klum \cite sklum
  * \br_link https://www.fbibiospecs.org/ebts.html
  */
 class ebtsFormat : public Format
 {
     Q_OBJECT
-
-    struct Field {
-        int type;
-        QList<QByteArray> data;
-    };
+    Q_PROPERTY(QList<int> types READ get_types WRITE set_types RESET reset_types STORED false)
+    Q_PROPERTY(bool all READ get_all WRITE set_all RESET reset_all STORED false)
+    BR_PROPERTY(QList<int>, types, QList<int>() << 10)
+    BR_PROPERTY(bool, all, false)
 
     struct Record {
         int type;
-        quint32 bytes;
-        int position; // Starting position of record
-
-        QHash<int,QList<QByteArray> > fields;
+        qint64 position; // Starting position of record
+        qint64 bytes;
     };
 
-    quint32 recordBytes(const QByteArray &byteArray, const float recordType, int from) const
+    static const char GroupSeparator = 0x1D;
+    static const char RecordSeparator = 0x1E;
+    static const char UnitSeparator = 0x1F;
+
+    // Length of the record, from its first four bytes for binary records or its first field otherwise, -1 if malformed
+    static qint64 recordBytes(const char *data, qint64 size, int recordType, qint64 from)
     {
+        if ((from < 0) || (from >= size))
+            return -1;
+        if (recordType == 4 || recordType == 7)
+            return (from + 4 <= size) ? qint64(qFromBigEndian<quint32>((const uchar*)data + from)) : -1;
+
+        const char *begin = data + from;
+        const char *separator = (const char*) memchr(begin, GroupSeparator, size - from);
+        const char *colon = (const char*) memchr(begin, ':', (separator ? separator : data + size) - begin);
+        if (!colon || !separator)
+            return -1;
         bool ok;
-        quint32 size;
-
-        if (recordType == 4 || recordType == 7) {
-            // read first four bytes
-            ok = true;
-            size = qFromBigEndian<quint32>((const uchar*)byteArray.mid(from,4).constData());
-        } else {
-            int index = byteArray.indexOf(QChar(0x1D), from);
-            size = byteArray.mid(from, index-from).split(':').last().toInt(&ok);
-        }
-
-        return ok ? size : -1;
+        const qint64 bytes = QByteArray::fromRawData(colon + 1, separator - colon - 1).toLongLong(&ok);
+        return (ok && (bytes > 0) && (from + bytes <= size)) ? bytes : -1;
     }
 
-    void parseRecord(const QByteArray &byteArray, Record &record) const
+    // Fields of a tagged record keyed by field number, as views into the transaction.
+    // The image data field (999) is always last and runs to the end of the record.
+    static QHash<int,QByteArray> parseFields(const char *data, const Record &record)
     {
-        if (record.type == 4 || record.type == 7) {
-            // Just a binary blob
-            // Read everything after the first four bytes
-            // Not current supported
-        } else {
-            // Continue reading fields until we get all the data
-            unsigned int position = record.position;
-            while (position < record.position + record.bytes) {
-                int index = byteArray.indexOf(QChar(0x1D), position);
-                Field field = parseField(byteArray.mid(position, index-position),QChar(0x1F));
-                if (field.type == 999 ) {
-                    // Data begin after the field identifier and the colon
-                    int dataBegin = byteArray.indexOf(':', position)+1;
-                    field.data.clear();
-                    field.data.append(byteArray.mid(dataBegin, record.bytes-(dataBegin-record.position)));
-
-                    // Data fields are always last in the record
-                    record.fields.insert(field.type,field.data);
-                    break;
-                }
-                // Advance the position accounting for the separator
-                position += index-position+1;
-                record.fields.insert(field.type,field.data);
+        QHash<int,QByteArray> fields;
+        const char *position = data + record.position;
+        const char *end = data + record.position + record.bytes;
+        while (position < end) {
+            const char *colon = (const char*) memchr(position, ':', end - position);
+            if (!colon) break;
+            const char *dot = (const char*) memchr(position, '.', colon - position);
+            const int type = QByteArray::fromRawData(dot ? dot + 1 : position, colon - (dot ? dot + 1 : position)).toInt();
+            if (type == 999) {
+                fields.insert(type, QByteArray::fromRawData(colon + 1, end - colon - 1));
+                break;
             }
+
+            const char *separator = (const char*) memchr(colon, GroupSeparator, end - colon);
+            if (!separator) separator = end;
+            fields.insert(type, QByteArray::fromRawData(colon + 1, separator - colon - 1));
+            position = separator + 1;
         }
+        return fields;
     }
 
-    Field parseField(const QByteArray &byteArray, const QChar &sep) const
+    static void decode(const QByteArray *image, Mat *m)
     {
-        bool ok;
-        Field f;
-
-        QList<QByteArray> data = byteArray.split(':');
-
-        f.type = data.first().split('.').last().toInt(&ok);
-        f.data = data.last().split(sep.toLatin1());
-
-        return f;
+        *m = imdecode(Mat(1, image->size(), CV_8UC1, (void*) image->constData()), CV_LOAD_IMAGE_COLOR);
     }
 
     Template read() const
     {
-        QByteArray byteArray;
-        QtUtils::readFile(file, byteArray);
+        // Mapped rather than read, so image data is decoded straight out of the file
+        QFile input(file);
+        if (!input.open(QFile::ReadOnly))
+            qFatal("Unable to open %s for reading.", qPrintable(file.name));
+        QByteArray buffer;
+        const char *data = (const char*) input.map(0, input.size());
+        qint64 size = input.size();
+        if (!data) {
+            buffer = input.readAll();
+            data = buffer.constData();
+            size = buffer.size();
+        }
 
         Template t;
 
-        Mat m;
-
-        QList<Record> records;
-
         // Read the type one record (every EBTS file will have one of these)
         Record r1;
         r1.type = 1;
         r1.position = 0;
-        r1.bytes = recordBytes(byteArray,r1.type,r1.position);
-
-        // The fields in a type 1 record are strictly defined
-        QList<QByteArray> data = byteArray.mid(r1.position,r1.bytes).split(QChar(0x1D).toLatin1());
-        foreach (const QByteArray &datum, data) {
-            Field f = parseField(datum,QChar(0x1F));
-            r1.fields.insert(f.type,f.data);
+        r1.bytes = recordBytes(data, size, r1.type, r1.position);
+        if (r1.bytes < 0) {
+            qWarning("ebtsFormat::read malformed transaction %s.", qPrintable(file.name));
+            return t;
         }
-
-        records.append(r1);
+        const QHash<int,QByteArray> fields1 = parseFields(data, r1);
 
         // Read the type two record (every EBTS file will have one of these)
         Record r2;
         r2.type = 2;
         r2.position = r1.bytes;
-        r2.bytes = recordBytes(byteArray,r2.type,r2.position);
-
-        // The fields in a type 2 record are strictly defined
-        data = byteArray.mid(r2.position,r2.bytes).split(QChar(0x1D).toLatin1());
-        foreach (const QByteArray &datum, data) {
-            Field f = parseField(datum,QChar(0x1F));
-            r2.fields.insert(f.type,f.data);
+        r2.bytes = recordBytes(data, size, r2.type, r2.position);
+        if (r2.bytes < 0) {
+            qWarning("ebtsFormat::read malformed transaction %s.", qPrintable(file.name));
+            return t;
         }
+        const QHash<int,QByteArray> fields2 = parseFields(data, r2);
 
         // Demographics
-        if (r2.fields.contains(18)) {
-            QString name = r2.fields.value(18).first();
-            QStringList names = name.split(',');
-            t.file.set("FIRSTNAME", names.at(1));
+        if (fields2.contains(18)) {
+            const QStringList names = QString(fields2.value(18).split(UnitSeparator).first()).split(',');
+            if (names.size() > 1) t.file.set("FIRSTNAME", names.at(1));
             t.file.set("LASTNAME", names.at(0));
         }
 
-        if (r2.fields.contains(22)) t.file.set("DOB", r2.fields.value(22).first().toInt());
-        if (r2.fields.contains(24)) t.file.set("GENDER", QString(r2.fields.value(24).first()));
-        if (r2.fields.contains(25)) t.file.set("RACE", QString(r2.fields.value(25).first()));
+        if (fields2.contains(22)) t.file.set("DOB", fields2.value(22).split(UnitSeparator).first().toInt());
+        if (fields2.contains(24)) t.file.set("GENDER", QString(fields2.value(24).split(UnitSeparator).first()));
+        if (fields2.contains(25)) t.file.set("RACE", QString(fields2.value(25).split(UnitSeparator).first()));
 
         if (t.file.contains("DOB")) {
             const QDate dob = QDate::fromString(t.file.get<QString>("DOB"), "yyyyMMdd");
@@ -166,38 +162,56 @@ class ebtsFormat : public Format
             t.file.set("Age", age);
         }
 
-        records.append(r2);
-
-        // The third field of the first record contains informations about all the remaining records in the transaction
-        // We don't care about the first two and the final items
-        QList<QByteArray> recordTypes = r1.fields.value(3);
-        for (int i=2; i<recordTypes.size()-1; i++) {
-            // The first two bytes indicate the record index (and we don't want the separator), but we only care about the type
-            QByteArray recordType = recordTypes[i].mid(3);
+        // The third field of the first record lists the type of every record in the transaction,
+        // one subfield per record, the first two being the type one and type two records
+        const QList<QByteArray> contents = fields1.value(3).split(RecordSeparator);
+        QList<Record> records;
+        qint64 position = r1.bytes + r2.bytes;
+        for (int i=2; i<contents.size(); i++) {
             Record r;
-            r.type = recordType.toInt();
+            r.type = contents[i].split(UnitSeparator).first().toInt();
+            r.position = position;
+            r.bytes = recordBytes(data, size, r.type, position);
+            if (r.bytes < 0) {
+                qWarning("ebtsFormat::read malformed record %d in %s.", i+1, qPrintable(file.name));
+                break;
+            }
             records.append(r);
+            position += r.bytes;
         }
 
-        QList<int> frontalIdxs;
-        int position = r1.bytes + r2.bytes;
-        for (int i=2; i<records.size(); i++) {
-            records[i].position = position;
-            records[i].bytes = recordBytes(byteArray,records[i].type,position);
+        // Only the image records of the requested types are parsed further
+        QList<QByteArray> images;
+        foreach (int type, types) {
+            foreach (const Record &r, records) {
+                if ((r.type != type) || (r.type == 4) || (r.type == 7)) continue; // Binary records aren't currently supported
+                const QByteArray image = parseFields(data, r).value(999);
+                if (image.isEmpty()) continue;
+                images.append(image);
+                if (!all) break;
+            }
+            if (!all && !images.isEmpty()) break;
+        }
 
-            parseRecord(byteArray, records[i]);
-            if (records[i].type == 10) frontalIdxs.append(i);
-            position += records[i].bytes;
+        if (images.isEmpty()) {
+            qWarning("ebtsFormat::cannot find image data within file.");
+            return t;
         }
 
-        if (!frontalIdxs.isEmpty()) {
-            // We use the first type 10 record to get the frontal
-            QByteArray frontal = records[frontalIdxs.first()].fields.value(999).first();
-            m = imdecode(Mat(3, frontal.size(), CV_8UC3, frontal.data()), CV_LOAD_IMAGE_COLOR);
-            if (!m.data) qWarning("ebtsFormat::read failed to decode image data.");
-            t.m() = m;
-        } else qWarning("ebtsFormat::cannot find image data within file.");
+        QVector<Mat> decoded(images.size());
+        if (images.size() == 1) {
+            decode(&images.first(), &decoded.first());
+        } else {
+            QFutureSynchronizer<void> futures;
+            for (int i=0; i<images.size(); i++)
+                futures.addFuture(QtConcurrent::run(decode, (const QByteArray*) &images[i], &decoded[i]));
+            futures.waitForFinished();
+        }
 
+        foreach (const Mat &m, decoded) {
+            if (!m.data) qWarning("ebtsFormat::read failed to decode image data.");
+            else         t.append(m);
+        }
         return t;
     }
 
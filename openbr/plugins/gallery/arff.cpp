@@ -14,8 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrent>
 #include <openbr/plugins/openbr_internal.h>
-#include <openbr/core/opencvutils.h>
 
 namespace br
 {
@@ -23,6 +24,9 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief Weka ARFF file format.
+ *
+ * Each block of templates is formatted into reusable buffers in parallel,
+ * while the previous block is written to disk by a single background thread, so rows stay in order.
  * \author Josh Klontz \cite jklontz
  * \br_link http://weka.wikispaces.com/ARFF+%28stable+version%29
  */
@@ -30,7 +34,19 @@ class arffGallery : public Gallery
 {
     Q_OBJECT
     QFile arffFile;
+    QVector<QByteArray> buffers[2]; // Alternate between blocks, one being formatted while the other is written
+    int current;
+    QFuture<void> writing;
 
+public:
+    arffGallery() : current(0) {}
+
+    ~arffGallery()
+    {
+        writing.waitForFinished();
+    }
+
+private:
     TemplateList readBlock(bool *done)
     {
         (void) done;
@@ -38,25 +54,121 @@ class arffGallery : public Gallery
         return TemplateList();
     }
 
-    void write(const Template &t)
+    // Formats like QString::number(), integral values skip the general floating point path
+    static void appendNumber(QByteArray &buffer, double value)
     {
-        if (!arffFile.isOpen()) {
-            arffFile.setFileName(file.name);
-            arffFile.open(QFile::WriteOnly);
-            arffFile.write("% OpenBR templates\n"
-                           "@RELATION OpenBR\n"
-                           "\n");
-
-            const int dimensions = t.m().rows * t.m().cols;
-            for (int i=0; i<dimensions; i++)
-                arffFile.write(qPrintable("@ATTRIBUTE v" + QString::number(i) + " REAL\n"));
-            arffFile.write(qPrintable("@ATTRIBUTE class string\n"));
-
-            arffFile.write("\n@DATA\n");
+        if ((value == floor(value)) && (fabs(value) < 1e6) && ((value != 0) || (1/value > 0))) {
+            char digits[8];
+            int n = 0;
+            int v = int(fabs(value));
+            do { digits[n++] = char('0' + v % 10); v /= 10; } while (v);
+            if (value < 0) buffer.append('-');
+            while (n) buffer.append(digits[--n]);
+        } else {
+            char number[32];
+            buffer.append(number, qsnprintf(number, sizeof(number), "%g", value));
         }
+    }
+
+    // Channel-major like OpenCVUtils::matrixToStringList
+    static void appendRow(QByteArray &buffer, const Template &t)
+    {
+        const cv::Mat &m = t.m();
+        const int channels = m.channels();
+        bool first = true;
+        for (int c=0; c<channels; c++)
+            for (int i=0; i<m.rows; i++) {
+                const uchar *row = m.ptr(i);
+                for (int j=0; j<m.cols; j++) {
+                    if (!first) buffer.append(',');
+                    first = false;
+                    const int k = j*channels + c;
+                    switch (m.depth()) {
+                      case CV_8U:  appendNumber(buffer, ((const quint8*) row)[k]); break;
+                      case CV_8S:  appendNumber(buffer, ((const qint8*) row)[k]); break;
+                      case CV_16U: appendNumber(buffer, ((const quint16*) row)[k]); break;
+                      case CV_16S: appendNumber(buffer, ((const qint16*) row)[k]); break;
+                      case CV_32S: buffer.append(QByteArray::number(((const qint32*) row)[k])); break;
+                      case CV_32F: appendNumber(buffer, ((const float*) row)[k]); break;
+                      default:     appendNumber(buffer, ((const double*) row)[k]); break;
+                    }
+                }
+            }
+        buffer.append(",'");
+        buffer.append(t.file.get<QString>("Label").toLocal8Bit());
+        buffer.append("'\n");
+    }
+
+    static void format(const TemplateList *templates, QByteArray *buffer, int begin, int end)
+    {
+        buffer->resize(0); // Keeps the allocation from earlier blocks
+        for (int i=begin; i<end; i++)
+            appendRow(*buffer, (*templates)[i]);
+    }
 
-        arffFile.write(qPrintable(OpenCVUtils::matrixToStringList(t).join(',')));
-        arffFile.write(qPrintable(",'" + t.file.get<QString>("Label") + "'\n"));
+    void writeBuffers(int index)
+    {
+        foreach (const QByteArray &buffer, buffers[index])
+            arffFile.write(buffer);
+    }
+
+    void open(const Template &t)
+    {
+        arffFile.setFileName(file.name);
+        arffFile.open(QFile::WriteOnly);
+
+        QByteArray header("% OpenBR templates\n"
+                          "@RELATION OpenBR\n"
+                          "\n");
+        const int dimensions = t.m().rows * t.m().cols;
+        for (int i=0; i<dimensions; i++)
+            header.append("@ATTRIBUTE v" + QByteArray::number(i) + " REAL\n");
+        header.append("@ATTRIBUTE class string\n");
+        header.append("\n@DATA\n");
+        arffFile.write(header);
+    }
+
+    void writeBlock(const TemplateList &templates)
+    {
+        if (!templates.isEmpty()) {
+            if (!arffFile.isOpen())
+                open(templates.first());
+
+            // Earlier rows have been written out by the time this set is reused
+            QVector<QByteArray> &chunks = buffers[current];
+            chunks.resize(std::max(1, std::min(Globals->parallelism, templates.size() / 64)));
+            QFutureSynchronizer<void> futures;
+            for (int i=0; i<chunks.size(); i++) {
+                const int begin = templates.size() * i / chunks.size(), end = templates.size() * (i + 1) / chunks.size();
+                if (i == chunks.size() - 1) format(&templates, &chunks[i], begin, end);
+                else                        futures.addFuture(QtConcurrent::run(format, &templates, &chunks[i], begin, end));
+            }
+            futures.waitForFinished();
+
+            writing.waitForFinished();
+            writing = QtConcurrent::run(this, &arffGallery::writeBuffers, current);
+            current = 1 - current;
+        }
+
+        if (!next.isNull())
+            next->writeBlock(templates);
+    }
+
+    void write(const Template &t)
+    {
+        if (!arffFile.isOpen())
+            open(t);
+        writing.waitForFinished();
+        QByteArray row;
+        appendRow(row, t);
+        arffFile.write(row);
+    }
+
+    void flush()
+    {
+        writing.waitForFinished();
+        arffFile.flush();
+        Gallery::flush();
     }
 };
 
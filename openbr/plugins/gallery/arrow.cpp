@@ -0,0 +1,144 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/arrow.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief Writes templates as an Arrow IPC file for analysis in Python or Spark.
+ *
+ * Each metadata key becomes a typed column, boolean, 64-bit integer, double, or UTF-8 for anything else,
+ * with nulls where a template lacks the key.
+ * The n-th matrix of each template becomes the column Matrix<n>, fixed size binary if every matrix has the same size,
+ * with its rows, cols and OpenCV type recorded as field metadata, and variable size binary otherwise.
+ * Write only, templates are buffered and the file is written when the gallery is destroyed.
+ * \author Unknown \cite unknown
+ */
+class arrowGallery : public Gallery
+{
+    Q_OBJECT
+
+    TemplateList templates;
+
+    ~arrowGallery()
+    {
+        if (file.isNull() || templates.isEmpty())
+            return;
+
+        QList<Arrow::Column> columns;
+        columns.append(Arrow::Column("File", Arrow::Column::Utf8));
+        columns.append(Arrow::Column("FTE", Arrow::Column::Bool));
+        foreach (const Template &t, templates) {
+            columns[0].append(t.file.name.toUtf8());
+            columns[1].append(t.file.fte);
+        }
+
+        QStringList keys;
+        foreach (const Template &t, templates)
+            foreach (const QString &key, t.file.localKeys())
+                if (!keys.contains(key))
+                    keys.append(key);
+        keys.sort();
+
+        foreach (const QString &key, keys) {
+            // The narrowest type that represents every value
+            bool allBool = true, allInteger = true, allNumeric = true;
+            foreach (const Template &t, templates) {
+                const QVariant value = t.file.value(key);
+                if (value.isNull()) continue;
+                const int type = value.userType();
+                allBool = allBool && (type == QMetaType::Bool);
+                allInteger = allInteger && ((type == QMetaType::Int) || (type == QMetaType::UInt) || (type == QMetaType::LongLong) || (type == QMetaType::ULongLong));
+                allNumeric = allNumeric && (allInteger || (type == QMetaType::Float) || (type == QMetaType::Double));
+            }
+
+            Arrow::Column column(key, allBool ? Arrow::Column::Bool : allInteger ? Arrow::Column::Int64 : allNumeric ? Arrow::Column::Float64 : Arrow::Column::Utf8);
+            foreach (const Template &t, templates) {
+                const QVariant value = t.file.value(key);
+                if (value.isNull())                            column.appendNull();
+                else if (column.type == Arrow::Column::Bool)   column.append(value.toBool());
+                else if (column.type == Arrow::Column::Int64)  column.append(qint64(value.toLongLong()));
+                else if (column.type == Arrow::Column::Float64) column.append(value.toDouble());
+                else                                           column.append(QtUtils::toString(value).toUtf8());
+            }
+            columns.append(column);
+        }
+
+        int matrices = 0;
+        foreach (const Template &t, templates)
+            matrices = std::max(matrices, t.size());
+
+        for (int i=0; i<matrices; i++) {
+            // Fixed size when every template has an identically shaped matrix
+            bool fixed = true;
+            const cv::Mat *first = NULL;
+            foreach (const Template &t, templates) {
+                if (i >= t.size()) { fixed = false; break; }
+                const cv::Mat &m = t[i];
+                if (!first) first = &m;
+                else if ((m.rows != first->rows) || (m.cols != first->cols) || (m.type() != first->type())) { fixed = false; break; }
+            }
+            fixed = fixed && (first->total() * first->elemSize() > 0);
+
+            Arrow::Column column("Matrix" + QString::number(i), fixed ? Arrow::Column::FixedSizeBinary : Arrow::Column::Binary,
+                                 fixed ? int(first->total() * first->elemSize()) : 0);
+            if (fixed) {
+                column.setMetadata("rows", QString::number(first->rows));
+                column.setMetadata("cols", QString::number(first->cols));
+                column.setMetadata("type", QString::number(first->type()));
+            }
+
+            foreach (const Template &t, templates) {
+                if (i >= t.size()) {
+                    column.appendNull();
+                    continue;
+                }
+                const cv::Mat m = t[i].isContinuous() ? t[i] : t[i].clone();
+                column.append(QByteArray((const char*) m.data, int(m.total() * m.elemSize())));
+            }
+            columns.append(column);
+        }
+
+        QtUtils::touchDir(QFileInfo(file.name));
+        Arrow::write(file.name, columns);
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        *done = true;
+        qFatal("arrowGallery is write only, read %s with pyarrow.", qPrintable(file.name));
+        return TemplateList();
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+        templates.append(t);
+    }
+};
+
+BR_REGISTER(Gallery, arrowGallery)
+
+} // namespace br
+
+#include "gallery/arrow.moc"
@@ -33,11 +33,15 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief An abstract gallery for handling binary data
+ * \br_property bool filter Only read templates whose metadata passes Globals->filters.
+ *                          Formats that can read a template's metadata on its own skip the matrices of rejected templates.
  * \author Josh Klontz \cite jklontz
  */
 class BinaryGallery : public Gallery
 {
     Q_OBJECT
+    Q_PROPERTY(bool filter READ get_filter WRITE set_filter RESET reset_filter STORED false)
+    BR_PROPERTY(bool, filter, false)
 
     void init()
     {
@@ -115,7 +119,7 @@ class BinaryGallery : public Gallery
 
         TemplateList templates;
         while ((templates.size() < readBlockSize) && !gallery.atEnd()) {
-            const Template t = readTemplate();
+            const Template t = filter ? readFilteredTemplate() : readTemplate();
             if (!t.isEmpty() || !t.file.isNull()) {
                 templates.append(t);
                 templates.last().file.set("progress", position());
@@ -130,6 +134,30 @@ class BinaryGallery : public Gallery
         return templates;
     }
 
+    void seek(qint64 index)
+    {
+        readOpen();
+        if (gallery.isSequential())
+            qFatal("Can't seek in sequential gallery: %s", qPrintable(file.name));
+        if (offsets.isEmpty())
+            offsets = templateOffsets();
+        gallery.seek(index < offsets.size() ? offsets[int(index)] : gallery.size());
+    }
+
+    TemplateList readRange(qint64 begin, qint64 end)
+    {
+        seek(begin);
+        TemplateList templates;
+        while ((begin + templates.size() < end) && !gallery.atEnd()) {
+            const Template t = readTemplate();
+            if (!t.isEmpty() || !t.file.isNull()) {
+                templates.append(t);
+                templates.last().file.set("progress", position());
+            }
+        }
+        return templates;
+    }
+
     void write(const Template &t)
     {
         writeOpen();
@@ -138,6 +166,15 @@ class BinaryGallery : public Gallery
             gallery.flush();
     }
 
+    void flush()
+    {
+        if (gallery.isOpen())
+            gallery.flush();
+        Gallery::flush();
+    }
+
+    QList<qint64> offsets; // Cached templateOffsets()
+
 protected:
     QFile gallery;
     QDataStream stream;
@@ -155,6 +192,21 @@ protected:
 
     virtual Template readTemplate() = 0;
     virtual void writeTemplate(const Template &t) = 0;
+
+    // The next template if its metadata passes Globals->filters, otherwise an empty template.
+    // Formats override this to check the metadata before reading the matrices.
+    virtual Template readFilteredTemplate()
+    {
+        const Template t = readTemplate();
+        return matchesFilters(t.file) ? t : Template();
+    }
+
+    // File offset of every template, implemented by formats that support seek() and readRange()
+    virtual QList<qint64> templateOffsets()
+    {
+        qFatal("Gallery %s does not support random access.", qPrintable(file.name));
+        return QList<qint64>();
+    }
 };
 
 /*!
@@ -163,12 +215,148 @@ protected:
  *
  * Designed to be a literal translation of templates to disk.
  * Compatible with TemplateList::fromBuffer.
+ *
+ * When written to a regular file, a metadata index is also written beside it as <gallery>.idx,
+ * holding a header with the template count followed by the metadata of every template.
+ * files() reads the index instead of the gallery when it is up to date,
+ * and otherwise scans the gallery seeking past the matrices rather than reading them.
  * \author Josh Klontz \cite jklontz
  */
 class galGallery : public BinaryGallery
 {
     Q_OBJECT
 
+    static const quint32 IndexMagic = 0x49475242; // "BRGI"
+    static const quint32 IndexVersion = 1;
+
+    bool writing, indexed;
+    QList<qint64> indexPositions; // Gallery position following each template, reported as "progress"
+    FileList indexFiles;
+
+public:
+    galGallery() : writing(false), indexed(false) {}
+
+    ~galGallery()
+    {
+        if (!writing || gallery.isSequential())
+            return;
+
+        gallery.flush();
+        const qint64 size = gallery.size();
+        gallery.close();
+        QFile::remove(indexName());
+        if (!indexed)
+            return;
+
+        QFile index(indexName());
+        if (!index.open(QFile::WriteOnly)) {
+            qWarning("Can't write gallery index: %s", qPrintable(index.fileName()));
+            return;
+        }
+        QDataStream indexStream(&index);
+        indexStream << IndexMagic << IndexVersion << size << quint64(indexFiles.size());
+        for (int i=0; i<indexFiles.size(); i++)
+            indexStream << indexPositions[i] << indexFiles[i];
+    }
+
+private:
+    QString indexName() const
+    {
+        return file.name + ".idx";
+    }
+
+    // Returns false if the index is missing or doesn't describe the gallery as it is now
+    bool readIndex(QList<qint64> &positions, FileList &files) const
+    {
+        const QFileInfo galleryInfo(file.name), indexInfo(indexName());
+        if (!galleryInfo.exists() || !indexInfo.exists() || (indexInfo.lastModified() < galleryInfo.lastModified()))
+            return false;
+
+        QFile index(indexName());
+        if (!index.open(QFile::ReadOnly))
+            return false;
+        QDataStream indexStream(&index);
+        quint32 magic, version;
+        qint64 size;
+        quint64 count;
+        indexStream >> magic >> version >> size >> count;
+        if ((magic != IndexMagic) || (version != IndexVersion) || (size != galleryInfo.size()) || (indexStream.status() != QDataStream::Ok))
+            return false;
+
+        positions.reserve(count);
+        files.reserve(count);
+        for (quint64 i=0; i<count; i++) {
+            qint64 position;
+            File f;
+            indexStream >> position >> f;
+            positions.append(position);
+            files.append(f);
+        }
+        return indexStream.status() == QDataStream::Ok;
+    }
+
+    // Positions and metadata of every template, from the index when possible
+    void readMetadata(QList<qint64> &positions, FileList &files) const
+    {
+        if (readIndex(positions, files))
+            return;
+        positions.clear();
+        files.clear();
+
+        // Same format as operator>>(QDataStream&, Template&), without reading the matrix data
+        QFile input(file);
+        if (!input.open(QFile::ReadOnly))
+            qFatal("Can't open gallery: %s for reading", qPrintable(input.fileName()));
+        QDataStream inputStream(&input);
+        while (!input.atEnd()) {
+            quint32 matrices;
+            inputStream >> matrices;
+            for (quint32 i=0; i<matrices; i++) {
+                int rows, cols, type, len;
+                inputStream >> rows >> cols >> type >> len;
+                inputStream.skipRawData(len);
+            }
+            File f;
+            inputStream >> f;
+            if (inputStream.status() != QDataStream::Ok)
+                qFatal("Corrupt gallery: %s", qPrintable(input.fileName()));
+            if ((matrices > 0) || !f.isNull()) {
+                positions.append(input.pos());
+                files.append(f);
+            }
+        }
+    }
+
+    FileList files()
+    {
+        if (gallery.isOpen() && gallery.isSequential())
+            return BinaryGallery::files();
+
+        QList<qint64> positions;
+        FileList files;
+        readMetadata(positions, files);
+        FileList filtered;
+        filtered.reserve(files.size());
+        for (int i=0; i<files.size(); i++)
+            if (!filter || matchesFilters(files[i])) {
+                filtered.append(files[i]);
+                filtered.last().set("progress", positions[i]);
+            }
+        return filtered;
+    }
+
+    QList<qint64> templateOffsets()
+    {
+        QList<qint64> positions;
+        FileList files;
+        readMetadata(positions, files);
+
+        // Each template starts where the previous one ends
+        positions.prepend(0);
+        positions.removeLast();
+        return positions;
+    }
+
     Template readTemplate()
     {
         Template t;
@@ -176,13 +364,45 @@ class galGallery : public BinaryGallery
         return t;
     }
 
+    Template readFilteredTemplate()
+    {
+        if (gallery.isSequential())
+            return BinaryGallery::readFilteredTemplate();
+
+        // The metadata follows the matrices, which are seeked past and only read if it matches
+        const qint64 start = gallery.pos();
+        quint32 matrices;
+        stream >> matrices;
+        for (quint32 i=0; i<matrices; i++) {
+            int rows, cols, type, len;
+            stream >> rows >> cols >> type >> len;
+            stream.skipRawData(len);
+        }
+        File f;
+        stream >> f;
+        if (stream.status() != QDataStream::Ok)
+            qFatal("Corrupt gallery: %s", qPrintable(gallery.fileName()));
+        if (!matchesFilters(f))
+            return Template();
+
+        gallery.seek(start);
+        return readTemplate();
+    }
+
     void writeTemplate(const Template &t)
     {
+        if (!writing) {
+            // Appending extends an existing index, which must describe the gallery as it is before this write
+            writing = true;
+            indexed = !gallery.isSequential() && ((gallery.size() == 0) || readIndex(indexPositions, indexFiles));
+        }
+
         if (t.isEmpty() && t.file.isNull())
             return;
-        else if (t.file.fte) {
+
+        File f = t.file;
+        if (t.file.fte) {
              // Only write metadata for failure to enroll, but remove any stored QVariants of type cv::Mat
-            File f = t.file;
             QVariantMap metadata = f.localMetadata();
             QMapIterator<QString, QVariant> i(metadata);
             while (i.hasNext()) {
@@ -194,6 +414,11 @@ class galGallery : public BinaryGallery
         }
         else
             stream << t;
+
+        if (indexed) {
+            indexPositions.append(gallery.pos());
+            indexFiles.append(f);
+        }
     }
 };
 
@@ -216,6 +441,49 @@ class tGallery : public BinaryGallery
         return t;
     }
 
+    Template readFilteredTemplate()
+    {
+        if (gallery.isSequential())
+            return BinaryGallery::readFilteredTemplate();
+
+        // The metadata precedes the feature vector, which is seeked past unless it matches
+        const qint64 start = gallery.pos();
+        br_universal_template header;
+        if (gallery.read((char*) &header, sizeof(header)) != sizeof(header))
+            qFatal("Truncated gallery: %s", qPrintable(gallery.fileName()));
+        QByteArray metadata(sizeof(header) + header.mdSize, 0);
+        memcpy(metadata.data(), &header, sizeof(header));
+        if (gallery.read(metadata.data() + sizeof(header), header.mdSize) != header.mdSize)
+            qFatal("Truncated gallery: %s", qPrintable(gallery.fileName()));
+        reinterpret_cast<br_universal_template*>(metadata.data())->fvSize = 0;
+
+        if (!matchesFilters(Template::fromUniversalTemplate(reinterpret_cast<br_const_utemplate>(metadata.constData())).file)) {
+            gallery.seek(start + sizeof(header) + header.mdSize + header.fvSize);
+            return Template();
+        }
+
+        gallery.seek(start);
+        return readTemplate();
+    }
+
+    QList<qint64> templateOffsets()
+    {
+        // Walk the headers, seeking past each template's data
+        QList<qint64> offsets;
+        QFile input(file);
+        if (!input.open(QFile::ReadOnly))
+            qFatal("Can't open gallery: %s for reading", qPrintable(input.fileName()));
+        while (!input.atEnd()) {
+            const qint64 offset = input.pos();
+            br_universal_template header;
+            if (input.read((char*) &header, sizeof(header)) != sizeof(header))
+                qFatal("Truncated gallery: %s", qPrintable(input.fileName()));
+            offsets.append(offset);
+            input.seek(offset + sizeof(header) + header.mdSize + header.fvSize);
+        }
+        return offsets;
+    }
+
     void writeTemplate(const Template &t)
     {
         const br_utemplate ut = Template::toUniversalTemplate(t);
@@ -229,18 +497,26 @@ BR_REGISTER(Gallery, tGallery)
 /*!
  * \ingroup galleries
  * \brief Newline-separated URLs.
+ *
+ * Remote URLs are prefetched as they are read, so Download finds them ready by the time the templates reach it.
  * \author Josh Klontz \cite jklontz
+ * \br_property bool readAhead Start fetching remote URLs as soon as they are read from the gallery. Default is true.
  */
 class urlGallery : public BinaryGallery
 {
     Q_OBJECT
+    Q_PROPERTY(bool readAhead READ get_readAhead WRITE set_readAhead RESET reset_readAhead STORED false)
+    BR_PROPERTY(bool, readAhead, true)
 
     Template readTemplate()
     {
         Template t;
         const QString url = QString::fromLocal8Bit(gallery.readLine()).simplified();
-        if (!url.isEmpty())
+        if (!url.isEmpty()) {
             t.file.set("URL", url);
+            if (readAhead)
+                prefetch(url);
+        }
         return t;
     }
 
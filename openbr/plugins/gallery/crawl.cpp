@@ -14,9 +14,14 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QElapsedTimer>
+#include <QRunnable>
 #include <QStandardPaths>
+#include <QThreadPool>
+#include <QWaitCondition>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
 
 namespace br
 {
@@ -24,6 +29,11 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief Crawl a root location for image files.
+ *
+ * Directories are listed concurrently on a private thread pool and readBlock returns images as they are found,
+ * so enrollment overlaps with the crawl.
+ * \br_property int threads Directories listed concurrently, with 1 the crawl is sequential and respects depthFirst. Default is Context::parallelism.
+ * \br_property QString manifest Text file of the size and modification time of each image crawled. Images unchanged since the manifest was written are skipped, and the manifest is rewritten when the crawl finishes. Default is "", no manifest.
  * \author Josh Klontz \cite jklontz
  */
 class crawlGallery : public Gallery
@@ -35,19 +45,85 @@ class crawlGallery : public Gallery
     Q_PROPERTY(int images READ get_images WRITE set_images RESET reset_images STORED false)
     Q_PROPERTY(bool json READ get_json WRITE set_json RESET reset_json STORED false)
     Q_PROPERTY(int timeLimit READ get_timeLimit WRITE set_timeLimit RESET reset_timeLimit STORED false)
+    Q_PROPERTY(int threads READ get_threads WRITE set_threads RESET reset_threads STORED false)
+    Q_PROPERTY(QString manifest READ get_manifest WRITE set_manifest RESET reset_manifest STORED false)
     BR_PROPERTY(bool, autoRoot, false)
     BR_PROPERTY(int, depth, INT_MAX)
     BR_PROPERTY(bool, depthFirst, false)
     BR_PROPERTY(int, images, INT_MAX)
     BR_PROPERTY(bool, json, false)
     BR_PROPERTY(int, timeLimit, INT_MAX)
+    BR_PROPERTY(int, threads, Globals->parallelism)
+    BR_PROPERTY(QString, manifest, "")
+
+    // Lists one directory, or crawls a whole root when sequential
+    class CrawlTask : public QRunnable
+    {
+        crawlGallery *gallery;
+        QFileInfo url;
+        int currentDepth;
+
+    public:
+        CrawlTask(crawlGallery *gallery, const QFileInfo &url, int currentDepth)
+            : gallery(gallery), url(url), currentDepth(currentDepth) {}
+
+        void run()
+        {
+            gallery->crawl(url, currentDepth);
+            gallery->finishTask();
+        }
+    };
+
+    typedef QPair<qint64, qint64> Stamp; // Size and modification time
 
     QTime elapsed;
-    TemplateList templates;
+    QThreadPool pool;
+    QMutex lock;
+    QWaitCondition changed;
+    QList<File> found; // Crawled but not yet read
+    QHash<QString, Stamp> stamps; // The manifest, updated as images are crawled
+    int pending, emitted;
+    bool stopped, manifestWritten;
+
+public:
+    crawlGallery() : pending(0), emitted(0), stopped(false), manifestWritten(false) {}
+
+    ~crawlGallery()
+    {
+        {
+            QMutexLocker locker(&lock);
+            stopped = true;
+        }
+        pool.clear();
+        pool.waitForDone();
+    }
+
+private:
+    bool stopping()
+    {
+        QMutexLocker locker(&lock);
+        return stopped || (emitted >= images) || (elapsed.elapsed()/1000 >= timeLimit);
+    }
+
+    void start(const QFileInfo &url, int currentDepth)
+    {
+        {
+            QMutexLocker locker(&lock);
+            pending++;
+        }
+        pool.start(new CrawlTask(this, url, currentDepth));
+    }
+
+    void finishTask()
+    {
+        QMutexLocker locker(&lock);
+        if (--pending == 0)
+            changed.wakeAll();
+    }
 
     void crawl(QFileInfo url, int currentDepth = 0)
     {
-        if ((templates.size() >= images) || (currentDepth >= depth) || (elapsed.elapsed()/1000 >= timeLimit))
+        if ((currentDepth >= depth) || stopping())
             return;
 
         if (url.filePath().startsWith("file://"))
@@ -57,46 +133,103 @@ class crawlGallery : public Gallery
             const QDir dir(url.absoluteFilePath());
             const QFileInfoList files = dir.entryInfoList(QDir::Files);
             const QFileInfoList subdirs = dir.entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot);
-            foreach (const QFileInfo &first, depthFirst ? subdirs : files)
-                crawl(first, currentDepth + 1);
-            foreach (const QFileInfo &second, depthFirst ? files : subdirs)
-                crawl(second, currentDepth + 1);
+            if (threads > 1) {
+                foreach (const QFileInfo &file, files)
+                    crawl(file, currentDepth + 1);
+                foreach (const QFileInfo &subdir, subdirs)
+                    start(subdir, currentDepth + 1);
+            } else {
+                foreach (const QFileInfo &first, depthFirst ? subdirs : files)
+                    crawl(first, currentDepth + 1);
+                foreach (const QFileInfo &second, depthFirst ? files : subdirs)
+                    crawl(second, currentDepth + 1);
+            }
         } else if (url.isFile()) {
             const QString suffix = url.suffix();
             if ((suffix == "bmp") || (suffix == "jpg") || (suffix == "jpeg") || (suffix == "png") || (suffix == "tiff")) {
+                const QString path = url.canonicalFilePath();
+                const Stamp stamp(url.size(), url.lastModified().toMSecsSinceEpoch());
+
+                QMutexLocker locker(&lock);
+                if ((stamps.value(path, Stamp(-1, -1)) == stamp) || (emitted >= images))
+                    return;
+                stamps.insert(path, stamp);
+
                 File f;
-                if (json) f.set("URL", "file://"+url.canonicalFilePath());
-                else      f.name = "file://"+url.canonicalFilePath();
-                templates.append(f);
+                if (json) f.set("URL", "file://"+path);
+                else      f.name = "file://"+path;
+                found.append(f);
+                emitted++;
+                changed.wakeAll();
             }
         }
     }
 
+    void readManifest()
+    {
+        if (manifest.isEmpty() || !QFileInfo(manifest).exists())
+            return;
+        foreach (const QString &line, QtUtils::readLines(manifest)) {
+            const QString path = line.section(' ', 2);
+            if (!path.isEmpty())
+                stamps.insert(path, Stamp(line.section(' ', 0, 0).toLongLong(), line.section(' ', 1, 1).toLongLong()));
+        }
+    }
+
+    void writeManifest()
+    {
+        if (manifest.isEmpty() || manifestWritten)
+            return;
+        QStringList lines;
+        for (QHash<QString, Stamp>::const_iterator i = stamps.constBegin(); i != stamps.constEnd(); ++i)
+            lines.append(QString("%1 %2 %3").arg(QString::number(i.value().first), QString::number(i.value().second), i.key()));
+        lines.sort();
+        QtUtils::writeFile(manifest, lines);
+        manifestWritten = true;
+    }
+
     void init()
     {
         elapsed.start();
+        readManifest();
+        pool.setMaxThreadCount(std::max(1, threads));
+
         const QString root = file.name.mid(0, file.name.size()-6); // Remove .crawl suffix";
         if (!root.isEmpty()) {
-            crawl(root);
+            start(root, 0);
         } else {
             if (autoRoot) {
                 foreach (const QString &path, QStandardPaths::standardLocations(QStandardPaths::HomeLocation))
-                    crawl(path);
+                    start(path, 0);
             } else {
                 QFile file;
                 file.open(stdin, QFile::ReadOnly);
                 while (!file.atEnd()) {
                     const QString url = QString::fromLocal8Bit(file.readLine()).simplified();
                     if (!url.isEmpty())
-                        crawl(url);
+                        start(url, 0);
                 }
             }
         }
     }
 
+    // Waits for a full block, or returns what has been found after a short wait so enrollment can start
     TemplateList readBlock(bool *done)
     {
-        *done = true;
+        QMutexLocker locker(&lock);
+        QElapsedTimer waiting;
+        waiting.start();
+        while ((found.size() < readBlockSize) && (pending > 0) && ((found.isEmpty() || (waiting.elapsed() < 100))))
+            changed.wait(&lock, 100);
+
+        TemplateList templates;
+        const int count = std::min(found.size(), readBlockSize);
+        for (int i=0; i<count; i++)
+            templates.append(found.takeFirst());
+
+        *done = (pending == 0) && found.isEmpty();
+        if (*done)
+            writeManifest();
         return templates;
     }
 
@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
+
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
 
@@ -85,6 +87,37 @@ class csvGallery : public FileGallery
         QtUtils::writeFile(file, lines);
     }
 
+    // Equivalent to splitting on "\s*,\s*" for a trimmed line, without a regular expression
+    static QStringList split(const QByteArray &line)
+    {
+        QStringList words;
+        foreach (const QByteArray &word, line.trimmed().split(','))
+            words.append(QString::fromLocal8Bit(word.trimmed()));
+        return words;
+    }
+
+    struct Chunk
+    {
+        int begin, end;
+        TemplateList templates;
+    };
+
+    static void parseLines(const QList<QByteArray> *lines, const QList<qint64> *positions, const QStringList *headers, Chunk *chunk)
+    {
+        TemplateList *templates = &chunk->templates;
+        for (int i=chunk->begin; i<chunk->end; i++) {
+            const QStringList words = split((*lines)[i]);
+            if (words.size() != headers->size()) continue;
+            File fi;
+            for (int j=0; j<words.size(); j++) {
+                if (j == 0) fi.name = words[j];
+                else        fi.set((*headers)[j], words[j]);
+            }
+            templates->append(fi);
+            templates->last().file.set("progress", (*positions)[i]);
+        }
+    }
+
     TemplateList readBlock(bool *done)
     {
         readOpen();
@@ -94,32 +127,33 @@ class csvGallery : public FileGallery
             *done = true;
             return templates;
         }
-        QRegExp regexp("\\s*,\\s*");
 
         if (f.pos() == 0)
-        {
-            // read a line
-            QByteArray lineBytes = f.readLine();
-            QString line = QString::fromLocal8Bit(lineBytes).trimmed();
-            headers = line.split(regexp);
+            headers = split(f.readLine());
+
+        // Reading raw lines is cheap, decoding and splitting them is done in parallel chunks
+        QList<QByteArray> lines;
+        QList<qint64> positions;
+        for (qint64 i = 0; i < this->readBlockSize && !f.atEnd(); i++) {
+            lines.append(f.readLine());
+            positions.append(f.pos());
         }
+        *done = f.atEnd();
 
-        for (qint64 i = 0; i < this->readBlockSize && !f.atEnd(); i++){
-            QByteArray lineBytes = f.readLine();
-            QString line = QString::fromLocal8Bit(lineBytes).trimmed();
-
-            QStringList words = line.split(regexp);
-            if (words.size() != headers.size()) continue;
-            File fi;
-            for (int j=0; j<words.size(); j++) {
-                if (j == 0) fi.name = words[j];
-                else        fi.set(headers[j], words[j]);
-            }
-            templates.append(fi);
-            templates.last().file.set("progress", f.pos());
+        static const int MinChunkSize = 1024;
+        const int chunks = std::max(1, std::min(QThreadPool::globalInstance()->maxThreadCount(), lines.size() / MinChunkSize));
+        QVector<Chunk> parsed(chunks);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<chunks; i++) {
+            parsed[i].begin = qint64(i) * lines.size() / chunks;
+            parsed[i].end = qint64(i+1) * lines.size() / chunks;
+            if (i == chunks-1) parseLines(&lines, &positions, &headers, &parsed[i]);
+            else               futures.addFuture(QtConcurrent::run(&csvGallery::parseLines, &lines, &positions, &headers, &parsed[i]));
         }
-        *done = f.atEnd();
+        futures.waitForFinished();
 
+        for (int i=0; i<chunks; i++)
+            templates.append(parsed[i].templates);
         return templates;
     }
 
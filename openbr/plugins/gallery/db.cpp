@@ -25,76 +25,153 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief Database input.
+ *
+ * Results are read readBlockSize rows at a time unless the query has a filter column or a subset is requested,
+ * in which case they are grouped by label in memory. Imports are inserted in a single transaction
+ * and every imported column is indexed.
  * \author Josh Klontz \cite jklontz
  */
 class dbGallery : public Gallery
 {
     Q_OBJECT
 
-    TemplateList readBlock(bool *done)
+    static const int ImportBatchSize = 10000;
+
+    QString connection;
+    QScopedPointer<QSqlQuery> results; // Streamed query, or NULL when not open
+    bool streaming;
+    TemplateList grouped; // Remaining output when not streaming
+    QString labelName;
+    bool hasMetadata;
+
+    QSqlDatabase database()
     {
-        TemplateList templates;
-        br::File import = file.get<QString>("import", "");
-        QString query = file.get<QString>("query");
-        QString subset = file.get<QString>("subset", "");
+        if (connection.isEmpty()) {
+            connection = "dbGallery" + QString::number(quintptr(this));
+            QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connection);
+            db.setDatabaseName(file);
+            if (!db.open()) qFatal("Failed to open SQLite database %s.", qPrintable(file.name));
+        }
+        return QSqlDatabase::database(connection);
+    }
 
-#ifndef BR_EMBEDDED
-        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE");
-        db.setDatabaseName(file);
-        if (!db.open()) qFatal("Failed to open SQLite database %s.", qPrintable(file.name));
-
-        if (!import.isNull()) {
-            qDebug("Parsing %s", qPrintable(import.name));
-            QStringList lines = QtUtils::readLines(import);
-            QList<QStringList> cells; cells.reserve(lines.size());
-            const QRegExp re("\\s*,\\s*");
-            foreach (const QString &line, lines) {
-                cells.append(line.split(re));
-                if (cells.last().size() != cells.first().size()) qFatal("Column count mismatch.");
+    static QStringList splitLine(const QString &line)
+    {
+        QStringList cells = line.split(',');
+        for (int i=0; i<cells.size(); i++)
+            cells[i] = cells[i].trimmed();
+        return cells;
+    }
+
+    void import(const File &import)
+    {
+        QSqlDatabase db = database();
+        const QString &table = import.baseName();
+        if (db.tables().contains(table)) {
+            qDebug("Table %s already imported", qPrintable(table));
+            return;
+        }
+
+        qDebug("Parsing %s", qPrintable(import.name));
+        QFile csv(import);
+        if (!csv.open(QFile::ReadOnly | QFile::Text))
+            qFatal("Failed to open %s.", qPrintable(import.name));
+        const QStringList header = splitLine(QString::fromLocal8Bit(csv.readLine()));
+
+        // Column types are decided by the first row
+        QString line = QString::fromLocal8Bit(csv.readLine());
+        QStringList cells = splitLine(line);
+        if (cells.size() != header.size()) qFatal("Column count mismatch.");
+        QStringList columns, qMarks;
+        QList<bool> numeric;
+        for (int i=0; i<header.size(); i++) {
+            bool isNumeric;
+            cells[i].toInt(&isNumeric);
+            numeric.append(isNumeric);
+            columns.append(header[i] + (isNumeric ? " INTEGER" : " STRING"));
+            qMarks.append("?");
+        }
+
+        qDebug("Creating table %s", qPrintable(table));
+        QSqlQuery q(db);
+        if (!q.exec("CREATE TABLE " + table + " (" + columns.join(", ") + ");"))
+            qFatal("%s.", qPrintable(q.lastError().text()));
+
+        // One transaction, inserting a batch of rows with every execution of the prepared statement
+        db.transaction();
+        if (!q.prepare("insert into " + table + " values (" + qMarks.join(", ") + ")"))
+            qFatal("%s.", qPrintable(q.lastError().text()));
+        QList<QVariantList> variantLists;
+        for (int i=0; i<header.size(); i++)
+            variantLists.append(QVariantList());
+        while (true) {
+            if (!line.trimmed().isEmpty()) {
+                if (cells.size() != header.size()) qFatal("Column count mismatch.");
+                for (int i=0; i<cells.size(); i++) {
+                    if (numeric[i]) variantLists[i] << cells[i].toInt();
+                    else            variantLists[i] << cells[i];
+                }
             }
 
-            QStringList columns, qMarks;
-            QList<QVariantList> variantLists;
-            for (int i=0; i<cells[0].size(); i++) {
-                bool isNumeric;
-                cells[1][i].toInt(&isNumeric);
-                columns.append(cells[0][i] + (isNumeric ? " INTEGER" : " STRING"));
-                qMarks.append("?");
-
-                QVariantList variantList; variantList.reserve(lines.size()-1);
-                for (int j=1; j<lines.size(); j++) {
-                    if (isNumeric) variantList << cells[j][i].toInt();
-                    else           variantList << cells[j][i];
+            const bool end = csv.atEnd();
+            if ((variantLists.first().size() >= ImportBatchSize) || (end && !variantLists.first().isEmpty())) {
+                for (int i=0; i<variantLists.size(); i++) {
+                    q.addBindValue(variantLists[i]);
+                    variantLists[i].clear();
                 }
-                variantLists.append(variantList);
+                if (!q.execBatch()) qFatal("%s.", qPrintable(q.lastError().text()));
             }
+            if (end)
+                break;
 
-            const QString &table = import.baseName();
-            qDebug("Creating table %s", qPrintable(table));
-            QSqlQuery q(db);
-            if (!q.exec("CREATE TABLE " + table + " (" + columns.join(", ") + ");"))
-                qFatal("%s.", qPrintable(q.lastError().text()));
-            if (!q.prepare("insert into " + table + " values (" + qMarks.join(", ") + ")"))
-                qFatal("%s.", qPrintable(q.lastError().text()));
-            foreach (const QVariantList &vl, variantLists)
-                q.addBindValue(vl);
-            if (!q.execBatch()) qFatal("%s.", qPrintable(q.lastError().text()));
+            line = QString::fromLocal8Bit(csv.readLine());
+            cells = splitLine(line);
         }
 
-        QSqlQuery q(db);
+        for (int i=0; i<header.size(); i++)
+            if (!q.exec("CREATE INDEX " + table + "_" + header[i] + " ON " + table + " (" + header[i] + ");"))
+                qFatal("%s.", qPrintable(q.lastError().text()));
+        if (!db.commit())
+            qFatal("%s.", qPrintable(db.lastError().text()));
+    }
+
+    void open()
+    {
+        br::File import = file.get<QString>("import", "");
+        QString query = file.get<QString>("query");
+        QString subset = file.get<QString>("subset", "");
+
+        if (!import.isNull())
+            this->import(import);
+
+        QSqlDatabase db = database();
         if (query.startsWith('\'') && query.endsWith('\''))
             query = query.mid(1, query.size()-2);
-        if (!q.exec(query))
+        if (query.endsWith(';'))
+            query.chop(1);
+
+        // Inspect the fields without reading any rows
+        QSqlQuery q(db);
+        if (!q.exec("SELECT * FROM (" + query + ") LIMIT 0"))
             qFatal("%s.", qPrintable(q.lastError().text()));
+        const QSqlRecord record = q.record();
+        if ((record.count() == 0) || (record.count() > 3))
+            qFatal("Query record expected one to three fields, got %d.", record.count());
+        hasMetadata = (record.count() >= 2);
+        const bool hasFilter = (record.count() >= 3);
+        labelName = hasMetadata ? record.fieldName(1) : QString("Label");
+        const QString label = hasMetadata ? "CAST(\"" + labelName + "\" AS TEXT)" : QString();
 
-        if ((q.record().count() == 0) || (q.record().count() > 3))
-            qFatal("Query record expected one to three fields, got %d.", q.record().count());
-        const bool hasMetadata = (q.record().count() >= 2);
-        const bool hasFilter = (q.record().count() >= 3);
+        results.reset(new QSqlQuery(db));
+        results->setForwardOnly(true);
 
-        QString labelName = "Label";
-        if (q.record().count() >= 2)
-            labelName = q.record().fieldName(1);
+        // Without a filter or subset, results are grouped by label in sorted order, which SQL can do as they are read
+        streaming = !hasFilter && subset.isEmpty();
+        if (streaming) {
+            if (!results->exec(hasMetadata ? "SELECT * FROM (" + query + ") ORDER BY " + label : query))
+                qFatal("%s.", qPrintable(results->lastError().text()));
+            return;
+        }
 
         // subset = seed:subjectMaxSize:numSubjects:subjectMinSize or
         // subset = seed:{Metadata,...,Metadata}:numSubjects
@@ -117,18 +194,27 @@ class dbGallery : public Gallery
             subjectMinSize = words.size() >= 4 ? QtUtils::toInt(words[3]) : subjectMaxSize;
         }
 
+        // Without a filter column the minimum subject size depends only on the label counts, so SQL drops small subjects
+        QString pushdown = query;
+        if (!hasFilter && hasMetadata && metadataFields.isEmpty() && (subjectMinSize > 1))
+            pushdown = "SELECT * FROM (" + query + ") WHERE " + label + " IN (SELECT " + label + " FROM (" + query + ") GROUP BY " + label +
+                       " HAVING COUNT(*) >= " + QString::number(subjectMinSize) + ")";
+        if (!results->exec(pushdown))
+            qFatal("%s.", qPrintable(results->lastError().text()));
+
         srand(seed);
 
         typedef QPair<QString,QString> Entry; // QPair<File,Metadata>
         QHash<QString, QList<Entry> > entries; // QHash<Label, QList<Entry> >
-        while (q.next()) {
-            if (hasFilter && (seed >= 0) && (qHash(q.value(2).toString()) % 2 != (uint)seed % 2)) continue; // Ensures training and testing filters don't overlap
+        while (results->next()) {
+            if (hasFilter && (seed >= 0) && (qHash(results->value(2).toString()) % 2 != (uint)seed % 2)) continue; // Ensures training and testing filters don't overlap
 
             if (metadataFields.isEmpty())
-                entries[hasMetadata ? q.value(1).toString() : ""].append(QPair<QString,QString>(q.value(0).toString(), hasFilter ? q.value(2).toString() : ""));
+                entries[hasMetadata ? results->value(1).toString() : ""].append(QPair<QString,QString>(results->value(0).toString(), hasFilter ? results->value(2).toString() : ""));
             else
-                entries[hasFilter ? q.value(2).toString() : ""].append(QPair<QString,QString>(q.value(0).toString(), hasMetadata ? q.value(1).toString() : ""));
+                entries[hasFilter ? results->value(2).toString() : ""].append(QPair<QString,QString>(results->value(0).toString(), hasMetadata ? results->value(1).toString() : ""));
         }
+        results.reset();
 
         QStringList labels = entries.keys();
         qSort(labels);
@@ -159,17 +245,51 @@ class dbGallery : public Gallery
                 if (entryList.size() > subjectMaxSize)
                     std::random_shuffle(entryList.begin(), entryList.end());
                 foreach (const Entry &entry, entryList.mid(0, subjectMaxSize)) {
-                    templates.append(File(entry.first));
-                    templates.last().file.set(labelName, label);
+                    grouped.append(File(entry.first));
+                    grouped.last().file.set(labelName, label);
                 }
                 numSubjects--;
             }
         }
+    }
 
-        db.close();
-#endif // BR_EMBEDDED
+    void close()
+    {
+        results.reset();
+        grouped.clear();
+        if (!connection.isEmpty()) {
+            QSqlDatabase::database(connection).close();
+            QSqlDatabase::removeDatabase(connection);
+            connection.clear();
+        }
+    }
 
+    TemplateList readBlock(bool *done)
+    {
+        TemplateList templates;
         *done = true;
+
+#ifndef BR_EMBEDDED
+        if (connection.isEmpty())
+            open();
+
+        if (streaming) {
+            while ((templates.size() < readBlockSize) && results->next()) {
+                templates.append(File(results->value(0).toString()));
+                templates.last().file.set(labelName, hasMetadata ? results->value(1).toString() : QString());
+            }
+            *done = (templates.size() < readBlockSize);
+        } else {
+            templates = grouped.mid(0, readBlockSize);
+            grouped = grouped.mid(templates.size());
+            *done = grouped.isEmpty();
+        }
+
+        // Like the other galleries, reading again after the last block starts over
+        if (*done)
+            close();
+#endif // BR_EMBEDDED
+
         return templates;
     }
 
@@ -183,6 +303,14 @@ class dbGallery : public Gallery
     {
         //
     }
+
+public:
+    dbGallery() : streaming(false), hasMetadata(false) {}
+
+    ~dbGallery()
+    {
+        close();
+    }
 };
 
 BR_REGISTER(Gallery, dbGallery)
@@ -14,7 +14,7 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtNetwork>
+#include <QThread>
 
 #include <openbr/plugins/openbr_internal.h>
 
@@ -24,11 +24,44 @@ namespace br
 /*!
  * \ingroup inputs
  * \brief Input from a google image search.
+ *
+ * Result pages are requested together through the connection pool shared with Download, and each result's image is
+ * prefetched as soon as its page arrives. readBlock returns the results of whichever pages have finished,
+ * the rest keep downloading in the background.
+ * \br_property int images Number of results to request, in pages of 20. Default is 100.
+ * \br_property double rate Maximum requests started per second by the shared pool, 0 for no limit. Default is 2.
  * \author Josh Klontz \cite jklontz
  */
 class googleGallery : public Gallery
 {
     Q_OBJECT
+    Q_PROPERTY(int images READ get_images WRITE set_images RESET reset_images STORED false)
+    Q_PROPERTY(double rate READ get_rate WRITE set_rate RESET reset_rate STORED false)
+    BR_PROPERTY(int, images, 100)
+    BR_PROPERTY(double, rate, 2)
+
+    QStringList pages; // Result pages not yet read
+    bool started;
+
+public:
+    googleGallery() : started(false) {}
+
+private:
+    TemplateList parse(const QString &data, const QString &query) const
+    {
+        TemplateList templates;
+        QStringList words = data.split("imgurl=");
+        words.takeFirst(); // Remove header
+        foreach (const QString &word, words) {
+            QString url = word.left(word.indexOf("&amp"));
+            url = url.replace("%2520","%20");
+            int junk = url.indexOf('%', url.lastIndexOf('.'));
+            if (junk != -1) url = url.left(junk);
+            prefetch(url);
+            templates.append(File(url,query));
+        }
+        return templates;
+    }
 
     TemplateList readBlock(bool *done)
     {
@@ -38,30 +71,30 @@ class googleGallery : public Gallery
         QString query = file.name.left(file.name.size()-7); // remove ".google"
 
 #ifndef BR_EMBEDDED
-        QNetworkAccessManager networkAccessManager;
-        for (int i=0; i<100; i+=20) { // Retrieve 100 images
-            QNetworkRequest request(search.arg(query, QString::number(i)));
-            QNetworkReply *reply = networkAccessManager.get(request);
-
-            while (!reply->isFinished())
-                QThread::yieldCurrentThread();
-
-            QString data(reply->readAll());
-            delete reply;
-
-            QStringList words = data.split("imgurl=");
-            words.takeFirst(); // Remove header
-            foreach (const QString &word, words) {
-                QString url = word.left(word.indexOf("&amp"));
-                url = url.replace("%2520","%20");
-                int junk = url.indexOf('%', url.lastIndexOf('.'));
-                if (junk != -1) url = url.left(junk);
-                templates.append(File(url,query));
+        if (!started) {
+            started = true;
+            setFetchRate(rate);
+            for (int i=0; i<images; i+=20)
+                pages.append(search.arg(query, QString::number(i)));
+        }
+
+        // Wait for at least one page, then return every page that has finished
+        while (templates.isEmpty() && !pages.isEmpty()) {
+            for (int i=pages.size()-1; i>=0; i--) {
+                QByteArray data;
+                QString error;
+                if (!pollFetch(pages[i], data, error))
+                    continue;
+                if (error.isEmpty()) templates.append(parse(QString(data), query));
+                else                 qWarning("%s: %s", qPrintable(pages[i]), qPrintable(error));
+                pages.removeAt(i);
             }
+            if (templates.isEmpty() && !pages.isEmpty())
+                QThread::msleep(10);
         }
 #endif // BR_EMBEDDED
 
-        *done = true;
+        *done = pages.isEmpty();
         return templates;
     }
 
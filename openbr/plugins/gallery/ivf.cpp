@@ -0,0 +1,83 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <algorithm>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief An inverted file index of IVFPQ codes.
+ *
+ * Only the last matrix of each template, its code from IVFPQTransform, is written.
+ * Templates are buffered and written in IVFCell order when the gallery is closed,
+ * so IVFPQDistance can find the templates in each probed cell by binary search.
+ * \author Unknown \cite unknown
+ */
+class ivfGallery : public Gallery
+{
+    Q_OBJECT
+
+    TemplateList templates;
+
+    ~ivfGallery()
+    {
+        if (templates.isEmpty())
+            return;
+
+        // Templates without a cell sort last, matching IVFPQDistance
+        QList< QPair<int,int> > order; // QPair<cell,index>
+        for (int i=0; i<templates.size(); i++)
+            order.append(QPair<int,int>(templates[i].file.get<int>("IVFCell", std::numeric_limits<int>::max()), i));
+        std::stable_sort(order.begin(), order.end());
+
+        QByteArray data;
+        QDataStream stream(&data, QFile::WriteOnly);
+        for (int i=0; i<order.size(); i++)
+            stream << templates[order[i].second];
+        QtUtils::writeFile(file, data);
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        *done = true;
+        QByteArray data;
+        QtUtils::readFile(file, data);
+        return TemplateList::fromBuffer(data);
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        Template code(t.file);
+        if (!t.isEmpty())
+            code.append(t.last());
+        templates.append(code);
+    }
+};
+
+BR_REGISTER(Gallery, ivfGallery)
+
+} // namespace br
+
+#include "gallery/ivf.moc"
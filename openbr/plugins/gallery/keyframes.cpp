@@ -14,6 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QFutureSynchronizer>
+#include <QtConcurrent>
+
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
 #include <openbr/core/opencvutils.h>
@@ -31,14 +34,104 @@ using namespace cv;
 namespace br
 {
 
+// Seeks straight to key frames with its own demuxer and decoder, so several can decode different GOPs at once
+class KeyframeDecoder
+{
+    AVFormatContext *avFormatCtx;
+    AVCodecContext *avCodecCtx;
+    SwsContext *avSwsCtx;
+    AVFrame *frame;
+    int streamID;
+
+public:
+    KeyframeDecoder()
+        : avFormatCtx(NULL), avCodecCtx(NULL), avSwsCtx(NULL), frame(NULL), streamID(-1) {}
+
+    ~KeyframeDecoder()
+    {
+        if (avSwsCtx)    sws_freeContext(avSwsCtx);
+        if (frame)       av_free(frame);
+        if (avCodecCtx)  avcodec_close(avCodecCtx);
+        if (avFormatCtx) avformat_close_input(&avFormatCtx);
+    }
+
+    bool open(const QString &path, int stream)
+    {
+        if ((avformat_open_input(&avFormatCtx, path.toStdString().c_str(), NULL, NULL) != 0) ||
+            (avformat_find_stream_info(avFormatCtx, NULL) < 0) ||
+            (stream >= (int)avFormatCtx->nb_streams))
+            return false;
+
+        streamID = stream;
+        avCodecCtx = avFormatCtx->streams[streamID]->codec;
+        avCodecCtx->thread_count = 1; // Parallelism comes from decoding several GOPs at once
+        AVCodec *avCodec = avcodec_find_decoder(avCodecCtx->codec_id);
+        if (!avCodec || (avcodec_open2(avCodecCtx, avCodec, NULL) < 0)) {
+            avCodecCtx = NULL;
+            return false;
+        }
+
+        frame = av_frame_alloc();
+        return true;
+    }
+
+    // Decodes only the key frame at timestamp, leaving dst empty on failure
+    void decode(int64_t timestamp, Mat *dst)
+    {
+        *dst = Mat();
+        if (av_seek_frame(avFormatCtx, streamID, timestamp, AVSEEK_FLAG_BACKWARD) < 0)
+            return;
+        avcodec_flush_buffers(avCodecCtx);
+
+        AVPacket packet;
+        av_init_packet(&packet);
+        int got = 0;
+        while (!got && (av_read_frame(avFormatCtx, &packet) >= 0)) {
+            const bool key = (packet.stream_index == streamID) && (packet.flags & AV_PKT_FLAG_KEY);
+            if (key)
+                avcodec_decode_video2(avCodecCtx, frame, &got, &packet);
+            av_free_packet(&packet);
+            if (key && !got) {
+                // Drain the decoder rather than feeding it the rest of the GOP
+                AVPacket empty;
+                av_init_packet(&empty);
+                empty.data = NULL;
+                empty.size = 0;
+                avcodec_decode_video2(avCodecCtx, frame, &got, &empty);
+                break;
+            }
+        }
+        if (!got)
+            return;
+
+        avSwsCtx = sws_getCachedContext(avSwsCtx, avCodecCtx->width, avCodecCtx->height, avCodecCtx->pix_fmt,
+                                        avCodecCtx->width, avCodecCtx->height, AV_PIX_FMT_BGR24,
+                                        SWS_BICUBIC, NULL, NULL, NULL);
+        dst->create(avCodecCtx->height, avCodecCtx->width, CV_8UC3);
+        uint8_t *data[4] = { dst->data, NULL, NULL, NULL };
+        int linesize[4] = { (int)dst->step, 0, 0, 0 };
+        sws_scale(avSwsCtx, frame->data, frame->linesize, 0, avCodecCtx->height, data, linesize);
+    }
+};
+
 /*!
  * \ingroup galleries
  * \brief Read key frames of a video with LibAV
+ *
+ * When the container has a seek index, as mp4 files do, the key frames are found in the index and decoded directly,
+ * without decoding the frames between them, spread over several decoders by GOP.
+ * Otherwise the gallery seeks from one key frame to the next, decoding until a frame is produced.
+ * \br_property bool useIndex Decode the key frames listed in the container's seek index when there is one. Default is true.
+ * \br_property int threads Key frames decoded concurrently from the seek index. Default is Context::parallelism.
  * \author Ben Klein \cite bhklein
  */
 class keyframesGallery : public Gallery
 {
     Q_OBJECT
+    Q_PROPERTY(bool useIndex READ get_useIndex WRITE set_useIndex RESET reset_useIndex STORED false)
+    Q_PROPERTY(int threads READ get_threads WRITE set_threads RESET reset_threads STORED false)
+    BR_PROPERTY(bool, useIndex, true)
+    BR_PROPERTY(int, threads, Globals->parallelism)
 
 public:
     int64_t idx;
@@ -55,6 +148,7 @@ public:
         cvt_frame = NULL;
         buffer = NULL;
         opened = false;
+        indexed = false;
         streamID = -1;
         fps = 0.f;
         time_base = 0.f;
@@ -66,6 +160,62 @@ public:
         release();
     }
 
+    // Key frame timestamps from the container's seek index, empty if it has none
+    QList<int64_t> indexedKeyframes() const
+    {
+        QList<int64_t> timestamps;
+        const AVStream *stream = avFormatCtx->streams[streamID];
+        for (int i=0; i<stream->nb_index_entries; i++)
+            if (stream->index_entries[i].flags & AVINDEX_KEYFRAME)
+                timestamps.append(stream->index_entries[i].timestamp);
+        return timestamps;
+    }
+
+    Template keyframe(const Mat &m, int64_t timestamp) const
+    {
+        Template output(file, m);
+        QString URL = file.get<QString>("URL", file.name);
+        output.file.set("URL", URL + "#t=" + QString::number((int)(timestamp * time_base)) + "s");
+        output.file.set("timestamp", QString::number((int)(timestamp * time_base * 1000)));
+        output.file.set("frame", QString::number(timestamp * time_base * fps));
+        return output;
+    }
+
+    TemplateList readIndexedBlock(bool *done)
+    {
+        if (decoders.isEmpty()) {
+            const int count = std::min(std::max(1, threads), keyframes.size());
+            for (int i=0; i<count; i++) {
+                decoders.append(QSharedPointer<KeyframeDecoder>(new KeyframeDecoder()));
+                if (!decoders.last()->open(QtUtils::getAbsolutePath(file.name), streamID))
+                    qFatal("Failed to open %s for reading.", qPrintable(file.name));
+            }
+        }
+
+        const int count = std::min(decoders.size(), keyframes.size());
+        QList<int64_t> timestamps;
+        for (int i=0; i<count; i++)
+            timestamps.append(keyframes.takeFirst());
+
+        QVector<Mat> mats(count);
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<count; i++)
+            futures.addFuture(QtConcurrent::run(decoders[i].data(), &KeyframeDecoder::decode, timestamps[i], &mats[i]));
+        futures.waitForFinished();
+
+        TemplateList dst;
+        for (int i=0; i<count; i++)
+            if (mats[i].data)
+                dst.append(keyframe(mats[i], timestamps[i]));
+
+        *done = keyframes.isEmpty();
+        if (*done) {
+            decoders.clear();
+            release();
+        }
+        return dst;
+    }
+
     virtual void deferredInit()
     {
         if (avformat_open_input(&avFormatCtx, QtUtils::getAbsolutePath(file.name).toStdString().c_str(), NULL, NULL) != 0) {
@@ -123,8 +273,12 @@ public:
     {
         if (!opened) {
             deferredInit();
+            indexed = useIndex && !(keyframes = indexedKeyframes()).isEmpty();
         }
 
+        if (indexed)
+            return readIndexedBlock(done);
+
         Template output;
         output.file = file;
 
@@ -163,12 +317,8 @@ public:
                 *done = true;
             avcodec_flush_buffers(avCodecCtx);
 
-            QString URL = file.get<QString>("URL", file.name);
-            output.file.set("URL", URL + "#t=" + QString::number((int)(idx * time_base)) + "s");
-            output.file.set("timestamp", QString::number((int)(idx * time_base * 1000)));
-            output.file.set("frame", QString::number(idx * time_base * fps));
             TemplateList dst;
-            dst.append(output);
+            dst.append(keyframe(output.m(), idx));
             return dst;
         }
         *done = true;
@@ -205,7 +355,9 @@ protected:
     AVFrame *frame;
     AVFrame *cvt_frame;
     uint8_t *buffer;
-    bool opened;
+    bool opened, indexed;
+    QList<int64_t> keyframes; // Not yet read, when indexed
+    QList< QSharedPointer<KeyframeDecoder> > decoders;
     int streamID;
     float fps;
     float time_base;
@@ -0,0 +1,388 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/hwcontext.h>
+#include <libswscale/swscale.h>
+}
+
+// avcodec_get_hw_config is only available from libavcodec 58
+#define BR_LIBAV_HWACCEL (LIBAVCODEC_VERSION_MAJOR >= 58)
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief Read a video frame by frame with LibAV
+ *
+ * Frames are decoded on threads of LibAV's own, optionally on the GPU, and converted
+ * straight into the memory of the output matrix rather than copied out of a decoder buffer.
+ * Output matrices are reused once every template referencing them has been released, as in videoGallery.
+ * Use it in place of videoGallery with the plugin argument, e.g. <tt>video.mp4[plugin=libav,hwaccel=vaapi]</tt>.
+ * \br_property QString hwaccel LibAV hardware device type to decode on, e.g. vaapi, cuda (NVDEC) or qsv (QuickSync). Falls back to the CPU if unavailable.
+ * \br_property int threads Number of decode threads, 0 lets LibAV choose.
+ * \br_property int buffers Maximum number of frame buffers kept for reuse.
+ * \br_property int begin Index of the first frame to read. The gallery seeks to the key frame before it and decodes forward from there.
+ * \author Unknown \cite unknown
+ */
+class libavGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(QString hwaccel READ get_hwaccel WRITE set_hwaccel RESET reset_hwaccel STORED false)
+    Q_PROPERTY(int threads READ get_threads WRITE set_threads RESET reset_threads STORED false)
+    Q_PROPERTY(int buffers READ get_buffers WRITE set_buffers RESET reset_buffers STORED false)
+    Q_PROPERTY(int begin READ get_begin WRITE set_begin RESET reset_begin STORED false)
+    BR_PROPERTY(QString, hwaccel, "")
+    BR_PROPERTY(int, threads, 0)
+    BR_PROPERTY(int, buffers, 32)
+    BR_PROPERTY(int, begin, 0)
+
+public:
+    libavGallery()
+    {
+#if LIBAVFORMAT_VERSION_MAJOR < 58
+        av_register_all();
+#endif
+        avFormatCtx = NULL;
+        avCodecCtx = NULL;
+        avSwsCtx = NULL;
+        hwDeviceCtx = NULL;
+        frame = NULL;
+        swFrame = NULL;
+        packet = NULL;
+        hwPixelFormat = AV_PIX_FMT_NONE;
+        opened = draining = false;
+        streamID = -1;
+        idx = 0;
+        frames = -1;
+        seekTarget = AV_NOPTS_VALUE;
+        nextBuffer = 0;
+    }
+
+    ~libavGallery()
+    {
+        release();
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        if (!opened)
+            open();
+
+        *done = false;
+        if (!decodeFrame()) {
+            release();
+            *done = true;
+            return TemplateList();
+        }
+
+        // After seeking, discard the frames between the key frame and the first one requested
+        while ((seekTarget != AV_NOPTS_VALUE) && (frame->best_effort_timestamp != AV_NOPTS_VALUE) && (frame->best_effort_timestamp < seekTarget)) {
+            av_frame_unref(frame);
+            if (!decodeFrame()) {
+                release();
+                *done = true;
+                return TemplateList();
+            }
+        }
+        seekTarget = AV_NOPTS_VALUE;
+
+        // Frames decoded on the GPU are first transferred to system memory
+        AVFrame *source = frame;
+        if (frame->format == hwPixelFormat) {
+            if (av_hwframe_transfer_data(swFrame, frame, 0) < 0)
+                qFatal("Failed to transfer a decoded frame of %s from the GPU.", qPrintable(file.name));
+            source = swFrame;
+        }
+
+        // Convert from native format directly into the output matrix
+        Mat m = frameBuffer(source->height, source->width);
+        avSwsCtx = sws_getCachedContext(avSwsCtx,
+                                        source->width, source->height, AVPixelFormat(source->format),
+                                        source->width, source->height, AV_PIX_FMT_BGR24,
+                                        SWS_BILINEAR, NULL, NULL, NULL);
+        uint8_t *dstData[1] = { m.data };
+        int dstLinesize[1] = { int(m.step) };
+        sws_scale(avSwsCtx, source->data, source->linesize, 0, source->height, dstData, dstLinesize);
+
+        Template output;
+        output.file = file;
+        output.m() = m;
+        output.file.set("progress", idx++);
+        const AVRational timeBase = avFormatCtx->streams[streamID]->time_base;
+        output.file.set("timestamp", QString::number(qint64(frame->best_effort_timestamp * av_q2d(timeBase) * 1000)));
+
+        av_frame_unref(frame);
+        av_frame_unref(swFrame);
+
+        TemplateList dst;
+        dst.append(output);
+        return dst;
+    }
+
+    void write(const Template &t)
+    {
+        (void)t; qFatal("Not implemented");
+    }
+
+    // The frame count in the container, estimated from the duration if it isn't recorded
+    qint64 totalSize()
+    {
+        if (frames == -1) {
+            if (!opened)
+                open();
+            const AVStream *stream = avFormatCtx->streams[streamID];
+            frames = stream->nb_frames;
+            if ((frames <= 0) && (stream->duration != AV_NOPTS_VALUE) && (stream->avg_frame_rate.num > 0))
+                frames = qint64(stream->duration * av_q2d(stream->time_base) * av_q2d(stream->avg_frame_rate));
+            if (frames <= 0)
+                frames = std::numeric_limits<qint64>::max();
+        }
+        return frames;
+    }
+
+    qint64 position() { return idx; }
+
+private:
+    AVFormatContext *avFormatCtx;
+    AVCodecContext *avCodecCtx;
+    SwsContext *avSwsCtx;
+    AVBufferRef *hwDeviceCtx;
+    AVFrame *frame;
+    AVFrame *swFrame;
+    AVPacket *packet;
+    AVPixelFormat hwPixelFormat;
+    bool opened, draining;
+    int streamID;
+    qint64 idx, frames;
+    int64_t seekTarget; // Timestamp of the frame at begin, AV_NOPTS_VALUE once reached
+
+    QList<Mat> frameBuffers;
+    int nextBuffer;
+
+    static AVPixelFormat getFormat(AVCodecContext *ctx, const AVPixelFormat *formats)
+    {
+        const AVPixelFormat wanted = *static_cast<const AVPixelFormat*>(ctx->opaque);
+        for (const AVPixelFormat *format = formats; *format != AV_PIX_FMT_NONE; format++)
+            if (*format == wanted)
+                return *format;
+
+        // The decoder can't output to the device for this stream
+        return avcodec_default_get_format(ctx, formats);
+    }
+
+    void open()
+    {
+        if (avformat_open_input(&avFormatCtx, QtUtils::getAbsolutePath(file.name).toStdString().c_str(), NULL, NULL) != 0)
+            qFatal("Failed to open %s for reading.", qPrintable(file.name));
+        if (avformat_find_stream_info(avFormatCtx, NULL) < 0)
+            qFatal("Failed to read stream info for %s.", qPrintable(file.name));
+
+        AVCodec *avCodec = NULL;
+        streamID = av_find_best_stream(avFormatCtx, AVMEDIA_TYPE_VIDEO, -1, -1, &avCodec, 0);
+        if ((streamID < 0) || (avCodec == NULL))
+            qFatal("Failed to find a decodable video stream for %s", qPrintable(file.name));
+
+        avCodecCtx = avcodec_alloc_context3(avCodec);
+        if (avcodec_parameters_to_context(avCodecCtx, avFormatCtx->streams[streamID]->codecpar) < 0)
+            qFatal("Failed to read codec parameters for %s", qPrintable(file.name));
+        avCodecCtx->thread_count = threads;
+        avCodecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+        if (!hwaccel.isEmpty())
+            initHardware(avCodec);
+
+        if (avcodec_open2(avCodecCtx, avCodec, NULL) < 0)
+            qFatal("Could not open codec for file %s", qPrintable(file.name));
+
+        frame = av_frame_alloc();
+        swFrame = av_frame_alloc();
+        packet = av_packet_alloc();
+        draining = false;
+        idx = 0;
+        seekTarget = AV_NOPTS_VALUE;
+        opened = true;
+
+        if (begin > 0)
+            seek();
+    }
+
+    // Seek to the key frame at or before frame begin, readBlock decodes forward to it
+    void seek()
+    {
+        const AVStream *stream = avFormatCtx->streams[streamID];
+        if (stream->avg_frame_rate.num <= 0)
+            qFatal("Can't seek to frame %d of %s without a known frame rate.", begin, qPrintable(file.name));
+
+        int64_t target = av_rescale_q(begin, av_inv_q(stream->avg_frame_rate), stream->time_base);
+        if (stream->start_time != AV_NOPTS_VALUE)
+            target += stream->start_time;
+        if (av_seek_frame(avFormatCtx, streamID, target, AVSEEK_FLAG_BACKWARD) < 0)
+            qFatal("Failed to seek to frame %d of %s.", begin, qPrintable(file.name));
+
+        avcodec_flush_buffers(avCodecCtx);
+        seekTarget = target;
+        idx = begin;
+    }
+
+    void initHardware(AVCodec *avCodec)
+    {
+#if BR_LIBAV_HWACCEL
+        const AVHWDeviceType type = av_hwdevice_find_type_by_name(qPrintable(hwaccel));
+        if (type == AV_HWDEVICE_TYPE_NONE) {
+            qWarning("Unknown hardware device type %s, decoding %s on the CPU.", qPrintable(hwaccel), qPrintable(file.name));
+            return;
+        }
+
+        for (int i=0; const AVCodecHWConfig *config = avcodec_get_hw_config(avCodec, i); i++)
+            if ((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) && (config->device_type == type)) {
+                hwPixelFormat = config->pix_fmt;
+                break;
+            }
+
+        if (hwPixelFormat == AV_PIX_FMT_NONE) {
+            qWarning("%s can't decode %s with %s, decoding on the CPU.", avCodec->name, qPrintable(file.name), qPrintable(hwaccel));
+            return;
+        }
+
+        if (av_hwdevice_ctx_create(&hwDeviceCtx, type, NULL, NULL, 0) < 0) {
+            qWarning("Failed to open %s device, decoding %s on the CPU.", qPrintable(hwaccel), qPrintable(file.name));
+            hwPixelFormat = AV_PIX_FMT_NONE;
+            return;
+        }
+
+        avCodecCtx->hw_device_ctx = av_buffer_ref(hwDeviceCtx);
+        avCodecCtx->opaque = &hwPixelFormat;
+        avCodecCtx->get_format = getFormat;
+#else
+        (void) avCodec;
+        qWarning("LibAV is too old for hardware decoding, decoding %s on the CPU.", qPrintable(file.name));
+#endif
+    }
+
+    // Returns false once the stream has no more frames
+    bool decodeFrame()
+    {
+        forever {
+            const int ret = avcodec_receive_frame(avCodecCtx, frame);
+            if (ret == 0)
+                return true;
+            if (ret != AVERROR(EAGAIN))
+                return false; // AVERROR_EOF once drained, or a decoding error
+
+            // The decoder needs more input
+            if (av_read_frame(avFormatCtx, packet) < 0) {
+                if (draining)
+                    return false;
+                // Flush the frames the decoder is still holding
+                avcodec_send_packet(avCodecCtx, NULL);
+                draining = true;
+                continue;
+            }
+
+            if (packet->stream_index == streamID)
+                avcodec_send_packet(avCodecCtx, packet);
+            av_packet_unref(packet);
+        }
+    }
+
+    // A BGR matrix nobody else references, allocating one only if none is free
+    Mat frameBuffer(int rows, int cols)
+    {
+        for (int i=0; i<frameBuffers.size(); i++) {
+            const Mat &buffer = frameBuffers[i];
+            if (buffer.refcount && (*buffer.refcount == 1) && (buffer.rows == rows) && (buffer.cols == cols))
+                return buffer;
+        }
+
+        // Every buffer is still in use downstream, or the resolution changed
+        const Mat buffer(rows, cols, CV_8UC3);
+        if (frameBuffers.size() < buffers)
+            frameBuffers.append(buffer);
+        else if (!frameBuffers.isEmpty())
+            frameBuffers[nextBuffer++ % frameBuffers.size()] = buffer;
+        return buffer;
+    }
+
+    void release()
+    {
+        if (avSwsCtx)     sws_freeContext(avSwsCtx);
+        if (frame)        av_frame_free(&frame);
+        if (swFrame)      av_frame_free(&swFrame);
+        if (packet)       av_packet_free(&packet);
+        if (avCodecCtx)   avcodec_free_context(&avCodecCtx);
+        if (hwDeviceCtx)  av_buffer_unref(&hwDeviceCtx);
+        if (avFormatCtx)  avformat_close_input(&avFormatCtx);
+        avSwsCtx = NULL;
+        hwPixelFormat = AV_PIX_FMT_NONE;
+        opened = false;
+    }
+};
+
+BR_REGISTER(Gallery, libavGallery)
+
+/*!
+ * \ingroup formats
+ * \brief Read all frames of a video with LibAV
+ * \see libavGallery
+ * \author Unknown \cite unknown
+ */
+class libavFormat : public Format
+{
+    Q_OBJECT
+
+public:
+    Template read() const
+    {
+        Template frames;
+        if (!file.exists())
+            return frames;
+
+        File videoFile = file;
+        videoFile.set("plugin", "libav");
+        videoFile.set("buffers", 0); // Every frame is kept
+        QScopedPointer<Gallery> gallery(Gallery::make(videoFile));
+
+        bool done = false;
+        while (!done)
+            foreach (const Template &t, gallery->readBlock(&done))
+                frames.append(t.m());
+        return frames;
+    }
+
+    void write(const Template &t) const
+    {
+        (void) t;
+        qFatal("Not implemented");
+    }
+};
+
+BR_REGISTER(Format, libavFormat)
+
+} // namespace br
+
+#include "gallery/libav.moc"
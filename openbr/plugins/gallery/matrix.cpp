@@ -15,7 +15,9 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/bee.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/qtutils.h>
 
 namespace br
 {
@@ -23,6 +25,10 @@ namespace br
 /*!
  * \ingroup galleries
  * \brief Combine all Templates into one large matrix and process it as a Format
+ *
+ * For the float .mtx and .bin formats the matrix is written one row per template as they arrive,
+ * with the row count patched into the header on close, and read back through a memory map
+ * without loading it into memory. Other formats hold the templates in memory until the gallery is closed.
  * \author Josh Klontz \cite jklontz
  */
 class matrixGallery : public Gallery
@@ -31,10 +37,25 @@ class matrixGallery : public Gallery
     Q_PROPERTY(const QString extension READ get_extension WRITE set_extension RESET reset_extension STORED false)
     BR_PROPERTY(QString, extension, "mtx")
 
+    static const int RowsDigits = 10; // Width of the zero padded row count in .mtx headers
+
     TemplateList templates;
 
+    // Streaming writes
+    QFile output;
+    qint64 rowsOffset;
+    int rows, cols;
+
     ~matrixGallery()
     {
+        if (output.isOpen()) {
+            output.seek(rowsOffset);
+            if (extension == "mtx") output.write(qPrintable(QString("%1").arg(rows, RowsDigits, 10, QChar('0'))));
+            else                    output.write((const char*) &rows, 4);
+            output.close();
+            return;
+        }
+
         if (templates.isEmpty())
             return;
 
@@ -47,15 +68,107 @@ class matrixGallery : public Gallery
         return file.name.left(file.name.size() - file.suffix().size()) + extension;
     }
 
+    bool streamable() const
+    {
+        return (extension == "mtx") || ((extension == "bin") && !getFormat().get<bool>("raw", false));
+    }
+
+    // A view of a float matrix in the mapped file, or an empty matrix if it must be read through the Format
+    cv::Mat mapped(const QString &fileName, QString *target, QString *query) const
+    {
+        qint64 size;
+        const uchar *data = mapFile(fileName, &size);
+        if (!data)
+            return cv::Mat();
+
+        qint64 offset;
+        int r, c;
+        if (extension == "mtx") {
+            // Distance, mask and quantized matrices need decoding
+            const QByteArray header = QByteArray::fromRawData((const char*) data, int(std::min(size, qint64(4096))));
+            const QList<QByteArray> lines = header.split('\n');
+            if ((lines.size() < 5) || !lines[0].startsWith("S2"))
+                return cv::Mat();
+            const QList<QByteArray> words = lines[3].split(' ');
+            if ((words.size() < 3) || (words[0] != "MF") || getFormat().get<bool>("negate", false))
+                return cv::Mat();
+            *target = lines[1].simplified();
+            *query = lines[2].simplified();
+            r = words[1].toInt();
+            c = words[2].toInt();
+            offset = lines[0].size() + lines[1].size() + lines[2].size() + lines[3].size() + 4;
+        } else {
+            if (size < 8)
+                return cv::Mat();
+            r = ((const quint32*) data)[0];
+            c = ((const quint32*) data)[1];
+            offset = 8;
+        }
+
+        if (offset + qint64(r) * c * sizeof(float) > size)
+            qFatal("Truncated matrix %s.", qPrintable(fileName));
+        // const_cast is safe because the mapping is read-only and the view is never written
+        return cv::Mat(r, c, CV_32FC1, const_cast<uchar*>(data + offset));
+    }
+
     TemplateList readBlock(bool *done)
     {
         *done = true;
-        return TemplateList() << getFormat();
+        const File format = getFormat();
+        if (streamable()) {
+            QString target, query;
+            const cv::Mat m = mapped(format.name, &target, &query);
+            if (m.data) {
+                Template t(format, m);
+                if (extension == "mtx") {
+                    t.file.set("Target", target);
+                    t.file.set("Query", query);
+                }
+                return TemplateList() << t;
+            }
+        }
+        return TemplateList() << format;
     }
 
     void write(const Template &t)
     {
-        templates.append(t);
+        if (!streamable()) {
+            templates.append(t);
+            return;
+        }
+
+        cv::Mat m = t.m();
+        if (m.type() != CV_32FC1)
+            m.convertTo(m, CV_32F);
+        if (!m.isContinuous())
+            m = m.clone();
+
+        if (!output.isOpen()) {
+            const QString fileName = getFormat().name;
+            unmapFile(fileName);
+            output.setFileName(fileName);
+            QtUtils::touchDir(output);
+            if (!output.open(QFile::WriteOnly))
+                qFatal("Unable to open %s for writing.", qPrintable(fileName));
+
+            rows = 0;
+            cols = int(m.total());
+            if (extension == "mtx") {
+                QByteArray header = BEE::matrixHeader(0, cols, false, "Unknown_Target", "Unknown_Query");
+                rowsOffset = header.indexOf(' ', header.lastIndexOf("\nM")) + 1;
+                header.replace(int(rowsOffset), 1, QByteArray(RowsDigits, '0'));
+                output.write(header);
+            } else {
+                rowsOffset = 0;
+                output.write((const char*) &rows, 4);
+                output.write((const char*) &cols, 4);
+            }
+        }
+
+        if (int(m.total()) != cols)
+            qFatal("Matrix gallery templates must all have %d elements.", cols);
+        output.write((const char*) m.data, qint64(cols) * sizeof(float));
+        rows++;
     }
 };
 
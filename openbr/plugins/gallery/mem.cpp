@@ -32,11 +32,19 @@ class MemoryGalleries : public Initializer
 
     void finalize() const
     {
+        for (QHash<File, TemplateList>::const_iterator i = galleries.constBegin(); i != galleries.constEnd(); ++i)
+            Context::trackMemory(subsystem(i.key()), -i.value().bytes<qint64>());
         galleries.clear();
     }
 
 public:
     static QHash<File, TemplateList> galleries; /*!< TODO */
+
+    // Each gallery's matrices are accounted separately, see Context::trackMemory()
+    static QString subsystem(const File &file)
+    {
+        return "memGallery " + file.name;
+    }
 };
 
 QHash<File, TemplateList> MemoryGalleries::galleries;
@@ -58,10 +66,13 @@ class memGallery : public Gallery
     {
         block = 0;
         File galleryFile = file.name.mid(0, file.name.size()-4);
-        if ((galleryFile.suffix() == "gal") && galleryFile.exists() && !MemoryGalleries::galleries.contains(file)) {
+        // Mapped galleries are wrapped without copying, their matrices reference the mapped file
+        if (((galleryFile.suffix() == "gal") || (galleryFile.suffix() == "mmap") || (galleryFile.suffix() == "fgal")) && galleryFile.exists() && !MemoryGalleries::galleries.contains(file)) {
             QSharedPointer<Gallery> gallery(Factory<Gallery>::make(galleryFile));
             MemoryGalleries::galleries[file] = gallery->read();
+            packTemplates(MemoryGalleries::galleries[file]);
             gallerySize = MemoryGalleries::galleries[file].size();
+            Context::trackMemory(MemoryGalleries::subsystem(file), MemoryGalleries::galleries[file].bytes<qint64>());
         }
     }
 
@@ -80,6 +91,7 @@ class memGallery : public Gallery
     void write(const Template &t)
     {
         MemoryGalleries::galleries[file].append(t);
+        Context::trackMemory(MemoryGalleries::subsystem(file), t.bytes());
     }
 
     qint64 totalSize()
@@ -114,20 +126,12 @@ FileList FileList::fromGallery(const File &rFile, bool cache)
 
     TemplateList templates;
     // OK we read the data in some form, does the gallery type containing matrices?
-    if ((QStringList() << "gal" << "mem" << "template" << "ut").contains(file.suffix())) {
-        // Retrieve it block by block, dropping matrices from read templates.
+    if ((QStringList() << "gal" << "mem" << "template" << "ut" << "mmap" << "fgal" << "zgal" << "ivf").contains(file.suffix())) {
+        // Retrieve only the metadata, galleries that index it separately skip reading matrices entirely.
         QScopedPointer<Gallery> gallery(Gallery::make(file));
         gallery->set_readBlockSize(10);
-        bool done = false;
-        while (!done)
-        {
-            TemplateList tList = gallery->readBlock(&done);
-            for (int i=0; i < tList.size();i++)
-            {
-                tList[i].clear();
-                templates.append(tList[i].file);
-            }
-        }
+        foreach (const File &f, gallery->files())
+            templates.append(f);
     }
     else {
         // this is a gallery format that doesn't include matrices, so we can just read it
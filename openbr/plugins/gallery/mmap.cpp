@@ -0,0 +1,696 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QBuffer>
+#include <QMutex>
+#include <algorithm>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+using namespace cv;
+
+namespace br
+{
+
+// On-disk layout of a .mmap gallery:
+//   MappedHeader
+//   feature block   (every matrix, 16-byte aligned, contiguous)
+//   metadata block  (QDataStream serialized br::File per template)
+//   MappedTemplate[templateCount]
+//   MappedMatrix[matrixCount]
+struct MappedHeader
+{
+    char magic[8];
+    quint32 version;
+    quint32 reserved;
+    quint64 templateCount;
+    quint64 matrixCount;
+    quint64 metadataOffset;
+    quint64 metadataSize;
+    quint64 templateTableOffset;
+    quint64 matrixTableOffset;
+};
+
+struct MappedTemplate
+{
+    quint64 metadataOffset; // Relative to MappedHeader::metadataOffset
+    quint32 metadataSize;
+    quint32 matrixCount;
+    quint64 firstMatrix;
+};
+
+struct MappedMatrix
+{
+    quint64 dataOffset; // Absolute file offset
+    qint32 rows;
+    qint32 cols;
+    qint32 type;
+    qint32 reserved;
+};
+
+static const char MappedMagic[8] = { 'B', 'R', 'M', 'M', 'A', 'P', '0', '1' };
+static const quint32 MappedVersion = 1;
+static const qint64 MappedAlignment = 16;
+
+/*!
+ * \ingroup initializers
+ * \brief Keeps memory-mapped galleries open for the lifetime of the process.
+ *
+ * Matrices read from a mmapGallery point directly into the mapping,
+ * so the underlying file must outlive every Template that references it.
+ * \author Unknown \cite unknown
+ */
+class MappedGalleries : public Initializer
+{
+    Q_OBJECT
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        QMutexLocker locker(&lock);
+        files.clear();
+    }
+
+    struct MappedFile
+    {
+        QSharedPointer<QFile> file;
+        const uchar *data;
+    };
+
+    static QHash<QString, MappedFile> files;
+    static QMutex lock;
+
+public:
+    // Returns the start of a read-only mapping of the whole file, or NULL on failure.
+    static const uchar *map(const QString &fileName, qint64 *size)
+    {
+        QMutexLocker locker(&lock);
+        if (!files.contains(fileName)) {
+            MappedFile mapped;
+            mapped.file = QSharedPointer<QFile>(new QFile(fileName));
+            if (!mapped.file->open(QFile::ReadOnly))
+                return NULL;
+            // The mapping is owned by the QFile and released when it is closed
+            mapped.data = mapped.file->map(0, mapped.file->size());
+            if (!mapped.data)
+                return NULL;
+            files.insert(fileName, mapped);
+        }
+        const MappedFile &mapped = files[fileName];
+        *size = mapped.file->size();
+        return mapped.data;
+    }
+
+    static void unmap(const QString &fileName)
+    {
+        QMutexLocker locker(&lock);
+        files.remove(fileName);
+    }
+};
+
+QHash<QString, MappedGalleries::MappedFile> MappedGalleries::files;
+QMutex MappedGalleries::lock;
+
+BR_REGISTER(Initializer, MappedGalleries)
+
+const uchar *mapFile(const QString &fileName, qint64 *size)
+{
+    return MappedGalleries::map(fileName, size);
+}
+
+void unmapFile(const QString &fileName)
+{
+    MappedGalleries::unmap(fileName);
+}
+
+/*!
+ * \ingroup galleries
+ * \brief A read-only, memory-mappable gallery.
+ *
+ * Templates are stored with a fixed header, a contiguous block of matrix data,
+ * and offset tables for metadata and matrices.
+ * When read, matrices reference the mapped file directly instead of being copied,
+ * so multiple processes reading the same gallery share one copy through the page cache.
+ * Intended for large enrolled galleries compared in multiProcess mode.
+ * \author Unknown \cite unknown
+ */
+class mmapGallery : public Gallery
+{
+    Q_OBJECT
+
+    // Reading
+    const uchar *mapping;
+    qint64 mappingSize;
+    const MappedHeader *header;
+    const MappedTemplate *templateTable;
+    const MappedMatrix *matrixTable;
+    quint64 index;
+
+    // Writing
+    QFile output;
+    QBuffer metadata;
+    QList<MappedTemplate> templateEntries;
+    QList<MappedMatrix> matrixEntries;
+
+    void init()
+    {
+        mapping = NULL;
+        mappingSize = 0;
+        header = NULL;
+        templateTable = NULL;
+        matrixTable = NULL;
+        index = 0;
+    }
+
+    ~mmapGallery()
+    {
+        if (output.isOpen())
+            writeClose();
+    }
+
+    void readOpen()
+    {
+        if (mapping)
+            return;
+
+        if (!file.exists())
+            qFatal("File %s does not exist", qPrintable(file.name));
+
+        mapping = MappedGalleries::map(file.name, &mappingSize);
+        if (!mapping)
+            qFatal("Can't map gallery: %s for reading", qPrintable(file.name));
+        if (mappingSize < qint64(sizeof(MappedHeader)))
+            qFatal("Truncated mapped gallery: %s", qPrintable(file.name));
+
+        header = reinterpret_cast<const MappedHeader*>(mapping);
+        if (memcmp(header->magic, MappedMagic, sizeof(MappedMagic)) || (header->version != MappedVersion))
+            qFatal("Invalid mapped gallery: %s", qPrintable(file.name));
+        if ((header->matrixTableOffset + header->matrixCount*sizeof(MappedMatrix) > quint64(mappingSize)) ||
+            (header->templateTableOffset + header->templateCount*sizeof(MappedTemplate) > quint64(mappingSize)))
+            qFatal("Corrupt offset tables in mapped gallery: %s", qPrintable(file.name));
+
+        templateTable = reinterpret_cast<const MappedTemplate*>(mapping + header->templateTableOffset);
+        matrixTable = reinterpret_cast<const MappedMatrix*>(mapping + header->matrixTableOffset);
+    }
+
+    void writeOpen()
+    {
+        if (output.isOpen())
+            return;
+
+        output.setFileName(file);
+        // Existing mappings of this file would be invalidated by overwriting it
+        MappedGalleries::unmap(file.name);
+        QtUtils::touchDir(output);
+        if (!output.open(QFile::WriteOnly | QFile::Truncate))
+            qFatal("Can't open gallery: %s for writing", qPrintable(output.fileName()));
+
+        // Reserve space for the header, it is rewritten once the tables are known
+        MappedHeader placeholder;
+        memset(&placeholder, 0, sizeof(placeholder));
+        output.write((const char*) &placeholder, sizeof(placeholder));
+
+        metadata.open(QBuffer::WriteOnly);
+    }
+
+    void writeClose()
+    {
+        MappedHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, MappedMagic, sizeof(MappedMagic));
+        h.version = MappedVersion;
+        h.templateCount = templateEntries.size();
+        h.matrixCount = matrixEntries.size();
+
+        h.metadataOffset = output.pos();
+        h.metadataSize = metadata.size();
+        output.write(metadata.data());
+        align();
+
+        h.templateTableOffset = output.pos();
+        foreach (const MappedTemplate &entry, templateEntries)
+            output.write((const char*) &entry, sizeof(entry));
+
+        h.matrixTableOffset = output.pos();
+        foreach (const MappedMatrix &entry, matrixEntries)
+            output.write((const char*) &entry, sizeof(entry));
+
+        output.seek(0);
+        output.write((const char*) &h, sizeof(h));
+        output.close();
+
+        metadata.close();
+        templateEntries.clear();
+        matrixEntries.clear();
+    }
+
+    void align()
+    {
+        static const char padding[MappedAlignment] = { 0 };
+        const qint64 remainder = output.pos() % MappedAlignment;
+        if (remainder)
+            output.write(padding, MappedAlignment - remainder);
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        readOpen();
+
+        TemplateList templates;
+        while ((templates.size() < readBlockSize) && (index < header->templateCount)) {
+            const MappedTemplate &entry = templateTable[index];
+
+            File f;
+            QDataStream stream(QByteArray::fromRawData((const char*) mapping + header->metadataOffset + entry.metadataOffset, entry.metadataSize));
+            stream >> f;
+
+            Template t(f);
+            for (quint32 i=0; i<entry.matrixCount; i++) {
+                const MappedMatrix &m = matrixTable[entry.firstMatrix + i];
+                // const_cast is safe because the mapping is read-only and distances never modify their inputs
+                t.append(Mat(m.rows, m.cols, m.type, const_cast<uchar*>(mapping + m.dataOffset)));
+            }
+
+            t.file.set("progress", index);
+            templates.append(t);
+            index++;
+        }
+
+        *done = (index >= header->templateCount);
+        if (*done)
+            index = 0;
+        return templates;
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        writeOpen();
+
+        MappedTemplate entry;
+        entry.metadataOffset = metadata.pos();
+        entry.firstMatrix = matrixEntries.size();
+        entry.matrixCount = 0;
+
+        // Matrices of failures to enroll are not stored, consistent with galGallery
+        if (!t.file.fte) {
+            foreach (const Mat &m, t) {
+                align();
+                MappedMatrix matrix;
+                matrix.dataOffset = output.pos();
+                matrix.rows = m.rows;
+                matrix.cols = m.cols;
+                matrix.type = m.type();
+                matrix.reserved = 0;
+
+                if (m.isContinuous()) {
+                    output.write((const char*) m.data, m.total() * m.elemSize());
+                } else {
+                    for (int i=0; i<m.rows; i++)
+                        output.write((const char*) m.ptr(i), m.cols * m.elemSize());
+                }
+
+                matrixEntries.append(matrix);
+                entry.matrixCount++;
+            }
+        }
+
+        QDataStream stream(&metadata);
+        stream << t.file;
+        entry.metadataSize = metadata.pos() - entry.metadataOffset;
+        templateEntries.append(entry);
+    }
+
+    qint64 totalSize()
+    {
+        readOpen();
+        return header->templateCount;
+    }
+
+    qint64 position()
+    {
+        return index;
+    }
+};
+
+BR_REGISTER(Gallery, mmapGallery)
+
+// On-disk layout of a .fgal gallery:
+//   FlatHeader
+//   For each template, starting on a FlatAlignment boundary:
+//     FlatTemplate
+//     FlatMatrix[matrixCount]
+//     name        (UTF-8)
+//     metadata    (QDataStream serialized QVariantMap, omitted when empty)
+//     matrix data (each matrix starts on a FlatAlignment boundary)
+//   quint64[templateCount] absolute offsets of each FlatTemplate
+//   FlatFooter
+struct FlatHeader
+{
+    char magic[8];
+    quint32 version;
+    quint32 alignment;
+    quint8 reserved[48];
+};
+
+struct FlatTemplate
+{
+    quint64 size; // Bytes from the start of this header to the end of the last matrix
+    quint32 flags;
+    quint32 matrixCount;
+    quint32 nameSize;
+    quint32 metadataSize;
+    quint64 reserved;
+};
+
+struct FlatMatrix
+{
+    quint64 dataOffset; // Relative to the start of the FlatTemplate
+    qint32 rows;
+    qint32 cols;
+    qint32 type;
+    qint32 reserved;
+};
+
+struct FlatFooter
+{
+    quint64 indexOffset;
+    quint64 templateCount;
+    char magic[8];
+};
+
+static const char FlatMagic[8] = { 'B', 'R', 'F', 'L', 'A', 'T', '0', '1' };
+static const quint32 FlatVersion = 1;
+static const qint64 FlatAlignment = 64;
+static const quint32 FlatFTE = 0x1;
+
+/*!
+ * \ingroup galleries
+ * \brief A fixed-layout binary gallery, a drop-in replacement for galGallery that reads without copying.
+ *
+ * Each template is a fixed header followed by its matrix descriptors, name, metadata, and 64-byte aligned matrix payloads.
+ * A trailing index of template offsets makes the gallery seekable and sized without a scan.
+ * When read, matrices point directly into a mapping of the file, or when the file can't be mapped,
+ * into one buffer per block filled by a single bulk read.
+ * Metadata other than the name is only deserialized for templates that have it.
+ * \author Unknown \cite unknown
+ */
+class fgalGallery : public Gallery
+{
+    Q_OBJECT
+
+    // Reading
+    const uchar *mapping;
+    qint64 mappingSize;
+    QFile input;
+    QVector<quint64> inputIndex;
+    const quint64 *offsets;
+    quint64 indexOffset, templateCount, index;
+
+    // Writing
+    QFile output;
+    QVector<quint64> outputIndex;
+
+    void init()
+    {
+        mapping = NULL;
+        mappingSize = 0;
+        offsets = NULL;
+        indexOffset = templateCount = index = 0;
+    }
+
+    ~fgalGallery()
+    {
+        if (output.isOpen())
+            writeClose();
+    }
+
+    void readOpen()
+    {
+        if (offsets)
+            return;
+
+        if (!file.exists())
+            qFatal("File %s does not exist", qPrintable(file.name));
+
+        FlatHeader header;
+        FlatFooter footer;
+        mapping = MappedGalleries::map(file.name, &mappingSize);
+        if (mapping) {
+            if (mappingSize < qint64(sizeof(FlatHeader) + sizeof(FlatFooter)))
+                qFatal("Truncated fgal gallery: %s", qPrintable(file.name));
+            memcpy(&header, mapping, sizeof(header));
+            memcpy(&footer, mapping + mappingSize - sizeof(footer), sizeof(footer));
+        } else {
+            // Fall back to bulk reads, for example when the file is too large for the address space
+            input.setFileName(file);
+            if (!input.open(QFile::ReadOnly))
+                qFatal("Can't open gallery: %s for reading", qPrintable(file.name));
+            mappingSize = input.size();
+            if ((mappingSize < qint64(sizeof(FlatHeader) + sizeof(FlatFooter))) ||
+                (input.read((char*) &header, sizeof(header)) != sizeof(header)) ||
+                !input.seek(mappingSize - sizeof(footer)) ||
+                (input.read((char*) &footer, sizeof(footer)) != sizeof(footer)))
+                qFatal("Truncated fgal gallery: %s", qPrintable(file.name));
+        }
+
+        if (memcmp(header.magic, FlatMagic, sizeof(FlatMagic)) || memcmp(footer.magic, FlatMagic, sizeof(FlatMagic)) ||
+            (header.version != FlatVersion) || (header.alignment != FlatAlignment))
+            qFatal("Invalid fgal gallery: %s", qPrintable(file.name));
+        if (footer.indexOffset + footer.templateCount*sizeof(quint64) + sizeof(FlatFooter) != quint64(mappingSize))
+            qFatal("Corrupt index in fgal gallery: %s", qPrintable(file.name));
+
+        indexOffset = footer.indexOffset;
+        templateCount = footer.templateCount;
+        if (mapping) {
+            offsets = reinterpret_cast<const quint64*>(mapping + indexOffset);
+        } else {
+            inputIndex.resize(templateCount + 1);
+            input.seek(indexOffset);
+            if (input.read((char*) inputIndex.data(), templateCount*sizeof(quint64)) != qint64(templateCount*sizeof(quint64)))
+                qFatal("Truncated fgal gallery: %s", qPrintable(file.name));
+            inputIndex[templateCount] = indexOffset; // Simplifies computing the extent of a block
+            offsets = inputIndex.data();
+        }
+    }
+
+    void writeOpen()
+    {
+        if (output.isOpen())
+            return;
+
+        output.setFileName(file);
+        // Existing mappings of this file would be invalidated by overwriting it
+        MappedGalleries::unmap(file.name);
+        QtUtils::touchDir(output);
+        if (!output.open(QFile::WriteOnly | QFile::Truncate))
+            qFatal("Can't open gallery: %s for writing", qPrintable(output.fileName()));
+
+        FlatHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, FlatMagic, sizeof(FlatMagic));
+        header.version = FlatVersion;
+        header.alignment = FlatAlignment;
+        output.write((const char*) &header, sizeof(header));
+    }
+
+    void writeClose()
+    {
+        FlatFooter footer;
+        footer.indexOffset = output.pos();
+        footer.templateCount = outputIndex.size();
+        memcpy(footer.magic, FlatMagic, sizeof(FlatMagic));
+        output.write((const char*) outputIndex.data(), outputIndex.size()*sizeof(quint64));
+        output.write((const char*) &footer, sizeof(footer));
+        output.close();
+        outputIndex.clear();
+    }
+
+    static qint64 aligned(qint64 offset)
+    {
+        return (offset + FlatAlignment - 1) / FlatAlignment * FlatAlignment;
+    }
+
+    void align()
+    {
+        static const char padding[FlatAlignment] = { 0 };
+        const qint64 remainder = output.pos() % FlatAlignment;
+        if (remainder)
+            output.write(padding, FlatAlignment - remainder);
+    }
+
+    // A matrix header over data inside buffer, sharing the buffer's reference count like a ROI would
+    static Mat view(const Mat &buffer, const uchar *data, int rows, int cols, int type)
+    {
+        Mat m(rows, cols, type, const_cast<uchar*>(data));
+        m.refcount = buffer.refcount;
+        m.datastart = buffer.datastart;
+        m.dataend = buffer.dataend;
+        m.addref();
+        return m;
+    }
+
+    Template parse(const uchar *record, quint64 size, const Mat &buffer) const
+    {
+        FlatTemplate header;
+        memcpy(&header, record, sizeof(header));
+        const quint64 descriptorsSize = header.matrixCount*sizeof(FlatMatrix);
+        if ((header.size > size) || (sizeof(FlatTemplate) + descriptorsSize + header.nameSize + header.metadataSize > header.size))
+            qFatal("Corrupt template in fgal gallery: %s", qPrintable(file.name));
+
+        const uchar *name = record + sizeof(FlatTemplate) + descriptorsSize;
+        File f;
+        if (header.metadataSize > 0) {
+            QVariantMap metadata;
+            QDataStream stream(QByteArray::fromRawData((const char*) name + header.nameSize, header.metadataSize));
+            stream >> metadata;
+            f = File(metadata);
+        }
+        f.name = QString::fromUtf8((const char*) name, header.nameSize);
+        f.fte = (header.flags & FlatFTE) != 0;
+
+        Template t(f);
+        for (quint32 i=0; i<header.matrixCount; i++) {
+            FlatMatrix m;
+            memcpy(&m, record + sizeof(FlatTemplate) + i*sizeof(FlatMatrix), sizeof(m));
+            const quint64 bytes = quint64(m.rows) * m.cols * CV_ELEM_SIZE(m.type);
+            if (m.dataOffset + bytes > header.size)
+                qFatal("Corrupt matrix in fgal gallery: %s", qPrintable(file.name));
+            // const_cast is safe because the mapping is read-only and distances never modify their inputs
+            if (buffer.empty()) t.append(Mat(m.rows, m.cols, m.type, const_cast<uchar*>(record + m.dataOffset)));
+            else                t.append(view(buffer, record + m.dataOffset, m.rows, m.cols, m.type));
+        }
+        return t;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        readOpen();
+
+        const quint64 end = std::min(templateCount, index + quint64(std::max(readBlockSize, 1)));
+        TemplateList templates;
+        templates.reserve(end - index);
+
+        if (mapping) {
+            for (; index < end; index++) {
+                const quint64 limit = (index + 1 < templateCount) ? offsets[index+1] : indexOffset;
+                if ((offsets[index] < sizeof(FlatHeader)) || (offsets[index] + sizeof(FlatTemplate) > limit))
+                    qFatal("Corrupt index in fgal gallery: %s", qPrintable(file.name));
+                templates.append(parse(mapping + offsets[index], limit - offsets[index], Mat()));
+                templates.last().file.set("progress", index);
+            }
+        } else if (index < end) {
+            // One read for the whole block, the resulting matrices keep the buffer alive
+            const quint64 first = offsets[index], last = offsets[end];
+            if ((first < sizeof(FlatHeader)) || (last < first) || (last > indexOffset))
+                qFatal("Corrupt index in fgal gallery: %s", qPrintable(file.name));
+            Mat buffer(1, int(last - first + FlatAlignment), CV_8UC1);
+            uchar *base = alignPtr(buffer.data, FlatAlignment);
+            if (!input.seek(first) || (input.read((char*) base, last - first) != qint64(last - first)))
+                qFatal("Failed to read fgal gallery: %s", qPrintable(file.name));
+
+            for (; index < end; index++) {
+                if (offsets[index] + sizeof(FlatTemplate) > offsets[index+1])
+                    qFatal("Corrupt index in fgal gallery: %s", qPrintable(file.name));
+                templates.append(parse(base + (offsets[index] - first), offsets[index+1] - offsets[index], buffer));
+                templates.last().file.set("progress", index);
+            }
+        }
+
+        *done = (index >= templateCount);
+        if (*done)
+            index = 0;
+        return templates;
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        writeOpen();
+        align();
+
+        const QByteArray name = t.file.name.toUtf8();
+        QByteArray metadata;
+        const QVariantMap map = t.file.localMetadata();
+        if (!map.isEmpty()) {
+            QDataStream stream(&metadata, QIODevice::WriteOnly);
+            stream << map;
+        }
+
+        // Matrices of failures to enroll are not stored, consistent with galGallery
+        const QList<Mat> matrices = t.file.fte ? QList<Mat>() : QList<Mat>(t);
+
+        FlatTemplate header;
+        memset(&header, 0, sizeof(header));
+        header.flags = t.file.fte ? FlatFTE : 0;
+        header.matrixCount = matrices.size();
+        header.nameSize = name.size();
+        header.metadataSize = metadata.size();
+
+        QVector<FlatMatrix> descriptors(matrices.size());
+        qint64 size = sizeof(FlatTemplate) + descriptors.size()*sizeof(FlatMatrix) + name.size() + metadata.size();
+        for (int i=0; i<matrices.size(); i++) {
+            const Mat &m = matrices[i];
+            FlatMatrix &descriptor = descriptors[i];
+            size = aligned(size);
+            descriptor.dataOffset = size;
+            descriptor.rows = m.rows;
+            descriptor.cols = m.cols;
+            descriptor.type = m.type();
+            descriptor.reserved = 0;
+            size += m.total() * m.elemSize();
+        }
+        header.size = size;
+
+        outputIndex.append(output.pos());
+        output.write((const char*) &header, sizeof(header));
+        output.write((const char*) descriptors.data(), descriptors.size()*sizeof(FlatMatrix));
+        output.write(name);
+        output.write(metadata);
+        foreach (const Mat &m, matrices) {
+            align();
+            if (m.isContinuous()) {
+                output.write((const char*) m.data, m.total() * m.elemSize());
+            } else {
+                for (int i=0; i<m.rows; i++)
+                    output.write((const char*) m.ptr(i), m.cols * m.elemSize());
+            }
+        }
+    }
+
+    qint64 totalSize()
+    {
+        readOpen();
+        return templateCount;
+    }
+
+    qint64 position()
+    {
+        return index;
+    }
+};
+
+BR_REGISTER(Gallery, fgalGallery)
+
+} // namespace br
+
+#include "gallery/mmap.moc"
@@ -15,7 +15,8 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <fstream>
-#include <QQueue>
+#include <QFutureSynchronizer>
+#include <QtConcurrent>
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -25,17 +26,33 @@ namespace br
 {
 
 /*!
- * \brief DOCUMENT ME
+ * \brief Read Norpix .seq files frame by frame
+ *
+ * The frame offsets are found on the first open and cached beside the file in <file>.idx,
+ * later opens of an unchanged file skip the scan.
+ * Each block reads the encoded bytes of several frames sequentially and decodes them in parallel.
+ * \br_property int begin Index of the first frame to read, so shards of a recording can be processed independently. Default is 0.
+ * \br_property int end Index one past the last frame to read, -1 reads to the end of the file. Default is -1.
+ * \br_property int frames Frames decoded per block, 0 uses Context::parallelism. Default is 0.
  * \author Unknown \cite unknown
  */
 class seqGallery : public Gallery
 {
-public:
     Q_OBJECT
+    Q_PROPERTY(int begin READ get_begin WRITE set_begin RESET reset_begin STORED false)
+    Q_PROPERTY(int end READ get_end WRITE set_end RESET reset_end STORED false)
+    Q_PROPERTY(int frames READ get_frames WRITE set_frames RESET reset_frames STORED false)
+    BR_PROPERTY(int, begin, 0)
+    BR_PROPERTY(int, end, -1)
+    BR_PROPERTY(int, frames, 0)
+
+    static const quint32 IndexMagic = 0x53455149; // "SEQI"
 
+public:
     bool open()
     {
-        seqFile.open(QtUtils::getAbsolutePath(file.name).toStdString().c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+        const QString path = QtUtils::getAbsolutePath(file.name);
+        seqFile.open(path.toStdString().c_str(), std::ios::in | std::ios::binary | std::ios::ate);
         if (!isOpen()) {
             qDebug("Failed to open file %s for reading", qPrintable(file.name));
             return false;
@@ -43,7 +60,7 @@ public:
 
         int headSize = 1024;
         // start at end of file to get full size
-        int fileSize = seqFile.tellg();
+        const qint64 fileSize = seqFile.tellg();
         if (fileSize < headSize) {
             qDebug("No header in seq file");
             return false;
@@ -99,46 +116,21 @@ public:
         // the size of a full raw file, with extra crap after img data
         trueImgSizeBytes = readInt();
 
-        // gather all the frame positions in an array
-        seekPos.reserve(numFrames);
-        // start at end of header
-        seekPos.append(headSize);
-        // extra 8 bytes at end of img
-        int extra = 8;
-        for (int i=1; i<numFrames; i++) {
-            int s;
-            // compressed images have different sizes
-            // the first byte at the beginning of the file
-            // says how big the current img is
-            if (imgFormat == "compressed") {
-                int lastPos = seekPos[i-1];
-                seqFile.seekg(lastPos, std::ios::beg);
-                int currSize = readInt();
-                s = lastPos + currSize + extra;
-
-                // but there might be 16 extra bytes instead of 8...
-                if (i == 1) {
-                    seqFile.seekg(s, std::ios::beg);
-                    char zero;
-                    seqFile.read(&zero, 1);
-                    if (zero == 0) {
-                        s += 8;
-                        extra += 8;
-                    }
-                }
-            }
-            // raw images are all the same size
-            else {
-                s = headSize + (i*trueImgSizeBytes);
-            }
-
-            seekPos.enqueue(s);
+        const QString indexFile = path + ".idx";
+        const qint64 modified = QFileInfo(path).lastModified().toMSecsSinceEpoch();
+        if (!readIndex(indexFile, fileSize, modified)) {
+            scanOffsets(headSize);
+            writeIndex(indexFile, fileSize, modified);
         }
 
+        first = qBound(0, begin, numFrames);
+        last = (end < 0) ? numFrames : qBound(first, end, numFrames);
+        idx = first;
+
 #ifdef CVMATIO
-        if (basis.file.contains("vbb")) {
-            QString vbb = basis.file.get<QString>("vbb");
-            annotations = TemplateList::fromGallery(File(vbb));
+        if (file.contains("vbb")) {
+            QString vbb = file.get<QString>("vbb");
+            annotations = TemplateList::fromGallery(File(vbb)).mid(first);
         }
 #else
         qWarning("cvmatio not installed, bounding boxes will not be available. Add -DBR_WITH_CVMATIO cmake flag to install.");
@@ -159,51 +151,47 @@ public:
 
     TemplateList readBlock(bool *done)
     {
-        if (!isOpen()) {
-            if (!open())
-                qFatal("Failed to open file %s for reading", qPrintable(file.name));
-            else
-                idx = 0;
-        }
+        if (!isOpen() && !open())
+            qFatal("Failed to open file %s for reading", qPrintable(file.name));
 
         // if we've reached the last frame, we're done
-        if (seekPos.size() == 0) {
+        if (idx >= last) {
             *done = true;
             return TemplateList();
         }
 
-        seqFile.seekg(seekPos.dequeue(), std::ios::beg);
-
-        cv::Mat temp;
-        // let imdecode do all the work to decode the compressed img
-        if (imgFormat == "compressed") {
-            int imgSize = readInt() - 4;
-            std::vector<char> imgBuf(imgSize);
-            seqFile.read(&imgBuf[0], imgSize);
-            // flags < 0 means load image as-is (keep color info if available)
-            cv::imdecode(imgBuf, -1, &temp);
+        // Reading is sequential, decoding the frames is not
+        const int count = std::min(last - idx, frames > 0 ? frames : std::max(1, Globals->parallelism));
+        QList< std::vector<char> > encoded;
+        for (int i=0; i<count; i++) {
+            seqFile.seekg(offsets[idx + i], std::ios::beg);
+            const int size = (imgFormat == "compressed") ? readInt() - 4 : imgSizeBytes;
+            encoded.append(std::vector<char>(std::max(size, 0)));
+            if (size > 0)
+                seqFile.read(&encoded.last()[0], size);
         }
-        // raw images can be loaded straight into a Mat
-        else {
-            char *imgBuf = new char[imgSizeBytes];
-            seqFile.read(imgBuf, imgSizeBytes);
-            int type = (numChan == 1 ? CV_8UC1 : CV_8UC3);
-            temp = cv::Mat(height, width, type, imgBuf);
-        }
-        Template output;
-        output.file = file;
-        if (!annotations.empty()) {
-            output.file.setRects(annotations.first().file.rects());
-            annotations.removeFirst();
-        }
-        output.m() = temp;
-        output.file.set("position",idx);
-        idx++;
-
-        *done = false;
+
         TemplateList rVal;
-        rVal.append(output);
+        for (int i=0; i<count; i++) {
+            Template output;
+            output.file = file;
+            if (!annotations.empty()) {
+                output.file.setRects(annotations.first().file.rects());
+                annotations.removeFirst();
+            }
+            output.file.set("position", idx + i);
+            rVal.append(output);
+        }
+
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<count; i++) {
+            if (i == count - 1) decode(&encoded[i], &rVal[i].m());
+            else                futures.addFuture(QtConcurrent::run(this, &seqGallery::decode, &encoded[i], &rVal[i].m()));
+        }
+        futures.waitForFinished();
 
+        idx += count;
+        *done = (idx >= last);
         return rVal;
     }
 
@@ -213,8 +201,21 @@ public:
         qFatal("Not implemented.");
     }
 
+    qint64 totalSize()
+    {
+        if (!isOpen() && !open())
+            return 0;
+        return last - first;
+    }
+
+    qint64 position()
+    {
+        return isOpen() ? idx - first : 0;
+    }
+
 private:
-    qint64 idx;
+    int first, last, idx;
+
     int readInt()
     {
         int num;
@@ -234,9 +235,93 @@ private:
         buffer[bytes/2] = '\0';
     }
 
+    // gather all the frame positions in an array
+    void scanOffsets(int headSize)
+    {
+        offsets.clear();
+        offsets.reserve(numFrames);
+        // start at end of header
+        offsets.append(headSize);
+        // extra 8 bytes at end of img
+        int extra = 8;
+        for (int i=1; i<numFrames; i++) {
+            qint64 s;
+            // compressed images have different sizes
+            // the first byte at the beginning of the file
+            // says how big the current img is
+            if (imgFormat == "compressed") {
+                const qint64 lastPos = offsets[i-1];
+                seqFile.seekg(lastPos, std::ios::beg);
+                int currSize = readInt();
+                s = lastPos + currSize + extra;
+
+                // but there might be 16 extra bytes instead of 8...
+                if (i == 1) {
+                    seqFile.seekg(s, std::ios::beg);
+                    char zero;
+                    seqFile.read(&zero, 1);
+                    if (zero == 0) {
+                        s += 8;
+                        extra += 8;
+                    }
+                }
+            }
+            // raw images are all the same size
+            else {
+                s = headSize + (qint64(i)*trueImgSizeBytes);
+            }
+
+            offsets.append(s);
+        }
+    }
+
+    bool readIndex(const QString &indexFile, qint64 fileSize, qint64 modified)
+    {
+        QFile f(indexFile);
+        if (!f.open(QFile::ReadOnly))
+            return false;
+
+        QDataStream stream(&f);
+        quint32 magic;
+        qint64 size, time;
+        stream >> magic >> size >> time >> offsets;
+        if ((stream.status() != QDataStream::Ok) || (magic != IndexMagic) || (size != fileSize) ||
+            (time != modified) || (offsets.size() != numFrames)) {
+            offsets.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // Best effort, a read-only directory just means scanning again next time
+    void writeIndex(const QString &indexFile, qint64 fileSize, qint64 modified) const
+    {
+        QFile f(indexFile);
+        if (!f.open(QFile::WriteOnly))
+            return;
+        QDataStream stream(&f);
+        stream << IndexMagic << fileSize << modified << offsets;
+    }
+
+    void decode(const std::vector<char> *encoded, cv::Mat *frame) const
+    {
+        // let imdecode do all the work to decode the compressed img
+        if (imgFormat == "compressed") {
+            if (!encoded->empty())
+                // flags < 0 means load image as-is (keep color info if available)
+                *frame = cv::imdecode(*encoded, -1);
+        }
+        // raw images can be copied straight into a Mat
+        else {
+            frame->create(height, width, numChan == 1 ? CV_8UC1 : CV_8UC3);
+            if (!encoded->empty())
+                memcpy(frame->data, &(*encoded)[0], std::min(encoded->size(), frame->total() * frame->elemSize()));
+        }
+    }
+
 protected:
     std::ifstream seqFile;
-    QQueue<int> seekPos;
+    QVector<qint64> offsets;
     int width, height, numChan, imgSizeBytes, trueImgSizeBytes, numFrames;
     QString imgFormat;
     TemplateList annotations;
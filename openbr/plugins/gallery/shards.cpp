@@ -0,0 +1,383 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QEventLoop>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+#include <QTimer>
+#include <QUrlQuery>
+#include <QtNetwork>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup galleries
+ * \brief A logical gallery held in disjoint shards by resident search services, see MongooseInitializer.
+ *
+ * Each line names a shard's gallery on the services and the base URLs of the services holding it, replicas first to last:
+ * \code
+ * watchlist0.gal http://node1:8080 http://node2:8080
+ * watchlist1.gal http://node2:8080 http://node1:8080
+ * \endcode
+ * Its files() are the names of every template, shard by shard, so they line up with the columns of a comparison against it.
+ * The templates themselves stay on the services and can't be read back, so a shards gallery can't be converted into another gallery.
+ * Comparing against it with br::Compare scatters the enrolled probes to every shard and gathers their top matches into the same Output
+ * or top-K candidates a local gallery would give, with k taken from the output or every target when it keeps them all.
+ * Written templates are enrolled on whichever shard holds the fewest, so converting a gallery into one spreads it evenly.
+ * Templates already on the shards are kept, writing never moves them between shards.
+ * Requests that fail, or answer 503 or 5xx, are retried on the shard's next replica with exponential backoff.
+ * \br_property int attempts Requests made of each shard before it is considered down. Default is 3.
+ * \br_property int timeout Milliseconds to wait for a round of requests. Default is 30000.
+ * \br_property bool partial Continue without shards that are down instead of aborting. Default is false.
+ * \author Unknown \cite unknown
+ */
+class shardsGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(int attempts READ get_attempts WRITE set_attempts RESET reset_attempts STORED false)
+    Q_PROPERTY(int timeout READ get_timeout WRITE set_timeout RESET reset_timeout STORED false)
+    Q_PROPERTY(bool partial READ get_partial WRITE set_partial RESET reset_partial STORED false)
+    BR_PROPERTY(int, attempts, 3)
+    BR_PROPERTY(int, timeout, 30000)
+    BR_PROPERTY(bool, partial, false)
+
+    static const int Backoff = 100; // ms, doubled after every round
+    static const int MaxCalls = 256; // Requests in flight at once
+
+    struct Shard
+    {
+        QString gallery;
+        QStringList replicas;
+        QStringList names;
+        int offset; // Of the shard's first template in the logical gallery
+        bool up;
+    };
+
+    struct Call
+    {
+        int shard, replica;
+        QString path; // With its query
+        QByteArray body; // POSTed if not empty
+        QByteArray response;
+        bool ok;
+    };
+
+    QList<Shard> shards;
+    bool described;
+    TemplateList pending; // Written but not yet enrolled
+
+public:
+    shardsGallery() : described(false) {}
+
+    ~shardsGallery()
+    {
+        flush();
+    }
+
+    void flush()
+    {
+        if (pending.isEmpty())
+            return;
+        describe();
+
+        // The least loaded shard takes each template
+        QList<Call> calls;
+        foreach (const Template &t, pending) {
+            int best = -1;
+            for (int i=0; i<shards.size(); i++)
+                if (shards[i].up && ((best == -1) || (shards[i].names.size() < shards[best].names.size())))
+                    best = i;
+            if (best == -1)
+                qFatal("No shard of %s is up to enroll in.", qPrintable(file.name));
+
+            QByteArray body;
+            QDataStream stream(&body, QIODevice::WriteOnly);
+            stream << t;
+            calls.append(call(best, "/enroll", body));
+            shards[best].names.append(t.file.name);
+        }
+        pending.clear();
+
+        perform(calls);
+        foreach (const Call &c, calls)
+            if (!c.ok)
+                fail(c.shard, "enroll");
+        described = false; // Names were assigned by the services
+    }
+
+    // Scatters the queries to every shard and gathers their candidates into output, in logical gallery columns
+    void search(const TemplateList &queries, Output *output)
+    {
+        describe();
+
+        // Top-K outputs need only as many candidates from each shard, anything else needs every score
+        const QVariant k = output->property("k");
+
+        for (int begin=0; begin<queries.size(); begin += std::max(1, MaxCalls / std::max(1, shards.size()))) {
+            const int end = std::min(queries.size(), begin + std::max(1, MaxCalls / std::max(1, shards.size())));
+
+            QList<Call> calls;
+            QList<int> rows;
+            for (int i=begin; i<end; i++) {
+                if (queries[i].isEmpty() || queries[i].file.fte) {
+                    for (int s=0; s<shards.size(); s++)
+                        if (shards[s].up)
+                            for (int j=0; j<shards[s].names.size(); j++)
+                                output->setRelative(-std::numeric_limits<float>::max(), i, shards[s].offset + j);
+                    continue;
+                }
+
+                QByteArray body;
+                QDataStream stream(&body, QIODevice::WriteOnly);
+                stream << queries[i];
+                for (int s=0; s<shards.size(); s++) {
+                    if (!shards[s].up || shards[s].names.isEmpty())
+                        continue;
+                    const int shardK = k.isValid() ? std::min(k.toInt(), shards[s].names.size()) : shards[s].names.size();
+                    calls.append(call(s, "/search", body, "&k=" + QString::number(shardK)));
+                    rows.append(i);
+                }
+            }
+
+            perform(calls);
+            for (int c=0; c<calls.size(); c++) {
+                const Shard &shard = shards[calls[c].shard];
+                if (!calls[c].ok) {
+                    fail(calls[c].shard, "search");
+                    continue;
+                }
+
+                // Templates enrolled on the shard since it was described are beyond its columns
+                const QJsonArray results = QJsonDocument::fromJson(calls[c].response).object().value("results").toArray();
+                foreach (const QJsonValue &value, results) {
+                    const QJsonObject result = value.toObject();
+                    const int index = result.value("index").toInt(-1);
+                    if ((index >= 0) && (index < shard.names.size()))
+                        output->setRelative(result.value("score").toDouble(), rows[c], shard.offset + index);
+                }
+            }
+
+            Globals->currentStep += end - begin;
+            Globals->currentProgress = Globals->currentStep;
+            Globals->printStatus();
+        }
+    }
+
+private:
+    void init()
+    {
+        shards.clear();
+        described = false;
+        if (!QFileInfo(file.name).exists())
+            return;
+
+        foreach (const QString &line, QtUtils::readLines(file.name)) {
+            const QStringList words = line.simplified().split(' ', QString::SkipEmptyParts);
+            if (words.isEmpty() || words.first().startsWith('#'))
+                continue;
+            if (words.size() < 2)
+                qFatal("Shard '%s' of %s names no service.", qPrintable(line), qPrintable(file.name));
+
+            Shard shard;
+            shard.gallery = words.first();
+            shard.replicas = words.mid(1);
+            shard.offset = 0;
+            shard.up = true;
+            shards.append(shard);
+        }
+    }
+
+    Call call(int shard, const QString &endpoint, const QByteArray &body = QByteArray(), const QString &arguments = QString()) const
+    {
+        QUrlQuery query;
+        query.addQueryItem("gallery", shards[shard].gallery);
+        Call c;
+        c.shard = shard;
+        c.replica = 0;
+        c.path = endpoint + "?" + query.toString(QUrl::FullyEncoded) + (body.isEmpty() ? "" : "&template=true") + arguments;
+        c.body = body;
+        c.ok = false;
+        return c;
+    }
+
+    // Sizes and names of every shard, refreshed after writes
+    void describe()
+    {
+        if (described)
+            return;
+
+        QList<Call> calls;
+        for (int i=0; i<shards.size(); i++)
+            calls.append(call(i, "/gallery"));
+        perform(calls);
+
+        int offset = 0;
+        for (int i=0; i<shards.size(); i++) {
+            Shard &shard = shards[i];
+            shard.names.clear();
+            shard.offset = offset;
+            shard.up = calls[i].ok;
+            if (!shard.up) {
+                fail(i, "describe");
+                continue;
+            }
+            foreach (const QJsonValue &name, QJsonDocument::fromJson(calls[i].response).object().value("names").toArray())
+                shard.names.append(name.toString());
+            offset += shard.names.size();
+        }
+        described = true;
+    }
+
+    void fail(int shard, const char *request)
+    {
+        const Shard &s = shards[shard];
+        if (!partial)
+            qFatal("Shard %s of %s failed to %s on every replica (%s).", qPrintable(s.gallery), qPrintable(file.name), request, qPrintable(s.replicas.join(", ")));
+        qWarning("Shard %s of %s failed to %s on every replica, continuing without it.", qPrintable(s.gallery), qPrintable(file.name), request);
+        shards[shard].up = false;
+        Context::addMetric("br_shard_failures_total{shard=\"" + s.gallery + "\"}");
+    }
+
+    // Issues the calls together, retrying failures on the next replica, and leaves the ones that never succeed with ok unset
+    void perform(QList<Call> &calls) const
+    {
+        QNetworkAccessManager manager;
+        for (int attempt=0; attempt<attempts; attempt++) {
+            QEventLoop loop;
+            QObject::connect(&manager, SIGNAL(finished(QNetworkReply*)), &loop, SLOT(quit()));
+            QTimer timer;
+            timer.setSingleShot(true);
+            QObject::connect(&timer, SIGNAL(timeout()), &loop, SLOT(quit()));
+
+            QHash<QNetworkReply*, int> replies;
+            for (int i=0; i<calls.size(); i++) {
+                if (calls[i].ok)
+                    continue;
+                const QStringList &replicas = shards[calls[i].shard].replicas;
+                QNetworkRequest request(QUrl(replicas[calls[i].replica % replicas.size()] + calls[i].path));
+                request.setRawHeader("User-Agent", "br");
+                QNetworkReply *reply;
+                if (calls[i].body.isEmpty()) {
+                    reply = manager.get(request);
+                } else {
+                    request.setHeader(QNetworkRequest::ContentTypeHeader, "application/octet-stream");
+                    reply = manager.post(request, calls[i].body);
+                }
+                replies.insert(reply, i);
+            }
+            if (replies.isEmpty())
+                return;
+
+            timer.start(timeout);
+            while (timer.isActive()) {
+                bool finished = true;
+                foreach (QNetworkReply *reply, replies.keys())
+                    finished = finished && reply->isFinished();
+                if (finished)
+                    break;
+                loop.exec();
+            }
+
+            foreach (QNetworkReply *reply, replies.keys()) {
+                Call &c = calls[replies[reply]];
+                if (!reply->isFinished())
+                    reply->abort();
+                const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+                if ((reply->error() == QNetworkReply::NoError) && (status == 200)) {
+                    c.response = reply->readAll();
+                    c.ok = !QJsonDocument::fromJson(c.response).object().contains("error");
+                }
+                if (!c.ok)
+                    c.replica++; // Try the next replica
+                delete reply;
+            }
+
+            bool done = true;
+            foreach (const Call &c, calls)
+                done = done && c.ok;
+            if (done)
+                return;
+            QThread::msleep(Backoff << attempt);
+        }
+    }
+
+    FileList files()
+    {
+        describe();
+        FileList files;
+        foreach (const Shard &shard, shards)
+            foreach (const QString &name, shard.names) {
+                File f(name);
+                f.set("Shard", shard.gallery);
+                files.append(f);
+            }
+        return files;
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        (void) done;
+        qFatal("The templates of %s are held by its search services and can't be read, only compared against.", qPrintable(file.name));
+        return TemplateList();
+    }
+
+    void write(const Template &t)
+    {
+        pending.append(t);
+        if (pending.size() >= MaxCalls)
+            flush();
+    }
+};
+
+BR_REGISTER(Gallery, shardsGallery)
+
+void compareShards(const File &targetGallery, const File &queryGallery, const File &output)
+{
+    QScopedPointer<Gallery> gallery(Gallery::make(targetGallery));
+    shardsGallery *shards = qobject_cast<shardsGallery*>(gallery.data());
+    if (!shards)
+        qFatal("%s is not a shards gallery.", qPrintable(targetGallery.flat()));
+    if (queryGallery == ".")
+        qFatal("Can't compare a shards gallery against itself.");
+
+    // The services compare enrolled templates, so probes that aren't are enrolled here with the same algorithm
+    TemplateList queries = TemplateList::fromGallery(queryGallery);
+    if (!(QStringList() << "gal" << "mem" << "template" << "ut" << "mmap" << "fgal" << "zgal" << "ivf").contains(queryGallery.suffix())) {
+        QSharedPointer<Transform> transform = Transform::fromAlgorithm(output.get<QString>("algorithm"));
+        TemplateList enrolled;
+        transform->project(queries, enrolled);
+        queries = enrolled;
+    }
+
+    const FileList targetFiles = shards->files();
+    qDebug("Searching %d queries across the %d templates of %s", queries.size(), targetFiles.size(), qPrintable(targetGallery.flat()));
+
+    QScopedPointer<Output> o(Output::make(output, targetFiles, queries.files()));
+    o->setBlock(0, 0);
+    Globals->currentStep = 0;
+    Globals->totalSteps = queries.size();
+    shards->search(queries, o.data());
+}
+
+} // namespace br
+
+#include "gallery/shards.moc"
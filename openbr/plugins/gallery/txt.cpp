@@ -75,15 +75,40 @@ class txtGallery : public FileGallery
         return templates;
     }
 
+    void appendLine(QByteArray &buffer, const Template &t) const
+    {
+        buffer.append(t.file.name.toLocal8Bit());
+        if (!label.isEmpty()) {
+            buffer.append(' ');
+            buffer.append(t.file.get<QString>(label).toLocal8Bit());
+        }
+        buffer.append('\n');
+    }
+
+    // One write per block rather than per line
+    void writeBlock(const TemplateList &templates)
+    {
+        if (!templates.isEmpty()) {
+            writeOpen();
+            buffer.resize(0); // Keeps the allocation from earlier blocks
+            foreach (const Template &t, templates)
+                appendLine(buffer, t);
+            f.write(buffer);
+        }
+
+        if (!next.isNull())
+            next->writeBlock(templates);
+    }
+
     void write(const Template &t)
     {
         writeOpen();
-        QString line = t.file.name;
-        if (!label.isEmpty())
-            line += " " + t.file.get<QString>(label);
-
-        f.write((line+"\n").toLocal8Bit() );
+        QByteArray line;
+        appendLine(line, t);
+        f.write(line);
     }
+
+    QByteArray buffer;
 };
 
 BR_REGISTER(Gallery, txtGallery)
@@ -24,13 +24,24 @@ namespace br
 
 /*!
  * \brief Read a video frame by frame using cv::VideoCapture
+ *
+ * Decoded frames are copied into buffers owned by the gallery, which are reused once
+ * every template referencing them has been released, e.g. when a stream retires the frame.
+ * \br_property int buffers Maximum number of frame buffers kept for reuse.
+ * \br_property int begin Index of the first frame to read, reached by seeking rather than decoding the frames before it.
  * \author Unknown \cite unknown
  */
 class videoGallery : public Gallery
 {
     Q_OBJECT
+    Q_PROPERTY(int buffers READ get_buffers WRITE set_buffers RESET reset_buffers STORED false)
+    Q_PROPERTY(int begin READ get_begin WRITE set_begin RESET reset_begin STORED false)
+    BR_PROPERTY(int, buffers, 32)
+    BR_PROPERTY(int, begin, 0)
+
 public:
     qint64 idx;
+    videoGallery() : idx(0), nextBuffer(0), frames(-1) {}
     ~videoGallery()
     {
         video.release();
@@ -44,8 +55,29 @@ public:
 
         if (!status)
             qFatal("Failed to open file %s with path %s", qPrintable(file.name), qPrintable(QtUtils::getAbsolutePath(file.name)));
+
+        if (begin > 0)
+            video.set(CV_CAP_PROP_POS_FRAMES, begin);
     }
 
+    // The frame count in the container, which may be an estimate
+    qint64 totalSize()
+    {
+        if (frames == -1) {
+            if (!video.isOpened()) {
+                QMutexLocker lock(&openLock);
+                deferredInit();
+                idx = begin;
+            }
+            frames = qint64(video.get(CV_CAP_PROP_FRAME_COUNT));
+            if (frames <= 0)
+                frames = std::numeric_limits<qint64>::max();
+        }
+        return frames;
+    }
+
+    qint64 position() { return idx; }
+
     TemplateList readBlock(bool *done)
     {
         if (!video.isOpened()) {
@@ -53,7 +85,7 @@ public:
             QMutexLocker lock(&openLock);
 
             deferredInit();
-            idx = 0;
+            idx = begin;
         }
 
         Template output;
@@ -71,10 +103,10 @@ public:
             return TemplateList();
         }
 
-        // This clone is critical, if we don't do it then the output matrix will
+        // This copy is critical, if we don't do it then the output matrix will
         // be an alias of an internal buffer of the video source, leading to various
         // problems later.
-        output.m() = temp.clone();
+        output.m() = recycledBuffer(temp);
 
         output.file.set("progress", idx);
         idx++;
@@ -92,6 +124,31 @@ public:
 
 protected:
     cv::VideoCapture video;
+
+private:
+    QList<cv::Mat> frameBuffers;
+    int nextBuffer;
+    qint64 frames; // Cached by totalSize(), -1 until known
+
+    // Copy frame into a buffer nobody else references, allocating one only if none is free
+    cv::Mat recycledBuffer(const cv::Mat &frame)
+    {
+        for (int i=0; i<frameBuffers.size(); i++) {
+            cv::Mat &buffer = frameBuffers[i];
+            if (buffer.refcount && (*buffer.refcount == 1) && (buffer.size() == frame.size()) && (buffer.type() == frame.type())) {
+                frame.copyTo(buffer);
+                return buffer;
+            }
+        }
+
+        // Every buffer is still in use downstream, or the resolution changed
+        const cv::Mat buffer = frame.clone();
+        if (frameBuffers.size() < buffers)
+            frameBuffers.append(buffer);
+        else if (!frameBuffers.isEmpty())
+            frameBuffers[nextBuffer++ % frameBuffers.size()] = buffer;
+        return buffer;
+    }
 };
 
 BR_REGISTER(Gallery,videoGallery)
@@ -0,0 +1,224 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QBuffer>
+#include <QtConcurrent>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+static const char CompressedMagic[8] = { 'B', 'R', 'Z', 'G', 'A', 'L', '0', '1' };
+
+/*!
+ * \ingroup galleries
+ * \brief A block-compressed binary gallery.
+ *
+ * Templates are serialized as in galGallery, then every group of blockTemplates is compressed independently,
+ * so blocks can be decompressed in parallel.
+ * While the caller processes one block, readBlock decompresses the next prefetch blocks on the global thread pool.
+ * Intended for archived galleries on network storage, where reading is limited by bandwidth rather than CPU.
+ * Compression uses zlib through qCompress, which every Qt build provides.
+ * \br_property int blockTemplates Number of templates per compressed block.
+ * \br_property int level Compression level from 0 to 9, or -1 for the zlib default.
+ * \br_property int prefetch Number of blocks decompressed ahead of the caller.
+ * \author Unknown \cite unknown
+ */
+class zgalGallery : public Gallery
+{
+    Q_OBJECT
+    Q_PROPERTY(int blockTemplates READ get_blockTemplates WRITE set_blockTemplates RESET reset_blockTemplates STORED false)
+    Q_PROPERTY(int level READ get_level WRITE set_level RESET reset_level STORED false)
+    Q_PROPERTY(int prefetch READ get_prefetch WRITE set_prefetch RESET reset_prefetch STORED false)
+    BR_PROPERTY(int, blockTemplates, 256)
+    BR_PROPERTY(int, level, -1)
+    BR_PROPERTY(int, prefetch, Globals->parallelism)
+
+    struct PendingBlock
+    {
+        QFuture<TemplateList> templates;
+        qint64 end; // File position following the block
+    };
+
+    QFile gallery;
+    QDataStream stream;
+    QList<PendingBlock> pending;
+    qint64 consumed; // File position following the last block returned
+
+    // Writing
+    QBuffer uncompressed;
+    QDataStream uncompressedStream;
+    quint32 uncompressedTemplates;
+
+    ~zgalGallery()
+    {
+        if ((gallery.openMode() & QFile::WriteOnly) && (uncompressedTemplates > 0))
+            flushBlock();
+        // Outstanding decompressions reference nothing owned by the gallery, but finish them before exiting
+        foreach (const PendingBlock &block, pending)
+            block.templates.waitForFinished();
+    }
+
+    void init()
+    {
+        consumed = 0;
+        uncompressedTemplates = 0;
+    }
+
+    void readOpen()
+    {
+        if (gallery.isOpen())
+            return;
+
+        gallery.setFileName(file);
+        if (!gallery.exists())
+            qFatal("File %s does not exist", qPrintable(gallery.fileName()));
+        if (!gallery.open(QFile::ReadOnly))
+            qFatal("Can't open gallery: %s for reading", qPrintable(gallery.fileName()));
+
+        char magic[sizeof(CompressedMagic)];
+        if ((gallery.read(magic, sizeof(magic)) != sizeof(magic)) || memcmp(magic, CompressedMagic, sizeof(magic)))
+            qFatal("Invalid compressed gallery: %s", qPrintable(gallery.fileName()));
+        stream.setDevice(&gallery);
+        consumed = gallery.pos();
+    }
+
+    void writeOpen()
+    {
+        if (gallery.isOpen())
+            return;
+
+        gallery.setFileName(file);
+        QtUtils::touchDir(gallery);
+        if (!gallery.open(QFile::WriteOnly))
+            qFatal("Can't open gallery: %s for writing", qPrintable(gallery.fileName()));
+        gallery.write(CompressedMagic, sizeof(CompressedMagic));
+        stream.setDevice(&gallery);
+
+        uncompressed.open(QBuffer::WriteOnly);
+        uncompressedStream.setDevice(&uncompressed);
+    }
+
+    static TemplateList decompress(const QByteArray &compressed, quint32 count)
+    {
+        const QByteArray data = qUncompress(compressed);
+        QDataStream dataStream(data);
+        TemplateList templates;
+        templates.reserve(count);
+        for (quint32 i=0; i<count; i++) {
+            Template t;
+            dataStream >> t;
+            templates.append(t);
+        }
+        if (dataStream.status() != QDataStream::Ok)
+            qFatal("Corrupt block in compressed gallery.");
+        return templates;
+    }
+
+    // Reads compressed blocks until prefetch of them are decompressing
+    void fill()
+    {
+        while ((pending.size() < std::max(prefetch, 1)) && !gallery.atEnd()) {
+            quint32 count;
+            QByteArray compressed;
+            stream >> count >> compressed;
+            if (stream.status() != QDataStream::Ok)
+                qFatal("Truncated compressed gallery: %s", qPrintable(gallery.fileName()));
+
+            PendingBlock block;
+            block.templates = QtConcurrent::run(&zgalGallery::decompress, compressed, count);
+            block.end = gallery.pos();
+            pending.append(block);
+        }
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        readOpen();
+        if (pending.isEmpty() && gallery.atEnd()) {
+            gallery.seek(sizeof(CompressedMagic));
+            consumed = gallery.pos();
+        }
+
+        TemplateList templates;
+        fill();
+        while ((templates.size() < readBlockSize) && !pending.isEmpty()) {
+            const PendingBlock block = pending.takeFirst();
+            fill(); // Keep the pool busy while this thread waits on the oldest block
+            templates.append(block.templates.result());
+            consumed = block.end;
+        }
+
+        for (int i=0; i<templates.size(); i++)
+            templates[i].file.set("progress", consumed);
+
+        *done = pending.isEmpty() && gallery.atEnd();
+        return templates;
+    }
+
+    void write(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        writeOpen();
+        if (t.file.fte) {
+            // Only write metadata for failure to enroll, but remove any stored QVariants of type cv::Mat
+            File f = t.file;
+            QVariantMap metadata = f.localMetadata();
+            QMapIterator<QString, QVariant> i(metadata);
+            while (i.hasNext()) {
+                i.next();
+                if (strcmp(i.value().typeName(),"cv::Mat") == 0)
+                    f.remove(i.key());
+            }
+            uncompressedStream << Template(f);
+        } else {
+            uncompressedStream << t;
+        }
+
+        if (++uncompressedTemplates >= quint32(std::max(blockTemplates, 1)))
+            flushBlock();
+    }
+
+    void flushBlock()
+    {
+        stream << uncompressedTemplates << qCompress(uncompressed.data(), level);
+        uncompressed.buffer().clear();
+        uncompressed.seek(0);
+        uncompressedTemplates = 0;
+    }
+
+    qint64 totalSize()
+    {
+        readOpen();
+        return gallery.size();
+    }
+
+    qint64 position()
+    {
+        return consumed;
+    }
+};
+
+BR_REGISTER(Gallery, zgalGallery)
+
+} // namespace br
+
+#include "gallery/zgal.moc"
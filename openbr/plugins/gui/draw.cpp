@@ -27,6 +27,7 @@ namespace br
  * \brief Renders metadata onto the image.
  *
  * The inPlace argument controls whether or not the image is cloned before the metadata is drawn.
+ * With overlay the metadata is recorded for RenderOverlay instead and the image is left untouched.
  *
  * \author Josh Klontz \cite jklontz
  */
@@ -40,6 +41,7 @@ class DrawTransform : public UntrainableTransform
     Q_PROPERTY(int lineThickness READ get_lineThickness WRITE set_lineThickness RESET reset_lineThickness STORED false)
     Q_PROPERTY(bool named READ get_named WRITE set_named RESET reset_named STORED false)
     Q_PROPERTY(bool location READ get_location WRITE set_location RESET reset_location STORED false)
+    Q_PROPERTY(bool overlay READ get_overlay WRITE set_overlay RESET reset_overlay STORED false)
     BR_PROPERTY(bool, verbose, false)
     BR_PROPERTY(bool, points, true)
     BR_PROPERTY(bool, rects, true)
@@ -47,25 +49,34 @@ class DrawTransform : public UntrainableTransform
     BR_PROPERTY(int, lineThickness, 1)
     BR_PROPERTY(bool, named, true)
     BR_PROPERTY(bool, location, true)
+    BR_PROPERTY(bool, overlay, false)
 
     void project(const Template &src, Template &dst) const
     {
         const Scalar color(0,255,0);
         const Scalar verboseColor(255, 255, 0);
-        dst.m() = inPlace ? src.m() : src.m().clone();
+        if (overlay) dst = src;
+        else         dst.m() = inPlace ? src.m() : src.m().clone();
 
         if (points) {
             const QList<Point2f> pointsList = (named) ? OpenCVUtils::toPoints(src.file.points()+src.file.namedPoints()) : OpenCVUtils::toPoints(src.file.points());
             for (int i=0; i<pointsList.size(); i++) {
                 const Point2f &point = pointsList[i];
-                circle(dst, point, 3, color, -1);
                 QString label = (location) ? QString("%1,(%2,%3)").arg(QString::number(i),QString::number(point.x),QString::number(point.y)) : QString("%1").arg(QString::number(i));
-                if (verbose) putText(dst, label.toStdString(), point, FONT_HERSHEY_SIMPLEX, 0.5, verboseColor, 1);
+                if (overlay) {
+                    overlayCircle(dst.file, point, 3, color, -1);
+                    if (verbose) overlayText(dst.file, label, point, 0.5, verboseColor, 1);
+                } else {
+                    circle(dst, point, 3, color, -1);
+                    if (verbose) putText(dst, label.toStdString(), point, FONT_HERSHEY_SIMPLEX, 0.5, verboseColor, 1);
+                }
             }
         }
         if (rects) {
-            foreach (const Rect &rect, OpenCVUtils::toRects(src.file.namedRects() + src.file.rects()))
-                rectangle(dst, rect, color, lineThickness);
+            foreach (const Rect &rect, OpenCVUtils::toRects(src.file.namedRects() + src.file.rects())) {
+                if (overlay) overlayRectangle(dst.file, rect, color, lineThickness);
+                else         rectangle(dst, rect, color, lineThickness);
+            }
         }
     }
 };
@@ -25,11 +25,14 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Creates a Delaunay triangulation based on a set of points
+ * \br_property bool overlay Record the triangles for RenderOverlay instead of drawing them.
  * \author Scott Klum \cite sklum
  */
 class DrawDelaunayTransform : public UntrainableTransform
 {
     Q_OBJECT
+    Q_PROPERTY(bool overlay READ get_overlay WRITE set_overlay RESET reset_overlay STORED false)
+    BR_PROPERTY(bool, overlay, false)
 
     void project(const Template &src, Template &dst) const
     {
@@ -40,9 +43,11 @@ class DrawDelaunayTransform : public UntrainableTransform
 
             // Clone the matrix do draw on it
             for (int i = 0; i < validTriangles.size(); i+=3) {
-                line(dst, validTriangles[i], validTriangles[i+1], Scalar(0,0,0), 1);
-                line(dst, validTriangles[i+1], validTriangles[i+2], Scalar(0,0,0), 1);
-                line(dst, validTriangles[i+2], validTriangles[i], Scalar(0,0,0), 1);
+                for (int j = 0; j < 3; j++) {
+                    const Point2f &a = validTriangles[i+j], &b = validTriangles[i+(j+1)%3];
+                    if (overlay) overlayLine(dst.file, a, b, Scalar(0,0,0), 1);
+                    else         line(dst, a, b, Scalar(0,0,0), 1);
+                }
             }
         } else qWarning("Template does not contain Delaunay triangulation.");
     }
@@ -26,6 +26,7 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Draws a grid on the image
+ * \br_property bool overlay Record the grid for RenderOverlay instead of drawing it.
  * \author Josh Klontz \cite jklontz
  */
 class DrawGridLinesTransform : public UntrainableTransform
@@ -36,23 +37,30 @@ class DrawGridLinesTransform : public UntrainableTransform
     Q_PROPERTY(int r READ get_r WRITE set_r RESET reset_r STORED false)
     Q_PROPERTY(int g READ get_g WRITE set_g RESET reset_g STORED false)
     Q_PROPERTY(int b READ get_b WRITE set_b RESET reset_b STORED false)
+    Q_PROPERTY(bool overlay READ get_overlay WRITE set_overlay RESET reset_overlay STORED false)
     BR_PROPERTY(int, rows, 0)
     BR_PROPERTY(int, columns, 0)
     BR_PROPERTY(int, r, 196)
     BR_PROPERTY(int, g, 196)
     BR_PROPERTY(int, b, 196)
+    BR_PROPERTY(bool, overlay, false)
 
     void project(const Template &src, Template &dst) const
     {
-        Mat m = src.m().clone();
+        Mat m = overlay ? src.m() : src.m().clone();
+        if (overlay) dst = src;
         float rowStep = 1.f * m.rows / (rows+1);
         float columnStep = 1.f * m.cols / (columns+1);
         int thickness = qMin(m.rows, m.cols) / 256;
-        for (float row = rowStep/2; row < m.rows; row += rowStep)
-            line(m, Point(0, row), Point(m.cols, row), Scalar(r, g, b), thickness, CV_AA);
-        for (float column = columnStep/2; column < m.cols; column += columnStep)
-            line(m, Point(column, 0), Point(column, m.rows), Scalar(r, g, b), thickness, CV_AA);
-        dst = m;
+        for (float row = rowStep/2; row < m.rows; row += rowStep) {
+            if (overlay) overlayLine(dst.file, Point(0, row), Point(m.cols, row), Scalar(r, g, b), thickness, CV_AA);
+            else         line(m, Point(0, row), Point(m.cols, row), Scalar(r, g, b), thickness, CV_AA);
+        }
+        for (float column = columnStep/2; column < m.cols; column += columnStep) {
+            if (overlay) overlayLine(dst.file, Point(column, 0), Point(column, m.rows), Scalar(r, g, b), thickness, CV_AA);
+            else         line(m, Point(column, 0), Point(column, m.rows), Scalar(r, g, b), thickness, CV_AA);
+        }
+        if (!overlay) dst = m;
     }
 };
 
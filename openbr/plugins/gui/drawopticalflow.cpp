@@ -25,6 +25,7 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Draw a line representing the direction and magnitude of optical flow at the specified points.
+ * \br_property bool overlay Record the lines for RenderOverlay instead of drawing them.
  * \author Austin Blanton \cite imaus10
  */
 class DrawOpticalFlow : public UntrainableTransform
@@ -32,6 +33,8 @@ class DrawOpticalFlow : public UntrainableTransform
     Q_OBJECT
     Q_PROPERTY(QString original READ get_original WRITE set_original RESET reset_original STORED false)
     BR_PROPERTY(QString, original, "original")
+    Q_PROPERTY(bool overlay READ get_overlay WRITE set_overlay RESET reset_overlay STORED false)
+    BR_PROPERTY(bool, overlay, false)
 
     void project(const Template &src, Template &dst) const
     {
@@ -44,7 +47,8 @@ class DrawOpticalFlow : public UntrainableTransform
         foreach (const Point2f &pt, OpenCVUtils::toPoints(dst.file.points())) {
             Point2f dxy = flow.at<Point2f>(pt.y, pt.x);
             Point2f newPt(pt.x+dxy.x, pt.y+dxy.y);
-            line(dst, pt, newPt, color);
+            if (overlay) overlayLine(dst.file, pt, newPt, color);
+            else         line(dst, pt, newPt, color);
         }
     }
 };
@@ -27,6 +27,7 @@ namespace br
  * \brief Draw the values of a list of properties at the specified point on the image
  *
  * The inPlace argument controls whether or not the image is cloned before it is drawn on.
+ * With overlay the text is recorded for RenderOverlay instead and the image is left untouched.
  *
  * \author Charles Otto \cite caotto
  */
@@ -36,9 +37,11 @@ class DrawPropertiesPointTransform : public UntrainableTransform
     Q_PROPERTY(QStringList propNames READ get_propNames WRITE set_propNames RESET reset_propNames STORED false)
     Q_PROPERTY(QString pointName READ get_pointName WRITE set_pointName RESET reset_pointName STORED false)
     Q_PROPERTY(bool inPlace READ get_inPlace WRITE set_inPlace RESET reset_inPlace STORED false)
+    Q_PROPERTY(bool overlay READ get_overlay WRITE set_overlay RESET reset_overlay STORED false)
     BR_PROPERTY(QStringList, propNames, QStringList())
     BR_PROPERTY(QString, pointName, "")
     BR_PROPERTY(bool, inPlace, false)
+    BR_PROPERTY(bool, overlay, false)
 
     void project(const Template &src, Template &dst) const
     {
@@ -46,7 +49,7 @@ class DrawPropertiesPointTransform : public UntrainableTransform
         if (propNames.isEmpty() || pointName.isEmpty())
             return;
 
-        dst.m() = inPlace ? src.m() : src.m().clone();
+        if (!overlay) dst.m() = inPlace ? src.m() : src.m().clone();
 
         QVariant point = dst.file.value(pointName);
 
@@ -74,7 +77,8 @@ class DrawPropertiesPointTransform : public UntrainableTransform
         if (outString.empty())
             return;
 
-        putText(dst, outString, cvPoint, FONT_HERSHEY_SIMPLEX, 0.5, textColor, 1);
+        if (overlay) overlayText(dst.file, QString::fromStdString(outString), cvPoint, 0.5, textColor, 1);
+        else         putText(dst, outString, cvPoint, FONT_HERSHEY_SIMPLEX, 0.5, textColor, 1);
     }
 
 };
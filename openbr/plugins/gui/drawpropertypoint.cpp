@@ -27,6 +27,7 @@ namespace br
  * \brief Draw the value of the specified property at the specified point on the image
  *
  * The inPlace argument controls whether or not the image is cloned before it is drawn on.
+ * With overlay the text is recorded for RenderOverlay instead and the image is left untouched.
  *
  * \author Charles Otto \cite caotto
  */
@@ -36,9 +37,11 @@ class DrawPropertyPointTransform : public UntrainableTransform
     Q_PROPERTY(QString propName READ get_propName WRITE set_propName RESET reset_propName STORED false)
     Q_PROPERTY(QString pointName READ get_pointName WRITE set_pointName RESET reset_pointName STORED false)
     Q_PROPERTY(bool inPlace READ get_inPlace WRITE set_inPlace RESET reset_inPlace STORED false)
+    Q_PROPERTY(bool overlay READ get_overlay WRITE set_overlay RESET reset_overlay STORED false)
     BR_PROPERTY(QString, propName, "")
     BR_PROPERTY(QString, pointName, "")
     BR_PROPERTY(bool, inPlace, false)
+    BR_PROPERTY(bool, overlay, false)
 
 
     void project(const Template &src, Template &dst) const
@@ -47,7 +50,7 @@ class DrawPropertyPointTransform : public UntrainableTransform
         if (propName.isEmpty() || pointName.isEmpty())
             return;
 
-        dst.m() = inPlace ? src.m() : src.m().clone();
+        if (!overlay) dst.m() = inPlace ? src.m() : src.m().clone();
 
         const Scalar textColor(255, 255, 0);
 
@@ -68,7 +71,8 @@ class DrawPropertyPointTransform : public UntrainableTransform
         Point2f cvPoint = OpenCVUtils::toPoint(targetPoint);
 
         std::string text = propName.toStdString() + ": " + propString.toStdString();
-        putText(dst, text, cvPoint, FONT_HERSHEY_SIMPLEX, 0.5, textColor, 1);
+        if (overlay) overlayText(dst.file, QString::fromStdString(text), cvPoint, 0.5, textColor, 1);
+        else         putText(dst, text, cvPoint, FONT_HERSHEY_SIMPLEX, 0.5, textColor, 1);
     }
 
 };
@@ -0,0 +1,110 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <openbr/plugins/openbr_internal.h>
+
+using namespace cv;
+
+namespace br
+{
+
+// Each primitive is a QVariantList of
+// type, x1, y1, x2, y2, blue, green, red, thickness, lineType, radius, scale, text
+enum OverlayType { OverlayCircle, OverlayLine, OverlayRectangle, OverlayText };
+
+static void appendOverlay(File &file, OverlayType type, const Point2f &a, const Point2f &b, const Scalar &color,
+                          int thickness, int lineType = 8, int radius = 0, double scale = 0, const QString &text = QString())
+{
+    QVariantList primitive;
+    primitive << int(type) << a.x << a.y << b.x << b.y << color[0] << color[1] << color[2]
+              << thickness << lineType << radius << scale << text;
+    QVariantList overlay = file.value("Overlay").toList();
+    overlay.append(QVariant(primitive));
+    file.set("Overlay", overlay);
+}
+
+void overlayCircle(File &file, const Point2f &center, int radius, const Scalar &color, int thickness)
+{
+    appendOverlay(file, OverlayCircle, center, center, color, thickness, 8, radius);
+}
+
+void overlayLine(File &file, const Point2f &a, const Point2f &b, const Scalar &color, int thickness, int lineType)
+{
+    appendOverlay(file, OverlayLine, a, b, color, thickness, lineType);
+}
+
+void overlayRectangle(File &file, const Rect &rect, const Scalar &color, int thickness)
+{
+    appendOverlay(file, OverlayRectangle, rect.tl(), rect.br(), color, thickness);
+}
+
+void overlayText(File &file, const QString &text, const Point2f &origin, double scale, const Scalar &color, int thickness)
+{
+    appendOverlay(file, OverlayText, origin, origin, color, thickness, 8, 0, scale, text);
+}
+
+void renderOverlay(File &file, Mat &m)
+{
+    foreach (const QVariant &variant, file.value("Overlay").toList()) {
+        const QVariantList p = variant.toList();
+        if (p.size() != 13) qFatal("Malformed overlay primitive.");
+        const Point2f a(p[1].toFloat(), p[2].toFloat()), b(p[3].toFloat(), p[4].toFloat());
+        const Scalar color(p[5].toDouble(), p[6].toDouble(), p[7].toDouble());
+        const int thickness = p[8].toInt(), lineType = p[9].toInt();
+        switch (p[0].toInt()) {
+          case OverlayCircle:    circle(m, a, p[10].toInt(), color, thickness, lineType); break;
+          case OverlayLine:      line(m, a, b, color, thickness, lineType); break;
+          case OverlayRectangle: rectangle(m, a, b, color, thickness, lineType); break;
+          case OverlayText:      putText(m, p[12].toString().toStdString(), a, FONT_HERSHEY_SIMPLEX, p[11].toDouble(), color, thickness, lineType); break;
+          default:               qFatal("Unknown overlay primitive.");
+        }
+    }
+    file.remove("Overlay");
+}
+
+/*!
+ * \ingroup transforms
+ * \brief Rasterizes the primitives recorded by draw transforms run with overlay set.
+ *
+ * All of the primitives are drawn onto one copy of the image, in the order they were recorded,
+ * rather than each draw step cloning the frame. Like any untrainable transform it runs on frames in parallel.
+ * \br_property bool inPlace Draw without cloning the image first.
+ * \author Unknown \cite unknown
+ */
+class RenderOverlayTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(bool inPlace READ get_inPlace WRITE set_inPlace RESET reset_inPlace STORED false)
+    BR_PROPERTY(bool, inPlace, false)
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        if (!src.file.contains("Overlay") || src.isEmpty())
+            return;
+
+        if (!inPlace) dst.m() = src.m().clone();
+        renderOverlay(dst.file, dst.m());
+    }
+};
+
+BR_REGISTER(Transform, RenderOverlayTransform)
+
+} // namespace br
+
+#include "gui/renderoverlay.moc"
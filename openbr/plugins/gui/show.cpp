@@ -150,10 +150,16 @@ protected:
     QWaitCondition wait;
     QPixmap pixmap;
 
+    // Mailbox for postImage, holds the most recent frame not yet shown
+    QMutex latestLock;
+    QImage latest;
+    bool latestPending;
+
 public:
 
     DisplayWindow(QWidget *parent = NULL) : QLabel(parent)
     {
+        latestPending = false;
         setFixedSize(200,200);
         QApplication::instance()->installEventFilter(this);
     }
@@ -162,7 +168,31 @@ public:
         QApplication::instance()->removeEventFilter(this);
     }
 
+    // May be called from any thread without waiting on the main thread.
+    // A frame still waiting to be shown is replaced, so at most one is ever queued.
+    void postImage(const QImage &image)
+    {
+        QMutexLocker locker(&latestLock);
+        latest = image;
+        if (latestPending) return;
+        latestPending = true;
+        QMetaObject::invokeMethod(this, "showLatest", Qt::QueuedConnection);
+    }
+
 public slots:
+    void showLatest()
+    {
+        QImage image;
+        {
+            QMutexLocker locker(&latestLock);
+            image = latest;
+            latest = QImage();
+            latestPending = false;
+        }
+        if (!image.isNull())
+            showImage(QPixmap::fromImage(image));
+    }
+
     void showImage(const QPixmap &input)
     {
         pixmap = input;
@@ -528,6 +558,14 @@ private:
  *
  * Can be used with parallelism enabled, although it is considered TimeVarying.
  *
+ * By default every frame is shown and, with waitInput, the pipeline waits on the window.
+ * When maxRate is positive frames are instead handed to the window without waiting, at most maxRate times a second.
+ * Frames arriving faster are dropped before they are converted, and one not yet painted is replaced by the newest,
+ * so throughput doesn't depend on the window. waitInput is ignored in this mode.
+ *
+ * \br_property bool waitInput Wait for a key press after each image.
+ * \br_property QStringList keys Metadata shown in the window title.
+ * \br_property float maxRate If positive, the maximum number of frames displayed per second without blocking.
  * \author Charles Otto \cite caotto
  */
 class ShowTransform : public TimeVaryingTransform
@@ -540,6 +578,9 @@ public:
     Q_PROPERTY(QStringList keys READ get_keys WRITE set_keys RESET reset_keys STORED false)
     BR_PROPERTY(QStringList, keys, QStringList())
 
+    Q_PROPERTY(float maxRate READ get_maxRate WRITE set_maxRate RESET reset_maxRate STORED false)
+    BR_PROPERTY(float, maxRate, 0)
+
     ShowTransform() : TimeVaryingTransform(false, false)
     {
         displayBuffer = NULL;
@@ -564,20 +605,13 @@ public:
         if (src.empty())
             return;
 
-        foreach (const Template &t, src) {
-            // build label
-            QString newTitle;
-
-            foreach (const QString &s, keys) {
-                if (s.compare("name", Qt::CaseInsensitive) == 0) {
-                    newTitle = newTitle + s + ": " + t.file.fileName() + " ";
-                } else if (t.file.contains(s)) {
-                    QString out = t.file.get<QString>(s);
-                    newTitle = newTitle + s + ": " + out + " ";
-                }
+        if (maxRate > 0) {
+            postLatest(src);
+            return;
+        }
 
-            }
-            emit this->changeTitle(newTitle);
+        foreach (const Template &t, src) {
+            emit this->changeTitle(title(t));
 
             foreach (const cv::Mat &m, t) {
                 if (!m.data) continue;
@@ -603,6 +637,42 @@ public:
         emit hideWindow();
     }
 
+    QString title(const Template &t) const
+    {
+        QString newTitle;
+        foreach (const QString &s, keys) {
+            if (s.compare("name", Qt::CaseInsensitive) == 0) {
+                newTitle = newTitle + s + ": " + t.file.fileName() + " ";
+            } else if (t.file.contains(s)) {
+                QString out = t.file.get<QString>(s);
+                newTitle = newTitle + s + ": " + out + " ";
+            }
+        }
+        return newTitle;
+    }
+
+    // Non-blocking display of the newest image in src, if one is due
+    void postLatest(const TemplateList &src)
+    {
+        if (!window) return;
+
+        {
+            QMutexLocker locker(&rateLock);
+            if (displayTimer.isValid() && (displayTimer.nsecsElapsed() < qint64(1e9 / maxRate)))
+                return;
+            displayTimer.start();
+        }
+
+        for (int i=src.size()-1; i>=0; i--) {
+            for (int j=src[i].size()-1; j>=0; j--) {
+                if (!src[i][j].data) continue;
+                emit changeTitle(title(src[i]));
+                window->postImage(toQImage(src[i][j]));
+                return;
+            }
+        }
+    }
+
     void init()
     {
         initActual<DisplayWindow>();
@@ -636,6 +706,8 @@ protected:
     DisplayWindow *window;
     QImage qImageBuffer;
     QPixmap *displayBuffer;
+    QMutex rateLock;
+    QElapsedTimer displayTimer; // Since the last frame posted in non-blocking mode
 
 signals:
     void updateImage(const QPixmap &input);
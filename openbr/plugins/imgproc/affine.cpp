@@ -17,6 +17,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/arena.h>
 #include <openbr/core/opencvutils.h>
 
 using namespace cv;
@@ -29,6 +30,7 @@ namespace br
  * \brief Performs a two or three point registration.
  * \author Josh Klontz \cite jklontz
  * \note Method: Area should be used for shrinking an image, Cubic for slow but accurate enlargment, Bilin for fast enlargement.
+ * \br_property bool gray Convert color images to gray, as Cvt(Gray) would. With Bilin, 8-bit color is warped and converted in a single pass over the output.
  */
 class AffineTransform : public UntrainableTransform
 {
@@ -55,6 +57,7 @@ private:
     Q_PROPERTY(Method method READ get_method WRITE set_method RESET reset_method STORED false)
     Q_PROPERTY(bool storeAffine READ get_storeAffine WRITE set_storeAffine RESET reset_storeAffine STORED false)
     Q_PROPERTY(bool warpPoints READ get_warpPoints WRITE set_warpPoints RESET reset_warpPoints STORED false)
+    Q_PROPERTY(bool gray READ get_gray WRITE set_gray RESET reset_gray STORED false)
     BR_PROPERTY(int, width, 64)
     BR_PROPERTY(int, height, 64)
     BR_PROPERTY(float, x1, 0)
@@ -66,6 +69,20 @@ private:
     BR_PROPERTY(Method, method, Bilin)
     BR_PROPERTY(bool, storeAffine, false)
     BR_PROPERTY(bool, warpPoints, false)
+    BR_PROPERTY(bool, gray, false)
+
+    // Gray contribution of each BGR value in cvtColor's fixed point
+    int grayLut[3][256];
+    static const int GrayShift = 14;
+
+    void init()
+    {
+        for (int i=0; i<256; i++) {
+            grayLut[0][i] = i*1868;
+            grayLut[1][i] = i*9617;
+            grayLut[2][i] = i*4899;
+        }
+    }
 
     static Point2f getThirdAffinePoint(const Point2f &a, const Point2f &b)
     {
@@ -74,9 +91,47 @@ private:
         return Point2f(a.x - dy, a.y + dx);
     }
 
+    // Bilinear warp sampling only the output pixels, converting each source pixel to gray as it is read
+    void warpGray(const Mat &src, Mat &dst, const Mat &affineTransform) const
+    {
+        Mat inverse;
+        invertAffineTransform(affineTransform, inverse);
+        const double *M = inverse.ptr<double>();
+
+        dst.create(height, width, CV_8UC1);
+        const int channels = src.channels();
+        for (int y=0; y<height; y++) {
+            uchar *row = dst.ptr<uchar>(y);
+            for (int x=0; x<width; x++) {
+                const double sx = M[0]*x + M[1]*y + M[2];
+                const double sy = M[3]*x + M[4]*y + M[5];
+                const int x0 = cvFloor(sx), y0 = cvFloor(sy);
+                const float fx = sx - x0, fy = sy - y0;
+
+                // Pixels outside the source are black, as with warpAffine's default border
+                float value[2][2];
+                for (int i=0; i<2; i++)
+                    for (int j=0; j<2; j++) {
+                        const int r = y0 + i, c = x0 + j;
+                        if ((r < 0) || (r >= src.rows) || (c < 0) || (c >= src.cols)) {
+                            value[i][j] = 0;
+                        } else {
+                            const uchar *bgr = src.ptr<uchar>(r) + c*channels;
+                            value[i][j] = grayLut[0][bgr[0]] + grayLut[1][bgr[1]] + grayLut[2][bgr[2]];
+                        }
+                    }
+
+                const float top = value[0][0] + fx*(value[0][1] - value[0][0]);
+                const float bottom = value[1][0] + fx*(value[1][1] - value[1][0]);
+                row[x] = saturate_cast<uchar>((top + fy*(bottom - top)) / (1 << GrayShift));
+            }
+        }
+    }
+
     void project(const Template &src, Template &dst) const
     {
         const bool twoPoints = ((x3 == -1) || (y3 == -1));
+        dst = Arena::mat();
 
         Point2f dstPoints[3];
         dstPoints[0] = Point2f(x1*width, y1*height);
@@ -96,6 +151,8 @@ private:
 
             if ((landmarks.size() < 2) || (!twoPoints && (landmarks.size() < 3))) {
                 resize(src, dst, Size(width, height));
+                if (gray && (dst.m().channels() > 1))
+                    OpenCVUtils::cvtGray(dst.m(), dst.m());
                 return;
             } else {
                 srcPoints[0] = landmarks[0];
@@ -110,7 +167,13 @@ private:
         if (twoPoints) srcPoints[2] = getThirdAffinePoint(srcPoints[0], srcPoints[1]);
 
         Mat affineTransform = getAffineTransform(srcPoints, dstPoints);
-        warpAffine(src, dst, affineTransform, Size(width, height), method);
+        if (gray && (src.m().depth() == CV_8U) && (src.m().channels() == 3) && (method == Bilin)) {
+            warpGray(src, dst, affineTransform);
+        } else {
+            warpAffine(src, dst, affineTransform, Size(width, height), method);
+            if (gray && (dst.m().channels() > 1))
+                OpenCVUtils::cvtGray(dst.m(), dst.m());
+        }
         dst.file.set("Affine_0", OpenCVUtils::fromPoint(dstPoints[0]));
         dst.file.set("Affine_1", OpenCVUtils::fromPoint(dstPoints[1]));
         if (!twoPoints) dst.file.set("Affine_2", OpenCVUtils::fromPoint(dstPoints[2]));
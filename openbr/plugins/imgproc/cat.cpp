@@ -24,6 +24,8 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Concatenates all input matrices into a single matrix.
+ *
+ * Inputs may be non-contiguous views, such as the regions output by RectRegions, and are copied row by row.
  * \author Josh Klontz \cite jklontz
  */
 class CatTransform : public UntrainableMetaTransform
@@ -50,7 +52,8 @@ class CatTransform : public UntrainableMetaTransform
         for (int i=0; i<src.size(); i++) {
             size_t size = src[i].total() * src[i].elemSize();
             int j = i % partitions;
-            memcpy(&dst[j].data[offsets[j]], src[i].ptr(), size);
+            Mat view(src[i].rows, src[i].cols, src[i].type(), &dst[j].data[offsets[j]]);
+            src[i].copyTo(view);
             offsets[j] += size;
         }
     }
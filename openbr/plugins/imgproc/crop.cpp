@@ -24,6 +24,8 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Crops about the specified region of interest.
+ *
+ * The crop is a view that shares the input's data, see RectRegionsTransform.
  * \author Josh Klontz \cite jklontz
  */
 class CropTransform : public UntrainableTransform
@@ -28,7 +28,7 @@ namespace br
  * \brief Colorspace conversion.
  * \author Josh Klontz \cite jklontz
  */
-class CvtTransform : public UntrainableTransform
+class CvtTransform : public PointwiseTransform
 {
     Q_OBJECT
     Q_ENUMS(ColorSpace)
@@ -51,9 +51,9 @@ private:
     BR_PROPERTY(ColorSpace, colorSpace, Gray)
     BR_PROPERTY(int, channel, -1)
 
-    void project(const Template &src, Template &dst) const
+    void apply(const Mat &src, Mat &dst) const
     {
-        if (src.m().channels() > 1 || colorSpace == CV_GRAY2BGR) cvtColor(src, dst, colorSpace);
+        if (src.channels() > 1 || colorSpace == CV_GRAY2BGR) cvtColor(src, dst, colorSpace);
         else dst = src;
 
         if (channel != -1) {
@@ -62,6 +62,23 @@ private:
             dst = mv[channel % (int)mv.size()];
         }
     }
+
+    bool lower(QStringList &channels, int &depth) const
+    {
+        if ((channel != -1) || ((colorSpace != Gray) && (colorSpace != RGBGray)))
+            return false;
+        if (channels.size() == 1)
+            return true;
+        if ((channels.size() != 3) || ((depth != CV_8U) && (depth != CV_32F)))
+            return false;
+
+        // Rec. 601 luma, rounded like cvtColor for 8U
+        const QString &b = channels[colorSpace == Gray ? 0 : 2];
+        const QString &r = channels[colorSpace == Gray ? 2 : 0];
+        const QString luma = QString("(+ (* 0.114 %1) (* 0.587 %2) (* 0.299 %3))").arg(b, channels[1], r);
+        channels = QStringList() << ((depth == CV_8U) ? QString("(u8 (+ %1 0.5))").arg(luma) : QString("(f32 %1)").arg(luma));
+        return true;
+    }
 };
 
 BR_REGISTER(Transform, CvtTransform)
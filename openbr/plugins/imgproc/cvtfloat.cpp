@@ -26,13 +26,21 @@ namespace br
  * \brief Convert to floating point format.
  * \author Josh Klontz \cite jklontz
  */
-class CvtFloatTransform : public UntrainableTransform
+class CvtFloatTransform : public PointwiseTransform
 {
     Q_OBJECT
 
-    void project(const Template &src, Template &dst) const
+    void apply(const Mat &src, Mat &dst) const
     {
-        src.m().convertTo(dst, CV_32F);
+        src.convertTo(dst, CV_32F);
+    }
+
+    bool lower(QStringList &channels, int &depth) const
+    {
+        for (int i=0; i<channels.size(); i++)
+            channels[i] = QString("(f32 %1)").arg(channels[i]);
+        depth = CV_32F;
+        return true;
     }
 };
 
@@ -0,0 +1,248 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <openbr/plugins/openbr_internal.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief SIFT descriptors on a grid of landmarks, one matrix per landmark.
+ *
+ * Equivalent to Grid(rows,columns,border)+SIFTDescriptor(size)+ByRow.
+ * Rather than letting OpenCV recompute image gradients around every overlapping keypoint,
+ * gradient magnitude and orientation bins are computed once per image with OpenCV's vectorized array functions.
+ * Each descriptor then accumulates from these shared planes using sample offsets, bins and weights precomputed in init().
+ * The accumulation follows OpenCV's own order, so descriptors agree with SIFTDescriptor to within floating point rounding.
+ * \br_property int rows Number of grid rows.
+ * \br_property int columns Number of grid columns.
+ * \br_property float border Grid border, as a fraction of the image size if less than one, otherwise in pixels.
+ * \br_property int size Keypoint diameter.
+ * \br_property double sigma Gaussian smoothing of the input image, as in SIFTDescriptor.
+ * \author Unknown \cite unknown
+ */
+class DenseSIFTDescriptorTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int rows READ get_rows WRITE set_rows RESET reset_rows STORED false)
+    Q_PROPERTY(int columns READ get_columns WRITE set_columns RESET reset_columns STORED false)
+    Q_PROPERTY(float border READ get_border WRITE set_border RESET reset_border STORED false)
+    Q_PROPERTY(int size READ get_size WRITE set_size RESET reset_size STORED false)
+    Q_PROPERTY(double sigma READ get_sigma WRITE set_sigma RESET reset_sigma STORED false)
+    BR_PROPERTY(int, rows, 1)
+    BR_PROPERTY(int, columns, 1)
+    BR_PROPERTY(float, border, 0)
+    BR_PROPERTY(int, size, 12)
+    BR_PROPERTY(double, sigma, 1.6)
+
+    // Descriptor layout, as in OpenCV's SIFT
+    static const int Width = 4; // Spatial cells per side
+    static const int Bins = 8; // Orientation bins per cell
+    static const int HistogramSize = (Width+2)*(Width+2)*(Bins+2);
+
+    struct Sample
+    {
+        int i, j; // Offset from the keypoint
+        int cell; // Histogram index of the sample's lower spatial cell
+        float rbin, cbin; // Interpolation weights towards the upper cells
+        float weight; // Gaussian window
+    };
+
+    std::vector<Sample> samples; // In OpenCV's accumulation order
+    float orientation;
+    int radius;
+
+    void init()
+    {
+        // OpenCV describes KeyPoint's default angle of -1 at 360 - angle degrees
+        orientation = 360.f - KeyPoint().angle;
+
+        const float histWidth = 3.f * size * 0.5f;
+        radius = cvRound(histWidth * 1.4142135623730951f * (Width + 1) * 0.5f);
+        const float cosT = cosf(orientation*(float)(CV_PI/180)) / histWidth;
+        const float sinT = sinf(orientation*(float)(CV_PI/180)) / histWidth;
+        const float expScale = -1.f/(Width * Width * 0.5f);
+
+        samples.clear();
+        std::vector<float> weights;
+        for (int i=-radius; i<=radius; i++)
+            for (int j=-radius; j<=radius; j++) {
+                const float cRot = j * cosT - i * sinT;
+                const float rRot = j * sinT + i * cosT;
+                const float rbin = rRot + Width/2 - 0.5f;
+                const float cbin = cRot + Width/2 - 0.5f;
+                if ((rbin <= -1) || (rbin >= Width) || (cbin <= -1) || (cbin >= Width))
+                    continue;
+
+                Sample sample;
+                sample.i = i;
+                sample.j = j;
+                const int r0 = cvFloor(rbin);
+                const int c0 = cvFloor(cbin);
+                sample.cell = ((r0+1)*(Width+2) + c0+1)*(Bins+2);
+                sample.rbin = rbin - r0;
+                sample.cbin = cbin - c0;
+                samples.push_back(sample);
+                weights.push_back((cRot * cRot + rRot * rRot)*expScale);
+            }
+
+        if (!weights.empty())
+            exp(weights, weights);
+        for (size_t k=0; k<samples.size(); k++)
+            samples[k].weight = weights[k];
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        const Mat &m = src.m();
+        if (m.depth() != CV_8U)
+            qFatal("Expected 8-bit images.");
+
+        QList<QPointF> landmarks;
+        const float rowBorder = (border < 1 ? m.rows*border : border);
+        const float colBorder = (border < 1 ? m.cols*border : border);
+        const float rowStep = (m.rows-rowBorder*2) / rows;
+        const float columnStep = (m.cols-colBorder*2) / columns;
+        for (float y=rowStep/2+rowBorder; y<m.rows-rowBorder; y+=rowStep)
+            for (float x=columnStep/2+colBorder; x<m.cols-colBorder; x+=columnStep)
+                landmarks.append(QPointF(x,y));
+
+        dst.file = src.file;
+        dst.file.setPoints(landmarks);
+
+        // The base level of OpenCV's Gaussian pyramid, which assumes the input is already blurred by half a pixel
+        Mat gray, image;
+        if ((m.channels() == 3) || (m.channels() == 4)) cvtColor(m, gray, CV_BGR2GRAY);
+        else                                             gray = m;
+        gray.convertTo(image, CV_32F);
+        const float s = sigma;
+        const float blur = sqrtf(std::max(s * s - 0.25f, 0.01f));
+        GaussianBlur(image, image, Size(), blur, blur);
+
+        // Shared gradient planes over the image interior, where gradients are defined
+        Mat magnitudes, bins, fractions;
+        if ((image.rows > 2) && (image.cols > 2)) {
+            const Rect interior(1, 1, image.cols-2, image.rows-2);
+            Mat dx, dy, orientations;
+            subtract(image(interior + Point(1, 0)), image(interior - Point(1, 0)), dx);
+            subtract(image(interior - Point(0, 1)), image(interior + Point(0, 1)), dy);
+            magnitude(dx, dy, magnitudes);
+            phase(dx, dy, orientations, true);
+
+            bins.create(orientations.size(), CV_32SC1);
+            fractions.create(orientations.size(), CV_32FC1);
+            for (int r=0; r<orientations.rows; r++) {
+                const float *orientationRow = orientations.ptr<float>(r);
+                int *binRow = bins.ptr<int>(r);
+                float *fractionRow = fractions.ptr<float>(r);
+                for (int c=0; c<orientations.cols; c++) {
+                    float obin = (orientationRow[c] - orientation)*(Bins / 360.f);
+                    int o0 = cvFloor(obin);
+                    obin -= o0;
+                    // OpenCV wraps only once, so orientations within a degree of zero land in bin -1, which we reproduce
+                    if (o0 < 0) o0 += Bins;
+                    if (o0 >= Bins) o0 -= Bins;
+                    binRow[c] = o0;
+                    fractionRow[c] = obin;
+                }
+            }
+        }
+
+        // Clip the radius to the image diagonal, as OpenCV does
+        const int limit = std::min(radius, (int) sqrt((double) image.cols*image.cols + image.rows*image.rows));
+        const int length = Width*Width*Bins;
+        Mat descriptors(landmarks.size(), length, CV_32FC1);
+        std::vector<float> buffer(HistogramSize + 1); // Leading slack element for bin -1
+        float *hist = &buffer[1];
+
+        for (int k=0; k<landmarks.size(); k++) {
+            const Point pt(cvRound(landmarks[k].x()), cvRound(landmarks[k].y()));
+            std::fill(buffer.begin(), buffer.end(), 0.f);
+
+            for (size_t l=0; l<samples.size(); l++) {
+                const Sample &sample = samples[l];
+                if ((std::abs(sample.i) > limit) || (std::abs(sample.j) > limit))
+                    continue;
+                const int r = pt.y + sample.i, c = pt.x + sample.j;
+                if ((r <= 0) || (r >= image.rows - 1) || (c <= 0) || (c >= image.cols - 1))
+                    continue;
+
+                const float rbin = sample.rbin, cbin = sample.cbin;
+                const float obin = fractions.at<float>(r-1, c-1);
+                const float mag = magnitudes.at<float>(r-1, c-1)*sample.weight;
+
+                // Tri-linear interpolation
+                const float v_r1 = mag*rbin, v_r0 = mag - v_r1;
+                const float v_rc11 = v_r1*cbin, v_rc10 = v_r1 - v_rc11;
+                const float v_rc01 = v_r0*cbin, v_rc00 = v_r0 - v_rc01;
+                const float v_rco111 = v_rc11*obin, v_rco110 = v_rc11 - v_rco111;
+                const float v_rco101 = v_rc10*obin, v_rco100 = v_rc10 - v_rco101;
+                const float v_rco011 = v_rc01*obin, v_rco010 = v_rc01 - v_rco011;
+                const float v_rco001 = v_rc00*obin, v_rco000 = v_rc00 - v_rco001;
+
+                const int idx = sample.cell + bins.at<int>(r-1, c-1);
+                hist[idx] += v_rco000;
+                hist[idx+1] += v_rco001;
+                hist[idx+(Bins+2)] += v_rco010;
+                hist[idx+(Bins+3)] += v_rco011;
+                hist[idx+(Width+2)*(Bins+2)] += v_rco100;
+                hist[idx+(Width+2)*(Bins+2)+1] += v_rco101;
+                hist[idx+(Width+3)*(Bins+2)] += v_rco110;
+                hist[idx+(Width+3)*(Bins+2)+1] += v_rco111;
+            }
+
+            // Wrap the circular orientation histograms
+            float *descriptor = descriptors.ptr<float>(k);
+            for (int i=0; i<Width; i++)
+                for (int j=0; j<Width; j++) {
+                    const int idx = ((i+1)*(Width+2) + (j+1))*(Bins+2);
+                    hist[idx] += hist[idx+Bins];
+                    hist[idx+1] += hist[idx+Bins+1];
+                    for (int o=0; o<Bins; o++)
+                        descriptor[(i*Width + j)*Bins + o] = hist[idx+o];
+                }
+
+            // Hysteresis thresholding and scaling to the byte range
+            float nrm2 = 0;
+            for (int i=0; i<length; i++)
+                nrm2 += descriptor[i]*descriptor[i];
+            const float threshold = std::sqrt(nrm2)*0.2f;
+            nrm2 = 0;
+            for (int i=0; i<length; i++) {
+                descriptor[i] = std::min(descriptor[i], threshold);
+                nrm2 += descriptor[i]*descriptor[i];
+            }
+            nrm2 = 512.f/std::max(std::sqrt(nrm2), FLT_EPSILON);
+            for (int i=0; i<length; i++)
+                descriptor[i] = saturate_cast<uchar>(descriptor[i]*nrm2);
+        }
+
+        for (int i=0; i<descriptors.rows; i++)
+            dst += descriptors.row(i);
+    }
+};
+
+BR_REGISTER(Transform, DenseSIFTDescriptorTransform)
+
+} // namespace br
+
+#include "imgproc/densesift.moc"
@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QMetaEnum>
+#include <QMutex>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
@@ -58,6 +60,7 @@ private:
     Mat kReal, kImaginary;
 
     friend class GaborJetTransform;
+    friend class GaborBankTransform;
 
     static void makeWavelet(float lambda, float theta, float psi, float sigma, float gamma, Mat &kReal, Mat &kImaginary)
     {
@@ -201,6 +204,154 @@ class GaborJetTransform : public UntrainableTransform
 
 BR_REGISTER(Transform, GaborJetTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief A bank of gabor wavelets applied in the frequency domain, one matrix per wavelet and component.
+ *
+ * Each output matches the corresponding Gabor transform.
+ * Wavelet spectra are cached per image size, so each image costs one forward DFT,
+ * and one complex inverse DFT per wavelet that yields its real and imaginary responses together.
+ * Every requested component is derived from that shared response.
+ * \br_property QStringList components Any of Real, Imaginary, Magnitude and Phase, output in the order given for each wavelet.
+ * \author Unknown \cite unknown
+ */
+class GaborBankTransform : public UntrainableTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QList<float> lambdas READ get_lambdas WRITE set_lambdas RESET reset_lambdas STORED false)
+    Q_PROPERTY(QList<float> thetas READ get_thetas WRITE set_thetas RESET reset_thetas STORED false)
+    Q_PROPERTY(QList<float> psis READ get_psis WRITE set_psis RESET reset_psis STORED false)
+    Q_PROPERTY(QList<float> sigmas READ get_sigmas WRITE set_sigmas RESET reset_sigmas STORED false)
+    Q_PROPERTY(QList<float> gammas READ get_gammas WRITE set_gammas RESET reset_gammas STORED false)
+    Q_PROPERTY(QStringList components READ get_components WRITE set_components RESET reset_components STORED false)
+    BR_PROPERTY(QList<float>, lambdas, QList<float>())
+    BR_PROPERTY(QList<float>, thetas, QList<float>())
+    BR_PROPERTY(QList<float>, psis, QList<float>())
+    BR_PROPERTY(QList<float>, sigmas, QList<float>())
+    BR_PROPERTY(QList<float>, gammas, QList<float>())
+    BR_PROPERTY(QStringList, components, QStringList() << "Phase")
+
+    QList<Mat> kReals, kImaginaries;
+    QList<GaborTransform::Component> outputs;
+    int xPad, yPad; // Largest kernel half-size, by which images are padded
+
+    mutable QMutex spectraLock;
+    mutable QHash< QPair<int,int>, QList<Mat> > spectra; // conj(real) + i*conj(imaginary) DFT of each wavelet, by DFT size
+
+    void init()
+    {
+        kReals.clear();
+        kImaginaries.clear();
+        xPad = yPad = 0;
+        foreach (float lambda, lambdas)
+            foreach (float theta, thetas)
+                foreach (float psi, psis)
+                    foreach (float sigma, sigmas)
+                        foreach (float gamma, gammas) {
+                            Mat kReal, kImaginary;
+                            GaborTransform::makeWavelet(lambda, theta, psi, sigma, gamma, kReal, kImaginary);
+                            kReals.append(kReal);
+                            kImaginaries.append(kImaginary);
+                            xPad = std::max(xPad, kReal.cols/2);
+                            yPad = std::max(yPad, kReal.rows/2);
+                        }
+
+        const QMetaEnum component = GaborTransform::staticMetaObject.enumerator(GaborTransform::staticMetaObject.indexOfEnumerator("Component"));
+        outputs.clear();
+        foreach (const QString &name, components) {
+            const int value = component.keyToValue(qPrintable(name));
+            if (value == -1)
+                qFatal("Invalid component: %s", qPrintable(name));
+            outputs.append(GaborTransform::Component(value));
+        }
+
+        QMutexLocker locker(&spectraLock);
+        spectra.clear();
+    }
+
+    // Kernel centered on the origin of a size DFT, wrapping negative offsets around
+    static Mat wrap(const Mat &kernel, const Size &size)
+    {
+        Mat wrapped = Mat::zeros(size, CV_32FC1);
+        for (int y=0; y<kernel.rows; y++)
+            for (int x=0; x<kernel.cols; x++)
+                wrapped.at<float>((y - kernel.rows/2 + size.height) % size.height,
+                                  (x - kernel.cols/2 + size.width) % size.width) = kernel.at<float>(y, x);
+        return wrapped;
+    }
+
+    QList<Mat> filterSpectra(const Size &size) const
+    {
+        QMutexLocker locker(&spectraLock);
+        const QPair<int,int> key(size.width, size.height);
+        if (!spectra.contains(key)) {
+            QList<Mat> filters;
+            for (int i=0; i<kReals.size(); i++) {
+                Mat real, imaginary;
+                dft(wrap(kReals[i], size), real, DFT_COMPLEX_OUTPUT);
+                dft(wrap(kImaginaries[i], size), imaginary, DFT_COMPLEX_OUTPUT);
+
+                // Correlating with both real kernels at once, (Rr - iRi) + i(Ir - iIi)
+                std::vector<Mat> r, im, filter(2);
+                split(real, r);
+                split(imaginary, im);
+                filter[0] = r[0] + im[1];
+                filter[1] = im[0] - r[1];
+                Mat merged;
+                merge(filter, merged);
+                filters.append(merged);
+            }
+            spectra.insert(key, filters);
+        }
+        return spectra[key];
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        if (src.m().channels() != 1)
+            qFatal("Expected single channel images.");
+
+        // filter2D's default border, then zeros up to an efficient DFT size beyond the reach of any kernel
+        Mat image, padded;
+        src.m().convertTo(image, CV_32F);
+        copyMakeBorder(image, padded, yPad, yPad, xPad, xPad, BORDER_REFLECT_101);
+        const Size size(getOptimalDFTSize(padded.cols), getOptimalDFTSize(padded.rows));
+        copyMakeBorder(padded, padded, 0, size.height - padded.rows, 0, size.width - padded.cols, BORDER_CONSTANT, Scalar(0));
+
+        Mat spectrum;
+        dft(padded, spectrum, DFT_COMPLEX_OUTPUT);
+
+        const QList<Mat> filters = filterSpectra(size);
+        const bool polar = outputs.contains(GaborTransform::Magnitude) || outputs.contains(GaborTransform::Phase);
+        foreach (const Mat &filter, filters) {
+            Mat product, response;
+            mulSpectrums(spectrum, filter, product, 0);
+            dft(product, response, DFT_INVERSE | DFT_SCALE);
+
+            std::vector<Mat> parts;
+            split(response(Rect(xPad, yPad, image.cols, image.rows)), parts);
+            Mat magnitude, phase;
+            if (polar)
+                cartToPolar(parts[0], parts[1], magnitude, phase);
+
+            foreach (GaborTransform::Component output, outputs) {
+                Mat m;
+                if      (output == GaborTransform::Real)      m = parts[0];
+                else if (output == GaborTransform::Imaginary) m = parts[1];
+                else if (output == GaborTransform::Magnitude) m = magnitude;
+                else                                          m = phase;
+
+                // filter2D keeps the input depth
+                if (((output == GaborTransform::Real) || (output == GaborTransform::Imaginary)) && (src.m().depth() != CV_32F))
+                    m.convertTo(m, src.m().depth());
+                dst += m;
+            }
+        }
+    }
+};
+
+BR_REGISTER(Transform, GaborBankTransform)
+
 } // namespace br
 
 #include "imgproc/gabor.moc"
@@ -26,7 +26,7 @@ namespace br
  * \brief Gamma correction
  * \author Josh Klontz \cite jklontz
  */
-class GammaTransform : public UntrainableTransform
+class GammaTransform : public PointwiseTransform
 {
     Q_OBJECT
     Q_PROPERTY(float gamma READ get_gamma WRITE set_gamma RESET reset_gamma STORED false)
@@ -41,11 +41,26 @@ class GammaTransform : public UntrainableTransform
         else            for (int i=0; i<256; i++) lut.at<float>(i,0) = pow(i, gamma);
     }
 
-    void project(const Template &src, Template &dst) const
+    void apply(const Mat &src, Mat &dst) const
     {
-        if (src.m().depth() == CV_8U) LUT(src, lut, dst);
+        if (src.depth() == CV_8U) LUT(src, lut, dst);
         else                          pow(src, gamma, dst);
     }
+
+    bool lower(QStringList &channels, int &depth) const
+    {
+        if ((depth != CV_8U) && (depth != CV_32F) && (depth != CV_64F))
+            return false;
+        // Floats go through cv::pow, which gives 1 for a zero power and takes the absolute value for non-integer powers
+        if ((depth != CV_8U) && ((gamma == 0) || (gamma != cvRound(gamma))))
+            return false;
+        const QString cast = (depth == CV_64F) ? "f64" : "f32";
+        for (int i=0; i<channels.size(); i++)
+            channels[i] = (gamma == 0) ? QString("(%1 (log %2))").arg(cast, channels[i])
+                                       : QString("(%1 (pow %2 %3))").arg(cast, channels[i], QString::number(gamma, 'g', 9));
+        if (depth == CV_8U) depth = CV_32F;
+        return true;
+    }
 };
 
 BR_REGISTER(Transform, GammaTransform)
@@ -52,7 +52,8 @@ class GroupTransform : public UntrainableMetaTransform
         for (int i=0; i<src.size(); i++) {
             const size_t bytes = src[i].total() * src[i].elemSize();
             const int j = i / size;
-            memcpy(&dst[j].data[offsets[j]], src[i].ptr(), bytes);
+            Mat view(src[i].rows, src[i].cols, src[i].type(), &dst[j].data[offsets[j]]);
+            src[i].copyTo(view); // Handles non-contiguous views
             offsets[j] += bytes;
         }
     }
@@ -0,0 +1,61 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Convert to IEEE half precision, or back to single precision.
+ *
+ * OpenCV has no half precision depth, so the values are stored as their 16-bit patterns in a CV_16U matrix.
+ * br::L1Distance, br::L2Distance and br::DistDistance compare these directly, and galleries store them at half the size of floats.
+ * \author Unknown \cite unknown
+ * \br_property bool inverse If true, convert half precision matrices back to CV_32F. Default is false.
+ */
+class HalfTransform : public PointwiseTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(bool inverse READ get_inverse WRITE set_inverse RESET reset_inverse STORED false)
+    BR_PROPERTY(bool, inverse, false)
+
+    void apply(const Mat &src, Mat &dst) const
+    {
+        if (inverse) {
+            if (src.depth() != CV_16U)
+                qFatal("Expected half precision input.");
+            const Mat m = src.isContinuous() ? src : src.clone();
+            dst.create(m.rows, m.cols, CV_MAKETYPE(CV_32F, m.channels()));
+            halfToFloat((const quint16*) m.data, (float*) dst.data, int(m.total() * m.channels()));
+        } else {
+            Mat m;
+            src.convertTo(m, CV_32F);
+            dst.create(m.rows, m.cols, CV_MAKETYPE(CV_16U, m.channels()));
+            floatToHalf((const float*) m.data, (quint16*) dst.data, int(m.total() * m.channels()));
+        }
+    }
+};
+
+BR_REGISTER(Transform, HalfTransform)
+
+} // namespace br
+
+#include "imgproc/half.moc"
@@ -26,6 +26,8 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Histograms the matrix
+ *
+ * Single channel inputs are histogrammed where they are, so region views aren't copied first.
  * \author Josh Klontz \cite jklontz
  */
 class HistTransform : public UntrainableTransform
@@ -43,7 +45,8 @@ class HistTransform : public UntrainableTransform
         const int dims = this->dims == -1 ? max - min : this->dims;
 
         std::vector<Mat> mv;
-        split(src, mv);
+        if (src.m().channels() == 1) mv.push_back(src.m());
+        else                         split(src, mv);
         Mat m(mv.size(), dims, CV_32FC1);
 
         for (size_t i=0; i<mv.size(); i++) {
@@ -42,6 +42,33 @@ class IntegralSamplerTransform : public UntrainableTransform
     BR_PROPERTY(int, minSize, 8)
     BR_PROPERTY(bool, secondOrder, false)
 
+    struct Scale
+    {
+        int size, step, numDown, numAcross;
+        int offset; // Row of the scale's first descriptor in the output
+    };
+
+    QList<Scale> layout(const Mat &m, int *descriptors) const
+    {
+        QList<Scale> layout;
+        *descriptors = 0;
+        float idealSize = min(m.rows, m.cols)-1;
+        for (int scale=0; scale<scales; scale++) {
+            Scale s;
+            s.size = idealSize;
+            s.step = idealSize*stepFactor;
+            s.numDown = 1+(m.rows-s.size-1)/s.step;
+            s.numAcross = 1+(m.cols-s.size-1)/s.step;
+            s.offset = *descriptors;
+            layout.append(s);
+            *descriptors += s.numDown*s.numAcross;
+            if (secondOrder) *descriptors += s.numDown*(s.numAcross-1) + (s.numDown-1)*s.numAcross;
+            idealSize /= scaleFactor;
+            if (idealSize < minSize) break;
+        }
+        return layout;
+    }
+
     void project(const Template &src, Template &dst) const
     {
         typedef Eigen::Map< const Eigen::Matrix<qint32,Eigen::Dynamic,1> > InputDescriptor;
@@ -53,59 +80,59 @@ class IntegralSamplerTransform : public UntrainableTransform
         const int channels = m.channels();
         const int rowStep = channels * m.cols;
 
-        int descriptors = 0;
-        float idealSize = min(m.rows, m.cols)-1;
-        for (int scale=0; scale<scales; scale++) {
-            const int currentSize(idealSize);
-            const int numDown = 1+(m.rows-currentSize-1)/int(idealSize*stepFactor);
-            const int numAcross = 1+(m.cols-currentSize-1)/int(idealSize*stepFactor);
-            descriptors += numDown*numAcross;
-            if (secondOrder) descriptors += numDown*(numAcross-1) + (numDown-1)*numAcross;
-            idealSize /= scaleFactor;
-            if (idealSize < minSize) break;
-        }
+        int descriptors;
+        const QList<Scale> scaleLayout = layout(m, &descriptors);
         Mat n(descriptors, channels, CV_32FC1);
 
+        // Visit the integral image once from top to bottom, emitting the row stripe of every scale
+        // whose windows end on the current row, so both rows of the stripe are still in cache.
+        // Each window is written to the same place as a scale by scale traversal.
         const qint32 *dataIn = (qint32*)m.data;
         float *dataOut = (float*)n.data;
-        idealSize = min(m.rows, m.cols)-1;
-        int index = 0;
-        for (int scale=0; scale<scales; scale++) {
-            const int currentSize(idealSize);
-            const int currentStep(idealSize*stepFactor);
-            for (int i=currentSize; i<m.rows; i+=currentStep) {
-                for (int j=currentSize; j<m.cols; j+=currentStep) {
-                    InputDescriptor a(dataIn+((i-currentSize)*rowStep+(j-currentSize)*channels), channels, 1);
-                    InputDescriptor b(dataIn+((i-currentSize)*rowStep+ j             *channels), channels, 1);
-                    InputDescriptor c(dataIn+(i              *rowStep+(j-currentSize)*channels), channels, 1);
-                    InputDescriptor d(dataIn+(i              *rowStep+ j             *channels), channels, 1);
-                    OutputDescriptor y(dataOut+(index*channels), channels, 1);
-                    y = (d-b-c+a).cast<float>()/(currentSize*currentSize);
-                    index++;
+        QVector<int> stripes(scaleLayout.size(), 0);
+        for (int i=0; i<m.rows; i++) {
+            for (int k=0; k<scaleLayout.size(); k++) {
+                const Scale &s = scaleLayout[k];
+                if ((stripes[k] == s.numDown) || (i != s.size + stripes[k]*s.step))
+                    continue;
+                const qint32 *top = dataIn + (i-s.size)*rowStep;
+                const qint32 *bottom = dataIn + i*rowStep;
+                float *y = dataOut + (s.offset + stripes[k]*s.numAcross)*channels;
+                for (int j=s.size; j<m.cols; j+=s.step, y+=channels) {
+                    InputDescriptor a(top   +(j-s.size)*channels, channels, 1);
+                    InputDescriptor b(top   + j        *channels, channels, 1);
+                    InputDescriptor c(bottom+(j-s.size)*channels, channels, 1);
+                    InputDescriptor d(bottom+ j        *channels, channels, 1);
+                    OutputDescriptor(y, channels, 1) = (d-b-c+a).cast<float>()/(s.size*s.size);
                 }
+                stripes[k]++;
             }
+        }
+
+        int index = 0;
+        for (int k=0; k<scaleLayout.size(); k++) {
+            const Scale &s = scaleLayout[k];
+            if (stripes[k] != s.numDown)
+                qFatal("Computed %d of %d row stripes.", stripes[k], s.numDown);
+            index = s.offset + s.numDown*s.numAcross;
             if (secondOrder) {
-                const int numDown = 1+(m.rows-currentSize-1)/currentStep;
-                const int numAcross = 1+(m.cols-currentSize-1)/currentStep;
-                const float *dataIn = n.ptr<float>(index - numDown*numAcross);
-                for (int i=0; i<numDown; i++) {
-                    for (int j=0; j<numAcross; j++) {
-                        SecondOrderInputDescriptor a(dataIn + (i*numAcross+j)*channels, channels, 1);
-                        if (j < numAcross-1) {
+                const float *dataIn = n.ptr<float>(s.offset);
+                for (int i=0; i<s.numDown; i++) {
+                    for (int j=0; j<s.numAcross; j++) {
+                        SecondOrderInputDescriptor a(dataIn + (i*s.numAcross+j)*channels, channels, 1);
+                        if (j < s.numAcross-1) {
                             OutputDescriptor y(dataOut+(index*channels), channels, 1);
-                            y = a - SecondOrderInputDescriptor(dataIn + (i*numAcross+j+1)*channels, channels, 1);
+                            y = a - SecondOrderInputDescriptor(dataIn + (i*s.numAcross+j+1)*channels, channels, 1);
                             index++;
                         }
-                        if (i < numDown-1) {
+                        if (i < s.numDown-1) {
                             OutputDescriptor y(dataOut+(index*channels), channels, 1);
-                            y = a - SecondOrderInputDescriptor(dataIn + ((i+1)*numAcross+j)*channels, channels, 1);
+                            y = a - SecondOrderInputDescriptor(dataIn + ((i+1)*s.numAcross+j)*channels, channels, 1);
                             index++;
                         }
                     }
                 }
             }
-            idealSize /= scaleFactor;
-            if (idealSize < minSize) break;
         }
 
         if (descriptors != index)
@@ -14,6 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/imgproc/imgproc_c.h>
 #include <opencv2/highgui/highgui.hpp>
@@ -21,6 +24,8 @@
 #include <limits>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/arena.h>
+#include <openbr/core/opencvutils.h>
 
 using namespace cv;
 
@@ -45,9 +50,6 @@ class LBPTransform : public UntrainableTransform
     BR_PROPERTY(int, maxTransitions, 8)
     BR_PROPERTY(bool, rotationInvariant, false)
 
-    uchar lut[256];
-    uchar null;
-
     /* Returns the number of 0->1 or 1->0 transitions in i */
     static int numTransitions(int i)
     {
@@ -98,33 +100,117 @@ class LBPTransform : public UntrainableTransform
                 lut[i] = null; // Set to null id
     }
 
-    void project(const Template &src, Template &dst) const
+#ifdef __SSE2__
+    static inline __m128i bit(const float *neighbor, const __m128 &cval, int value)
     {
-        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
-        Mat n(m.rows, m.cols, CV_8UC1);
-        n = null; // Initialize to NULL LBP pattern
-
-        const float *p = (const float*)m.ptr();
-        for (int r=radius; r<m.rows-radius; r++) {
-            for (int c=radius; c<m.cols-radius; c++) {
-                const float cval  =     (p[(r+0*radius)*m.cols+c+0*radius]);
-                n.at<uchar>(r, c) = lut[(p[(r-1*radius)*m.cols+c-1*radius] >= cval ? 128 : 0) |
-                                        (p[(r-1*radius)*m.cols+c+0*radius] >= cval ? 64  : 0) |
-                                        (p[(r-1*radius)*m.cols+c+1*radius] >= cval ? 32  : 0) |
-                                        (p[(r+0*radius)*m.cols+c+1*radius] >= cval ? 16  : 0) |
-                                        (p[(r+1*radius)*m.cols+c+1*radius] >= cval ? 8   : 0) |
-                                        (p[(r+1*radius)*m.cols+c+0*radius] >= cval ? 4   : 0) |
-                                        (p[(r+1*radius)*m.cols+c-1*radius] >= cval ? 2   : 0) |
-                                        (p[(r+0*radius)*m.cols+c-1*radius] >= cval ? 1   : 0)];
-            }
+        return _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(neighbor), cval)), _mm_set1_epi32(value));
+    }
+#endif // __SSE2__
+
+protected:
+    uchar lut[256];
+    uchar null;
+
+    // Codes of row r of the single channel float image m, null where the neighborhood leaves the image
+    template <typename T>
+    void codes(const Mat &m, int r, T *row) const
+    {
+        const int begin = radius, end = m.cols - radius;
+        if ((r < radius) || (r >= m.rows - radius) || (begin >= end)) {
+            std::fill(row, row + m.cols, T(null));
+            return;
+        }
+        std::fill(row, row + begin, T(null));
+        std::fill(row + end, row + m.cols, T(null));
+
+        const float *above = m.ptr<float>(r-radius), *center = m.ptr<float>(r), *below = m.ptr<float>(r+radius);
+        const float *neighbors[8] = { above-radius, above, above+radius, center+radius,
+                                      below+radius, below, below-radius, center-radius };
+
+        int c = begin;
+#ifdef __SSE2__
+        for (; c+4<=end; c+=4) {
+            const __m128 cval = _mm_loadu_ps(center+c);
+            const __m128i code = _mm_or_si128(_mm_or_si128(_mm_or_si128(bit(neighbors[0]+c, cval, 128), bit(neighbors[1]+c, cval, 64)),
+                                                           _mm_or_si128(bit(neighbors[2]+c, cval, 32), bit(neighbors[3]+c, cval, 16))),
+                                              _mm_or_si128(_mm_or_si128(bit(neighbors[4]+c, cval, 8), bit(neighbors[5]+c, cval, 4)),
+                                                           _mm_or_si128(bit(neighbors[6]+c, cval, 2), bit(neighbors[7]+c, cval, 1))));
+            int packed[4];
+            _mm_storeu_si128((__m128i*)packed, code);
+            for (int i=0; i<4; i++)
+                row[c+i] = lut[packed[i]];
         }
+#endif // __SSE2__
+        for (; c<end; c++) {
+            const float cval = center[c];
+            int code = 0;
+            for (int i=0; i<8; i++)
+                if (neighbors[i][c] >= cval)
+                    code |= 128 >> i;
+            row[c] = lut[code];
+        }
+    }
 
+    void project(const Template &src, Template &dst) const
+    {
+        Mat m = Arena::mat(); src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
+        Mat n = Arena::mat(m.rows, m.cols, CV_8UC1);
+        for (int r=0; r<m.rows; r++)
+            codes(m, r, n.ptr<uchar>(r));
         dst += n;
     }
 };
 
 BR_REGISTER(Transform, LBPTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Histograms of Local Binary Patterns over rectangular regions, one matrix per region.
+ *
+ * Equivalent to LBP+RectRegions(width,height,widthStep,heightStep)+Hist(dims),
+ * but codes are computed a row at a time and accumulated straight into the region histograms,
+ * without an intermediate code image or region matrices.
+ * \br_property int width Region width.
+ * \br_property int height Region height.
+ * \br_property int widthStep Horizontal distance between regions, or -1 for width.
+ * \br_property int heightStep Vertical distance between regions, or -1 for height.
+ * \br_property int dims Histogram bins, or -1 for one per pattern including the null pattern.
+ * \author Unknown \cite unknown
+ */
+class LBPHistTransform : public LBPTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
+    Q_PROPERTY(int height READ get_height WRITE set_height RESET reset_height STORED false)
+    Q_PROPERTY(int widthStep READ get_widthStep WRITE set_widthStep RESET reset_widthStep STORED false)
+    Q_PROPERTY(int heightStep READ get_heightStep WRITE set_heightStep RESET reset_heightStep STORED false)
+    Q_PROPERTY(int dims READ get_dims WRITE set_dims RESET reset_dims STORED false)
+    BR_PROPERTY(int, width, 8)
+    BR_PROPERTY(int, height, 8)
+    BR_PROPERTY(int, widthStep, -1)
+    BR_PROPERTY(int, heightStep, -1)
+    BR_PROPERTY(int, dims, -1)
+
+    void project(const Template &src, Template &dst) const
+    {
+        Mat m = Arena::mat(); src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
+        OpenCVUtils::RegionHistograms hists(m.size(), Size(width, height),
+                                            Size(widthStep == -1 ? width : widthStep, heightStep == -1 ? height : heightStep),
+                                            dims == -1 ? null + 1 : dims);
+
+        std::vector<int> row(m.cols);
+        for (int r=0; r<m.rows; r++) {
+            codes(m, r, &row[0]);
+            hists.accumulate(r, &row[0]);
+        }
+
+        foreach (const Mat &hist, hists.histograms())
+            dst += hist;
+    }
+};
+
+BR_REGISTER(Transform, LBPHistTransform)
+
 } // namespace br
 
 #include "imgproc/lbp.moc"
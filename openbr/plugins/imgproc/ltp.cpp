@@ -14,11 +14,15 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/imgproc/imgproc_c.h>
 #include <limits>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
 
 using namespace cv;
 
@@ -42,6 +46,7 @@ class LTPTransform : public UntrainableTransform
     BR_PROPERTY(int,   radius,    1)
     BR_PROPERTY(float, threshold, 0.1F)
 
+protected:
     unsigned short lut[8][3];
     uchar null;
 
@@ -53,70 +58,127 @@ class LTPTransform : public UntrainableTransform
                 lut[i][j] = cnt++;
             cnt++;  //we skip the 4th number (only three patterns)
         }
+        null = 0;
     }
 
-    void project(const Template &src, Template &dst) const
+    // Largest code, when every neighbor is within the threshold
+    int maxCode() const
     {
-        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
+        int code = 0;
+        for (int i=0; i<8; i++)
+            code += lut[i][2];
+        return code;
+    }
 
-        Mat n(m.rows, m.cols, CV_16U);
-        n = null; 
-        float thresholdNeg = -1.0 * threshold; //compute once (can move to init)
-
-        const float *p = (const float*)m.ptr();
-        float diff;
-        for (int r=radius; r<m.rows-radius; r++) {
-            for (int c=radius; c<m.cols-radius; c++) {
-                const float cval  = (p[(r+0*radius)*m.cols+c+0*radius]);
-
-                diff = p[(r-1*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) = lut[0][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) = lut[0][1];
-                else                            n.at<unsigned short>(r,c) = lut[0][2];
-
-                diff = p[(r-1*radius)*m.cols+c+0*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[1][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[1][1];
-                else                            n.at<unsigned short>(r,c) += lut[1][2];
-
-                diff = p[(r-1*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[2][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[2][1];
-                else                            n.at<unsigned short>(r,c) += lut[2][2];
-
-                diff = p[(r+0*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[3][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[3][1];
-                else                            n.at<unsigned short>(r,c) += lut[3][2];
-
-                diff = p[(r+1*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[4][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[4][1];
-                else                            n.at<unsigned short>(r,c) += lut[4][2];
-
-                diff = p[(r+1*radius)*m.cols+c+0*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[5][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[5][1];
-                else                            n.at<unsigned short>(r,c) += lut[5][2];
-
-                diff = p[(r+1*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[6][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[6][1];
-                else                            n.at<unsigned short>(r,c) += lut[6][2];
-
-                diff = p[(r+0*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[7][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[7][1];
-                else                            n.at<unsigned short>(r,c) += lut[7][2];
+    // Codes of row r of the single channel float image m, null where the neighborhood leaves the image
+    template <typename T>
+    void codes(const Mat &m, int r, T *row) const
+    {
+        const int begin = radius, end = m.cols - radius;
+        if ((r < radius) || (r >= m.rows - radius) || (begin >= end)) {
+            std::fill(row, row + m.cols, T(null));
+            return;
+        }
+        std::fill(row, row + begin, T(null));
+        std::fill(row + end, row + m.cols, T(null));
+
+        const float *above = m.ptr<float>(r-radius), *center = m.ptr<float>(r), *below = m.ptr<float>(r+radius);
+        const float *neighbors[8] = { above-radius, above, above+radius, center+radius,
+                                      below+radius, below, below-radius, center-radius };
+        const float thresholdNeg = -1.0 * threshold;
+
+        int c = begin;
+#ifdef __SSE2__
+        // lut[i][j] is lut[i][2] - 2 + j, so each neighbor subtracts 2 when above the threshold and 1 when below it
+        const __m128 positive = _mm_set1_ps(threshold), negative = _mm_set1_ps(thresholdNeg);
+        for (; c+4<=end; c+=4) {
+            const __m128 cval = _mm_loadu_ps(center+c);
+            __m128i code = _mm_set1_epi32(maxCode());
+            for (int i=0; i<8; i++) {
+                const __m128 diff = _mm_sub_ps(_mm_loadu_ps(neighbors[i]+c), cval);
+                const __m128i over = _mm_castps_si128(_mm_cmpgt_ps(diff, positive));
+                const __m128i under = _mm_castps_si128(_mm_cmplt_ps(diff, negative));
+                code = _mm_add_epi32(code, _mm_add_epi32(_mm_add_epi32(over, over), under));
+            }
+            int packed[4];
+            _mm_storeu_si128((__m128i*)packed, code);
+            for (int i=0; i<4; i++)
+                row[c+i] = packed[i];
+        }
+#endif // __SSE2__
+        for (; c<end; c++) {
+            const float cval = center[c];
+            int code = 0;
+            for (int i=0; i<8; i++) {
+                const float diff = neighbors[i][c] - cval;
+                if      (diff > threshold)      code += lut[i][0];
+                else if (diff < thresholdNeg)   code += lut[i][1];
+                else                            code += lut[i][2];
             }
+            row[c] = code;
         }
+    }
 
+    void project(const Template &src, Template &dst) const
+    {
+        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
+        Mat n(m.rows, m.cols, CV_16U);
+        for (int r=0; r<m.rows; r++)
+            codes(m, r, n.ptr<unsigned short>(r));
         dst += n;
     }
 };
 
 BR_REGISTER(Transform, LTPTransform)
 
+/*!
+ * \ingroup transforms
+ * \brief Histograms of Local Ternary Patterns over rectangular regions, one matrix per region.
+ *
+ * Equivalent to LTP+RectRegions(width,height,widthStep,heightStep)+Hist(dims),
+ * but codes are computed a row at a time and accumulated straight into the region histograms,
+ * without an intermediate code image or region matrices.
+ * \br_property int width Region width.
+ * \br_property int height Region height.
+ * \br_property int widthStep Horizontal distance between regions, or -1 for width.
+ * \br_property int heightStep Vertical distance between regions, or -1 for height.
+ * \br_property int dims Histogram bins, or -1 for one per code up to the largest.
+ * \author Unknown \cite unknown
+ */
+class LTPHistTransform : public LTPTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(int width READ get_width WRITE set_width RESET reset_width STORED false)
+    Q_PROPERTY(int height READ get_height WRITE set_height RESET reset_height STORED false)
+    Q_PROPERTY(int widthStep READ get_widthStep WRITE set_widthStep RESET reset_widthStep STORED false)
+    Q_PROPERTY(int heightStep READ get_heightStep WRITE set_heightStep RESET reset_heightStep STORED false)
+    Q_PROPERTY(int dims READ get_dims WRITE set_dims RESET reset_dims STORED false)
+    BR_PROPERTY(int, width, 8)
+    BR_PROPERTY(int, height, 8)
+    BR_PROPERTY(int, widthStep, -1)
+    BR_PROPERTY(int, heightStep, -1)
+    BR_PROPERTY(int, dims, -1)
+
+    void project(const Template &src, Template &dst) const
+    {
+        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
+        OpenCVUtils::RegionHistograms hists(m.size(), Size(width, height),
+                                            Size(widthStep == -1 ? width : widthStep, heightStep == -1 ? height : heightStep),
+                                            dims == -1 ? maxCode() + 1 : dims);
+
+        std::vector<int> row(m.cols);
+        for (int r=0; r<m.rows; r++) {
+            codes(m, r, &row[0]);
+            hists.accumulate(r, &row[0]);
+        }
+
+        foreach (const Mat &hist, hists.histograms())
+            dst += hist;
+    }
+};
+
+BR_REGISTER(Transform, LTPHistTransform)
+
 } // namespace br
 
 #include "imgproc/ltp.moc"
@@ -24,7 +24,7 @@ namespace br
  * \brief dst = a*src+b
  * \author Josh Klontz \cite jklontz
  */
-class MAddTransform : public UntrainableTransform
+class MAddTransform : public PointwiseTransform
 {
     Q_OBJECT
     Q_PROPERTY(double a READ get_a WRITE set_a RESET reset_a STORED false)
@@ -32,9 +32,20 @@ class MAddTransform : public UntrainableTransform
     BR_PROPERTY(double, a, 1)
     BR_PROPERTY(double, b, 0)
 
-    void project(const Template &src, Template &dst) const
+    void apply(const cv::Mat &src, cv::Mat &dst) const
     {
-        src.m().convertTo(dst.m(), src.m().depth(), a, b);
+        src.convertTo(dst, src.depth(), a, b);
+    }
+
+    bool lower(QStringList &channels, int &depth) const
+    {
+        // convertTo saturates integer results, which the lowered expression doesn't
+        if ((depth != CV_32F) && (depth != CV_64F))
+            return false;
+        const QString cast = (depth == CV_64F) ? "f64" : "f32";
+        for (int i=0; i<channels.size(); i++)
+            channels[i] = QString("(%1 (+ (* %2 %3) %4))").arg(cast, channels[i], QString::number(a, 'g', 17), QString::number(b, 'g', 17));
+        return true;
     }
 };
 
@@ -31,7 +31,7 @@ namespace br
  * \br_property int beta Upper bound if using NORM_MINMAX. Not used otherwise.
  * \br_property bool squareRoot If true compute the signed square root of the output after normalization.
  */
-class NormalizeTransform : public UntrainableTransform
+class NormalizeTransform : public PointwiseTransform
 {
     Q_OBJECT
     Q_ENUMS(NormType)
@@ -65,7 +65,7 @@ private:
             }
     }
 
-    void project(const Template &src, Template &dst) const
+    void apply(const Mat &src, Mat &dst) const
     {
         if (!ByRow) {
             normalize(src, dst, alpha, beta, normType, CV_32F);
@@ -74,13 +74,15 @@ private:
         }
 
         else {
-            dst = src;
-            for (int i=0; i<dst.m().rows; i++) {
+            // Copied first so the rows are only normalized in place when src and dst already share their data
+            if (dst.data != src.data)
+                src.copyTo(dst);
+            for (int i=0; i<dst.rows; i++) {
                 Mat temp;
-                normalize(dst.m().row(i), temp, alpha, beta, normType);
+                normalize(dst.row(i), temp, alpha, beta, normType);
                 if (squareRoot)
                     signedSquareRoot(temp);
-                temp.copyTo(dst.m().row(i));
+                temp.copyTo(dst.row(i));
             }
         }
 
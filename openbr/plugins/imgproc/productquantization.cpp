@@ -15,8 +15,12 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <QtConcurrent>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/cluster.h>
 #include <openbr/core/common.h>
 #include <openbr/core/opencvutils.h>
 
@@ -26,6 +30,7 @@ namespace br
 {
 
 QVector<Mat> ProductQuantizationLUTs;
+QVector< QList<Mat> > ProductQuantizationCenters; // Subspace codebooks, indexed like ProductQuantizationLUTs
 
 /*!
  * \ingroup distances
@@ -77,6 +82,8 @@ BR_REGISTER(Distance, ProductQuantizationDistance)
  *           "Product quantization for nearest neighbor search."
  *           Pattern Analysis and Machine Intelligence, IEEE Transactions on 33.1 (2011): 117-128
  * \author Josh Klontz \cite jklontz
+ * \br_property int batchSize Samples per mini-batch k-means iteration when training the codebooks, <= 0 uses OpenCV's full batch kmeans. Default is 0.
+ * \br_property int iterations Number of mini-batch k-means iterations. Default is 100.
  */
 class ProductQuantizationTransform : public Transform
 {
@@ -85,13 +92,18 @@ class ProductQuantizationTransform : public Transform
     Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED false)
     Q_PROPERTY(bool bayesian READ get_bayesian WRITE set_bayesian RESET reset_bayesian STORED false)
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
     BR_PROPERTY(int, n, 2)
     BR_PROPERTY(br::Distance*, distance, Distance::make("L2", this))
     BR_PROPERTY(bool, bayesian, false)
     BR_PROPERTY(QString, inputVariable, "Label")
+    BR_PROPERTY(int, batchSize, 0)
+    BR_PROPERTY(int, iterations, 100)
 
     quint16 index;
     QList<Mat> centers;
+    QList<Mat> codebooks, norms; // Transposed centers of each subspace and their squared norms, for encoding
 
 public:
     ProductQuantizationTransform()
@@ -103,6 +115,7 @@ public:
         QMutexLocker locker(&mutex);
         index = ProductQuantizationLUTs.size();
         ProductQuantizationLUTs.append(Mat());
+        ProductQuantizationCenters.append(QList<Mat>());
     }
 
 private:
@@ -147,7 +160,7 @@ private:
     void _train(const Mat &data, const QList<int> &labels, Mat *lut, Mat *center)
     {
         Mat clusterLabels;
-        kmeans(data, 256, clusterLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, *center);
+        KMeans(data, 256, *center, &clusterLabels, batchSize, iterations);
 
         Mat fullLUT(1, 256*256, CV_32FC1);
         for (int i=0; i<256; i++)
@@ -236,32 +249,60 @@ private:
             else                                                                                               _train (subdata[i], labels, &subluts[i], &centers[i]);
         }
         futures.waitForFinished();
+        ProductQuantizationCenters[index] = centers;
+        prepareCodebooks();
     }
 
-    int getIndex(const Mat &m, const Mat &center) const
+    void prepareCodebooks()
     {
-        int bestIndex = 0;
-        double bestDistance = std::numeric_limits<double>::max();
-        for (int j=0; j<256; j++) {
-            double distance = norm(m, center.row(j), NORM_L2);
-            if (distance < bestDistance) {
-                bestDistance = distance;
-                bestIndex = j;
-            }
+        codebooks.clear();
+        norms.clear();
+        foreach (const Mat &center, centers) {
+            Mat codebook, norm(1, 256, CV_32FC1);
+            transpose(center, codebook);
+            codebooks.append(codebook);
+            for (int j=0; j<256; j++)
+                norm.at<float>(0,j) = center.row(j).dot(center.row(j));
+            norms.append(norm);
         }
-        return bestIndex;
+    }
+
+    // Nearest of the 256 centers, ranked by ||c||^2 - 2x.c with four centers scored per instruction
+    static int getIndex(const float *x, int width, const float *codebook, const float *norm)
+    {
+        float scores[256];
+        memcpy(scores, norm, sizeof(scores));
+        for (int i=0; i<width; i++) {
+            const float *c = codebook + i*256;
+#ifdef __SSE2__
+            const __m128 w = _mm_set1_ps(-2*x[i]);
+            for (int j=0; j<256; j+=4)
+                _mm_storeu_ps(scores+j, _mm_add_ps(_mm_loadu_ps(scores+j), _mm_mul_ps(w, _mm_loadu_ps(c+j))));
+#else
+            const float w = -2*x[i];
+            for (int j=0; j<256; j++)
+                scores[j] += w*c[j];
+#endif // __SSE2__
+        }
+        return int(std::min_element(scores, scores+256) - scores);
     }
 
     void project(const Template &src, Template &dst) const
     {
         Mat m = src.m().reshape(1, 1);
+        if (m.type() != CV_32FC1)
+            m.convertTo(m, CV_32F);
         const int step = getStep(m.cols);
         const int offset = getOffset(m.cols);
         const int dims = getDims(m.cols);
         dst = Mat(1, sizeof(quint16)+dims, CV_8UC1);
-        memcpy(dst.m().data, &index, sizeof(quint16));
-        for (int i=0; i<dims; i++)
-            dst.m().at<uchar>(0,sizeof(quint16)+i) = getIndex(m.colRange(max(0, i*step-offset), (i+1)*step-offset), centers[i]);
+        uchar *code = dst.m().data;
+        memcpy(code, &index, sizeof(quint16));
+        const float *x = m.ptr<float>();
+        for (int i=0; i<dims; i++) {
+            const int begin = max(0, i*step-offset);
+            code[sizeof(quint16)+i] = getIndex(x + begin, codebooks[i].rows, codebooks[i].ptr<float>(), norms[i].ptr<float>());
+        }
     }
 
     void store(QDataStream &stream) const
@@ -272,9 +313,13 @@ private:
     void load(QDataStream &stream)
     {
         stream >> index >> centers;
-        while (ProductQuantizationLUTs.size() <= index)
+        while (ProductQuantizationLUTs.size() <= index) {
             ProductQuantizationLUTs.append(Mat());
+            ProductQuantizationCenters.append(QList<Mat>());
+        }
         stream >> ProductQuantizationLUTs[index];
+        ProductQuantizationCenters[index] = centers;
+        prepareCodebooks();
     }
 };
 
@@ -25,28 +25,38 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Approximate floats as uchar.
+ *
+ * In symmetric mode floats are approximated as signed char with zero kept at zero, for br::DotProductDistance.
  * \author Josh Klontz \cite jklontz
+ * \br_property bool symmetric If true, scale by the largest magnitude to [-127, 127] and output CV_8S. Default is false.
  */
 class QuantizeTransform : public Transform
 {
     Q_OBJECT
     Q_PROPERTY(float a READ get_a WRITE set_a RESET reset_a)
     Q_PROPERTY(float b READ get_b WRITE set_b RESET reset_b)
+    Q_PROPERTY(bool symmetric READ get_symmetric WRITE set_symmetric RESET reset_symmetric STORED false)
     BR_PROPERTY(float, a, 1)
     BR_PROPERTY(float, b, 0)
+    BR_PROPERTY(bool, symmetric, false)
 
     void train(const TemplateList &data)
     {
         double minVal, maxVal;
         minMaxLoc(OpenCVUtils::toMat(data.data()), &minVal, &maxVal);
-        a = 255.0/(maxVal-minVal);
-        b = -a*minVal;
+        if (symmetric) {
+            a = 127.0/std::max(std::max(fabs(minVal), fabs(maxVal)), std::numeric_limits<double>::min());
+            b = 0;
+        } else {
+            a = 255.0/(maxVal-minVal);
+            b = -a*minVal;
+        }
         qDebug() << "Quantized dimensions =" << data.first().m().rows * data.first().m().cols;
     }
 
     void project(const Template &src, Template &dst) const
     {
-        src.m().convertTo(dst, CV_8U, a, b);
+        src.m().convertTo(dst, symmetric ? CV_8S : CV_8U, a, b);
     }
 };
 
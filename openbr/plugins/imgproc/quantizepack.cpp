@@ -0,0 +1,121 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Quantize each dimension to 4, 2 or 1 bits over a trained range and pack the codes into bytes.
+ *
+ * Dimensions are packed most significant bits first, in the same order as Pack.
+ * With bits=4 or bits=2 each dimension is spread uniformly over its trained range,
+ * with bits=1 it is thresholded at its trained median.
+ * Compare the packed templates with HalfByteL1, QuarterByteL1 or Hamming respectively.
+ * \author Unknown \cite unknown
+ * \br_property int bits Bits per dimension, one of 4, 2 or 1. Default is 4.
+ * \br_property float clip Fraction of the training values below and above each dimension's range. Default is 0.01.
+ */
+class QuantizePackTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(int bits READ get_bits WRITE set_bits RESET reset_bits STORED false)
+    Q_PROPERTY(float clip READ get_clip WRITE set_clip RESET reset_clip STORED false)
+    BR_PROPERTY(int, bits, 4)
+    BR_PROPERTY(float, clip, 0.01)
+
+    Mat lower, scale; // 1 x dimensions, codes are (x - lower) * scale
+
+    void init()
+    {
+        if ((bits != 1) && (bits != 2) && (bits != 4))
+            qFatal("Expected 1, 2 or 4 bits, got %d.", bits);
+    }
+
+    void train(const TemplateList &data)
+    {
+        Mat m;
+        OpenCVUtils::toMat(data.data()).convertTo(m, CV_32F);
+        m = m.reshape(1, m.rows);
+        Mat dimensions;
+        transpose(m, dimensions);
+
+        const int levels = 1 << bits;
+        const int n = dimensions.cols;
+        const int low = std::min(n-1, int(clip * n));
+        const int high = std::max(low, n-1-low);
+        lower.create(1, dimensions.rows, CV_32FC1);
+        scale.create(1, dimensions.rows, CV_32FC1);
+        for (int i=0; i<dimensions.rows; i++) {
+            float *values = dimensions.ptr<float>(i);
+            if (bits == 1) {
+                std::nth_element(values, values + n/2, values + n);
+                lower.at<float>(0,i) = values[n/2];
+                scale.at<float>(0,i) = 0;
+            } else {
+                std::nth_element(values, values + low, values + n);
+                const float lo = values[low];
+                std::nth_element(values + low, values + high, values + n);
+                const float hi = values[high];
+                lower.at<float>(0,i) = lo;
+                scale.at<float>(0,i) = hi > lo ? levels / (hi - lo) : 0;
+            }
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        Mat m;
+        src.m().convertTo(m, CV_32F);
+        m = m.reshape(1, 1);
+        if (m.cols != lower.cols)
+            qFatal("Expected %d dimensions, got %d.", lower.cols, m.cols);
+
+        const int levels = 1 << bits;
+        Mat packed = Mat::zeros(1, (m.cols * bits + 7) / 8, CV_8UC1);
+        uchar *code = packed.ptr();
+        const float *x = m.ptr<float>(), *l = lower.ptr<float>(), *s = scale.ptr<float>();
+        for (int i=0; i<m.cols; i++) {
+            int value;
+            if (bits == 1) value = x[i] > l[i] ? 1 : 0;
+            else           value = std::min(levels-1, std::max(0, int((x[i] - l[i]) * s[i])));
+            const int bit = i * bits;
+            code[bit / 8] |= value << (8 - bits - bit % 8);
+        }
+        dst = packed;
+    }
+
+    void store(QDataStream &stream) const
+    {
+        stream << lower << scale;
+    }
+
+    void load(QDataStream &stream)
+    {
+        stream >> lower >> scale;
+    }
+};
+
+BR_REGISTER(Transform, QuantizePackTransform)
+
+} // namespace br
+
+#include "imgproc/quantizepack.moc"
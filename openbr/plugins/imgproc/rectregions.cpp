@@ -24,6 +24,9 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Subdivide matrix into rectangular subregions.
+ *
+ * The subregions are views that share the input's data rather than copies of it.
+ * Transforms that overwrite their input in place copy a view first while it is still shared, see isExclusive.
  * \author Josh Klontz \cite jklontz
  */
 class RectRegionsTransform : public UntrainableTransform
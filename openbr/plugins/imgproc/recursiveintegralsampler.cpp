@@ -73,7 +73,7 @@ class RecursiveIntegralSamplerTransform : public Transform
         const int rows = src.rows-1; // Integral images have an extra row and column
         const int columns = src.cols-1;
 
-        Mat tmp(5, channels, CV_32FC1);
+        Mat tmp = Arena::mat(5, channels, CV_32FC1);
         integralHistogram(src,         0,      0, columns/2, rows/2, tmp, 0);
         integralHistogram(src, columns/2,      0, columns/2, rows/2, tmp, 1);
         integralHistogram(src,         0, rows/2, columns/2, rows/2, tmp, 2);
@@ -99,10 +99,8 @@ class RecursiveIntegralSamplerTransform : public Transform
         // Integral images have an extra row and column
         int subWidth = (src.m().cols-1) / scaleFactor + 1;
         int subHeight = (src.m().rows-1) / scaleFactor + 1;
-        return Template(src.file, QList<Mat>() << Mat(src, Rect(0,                     0, subWidth, subHeight))
-                                               << Mat(src, Rect(src.m().cols-subWidth, 0, subWidth, subHeight))
-                                               << Mat(src, Rect(0,                     src.m().rows-subHeight, subWidth, subHeight))
-                                               << Mat(src, Rect(src.m().cols-subWidth, src.m().rows-subHeight, subWidth, subHeight)));
+        // The sub transform only reads the first matrix of a template, so only the top left quadrant is needed
+        return Template(src.file, Mat(src, Rect(0, 0, subWidth, subHeight)));
     }
 
     bool canSubdivide(const Template &t) const
@@ -32,7 +32,9 @@ class ReshapeTransform : public UntrainableTransform
 
     void project(const Template &src, Template &dst) const
     {
-        dst = src.m().reshape(src.m().channels(), rows);
+        // Views of a larger matrix have to be copied before their rows can be reinterpreted
+        const Mat m = src.m().isContinuous() ? src.m() : src.m().clone();
+        dst = m.reshape(m.channels(), rows);
     }
 };
 
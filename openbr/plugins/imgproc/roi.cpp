@@ -25,6 +25,8 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Crops the rectangular regions of interest.
+ *
+ * The regions are views that share the input's data, see RectRegionsTransform.
  * \author Josh Klontz \cite jklontz
  */
 class ROITransform : public UntrainableTransform
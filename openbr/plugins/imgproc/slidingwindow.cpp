@@ -14,7 +14,10 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
+
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/featureplanes.h>
 #include <openbr/core/opencvutils.h>
 #include <openbr/core/qtutils.h>
 
@@ -37,6 +40,11 @@ namespace br
  * \br_property int minNeighbors Parameter for non-maximum supression
  * \br_property float confidenceThreshold A threshold for positive detections. Positive detections returned by the classifier that have confidences below this threshold are considered negative detections.
  * \br_property float eps Parameter for non-maximum supression
+ * \br_property bool batch Classify neighboring windows together through the classifier's batched interface.
+ * \br_property float overlap If positive, detections are merged by intersection over union non-maximum suppression at this threshold instead of grouping by eps.
+ *
+ * Each pyramid level is resized and preprocessed once, then its rows are split into tiles that are classified in parallel.
+ * Detections are merged in level and tile order before grouping, so results do not depend on scheduling.
  */
 class SlidingWindowTransform : public MetaTransform
 {
@@ -50,6 +58,8 @@ class SlidingWindowTransform : public MetaTransform
     Q_PROPERTY(int minNeighbors READ get_minNeighbors WRITE set_minNeighbors RESET reset_minNeighbors STORED false)
     Q_PROPERTY(float confidenceThreshold READ get_confidenceThreshold WRITE set_confidenceThreshold RESET reset_confidenceThreshold STORED false)
     Q_PROPERTY(float eps READ get_eps WRITE set_eps RESET reset_eps STORED false)
+    Q_PROPERTY(bool batch READ get_batch WRITE set_batch RESET reset_batch STORED false)
+    Q_PROPERTY(float overlap READ get_overlap WRITE set_overlap RESET reset_overlap STORED false)
 
     BR_PROPERTY(br::Classifier*, classifier, NULL)
     BR_PROPERTY(int, minSize, 20)
@@ -58,6 +68,8 @@ class SlidingWindowTransform : public MetaTransform
     BR_PROPERTY(int, minNeighbors, 5)
     BR_PROPERTY(float, confidenceThreshold, 10)
     BR_PROPERTY(float, eps, 0.2)
+    BR_PROPERTY(bool, batch, true)
+    BR_PROPERTY(float, overlap, 0)
 
     void train(const TemplateList &data)
     {
@@ -71,6 +83,97 @@ class SlidingWindowTransform : public MetaTransform
         if (!temp.isEmpty()) dst = temp.first();
     }
 
+    static const int TileWindows = 16384; // Approximate number of windows classified per tile
+    static const int BatchSize = 16; // Neighboring windows classified together
+
+    // A resized and preprocessed pyramid level, shared by its tiles
+    struct Level
+    {
+        double factor;
+        int step;
+        Size windowSize, processingRectSize;
+        Mat repImage;
+    };
+
+    // Rows [begin, end) of a level's window positions
+    struct Tile
+    {
+        const Level *level;
+        int begin, end;
+        std::vector<Rect> rects;
+        std::vector<float> confidences;
+    };
+
+    void preprocessLevel(const Mat *m, Level *level) const
+    {
+        // Shared with other detectors scanning the same image
+        const Mat scaledImage = FeaturePlanes::level(*m, Size(cvRound(m->cols/level->factor), cvRound(m->rows/level->factor)));
+        level->repImage = classifier->preprocess(scaledImage);
+    }
+
+    // Classifies every window of the row but keeps the sequential scan's results, which skip the window after a negative
+    void scanBatches(Tile *tile) const
+    {
+        const Level &level = *tile->level;
+        const int step = level.step;
+        const int windows = (level.processingRectSize.width + step - 1) / step;
+        uchar mask[BatchSize];
+        float confidences[BatchSize];
+
+        for (int y = tile->begin; y < tile->end; y += step) {
+            bool skip = false;
+            for (int w = 0; w < windows; w += BatchSize) {
+                const int count = std::min(BatchSize, windows - w);
+                memset(mask, 1, count);
+                classifier->classify(level.repImage, y*level.repImage.cols + w*step, step, count, mask, confidences);
+
+                for (int i = 0; i < count; i++) {
+                    if (skip) {
+                        skip = false;
+                        continue;
+                    }
+                    if (mask[i]) {
+                        tile->rects.push_back(Rect(cvRound((w+i)*step*level.factor), cvRound(y*level.factor), level.windowSize.width, level.windowSize.height));
+                        tile->confidences.push_back(confidences[i]);
+                    } else {
+                        skip = true;
+                    }
+                }
+            }
+        }
+    }
+
+    void scanTile(Tile *tile) const
+    {
+        const Level &level = *tile->level;
+        if (batch && level.repImage.isContinuous()) {
+            scanBatches(tile);
+            return;
+        }
+
+        int dx, dy;
+        const Size originalWindowSize = classifier->windowSize(&dx, &dy);
+        const int step = level.step;
+        for (int y = tile->begin; y < tile->end; y += step) {
+            for (int x = 0; x < level.processingRectSize.width; x += step) {
+                Mat window = level.repImage(Rect(Point(x, y), Size(originalWindowSize.width + dx, originalWindowSize.height + dy))).clone();
+
+                float confidence = 0;
+                int result = classifier->classify(window, false, &confidence);
+
+                if (result == 1) {
+                    tile->rects.push_back(Rect(cvRound(x*level.factor), cvRound(y*level.factor), level.windowSize.width, level.windowSize.height));
+                    tile->confidences.push_back(confidence);
+                }
+
+                // TODO: Add non ROC mode
+
+                if (result == 0)
+                    x += step;
+            }
+        }
+    }
+
     void project(const TemplateList &src, TemplateList &dst) const
     {
         Size minObjectSize(minSize, minSize);
@@ -95,8 +198,8 @@ class SlidingWindowTransform : public MetaTransform
                 if (maxObjectSize.height == 0 || maxObjectSize.width == 0)
                     maxObjectSize = m.size();
 
-                Mat imageBuffer(m.rows + 1, m.cols + 1, CV_8U);
-
+                // Enumerate the pyramid levels
+                QList<Level> levels;
                 for (double factor = 1; ; factor *= scaleFactor) {
                     int dx, dy;
                     Size originalWindowSize = classifier->windowSize(&dx, &dy);
@@ -112,34 +215,59 @@ class SlidingWindowTransform : public MetaTransform
                     if (windowSize.width < minObjectSize.width || windowSize.height < minObjectSize.height)
                         continue;
 
-                    Mat scaledImage(scaledImageSize, CV_8U, imageBuffer.data);
-                    resize(m, scaledImage, scaledImageSize, 0, 0, CV_INTER_LINEAR);
-
-                    Mat repImage = classifier->preprocess(scaledImage);
-
-                    int step = factor > 2. ? 1 : 2;
-                    for (int y = 0; y < processingRectSize.height; y += step) {
-                        for (int x = 0; x < processingRectSize.width; x += step) {
-                            Mat window = repImage(Rect(Point(x, y), Size(originalWindowSize.width + dx, originalWindowSize.height + dy))).clone();
+                    Level level;
+                    level.factor = factor;
+                    level.step = factor > 2. ? 1 : 2;
+                    level.windowSize = windowSize;
+                    level.processingRectSize = processingRectSize;
+                    levels.append(level);
+                }
 
-                            float confidence = 0;
-                            int result = classifier->classify(window, false, &confidence);
+                // Resize and preprocess each level once
+                QFutureSynchronizer<void> futures;
+                for (int j=0; j<levels.size(); j++)
+                    futures.addFuture(QtConcurrent::run(this, &SlidingWindowTransform::preprocessLevel, (const Mat*)&m, &levels[j]));
+                futures.waitForFinished();
+
+                // Split large levels into bands of rows
+                QList<Tile> tiles;
+                for (int j=0; j<levels.size(); j++) {
+                    const Level &level = levels.at(j);
+                    const int windowsPerRow = std::max(1, level.processingRectSize.width / level.step);
+                    const int rowsPerTile = level.step * std::max(1, TileWindows / windowsPerRow);
+                    for (int y = 0; y < level.processingRectSize.height; y += rowsPerTile) {
+                        Tile tile;
+                        tile.level = &level;
+                        tile.begin = y;
+                        tile.end = std::min(y + rowsPerTile, level.processingRectSize.height);
+                        tiles.append(tile);
+                    }
+                }
 
-                            if (result == 1) {
-                                rects.push_back(Rect(cvRound(x*factor), cvRound(y*factor), windowSize.width, windowSize.height));
-                                confidences.push_back(confidence);
-                            }
+                for (int j=0; j<tiles.size(); j++)
+                    futures.addFuture(QtConcurrent::run(this, &SlidingWindowTransform::scanTile, &tiles[j]));
+                futures.waitForFinished();
 
-                            // TODO: Add non ROC mode
+                foreach (const Tile &tile, tiles) {
+                    rects.insert(rects.end(), tile.rects.begin(), tile.rects.end());
+                    confidences.insert(confidences.end(), tile.confidences.begin(), tile.confidences.end());
+                }
 
-                            if (result == 0)
-                                x += step;
+                if (overlap > 0) {
+                    std::vector<Rect> positiveRects;
+                    std::vector<float> positiveConfidences;
+                    for (size_t j=0; j<rects.size(); j++)
+                        if (confidences[j] > confidenceThreshold) {
+                            positiveRects.push_back(rects[j]);
+                            positiveConfidences.push_back(confidences[j]);
                         }
-                    }
+                    OpenCVUtils::suppress(positiveRects, positiveConfidences, overlap);
+                    rects = positiveRects;
+                    confidences = positiveConfidences;
+                } else {
+                    OpenCVUtils::group(rects, confidences, confidenceThreshold, eps);
                 }
 
-                OpenCVUtils::group(rects, confidences, confidenceThreshold, eps);
-
                 if (!enrollAll && rects.empty())
                     rects.push_back(Rect(0, 0, m.cols, m.rows));
 
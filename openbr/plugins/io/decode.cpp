@@ -24,15 +24,22 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Decodes images
+ *
+ * With reducedSize, JPEGs are decoded at a reduced resolution as in Read.
  * \author Josh Klontz \cite jklontz
+ * \br_property int reducedSize Smallest shorter side of a reduced JPEG decode, 0 decodes at full resolution.
  */
 class DecodeTransform : public UntrainableTransform
 {
     Q_OBJECT
+    Q_PROPERTY(int reducedSize READ get_reducedSize WRITE set_reducedSize RESET reset_reducedSize STORED false)
+    BR_PROPERTY(int, reducedSize, 0)
 
     void project(const Template &src, Template &dst) const
     {
-        dst.append(cv::imdecode(src.m(), cv::IMREAD_UNCHANGED));
+        int scale;
+        dst.append(decodeReduced(src.m(), cv::IMREAD_UNCHANGED, reducedSize, &scale));
+        setDecodeScale(dst.file, scale);
     }
 };
 
@@ -24,16 +24,303 @@ using namespace cv;
 namespace br
 {
 
+/*!
+ * \brief Fetches remote resources asynchronously over one pooled QNetworkAccessManager.
+ *
+ * Requests are issued from a dedicated thread, at most \c concurrency at a time and optionally no faster than a given rate, most urgent first.
+ * Resources can be requested ahead of time with prefetch() and are held until take() or poll() collects them.
+ * Connection failures, 429 and 5xx responses are retried with exponential backoff.
+ */
+class Fetcher : public QObject
+{
+    Q_OBJECT
+
+    struct Resource
+    {
+        QByteArray data;
+        QString error;
+        bool done;
+        int attempts, waiters;
+        Resource() : done(false), attempts(0), waiters(0) {}
+    };
+
+    static const int MaxBuffered = 1024; // Prefetched resources held at once, beyond which the oldest are dropped
+    static const int MaxQueued = 256; // Prefetches waiting to be requested, beyond which they are ignored
+    static const int Backoff = 100; // ms, doubled after every attempt
+
+    QMutex mutex;
+    QWaitCondition fetched;
+    QHash<QString, Resource> resources;
+    QList<QString> queue; // Waiting to be requested, most urgent first
+    QList<QString> buffered; // Fetched but not taken, oldest first
+    QMap<qint64, QString> retries; // QMap<due time,url>
+    int active, concurrency, maxAttempts;
+    qint64 interval, lastRequest; // ms between request starts, zero for no rate limit
+    bool rateTimer; // A dispatch is scheduled for when the rate limit allows the next request
+    QElapsedTimer clock;
+
+    QThread thread;
+    QNetworkAccessManager *manager; // Created and used in thread
+
+public:
+    Fetcher() : active(0), concurrency(16), maxAttempts(4), interval(0), lastRequest(0), rateTimer(false), manager(NULL)
+    {
+        clock.start();
+        moveToThread(&thread);
+        thread.start();
+    }
+
+    ~Fetcher()
+    {
+        QMetaObject::invokeMethod(this, "shutdown", Qt::BlockingQueuedConnection);
+        thread.quit();
+        thread.wait();
+    }
+
+    void configure(int concurrency, int retries)
+    {
+        QMutexLocker locker(&mutex);
+        this->concurrency = std::max(concurrency, 1);
+        maxAttempts = std::max(retries, 0) + 1;
+    }
+
+    void setRate(double requestsPerSecond)
+    {
+        QMutexLocker locker(&mutex);
+        interval = (requestsPerSecond > 0) ? qint64(1000 / requestsPerSecond) : 0;
+    }
+
+    // Requests the resource if it hasn't been, returning true once it is fetched without blocking
+    bool poll(const QString &url, QByteArray &data, QString &error)
+    {
+        QMutexLocker locker(&mutex);
+        if (!resources.contains(url)) {
+            resources.insert(url, Resource());
+            queue.append(url);
+            QMetaObject::invokeMethod(this, "dispatch", Qt::QueuedConnection);
+            return false;
+        }
+
+        Resource &resource = resources[url];
+        if (!resource.done)
+            return false;
+        data = resource.data;
+        error = resource.error;
+        if (resource.waiters == 0) {
+            resources.remove(url);
+            buffered.removeOne(url);
+        }
+        return true;
+    }
+
+    void prefetch(const QString &url)
+    {
+        // A bound on read-ahead, which also keeps metadata-only reads of a large gallery from fetching all of it
+        QMutexLocker locker(&mutex);
+        if (resources.contains(url) || (queue.size() >= MaxQueued))
+            return;
+        resources.insert(url, Resource());
+        queue.append(url);
+        QMetaObject::invokeMethod(this, "dispatch", Qt::QueuedConnection);
+    }
+
+    // Blocks until the resource is fetched, returning false with the error if it couldn't be
+    bool take(const QString &url, QByteArray &data, QString &error)
+    {
+        QMutexLocker locker(&mutex);
+        if (!resources.contains(url))
+            resources.insert(url, Resource());
+        Resource &resource = resources[url];
+        if (!resource.done && (resource.attempts == 0) && !retries.values().contains(url)) {
+            // Not requested yet, move it to the front of the queue
+            queue.removeOne(url);
+            queue.prepend(url);
+            QMetaObject::invokeMethod(this, "dispatch", Qt::QueuedConnection);
+        }
+
+        resources[url].waiters++;
+        while (!resources[url].done)
+            fetched.wait(&mutex);
+
+        const Resource result = resources.take(url);
+        buffered.removeOne(url);
+        if (result.waiters > 1) {
+            // Someone else is waiting on the same URL, leave them a copy
+            Resource &remaining = resources[url];
+            remaining = result;
+            remaining.waiters--;
+            buffered.append(url);
+        }
+
+        data = result.data;
+        error = result.error;
+        return error.isEmpty();
+    }
+
+private slots:
+    void dispatch()
+    {
+        QMutexLocker locker(&mutex);
+        if (!manager)
+            manager = new QNetworkAccessManager();
+
+        // Retries that are due jump the queue
+        const qint64 now = clock.elapsed();
+        while (!retries.isEmpty() && (retries.firstKey() <= now))
+            queue.prepend(retries.take(retries.firstKey()));
+
+        while ((active < concurrency) && !queue.isEmpty()) {
+            if (interval > 0) {
+                const qint64 wait = lastRequest + interval - clock.elapsed();
+                if (wait > 0) {
+                    if (!rateTimer) {
+                        rateTimer = true;
+                        QTimer::singleShot(int(wait), this, SLOT(rateLimited()));
+                    }
+                    break;
+                }
+                lastRequest = clock.elapsed();
+            }
+
+            const QString url = queue.takeFirst();
+            QNetworkRequest request((QUrl(url, QUrl::StrictMode)));
+            request.setRawHeader("User-Agent", "br");
+            request.setAttribute(QNetworkRequest::HttpPipeliningAllowedAttribute, true);
+            QNetworkReply *reply = manager->get(request);
+            reply->setProperty("url", url);
+            connect(reply, SIGNAL(finished()), this, SLOT(finished()));
+            resources[url].attempts++;
+            active++;
+        }
+    }
+
+    void finished()
+    {
+        QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+        const QString url = reply->property("url").toString();
+        const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        const bool transient = ((reply->error() > QNetworkReply::NoError) && (reply->error() < QNetworkReply::ProxyConnectionRefusedError)) ||
+                               (status == 429) || (status >= 500);
+
+        QMutexLocker locker(&mutex);
+        active--;
+        Resource &resource = resources[url];
+        if ((reply->error() != QNetworkReply::NoError) && transient && (resource.attempts < maxAttempts)) {
+            const int delay = Backoff << (resource.attempts - 1);
+            retries.insertMulti(clock.elapsed() + delay, url);
+            QTimer::singleShot(delay, this, SLOT(dispatch()));
+        } else {
+            if (reply->error() == QNetworkReply::NoError) resource.data = reply->readAll();
+            else                                          resource.error = reply->errorString();
+            resource.done = true;
+            buffered.append(url);
+
+            // Drop the oldest prefetched resources nobody is waiting for
+            while (buffered.size() > MaxBuffered) {
+                const QString oldest = buffered.takeFirst();
+                if (resources[oldest].waiters > 0) buffered.append(oldest);
+                else                               resources.remove(oldest);
+                if (buffered.first() == url) break;
+            }
+            fetched.wakeAll();
+        }
+        reply->deleteLater();
+
+        locker.unlock();
+        dispatch();
+    }
+
+    void rateLimited()
+    {
+        {
+            QMutexLocker locker(&mutex);
+            rateTimer = false;
+        }
+        dispatch();
+    }
+
+    void shutdown()
+    {
+        delete manager;
+        manager = NULL;
+    }
+};
+
+/*!
+ * \ingroup initializers
+ * \brief Owns the Fetcher shared by Download and urlGallery.
+ * \author Unknown \cite unknown
+ */
+class FetcherInitializer : public Initializer
+{
+    Q_OBJECT
+
+    static QMutex lock;
+    static Fetcher *fetcher;
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        delete fetcher;
+        fetcher = NULL;
+    }
+
+public:
+    static Fetcher *instance()
+    {
+        QMutexLocker locker(&lock);
+        if (!fetcher)
+            fetcher = new Fetcher();
+        return fetcher;
+    }
+};
+
+QMutex FetcherInitializer::lock;
+Fetcher *FetcherInitializer::fetcher = NULL;
+
+BR_REGISTER(Initializer, FetcherInitializer)
+
+static bool isRemote(const QString &url)
+{
+    return url.startsWith("http://") || url.startsWith("https://");
+}
+
+void prefetch(const QString &url)
+{
+    if (isRemote(url))
+        FetcherInitializer::instance()->prefetch(url);
+}
+
+bool pollFetch(const QString &url, QByteArray &data, QString &error)
+{
+    return FetcherInitializer::instance()->poll(url, data, error);
+}
+
+void setFetchRate(double requestsPerSecond)
+{
+    FetcherInitializer::instance()->setRate(requestsPerSecond);
+}
+
 /*!
  * \ingroup transforms
  * \brief Downloads an image from a URL
+ *
+ * Remote resources are fetched through a connection pool shared by every thread,
+ * which galleries like urlGallery fill ahead of enrollment.
  * \author Josh Klontz \cite jklontz
+ * \br_property int concurrency Maximum number of requests in flight at once. Default is 16.
+ * \br_property int retries Times a request failing with a connection error, 429 or 5xx response is retried, with exponential backoff. Default is 3.
+ * \br_property double rate Maximum requests started per second by the pool, 0 leaves the current limit, which is none unless set elsewhere. Default is 0.
  */
 class DownloadTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
     Q_ENUMS(Mode)
     Q_PROPERTY(Mode mode READ get_mode WRITE set_mode RESET reset_mode STORED false)
+    Q_PROPERTY(int concurrency READ get_concurrency WRITE set_concurrency RESET reset_concurrency STORED false)
+    Q_PROPERTY(int retries READ get_retries WRITE set_retries RESET reset_retries STORED false)
+    Q_PROPERTY(double rate READ get_rate WRITE set_rate RESET reset_rate STORED false)
 
 public:
     enum Mode { Permissive,
@@ -41,14 +328,24 @@ public:
                 Decoded };
 private:
     BR_PROPERTY(Mode, mode, Encoded)
+    BR_PROPERTY(int, concurrency, 16)
+    BR_PROPERTY(int, retries, 3)
+    BR_PROPERTY(double, rate, 0)
+
+    void init()
+    {
+        FetcherInitializer::instance()->configure(concurrency, retries);
+        if (rate > 0)
+            setFetchRate(rate);
+    }
 
-    // The reasons for this data structure are as follows:
-    // 1) The QNetworkAccessManager must be used in the thread that _created_ it,
-    //    hence the use of `QThreadStorage`.
-    // 2) The QThreadStorage must be deleted _after_ the threads that added QNetworkAccessManager
-    //    to it are deleted, hence the `static` ensuring that `nam` is deleted at program termination,
-    //    long after the threads that created QNetworkAccessManager are deleted.
-    static QThreadStorage<QNetworkAccessManager*> nam;
+    // Every remote request of a batch is issued up front, so they are in flight together over the pooled connections
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        foreach (const Template &t, src)
+            prefetch(t.file.get<QString>("URL", t.file.name).simplified());
+        UntrainableMetaTransform::project(src, dst);
+    }
 
     void project(const Template &src, Template &dst) const
     {
@@ -65,39 +362,20 @@ private:
         else if (url.startsWith("file://"))
             url = url.mid(7);
 
-        QIODevice *device = NULL;
+        QByteArray data;
         if (QFileInfo(url).exists()) {
-            device = new QFile(url);
-            device->open(QIODevice::ReadOnly);
+            QFile file(url);
+            if (file.open(QIODevice::ReadOnly))
+                data = file.readAll();
         } else {
-            if (!nam.hasLocalData())
-                nam.setLocalData(new QNetworkAccessManager());
             const QUrl qURL(url, QUrl::StrictMode);
             if (qURL.isValid() && !qURL.isRelative()) {
-                QNetworkRequest req = QNetworkRequest(qURL);
-                req.setRawHeader("User-Agent", "br");
-                QNetworkReply *reply = nam.localData()->get(req);
-
-                reply->waitForReadyRead(-1);
-                while (!reply->isFinished())
-                    QCoreApplication::processEvents();
-
-                if (reply->error() != QNetworkReply::NoError) {
-                    qDebug() << reply->errorString() << url;
-                    reply->deleteLater();
-                } else {
-                    device = reply;
-                }
+                QString error;
+                if (!FetcherInitializer::instance()->take(url, data, error))
+                    qDebug() << error << url;
             }
         }
 
-        QByteArray data;
-        if (device) {
-            data = device->readAll();
-            delete device;
-            device = NULL;
-        }
-
         if (!data.isEmpty()) {
             Mat encoded(1, data.size(), CV_8UC1, (void*)data.data());
             encoded = encoded.clone();
@@ -117,7 +395,6 @@ private:
         }
     }
 };
-QThreadStorage<QNetworkAccessManager*> DownloadTransform::nam;
 
 BR_REGISTER(Transform, DownloadTransform)
 
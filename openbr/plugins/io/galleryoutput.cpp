@@ -46,7 +46,14 @@ class GalleryOutputTransform : public TimeVaryingTransform
     {
         (void) data;
     }
-    ;
+
+    // Called at the end of every stream, so callers can rely on the output being on disk when it returns
+    void finalize(TemplateList &output)
+    {
+        output.clear();
+        writer->flush();
+    }
+
     void init()
     {
         writer = QSharedPointer<Gallery>(Gallery::make(outputString));
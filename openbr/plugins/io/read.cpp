@@ -14,7 +14,17 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#ifndef BR_EMBEDDED
+#include <QBuffer>
+#include <QImageReader>
+#endif // BR_EMBEDDED
+#include <QFutureSynchronizer>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <QtConcurrentRun>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/core/opencvutils.h>
 #include <openbr/plugins/openbr_internal.h>
 
@@ -23,10 +33,185 @@ using namespace cv;
 namespace br
 {
 
+Mat decodeReduced(const Mat &encoded, int flags, int reducedSize, int *scale)
+{
+    *scale = 1;
+#ifndef BR_EMBEDDED
+    const bool jpeg = (encoded.total() > 2) && (encoded.data[0] == 0xFF) && (encoded.data[1] == 0xD8);
+    if ((reducedSize > 0) && jpeg && ((flags == IMREAD_COLOR) || (flags == IMREAD_GRAYSCALE) || (flags == IMREAD_UNCHANGED))) {
+        QByteArray bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(encoded.data), int(encoded.total()));
+        QBuffer buffer(&bytes);
+        QImageReader reader(&buffer, "jpeg");
+        const QSize size = reader.size();
+
+        int s = 1;
+        while ((s < 8) && (qMin(size.width(), size.height()) / (2*s) >= reducedSize))
+            s *= 2;
+
+        if (s > 1) {
+            // The size libjpeg's DCT scaling produces, rounded up as libjpeg does, so Qt doesn't resample afterwards
+            reader.setScaledSize(QSize((size.width() + s - 1) / s, (size.height() + s - 1) / s));
+            QImage image = reader.read();
+            if (!image.isNull()) {
+                const bool gray = (flags == IMREAD_GRAYSCALE) || ((flags == IMREAD_UNCHANGED) && image.isGrayscale());
+                image = image.convertToFormat(QImage::Format_RGB888);
+                const Mat rgb(image.height(), image.width(), CV_8UC3, image.bits(), image.bytesPerLine());
+                Mat dst;
+                cvtColor(rgb, dst, gray ? CV_RGB2GRAY : CV_RGB2BGR);
+                *scale = s;
+                return dst;
+            }
+        }
+    }
+#else // BR_EMBEDDED
+    (void) reducedSize;
+#endif // BR_EMBEDDED
+    return imdecode(encoded, flags);
+}
+
+void setDecodeScale(File &file, int scale)
+{
+    if ((scale == 1) || file.contains("DecodeScale"))
+        return;
+
+    QList<QRectF> rects = file.rects();
+    for (int i=0; i<rects.size(); i++)
+        rects[i] = QRectF(rects[i].topLeft() / scale, rects[i].bottomRight() / scale);
+    file.setRects(rects);
+
+    QList<QPointF> points = file.points();
+    for (int i=0; i<points.size(); i++)
+        points[i] = points[i] / scale;
+    file.setPoints(points);
+
+    file.set("DecodeScale", scale);
+}
+
+// Reads the files of a block on background I/O threads, at most window of them ahead of the workers decoding them.
+// A worker that gets to a file before the I/O threads do reads it itself.
+class ReadAhead
+{
+    enum State { Unread, Reading, Ready, Taken };
+
+    static const int IOThreads = 4;
+
+    const QStringList files;
+    QVector<State> states;
+    QVector<QByteArray> buffers;
+    int next, buffered, loaders;
+    const int window;
+    bool stopping;
+    QMutex lock;
+    QWaitCondition changed;
+
+    class Loader : public QRunnable
+    {
+        ReadAhead *readAhead;
+
+    public:
+        Loader(ReadAhead *readAhead) : readAhead(readAhead) {}
+
+        void run()
+        {
+            readAhead->load();
+        }
+    };
+
+    static QThreadPool *ioThreads()
+    {
+        static QThreadPool pool;
+        pool.setMaxThreadCount(IOThreads);
+        return &pool;
+    }
+
+    static QByteArray readFile(const QString &fileName)
+    {
+        QFile file(fileName);
+        return file.open(QFile::ReadOnly) ? file.readAll() : QByteArray();
+    }
+
+    void load()
+    {
+        QMutexLocker locker(&lock);
+        while (!stopping) {
+            while ((next < files.size()) && (states[next] != Unread))
+                next++;
+            if (next == files.size())
+                break;
+            if (buffered >= window) {
+                changed.wait(&lock);
+                continue;
+            }
+
+            const int i = next++;
+            states[i] = Reading;
+            buffered++;
+            locker.unlock();
+            const QByteArray data = readFile(files[i]);
+            locker.relock();
+            buffers[i] = data;
+            states[i] = Ready;
+            changed.wakeAll();
+        }
+        loaders--;
+        changed.wakeAll();
+    }
+
+public:
+    // Empty file names are skipped
+    ReadAhead(const QStringList &files, int window)
+        : files(files), states(files.size(), Unread), buffers(files.size()), next(0), buffered(0), loaders(IOThreads), window(window), stopping(false)
+    {
+        for (int i=0; i<files.size(); i++)
+            if (files[i].isEmpty())
+                states[i] = Taken;
+        for (int i=0; i<IOThreads; i++)
+            ioThreads()->start(new Loader(this));
+    }
+
+    ~ReadAhead()
+    {
+        QMutexLocker locker(&lock);
+        stopping = true;
+        changed.wakeAll();
+        while (loaders > 0)
+            changed.wait(&lock);
+    }
+
+    QByteArray take(int i)
+    {
+        QMutexLocker locker(&lock);
+        if (states[i] == Unread) {
+            states[i] = Taken;
+            locker.unlock();
+            return readFile(files[i]);
+        }
+
+        while (states[i] == Reading)
+            changed.wait(&lock);
+        const QByteArray data = buffers[i];
+        buffers[i].clear();
+        states[i] = Taken;
+        buffered--;
+        changed.wakeAll();
+        return data;
+    }
+};
+
 /*!
  * \ingroup transforms
  * \brief Read images
+ *
+ * With reducedSize, JPEGs are decoded with libjpeg's DCT scaling at the largest reduction of 1/2, 1/4 or 1/8
+ * whose shorter side is still at least reducedSize pixels, which is much faster than decoding them at full resolution
+ * for pipelines that downsize anyway. Rects and points are scaled to match and the reduction is kept as DecodeScale,
+ * which OriginalScale undoes once the pipeline's own rects and points are in place. Other images are decoded at full resolution.
+ *
+ * With readAhead, a block of templates read together has its files loaded into memory by background I/O threads,
+ * up to readAhead files ahead of the threads decoding them, so the decoding threads don't wait on the disk.
  * \author Josh Klontz \cite jklontz
+ * \br_property int reducedSize Smallest shorter side of a reduced JPEG decode, 0 decodes at full resolution.
+ * \br_property int readAhead Most files held in memory ahead of decoding, 0 reads each file on the thread decoding it.
  */
 class ReadTransform : public UntrainableMetaTransform
 {
@@ -45,16 +230,76 @@ public:
     };
 
 private:
+    Q_PROPERTY(int reducedSize READ get_reducedSize WRITE set_reducedSize RESET reset_reducedSize STORED false)
     BR_PROPERTY(Mode, mode, Color)
+    Q_PROPERTY(int readAhead READ get_readAhead WRITE set_readAhead RESET reset_readAhead STORED false)
+    BR_PROPERTY(int, reducedSize, 0)
+    BR_PROPERTY(int, readAhead, 0)
 
     void project(const Template &src, Template &dst) const
+    {
+        read(src, dst, NULL);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (readAhead <= 0) {
+            UntrainableMetaTransform::project(src, dst);
+            return;
+        }
+
+        QStringList files;
+        foreach (const Template &t, src)
+            files.append(t.empty() ? t.file.resolved() : QString());
+        ReadAhead prefetch(files, readAhead);
+
+        dst.reserve(src.size());
+        for (int i=0; i<src.size(); i++)
+            dst.append(Template());
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<dst.size(); i++)
+            if (threadParallelism() > 1) futures.addFuture(QtConcurrent::run(this, &ReadTransform::readPrefetched, &prefetch, &src[i], &dst[i], i));
+            else                         readPrefetched(&prefetch, &src[i], &dst[i], i);
+        futures.waitForFinished();
+    }
+
+    void readPrefetched(ReadAhead *prefetch, const Template *src, Template *dst, int i) const
+    {
+        if (!src->empty()) {
+            read(*src, *dst, NULL);
+        } else {
+            const QByteArray encoded = prefetch->take(i);
+            read(*src, *dst, &encoded);
+        }
+    }
+
+    // Files already in memory are passed as encoded
+    void read(const Template &src, Template &dst, const QByteArray *encoded) const
     {
         dst.file = src.file;
         if (Globals->verbose)
             qDebug("Opening %s", qPrintable(src.file.flat()));
 
         if (src.empty()) {
-            const Mat img = imread(src.file.resolved().toStdString(), mode);
+            Mat img;
+            const QString suffix = src.file.suffix().toLower();
+            if (encoded) {
+                if (!encoded->isEmpty()) {
+                    int scale;
+                    img = decodeReduced(Mat(1, encoded->size(), CV_8UC1, const_cast<char*>(encoded->data())), mode, reducedSize, &scale);
+                    setDecodeScale(dst.file, scale);
+                }
+            } else if ((reducedSize > 0) && ((suffix == "jpg") || (suffix == "jpeg"))) {
+                QFile file(src.file.resolved());
+                if (file.open(QFile::ReadOnly)) {
+                    const QByteArray encoded = file.readAll();
+                    int scale;
+                    img = decodeReduced(Mat(1, encoded.size(), CV_8UC1, const_cast<char*>(encoded.data())), mode, reducedSize, &scale);
+                    setDecodeScale(dst.file, scale);
+                }
+            } else {
+                img = imread(src.file.resolved().toStdString(), mode);
+            }
             if (img.data) dst.append(img);
             else          dst.file.fte = true;
         } else {
@@ -62,9 +307,11 @@ private:
 		if (((m.rows > 1) && (m.cols > 1)) || (m.type() != CV_8UC1))
                     dst += m;
 		else {
-                    const Mat img = imdecode(m, mode);
+                    int scale;
+                    const Mat img = decodeReduced(m, mode, reducedSize, &scale);
                     if (img.data) dst.append(img);
                     else          dst.file.fte = true;
+                    setDecodeScale(dst.file, scale);
 		}
             }
         }
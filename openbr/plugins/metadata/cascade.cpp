@@ -158,34 +158,48 @@ static void trainCascade(const TrainParams &params)
 namespace br
 {
         
-class CascadeResourceMaker : public ResourceMaker<CascadeClassifier>
+static QString cascadeFile(const QString &model)
+{
+    QString file = Globals->sdkPath + "/share/openbr/models/";
+    if      (model == "Ear")         file += "haarcascades/haarcascade_ear.xml";
+    else if (model == "Eye")         file += "haarcascades/haarcascade_eye_tree_eyeglasses.xml";
+    else if (model == "FrontalFace") file += "haarcascades/haarcascade_frontalface_alt2.xml";
+    else if (model == "ProfileFace") file += "haarcascades/haarcascade_profileface.xml";
+    else {
+        // Create a directory for trainable cascades
+        file += "openbrcascades/"+model+"/cascade.xml";
+        QFile touchFile(file);
+        QtUtils::touchDir(touchFile);
+    }
+    return file;
+}
+
+// The cascade is parsed once per process, each thread detects with its own copy.
+class CascadeResourceMaker : public SharedResourceMaker<CascadeClassifier>
 {
     QString file;
 
 public:
-    CascadeResourceMaker(const QString &model)
-    {
-        file = Globals->sdkPath + "/share/openbr/models/";
-        if      (model == "Ear")         file += "haarcascades/haarcascade_ear.xml";
-        else if (model == "Eye")         file += "haarcascades/haarcascade_eye_tree_eyeglasses.xml";
-        else if (model == "FrontalFace") file += "haarcascades/haarcascade_frontalface_alt2.xml";
-        else if (model == "ProfileFace") file += "haarcascades/haarcascade_profileface.xml";
-        else {
-            // Create a directory for trainable cascades
-            file += "openbrcascades/"+model+"/cascade.xml";
-            QFile touchFile(file);
-            QtUtils::touchDir(touchFile);
-        }                             
-    }
+    CascadeResourceMaker(const QString &file)
+        : SharedResourceMaker<CascadeClassifier>(file)
+        , file(file)
+    {}
 
 private:
-    CascadeClassifier *make() const
+    CascadeClassifier *load() const
     {
         CascadeClassifier *cascade = new CascadeClassifier();
         if (!cascade->load(file.toStdString()))
             qFatal("Failed to load: %s", qPrintable(file));
         return cascade;
     }
+
+    CascadeClassifier *instantiate(const CascadeClassifier &model) const
+    {
+        CascadeClassifier *cascade = new CascadeClassifier();
+        OpenCVUtils::copyCascade(model, *cascade);
+        return cascade;
+    }
 };
 
 /*!
@@ -252,7 +266,8 @@ class CascadeTransform : public MetaTransform
 
     void init()
     {
-        cascadeResource.setResourceMaker(new CascadeResourceMaker(model));
+        cascadeResource.setResourceMaker(new CascadeResourceMaker(cascadeFile(model)));
+        cascadeResource.setMaxResources(0);
         if (model == "Ear" || model == "Eye" || model == "FrontalFace" || model == "ProfileFace")
             this->trainable = false;
     }
@@ -14,12 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <Eigen/Dense>
-
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
 
-using namespace Eigen;
 using namespace cv;
 
 namespace br
@@ -28,11 +25,28 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Consolidate redundant/overlapping detections.
+ *
+ * Group averages each connected set of detections whose intersection exceeds overlap of the larger area.
+ * NMS keeps the most confident detections, suppressing those whose intersection over union with a kept detection exceeds overlap.
+ * \br_property enum method Group or NMS.
+ * \br_property float overlap Overlap threshold for two detections to be considered redundant.
  * \author Brendan Klare \cite bklare
  */
 class ConsolidateDetectionsTransform : public UntrainableMetadataTransform
 {
     Q_OBJECT
+    Q_ENUMS(Method)
+    Q_PROPERTY(Method method READ get_method WRITE set_method RESET reset_method STORED false)
+    Q_PROPERTY(float overlap READ get_overlap WRITE set_overlap RESET reset_overlap STORED false)
+
+public:
+    /*!< */
+    enum Method { Group,
+                  NMS };
+
+private:
+    BR_PROPERTY(Method, method, Group)
+    BR_PROPERTY(float, overlap, 0.5)
 
     void projectMetadata(const File &src, File &dst) const
     {
@@ -40,113 +54,50 @@ class ConsolidateDetectionsTransform : public UntrainableMetadataTransform
         if (!dst.contains("Confidences"))
             return;
 
-        //Compute overlap between rectangles and create discrete Laplacian matrix
-        QList<Rect> rects = OpenCVUtils::toRects(src.rects());
-        int n = rects.size();
+        QList<Rect> rectList = OpenCVUtils::toRects(src.rects());
+        std::vector<Rect> rects(rectList.begin(), rectList.end());
+        const int n = rects.size();
         if (n == 0)
             return;
-        MatrixXf laplace(n,n);
-        for (int i = 0; i < n; i++) {
-            laplace(i,i) = 0;
-        }
-        for (int i = 0; i < n; i++){
-            for (int j = i + 1; j < n; j++) {
-                float overlap = (float)((rects[i] & rects[j]).area()) / (float)max(rects[i].area(), rects[j].area());
-                if (overlap > 0.5) {
-                    laplace(i,j) = -1.0;
-                    laplace(j,i) = -1.0;
-                    laplace(i,i) = laplace(i,i) + 1.0;
-                    laplace(j,j) = laplace(j,j) + 1.0;
-                } else {
-                    laplace(i,j) = 0;
-                    laplace(j,i) = 0;
-                }
-            }
-        }
-
-        // Compute eigendecomposition
-        SelfAdjointEigenSolver<Eigen::MatrixXf> eSolver(laplace);
-        MatrixXf allEVals = eSolver.eigenvalues();
-        MatrixXf allEVecs = eSolver.eigenvectors();
 
-        //Keep eigenvectors with zero eigenvalues
-        int nRegions = 0;
-        for (int i = 0; i < n; i++) {
-            if (fabs(allEVals(i)) < 1e-4) {
-                nRegions++;
-            }
-        }
-        MatrixXf regionVecs(n, nRegions);
-        for (int i = 0, cnt = 0; i < n; i++) {
-            if (fabs(allEVals(i)) < 1e-4)
-                regionVecs.col(cnt++) = allEVecs.col(i);
-        }
+        QList<float> confidenceList = dst.getList<float>("Confidences");
+        std::vector<float> confidences(confidenceList.begin(), confidenceList.end());
 
-        //Determine membership for each consolidated location
-        // and compute average of regions. This is determined by
-        // finding which eigenvector has the highest magnitude for
-        // each input dimension. Each input dimension corresponds to
-        // one of the input rect region. Thus, each eigenvector represents
-        // a set of overlaping regions.
-        float *midX = new float[nRegions];
-        float *midY = new float[nRegions];
-        float *avgWidth = new float[nRegions];
-        float *avgHeight = new float[nRegions];
-        float *confs = new float[nRegions];
-        int *cnts = new int[nRegions];
-        int mx;
-        int mxIdx;
-        for (int i = 0 ; i < nRegions; i++) {
-            midX[i] = 0;
-            midY[i] = 0;
-            avgWidth[i] = 0;
-            avgHeight[i] = 0;
-            confs[i] = 0;
-            cnts[i] = 0;
+        if (method == NMS) {
+            OpenCVUtils::suppress(rects, confidences, overlap);
+            dst.setRects(QList<Rect>::fromVector(QVector<Rect>::fromStdVector(rects)));
+            dst.setList<float>("Confidences", QList<float>::fromVector(QVector<float>::fromStdVector(confidences)));
+            return;
         }
 
-        QList<float> confidences = dst.getList<float>("Confidences");
+        // Average the center, size and confidence of each set of overlapping regions
+        std::vector<int> labels;
+        const int nRegions = OpenCVUtils::partitionOverlapping(rects, overlap, labels);
+        QVector<float> midX(nRegions, 0), midY(nRegions, 0), avgWidth(nRegions, 0), avgHeight(nRegions, 0), confs(nRegions, 0);
+        QVector<int> cnts(nRegions, 0);
         for (int i = 0; i < n; i++) {
-            mx = 0.0;
-            mxIdx = -1;
-
-            for (int j = 0; j < nRegions; j++) {
-                if (fabs(regionVecs(i,j)) > mx) {
-                    mx = fabs(regionVecs(i,j));
-                    mxIdx = j;
-                }
-            }
-
+            const int region = labels[i];
             Rect curRect = rects[i];
-            midX[mxIdx] += ((float)curRect.x + (float)curRect.width  / 2.0);
-            midY[mxIdx] += ((float)curRect.y + (float)curRect.height / 2.0);
-            avgWidth[mxIdx]  += (float) curRect.width;
-            avgHeight[mxIdx] += (float) curRect.height;
-            confs[mxIdx] += confidences[i];
-            cnts[mxIdx]++;
+            midX[region] += ((float)curRect.x + (float)curRect.width  / 2.0);
+            midY[region] += ((float)curRect.y + (float)curRect.height / 2.0);
+            avgWidth[region]  += (float) curRect.width;
+            avgHeight[region] += (float) curRect.height;
+            confs[region] += confidences[i];
+            cnts[region]++;
         }
 
         QList<Rect> consolidatedRects;
         QList<float> consolidatedConfidences;
         for (int i = 0; i < nRegions; i++) {
             float cntF = (float) cnts[i];
-            if (cntF > 0) {
-                int x = qRound((midX[i] / cntF) - (avgWidth[i] / cntF) / 2.0);
-                int y = qRound((midY[i] / cntF) - (avgHeight[i] / cntF) / 2.0);
-                int w = qRound(avgWidth[i] / cntF);
-                int h = qRound(avgHeight[i] / cntF);
-                consolidatedRects.append(Rect(x,y,w,h));
-                consolidatedConfidences.append(confs[i] / cntF);
-            }
+            int x = qRound((midX[i] / cntF) - (avgWidth[i] / cntF) / 2.0);
+            int y = qRound((midY[i] / cntF) - (avgHeight[i] / cntF) / 2.0);
+            int w = qRound(avgWidth[i] / cntF);
+            int h = qRound(avgHeight[i] / cntF);
+            consolidatedRects.append(Rect(x,y,w,h));
+            consolidatedConfidences.append(confs[i] / cntF);
         }
 
-        delete [] midX;
-        delete [] midY;
-        delete [] avgWidth;
-        delete [] avgHeight;
-        delete [] confs;
-        delete [] cnts;
-
         dst.setRects(consolidatedRects);
         dst.setList<float>("Confidences", consolidatedConfidences);
     }
@@ -0,0 +1,181 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QElapsedTimer>
+#include <algorithm>
+
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Records the time and output size of the wrapped transform for each template.
+ *
+ * Templates get "EnrollTime", the wall time in ms their projection took, and "EnrollBytes", the size of the matrices it produced.
+ * Templates produced from one input share its time. The slowest inputs are listed when the transform is finalized.
+ * Projections aren't interrupted, inputs taking longer than the deadline are marked as failures to enroll once they finish.
+ *
+ * \author Unknown \cite unknown
+ * \br_property br::Transform* transform The transform to time.
+ * \br_property int deadline Milliseconds after which an input fails to enroll, 0 to disable.
+ * \br_property int slowest The number of slowest inputs to list, 0 to disable.
+ */
+class CostTransform : public MetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform STORED false)
+    Q_PROPERTY(int deadline READ get_deadline WRITE set_deadline RESET reset_deadline STORED false)
+    Q_PROPERTY(int slowest READ get_slowest WRITE set_slowest RESET reset_slowest STORED false)
+    BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(int, deadline, 0)
+    BR_PROPERTY(int, slowest, 10)
+
+    typedef QPair<double, QString> Cost; // QPair<ms, input>
+
+    mutable QMutex costsLock;
+    mutable QList<Cost> costs; // The slowest inputs, slowest first
+    mutable int missed;
+
+    void init()
+    {
+        if (transform)
+            trainable = transform->trainable;
+        costs.clear();
+        missed = 0;
+    }
+
+    bool timeVarying() const { return transform->timeVarying(); }
+
+    void train(const QList<TemplateList> &data)
+    {
+        transform->train(data);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        QElapsedTimer timer;
+        timer.start();
+        transform->project(src, dst);
+        record(src.file, timer.nsecsElapsed() / 1e6, dst);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        // Inputs are timed one at a time, so each is charged only for its own outputs
+        foreach (const Template &t, src) {
+            QElapsedTimer timer;
+            timer.start();
+            TemplateList outputs;
+            transform->project(TemplateList() << t, outputs);
+            const double elapsed = timer.nsecsElapsed() / 1e6;
+            for (int i=0; i<outputs.size(); i++)
+                record(t.file, elapsed, outputs[i]);
+            dst.append(outputs);
+        }
+    }
+
+    void projectUpdate(const Template &src, Template &dst)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        transform->projectUpdate(src, dst);
+        record(src.file, timer.nsecsElapsed() / 1e6, dst);
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        if (!timeVarying()) {
+            project(src, dst);
+            return;
+        }
+
+        // Time varying transforms see the whole list at once, so its outputs share the time of the list
+        QElapsedTimer timer;
+        timer.start();
+        transform->projectUpdate(src, dst);
+        const double elapsed = timer.nsecsElapsed() / 1e6;
+        for (int i=0; i<dst.size(); i++)
+            record(dst[i].file, elapsed, dst[i]);
+    }
+
+    void record(const File &input, double elapsed, Template &dst) const
+    {
+        dst.file.set("EnrollTime", elapsed);
+        dst.file.set("EnrollBytes", qint64(dst.bytes()));
+        const bool late = (deadline > 0) && (elapsed > deadline);
+        if (late)
+            dst.file.fte = true;
+        if (!late && (slowest <= 0))
+            return;
+
+        QMutexLocker locker(&costsLock);
+        if (late)
+            missed++;
+        if ((slowest <= 0) || ((costs.size() == slowest) && (elapsed <= costs.last().first)))
+            return;
+        for (int i=0; i<costs.size(); i++)
+            if (costs[i].second == input.name) {
+                costs[i].first = std::max(costs[i].first, elapsed);
+                std::sort(costs.begin(), costs.end(), slower);
+                return;
+            }
+        costs.insert(std::lower_bound(costs.begin(), costs.end(), Cost(elapsed, input.name), slower), Cost(elapsed, input.name));
+        if (costs.size() > slowest)
+            costs.removeLast();
+    }
+
+    static bool slower(const Cost &a, const Cost &b)
+    {
+        return a.first > b.first;
+    }
+
+    void finalize(TemplateList &output)
+    {
+        transform->finalize(output);
+
+        QMutexLocker locker(&costsLock);
+        if (missed > 0)
+            qDebug("%d inputs failed to enroll within the %d ms deadline.", missed, deadline);
+        missed = 0;
+        if (costs.isEmpty())
+            return;
+
+        QStringList lines;
+        for (int i=0; i<costs.size(); i++)
+            lines.append(QString("%1\t%2").arg(QString::number(costs[i].first, 'f', 1), costs[i].second));
+        qDebug("\nSlowest inputs (ms)\n%s", qPrintable(lines.join("\n")));
+        costs.clear();
+    }
+
+    void store(QDataStream &stream) const
+    {
+        transform->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        transform->load(stream);
+    }
+};
+
+BR_REGISTER(Transform, CostTransform)
+
+} // namespace br
+
+#include "metadata/cost.moc"
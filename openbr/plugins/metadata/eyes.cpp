@@ -149,24 +149,24 @@ private:
     {
         Rect roi = OpenCVUtils::toRect(src.file.rects().first());
 
-        Mat gray;
-        OpenCVUtils::cvtGray(src.m()(roi), gray);
-
-        Mat image_tile;
+        // Downscale the face before converting it, so only the filter sized tile is converted
         // (r,c) == (128, 128) EyeLocatorASEF128x128.fel
-        resize(gray, image_tile, Size(height, width));
+        Mat image_tile = Arena::mat(), gray_tile = Arena::mat();
+        resize(src.m()(roi), image_tile, Size(height, width));
+        OpenCVUtils::cvtGray(image_tile, gray_tile);
 
         // _preprocess
-        Mat image;
-        LUT(image_tile, lut, image);
+        Mat image = Arena::mat();
+        LUT(gray_tile, lut, image);
 
-        // correlate
-        Mat left_corr, right_corr;
+        // correlate, one forward transform of the tile serves both filter spectra
+        Mat left_corr = Arena::mat(), right_corr = Arena::mat();
         dft(image, image, CV_DXT_FORWARD);
         mulSpectrums(image, left_filter_dft, left_corr, 0, true);
         mulSpectrums(image, right_filter_dft, right_corr, 0, true);
-        dft(left_corr, left_corr, CV_DXT_INV_SCALE);
-        dft(right_corr, right_corr, CV_DXT_INV_SCALE);
+        // Only the rows down to the bottom of each eye's search window are read, so the rest aren't inverted
+        dft(left_corr, left_corr, CV_DXT_INV_SCALE, left_rect.y + left_rect.height);
+        dft(right_corr, right_corr, CV_DXT_INV_SCALE, right_rect.y + right_rect.height);
 
         // locateEyes
         double minVal, maxVal;
@@ -174,13 +174,13 @@ private:
 
         // left_rect == (23, 35)  (32, 32) EyeLocatorASEF128x128.fel
         minMaxLoc(left_corr(left_rect), &minVal, &maxVal, &minLoc, &maxLoc);
-        float first_eye_x = (left_rect.x + maxLoc.x)*gray.cols/width+roi.x;
-        float first_eye_y = (left_rect.y + maxLoc.y)*gray.rows/height+roi.y;
+        float first_eye_x = (left_rect.x + maxLoc.x)*roi.width/width+roi.x;
+        float first_eye_y = (left_rect.y + maxLoc.y)*roi.height/height+roi.y;
 
         // right_rect == (71, 32)  (32, 32) EyeLocatorASEF128x128.fel
         minMaxLoc(right_corr(right_rect), &minVal, &maxVal, &minLoc, &maxLoc);
-        float second_eye_x = (right_rect.x + maxLoc.x)*gray.cols/width+roi.x;
-        float second_eye_y = (right_rect.y + maxLoc.y)*gray.rows/height+roi.y;
+        float second_eye_x = (right_rect.x + maxLoc.x)*roi.width/width+roi.x;
+        float second_eye_y = (right_rect.y + maxLoc.y)*roi.height/height+roi.y;
 
         dst.m() = src.m();
         dst.file.appendPoint(QPointF(first_eye_x, first_eye_y));
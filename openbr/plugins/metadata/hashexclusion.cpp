@@ -0,0 +1,170 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QCryptographicHash>
+#include <QFileInfo>
+#include <QMutex>
+#include <QSet>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Drops templates whose file contents were already enrolled, before they are decoded.
+ *
+ * Each file is hashed together with the algorithm, so an input is only skipped if it was enrolled by the same algorithm.
+ * Hashes of enrolled inputs are read from table, one SHA-1 hash and file name per line.
+ * Byte-identical duplicates within a run are dropped too, keeping the first.
+ * Passed templates carry their hash in the ContentHash metadata field, for HashRecordTransform to add to the table once they are enrolled.
+ * Templates that already have matrices, or whose file can't be read, are passed through.
+ * \br_property QString table File holding the hashes of enrolled inputs.
+ * \br_property QString algorithm Identifies the algorithm the inputs are enrolled by.
+ * \author Unknown \cite unknown
+ */
+class HashExclusionTransform : public UntrainableMetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QString table READ get_table WRITE set_table RESET reset_table STORED false)
+    Q_PROPERTY(QString algorithm READ get_algorithm WRITE set_algorithm RESET reset_algorithm STORED false)
+    BR_PROPERTY(QString, table, "")
+    BR_PROPERTY(QString, algorithm, "")
+
+    mutable QMutex mutex;
+    mutable QHash<QByteArray, QString> enrolled; // Hash of each enrolled or passed input to its file name
+    mutable int skipped;
+
+    ~HashExclusionTransform()
+    {
+        if (skipped > 0)
+            qDebug("Skipped %d previously enrolled or duplicate inputs.", skipped);
+    }
+
+    void init()
+    {
+        enrolled.clear();
+        skipped = 0;
+        if (table.isEmpty() || !QFileInfo(table).exists())
+            return;
+
+        QFile file(table);
+        if (!file.open(QFile::ReadOnly))
+            qFatal("Can't read enrollment hashes: %s", qPrintable(table));
+        while (!file.atEnd()) {
+            const QByteArray line = file.readLine().trimmed();
+            const int space = line.indexOf(' ');
+            if (space > 0)
+                enrolled.insert(line.left(space), QString::fromUtf8(line.mid(space+1)));
+        }
+    }
+
+    void project(const Template &, Template &) const
+    {
+        qFatal("HashExclusion can't do anything here");
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        foreach (const Template &t, src) {
+            QFile file(t.file.resolved());
+            if (!t.isEmpty() || !file.open(QFile::ReadOnly)) {
+                dst.append(t);
+                continue;
+            }
+
+            QCryptographicHash hash(QCryptographicHash::Sha1);
+            hash.addData(algorithm.toUtf8());
+            hash.addData(&file);
+            const QByteArray key = hash.result().toHex();
+
+            QMutexLocker locker(&mutex);
+            if (enrolled.contains(key)) {
+                skipped++;
+                continue;
+            }
+            enrolled.insert(key, t.file.name);
+            dst.append(t);
+            dst.last().file.set("ContentHash", QString::fromLatin1(key));
+        }
+    }
+
+public:
+    HashExclusionTransform() : skipped(0) {}
+};
+
+BR_REGISTER(Transform, HashExclusionTransform)
+
+/*!
+ * \ingroup transforms
+ * \brief Appends the ContentHash of enrolled templates to a HashExclusionTransform table.
+ *
+ * Placed after enrollment, so inputs that fail to enroll are not recorded and are tried again by later runs.
+ * The ContentHash metadata field is removed, the table is written once the transform is destroyed.
+ * \br_property QString table File holding the hashes of enrolled inputs.
+ * \author Unknown \cite unknown
+ */
+class HashRecordTransform : public UntrainableMetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(QString table READ get_table WRITE set_table RESET reset_table STORED false)
+    BR_PROPERTY(QString, table, "")
+
+    mutable QMutex mutex;
+    mutable QSet<QString> recorded;
+    mutable QStringList added; // Table lines not yet saved
+
+    ~HashRecordTransform()
+    {
+        if (table.isEmpty() || added.isEmpty())
+            return;
+
+        QFile file(table);
+        QtUtils::touchDir(file);
+        if (!file.open(QFile::WriteOnly | QFile::Append))
+            qFatal("Can't write enrollment hashes: %s", qPrintable(table));
+        file.write((added.join("\n") + "\n").toUtf8());
+    }
+
+    void project(const Template &, Template &) const
+    {
+        qFatal("HashRecord can't do anything here");
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        foreach (Template t, src) {
+            const QString key = t.file.get<QString>("ContentHash", "");
+            t.file.remove("ContentHash");
+            if (!key.isEmpty() && !t.file.fte && !t.isEmpty()) {
+                QMutexLocker locker(&mutex);
+                if (!recorded.contains(key)) {
+                    recorded.insert(key);
+                    added.append(key + " " + t.file.name);
+                }
+            }
+            dst.append(t);
+        }
+    }
+};
+
+BR_REGISTER(Transform, HashRecordTransform)
+
+} // namespace br
+
+#include "metadata/hashexclusion.moc"
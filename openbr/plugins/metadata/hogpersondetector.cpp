@@ -16,7 +16,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
+
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/featureplanes.h>
+#include <openbr/core/opencvutils.h>
 
 using namespace cv;
 
@@ -26,29 +30,127 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Detects objects with OpenCV's built-in HOG detection.
+ *
+ * Each pyramid level is resized once, shared with other detectors scanning the same image, then scanned in parallel.
+ * The block histograms of a level are computed once and reused by every window overlapping them.
+ * Like Cascade, each detection is output as its own template with a Confidence and a Person rect,
+ * and the whole image is returned when nothing is found and enrollAll is unset,
+ * so the detector can be wrapped in Track and MotionROI to follow people through video and scan only what moved.
  * \br_link http://docs.opencv.org/modules/gpu/doc/object_detection.html
  * \author Austin Blanton \cite imaus10
+ * \br_property float hitThreshold Minimum SVM response of a window to be detected. Default is 0.
+ * \br_property float scaleFactor The factor to scale the image by between pyramid levels. Default is 1.05.
+ * \br_property int winStride Step between windows in pixels, a multiple of the 8 pixel block stride. Default is 8.
+ * \br_property int minNeighbors Number of overlapping windows needed for a detection. Default is 2.
+ * \br_property float overlap If positive, detections are merged by intersection over union non-maximum suppression at this threshold instead of grouped by minNeighbors.
  */
-class HOGPersonDetectorTransform : public UntrainableTransform
+class HOGPersonDetectorTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
+    Q_PROPERTY(float hitThreshold READ get_hitThreshold WRITE set_hitThreshold RESET reset_hitThreshold STORED false)
+    Q_PROPERTY(float scaleFactor READ get_scaleFactor WRITE set_scaleFactor RESET reset_scaleFactor STORED false)
+    Q_PROPERTY(int winStride READ get_winStride WRITE set_winStride RESET reset_winStride STORED false)
+    Q_PROPERTY(int minNeighbors READ get_minNeighbors WRITE set_minNeighbors RESET reset_minNeighbors STORED false)
+    Q_PROPERTY(float overlap READ get_overlap WRITE set_overlap RESET reset_overlap STORED false)
+    BR_PROPERTY(float, hitThreshold, 0)
+    BR_PROPERTY(float, scaleFactor, 1.05)
+    BR_PROPERTY(int, winStride, 8)
+    BR_PROPERTY(int, minNeighbors, 2)
+    BR_PROPERTY(float, overlap, 0)
 
     HOGDescriptor hog;
 
+    // A pyramid level and the windows detected in it, in level coordinates
+    struct Level
+    {
+        double scale;
+        Mat image;
+        std::vector<Point> hits;
+        std::vector<double> weights;
+    };
+
     void init()
     {
         hog.setSVMDetector(HOGDescriptor::getDefaultPeopleDetector());
     }
 
+    void detectLevel(const Mat *m, Level *level) const
+    {
+        // Shared with other detectors scanning the same image
+        level->image = FeaturePlanes::level(*m, Size(cvRound(m->cols/level->scale), cvRound(m->rows/level->scale)));
+        hog.detect(level->image, level->hits, level->weights, hitThreshold, Size(winStride, winStride), Size());
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        dst = src;
-        std::vector<Rect> objLocs;
-        QList<Rect> rects;
-        hog.detectMultiScale(src, objLocs);
-        foreach (const Rect &obj, objLocs)
-            rects.append(obj);
-        dst.file.setRects(rects);
+        TemplateList temp;
+        project(TemplateList() << src, temp);
+        if (!temp.isEmpty()) dst = temp.first();
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        foreach (const Template &t, src) {
+            const bool enrollAll = t.file.getBool("enrollAll");
+
+            // Mirror the behavior of ExpandTransform in the special case
+            // of an empty template.
+            if (t.empty() && !enrollAll) {
+                dst.append(t);
+                continue;
+            }
+
+            for (int i=0; i<t.size(); i++) {
+                Mat m;
+                OpenCVUtils::cvtUChar(t[i], m);
+
+                QList<Level> levels;
+                for (double scale = 1; (cvRound(m.cols/scale) >= hog.winSize.width) && (cvRound(m.rows/scale) >= hog.winSize.height); scale *= scaleFactor) {
+                    Level level;
+                    level.scale = scale;
+                    levels.append(level);
+                }
+
+                QFutureSynchronizer<void> futures;
+                for (int j=0; j<levels.size(); j++)
+                    futures.addFuture(QtConcurrent::run(this, &HOGPersonDetectorTransform::detectLevel, (const Mat*)&m, &levels[j]));
+                futures.waitForFinished();
+
+                // Merged in level order, so results do not depend on scheduling
+                std::vector<Rect> rects;
+                std::vector<double> weights;
+                foreach (const Level &level, levels)
+                    for (size_t j=0; j<level.hits.size(); j++) {
+                        rects.push_back(Rect(cvRound(level.hits[j].x*level.scale), cvRound(level.hits[j].y*level.scale),
+                                             cvRound(hog.winSize.width*level.scale), cvRound(hog.winSize.height*level.scale)));
+                        weights.push_back(level.weights[j]);
+                    }
+
+                std::vector<float> confidences;
+                if (overlap > 0) {
+                    confidences.assign(weights.begin(), weights.end());
+                    OpenCVUtils::suppress(rects, confidences, overlap);
+                } else {
+                    std::vector<int> neighbors;
+                    groupRectangles(rects, minNeighbors, 0.2, &neighbors, &weights);
+                    confidences.assign(weights.begin(), weights.end());
+                }
+
+                if (!enrollAll && rects.empty()) {
+                    rects.push_back(Rect(0, 0, m.cols, m.rows));
+                    confidences.push_back(-std::numeric_limits<float>::max());
+                }
+
+                for (size_t j=0; j<rects.size(); j++) {
+                    Template u(t.file, t[i]);
+                    u.file.set("Confidence", confidences[j]);
+                    const QRectF rect = OpenCVUtils::fromRect(rects[j]);
+                    u.file.appendRect(rect);
+                    u.file.set("Person", rect);
+                    dst.append(u);
+                }
+            }
+        }
     }
 };
 
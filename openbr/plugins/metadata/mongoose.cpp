@@ -1,36 +1,335 @@
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QReadWriteLock>
+#include <QThread>
+#include <QUrlQuery>
+#include <QWaitCondition>
+#include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+
 #include <openbr/plugins/openbr_internal.h>
 #include <mongoose.h>
 
 namespace br
 {
 
-// This function will be called by mongoose on every new request.
-static int begin_request_handler(struct mg_connection *conn) {
-  const struct mg_request_info *request_info = mg_get_request_info(conn);
-  char content[100];
-
-  // Prepare the message we're going to send
-  int content_length = snprintf(content, sizeof(content),
-                                "Hello from mongoose! Remote port: %d",
-                                request_info->remote_port);
-
-  // Send HTTP reply to the client
-  mg_printf(conn,
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Type: text/plain\r\n"
-            "Content-Length: %d\r\n"        // Always set Content-Length
-            "\r\n"
-            "%s",
-            content_length, content);
-
-  // Returning non-zero tells mongoose that our function has replied to
-  // the client, and mongoose should not send client any more data.
-  return 1;
+/*!
+ * \brief A resident enroll and search service.
+ *
+ * The algorithm and galleries are loaded once and kept in memory.
+ * A pool of workers, one per thread of Globals->parallelism, each holding a smartCopy of the algorithm, serves a bounded queue.
+ * Requests arriving within a short window of each other are answered by one batch,
+ * enrolling every probe and then comparing them against each gallery in a single Distance::compare pass.
+ * Requests beyond the queue bound are refused rather than left to wait.
+ * Probes may also arrive already enrolled, as they do from a shardsGallery scattering a search across services.
+ */
+class SearchService
+{
+public:
+    struct Request
+    {
+        bool search; // Otherwise enroll
+        QString gallery;
+        int k;
+        cv::Mat image;
+        Template probe; // Already enrolled, used instead of image when it has matrices
+        QByteArray response;
+        bool done;
+    };
+
+    static const int BatchWindow = 5; // ms
+    static const int MaxBatchSize = 256;
+    static const int MaxQueueSize = 4 * MaxBatchSize;
+    static const int LatencySamples = 4096;
+
+    SearchService() : stopping(false), requests(0), rejected(0), batches(0), nextLatency(0)
+    {
+        uptime.start();
+    }
+
+    ~SearchService()
+    {
+        qDeleteAll(workers);
+    }
+
+    void start()
+    {
+        for (int i=0; i<std::max(Globals->parallelism, 1); i++) {
+            workers.append(new Worker(this));
+            workers.last()->start();
+        }
+    }
+
+    void stop()
+    {
+        QMutexLocker locker(&mutex);
+        stopping = true;
+        pending.wakeAll();
+    }
+
+    void wait()
+    {
+        foreach (Worker *worker, workers)
+            worker->wait();
+    }
+
+    // Called concurrently from the mongoose worker threads, returns false if the queue is full
+    bool submit(Request &request)
+    {
+        QElapsedTimer timer;
+        timer.start();
+
+        QMutexLocker locker(&mutex);
+        if (queue.size() >= MaxQueueSize) {
+            rejected++;
+            Context::addMetric("br_search_rejected_total");
+            return false;
+        }
+        request.done = false;
+        queue.append(&request);
+        Context::setMetric("br_search_queue_depth", queue.size());
+        pending.wakeOne();
+        while (!request.done)
+            completed.wait(&mutex);
+
+        requests++;
+        if (latencies.size() < LatencySamples) latencies.append(timer.nsecsElapsed() / 1e6);
+        else                                   latencies[nextLatency] = timer.nsecsElapsed() / 1e6;
+        nextLatency = (nextLatency + 1) % LatencySamples;
+        Context::addMetric(request.search ? "br_search_requests_total{type=\"search\"}" : "br_search_requests_total{type=\"enroll\"}");
+        Context::observeMetric("br_search_request_seconds", timer.nsecsElapsed() / 1e9);
+        return true;
+    }
+
+    QByteArray stats()
+    {
+        QMutexLocker locker(&mutex);
+        QVector<double> sorted = latencies;
+        std::sort(sorted.begin(), sorted.end());
+
+        QJsonObject json;
+        json["requests"] = double(requests);
+        json["rejected"] = double(rejected);
+        json["batches"] = double(batches);
+        json["queued"] = queue.size();
+        json["workers"] = workers.size();
+        json["throughput"] = requests / std::max(uptime.elapsed() / 1000.0, 1e-3); // requests per second
+        json["p50"] = sorted.isEmpty() ? 0 : sorted[sorted.size() / 2]; // ms, over recent requests
+        json["p99"] = sorted.isEmpty() ? 0 : sorted[std::min(sorted.size() - 1, int(sorted.size() * 0.99))];
+        return QJsonDocument(json).toJson();
+    }
+
+    // The size and template names of a gallery, loading it if needed
+    QByteArray describe(const QString &name)
+    {
+        QWriteLocker locker(&galleriesLock);
+        const TemplateList &templates = gallery(name);
+        QJsonArray names;
+        foreach (const Template &t, templates)
+            names.append(t.file.name);
+        QJsonObject json;
+        json["size"] = templates.size();
+        json["names"] = names;
+        return QJsonDocument(json).toJson();
+    }
+
+private:
+    class Worker : public QThread
+    {
+        SearchService *service;
+
+    public:
+        Worker(SearchService *service) : service(service) {}
+
+    private:
+        void run()
+        {
+            service->work();
+        }
+    };
+
+    QList<Worker*> workers;
+
+    QMutex mutex;
+    QWaitCondition pending, completed;
+    QList<Request*> queue;
+    bool stopping;
+
+    QMutex algorithmLock;
+    QSharedPointer<Transform> transform;
+    QSharedPointer<Distance> distance;
+
+    QReadWriteLock galleriesLock;
+    QHash<QString, TemplateList> galleries;
+
+    QElapsedTimer uptime;
+    qint64 requests, rejected, batches;
+    QVector<double> latencies; // Ring buffer of the most recent latencies, in ms
+    int nextLatency;
+
+    void work()
+    {
+        // Each worker projects through its own copy of any transform with per-thread state
+        Transform *copy = NULL;
+        bool ownsCopy = false;
+
+        QMutexLocker locker(&mutex);
+        while (!stopping) {
+            if (queue.isEmpty()) {
+                pending.wait(&mutex);
+                continue;
+            }
+
+            // Give concurrent requests a chance to join the batch
+            QElapsedTimer window;
+            window.start();
+            while ((queue.size() < MaxBatchSize) && (window.elapsed() < BatchWindow) && !stopping)
+                pending.wait(&mutex, BatchWindow - window.elapsed());
+
+            const QList<Request*> batch = queue.mid(0, MaxBatchSize);
+            queue = queue.mid(batch.size());
+            Context::setMetric("br_search_queue_depth", queue.size());
+            if (batch.isEmpty())
+                continue; // Another worker took them
+            batches++;
+
+            locker.unlock();
+            if (!copy) {
+                QMutexLocker algorithmLocker(&algorithmLock);
+                if (transform.isNull()) {
+                    transform = QSharedPointer<Transform>(Transform::fromAlgorithm(Globals->algorithm));
+                    distance = Distance::fromAlgorithm(Globals->algorithm);
+                }
+                copy = transform->smartCopy(ownsCopy);
+            }
+            process(batch, copy);
+            locker.relock();
+
+            foreach (Request *request, batch)
+                request->done = true;
+            completed.wakeAll();
+        }
+
+        if (ownsCopy)
+            delete copy;
+    }
+
+    // Expects galleriesLock to be held for writing
+    TemplateList &gallery(const QString &name)
+    {
+        if (!galleries.contains(name)) {
+            TemplateList &templates = galleries[name];
+            if ((QStringList() << "gal" << "mem" << "template" << "ut" << "mmap" << "fgal" << "zgal" << "ivf").contains(QFileInfo(name).suffix()) && QFileInfo(name).exists()) {
+                templates = TemplateList::fromGallery(name);
+                packTemplates(templates);
+            }
+        }
+        return galleries[name];
+    }
+
+    void process(const QList<Request*> &batch, Transform *transform)
+    {
+        QList<Template> probes;
+        foreach (Request *request, batch) {
+            Template probe;
+            if (!request->probe.isEmpty()) probe = request->probe;
+            else                           transform->project(Template(request->image), probe);
+            probes.append(probe);
+        }
+
+        // Enrollments are applied before the searches in the same batch
+        QHash<QString, QList<int> > searches; // QHash<gallery,batch indices>
+        galleriesLock.lockForWrite();
+        for (int i=0; i<batch.size(); i++) {
+            if (batch[i]->search) {
+                searches[batch[i]->gallery].append(i);
+                gallery(batch[i]->gallery); // Loaded now, so searches only need to read
+            } else if (probes[i].isEmpty() || probes[i].file.fte) {
+                batch[i]->response = "{\"error\":\"failure to enroll\"}";
+            } else {
+                TemplateList &templates = gallery(batch[i]->gallery);
+                if (probes[i].file.name.isEmpty() || batch[i]->probe.isEmpty())
+                    probes[i].file.name = QString::number(templates.size());
+                templates.append(probes[i]);
+                QJsonObject json;
+                json["index"] = templates.size() - 1;
+                batch[i]->response = QJsonDocument(json).toJson();
+            }
+        }
+        galleriesLock.unlock();
+
+        // Searches by other workers proceed concurrently, enrollments wait for them
+        QReadLocker galleriesLocker(&galleriesLock);
+        foreach (const QString &name, searches.keys()) {
+            const TemplateList &targets = galleries[name];
+            const QList<int> &indices = searches[name];
+            TemplateList queries;
+            foreach (int i, indices)
+                queries.append(probes[i]);
+
+            if (targets.isEmpty()) {
+                foreach (int i, indices)
+                    batch[i]->response = "{\"results\":[]}";
+                continue;
+            }
+
+            QScopedPointer<MatrixOutput> output(MatrixOutput::make(targets.files(), queries.files()));
+            distance->compare(targets, queries, output.data());
+
+            for (int i=0; i<indices.size(); i++) {
+                const float *scores = output->data.ptr<float>(i);
+                QVector< QPair<float,int> > candidates(targets.size());
+                for (int j=0; j<targets.size(); j++)
+                    candidates[j] = QPair<float,int>(-scores[j], j); // Negated so the best scores sort first
+                const int k = std::min(std::max(batch[indices[i]]->k, 1), targets.size());
+                std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end());
+
+                QJsonArray results;
+                for (int j=0; j<k; j++) {
+                    QJsonObject result;
+                    result["index"] = candidates[j].second;
+                    result["name"] = targets[candidates[j].second].file.name;
+                    result["score"] = -candidates[j].first;
+                    results.append(result);
+                }
+                QJsonObject json;
+                json["results"] = results;
+                json["size"] = targets.size(); // Indices refer to the gallery at this size
+                batch[indices[i]]->response = QJsonDocument(json).toJson();
+            }
+        }
+    }
+};
+
+static void reply(struct mg_connection *conn, const QByteArray &content, const char *status = "200 OK", const char *headers = "", const char *type = "application/json")
+{
+    mg_printf(conn,
+              "HTTP/1.1 %s\r\n"
+              "Content-Type: %s\r\n"
+              "Content-Length: %d\r\n" // Always set Content-Length, so the connection can be kept alive
+              "%s"
+              "\r\n",
+              status, type, content.size(), headers);
+    mg_write(conn, content.data(), content.size());
 }
 
 /*!
  * \ingroup initializers
  * \brief Initialize mongoose server
+ *
+ * Serves the current algorithm on port 8080, keep the process resident with -daemon.
+ * - POST /enroll?gallery=<gallery> with an encoded image appends it to the gallery.
+ * - POST /search?gallery=<gallery>&k=<k> with an encoded image returns the k best matches.
+ * - Adding template=true to either takes a template already enrolled by the same algorithm, serialized with QDataStream, instead of an image.
+ * - GET /gallery?gallery=<gallery> returns the size and template names of the gallery.
+ * - GET /stats returns the request, rejection and queue counts, throughput and p50/p99 latency.
+ * - GET /metrics returns Context::metrics() for Prometheus to scrape: templates processed, failures to enroll,
+ *   comparisons, stream frames in flight and their latency, and the queue depth and latency of this service.
+ * Galleries are loaded when first referenced, and enrolled templates are kept in memory.
+ * Connections are kept alive, and requests are answered with 503 when the queue is full.
+ * Request bodies larger than 64 MB are answered with 413 before they are read.
  * \author Unknown \cite Unknown
  */
 class MongooseInitializer : public Initializer
@@ -39,11 +338,94 @@ class MongooseInitializer : public Initializer
 
     static struct mg_context *ctx;
     static struct mg_callbacks callbacks;
+    static SearchService *service;
+
+    static const int MaxRequestBytes = 64 << 20;
+
+    // This function will be called by mongoose on every new request, from its own worker thread.
+    static int begin_request_handler(struct mg_connection *conn)
+    {
+        const struct mg_request_info *request_info = mg_get_request_info(conn);
+        const QString uri = request_info->uri;
+        const QUrlQuery query(QString(request_info->query_string ? request_info->query_string : ""));
+
+        if (uri == "/stats") {
+            reply(conn, service->stats());
+            return 1;
+        }
+
+        if (uri == "/metrics") {
+            reply(conn, Context::metrics().toUtf8(), "200 OK", "", "text/plain; version=0.0.4");
+            return 1;
+        }
+
+        if (uri == "/gallery") {
+            reply(conn, service->describe(query.queryItemValue("gallery")));
+            return 1;
+        }
+
+        if (((uri != "/enroll") && (uri != "/search")) || strcmp(request_info->request_method, "POST")) {
+            reply(conn, "{\"error\":\"unknown request\"}", "404 Not Found");
+            return 1;
+        }
+
+        // The client sets Content-Length, so it is bounded before anything is allocated for the body
+        const char *contentLength = mg_get_header(conn, "Content-Length");
+        bool ok = true;
+        const qint64 length = contentLength ? QByteArray(contentLength).trimmed().toLongLong(&ok) : 0;
+        // The unread body would be taken for the next request, so the connection is closed
+        if (!ok || (length < 0)) {
+            reply(conn, "{\"error\":\"invalid Content-Length\"}", "400 Bad Request", "Connection: close\r\n");
+            return 1;
+        }
+        if (length > MaxRequestBytes) {
+            reply(conn, "{\"error\":\"request too large\"}", "413 Payload Too Large", "Connection: close\r\n");
+            return 1;
+        }
+        QByteArray body(int(length), 0);
+        int read = 0;
+        while (read < body.size()) {
+            const int bytes = mg_read(conn, body.data() + read, body.size() - read);
+            if (bytes <= 0) break;
+            read += bytes;
+        }
+
+        SearchService::Request request;
+        request.search = (uri == "/search");
+        request.gallery = query.queryItemValue("gallery");
+        request.k = query.hasQueryItem("k") ? query.queryItemValue("k").toInt() : 10;
+        if (query.queryItemValue("template") == "true") {
+            QDataStream stream(body.left(read));
+            stream >> request.probe;
+            if ((stream.status() != QDataStream::Ok) || request.probe.isEmpty()) {
+                reply(conn, "{\"error\":\"unable to read template\"}", "400 Bad Request");
+                return 1;
+            }
+        } else {
+            request.image = cv::imdecode(cv::Mat(1, read, CV_8UC1, body.data()), 1);
+            if (!request.image.data) {
+                reply(conn, "{\"error\":\"unable to decode image\"}", "400 Bad Request");
+                return 1;
+            }
+        }
+
+        if (service->submit(request))
+            reply(conn, request.response);
+        else
+            reply(conn, "{\"error\":\"overloaded\"}", "503 Service Unavailable", "Retry-After: 1\r\n");
+
+        // Returning non-zero tells mongoose that our function has replied to
+        // the client, and mongoose should not send client any more data.
+        return 1;
+    }
 
     void initialize() const
     {
+        service = new SearchService();
+        service->start();
+
         // List of options. Last element must be NULL.
-        const char *options[] = { "listening_ports", "8080", NULL };
+        const char *options[] = { "listening_ports", "8080", "enable_keep_alive", "yes", NULL };
 
         // Prepare callbacks structure. We have only one callback, the rest are NULL.
         memset(&callbacks, 0, sizeof(callbacks));
@@ -55,13 +437,17 @@ class MongooseInitializer : public Initializer
 
     void finalize() const
     {
-        // Stop the server.
+        // Stop the server before the service it forwards requests to.
         mg_stop(ctx);
+        service->stop();
+        service->wait();
+        delete service;
     }
 };
 
 struct mg_context *MongooseInitializer::ctx;
 struct mg_callbacks MongooseInitializer::callbacks;
+SearchService *MongooseInitializer::service;
 
 BR_REGISTER(Initializer, MongooseInitializer)
 
@@ -0,0 +1,57 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Scales rects and points back to the full resolution of an image decoded at a reduced resolution by Read or Decode.
+ * \author Unknown \cite unknown
+ */
+class OriginalScaleTransform : public UntrainableMetadataTransform
+{
+    Q_OBJECT
+
+    void projectMetadata(const File &src, File &dst) const
+    {
+        dst = src;
+        if (!src.contains("DecodeScale"))
+            return;
+
+        const float scale = src.get<float>("DecodeScale");
+        QList<QRectF> rects = src.rects();
+        for (int i=0; i<rects.size(); i++)
+            rects[i] = QRectF(rects[i].topLeft() * scale, rects[i].bottomRight() * scale);
+        dst.setRects(rects);
+
+        QList<QPointF> points = src.points();
+        for (int i=0; i<points.size(); i++)
+            points[i] = points[i] * scale;
+        dst.setPoints(points);
+
+        dst.remove("DecodeScale");
+    }
+};
+
+BR_REGISTER(Transform, OriginalScaleTransform)
+
+} // namespace br
+
+#include "metadata/originalscale.moc"
@@ -0,0 +1,348 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QElapsedTimer>
+#include <QThreadStorage>
+#include <algorithm>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+struct ProfileNode
+{
+    qint64 calls, inclusive, exclusive; // Nanoseconds
+
+    ProfileNode() : calls(0), inclusive(0), exclusive(0) {}
+};
+
+struct ProfileEvent
+{
+    QString path;
+    int thread;
+    qint64 begin, duration;
+};
+
+// Collected from every thread under profileLock, written by ProfileInitializer::finalize()
+static QMutex profileLock;
+static QHash<QString, ProfileNode> profileNodes;
+static QList<ProfileEvent> profileEvents;
+static QElapsedTimer profileClock;
+static bool profileTracing = false;
+static const int MaxProfileEvents = 1 << 20;
+
+// Time spent in instrumented callees of each active call on this thread, innermost last
+static QThreadStorage< QVector<qint64> > calleeTimes;
+static QThreadStorage<int> profileThreads;
+static QAtomicInt profileThreadCount;
+
+// Times one call of an instrumented transform, excluding the instrumented transforms it calls on the same thread
+class ProfileScope
+{
+    const QString &path;
+    const qint64 begin;
+
+public:
+    explicit ProfileScope(const QString &path_)
+        : path(path_), begin(profileClock.nsecsElapsed())
+    {
+        calleeTimes.localData().append(0);
+    }
+
+    ~ProfileScope()
+    {
+        const qint64 duration = profileClock.nsecsElapsed() - begin;
+        QVector<qint64> &callees = calleeTimes.localData();
+        const qint64 exclusive = duration - callees.last();
+        callees.removeLast();
+        if (!callees.isEmpty())
+            callees.last() += duration;
+
+        if (!profileThreads.hasLocalData())
+            profileThreads.setLocalData(profileThreadCount.fetchAndAddRelaxed(1) + 1);
+
+        QMutexLocker locker(&profileLock);
+        ProfileNode &node = profileNodes[path];
+        node.calls++;
+        node.inclusive += duration;
+        node.exclusive += exclusive;
+
+        if (profileTracing && (profileEvents.size() < MaxProfileEvents)) {
+            ProfileEvent event;
+            event.path = path;
+            event.thread = profileThreads.localData();
+            event.begin = begin;
+            event.duration = duration;
+            profileEvents.append(event);
+        }
+    }
+};
+
+/*!
+ * \ingroup transforms
+ * \brief Times each project and train call of a transform for Context::profile.
+ *
+ * Made by Transform::make around every transform that isn't a composite or wrapper transform while profiling is enabled,
+ * so unlike StopWatchTransform it doesn't appear in algorithm descriptions.
+ * Calls are aggregated by the path of the transform through the algorithm tree.
+ *
+ * \author Unknown \cite unknown
+ * \br_property br::Transform* transform The instrumented transform.
+ */
+class ProfileTransform : public MetaTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform STORED false)
+    BR_PROPERTY(br::Transform*, transform, NULL)
+
+    // Resolved from the parents of this transform the first time it is called, they aren't set when it is made
+    mutable QMutex pathLock;
+    mutable QAtomicInt resolved;
+    mutable QString projectPath, trainPath;
+
+    QString description(bool expanded) const
+    {
+        return transform->description(expanded);
+    }
+
+    bool setPropertyRecursive(const QString &name, QVariant value)
+    {
+        return transform->setPropertyRecursive(name, value);
+    }
+
+    void init()
+    {
+        if (transform == NULL)
+            return;
+
+        transform->setParent(this);
+        file = transform->file;
+        independent = transform->independent;
+        trainable = transform->trainable;
+        setObjectName(transform->objectName());
+    }
+
+    const QString &path(bool training) const
+    {
+        if (!resolved.loadAcquire()) {
+            QMutexLocker locker(&pathLock);
+            if (!resolved.load()) {
+                QStringList frames(objectName());
+                for (const QObject *ancestor = parent(); ancestor && ancestor->inherits("br::Transform"); ancestor = ancestor->parent())
+                    if (!ancestor->inherits("br::IndependentTransform") && !ancestor->inherits("br::ProfileTransform"))
+                        frames.prepend(ancestor->objectName());
+                setPath(frames.join(";"));
+            }
+        }
+        return training ? trainPath : projectPath;
+    }
+
+    void setPath(const QString &frames) const
+    {
+        projectPath = "project;" + frames;
+        trainPath = "train;" + frames;
+        resolved.storeRelease(1);
+    }
+
+    // Copies keep the path of this transform, as Transform::clone() leaves them without parents
+    ProfileTransform *wrap(Transform *copy) const
+    {
+        ProfileTransform *profile = new ProfileTransform();
+        profile->transform = copy;
+        profile->init();
+        const QString &frames = path(false);
+        profile->setPath(frames.mid(frames.indexOf(';') + 1));
+        return profile;
+    }
+
+    Transform *clone() const
+    {
+        return wrap(transform->clone());
+    }
+
+    Transform *smartCopy(bool &newTransform)
+    {
+        Transform *copy = transform->smartCopy(newTransform);
+        return newTransform ? wrap(copy) : this;
+    }
+
+    Transform *simplify(bool &newTransform)
+    {
+        Transform *temp = transform->simplify(newTransform);
+        if (temp == transform) {
+            newTransform = false;
+            return this;
+        }
+        if (!temp || temp->inherits("br::CompositeTransform") || temp->inherits("br::WrapperTransform"))
+            return temp;
+        newTransform = true;
+        return wrap(temp);
+    }
+
+    bool timeVarying() const { return transform->timeVarying(); }
+
+    void train(const TemplateList &data)
+    {
+        ProfileScope scope(path(true));
+        transform->train(data);
+    }
+
+    void train(const QList<TemplateList> &data)
+    {
+        ProfileScope scope(path(true));
+        transform->train(data);
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        ProfileScope scope(path(false));
+        transform->project(src, dst);
+    }
+
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        ProfileScope scope(path(false));
+        transform->project(src, dst);
+    }
+
+    void projectInPlace(Template &srcdst) const
+    {
+        ProfileScope scope(path(false));
+        transform->projectInPlace(srcdst);
+    }
+
+    void projectInPlace(TemplateList &srcdst) const
+    {
+        ProfileScope scope(path(false));
+        transform->projectInPlace(srcdst);
+    }
+
+    void projectUpdate(const Template &src, Template &dst)
+    {
+        ProfileScope scope(path(false));
+        transform->projectUpdate(src, dst);
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        ProfileScope scope(path(false));
+        transform->projectUpdate(src, dst);
+    }
+
+    void finalize(TemplateList &output)
+    {
+        transform->finalize(output);
+    }
+
+    void store(QDataStream &stream) const
+    {
+        transform->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        transform->load(stream);
+    }
+};
+
+BR_REGISTER(Transform, ProfileTransform)
+
+Transform *profiled(Transform *transform)
+{
+    if (transform->inherits("br::CompositeTransform") || transform->inherits("br::WrapperTransform"))
+        return transform;
+
+    File profile(".Profile");
+    profile.set("transform", qVariantFromValue<void*>(transform));
+    return Factory<Transform>::make(profile);
+}
+
+/*!
+ * \ingroup initializers
+ * \brief Writes the times collected for Context::profile when the context is finalized.
+ *
+ * Paths ending in .json get a Chrome trace of up to 2^20 calls, viewable in chrome://tracing.
+ * Other paths get collapsed stacks of exclusive microseconds, one line per path, for flamegraph.pl and compatible tools.
+ * Exclusive time only subtracts callees on the same thread, so transforms that parallelize their children
+ * are charged for waiting on them.
+ *
+ * \author Unknown \cite unknown
+ */
+class ProfileInitializer : public Initializer
+{
+    Q_OBJECT
+
+    void initialize() const
+    {
+        profileClock.start();
+        profileTracing = Globals->profile.endsWith(".json");
+    }
+
+    QStringList plugins() const
+    {
+        return QStringList() << "Profile";
+    }
+
+    void finalize() const
+    {
+        QMutexLocker locker(&profileLock);
+        if (!profileNodes.isEmpty() && !Globals->profile.isEmpty()) {
+            if (profileTracing) {
+                QStringList events;
+                foreach (const ProfileEvent &event, profileEvents) {
+                    const QStringList frames = event.path.split(';');
+                    events.append(QString("{\"name\":\"%1\",\"cat\":\"%2\",\"ph\":\"X\",\"pid\":1,\"tid\":%3,\"ts\":%4,\"dur\":%5,\"args\":{\"path\":\"%6\"}}")
+                                  .arg(frames.last(), frames.first(), QString::number(event.thread),
+                                       QString::number(event.begin / 1000.0, 'f', 3), QString::number(event.duration / 1000.0, 'f', 3), event.path));
+                }
+                if (profileEvents.size() == MaxProfileEvents)
+                    qWarning("Profile trace truncated to the first %d calls.", MaxProfileEvents);
+                QtUtils::writeFile(Globals->profile, "{\"traceEvents\":[\n" + events.join(",\n") + "\n]}");
+            } else {
+                QStringList stacks;
+                for (QHash<QString, ProfileNode>::const_iterator i = profileNodes.constBegin(); i != profileNodes.constEnd(); ++i)
+                    stacks.append(i.key() + " " + QString::number(i.value().exclusive / 1000));
+                std::sort(stacks.begin(), stacks.end());
+                QtUtils::writeFile(Globals->profile, stacks);
+            }
+
+            QList< QPair<qint64, QString> > order;
+            for (QHash<QString, ProfileNode>::const_iterator i = profileNodes.constBegin(); i != profileNodes.constEnd(); ++i)
+                order.append(QPair<qint64, QString>(-i.value().exclusive, i.key()));
+            std::sort(order.begin(), order.end());
+
+            QStringList lines;
+            lines.append("Path\tCalls\tInclusive (ms)\tExclusive (ms)");
+            for (int i=0; i<order.size(); i++) {
+                const ProfileNode &node = profileNodes[order[i].second];
+                lines.append(QString("%1\t%2\t%3\t%4").arg(order[i].second, QString::number(node.calls),
+                                                           QString::number(node.inclusive / 1e6, 'f', 3), QString::number(node.exclusive / 1e6, 'f', 3)));
+            }
+            qDebug("\nProfile\n%s\n", qPrintable(lines.join("\n")));
+        }
+        profileNodes.clear();
+        profileEvents.clear();
+    }
+};
+
+BR_REGISTER(Initializer, ProfileInitializer)
+
+} // namespace br
+
+#include "metadata/profile.moc"
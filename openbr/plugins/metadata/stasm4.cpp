@@ -1,4 +1,5 @@
 #include <QString>
+#include <QtConcurrent>
 #include <stasm_lib.h>
 #include <stasmcascadeclassifier.h>
 #include <opencv2/opencv.hpp>
@@ -14,16 +15,32 @@ using namespace cv;
 namespace br
 {
 
-class StasmResourceMaker : public ResourceMaker<StasmCascadeClassifier>
+// The cascades are parsed once per process, each thread searches with its own copies.
+class StasmResourceMaker : public SharedResourceMaker<StasmCascadeClassifier>
 {
+public:
+    StasmResourceMaker()
+        : SharedResourceMaker<StasmCascadeClassifier>(Globals->sdkPath + "/share/openbr/models/")
+    {}
+
 private:
-    StasmCascadeClassifier *make() const
+    StasmCascadeClassifier *load() const
     {
         StasmCascadeClassifier *stasmCascade = new StasmCascadeClassifier();
         if (!stasmCascade->load(Globals->sdkPath.toStdString() + "/share/openbr/models/"))
             qFatal("Failed to load Stasm Cascade");
         return stasmCascade;
     }
+
+    StasmCascadeClassifier *instantiate(const StasmCascadeClassifier &model) const
+    {
+        StasmCascadeClassifier *stasmCascade = new StasmCascadeClassifier();
+        OpenCVUtils::copyCascade(model.faceCascade, stasmCascade->faceCascade);
+        OpenCVUtils::copyCascade(model.mouthCascade, stasmCascade->mouthCascade);
+        OpenCVUtils::copyCascade(model.leftEyeCascade, stasmCascade->leftEyeCascade);
+        OpenCVUtils::copyCascade(model.rightEyeCascade, stasmCascade->rightEyeCascade);
+        return stasmCascade;
+    }
 };
 
 /*!
@@ -54,6 +71,13 @@ BR_REGISTER(Initializer, StasmInitializer)
 /*!
  * \ingroup transforms
  * \brief Wraps STASM key point detector
+ *
+ * With useRects the faces are taken from the template's rects, for example found upstream by Cascade(FrontalFace),
+ * and Stasm's own face detector is skipped. Each face is searched in parallel with a per-thread copy of the
+ * eye and mouth cascades from the resource pool, and its landmarks are appended in rect order.
+ * Templates without rects fall back to Stasm's face detector.
+ *
+ * \br_property bool useRects Search the faces in the template's rects rather than detecting them.
  * \author Scott Klum \cite sklum
  */
 class StasmTransform : public UntrainableTransform
@@ -68,6 +92,8 @@ class StasmTransform : public UntrainableTransform
     BR_PROPERTY(QList<float>, pinPoints, QList<float>())
     Q_PROPERTY(QStringList pinLabels READ get_pinLabels WRITE set_pinLabels RESET reset_pinLabels STORED false)
     BR_PROPERTY(QStringList, pinLabels, QStringList())
+    Q_PROPERTY(bool useRects READ get_useRects WRITE set_useRects RESET reset_useRects STORED false)
+    BR_PROPERTY(bool, useRects, false)
 
     Resource<StasmCascadeClassifier> stasmCascadeResource;
 
@@ -75,6 +101,15 @@ class StasmTransform : public UntrainableTransform
     {
         if (!stasm_init(qPrintable(Globals->sdkPath + "/share/openbr/models/stasm"), 0)) qFatal("Failed to initalize stasm.");
         stasmCascadeResource.setResourceMaker(new StasmResourceMaker());
+        stasmCascadeResource.setMaxResources(0);
+    }
+
+    void searchRect(const Mat *stasmSrc, Rect rect, float *landmarks, int *foundFace) const
+    {
+        StasmCascadeClassifier *stasmCascade = stasmCascadeResource.acquire();
+        stasm_search_rect(foundFace, landmarks, reinterpret_cast<const char*>(stasmSrc->data), stasmSrc->cols, stasmSrc->rows,
+                          rect.x, rect.y, rect.width, rect.height, *stasmCascade);
+        stasmCascadeResource.release(stasmCascade);
     }
 
     void project(const Template &src, Template &dst) const
@@ -89,9 +124,14 @@ class StasmTransform : public UntrainableTransform
             qFatal("Stasm expects continuous matrix data.");
         dst = src;
 
-        int foundFace = 0;
         int nLandmarks = stasm_NLANDMARKS;
-        float landmarks[2 * stasm_NLANDMARKS];
+        const QList<Rect> rects = OpenCVUtils::toRects(src.file.rects());
+        const bool fromRects = useRects && !rects.isEmpty();
+        const int faces = fromRects ? rects.size() : 1;
+        QVector<int> foundFaces(faces, 0);
+        QVector<float> faceLandmarks(faces * 2 * stasm_NLANDMARKS);
+        int &foundFace = foundFaces[0];
+        float *landmarks = faceLandmarks.data();
 
         bool searchPinned = false;
 
@@ -126,9 +166,16 @@ class StasmTransform : public UntrainableTransform
 
             // The ASM in Stasm is guaranteed to converge in this case
             foundFace = 1;
+        } else if (fromRects) {
+            // Faces were found upstream, search each on its own thread
+            QFutureSynchronizer<void> futures;
+            for (int i=0; i<faces; i++)
+                futures.addFuture(QtConcurrent::run(this, &StasmTransform::searchRect, (const Mat*)&stasmSrc, rects[i],
+                                                    faceLandmarks.data() + i*2*stasm_NLANDMARKS, foundFaces.data() + i));
+            futures.waitForFinished();
         }
 
-        if (!foundFace) {
+        if (!foundFace && !fromRects) {
             StasmCascadeClassifier *stasmCascade = stasmCascadeResource.acquire();
             stasm_search_single(&foundFace, landmarks, reinterpret_cast<const char*>(stasmSrc.data), stasmSrc.cols, stasmSrc.rows, *stasmCascade, NULL, NULL);
             stasmCascadeResource.release(stasmCascade);
@@ -136,7 +183,8 @@ class StasmTransform : public UntrainableTransform
 
         if (stasm3Format) {
             nLandmarks = 76;
-            stasm_convert_shape(landmarks, nLandmarks);
+            for (int i=0; i<faces; i++)
+                stasm_convert_shape(faceLandmarks.data() + i*2*stasm_NLANDMARKS, nLandmarks);
         }
 
         // For convenience, if these are the only points/rects we want to deal with as the algorithm progresses
@@ -145,19 +193,28 @@ class StasmTransform : public UntrainableTransform
             dst.file.clearRects();
         }
 
-        if (!foundFace) {
-            if (Globals->verbose) qWarning("No face found in %s.", qPrintable(src.file.fileName()));
-            dst.file.fte = true;
-        } else {
+        bool labeled = false;
+        for (int face = 0; face < faces; face++) {
+            if (!foundFaces[face]) continue;
+            const float *faceLandmark = faceLandmarks.data() + face*2*stasm_NLANDMARKS;
             QList<QPointF> points;
             for (int i = 0; i < nLandmarks; i++) {
-                QPointF point(landmarks[2 * i], landmarks[2 * i + 1]);
+                QPointF point(faceLandmark[2 * i], faceLandmark[2 * i + 1]);
                 points.append(point);
             }
-            dst.file.set("StasmRightEye", points[38]);
-            dst.file.set("StasmLeftEye", points[39]);
+            // Eyes of the first face found
+            if (!labeled) {
+                dst.file.set("StasmRightEye", points[38]);
+                dst.file.set("StasmLeftEye", points[39]);
+                labeled = true;
+            }
             dst.file.appendPoints(points);
         }
+
+        if (!labeled) {
+            if (Globals->verbose) qWarning("No face found in %s.", qPrintable(src.file.fileName()));
+            dst.file.fte = true;
+        }
     }
 };
 
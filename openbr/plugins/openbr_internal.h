@@ -2,6 +2,7 @@
 #define OPENBR_INTERNAL_H
 
 #include "openbr/openbr_plugin.h"
+#include "openbr/core/arena.h"
 #include "openbr/core/resource.h"
 
 namespace br
@@ -21,6 +22,73 @@ private:
     void load(QDataStream &stream) { (void) stream; }
 };
 
+// True if the matrices of t are referenced by nothing but t, so they can be overwritten in place
+inline bool isExclusive(const Template &t)
+{
+    if (!t.isDetached())
+        return false;
+    foreach (const cv::Mat &m, t)
+        if (!m.refcount || (*m.refcount != 1))
+            return false;
+    return true;
+}
+
+/*!
+ * \brief An untrainable transform of each matrix on its own, which PipeTransform::simplify can fuse with its neighbours.
+ *
+ * apply() must give the same result when src and dst share their data, so fused transforms can run in place.
+ */
+class BR_EXPORT PointwiseTransform : public UntrainableTransform
+{
+    Q_OBJECT
+
+public:
+    virtual void apply(const cv::Mat &src, cv::Mat &dst) const = 0;
+
+    // Rewrites the Likely expressions for each channel of an element of the given depth into those of this step's output.
+    // Returns false if the step can't be lowered, leaving the arguments unspecified, see PointwiseCompiler.
+    virtual bool lower(QStringList &channels, int &depth) const { (void) channels; (void) depth; return false; }
+
+    void projectInPlace(Template &srcdst) const
+    {
+        if ((srcdst.size() == 1) && isExclusive(srcdst)) apply(srcdst.m(), srcdst.m());
+        else                                             Transform::projectInPlace(srcdst);
+    }
+
+    void projectInPlace(TemplateList &srcdst) const { projectEachInPlace(srcdst); }
+
+private:
+    void project(const Template &src, Template &dst) const
+    {
+        cv::Mat &out = dst.m();
+        if (!out.data && (&src != &dst)) out = Arena::mat();
+        apply(src.m(), out);
+    }
+};
+
+// A Pipe-parseable description of a run of fused steps, so the run can be rebuilt with every step's arguments
+inline QString describeSteps(const QList<const PointwiseTransform*> &steps, bool expanded)
+{
+    QStringList descriptions;
+    foreach (const PointwiseTransform *step, steps)
+        descriptions.append(step->description(expanded));
+    return "(" + descriptions.join("+") + ")";
+}
+
+/*!
+ * \brief Compiles runs of PointwiseTransforms that PipeTransform::simplify would otherwise fuse, see Context::jit.
+ *
+ * Installed by the Initializer of a JIT backend, plugins/core/likely.cpp when built with Likely.
+ */
+class BR_EXPORT PointwiseCompiler
+{
+public:
+    virtual ~PointwiseCompiler() {}
+    virtual Transform *compile(const QList<const PointwiseTransform*> &steps) const = 0; // NULL if the steps can't be compiled
+
+    static PointwiseCompiler *instance; // NULL without a backend
+};
+
 class BR_EXPORT MetaTransform : public Transform
 {
     Q_OBJECT
@@ -391,6 +459,15 @@ public:
         projectMetadata(src.file, dst.file);
     }
 
+    // Only the metadata changes, so the matrices are left where they are
+    void projectInPlace(Template &srcdst) const
+    {
+        const File src = srcdst.file;
+        projectMetadata(src, srcdst.file);
+    }
+
+    void projectInPlace(TemplateList &srcdst) const { projectEachInPlace(srcdst); }
+
 protected:
     MetadataTransform(bool trainable = true) : Transform(false,trainable) {}
 };
@@ -424,6 +501,87 @@ public:
 
 void applyAdditionalProperties(const File &temp, Transform *target);
 
+// Implemented in plugins/core/stream.cpp
+// The most recent per-stage statistics of each stream as CSV, see Context::streamStats
+QString streamStatistics();
+
+// The clock streams stamp templates with as they are read, in ns, see "StreamEnter" in ProgressCounterTransform
+qint64 streamTime();
+
+// Run job on the executor shared by the streams whose parent is owner, see DistributeTemplateTransform.
+// Jobs must not wait on other stream jobs, since they may occupy every thread of the executor.
+void startStreamJob(QObject *owner, QRunnable *job);
+
+// Implemented in plugins/gui/renderoverlay.cpp
+// Draw transforms with overlay set record their primitives in the "Overlay" metadata of the template instead of drawing.
+// renderOverlay() rasterizes and removes them, so a chain of draw steps shares a single copy of the image, see RenderOverlayTransform.
+void overlayCircle(File &file, const cv::Point2f &center, int radius, const cv::Scalar &color, int thickness);
+void overlayLine(File &file, const cv::Point2f &a, const cv::Point2f &b, const cv::Scalar &color, int thickness = 1, int lineType = 8);
+void overlayRectangle(File &file, const cv::Rect &rect, const cv::Scalar &color, int thickness);
+void overlayText(File &file, const QString &text, const cv::Point2f &origin, double scale, const cv::Scalar &color, int thickness);
+void renderOverlay(File &file, cv::Mat &m);
+
+// Implemented in plugins/io/read.cpp
+// Decodes an image, JPEGs at the largest DCT scaling of 1/2, 1/4 or 1/8 keeping their shorter side at least reducedSize pixels.
+// Only IMREAD_COLOR, IMREAD_GRAYSCALE and IMREAD_UNCHANGED decodes are reduced. The reduction applied is returned in scale.
+cv::Mat decodeReduced(const cv::Mat &encoded, int flags, int reducedSize, int *scale);
+// Scales rects and points to an image decoded with the given reduction and records it as DecodeScale
+void setDecodeScale(File &file, int scale);
+
+// Implemented in plugins/io/download.cpp
+// Starts fetching an http(s) URL in the background so a later Download of it doesn't wait on the network.
+void prefetch(const QString &url);
+
+// Requests url through the same pool if it hasn't been, returning true with its data, or error, once it has finished.
+// Never blocks, unlike prefetch() requests are never dropped.
+bool pollFetch(const QString &url, QByteArray &data, QString &error);
+void setFetchRate(double requestsPerSecond); // Zero removes the limit
+
+// Implemented in plugins/output/topk.cpp
+// The k best targets of each query, best first, written to indices and scores as row-major queries.size() x k arrays.
+// Computed through the parallel Distance::compare keeping only O(k) candidates per query. Missing candidates get index -1.
+void searchTopK(const Distance *distance, const TemplateList &targets, const TemplateList &queries, int k, int *indices, float *scores);
+
+// Implemented in plugins/distance/filter.cpp
+// True if the metadata has one of the values listed for every key of Globals->filters.
+bool matchesFilters(const File &file);
+
+// Implemented in plugins/gallery/mmap.cpp
+// A read-only mapping of an entire file kept open until the process exits or the file is unmapped, so matrices
+// read from it can point straight into the mapping. Returns NULL on failure.
+const uchar *mapFile(const QString &fileName, qint64 *size);
+void unmapFile(const QString &fileName); // Call before overwriting a mapped file
+
+// Implemented in plugins/gallery/shards.cpp
+// Compares the queries against a shardsGallery by scattering them to the search services holding its shards.
+void compareShards(const File &targetGallery, const File &queryGallery, const File &output);
+
+// Implemented in plugins/core/pipe.cpp
+// Training checkpoint of a child of a composite transform, see Context::checkpoint.
+// Keyed by the composite transform's description, the index of the child and the names of the training templates.
+// Returns an empty string if checkpointing is disabled.
+QString checkpointFile(const Transform *composite, int child, const QList<TemplateList> &data);
+
+// Copies the matrices of uniformly sized single matrix templates into one contiguous buffer with a fixed,
+// 16-byte aligned row stride, leaving each template with a view into it. Templates without matrices are skipped.
+// Returns false and leaves the templates untouched if they are not uniform.
+bool packTemplates(TemplateList &templates);
+
+// The parallelism of the calling thread, Globals->parallelism unless the thread was given a budget of its own.
+// Algorithm handles set it on their threads so that each handle keeps to its own thread count.
+int threadParallelism();
+int setThreadParallelism(int parallelism); // Zero clears the budget, returns the previous one
+
+// Implemented in openbr_plugin.cpp
+// Distance::compare, but under Context::crossValidate only the pairs within a partition are scored, the others get -FLT_MAX.
+// Used where the scores are evaluated, training compares every pair.
+void comparePartitions(const Distance *distance, const TemplateList &target, const TemplateList &query, Output *output);
+
+// Implemented in plugins/metadata/profile.cpp
+// Wraps a transform made while Context::profile is set so its project and train calls are timed.
+// Composite and wrapper transforms are returned as is, their children are instrumented instead.
+Transform *profiled(Transform *transform);
+
 
 inline void splitFTEs(TemplateList &src, TemplateList  &ftes)
 {
@@ -454,6 +612,40 @@ private:
     void train(const TemplateList &data) { (void) data; }
 };
 
+/*!
+ * \brief A br::UntrainableDistance between single matrices that grows as it is computed, and can stop once it exceeds an upper bound.
+ *
+ * Derived classes implement compare(a, b, upper) and may return any distance greater than upper once the distance is known to exceed it.
+ */
+class BR_EXPORT BoundedDistance : public UntrainableDistance
+{
+    Q_OBJECT
+
+public:
+    float compare(const Template &a, const Template &b, float lower, float upper) const
+    {
+        (void) lower;
+        if ((a.size() != 1) || (b.size() != 1))
+            return Distance::compare(a, b);
+        return compare(a.m(), b.m(), upper);
+    }
+
+    float compare(const cv::Mat &a, const cv::Mat &b) const
+    {
+        return compare(a, b, std::numeric_limits<float>::max());
+    }
+
+private:
+    float compare(const cv::Mat &a, const cv::Mat &b, float upper) const
+    {
+        if (a.empty() || b.empty() || a.rows != b.rows || a.cols != b.cols || a.elemSize() != b.elemSize())
+            return -std::numeric_limits<float>::max();
+        return boundedCompare(a, b, upper);
+    }
+
+    virtual float boundedCompare(const cv::Mat &a, const cv::Mat &b, float upper) const = 0;
+};
+
 /*!
  * \brief A br::Distance that checks the elements of its list property to see if it needs to be trained.
  */
@@ -0,0 +1,62 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/arrow.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup outputs
+ * \brief Arrow IPC file output, the columnar equivalent of csvOutput.
+ *
+ * A UTF-8 File column of query names followed by one float column of scores per target, named after the target.
+ * \author Unknown \cite unknown
+ */
+class arrowOutput : public MatrixOutput
+{
+    Q_OBJECT
+
+    ~arrowOutput()
+    {
+        if (file.isNull() || targetFiles.isEmpty() || queryFiles.isEmpty()) return;
+
+        QList<Arrow::Column> columns;
+        columns.append(Arrow::Column("File", Arrow::Column::Utf8));
+        foreach (const File &query, queryFiles)
+            columns.last().append(query.name.toUtf8());
+
+        for (int j=0; j<targetFiles.size(); j++) {
+            Arrow::Column column(targetFiles[j].name, Arrow::Column::Float32);
+            column.values.reserve(queryFiles.size() * sizeof(float));
+            for (int i=0; i<queryFiles.size(); i++)
+                column.append(double(data.at<float>(i,j)));
+            columns.append(column);
+        }
+
+        QtUtils::touchDir(QFileInfo(file.name));
+        Arrow::write(file.name, columns);
+    }
+};
+
+BR_REGISTER(Output, arrowOutput)
+
+} // namespace br
+
+#include "output/arrow.moc"
@@ -14,32 +14,181 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/bee.h>
 #include <openbr/core/qtutils.h>
 
 namespace br
 {
 
+/*!
+ * \brief Writes completed score blocks into a BEE matrix from its own thread.
+ *
+ * A bounded queue lets comparisons run a few blocks ahead of the file system.
+ * Blocks spanning whole rows are contiguous in the file, consecutive ones are coalesced into large writes.
+ * Scores are encoded on this thread too.
+ */
+class MatrixWriter : public QThread
+{
+public:
+    MatrixWriter(const QString &fileName, qint64 _headerSize, int _columns, int _capacity, const BEE::SimmatEncoding &_encoding)
+        : headerSize(_headerSize), columns(_columns), capacity(std::max(_capacity, 1)), encoding(_encoding), elemSize(_encoding.elemSize()), finished(false), bufferOffset(0), clipped(0)
+    {
+        file.setFileName(fileName);
+        if (!file.open(QFile::ReadWrite))
+            qFatal("Unable to open %s for modifying.", qPrintable(fileName));
+        start();
+    }
+
+    // Blocks while the queue is full
+    void write(const cv::Mat &scores, int row, int column)
+    {
+        QMutexLocker locker(&mutex);
+        while (queue.size() >= capacity)
+            notFull.wait(&mutex);
+        Block block;
+        block.scores = scores;
+        block.row = row;
+        block.column = column;
+        queue.append(block);
+        notEmpty.wakeAll();
+    }
+
+    void finish()
+    {
+        QMutexLocker locker(&mutex);
+        finished = true;
+        notEmpty.wakeAll();
+        locker.unlock();
+        wait();
+    }
+
+private:
+    static const int FlushSize = 16 << 20;
+
+    struct Block
+    {
+        cv::Mat scores;
+        int row, column;
+    };
+
+    QFile file;
+    const qint64 headerSize;
+    const int columns, capacity;
+    const BEE::SimmatEncoding encoding;
+    const qint64 elemSize;
+    QMutex mutex;
+    QWaitCondition notEmpty, notFull;
+    QList<Block> queue;
+    bool finished;
+    QByteArray buffer;
+    qint64 bufferOffset;
+    qint64 clipped;
+
+    void run()
+    {
+        forever {
+            QMutexLocker locker(&mutex);
+            while (queue.isEmpty() && !finished)
+                notEmpty.wait(&mutex);
+            if (queue.isEmpty()) break;
+            Block block = queue.takeFirst();
+            notFull.wakeAll();
+            locker.unlock();
+
+            block.scores = encoding.encode(block.scores, &clipped);
+            const qint64 offset = headerSize + elemSize*(qint64(block.row)*columns + block.column);
+            const qint64 size = elemSize*block.scores.total();
+            if ((block.column == 0) && (block.scores.cols == columns) && block.scores.isContinuous()) {
+                if (!buffer.isEmpty() && ((bufferOffset + buffer.size() != offset) || (buffer.size() + size > FlushSize)))
+                    flush();
+                if (size >= FlushSize) {
+                    writeAt(offset, (const char*)block.scores.data, size);
+                } else {
+                    if (buffer.isEmpty()) bufferOffset = offset;
+                    buffer.append((const char*)block.scores.data, int(size));
+                }
+            } else {
+                flush();
+                for (int i=0; i<block.scores.rows; i++)
+                    writeAt(offset + elemSize*i*columns, (const char*)block.scores.ptr(i), elemSize*block.scores.cols);
+            }
+        }
+
+        flush();
+        file.close();
+        if (clipped > 0)
+            qWarning("%lld scores saturated writing %s.", clipped, qPrintable(file.fileName()));
+    }
+
+    void flush()
+    {
+        if (buffer.isEmpty()) return;
+        writeAt(bufferOffset, buffer.constData(), buffer.size());
+        buffer.clear();
+    }
+
+    void writeAt(qint64 offset, const char *data, qint64 size)
+    {
+        if (!file.seek(offset) || (file.write(data, size) != size))
+            qFatal("Failed to write %s.", qPrintable(file.fileName()));
+    }
+};
+
 /*!
  * \ingroup outputs
  * \brief simmat output.
+ *
+ * Completed blocks are written asynchronously by a MatrixWriter, so comparisons overlap file I/O.
+ * Scores can be stored in reduced precision, BEE::readMatrix and BEE::MatrixStream decode them when reading.
+ * \br_property QString targetGallery Target gallery name written to the header.
+ * \br_property QString queryGallery Query gallery name written to the header.
+ * \br_property int queueSize Number of completed blocks allowed to wait for the writer.
+ * \br_property enum precision Score storage, one of Float, Half, UInt16 or UInt8. Default is Float.
+ * \br_property float lower Lowest score representable by the UInt16 and UInt8 encodings, lower scores saturate. Default is 0.
+ * \br_property float upper Highest score representable by the UInt16 and UInt8 encodings, higher scores saturate. Default is 1.
  * \author Josh Klontz \cite jklontz
  */
 class mtxOutput : public Output
 {
     Q_OBJECT
+    Q_ENUMS(Precision)
 
     Q_PROPERTY(QString targetGallery READ get_targetGallery WRITE set_targetGallery RESET reset_targetGallery STORED false)
     Q_PROPERTY(QString queryGallery READ get_queryGallery WRITE set_queryGallery RESET reset_queryGallery STORED false)
+    Q_PROPERTY(int queueSize READ get_queueSize WRITE set_queueSize RESET reset_queueSize STORED false)
+    Q_PROPERTY(Precision precision READ get_precision WRITE set_precision RESET reset_precision STORED false)
+    Q_PROPERTY(float lower READ get_lower WRITE set_lower RESET reset_lower STORED false)
+    Q_PROPERTY(float upper READ get_upper WRITE set_upper RESET reset_upper STORED false)
+
+public:
+    /*!< */
+    enum Precision { Float,
+                     Half,
+                     UInt16,
+                     UInt8 };
+
+private:
     BR_PROPERTY(QString, targetGallery, "Unknown_Target")
     BR_PROPERTY(QString, queryGallery, "Unknown_Query")
+    BR_PROPERTY(int, queueSize, 2)
+    BR_PROPERTY(Precision, precision, Float)
+    BR_PROPERTY(float, lower, 0)
+    BR_PROPERTY(float, upper, 1)
 
-    int headerSize, rowBlock, columnBlock;
+    int rowBlock, columnBlock;
     cv::Mat blockScores;
+    QScopedPointer<MatrixWriter> writer;
 
     ~mtxOutput()
     {
+        if (writer.isNull()) return;
         writeBlock();
+        writer->finish();
     }
 
     void setBlock(int rowBlock, int columnBlock)
@@ -50,24 +199,18 @@ class mtxOutput : public Output
             QtUtils::touchDir(f);
             if (!f.open(QFile::WriteOnly))
                 qFatal("Unable to open %s for writing.", qPrintable(file));
-            const int endian = 0x12345678;
-            QByteArray header;
-            header.append("S2\n");
-            header.append(qPrintable(targetGallery));
-            header.append("\n");
-            header.append(qPrintable(queryGallery));
-            header.append("\nMF ");
-            header.append(qPrintable(QString::number(queryFiles.size())));
-            header.append(" ");
-            header.append(qPrintable(QString::number(targetFiles.size())));
-            header.append(" ");
-            header.append(QByteArray((const char*)&endian, 4));
-            header.append("\n");
-            headerSize = f.write(header);
-            const float defaultValue = -std::numeric_limits<float>::max();
-            for (int i=0; i<targetFiles.size()*queryFiles.size(); i++)
-                f.write((const char*)&defaultValue, 4);
+            const BEE::SimmatEncoding encoding = BEE::SimmatEncoding::fromRange(BEE::SimmatEncoding::Type(precision), lower, upper);
+            const qint64 headerSize = f.write(BEE::matrixHeader(queryFiles.size(), targetFiles.size(), false, targetGallery, queryGallery, encoding));
+
+            // Scores never set keep the default value
+            const cv::Mat defaultValues = encoding.encode(cv::Mat(1, 1 << 18, CV_32FC1, cv::Scalar(-std::numeric_limits<float>::max())));
+            for (qint64 remaining = qint64(targetFiles.size())*queryFiles.size(); remaining > 0; remaining -= defaultValues.cols) {
+                const qint64 count = std::min(remaining, qint64(defaultValues.cols));
+                f.write((const char*)defaultValues.data, count*encoding.elemSize());
+            }
             f.close();
+
+            writer.reset(new MatrixWriter(file, headerSize, targetFiles.size(), queueSize, encoding));
         } else {
             writeBlock();
         }
@@ -94,14 +237,8 @@ class mtxOutput : public Output
 
     void writeBlock()
     {
-        QFile f(file);
-        if (!f.open(QFile::ReadWrite))
-            qFatal("Unable to open %s for modifying.", qPrintable(file));
-        for (int i=0; i<blockScores.rows; i++) {
-            f.seek(headerSize + sizeof(float)*(quint64(rowBlock*this->blockRows+i)*targetFiles.size()+(columnBlock*this->blockCols)));
-            f.write((const char*)blockScores.row(i).data, sizeof(float)*blockScores.cols);
-        }
-        f.close();
+        // The next block is written into a new matrix, so the writer owns this one
+        writer->write(blockScores, rowBlock*this->blockRows, columnBlock*this->blockCols);
     }
 };
 
@@ -0,0 +1,250 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <QMutex>
+#include <QThreadStorage>
+#include <algorithm>
+#include <functional>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/bee.h>
+#include <openbr/core/eval.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup outputs
+ * \brief Evaluate scores as they are computed, without storing the similarity matrix.
+ *
+ * Genuine and impostor status is looked up from a BEE::ImplicitMask of the target and query labels.
+ * Each thread bins scores into its own genuine and impostor histograms over [minScore, maxScore],
+ * scores outside the range are counted in the first or last bin.
+ * If the range is left unset it is calibrated from the first scores received.
+ * Each query retains its best genuine score and highest scoring impostors,
+ * so search statistics and the CMC up to rank are exact.
+ * Writes the evalOutput CSV to the output file name with its suffix replaced by .csv.
+ * \br_property int bins Number of histogram bins.
+ * \br_property float minScore Lowest score binned, leave equal to maxScore to calibrate the range.
+ * \br_property float maxScore Highest score binned.
+ * \br_property int rank Number of impostors retained per query.
+ * \author Unknown \cite unknown
+ */
+class onlineEvalOutput : public Output
+{
+    Q_OBJECT
+    Q_PROPERTY(int bins READ get_bins WRITE set_bins RESET reset_bins STORED false)
+    Q_PROPERTY(float minScore READ get_minScore WRITE set_minScore RESET reset_minScore STORED false)
+    Q_PROPERTY(float maxScore READ get_maxScore WRITE set_maxScore RESET reset_maxScore STORED false)
+    Q_PROPERTY(int rank READ get_rank WRITE set_rank RESET reset_rank STORED false)
+    BR_PROPERTY(int, bins, 1 << 18)
+    BR_PROPERTY(float, minScore, 0)
+    BR_PROPERTY(float, maxScore, 0)
+    BR_PROPERTY(int, rank, 200)
+
+    static const int CalibrationSize = 1 << 16;
+    static const int NumLocks = 64;
+
+    struct Histograms
+    {
+        QVector<qint64> genuines, impostors;
+        qint64 nans;
+        Histograms(int bins) : genuines(bins, 0), impostors(bins, 0), nans(0) {}
+    };
+
+    struct Search
+    {
+        float bestGenuine;
+        bool genuine;
+        QVector<float> impostors; // Min-heap of the highest impostor scores
+        Search() : bestGenuine(-std::numeric_limits<float>::max()), genuine(false) {}
+    };
+
+    BEE::ImplicitMask mask;
+
+    QThreadStorage< QSharedPointer<Histograms> > localHistograms;
+    QList< QSharedPointer<Histograms> > histograms; // Every thread's histograms
+    QList< QPair<float,bool> > calibration; // QPair<score,genuine> received before the range is known
+    QAtomicInt calibrated;
+    float low;
+    double binWidth;
+    QMutex mutex;
+
+    QVector<Search> searches;
+    QVector<float> minimums; // Score an impostor must beat to affect its query, read without locking as a fast reject
+    QMutex locks[NumLocks];
+
+    ~onlineEvalOutput()
+    {
+        if (file.isNull() || searches.isEmpty()) return;
+        if (!calibrated.load()) calibrate();
+
+        Histograms total(bins);
+        foreach (const QSharedPointer<Histograms> &local, histograms) {
+            for (int i=0; i<bins; i++) {
+                total.genuines[i] += local->genuines[i];
+                total.impostors[i] += local->impostors[i];
+            }
+            total.nans += local->nans;
+            // Threads outliving this output release their histograms on exit
+            local->genuines.clear();
+            local->impostors.clear();
+        }
+        if (total.nans > 0) qWarning("Encountered %lld NaN scores!", total.nans);
+
+        QList<float> genuineSearches, impostorSearches;
+        QVector<int> firstGenuineReturns(searches.size(), 0);
+        for (int i=0; i<searches.size(); i++) {
+            const Search &search = searches[i];
+            if (search.genuine) {
+                // Ties are ranked pessimistically, impostors ahead of genuines
+                int firstGenuineReturn = 1;
+                foreach (float impostor, search.impostors)
+                    if (impostor >= search.bestGenuine)
+                        firstGenuineReturn++;
+                firstGenuineReturns[i] = firstGenuineReturn;
+                genuineSearches.append(search.bestGenuine);
+            } else if (!search.impostors.isEmpty()) {
+                impostorSearches.append(*std::max_element(search.impostors.begin(), search.impostors.end()));
+            }
+        }
+
+        EvaluateHistograms(total.genuines, total.impostors, low, binWidth, genuineSearches, impostorSearches, firstGenuineReturns,
+                           targetFiles.size(), queryFiles.size(), QString(file.name).replace("." + file.suffix(), ".csv"));
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        if (bins < 1) qFatal("onlineEvalOutput requires bins >= 1.");
+        if (rank < 1) qFatal("onlineEvalOutput requires rank >= 1.");
+
+        mask = BEE::ImplicitMask(targetFiles, queryFiles);
+        searches = QVector<Search>(queryFiles.size());
+        minimums = QVector<float>(queryFiles.size(), -std::numeric_limits<float>::infinity());
+        if (minScore != maxScore) {
+            low = std::min(minScore, maxScore);
+            binWidth = (double(std::max(minScore, maxScore)) - low) / bins;
+            calibrated.store(1);
+        }
+    }
+
+    Histograms &local()
+    {
+        if (!localHistograms.hasLocalData()) {
+            QSharedPointer<Histograms> histogram(new Histograms(bins));
+            QMutexLocker locker(&mutex);
+            histograms.append(histogram);
+            localHistograms.setLocalData(histogram);
+        }
+        return *localHistograms.localData();
+    }
+
+    int bin(float score) const
+    {
+        const double position = (double(score) - low) / binWidth;
+        if (position <= 0)    return 0;
+        if (position >= bins) return bins - 1;
+        return int(position);
+    }
+
+    // Fixes the histogram range and bins the scores buffered so far
+    void calibrate()
+    {
+        float high = -std::numeric_limits<float>::max();
+        low = std::numeric_limits<float>::max();
+        for (int i=0; i<calibration.size(); i++) {
+            if (calibration[i].first == -std::numeric_limits<float>::max()) continue;
+            low = std::min(low, calibration[i].first);
+            high = std::max(high, calibration[i].first);
+        }
+        if (low > high) low = high = 0;
+
+        // Leave room for scores beyond those seen so far
+        const double margin = (high > low) ? (double(high) - low) / 2 : std::max(qAbs(double(high)), 1.0);
+        low -= margin;
+        binWidth = (double(high) + margin - low) / bins;
+
+        QSharedPointer<Histograms> histogram(new Histograms(bins));
+        for (int i=0; i<calibration.size(); i++) {
+            if (calibration[i].second) histogram->genuines[bin(calibration[i].first)]++;
+            else                       histogram->impostors[bin(calibration[i].first)]++;
+        }
+        histograms.append(histogram);
+        calibration.clear();
+        calibrated.storeRelease(1);
+    }
+
+    // Buffers the score until the range is known, returns false once it is
+    bool buffer(float value, bool genuine)
+    {
+        QMutexLocker locker(&mutex);
+        if (calibrated.load()) return false;
+        calibration.append(QPair<float,bool>(value, genuine));
+        if (calibration.size() == CalibrationSize) calibrate();
+        return true;
+    }
+
+    void set(float value, int i, int j)
+    {
+        // Return early for self similar matrices
+        if (selfSimilar && (i == j)) return;
+
+        const BEE::MaskValue maskValue = mask.at(i, j);
+        if (maskValue == BEE::DontCare) return;
+        const bool genuine = (maskValue == BEE::Match);
+
+        if (value != value) {
+            local().nans++;
+            return;
+        }
+
+        if (calibrated.loadAcquire() || !buffer(value, genuine)) {
+            Histograms &histogram = local();
+            if (genuine) histogram.genuines[bin(value)]++;
+            else         histogram.impostors[bin(value)]++;
+        }
+
+        if (!genuine && (value <= minimums[i])) return;
+
+        QMutexLocker locker(&locks[i % NumLocks]);
+        Search &search = searches[i];
+        if (genuine) {
+            search.bestGenuine = search.genuine ? std::max(search.bestGenuine, value) : value;
+            search.genuine = true;
+            return;
+        }
+
+        QVector<float> &heap = search.impostors;
+        if (heap.size() < rank) {
+            heap.append(value);
+            std::push_heap(heap.begin(), heap.end(), std::greater<float>());
+        } else if (value > heap.front()) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<float>());
+            heap.last() = value;
+            std::push_heap(heap.begin(), heap.end(), std::greater<float>());
+        }
+        if (heap.size() == rank)
+            minimums[i] = heap.front();
+    }
+};
+
+BR_REGISTER(Output, onlineEvalOutput)
+
+} // namespace br
+
+#include "output/onlineeval.moc"
@@ -14,10 +14,12 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QtConcurrent>
+
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/bee.h>
 #include <openbr/core/common.h>
 #include <openbr/core/qtutils.h>
-#include <openbr/core/opencvutils.h>
 
 namespace br
 {
@@ -25,48 +27,73 @@ namespace br
 /*!
  * \ingroup outputs
  * \brief Outputs highest ranked matches with scores.
+ *
+ * The rank of each query's first genuine match is counted in a single pass over its row, without sorting it.
+ * Queries are ranked in parallel.
  * \author Scott Klum \cite sklum
  */
 class rankOutput : public MatrixOutput
 {
     Q_OBJECT
 
+    BEE::ImplicitMask mask;
+    QVector<int> ranks, positions; // Per query, a rank of 0 means no genuine match
+
     ~rankOutput()
     {
         if (targetFiles.isEmpty() || queryFiles.isEmpty()) return;
 
-        QList<int> ranks;
-        QList<int> positions;
-        QList<float> scores;
-        QStringList lines;
+        // Each query is ranked against the targets in its own partition
+        mask = BEE::ImplicitMask(targetFiles, queryFiles, -1);
 
-        for (int i=0; i<queryFiles.size(); i++) {
-            typedef QPair<float,int> Pair;
-            int rank = 1;
-            foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true)) {
-                // Check if target files are marked as allParitions, and make sure target and query files are in the same partition
-                if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
-                    if (QString(targetFiles[pair.second]) != QString(queryFiles[i])) {
-                        if (targetFiles[pair.second].get<QString>("Label") == queryFiles[i].get<QString>("Label")) {
-                            ranks.append(rank);
-                            positions.append(pair.second);
-                            scores.append(pair.first);
-                            break;
-                        }
-                        rank++;
-                    }
-                }
+        ranks = QVector<int>(queryFiles.size(), 0);
+        positions = QVector<int>(queryFiles.size(), -1);
+        const int chunks = std::min(std::max(Globals->parallelism, 1) * 4, queryFiles.size());
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<chunks; i++)
+            futures.addFuture(QtConcurrent::run(this, &rankOutput::rankQueries, i*queryFiles.size()/chunks, (i+1)*queryFiles.size()/chunks));
+        futures.waitForFinished();
+
+        QList<int> retrieved, retrievedRanks;
+        for (int i=0; i<queryFiles.size(); i++)
+            if (ranks[i] > 0) {
+                retrieved.append(i);
+                retrievedRanks.append(ranks[i]);
             }
-        }
 
+        QStringList lines;
         typedef QPair<int,int> RankPair;
-        foreach (const RankPair &pair, Common::Sort(ranks, false))
-            // pair.first == rank retrieved, pair.second == original position
-            lines.append(queryFiles[pair.second].name + " " + QString::number(pair.first) + " " + QString::number(scores[pair.second]) + " " + targetFiles[positions[pair.second]].name);
-
+        foreach (const RankPair &pair, Common::Sort(retrievedRanks, false)) {
+            // pair.first == rank retrieved, pair.second == position in retrieved
+            const int i = retrieved[pair.second];
+            lines.append(queryFiles[i].name + " " + QString::number(pair.first) + " " + QString::number(data.at<float>(i, positions[i])) + " " + targetFiles[positions[i]].name);
+        }
 
         QtUtils::writeFile(file, lines);
     }
+
+    void rankQueries(int begin, int end)
+    {
+        for (int i=begin; i<end; i++) {
+            const float *scores = data.ptr<float>(i);
+
+            // The first genuine match of a descending sort on (score, index)
+            int best = -1;
+            for (int j=0; j<data.cols; j++)
+                if ((mask.at(i, j) == BEE::Match) && ((best == -1) || (scores[j] >= scores[best])))
+                    best = j;
+            if (best == -1) continue;
+
+            // Count the impostors sorted ahead of it
+            int rank = 1;
+            for (int j=0; j<data.cols; j++)
+                if (((scores[j] > scores[best]) || ((scores[j] == scores[best]) && (j > best))) && (mask.at(i, j) == BEE::NonMatch))
+                    rank++;
+
+            ranks[i] = rank;
+            positions[i] = best;
+        }
+    }
 };
 
 BR_REGISTER(Output, rankOutput)
@@ -0,0 +1,136 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <algorithm>
+
+#include <openbr/plugins/openbr_internal.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup outputs
+ * \brief Splits the columns of a comparison against several concatenated target galleries into one output per gallery.
+ *
+ * The file name is a pattern with a \c %1 place marker replaced by the index of each target gallery,
+ * every output is made from it with the remaining metadata of this one.
+ * When blocks span all the targets, as they do when the query gallery is streamed, each output receives its part of every block.
+ * Otherwise each output receives its scores as a single block.
+ * \br_property QStringList galleries Target galleries, in the order they were concatenated.
+ * \author Unknown \cite unknown
+ */
+class splitOutput : public Output
+{
+    Q_OBJECT
+    Q_PROPERTY(QStringList galleries READ get_galleries WRITE set_galleries RESET reset_galleries STORED false)
+    BR_PROPERTY(QStringList, galleries, QStringList())
+
+    QList< QSharedPointer<Output> > outputs;
+    QVector<int> offsets; // First target of each gallery, plus the total
+    QPoint offset; // Of the current block
+    bool started, wholeRows;
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        if (galleries.isEmpty()) qFatal("Split output requires target galleries.");
+        if (!file.name.contains("%1")) qFatal("Split output file name missing gallery number place marker (%%1)");
+
+        if (offsets.isEmpty()) {
+            offsets.append(0);
+            foreach (const QString &gallery, galleries)
+                offsets.append(offsets.last() + FileList::fromGallery(gallery, true).size());
+        }
+        if (offsets.last() != targetFiles.size())
+            qFatal("Split output expected %d targets, received %d.", offsets.last(), targetFiles.size());
+
+        // Initialized more than once by OutputTransform, outputs are only made the first time
+        const bool made = !outputs.isEmpty();
+        for (int i=0; i<galleries.size(); i++) {
+            const FileList targets(targetFiles.mid(offsets[i], offsets[i+1] - offsets[i]));
+            if (made) {
+                outputs[i]->initialize(targets, queryFiles);
+                continue;
+            }
+
+            File output = file;
+            output.name = file.name.arg(i);
+            output.remove("plugin");
+            output.remove("galleries");
+            output.set("targetGallery", galleries[i]);
+            outputs.append(QSharedPointer<Output>(Output::make(output, targets, queryFiles)));
+        }
+    }
+
+    void setBlock(int rowBlock, int columnBlock)
+    {
+        offset = QPoint((columnBlock == -1) ? 0 : blockCols*columnBlock,
+                        (rowBlock == -1) ? 0 : blockRows*rowBlock);
+
+        if (!started) {
+            started = true;
+            wholeRows = (offset.x() == 0) && (blockCols >= targetFiles.size());
+            if (!wholeRows)
+                for (int i=0; i<outputs.size(); i++) {
+                    outputs[i]->blockRows = queryFiles.size();
+                    outputs[i]->blockCols = offsets[i+1] - offsets[i];
+                    outputs[i]->setBlock(0, 0);
+                }
+        }
+
+        if (wholeRows)
+            for (int i=0; i<outputs.size(); i++) {
+                outputs[i]->blockRows = blockRows;
+                outputs[i]->blockCols = offsets[i+1] - offsets[i];
+                outputs[i]->setBlock(rowBlock, 0);
+            }
+    }
+
+    // Index of the gallery containing target column j
+    inline int gallery(int j) const
+    {
+        return int(std::upper_bound(offsets.begin(), offsets.end(), j) - offsets.begin()) - 1;
+    }
+
+    void setRelative(float value, int i, int j)
+    {
+        const int column = offset.x() + j;
+        const int k = gallery(column);
+        outputs[k]->setRelative(value, wholeRows ? i : offset.y() + i, column - offsets[k]);
+    }
+
+    float boundRelative(int i, int j) const
+    {
+        const int column = offset.x() + j;
+        const int k = gallery(column);
+        return outputs[k]->boundRelative(wholeRows ? i : offset.y() + i, column - offsets[k]);
+    }
+
+    void set(float value, int i, int j)
+    {
+        (void) value; (void) i; (void) j;
+        qFatal("Logic error.");
+    }
+
+public:
+    splitOutput() : started(false), wholeRows(false) {}
+};
+
+BR_REGISTER(Output, splitOutput)
+
+} // namespace br
+
+#include "output/split.moc"
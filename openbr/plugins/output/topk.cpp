@@ -0,0 +1,161 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QMutex>
+#include <algorithm>
+#include <math.h>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup outputs
+ * \brief The k highest scoring targets for each query, computed without storing the similarity matrix.
+ *
+ * Each query keeps a bounded min-heap of its best candidates, so memory is O(queries*k) rather than O(queries*targets).
+ * Safe to call concurrently from multiple compareBlock threads.
+ * The current minimum is passed to the distance as a bound, so bounded distances can abandon comparisons that can't place.
+ * Writes one line per candidate as Query,Rank,Score,Target, with queries in gallery order.
+ * \br_property int k Number of candidates retained per query.
+ * \br_property float threshold Candidates scoring below this value are discarded, as are failed comparisons.
+ * \br_property bool args Write the full metadata of each file instead of just its name.
+ * \author Unknown \cite unknown
+ */
+class topKOutput : public Output
+{
+    Q_OBJECT
+    Q_PROPERTY(int k READ get_k WRITE set_k RESET reset_k STORED false)
+    Q_PROPERTY(float threshold READ get_threshold WRITE set_threshold RESET reset_threshold STORED false)
+    Q_PROPERTY(bool args READ get_args WRITE set_args RESET reset_args STORED false)
+    BR_PROPERTY(int, k, 50)
+    BR_PROPERTY(float, threshold, -std::numeric_limits<float>::max())
+    BR_PROPERTY(bool, args, false)
+
+    typedef QPair<float,int> Candidate; // QPair<score,target index>
+
+    // Min-heap on score, the weakest retained candidate is at the front
+    static bool heapCompare(const Candidate &a, const Candidate &b)
+    {
+        return a.first > b.first;
+    }
+
+    static const int NumLocks = 64;
+
+    QVector< QVector<Candidate> > heaps;
+    QVector<float> minimums; // Score a new candidate must beat, read without locking as a fast reject
+    QMutex locks[NumLocks];
+    QList<int> targetPartitions, queryPartitions;
+
+    friend void searchTopK(const Distance *distance, const TemplateList &targets, const TemplateList &queries, int k, int *indices, float *scores);
+
+    ~topKOutput()
+    {
+        if (file.isNull() || heaps.isEmpty()) return;
+
+        QStringList lines;
+        lines.append("Query,Rank,Score,Target");
+        for (int i=0; i<heaps.size(); i++) {
+            QVector<Candidate> candidates = heaps[i];
+            std::sort(candidates.begin(), candidates.end(), heapCompare);
+            const QString query = args ? queryFiles[i].flat() : queryFiles[i].name;
+            for (int j=0; j<candidates.size(); j++) {
+                const File &target = targetFiles[candidates[j].second];
+                lines.append(query + "," + QString::number(j+1) + "," + QString::number(candidates[j].first) + "," + (args ? target.flat() : target.name));
+            }
+        }
+        QtUtils::writeFile(file, lines);
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        if (k < 1) qFatal("topKOutput requires k >= 1.");
+
+        heaps = QVector< QVector<Candidate> >(queryFiles.size());
+        for (int i=0; i<heaps.size(); i++)
+            heaps[i].reserve(k);
+        // Failed comparisons score -FLT_MAX and are never candidates, so distances may skip targets they won't score
+        minimums = QVector<float>(queryFiles.size(), std::max(threshold, nextafterf(-std::numeric_limits<float>::max(), 0)));
+
+        // Looked up once here rather than per comparison
+        if (Globals->crossValidate > 0) {
+            foreach (const File &target, targetFiles)
+                targetPartitions.append(target.get<int>("Partition", -1));
+            foreach (const File &query, queryFiles)
+                queryPartitions.append(query.get<int>("Partition", -1));
+        }
+    }
+
+    void set(float value, int i, int j)
+    {
+        // Return early for self similar matrices
+        if (selfSimilar && (i == j)) return;
+        if (value < minimums[i]) return;
+
+        // Check if target files are marked as allPartitions, and make sure target and query files are in the same partition
+        if (!targetPartitions.isEmpty() && (targetPartitions[j] != -1) && (targetPartitions[j] != queryPartitions[i]))
+            return;
+
+        QMutexLocker locker(&locks[i % NumLocks]);
+        QVector<Candidate> &heap = heaps[i];
+        if (heap.size() < k) {
+            heap.append(Candidate(value, j));
+            std::push_heap(heap.begin(), heap.end(), heapCompare);
+        } else if (value > heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end(), heapCompare);
+            heap.last() = Candidate(value, j);
+            std::push_heap(heap.begin(), heap.end(), heapCompare);
+        } else {
+            return;
+        }
+
+        if (heap.size() == k)
+            minimums[i] = std::max(threshold, heap.front().first);
+    }
+
+    // Lets the distance stop comparing once it can't beat the weakest retained candidate
+    float bound(int i, int j) const
+    {
+        (void) j;
+        return minimums[i];
+    }
+};
+
+BR_REGISTER(Output, topKOutput)
+
+void searchTopK(const Distance *distance, const TemplateList &targets, const TemplateList &queries, int k, int *indices, float *scores)
+{
+    topKOutput output;
+    output.set_k(k);
+    output.initialize(targets.files(), queries.files());
+    distance->compare(targets, queries, &output);
+
+    for (int i=0; i<output.heaps.size(); i++) {
+        QVector<topKOutput::Candidate> candidates = output.heaps[i];
+        std::sort(candidates.begin(), candidates.end(), topKOutput::heapCompare);
+        for (int j=0; j<k; j++) {
+            indices[i*k+j] = (j < candidates.size()) ? candidates[j].second : -1;
+            scores[i*k+j] = (j < candidates.size()) ? candidates[j].first : -std::numeric_limits<float>::max();
+        }
+    }
+}
+
+} // namespace br
+
+#include "output/topk.moc"
@@ -2,6 +2,7 @@
 #include <opencv2/highgui/highgui.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/featureplanes.h>
 #include <openbr/core/opencvutils.h>
 
 using namespace cv;
@@ -42,6 +43,10 @@ class GradientHistogramRepresentation : public Representation
 
     void preprocess(const Mat &src, Mat &dst) const
     {
+        const QString plane = "GradientHistogram" + QString::number(bins);
+        dst = FeaturePlanes::plane(src, plane);
+        if (!dst.empty()) return;
+
         // Compute as is done in GradientTransform
         Mat dx, dy, magnitude, angle;
         Sobel(src, dx, CV_32F, 1, 0, CV_SCHARR);
@@ -64,6 +69,7 @@ class GradientHistogramRepresentation : public Representation
 
         // Concatenate images into row
         merge(outputs,dst);
+        FeaturePlanes::setPlane(src, plane, dst);
     }
 
     /*  ___ ___
@@ -1,6 +1,7 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/featureplanes.h>
 #include <openbr/core/opencvutils.h>
 
 using namespace cv;
@@ -80,7 +81,11 @@ class HaarRepresentation : public Representation
 
     void preprocess(const Mat &src, Mat &dst) const
     {
-        integral(src, dst);
+        dst = FeaturePlanes::plane(src, "Integral");
+        if (dst.empty()) {
+            integral(src, dst);
+            FeaturePlanes::setPlane(src, "Integral", dst);
+        }
     }
 
     float evaluate(const Mat &image, int idx) const
@@ -1,6 +1,10 @@
 #include <opencv2/imgproc/imgproc.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/featureplanes.h>
 #include <openbr/core/opencvutils.h>
 
 using namespace cv;
@@ -50,7 +54,11 @@ class MBLBPRepresentation : public Representation
 
     void preprocess(const Mat &src, Mat &dst) const
     {
-        integral(src, dst);
+        dst = FeaturePlanes::plane(src, "Integral");
+        if (dst.empty()) {
+            integral(src, dst);
+            FeaturePlanes::setPlane(src, "Integral", dst);
+        }
     }
 
     float evaluate(const Mat &image, int idx) const
@@ -68,6 +76,24 @@ class MBLBPRepresentation : public Representation
         return result;
     }
 
+    // Neighboring windows share the integral image, offsets are recomputed for its row stride
+    void evaluate(const Mat &image, int idx, int origin, int step, int count, float *responses) const
+    {
+        const Rect &rect = features[idx].rect;
+        const Feature feature(image.cols, rect.x, rect.y, rect.width, rect.height);
+        const int *ptr = image.ptr<int>() + origin;
+
+        int i = 0;
+#ifdef __SSE2__
+        // Four windows per iteration when their corners are adjacent or every other element
+        if ((step == 1) || (step == 2))
+            for (; i+4 <= count; i+=4)
+                _mm_storeu_ps(responses + i, _mm_cvtepi32_ps(feature.calc4(ptr + i*step, step)));
+#endif // __SSE2__
+        for (; i < count; i++)
+            responses[i] = (float)feature.calc(ptr + i*step);
+    }
+
     Size windowSize(int *dx, int *dy) const
     {
         if (dx && dy)
@@ -82,7 +108,11 @@ class MBLBPRepresentation : public Representation
     {
         Feature() { rect = Rect(0, 0, 0, 0); }
         Feature( int offset, int x, int y, int _block_w, int _block_h  );
-        uchar calc(const Mat &img) const;
+        uchar calc(const Mat &img) const { return calc(img.ptr<int>()); }
+        uchar calc(const int *ptr) const;
+#ifdef __SSE2__
+        __m128i calc4(const int *ptr, int step) const;
+#endif // __SSE2__
 
         Rect rect;
         int p[16];
@@ -116,9 +146,8 @@ MBLBPRepresentation::Feature::Feature( int offset, int x, int y, int _blockWidth
     calcOffset(p[8], p[9], p[12], p[13], tr, offset);
 }
 
-inline uchar MBLBPRepresentation::Feature::calc(const Mat &img) const
+inline uchar MBLBPRepresentation::Feature::calc(const int *ptr) const
 {
-    const int* ptr = img.ptr<int>();
     int cval = ptr[p[5]] - ptr[p[6]] - ptr[p[9]] + ptr[p[10]];
 
     return (uchar)((ptr[p[0]] - ptr[p[1]] - ptr[p[4]] + ptr[p[5]] >= cval ? 128 : 0) |   // 0
@@ -131,6 +160,50 @@ inline uchar MBLBPRepresentation::Feature::calc(const Mat &img) const
                    (ptr[p[4]] - ptr[p[5]] - ptr[p[8]] + ptr[p[9]] >= cval ? 1 : 0));     // 3
 }
 
+#ifdef __SSE2__
+
+// Integral image values at offset of four windows, step elements apart
+static inline __m128i load4(const int *ptr, int step)
+{
+    if (step == 1)
+        return _mm_loadu_si128((const __m128i*)ptr);
+    // Elements 0, 2, 4 and 6, without reading past the last window
+    const __m128 low = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)ptr));
+    const __m128 high = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(ptr + 3)));
+    return _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+static inline __m128i blockSum(const __m128i *v, int a, int b, int c, int d)
+{
+    return _mm_add_epi32(_mm_sub_epi32(_mm_sub_epi32(v[a], v[b]), v[c]), v[d]);
+}
+
+// Sets bit where the block sum is >= the center sum
+static inline __m128i lbpBit(const __m128i &sum, const __m128i &cval, int bit)
+{
+    return _mm_andnot_si128(_mm_cmplt_epi32(sum, cval), _mm_set1_epi32(bit));
+}
+
+__m128i MBLBPRepresentation::Feature::calc4(const int *ptr, int step) const
+{
+    __m128i v[16];
+    for (int i = 0; i < 16; i++)
+        v[i] = load4(ptr + p[i], step);
+
+    const __m128i cval = blockSum(v, 5, 6, 9, 10);
+    __m128i result = lbpBit(blockSum(v, 0, 1, 4, 5), cval, 128);          // 0
+    result = _mm_or_si128(result, lbpBit(blockSum(v, 1, 2, 5, 6), cval, 64));    // 1
+    result = _mm_or_si128(result, lbpBit(blockSum(v, 2, 3, 6, 7), cval, 32));    // 2
+    result = _mm_or_si128(result, lbpBit(blockSum(v, 6, 7, 10, 11), cval, 16));  // 5
+    result = _mm_or_si128(result, lbpBit(blockSum(v, 10, 11, 14, 15), cval, 8)); // 8
+    result = _mm_or_si128(result, lbpBit(blockSum(v, 9, 10, 13, 14), cval, 4));  // 7
+    result = _mm_or_si128(result, lbpBit(blockSum(v, 8, 9, 12, 13), cval, 2));   // 6
+    result = _mm_or_si128(result, lbpBit(blockSum(v, 4, 5, 8, 9), cval, 1));     // 3
+    return result;
+}
+
+#endif // __SSE2__
+
 } // namespace br
 
 #include "representation/mblbp.moc"
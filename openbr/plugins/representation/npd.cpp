@@ -1,3 +1,7 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
 #include <openbr/plugins/openbr_internal.h>
 
 using namespace cv;
@@ -5,6 +9,49 @@ using namespace cv;
 namespace br
 {
 
+// NPD of every pair of 8-bit values, computed exactly as the arithmetic in Feature::calc
+static struct NPDTable
+{
+    float values[256*256];
+
+    NPDTable()
+    {
+        for (int v1 = 0; v1 < 256; v1++)
+            for (int v2 = 0; v2 < 256; v2++)
+                values[v1*256 + v2] = v1 == 0 && v2 == 0 ? 0 : ((float)(v1 - v2)) / (v1 + v2);
+    }
+} npdTable;
+
+#ifdef __SSE2__
+
+// NPD of eight pairs of 16-bit values
+static inline void npd8(__m128i v1, __m128i v2, float *responses)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i difference = _mm_sub_epi16(v1, v2);
+    const __m128i sum = _mm_add_epi16(v1, v2);
+    for (int half = 0; half < 2; half++) {
+        // Sign extend the differences, the sums are non-negative
+        const __m128i d = half == 0 ? _mm_srai_epi32(_mm_unpacklo_epi16(difference, difference), 16)
+                                    : _mm_srai_epi32(_mm_unpackhi_epi16(difference, difference), 16);
+        const __m128i s = half == 0 ? _mm_unpacklo_epi16(sum, zero) : _mm_unpackhi_epi16(sum, zero);
+        const __m128 npd = _mm_div_ps(_mm_cvtepi32_ps(d), _mm_cvtepi32_ps(s));
+        // Both values are zero exactly when the sum is
+        const __m128 valid = _mm_castsi128_ps(_mm_xor_si128(_mm_cmpeq_epi32(s, zero), _mm_set1_epi32(-1)));
+        _mm_storeu_ps(responses + 4*half, _mm_and_ps(npd, valid));
+    }
+}
+
+// Eight 8-bit values step elements apart, widened to 16 bits
+static inline __m128i load8(const uchar *ptr, int step)
+{
+    if (step == 1)
+        return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)ptr), _mm_setzero_si128());
+    return _mm_and_si128(_mm_loadu_si128((const __m128i*)ptr), _mm_set1_epi16(0xff));
+}
+
+#endif // __SSE2__
+
 class NPDRepresentation : public Representation
 {
     Q_OBJECT
@@ -36,6 +83,32 @@ class NPDRepresentation : public Representation
         return result;
     }
 
+    // 8-bit images use the lookup table, or SSE2 for windows that are adjacent or every other element
+    void evaluate(const Mat &image, int idx, int origin, int step, int count, float *responses) const
+    {
+        if (image.type() != CV_8UC1) {
+            Representation::evaluate(image, idx, origin, step, count, responses);
+            return;
+        }
+
+        // Window offsets for the image row stride
+        const Feature &feature = features[idx];
+        const uchar *a = image.ptr<uchar>() + origin + (feature.p[0] / winWidth) * image.cols + feature.p[0] % winWidth;
+        const uchar *b = image.ptr<uchar>() + origin + (feature.p[1] / winWidth) * image.cols + feature.p[1] % winWidth;
+
+        int i = 0;
+#ifdef __SSE2__
+        if ((step == 1) || (step == 2))
+            for (; i+8 <= count; i+=8) {
+                // Every other element loads 16 bytes, stop before reading past the image
+                if ((step == 2) && ((std::max(a, b) + 2*i + 16) > image.dataend)) break;
+                npd8(load8(a + i*step, step), load8(b + i*step, step), responses + i);
+            }
+#endif // __SSE2__
+        for (; i < count; i++)
+            responses[i] = npdTable.values[a[i*step]*256 + b[i*step]];
+    }
+
     Size windowSize(int *dx, int *dy) const
     {
         if (dx && dy)
@@ -61,6 +134,11 @@ BR_REGISTER(Representation, NPDRepresentation)
 
 inline float NPDRepresentation::Feature::calc(const Mat &image) const
 {
+    if (image.depth() == CV_8U) {
+        const uchar *ptr = image.ptr<uchar>();
+        return npdTable.values[ptr[p[0]]*256 + ptr[p[1]]];
+    }
+
     const int *ptr = image.ptr<int>();
     int v1 = ptr[p[0]], v2 = ptr[p[1]];
     return v1 == 0 && v2 == 0 ? 0 : ((float)(v1 - v2)) / (v1 + v2);
@@ -62,6 +62,11 @@ class RandomRepresentation : public Representation
         return representation->evaluate(image,newIndices);
     }
 
+    void evaluate(const Mat &image, int idx, int origin, int step, int count, float *responses) const
+    {
+        representation->evaluate(image, features[idx], origin, step, count, responses);
+    }
+
     int numFeatures() const
     {
         return features.size();
@@ -25,39 +25,103 @@ namespace br
  *
  * For a video with m frames, AggregateFrames would create a total of m-n+1 sequences ([0,n] ... [m-n+1, m])
  *
+ * The window is a fixed ring of frame references, so nothing is copied as it slides.
+ * In Sum and Mean modes a single running aggregate of the window is passed along instead,
+ * updated with the arriving and departing frames only, regardless of n.
+ *
+ * \br_property Mode mode Window passes the frames themselves, Sum and Mean their 32-bit float sum or mean. Default is Window.
  * \author Josh Klontz \cite jklontz
  */
 class AggregateFrames : public TimeVaryingTransform
 {
     Q_OBJECT
+    Q_ENUMS(Mode)
     Q_PROPERTY(int n READ get_n WRITE set_n RESET reset_n STORED false)
+    Q_PROPERTY(Mode mode READ get_mode WRITE set_mode RESET reset_mode STORED false)
+
+public:
+    enum Mode { Window,
+                Sum,
+                Mean };
+
+private:
     BR_PROPERTY(int, n, 1)
+    BR_PROPERTY(Mode, mode, Window)
 
-    TemplateList buffer;
+    QVector<Template> ring;
+    int head, count; // Index of the oldest frame, and frames held
+    cv::Mat sum; // Running sum of the window in double precision, to avoid drift over long videos
 
 public:
-    AggregateFrames() : TimeVaryingTransform(false, false) {}
+    AggregateFrames() : TimeVaryingTransform(false, false), head(0), count(0) {}
 
 private:
+    void init()
+    {
+        ring = QVector<Template>(std::max(n, 1));
+        head = count = 0;
+        sum.release();
+    }
+
     void train(const TemplateList &data)
     {
         (void) data;
     }
 
-    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    void accumulate(const cv::Mat &m, double sign)
     {
-        buffer.append(src);
-        if (buffer.size() < n) return;
-        Template out;
-        foreach (const Template &t, buffer) out.append(t);
-        out.file = buffer.takeFirst().file;
+        if (!sum.data) {
+            sum = cv::Mat::zeros(m.size(), CV_MAKETYPE(CV_64F, m.channels()));
+        } else if ((m.size() != sum.size()) || (m.channels() != sum.channels())) {
+            qFatal("AggregateFrames can only sum frames of one size.");
+        }
+        cv::Mat m64;
+        m.convertTo(m64, CV_64F);
+        if (sign > 0) sum += m64;
+        else          sum -= m64;
+    }
+
+    void push(const Template &t, TemplateList &dst)
+    {
+        const int capacity = ring.size();
+        if (count == capacity) {
+            // The oldest frame leaves the window
+            if (mode != Window)
+                accumulate(ring[head].m(), -1);
+            ring[head] = Template();
+            head = (head + 1) % capacity;
+            count--;
+        }
+
+        ring[(head + count) % capacity] = t;
+        count++;
+        if (mode != Window)
+            accumulate(t.m(), 1);
+        if (count < capacity)
+            return;
+
+        Template out(ring[head].file);
+        if (mode == Window) {
+            for (int i=0; i<capacity; i++)
+                out.append(ring[(head + i) % capacity]);
+        } else {
+            cv::Mat result;
+            sum.convertTo(result, CV_MAKETYPE(CV_32F, sum.channels()), (mode == Mean) ? 1.0 / capacity : 1.0);
+            out.append(result);
+        }
         dst.append(out);
     }
 
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        foreach (const Template &t, src)
+            push(t, dst);
+    }
+
     void finalize(TemplateList &output)
     {
         (void) output;
-        buffer.clear();
+        init();
     }
 
     void store(QDataStream &stream) const
@@ -0,0 +1,244 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Runs a detector only on the regions of a fixed camera's frames that changed.
+ *
+ * A running mean and variance of each pixel, kept at 1/downsample resolution, models the static background.
+ * Pixels whose AbsDiff from the mean exceeds deviations standard deviations, and at least minDifference, are moving.
+ * The bounding boxes of the moving regions are padded, grown to minSize and merged where they overlap,
+ * then cropped from the frame and passed to the detector, whose detections are mapped back into frame coordinates.
+ * Every interval frames, and whenever the regions cover more than maxArea of the frame, the detector sweeps the full frame instead.
+ * \br_property br::Transform* transform The detector.
+ * \br_property int interval Frames between full-frame sweeps.
+ * \br_property int downsample Factor by which frames are shrunk before modeling the background.
+ * \br_property float learningRate Weight of each new frame in the background model.
+ * \br_property float deviations Standard deviations from the background mean for a pixel to be moving.
+ * \br_property float minDifference Smallest intensity difference from the background mean for a pixel to be moving.
+ * \br_property float padding Fraction of its size each region is padded by.
+ * \br_property int minSize Smallest region passed to the detector, in pixels, which should be at least the detector's window.
+ * \br_property float maxArea Fraction of the frame above which the full frame is swept.
+ * \author Unknown \cite unknown
+ */
+class MotionROITransform : public TimeVaryingTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform STORED false)
+    Q_PROPERTY(int interval READ get_interval WRITE set_interval RESET reset_interval STORED false)
+    Q_PROPERTY(int downsample READ get_downsample WRITE set_downsample RESET reset_downsample STORED false)
+    Q_PROPERTY(float learningRate READ get_learningRate WRITE set_learningRate RESET reset_learningRate STORED false)
+    Q_PROPERTY(float deviations READ get_deviations WRITE set_deviations RESET reset_deviations STORED false)
+    Q_PROPERTY(float minDifference READ get_minDifference WRITE set_minDifference RESET reset_minDifference STORED false)
+    Q_PROPERTY(float padding READ get_padding WRITE set_padding RESET reset_padding STORED false)
+    Q_PROPERTY(int minSize READ get_minSize WRITE set_minSize RESET reset_minSize STORED false)
+    Q_PROPERTY(float maxArea READ get_maxArea WRITE set_maxArea RESET reset_maxArea STORED false)
+    BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(int, interval, 30)
+    BR_PROPERTY(int, downsample, 4)
+    BR_PROPERTY(float, learningRate, 0.05)
+    BR_PROPERTY(float, deviations, 3)
+    BR_PROPERTY(float, minDifference, 15)
+    BR_PROPERTY(float, padding, 0.25)
+    BR_PROPERTY(int, minSize, 64)
+    BR_PROPERTY(float, maxArea, 0.5)
+
+    Mat mean, meanSquare; // Background model, CV_32FC1 at 1/downsample resolution
+    int sinceSweep;
+
+public:
+    MotionROITransform() : TimeVaryingTransform(false, false), sinceSweep(0) {}
+
+private:
+    void init()
+    {
+        if (!transform)
+            qFatal("MotionROI requires a detector.");
+        trainable = transform->trainable;
+    }
+
+    void train(const TemplateList &data)
+    {
+        transform->train(data);
+    }
+
+    // Updates the background model, returning the moving regions in frame coordinates
+    QList<Rect> moving(const Mat &frame)
+    {
+        Mat gray, small;
+        if (frame.channels() == 1) gray = frame;
+        else                       OpenCVUtils::cvtGray(frame, gray);
+        resize(gray, small, Size(std::max(gray.cols / downsample, 1), std::max(gray.rows / downsample, 1)), 0, 0, INTER_AREA);
+        small.convertTo(small, CV_32F);
+
+        QList<Rect> regions;
+        if (mean.size() != small.size()) {
+            // A new scene, sweep it until the model has seen more than one frame
+            mean = small.clone();
+            meanSquare = small.mul(small);
+            sinceSweep = interval;
+            return regions;
+        }
+
+        Mat difference, variance, threshold, mask;
+        absdiff(small, mean, difference);
+        variance = meanSquare - mean.mul(mean);
+        cv::max(variance, 0, variance);
+        sqrt(variance, threshold);
+        threshold *= deviations;
+        cv::max(threshold, minDifference, threshold);
+        compare(difference, threshold, mask, CMP_GT);
+
+        accumulateWeighted(small, mean, learningRate);
+        accumulateWeighted(small.mul(small), meanSquare, learningRate);
+
+        // Remove isolated pixels, then join the fragments of each moving object
+        morphologyEx(mask, mask, MORPH_OPEN, Mat());
+        dilate(mask, mask, Mat(), Point(-1, -1), 2);
+
+        std::vector< std::vector<Point> > contours;
+        findContours(mask, contours, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
+        const Rect bounds(0, 0, frame.cols, frame.rows);
+        for (size_t i=0; i<contours.size(); i++) {
+            const Rect box = boundingRect(contours[i]);
+            const int width = std::max(cvRound(box.width * downsample * (1 + 2*padding)), minSize);
+            const int height = std::max(cvRound(box.height * downsample * (1 + 2*padding)), minSize);
+            const Point center((box.x + box.width/2.0) * downsample, (box.y + box.height/2.0) * downsample);
+            const Rect region = Rect(center.x - width/2, center.y - height/2, width, height) & bounds;
+            if (region.area() > 0)
+                regions.append(region);
+        }
+
+        // Detecting once over the union of overlapping regions avoids duplicate detections
+        bool merged = true;
+        while (merged) {
+            merged = false;
+            for (int i=0; i<regions.size() && !merged; i++)
+                for (int j=i+1; j<regions.size() && !merged; j++)
+                    if ((regions[i] & regions[j]).area() > 0) {
+                        regions[i] |= regions[j];
+                        regions.removeAt(j);
+                        merged = true;
+                    }
+        }
+        return regions;
+    }
+
+    static QRectF translated(const QRectF &rect, const Point &offset)
+    {
+        return rect.translated(offset.x, offset.y);
+    }
+
+    // Detections in a region, moved into frame coordinates and onto the full frame
+    void detect(const Template &src, const Rect &region, TemplateList &dst) const
+    {
+        Template crop(src.file, Mat(src.m(), region));
+        crop.file.set("enrollAll", true); // Only actual detections, the full-frame fallback is added by projectUpdate
+
+        TemplateList detections;
+        transform->project(TemplateList() << crop, detections);
+
+        const Point offset = region.tl();
+        foreach (const Template &detection, detections) {
+            Template u = src;
+            u.file = detection.file;
+            if (src.file.contains("enrollAll")) u.file.set("enrollAll", src.file.value("enrollAll"));
+            else                                u.file.remove("enrollAll");
+
+            QList<QRectF> rects = u.file.rects();
+            for (int i=src.file.rects().size(); i<rects.size(); i++)
+                rects[i] = translated(rects[i], offset);
+            u.file.setRects(rects);
+
+            QList<QPointF> points = u.file.points();
+            for (int i=src.file.points().size(); i<points.size(); i++)
+                points[i] += QPointF(offset.x, offset.y);
+            u.file.setPoints(points);
+
+            foreach (const QString &key, u.file.localKeys()) {
+                if (src.file.contains(key)) continue;
+                const QVariant value = u.file.value(key);
+                if      (value.type() == QVariant::RectF)  u.file.set(key, translated(value.toRectF(), offset));
+                else if (value.type() == QVariant::PointF) u.file.set(key, value.toPointF() + QPointF(offset.x, offset.y));
+            }
+            dst.append(u);
+        }
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        foreach (const Template &t, src) {
+            const Mat &m = t.m();
+            const QList<Rect> regions = moving(m);
+
+            int area = 0;
+            foreach (const Rect &region, regions)
+                area += region.area();
+
+            if ((sinceSweep >= interval) || (area > maxArea * m.rows * m.cols)) {
+                sinceSweep = 1;
+                transform->project(TemplateList() << t, dst);
+                continue;
+            }
+            sinceSweep++;
+
+            const int before = dst.size();
+            foreach (const Rect &region, regions)
+                detect(t, region, dst);
+
+            // Mirror the detectors, which return the whole frame when nothing is found
+            if ((dst.size() == before) && !t.file.getBool("enrollAll")) {
+                Template u = t;
+                u.file.appendRect(QRectF(0, 0, m.cols, m.rows));
+                dst.append(u);
+            }
+        }
+    }
+
+    void finalize(TemplateList &output)
+    {
+        (void) output;
+        mean.release();
+        meanSquare.release();
+    }
+
+    void store(QDataStream &stream) const
+    {
+        transform->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        transform->load(stream);
+    }
+};
+
+BR_REGISTER(Transform, MotionROITransform)
+
+} // namespace br
+
+#include "video/motionroi.moc"
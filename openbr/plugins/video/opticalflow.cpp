@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <opencv2/gpu/gpu.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/video/tracking.hpp>
 #include <opencv2/video/background_segm.hpp>
 
@@ -28,11 +30,17 @@ namespace br
 /*!
  * \ingroup transforms
  * \brief Gets a one-channel dense optical flow from two images
+ *
+ * Consecutive pairs from AggregateFrames(2) share a frame, so the grayscale and downscaled copy of each pair's
+ * second frame is kept and reused as the first frame of the next pair.
+ * \br_property double scale Flow is computed on frames resized by this factor, then resized back and rescaled to full resolution vectors. Default is 1.
+ * \br_property Backend backend CPU, or GPU for OpenCV's CUDA Farneback implementation, falling back to CPU without a CUDA device. Default is CPU.
  * \author Austin Blanton \cite imaus10
  */
 class OpticalFlowTransform : public UntrainableMetaTransform
 {
     Q_OBJECT
+    Q_ENUMS(Backend)
     Q_PROPERTY(double pyr_scale READ get_pyr_scale WRITE set_pyr_scale RESET reset_pyr_scale STORED false)
     Q_PROPERTY(int levels READ get_levels WRITE set_levels RESET reset_levels STORED false)
     Q_PROPERTY(int winsize READ get_winsize WRITE set_winsize RESET reset_winsize STORED false)
@@ -41,6 +49,14 @@ class OpticalFlowTransform : public UntrainableMetaTransform
     Q_PROPERTY(double poly_sigma READ get_poly_sigma WRITE set_poly_sigma RESET reset_poly_sigma STORED false)
     Q_PROPERTY(int flags READ get_flags WRITE set_flags RESET reset_flags STORED false)
     Q_PROPERTY(bool useMagnitude READ get_useMagnitude WRITE set_useMagnitude RESET reset_useMagnitude STORED false)
+    Q_PROPERTY(double scale READ get_scale WRITE set_scale RESET reset_scale STORED false)
+    Q_PROPERTY(Backend backend READ get_backend WRITE set_backend RESET reset_backend STORED false)
+
+public:
+    enum Backend { CPU,
+                   GPU };
+
+private:
     // these defaults are optimized for KTH
     BR_PROPERTY(double, pyr_scale, 0.1)
     BR_PROPERTY(int, levels, 1)
@@ -50,15 +66,87 @@ class OpticalFlowTransform : public UntrainableMetaTransform
     BR_PROPERTY(double, poly_sigma, 1.1)
     BR_PROPERTY(int, flags, 0)
     BR_PROPERTY(bool, useMagnitude, true)
+    BR_PROPERTY(double, scale, 1)
+    BR_PROPERTY(Backend, backend, CPU)
+
+    bool useGpu;
+    mutable QMutex gpuLock; // The GPU flow object keeps state between calls
+    mutable gpu::FarnebackOpticalFlow gpuFlow;
+
+    mutable QMutex cacheLock;
+    mutable Mat cachedFrame, cachedGray; // The second frame of the last pair, held so its buffer can't be recycled
+
+    void init()
+    {
+        useGpu = false;
+        if (backend == GPU) {
+            useGpu = gpu::getCudaEnabledDeviceCount() > 0;
+            if (!useGpu)
+                qWarning("OpticalFlow found no CUDA device, falling back to the CPU.");
+        }
+
+        gpuFlow.pyrScale = pyr_scale;
+        gpuFlow.numLevels = levels;
+        gpuFlow.winSize = winsize;
+        gpuFlow.numIters = iterations;
+        gpuFlow.polyN = poly_n;
+        gpuFlow.polySigma = poly_sigma;
+        gpuFlow.flags = flags;
+
+        QMutexLocker locker(&cacheLock);
+        cachedFrame.release();
+        cachedGray.release();
+    }
+
+    Mat prepare(const Mat &frame) const
+    {
+        Mat gray = frame;
+        if (frame.channels() != 1) OpenCVUtils::cvtGray(frame, gray);
+        if (scale != 1) {
+            Mat resized;
+            resize(gray, resized, Size(), scale, scale, INTER_AREA);
+            gray = resized;
+        }
+        return gray;
+    }
 
     void project(const Template &src, Template &dst) const
     {
         // get the two images put there by AggregateFrames
         if (src.size() != 2) qFatal("Optical Flow requires two images.");
-        Mat prevImg = src[0], nextImg = src[1], flow;
-        if (src[0].channels() != 1) OpenCVUtils::cvtGray(src[0], prevImg);
-        if (src[1].channels() != 1) OpenCVUtils::cvtGray(src[1], nextImg);
-        calcOpticalFlowFarneback(prevImg, nextImg, flow, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, flags);
+
+        Mat prevImg, nextImg, flow;
+        {
+            QMutexLocker locker(&cacheLock);
+            if (cachedFrame.data && (cachedFrame.data == src[0].data) && (cachedFrame.size() == src[0].size()) && (cachedFrame.type() == src[0].type()))
+                prevImg = cachedGray;
+        }
+        if (!prevImg.data)
+            prevImg = prepare(src[0]);
+        nextImg = prepare(src[1]);
+        {
+            QMutexLocker locker(&cacheLock);
+            cachedFrame = src[1];
+            cachedGray = nextImg;
+        }
+
+        if (useGpu) {
+            QMutexLocker locker(&gpuLock);
+            gpu::GpuMat prev(prevImg), next(nextImg), flowX, flowY;
+            gpuFlow(prev, next, flowX, flowY);
+            std::vector<Mat> channels(2);
+            flowX.download(channels[0]);
+            flowY.download(channels[1]);
+            merge(channels, flow);
+        } else {
+            calcOpticalFlowFarneback(prevImg, nextImg, flow, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, flags);
+        }
+
+        if (scale != 1) {
+            Mat full;
+            resize(flow, full, src[1].size(), 0, 0, INTER_LINEAR);
+            flow = full / scale;
+        }
 
         if (useMagnitude) {
             // the result is two channels
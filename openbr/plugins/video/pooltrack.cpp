@@ -0,0 +1,178 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Reduces every track to one or a few templates, so a video enrolls per person rather than per detection.
+ *
+ * Templates are grouped by the TrackID set by TrackTransform, within each video.
+ * A track ends once it hasn't been seen for maxAge frames, by FrameNumber, or when the stream finishes,
+ * and is then replaced by its best keep templates by quality, or by the mean of its matrices.
+ * Only the candidates are held while a track is open, not the whole track.
+ * Templates without a TrackID pass through.
+ * Output templates carry TrackFrames, TrackBegin and TrackEnd, the number of frames in the track and its first and last FrameNumber.
+ * \br_property QString quality Metadata ranking the templates of a track, such as DFFS set by FaceQuality. Templates without it rank last. Default is DFFS.
+ * \br_property bool higherIsBetter Whether larger quality values are better, false for distances like DFFS. Default is false.
+ * \br_property int keep Templates kept per track in Select mode. Default is 1.
+ * \br_property Mode mode Select keeps the best templates, Mean pools the track into one template with the mean of every frame's last matrix. Default is Select.
+ * \br_property int maxAge Frames a track can go unseen before it is closed. Default is 30.
+ * \author Unknown \cite unknown
+ */
+class PoolTrackTransform : public TimeVaryingTransform
+{
+    Q_OBJECT
+    Q_ENUMS(Mode)
+    Q_PROPERTY(QString quality READ get_quality WRITE set_quality RESET reset_quality STORED false)
+    Q_PROPERTY(bool higherIsBetter READ get_higherIsBetter WRITE set_higherIsBetter RESET reset_higherIsBetter STORED false)
+    Q_PROPERTY(int keep READ get_keep WRITE set_keep RESET reset_keep STORED false)
+    Q_PROPERTY(Mode mode READ get_mode WRITE set_mode RESET reset_mode STORED false)
+    Q_PROPERTY(int maxAge READ get_maxAge WRITE set_maxAge RESET reset_maxAge STORED false)
+
+public:
+    enum Mode { Select,
+                Mean };
+
+private:
+    BR_PROPERTY(QString, quality, "DFFS")
+    BR_PROPERTY(bool, higherIsBetter, false)
+    BR_PROPERTY(int, keep, 1)
+    BR_PROPERTY(Mode, mode, Select)
+    BR_PROPERTY(int, maxAge, 30)
+
+    struct Track
+    {
+        QList< QPair<float, Template> > best; // Best first, at most keep in Select mode and the single best in Mean mode
+        Mat sum; // Of every frame's last matrix, in Mean mode
+        int frames, begin, end;
+        Track() : frames(0), begin(0), end(0) {}
+    };
+
+    QHash<QString, Track> tracks;
+    int frame; // Fallback clock for templates without a FrameNumber
+
+public:
+    PoolTrackTransform() : TimeVaryingTransform(false, false), frame(0) {}
+
+private:
+    void train(const TemplateList &data)
+    {
+        (void) data;
+    }
+
+    // Larger is better
+    float score(const Template &t) const
+    {
+        if (!t.file.contains(quality))
+            return -std::numeric_limits<float>::max();
+        const float value = t.file.get<float>(quality);
+        return higherIsBetter ? value : -value;
+    }
+
+    void add(Track &track, const Template &t, int frameNumber)
+    {
+        if (track.frames == 0) track.begin = frameNumber;
+        track.end = frameNumber;
+        track.frames++;
+
+        if (mode == Mean) {
+            Mat m;
+            t.m().convertTo(m, CV_32F);
+            if (!track.sum.data)                  track.sum = m;
+            else if (track.sum.size() == m.size()) track.sum += m;
+            else                                  qFatal("PoolTrack can only average matrices of one size.");
+        }
+
+        const int capacity = (mode == Mean) ? 1 : std::max(keep, 1);
+        const float s = score(t);
+        int i = 0;
+        while ((i < track.best.size()) && (track.best[i].first >= s))
+            i++;
+        if (i < capacity) {
+            track.best.insert(i, QPair<float, Template>(s, t));
+            while (track.best.size() > capacity)
+                track.best.removeLast();
+        }
+    }
+
+    void close(const Track &track, TemplateList &dst) const
+    {
+        for (int i=0; i<track.best.size(); i++) {
+            Template t = track.best[i].second;
+            if (mode == Mean)
+                t = Template(t.file, track.sum / track.frames);
+            t.file.set("TrackFrames", track.frames);
+            t.file.set("TrackBegin", track.begin);
+            t.file.set("TrackEnd", track.end);
+            dst.append(t);
+        }
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        int latest = frame;
+        foreach (const Template &t, src) {
+            const int frameNumber = t.file.get<int>("FrameNumber", frame);
+            latest = std::max(latest, frameNumber);
+            if (!t.file.contains("TrackID")) {
+                dst.append(t);
+                continue;
+            }
+            add(tracks[t.file.name + "#" + t.file.get<QString>("TrackID")], t, frameNumber);
+        }
+        frame = latest + 1;
+
+        // Close the tracks that ended
+        QMutableHashIterator<QString, Track> i(tracks);
+        while (i.hasNext()) {
+            i.next();
+            if (latest - i.value().end > maxAge) {
+                close(i.value(), dst);
+                i.remove();
+            }
+        }
+    }
+
+    void finalize(TemplateList &output)
+    {
+        foreach (const Track &track, tracks)
+            close(track, output);
+        tracks.clear();
+        frame = 0;
+    }
+
+    void store(QDataStream &stream) const
+    {
+        (void) stream;
+    }
+
+    void load(QDataStream &stream)
+    {
+        (void) stream;
+    }
+};
+
+BR_REGISTER(Transform, PoolTrackTransform)
+
+} // namespace br
+
+#include "video/pooltrack.moc"
@@ -0,0 +1,260 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/opencvutils.h>
+
+using namespace cv;
+
+namespace br
+{
+
+/*!
+ * \ingroup transforms
+ * \brief Runs a detector on keyframes and follows its detections with sparse optical flow in between.
+ *
+ * The detector runs every interval frames, whenever there is nothing to track, and whenever fewer than minFraction of a track's points can be followed.
+ * On the frames in between each track moves by the median flow of the corners found inside it, and scales by the median change in their pairwise distances.
+ * Every output template carries a TrackID, kept across keyframes by detections overlapping the track by more than overlap,
+ * and a TrackConfidence, the fraction of the track's corners followed into the frame or 1 on keyframes.
+ * Tracked templates copy the detector's Confidence and any metadata it set to the detected rect, such as FrontalFace for Cascade.
+ * \br_property br::Transform* transform The detector.
+ * \br_property int interval Frames between keyframes.
+ * \br_property int corners The number of corners followed in each track.
+ * \br_property float minFraction The fraction of a track's corners which must be followed, backward and forward, for the track to continue.
+ * \br_property float overlap Intersection over union a detection needs with a track to keep its TrackID.
+ * \br_paper Zdenek Kalal, Krystian Mikolajczyk, Jiri Matas
+ *           Forward-Backward Error: Automatic Detection of Tracking Failures
+ *           ICPR, 2010
+ * \author Unknown \cite unknown
+ */
+class TrackTransform : public TimeVaryingTransform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform STORED false)
+    Q_PROPERTY(int interval READ get_interval WRITE set_interval RESET reset_interval STORED false)
+    Q_PROPERTY(int corners READ get_corners WRITE set_corners RESET reset_corners STORED false)
+    Q_PROPERTY(float minFraction READ get_minFraction WRITE set_minFraction RESET reset_minFraction STORED false)
+    Q_PROPERTY(float overlap READ get_overlap WRITE set_overlap RESET reset_overlap STORED false)
+    BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(int, interval, 10)
+    BR_PROPERTY(int, corners, 25)
+    BR_PROPERTY(float, minFraction, 0.5)
+    BR_PROPERTY(float, overlap, 0.3)
+
+    struct Track
+    {
+        int id;
+        QRectF rect;
+        float confidence; // The detector's
+        float followed; // Fraction of the corners followed into the current frame
+        QStringList rectKeys; // Metadata the detector set to the rect
+    };
+
+    QList<Track> tracks;
+    Mat previous;
+    int sinceKeyframe, nextID;
+
+public:
+    TrackTransform() : TimeVaryingTransform(false, false), sinceKeyframe(0), nextID(0) {}
+
+private:
+    void init()
+    {
+        if (!transform)
+            qFatal("Track requires a detector.");
+        trainable = transform->trainable;
+    }
+
+    void train(const TemplateList &data)
+    {
+        transform->train(data);
+    }
+
+    static float intersectionOverUnion(const QRectF &a, const QRectF &b)
+    {
+        const QRectF intersection = a & b;
+        const float area = intersection.width() * intersection.height();
+        return area / (a.width()*a.height() + b.width()*b.height() - area);
+    }
+
+    static float median(std::vector<float> values)
+    {
+        std::nth_element(values.begin(), values.begin() + values.size()/2, values.end());
+        return values[values.size()/2];
+    }
+
+    // Moves every track to the next frame, false if any of them was lost
+    bool follow(const Mat &next)
+    {
+        std::vector<Point2f> points;
+        QList<int> begins;
+        foreach (const Track &track, tracks) {
+            begins.append(points.size());
+            const Rect rect = OpenCVUtils::toRect(track.rect) & Rect(0, 0, previous.cols, previous.rows);
+            if (rect.area() == 0)
+                return false;
+
+            std::vector<Point2f> trackPoints;
+            goodFeaturesToTrack(previous(rect), trackPoints, corners, 0.01, 2);
+            if (trackPoints.size() < 2)
+                return false;
+            for (size_t i=0; i<trackPoints.size(); i++)
+                points.push_back(trackPoints[i] + Point2f(rect.x, rect.y));
+        }
+        begins.append(points.size());
+
+        // Forward then backward, every track at once so the pyramids are built once
+        std::vector<Point2f> forward, backward;
+        std::vector<uchar> forwardStatus, backwardStatus;
+        std::vector<float> errors;
+        calcOpticalFlowPyrLK(previous, next, points, forward, forwardStatus, errors);
+        calcOpticalFlowPyrLK(next, previous, forward, backward, backwardStatus, errors);
+
+        for (int t=0; t<tracks.size(); t++) {
+            std::vector<int> followed;
+            std::vector<float> backwardErrors;
+            for (int i=begins[t]; i<begins[t+1]; i++)
+                if (forwardStatus[i] && backwardStatus[i])
+                    backwardErrors.push_back(norm(backward[i] - points[i]));
+            if (backwardErrors.empty())
+                return false;
+
+            // The points with at most the median forward-backward error, or within a pixel
+            const float maxError = std::max(median(backwardErrors), 1.f);
+            for (int i=begins[t]; i<begins[t+1]; i++)
+                if (forwardStatus[i] && backwardStatus[i] && (norm(backward[i] - points[i]) <= maxError))
+                    followed.push_back(i);
+            if ((followed.size() < 2) || (followed.size() < minFraction * (begins[t+1] - begins[t])))
+                return false;
+
+            std::vector<float> dx, dy, scales;
+            for (size_t i=0; i<followed.size(); i++) {
+                dx.push_back(forward[followed[i]].x - points[followed[i]].x);
+                dy.push_back(forward[followed[i]].y - points[followed[i]].y);
+                for (size_t j=i+1; j<followed.size(); j++) {
+                    const float before = norm(points[followed[i]] - points[followed[j]]);
+                    if (before > 0)
+                        scales.push_back(norm(forward[followed[i]] - forward[followed[j]]) / before);
+                }
+            }
+
+            tracks[t].followed = float(followed.size()) / (begins[t+1] - begins[t]);
+            QRectF &rect = tracks[t].rect;
+            const float scale = scales.empty() ? 1 : median(scales);
+            const QPointF center = rect.center() + QPointF(median(dx), median(dy));
+            rect.setSize(rect.size() * scale);
+            rect.moveCenter(center);
+        }
+        return true;
+    }
+
+    void detect(const Template &src, TemplateList &dst)
+    {
+        TemplateList detections;
+        transform->project(TemplateList() << src, detections);
+
+        QList<Track> previousTracks = tracks;
+        tracks.clear();
+        foreach (Template detection, detections) {
+            if (detection.file.rects().isEmpty())
+                continue;
+
+            Track track;
+            track.rect = detection.file.rects().last();
+            track.confidence = detection.file.get<float>("Confidence", 1);
+            track.followed = 1;
+            foreach (const QString &key, detection.file.localKeys())
+                if (!src.file.contains(key) && (detection.file.value(key).type() == QVariant::RectF) && (detection.file.get<QRectF>(key) == track.rect))
+                    track.rectKeys.append(key);
+
+            // Continue the previous track overlapping the most
+            int best = -1;
+            float bestOverlap = overlap;
+            for (int i=0; i<previousTracks.size(); i++) {
+                const float trackOverlap = intersectionOverUnion(track.rect, previousTracks[i].rect);
+                if (trackOverlap > bestOverlap) {
+                    best = i;
+                    bestOverlap = trackOverlap;
+                }
+            }
+            track.id = best >= 0 ? previousTracks.takeAt(best).id : nextID++;
+            tracks.append(track);
+
+            detection.file.set("TrackID", track.id);
+            detection.file.set("TrackConfidence", 1);
+            dst.append(detection);
+        }
+    }
+
+    void projectUpdate(const TemplateList &src, TemplateList &dst)
+    {
+        foreach (const Template &t, src) {
+            Mat next;
+            if (t.m().channels() == 1) next = t.m();
+            else                       OpenCVUtils::cvtGray(t.m(), next);
+
+            const bool keyframe = tracks.isEmpty() || (sinceKeyframe + 1 >= interval) || (previous.size() != next.size()) || !follow(next);
+            previous = next;
+
+            if (keyframe) {
+                detect(t, dst);
+                sinceKeyframe = 0;
+                continue;
+            }
+            sinceKeyframe++;
+
+            foreach (const Track &track, tracks) {
+                Template u = t;
+                u.file.appendRect(track.rect);
+                foreach (const QString &key, track.rectKeys)
+                    u.file.set(key, track.rect);
+                u.file.set("Confidence", track.confidence);
+                u.file.set("TrackID", track.id);
+                u.file.set("TrackConfidence", track.followed);
+                dst.append(u);
+            }
+        }
+    }
+
+    void finalize(TemplateList &output)
+    {
+        (void) output;
+        tracks.clear();
+        previous.release();
+        sinceKeyframe = 0;
+    }
+
+    void store(QDataStream &stream) const
+    {
+        transform->store(stream);
+    }
+
+    void load(QDataStream &stream)
+    {
+        transform->load(stream);
+    }
+};
+
+BR_REGISTER(Transform, TrackTransform)
+
+} // namespace br
+
+#include "video/track.moc"
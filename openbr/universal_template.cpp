@@ -2,7 +2,9 @@
 #include <QFutureSynchronizer>
 #include <QMutex>
 #include <QMutexLocker>
+#include <QThread>
 #include <QtConcurrent>
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 
@@ -75,9 +77,69 @@ static bool read_buffer(FILE *file, char *buffer, size_t bytes)
     return true;
 }
 
+static void iterateChunk(br_const_utemplate begin, br_const_utemplate end, br_utemplate_callback callback, br_callback_context context)
+{
+    br_iterate_utemplates(begin, end, callback, context);
+}
+
+// Iterates over a mapping of the rest of the file, returns false if the file can't be mapped
+static bool iterate_mapped(FILE *file, br_utemplate_callback callback, br_callback_context context, bool parallel, int *count)
+{
+    QFile mapped;
+    if (!mapped.open(file, QFile::ReadOnly, QFile::DontCloseHandle) || mapped.isSequential())
+        return false;
+
+    const qint64 offset = ftell(file);
+    const qint64 size = mapped.size() - offset;
+    if ((offset < 0) || (size < 0))
+        return false;
+    if (size == 0) {
+        *count = 0;
+        return true;
+    }
+
+    const char *data = reinterpret_cast<const char*>(mapped.map(offset, size));
+    if (!data)
+        return false;
+
+    // Find the template boundaries, a trailing partial template is left unread like in the buffered case
+    QVector<br_const_utemplate> templates;
+    qint64 position = 0;
+    while (position + qint64(sizeof(br_universal_template)) <= size) {
+        br_const_utemplate t = reinterpret_cast<br_const_utemplate>(data + position);
+        const qint64 next = position + sizeof(br_universal_template) + t->mdSize + t->fvSize;
+        if (next > size)
+            break;
+        templates.append(t);
+        position = next;
+    }
+    const br_const_utemplate end = reinterpret_cast<br_const_utemplate>(data + position);
+    templates.append(end);
+
+    *count = templates.size() - 1;
+    if (parallel && (*count > 1)) {
+        // Contiguous chunks of templates rather than one task per template
+        const int chunks = std::min(*count, 4 * std::max(1, QThread::idealThreadCount()));
+        QFutureSynchronizer<void> futures;
+        for (int i=0; i<chunks; i++)
+            futures.addFuture(QtConcurrent::run(iterateChunk, templates[qint64(i) * *count / chunks], templates[qint64(i+1) * *count / chunks], callback, context));
+        futures.waitForFinished();
+    } else {
+        br_iterate_utemplates(templates.first(), end, callback, context);
+    }
+
+    // Leave the file positioned after the last complete template
+    if (fseek(file, offset + position, SEEK_SET))
+        qFatal("Unable to seek past iterated templates!");
+    return true;
+}
+
 int br_iterate_utemplates_file(FILE *file, br_utemplate_callback callback, br_callback_context context, bool parallel)
 {
     int count = 0;
+    if (iterate_mapped(file, callback, context, parallel, &count))
+        return count;
+
     QFutureSynchronizer<void> futures;
     while (true) {
         br_utemplate t = (br_utemplate) malloc(sizeof(br_universal_template));
@@ -85,6 +85,9 @@ BR_EXPORT void br_iterate_utemplates(br_const_utemplate begin, br_const_utemplat
 
 /*!
  * \brief Iterate over br_universal_template in a file.
+ *
+ * Regular files are memory-mapped, and callbacks receive templates that point into the mapping.
+ * If \em parallel is set, contiguous chunks of templates are dispatched to the thread pool.
  * \return The number of templates iterated
  * \see br_iterate_utemplates
  */
@@ -212,6 +212,12 @@ def init_brpy(br_loc='/usr/local/lib'):
     br.br_img_is_empty.argtypes = [c_void_p]
     br.br_img_is_empty.restype = c_bool
 
+    br.br_img_depth.argtypes = [c_void_p]
+    br.br_img_depth.restype = c_int
+
+    br.br_img_step.argtypes = [c_void_p]
+    br.br_img_step.restype = c_int
+
     br.br_get_filename.argtypes = [c_char_p, c_int, c_void_p]
     br.br_get_filename.restype = c_int
     br.br_get_filename = _handle_string_func(br.br_get_filename)
@@ -234,12 +240,27 @@ def init_brpy(br_loc='/usr/local/lib'):
     br.br_get_matrix_output_at.argtypes = [c_void_p, c_int, c_int]
     br.br_get_matrix_output_at.restype = c_float
 
+    br.br_get_matrix_output_data.argtypes = [c_void_p]
+    br.br_get_matrix_output_data.restype = POINTER(c_float)
+
+    br.br_matrix_output_rows.argtypes = [c_void_p]
+    br.br_matrix_output_rows.restype = c_int
+
+    br.br_matrix_output_cols.argtypes = [c_void_p]
+    br.br_matrix_output_cols.restype = c_int
+
     br.br_get_template.argtypes = [c_void_p, c_int]
     br.br_get_template.restype = c_void_p
 
     br.br_num_templates.argtypes = [c_void_p]
     br.br_num_templates.restype = c_int
 
+    br.br_template_list_feature_size.argtypes = [c_void_p]
+    br.br_template_list_feature_size.restype = c_int
+
+    br.br_template_list_features.argtypes = [c_void_p, POINTER(c_float)]
+    br.br_template_list_features.restype = c_bool
+
     br.br_make_gallery.argtypes = [c_char_p]
     br.br_make_gallery.restype = c_void_p
 
@@ -252,4 +273,61 @@ def init_brpy(br_loc='/usr/local/lib'):
 
     br.br_close_gallery.argtypes = [c_void_p]
 
+    br.img_array = lambda tmpl: img_array(br, tmpl)
+    br.matrix_output_array = lambda output: matrix_output_array(br, output)
+    br.load_features = lambda gallery: load_features(br, gallery)
+
     return br
+
+# numpy views over openbr memory, numpy is only needed if these are used.
+# A view shares memory with the template or output it came from and is
+# only valid until that template or output is freed.
+
+# numpy dtypes of the OpenCV depths CV_8U through CV_64F
+_depth_dtypes = ['uint8', 'int8', 'uint16', 'int16', 'int32', 'float32', 'float64']
+
+def img_array(br, tmpl):
+    '''
+    Returns a numpy array viewing the pixels of a template's image
+    without copying them, shaped (rows, cols, channels).
+    '''
+    import numpy as np
+    if br.br_img_is_empty(tmpl):
+        return np.empty((0, 0, 0), dtype='uint8')
+    rows, cols, channels = br.br_img_rows(tmpl), br.br_img_cols(tmpl), br.br_img_channels(tmpl)
+    dtype = np.dtype(_depth_dtypes[br.br_img_depth(tmpl)])
+    step = br.br_img_step(tmpl)
+    data = br.br_unload_img(tmpl)
+    buf = (c_ubyte * (step * rows)).from_address(addressof(data.contents))
+    return np.ndarray((rows, cols, channels), dtype=dtype, buffer=buf,
+                      strides=(step, channels * dtype.itemsize, dtype.itemsize))
+
+def matrix_output_array(br, output):
+    '''
+    Returns a numpy array viewing the scores of a br_matrix_output
+    without copying them, shaped (queries, targets).
+    '''
+    import numpy as np
+    rows, cols = br.br_matrix_output_rows(output), br.br_matrix_output_cols(output)
+    if rows * cols == 0:
+        return np.empty((rows, cols), dtype='float32')
+    return np.ctypeslib.as_array(br.br_get_matrix_output_data(output), shape=(rows, cols))
+
+def load_features(br, gallery):
+    '''
+    Loads the feature vectors of a gallery file into a float32 numpy
+    array with one row per template, in a single call into openbr.
+    '''
+    import numpy as np
+    gal = br.br_make_gallery(gallery)
+    tl = br.br_load_from_gallery(gal)
+    try:
+        size = br.br_template_list_feature_size(tl)
+        if size < 0 and br.br_num_templates(tl) > 0:
+            raise ValueError('Templates in %s differ in size' % gallery)
+        features = np.empty((br.br_num_templates(tl), max(size, 0)), dtype='float32')
+        br.br_template_list_features(tl, features.ctypes.data_as(POINTER(c_float)))
+        return features
+    finally:
+        br.br_free_template_list(tl)
+        br.br_close_gallery(gal)